@@ -0,0 +1,31 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/utils/base64.hpp>
+
+#include <oxenc/base64.h>
+
+#include <random>
+#include <string>
+
+using namespace oxen;
+
+TEST_CASE("base64 - message encoding and decoding", "[base64]") {
+    INFO("accelerated: " << util::base64_accelerated());
+    std::mt19937_64 rng{12345};
+
+    // A short message, a typical message, and a maximum-size (76800 byte) message
+    for (size_t size : {100, 5000, 76800}) {
+        std::string data(size, '\0');
+        for (auto& c : data)
+            c = static_cast<char>(rng());
+        const auto encoded = oxenc::to_base64(data);
+        const auto n = std::to_string(size);
+
+        BENCHMARK("oxenc::to_base64 " + n) { return oxenc::to_base64(data); };
+        BENCHMARK("util::base64_encode " + n) { return util::base64_encode(data); };
+        BENCHMARK("oxenc::from_base64 " + n) {
+            return oxenc::is_base64(encoded) ? oxenc::from_base64(encoded) : "";
+        };
+        BENCHMARK("util::base64_decode " + n) { return util::base64_decode(encoded); };
+    }
+}
@@ -0,0 +1,46 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/crypto/channel_encryption.hpp>
+#include <oxenss/crypto/keys.h>
+
+#include <sodium/crypto_box.h>
+
+#include <random>
+#include <string>
+
+using namespace oxen;
+using namespace oxen::crypto;
+
+namespace {
+
+x25519_keypair random_keypair() {
+    x25519_pubkey pk;
+    x25519_seckey sk;
+    crypto_box_keypair(pk.data(), sk.data());
+    return {pk, sk};
+}
+
+}  // namespace
+
+TEST_CASE("encryption - onion request channel encryption", "[encrypt]") {
+    std::mt19937_64 rng{12345};
+    auto [server_pk, server_sk] = random_keypair();
+    auto [client_pk, client_sk] = random_keypair();
+    ChannelEncryption server{server_sk, server_pk};
+    ChannelEncryption client{client_sk, client_pk, false};
+
+    // A typical onion request payload and a maximum-size store request
+    for (size_t size : {1000, 100'000}) {
+        std::string plaintext(size, '\0');
+        for (auto& c : plaintext)
+            c = static_cast<char>(rng());
+
+        for (auto type : {EncryptType::aes_cbc, EncryptType::aes_gcm, EncryptType::xchacha20}) {
+            const auto name = std::string{to_string(type)} + " " + std::to_string(size);
+            auto ciphertext = client.encrypt(type, plaintext, server_pk);
+
+            BENCHMARK("decrypt " + name) { return server.decrypt(type, ciphertext, client_pk); };
+            BENCHMARK("encrypt " + name) { return server.encrypt(type, plaintext, client_pk); };
+        }
+    }
+}
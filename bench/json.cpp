@@ -0,0 +1,65 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/rpc/json_parse.h>
+
+#include <oxenc/base64.h>
+#include <oxenc/hex.h>
+
+#include <random>
+#include <string>
+
+using namespace oxen;
+using nlohmann::json;
+
+namespace {
+
+std::string random_bytes(std::mt19937_64& rng, size_t size) {
+    std::string data(size, '\0');
+    for (auto& c : data)
+        c = static_cast<char>(rng());
+    return data;
+}
+
+// A json store request carrying a maximum-size (76800 byte) message
+std::string store_body(std::mt19937_64& rng) {
+    return json{{"method", "store"},
+                {"params",
+                 {{"pubkey", "05" + oxenc::to_hex(random_bytes(rng, 32))},
+                  {"namespace", 42},
+                  {"timestamp", 1690000000000},
+                  {"ttl", 1209600000},
+                  {"data", oxenc::to_base64(random_bytes(rng, 76800))},
+                  {"signature", oxenc::to_base64(random_bytes(rng, 64))}}}}
+            .dump();
+}
+
+// A json batch of 20 signed retrieves, as a client polling several namespaces would send
+std::string batch_body(std::mt19937_64& rng) {
+    json reqs = json::array();
+    for (int i = 0; i < 20; i++)
+        reqs.push_back(
+                {{"method", "retrieve"},
+                 {"params",
+                  {{"pubkey", "05" + oxenc::to_hex(random_bytes(rng, 32))},
+                   {"namespace", i},
+                   {"last_hash", oxenc::to_base64(random_bytes(rng, 32)).substr(0, 43)},
+                   {"timestamp", 1690000000000 + i},
+                   {"signature", oxenc::to_base64(random_bytes(rng, 64))}}}});
+    return json{{"method", "batch"}, {"params", {{"requests", std::move(reqs)}}}}.dump();
+}
+
+}  // namespace
+
+TEST_CASE("json - request body parsing", "[json]") {
+    std::mt19937_64 rng{12345};
+
+    const auto store = store_body(rng);
+    const auto batch = batch_body(rng);
+    REQUIRE(rpc::parse_json(store) == json::parse(store));
+    REQUIRE(rpc::parse_json(batch) == json::parse(batch));
+
+    BENCHMARK("nlohmann store") { return json::parse(store); };
+    BENCHMARK("rpc::parse_json store") { return rpc::parse_json(store); };
+    BENCHMARK("nlohmann batch") { return json::parse(batch); };
+    BENCHMARK("rpc::parse_json batch") { return rpc::parse_json(batch); };
+}
@@ -0,0 +1,13 @@
+#define CATCH_CONFIG_RUNNER
+#include <catch2/catch.hpp>
+
+// Microbenchmarks for hot paths in the storage server.  Run with `./bench` to run them all, or
+// `./bench '[swarm]'` (or some other tag) to run just a subset; see `./bench --help` for the other
+// Catch2 options (such as `--benchmark-samples`).
+//
+// For comparing results between releases, `./bench -r xml -o results.xml` writes each benchmark's
+// mean, standard deviation and outlier counts in machine-readable form.
+
+int main(int argc, char* argv[]) {
+    return Catch::Session().run(argc, argv);
+}
@@ -0,0 +1,50 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/crypto/keys.h>
+#include <oxenss/rpc/rate_limiter.h>
+
+#include <oxenmq/oxenmq.h>
+
+#include <array>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace oxen;
+
+TEST_CASE("rate limiter - client and snode lookups", "[ratelim]") {
+    oxenmq::OxenMQ omq;
+    rpc::RateLimiter limiter{omq};
+    std::mt19937_64 rng{12345};
+
+    // Many distinct clients, as on a busy node
+    std::vector<uint32_t> ipv4s(10'000);
+    for (auto& ip : ipv4s)
+        ip = static_cast<uint32_t>(rng());
+    std::vector<std::array<unsigned char, 16>> ipv6s(10'000);
+    for (auto& ip : ipv6s)
+        for (auto& b : ip)
+            b = static_cast<unsigned char>(rng());
+    std::vector<crypto::legacy_pubkey> snodes(1'500);
+    for (auto& pk : snodes)
+        for (auto& b : pk)
+            b = static_cast<unsigned char>(rng());
+
+    size_t i = 0;
+    auto now = std::chrono::steady_clock::now();
+    BENCHMARK("should_rate_limit_client (ipv4)") {
+        return limiter.should_rate_limit_client(ipv4s[i++ % ipv4s.size()], now);
+    };
+    BENCHMARK("should_rate_limit_client_v6") {
+        return limiter.should_rate_limit_client_v6(ipv6s[i++ % ipv6s.size()], now);
+    };
+    BENCHMARK("should_rate_limit (snode)") {
+        return limiter.should_rate_limit(snodes[i++ % snodes.size()], now);
+    };
+
+    // The same client over and over, i.e. a client that is being rate limited
+    BENCHMARK("should_rate_limit_client (one client)") {
+        return limiter.should_rate_limit_client(ipv4s[0], now);
+    };
+}
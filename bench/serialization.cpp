@@ -0,0 +1,83 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/rpc/request_handler.h>
+#include <oxenss/snode/serialization.h>
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace oxen;
+using namespace std::literals;
+
+namespace {
+
+std::string random_bytes(std::mt19937_64& rng, size_t size) {
+    std::string data(size, '\0');
+    for (auto& c : data)
+        c = static_cast<char>(rng());
+    return data;
+}
+
+user_pubkey_t random_pubkey(std::mt19937_64& rng) {
+    user_pubkey_t pk;
+    pk.load("\x05" + random_bytes(rng, 32));
+    return pk;
+}
+
+// A bootstrap/swarm sync sized batch of `n` messages spread across `accounts` accounts
+std::vector<message> random_messages(std::mt19937_64& rng, size_t n, size_t accounts) {
+    std::vector<user_pubkey_t> pks;
+    for (size_t i = 0; i < accounts; i++)
+        pks.push_back(random_pubkey(rng));
+    auto now = std::chrono::time_point_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now());
+    std::vector<message> msgs;
+    msgs.reserve(n);
+    for (size_t i = 0; i < n; i++)
+        msgs.emplace_back(
+                pks[i % accounts],
+                random_bytes(rng, 32),
+                namespace_id::Default,
+                now,
+                now + 14 * 24h,
+                random_bytes(rng, 500));
+    return msgs;
+}
+
+}  // namespace
+
+TEST_CASE("serialization - message batches", "[serialization]") {
+    std::mt19937_64 rng{12345};
+    auto msgs = random_messages(rng, 1000, 100);
+
+    for (auto version :
+         {snode::SERIALIZATION_VERSION_BT, snode::SERIALIZATION_VERSION_GROUPED}) {
+        const auto v = "v" + std::to_string(version);
+        BENCHMARK("serialize_messages " + v) {
+            return snode::serialize_messages(msgs.begin(), msgs.end(), version);
+        };
+
+        auto serialized = snode::serialize_messages(msgs.begin(), msgs.end(), version);
+        BENCHMARK("deserialize_messages " + v) {
+            size_t count = 0;
+            for (auto& s : serialized)
+                count += snode::deserialize_messages(s).size();
+            return count;
+        };
+    }
+}
+
+TEST_CASE("serialization - message hashing", "[serialization][hash]") {
+    std::mt19937_64 rng{12345};
+    auto pk = random_pubkey(rng);
+
+    // A typical message and a maximum-size (76800 byte) message
+    for (size_t size : {500, 76800}) {
+        auto data = random_bytes(rng, size);
+        BENCHMARK("computeMessageHash " + std::to_string(size)) {
+            return rpc::computeMessageHash(pk, namespace_id::Default, data);
+        };
+    }
+}
@@ -0,0 +1,96 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/crypto/keys.h>
+
+#include <oxenmq/batch.h>
+#include <oxenmq/oxenmq.h>
+#include <sodium/crypto_sign.h>
+
+#include <array>
+#include <future>
+#include <string>
+#include <vector>
+
+using namespace oxen;
+
+namespace {
+
+struct signed_request {
+    std::array<unsigned char, 32> pubkey;
+    std::string msg;
+    std::array<unsigned char, 64> sig;
+};
+
+// Builds `n` retrieve-like signed requests, each from a different account
+std::vector<signed_request> make_requests(size_t n) {
+    std::vector<signed_request> reqs(n);
+    std::array<unsigned char, 64> sk;
+    for (size_t i = 0; i < n; i++) {
+        auto& r = reqs[i];
+        crypto_sign_keypair(r.pubkey.data(), sk.data());
+        r.msg = "retrieve" + std::to_string(1700000000000 + i);
+        crypto_sign_detached(
+                r.sig.data(),
+                nullptr,
+                reinterpret_cast<const unsigned char*>(r.msg.data()),
+                r.msg.size(),
+                sk.data());
+    }
+    return reqs;
+}
+
+bool verify(const signed_request& r) {
+    return 0 == crypto_sign_verify_detached(
+                        r.sig.data(),
+                        reinterpret_cast<const unsigned char*>(r.msg.data()),
+                        r.msg.size(),
+                        r.pubkey.data());
+}
+
+}  // namespace
+
+TEST_CASE("signatures - single verification", "[signature]") {
+    auto reqs = make_requests(1);
+    BENCHMARK("verify") { return verify(reqs[0]); };
+
+    // A subkey-signed request additionally has to derive the verification key first
+    std::array<unsigned char, 32> subkey;
+    subkey.fill(0x42);
+    BENCHMARK("subkey_verify_key") {
+        return crypto::subkey_verify_key(reqs[0].pubkey.data(), subkey.data());
+    };
+    BENCHMARK("cached_subkey_verify_key") {
+        return crypto::cached_subkey_verify_key(reqs[0].pubkey.data(), subkey.data());
+    };
+}
+
+TEST_CASE("signatures - batch subrequest verification", "[signature]") {
+    oxenmq::OxenMQ omq;
+    omq.start();
+
+    // A small batch, a typical multi-namespace retrieve batch, and a maximum size batch
+    for (size_t n : {4, 10, 20}) {
+        auto reqs = make_requests(n);
+        const auto count = std::to_string(n);
+
+        BENCHMARK("sequential " + count) {
+            bool good = true;
+            for (auto& r : reqs)
+                good &= verify(r);
+            return good;
+        };
+
+        BENCHMARK("oxenmq batch " + count) {
+            std::vector<char> results(reqs.size());
+            std::promise<void> done;
+            oxenmq::Batch<void> batch;
+            batch.reserve(reqs.size());
+            for (size_t i = 0; i < reqs.size(); i++)
+                batch.add_job([&, i] { results[i] = verify(reqs[i]); });
+            batch.completion([&](auto&&) { done.set_value(); });
+            omq.batch(std::move(batch));
+            done.get_future().wait();
+            return results;
+        };
+    }
+}
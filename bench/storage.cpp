@@ -0,0 +1,163 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/storage/database.hpp>
+
+#include <chrono>
+#include <filesystem>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace oxen;
+using namespace std::literals;
+
+namespace {
+
+// A moderately busy node: 50k stored messages across 5k accounts
+constexpr size_t NUM_ACCOUNTS = 5'000;
+constexpr size_t NUM_MESSAGES = 50'000;
+// Typical (non-attachment) Session message size
+constexpr size_t MESSAGE_SIZE = 500;
+
+struct bench_db {
+    std::filesystem::path dir;
+    std::optional<Database> db;
+
+    bench_db() {
+        dir = std::filesystem::temp_directory_path() /
+              ("oxenss-bench-" + std::to_string(std::random_device{}()));
+        std::filesystem::create_directories(dir);
+        db.emplace(dir);
+    }
+    ~bench_db() {
+        db.reset();
+        std::error_code ec;
+        std::filesystem::remove_all(dir, ec);
+    }
+};
+
+user_pubkey_t random_pubkey(std::mt19937_64& rng) {
+    std::string raw(33, '\x05');
+    for (size_t i = 1; i < raw.size(); i++)
+        raw[i] = static_cast<char>(rng());
+    user_pubkey_t pk;
+    pk.load(raw);
+    return pk;
+}
+
+std::string random_hash(std::mt19937_64& rng) {
+    static constexpr auto chars =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"sv;
+    std::string hash(43, 'A');
+    for (auto& c : hash)
+        c = chars[rng() % chars.size()];
+    return hash;
+}
+
+message random_message(
+        std::mt19937_64& rng,
+        const user_pubkey_t& pk,
+        std::chrono::system_clock::time_point now,
+        std::chrono::milliseconds ttl = 14 * 24h) {
+    std::string data(MESSAGE_SIZE, '\0');
+    for (auto& c : data)
+        c = static_cast<char>(rng());
+    auto ts = std::chrono::time_point_cast<std::chrono::milliseconds>(now);
+    return {pk, random_hash(rng), namespace_id::Default, ts, ts + ttl, std::move(data)};
+}
+
+// Fills the database, returning the accounts and the hash of each account's most recent message
+std::vector<std::pair<user_pubkey_t, std::string>> populate(Database& db, std::mt19937_64& rng) {
+    std::vector<std::pair<user_pubkey_t, std::string>> accounts;
+    accounts.reserve(NUM_ACCOUNTS);
+    for (size_t i = 0; i < NUM_ACCOUNTS; i++)
+        accounts.emplace_back(random_pubkey(rng), "");
+
+    auto now = std::chrono::system_clock::now();
+    std::vector<message> msgs;
+    msgs.reserve(NUM_MESSAGES);
+    for (size_t i = 0; i < NUM_MESSAGES; i++) {
+        auto& [pk, last] = accounts[i % NUM_ACCOUNTS];
+        auto& m = msgs.emplace_back(random_message(rng, pk, now + std::chrono::milliseconds(i)));
+        last = m.hash;
+    }
+    db.bulk_store(msgs);
+    return accounts;
+}
+
+}  // namespace
+
+TEST_CASE("storage - message storage and retrieval", "[storage]") {
+    std::mt19937_64 rng{12345};
+    bench_db b;
+    auto& db = *b.db;
+    auto accounts = populate(db, rng);
+
+    size_t i = 0;
+    auto now = std::chrono::system_clock::now();
+    BENCHMARK("store") {
+        return db.store(random_message(rng, accounts[i++ % NUM_ACCOUNTS].first, now));
+    };
+
+    BENCHMARK("bulk_store 100") {
+        std::vector<message> msgs;
+        msgs.reserve(100);
+        for (int j = 0; j < 100; j++)
+            msgs.push_back(random_message(rng, accounts[i++ % NUM_ACCOUNTS].first, now));
+        db.bulk_store(msgs);
+        return msgs.size();
+    };
+
+    // The most common request: a poll that has already seen everything
+    BENCHMARK("retrieve (up to date)") {
+        auto& [pk, last] = accounts[i++ % NUM_ACCOUNTS];
+        return db.retrieve(pk, namespace_id::Default, last).first.size();
+    };
+
+    BENCHMARK("retrieve (everything)") {
+        auto& [pk, last] = accounts[i++ % NUM_ACCOUNTS];
+        return db.retrieve(pk, namespace_id::Default, "").first.size();
+    };
+}
+
+TEST_CASE("storage - bulk ingest", "[storage]") {
+    // Bootstrapping a new swarm member, or a large push batch: 100k messages into an empty
+    // database.  Each pass takes long enough that Catch2 times just one bulk_store per sample (any
+    // further runs in a sample would be storing duplicates).
+    constexpr size_t INGEST_MESSAGES = 100'000;
+    std::mt19937_64 rng{12345};
+    std::vector<user_pubkey_t> accounts;
+    for (size_t i = 0; i < NUM_ACCOUNTS; i++)
+        accounts.push_back(random_pubkey(rng));
+    auto now = std::chrono::system_clock::now();
+    std::vector<message> msgs;
+    msgs.reserve(INGEST_MESSAGES);
+    for (size_t i = 0; i < INGEST_MESSAGES; i++)
+        msgs.push_back(random_message(rng, accounts[i % NUM_ACCOUNTS], now));
+
+    BENCHMARK_ADVANCED("bulk_store 100k")(Catch::Benchmark::Chronometer meter) {
+        bench_db b;
+        meter.measure([&] { b.db->bulk_store(msgs); });
+    };
+}
+
+TEST_CASE("storage - expiry", "[storage]") {
+    std::mt19937_64 rng{12345};
+    bench_db b;
+    auto& db = *b.db;
+    auto accounts = populate(db, rng);
+
+    // Each pass removes a fresh batch of already-expired messages from the full database.  This
+    // takes milliseconds, so Catch2 times a single pass per sample (with any further runs in a
+    // sample timing a pass with nothing to do).
+    BENCHMARK_ADVANCED("clean_expired 1000")(Catch::Benchmark::Chronometer meter) {
+        auto past = std::chrono::system_clock::now() - 1h;
+        std::vector<message> msgs;
+        msgs.reserve(1000);
+        for (size_t j = 0; j < 1000; j++)
+            msgs.push_back(random_message(rng, accounts[j % NUM_ACCOUNTS].first, past, 1min));
+        db.bulk_store(msgs);
+        meter.measure([&] { db.clean_expired(); });
+    };
+}
@@ -0,0 +1,60 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/snode/swarm.h>
+
+#include <algorithm>
+#include <random>
+
+using namespace oxen;
+using namespace oxen::snode;
+
+namespace {
+
+// Roughly the size of the current network: ~1500 nodes in ~300 swarms
+constexpr size_t NUM_SWARMS = 300;
+constexpr size_t NUM_LOOKUPS = 1000;
+
+std::vector<SwarmInfo> random_swarms(std::mt19937_64& rng) {
+    std::vector<SwarmInfo> swarms;
+    swarms.reserve(NUM_SWARMS);
+    for (size_t i = 0; i < NUM_SWARMS; i++)
+        swarms.push_back({rng(), std::vector<sn_record>(5)});
+    std::sort(swarms.begin(), swarms.end());
+    return swarms;
+}
+
+std::vector<user_pubkey_t> random_pubkeys(std::mt19937_64& rng) {
+    std::vector<user_pubkey_t> pks(NUM_LOOKUPS);
+    std::string raw(33, '\x05');
+    for (auto& pk : pks) {
+        for (size_t i = 1; i < raw.size(); i++)
+            raw[i] = static_cast<char>(rng());
+        pk.load(raw);
+    }
+    return pks;
+}
+
+}  // namespace
+
+TEST_CASE("swarm - pubkey to swarm lookup", "[swarm]") {
+    std::mt19937_64 rng{12345};
+    auto swarms = random_swarms(rng);
+    auto pks = random_pubkeys(rng);
+
+    BENCHMARK("get_swarm_by_pk") {
+        uint64_t sum = 0;
+        for (auto& pk : pks)
+            sum += get_swarm_by_pk(swarms, pk)->swarm_id;
+        return sum;
+    };
+
+    SwarmLookup lookup{swarms};
+    BENCHMARK("SwarmLookup::find") {
+        uint64_t sum = 0;
+        for (auto& pk : pks)
+            sum += swarms[lookup.find(pubkey_to_swarm_space(pk))].swarm_id;
+        return sum;
+    };
+
+    BENCHMARK("SwarmLookup construction") { return SwarmLookup{swarms}; };
+}
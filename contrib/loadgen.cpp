@@ -0,0 +1,501 @@
+// Load generator for end-to-end throughput testing of a single storage server.
+//
+// Runs a number of concurrent HTTPS and/or OMQ clients against one node for a fixed duration.  Each
+// client sends (and waits for) one request after another, picking each from a weighted mix of
+// store, retrieve, batch, expire_msgs and onion requests, signed with generated account keys.
+// Once done it reports throughput and latency percentiles per request type.
+//
+// Build with `make loadgen` (from the build directory); run with `--help` for the options.  For
+// example, against a local testnet node:
+//
+//     contrib/loadgen --https 127.0.0.1:22021 --omq 127.0.0.1:22020 --x25519 PUBKEY \
+//         --https-clients 50 --omq-clients 50 --duration 60 --mix store=3,retrieve=6,onion=1
+//
+// Batch requests default to a store and a retrieve; `--batch-size` makes them bigger, mixing in
+// more stores, retrieves and expiries (e.g. `--mix batch=1 --batch-size 20` for nothing but full
+// size mixed batches, like those of network-tests/test_batch.py).
+//
+// Note that a node rate limits clients by IP address, so for sustained load from a single machine
+// the node must be run with a suitably raised client rate limit (see `--rate-limit-client` and
+// `--rate-limit-burst`).
+
+#include <oxenss/crypto/channel_encryption.hpp>
+#include <oxenss/crypto/keys.h>
+
+#include <CLI/CLI.hpp>
+#include <cpr/cpr.h>
+#include <nlohmann/json.hpp>
+#include <oxenc/base64.h>
+#include <oxenc/endian.h>
+#include <oxenc/hex.h>
+#include <oxenmq/oxenmq.h>
+#include <sodium/core.h>
+#include <sodium/crypto_box.h>
+#include <sodium/crypto_sign.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std::literals;
+using namespace oxen;
+using namespace oxen::crypto;
+using nlohmann::json;
+
+namespace {
+
+enum class op : size_t { store, retrieve, batch, expire, onion };
+constexpr std::array<std::string_view, 5> OP_NAMES{"store", "retrieve", "batch", "expire", "onion"};
+constexpr size_t NUM_OPS = OP_NAMES.size();
+
+// How many of each account's most recently stored message hashes we keep around to expire
+constexpr size_t KEPT_HASHES = 20;
+// How many messages an expire request updates (at most)
+constexpr size_t EXPIRE_COUNT = 5;
+
+struct options {
+    std::string https;
+    std::string omq;
+    std::string x25519_hex;
+    x25519_pubkey x25519;
+    int https_clients = 10;
+    int omq_clients = 0;
+    int accounts = 10;
+    double duration = 30;
+    size_t size = 500;
+    int64_t ttl = 3600;
+    std::array<double, NUM_OPS> mix{4, 5, 1, 0, 0};
+    size_t batch_size = 2;
+    bool json = false;
+};
+
+struct account {
+    std::array<unsigned char, 32> ed_pk;
+    std::array<unsigned char, 64> ed_sk;
+    std::string pubkey;  // 05-prefixed session id
+    std::deque<std::string> hashes;
+
+    account() {
+        crypto_sign_keypair(ed_pk.data(), ed_sk.data());
+        std::array<unsigned char, 32> x_pk;
+        crypto_sign_ed25519_pk_to_curve25519(x_pk.data(), ed_pk.data());
+        pubkey = "05" + oxenc::to_hex(x_pk.begin(), x_pk.end());
+    }
+
+    std::string sign(std::string_view msg) const {
+        std::array<unsigned char, 64> sig;
+        crypto_sign_detached(
+                sig.data(),
+                nullptr,
+                reinterpret_cast<const unsigned char*>(msg.data()),
+                msg.size(),
+                ed_sk.data());
+        return oxenc::to_base64(sig.begin(), sig.end());
+    }
+
+    // The signing/auth parameters shared by all signed requests
+    json auth_params(std::string_view sig_msg) const {
+        return json{
+                {"pubkey", pubkey},
+                {"pubkey_ed25519", oxenc::to_hex(ed_pk.begin(), ed_pk.end())},
+                {"signature", sign(sig_msg)}};
+    }
+};
+
+int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+            .count();
+}
+
+struct results {
+    std::array<std::vector<double>, NUM_OPS> latencies_ms;  // Successful requests only
+    std::array<uint64_t, NUM_OPS> failures{};
+
+    void merge(results&& r) {
+        for (size_t i = 0; i < NUM_OPS; i++) {
+            latencies_ms[i].insert(
+                    latencies_ms[i].end(), r.latencies_ms[i].begin(), r.latencies_ms[i].end());
+            failures[i] += r.failures[i];
+        }
+    }
+};
+
+// A single client: owns its accounts (so that no state is shared between clients) and keeps
+// sending requests until the deadline.
+class client {
+  public:
+    client(const options& opts, oxenmq::OxenMQ* omq, oxenmq::ConnectionID omq_conn) :
+            opts_{opts}, omq_{omq}, omq_conn_{std::move(omq_conn)}, rng_{std::random_device{}()} {
+        accounts_.resize(opts.accounts);
+        if (!omq_) {
+            session_.SetVerifySsl(cpr::VerifySsl{false});
+            session_.SetTimeout(30s);
+        }
+    }
+
+    results run(std::chrono::steady_clock::time_point deadline) {
+        std::discrete_distribution<size_t> pick{opts_.mix.begin(), opts_.mix.end()};
+        std::uniform_int_distribution<size_t> pick_account{0, accounts_.size() - 1};
+        while (std::chrono::steady_clock::now() < deadline) {
+            auto o = static_cast<op>(pick(rng_));
+            auto& acc = accounts_[pick_account(rng_)];
+            if (o == op::expire && acc.hashes.empty())
+                o = op::store;
+            // Onion requests only go over HTTPS
+            if (o == op::onion && omq_)
+                o = op::retrieve;
+
+            auto started = std::chrono::steady_clock::now();
+            auto [ok, body] = o == op::onion ? send_onion(acc) : send(request(o, acc));
+            auto elapsed = std::chrono::steady_clock::now() - started;
+
+            auto i = static_cast<size_t>(o);
+            if (!ok) {
+                results_.failures[i]++;
+                continue;
+            }
+            results_.latencies_ms[i].push_back(
+                    std::chrono::duration<double, std::milli>(elapsed).count());
+            if (o == op::store)
+                remember_hash(acc, body);
+        }
+        return std::move(results_);
+    }
+
+  private:
+    const options& opts_;
+    oxenmq::OxenMQ* omq_;
+    oxenmq::ConnectionID omq_conn_;
+    cpr::Session session_;
+    std::mt19937_64 rng_;
+    std::vector<account> accounts_;
+    results results_;
+
+    std::string random_data() {
+        std::string data(opts_.size, '\0');
+        for (auto& c : data)
+            c = static_cast<char>(rng_());
+        return oxenc::to_base64(data);
+    }
+
+    json store_params(const account& acc) {
+        auto ts = now_ms();
+        auto p = acc.auth_params("store" + std::to_string(ts));
+        p["timestamp"] = ts;
+        p["sig_timestamp"] = ts;
+        p["ttl"] = opts_.ttl * 1000;
+        p["data"] = random_data();
+        return p;
+    }
+
+    json retrieve_params(const account& acc) {
+        auto ts = now_ms();
+        auto p = acc.auth_params("retrieve" + std::to_string(ts));
+        p["timestamp"] = ts;
+        // Polling for anything newer than the last message we stored, like a client would
+        if (!acc.hashes.empty())
+            p["last_hash"] = acc.hashes.back();
+        return p;
+    }
+
+    json expire_params(const account& acc) {
+        auto expiry = now_ms() + opts_.ttl * 1000 / 2;
+        std::vector<std::string> msgs(
+                acc.hashes.end() - std::min(acc.hashes.size(), EXPIRE_COUNT), acc.hashes.end());
+        std::string sig_msg = "expire" + std::to_string(expiry);
+        for (auto& h : msgs)
+            sig_msg += h;
+        auto p = acc.auth_params(sig_msg);
+        p["expiry"] = expiry;
+        p["messages"] = std::move(msgs);
+        return p;
+    }
+
+    // A typical client batch sends a message and polls; bigger ones repeat that, with every
+    // other poll replaced by an expiry update once the account has messages.
+    json batch_params(const account& acc) {
+        json reqs = json::array();
+        for (size_t i = 0; i < opts_.batch_size; i++) {
+            if (i % 2 == 0)
+                reqs.push_back({{"method", "store"}, {"params", store_params(acc)}});
+            else if (i % 4 == 3 && !acc.hashes.empty())
+                reqs.push_back({{"method", "expire"}, {"params", expire_params(acc)}});
+            else
+                reqs.push_back({{"method", "retrieve"}, {"params", retrieve_params(acc)}});
+        }
+        return {{"requests", std::move(reqs)}};
+    }
+
+    json request(op o, const account& acc) {
+        switch (o) {
+            case op::store: return {{"method", "store"}, {"params", store_params(acc)}};
+            case op::expire: return {{"method", "expire"}, {"params", expire_params(acc)}};
+            case op::batch: return {{"method", "batch"}, {"params", batch_params(acc)}};
+            case op::retrieve:
+            case op::onion: break;
+        }
+        return {{"method", "retrieve"}, {"params", retrieve_params(acc)}};
+    }
+
+    static bool ok_status(int status) { return status == 200; }
+
+    // Sends a storage RPC request, returning whether it succeeded along with the response body.
+    std::pair<bool, std::string> send(const json& req) {
+        if (!omq_) {
+            session_.SetUrl(cpr::Url{"https://" + opts_.https + "/storage_rpc/v1"});
+            session_.SetBody(cpr::Body{req.dump()});
+            auto r = session_.Post();
+            return {ok_status(r.status_code), std::move(r.text)};
+        }
+
+        std::promise<std::pair<bool, std::string>> result;
+        auto fut = result.get_future();
+        omq_->request(
+                omq_conn_,
+                "storage." + req["method"].get<std::string>(),
+                [&result](bool success, std::vector<std::string> data) {
+                    // Successful replies are just the body; failures are [code, body]
+                    bool ok = success && data.size() == 1;
+                    result.set_value({ok, ok ? std::move(data[0]) : ""s});
+                },
+                req["params"].dump(),
+                oxenmq::send_option::request_timeout{30s});
+        return fut.get();
+    }
+
+    // Sends a retrieve wrapped in a single hop onion request to the node itself.
+    std::pair<bool, std::string> send_onion(const account& acc) {
+        x25519_pubkey eph_pk;
+        x25519_seckey eph_sk;
+        crypto_box_keypair(eph_pk.data(), eph_sk.data());
+        ChannelEncryption e{eph_sk, eph_pk, false};
+
+        auto payload = request(op::retrieve, acc).dump();
+        auto data = encode_size(payload.size());
+        data += payload;
+        data += R"({"headers":[]})";
+        auto blob = e.encrypt(EncryptType::xchacha20, data, opts_.x25519);
+
+        auto body = encode_size(blob.size());
+        body += blob;
+        body += json{{"ephemeral_key", eph_pk.hex()},
+                     {"enc_type", to_string(EncryptType::xchacha20)}}
+                        .dump();
+
+        session_.SetUrl(cpr::Url{"https://" + opts_.https + "/onion_req/v2"});
+        session_.SetBody(cpr::Body{std::move(body)});
+        auto r = session_.Post();
+        return {ok_status(r.status_code), ""};
+    }
+
+    static std::string encode_size(uint32_t s) {
+        oxenc::host_to_little_inplace(s);
+        return {reinterpret_cast<const char*>(&s), sizeof(s)};
+    }
+
+    static void remember_hash(account& acc, const std::string& body) {
+        auto j = json::parse(body, nullptr, false);
+        if (!j.is_object())
+            return;
+        if (auto it = j.find("hash"); it != j.end() && it->is_string()) {
+            acc.hashes.push_back(it->get<std::string>());
+            if (acc.hashes.size() > KEPT_HASHES)
+                acc.hashes.pop_front();
+        }
+    }
+};
+
+double percentile(const std::vector<double>& sorted, double q) {
+    if (sorted.empty())
+        return 0;
+    return sorted[std::min(sorted.size() - 1, static_cast<size_t>(q * sorted.size()))];
+}
+
+void report(results& r, double elapsed, bool as_json) {
+    constexpr std::array<double, 4> QUANTILES{0.5, 0.9, 0.99, 0.999};
+    constexpr std::array<std::string_view, 4> QUANTILE_NAMES{"p50", "p90", "p99", "p99.9"};
+    json j;
+    if (!as_json) {
+        std::cout << std::left << std::setw(10) << "request" << std::right << std::setw(10) << "ok"
+                  << std::setw(8) << "failed" << std::setw(10) << "req/s";
+        for (auto name : QUANTILE_NAMES)
+            std::cout << std::setw(10) << name;
+        std::cout << std::setw(10) << "max" << "  (latencies in ms)\n";
+    }
+    uint64_t total = 0;
+    for (size_t i = 0; i < NUM_OPS; i++) {
+        auto& lat = r.latencies_ms[i];
+        if (lat.empty() && !r.failures[i])
+            continue;
+        std::sort(lat.begin(), lat.end());
+        total += lat.size();
+        double rate = lat.size() / elapsed;
+        double max = lat.empty() ? 0 : lat.back();
+        if (as_json) {
+            auto& o = j["requests"][std::string{OP_NAMES[i]}];
+            o["ok"] = lat.size();
+            o["failed"] = r.failures[i];
+            o["rate"] = rate;
+            for (size_t q = 0; q < QUANTILES.size(); q++)
+                o[std::string{QUANTILE_NAMES[q]} + "_ms"] = percentile(lat, QUANTILES[q]);
+            o["max_ms"] = max;
+            continue;
+        }
+        std::cout << std::left << std::setw(10) << OP_NAMES[i] << std::right << std::setw(10)
+                  << lat.size() << std::setw(8) << r.failures[i] << std::fixed
+                  << std::setprecision(1) << std::setw(10) << rate << std::setprecision(2);
+        for (auto q : QUANTILES)
+            std::cout << std::setw(10) << percentile(lat, q);
+        std::cout << std::setw(10) << max << "\n";
+    }
+    if (as_json) {
+        j["duration"] = elapsed;
+        j["rate"] = total / elapsed;
+        std::cout << j.dump(2) << "\n";
+    } else {
+        std::cout << "\nTotal: " << total << " successful requests in " << std::setprecision(1)
+                  << elapsed << "s (" << total / elapsed << " req/s)\n";
+    }
+}
+
+// Parses a "store=4,retrieve=5,..." request mix
+void parse_mix(std::string_view spec, std::array<double, NUM_OPS>& mix) {
+    mix.fill(0);
+    while (!spec.empty()) {
+        auto comma = spec.find(',');
+        auto item = spec.substr(0, comma);
+        spec = comma == std::string_view::npos ? ""sv : spec.substr(comma + 1);
+        auto eq = item.find('=');
+        auto it = std::find(OP_NAMES.begin(), OP_NAMES.end(), item.substr(0, eq));
+        if (eq == std::string_view::npos || it == OP_NAMES.end())
+            throw std::invalid_argument{"Invalid request mix entry '" + std::string{item} + "'"};
+        mix[it - OP_NAMES.begin()] = std::stod(std::string{item.substr(eq + 1)});
+    }
+    if (std::all_of(mix.begin(), mix.end(), [](double w) { return w <= 0; }))
+        throw std::invalid_argument{"Request mix is empty"};
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    options opts;
+    std::string mix;
+
+    CLI::App cli{"Oxen Storage Server load generator"};
+    cli.add_option("--https", opts.https, "HTTPS address (IP:PORT) of the node")->required();
+    cli.add_option(
+            "--omq", opts.omq, "OMQ address (IP:PORT) of the node; required for OMQ clients");
+    cli.add_option(
+            "--x25519",
+            opts.x25519_hex,
+            "The node's x25519 pubkey (hex); required for OMQ clients and onion requests");
+    cli.add_option("--https-clients", opts.https_clients, "Number of concurrent HTTPS clients")
+            ->capture_default_str();
+    cli.add_option("--omq-clients", opts.omq_clients, "Number of concurrent OMQ clients")
+            ->capture_default_str();
+    cli.add_option("--accounts", opts.accounts, "Number of generated accounts per client")
+            ->capture_default_str()
+            ->check(CLI::PositiveNumber);
+    cli.add_option("--duration", opts.duration, "How long to run for, in seconds")
+            ->capture_default_str()
+            ->check(CLI::PositiveNumber);
+    cli.add_option("--size", opts.size, "Size of stored messages, in bytes (before base64)")
+            ->capture_default_str();
+    cli.add_option("--ttl", opts.ttl, "TTL of stored messages, in seconds")
+            ->capture_default_str()
+            ->check(CLI::PositiveNumber);
+    cli.add_option(
+               "--mix",
+               mix,
+               "Relative weights of the request types to send, as a comma-separated list of "
+               "TYPE=WEIGHT where TYPE is one of store, retrieve, batch, expire or onion")
+            ->default_str("store=4,retrieve=5,batch=1");
+    cli.add_option("--batch-size", opts.batch_size, "Number of requests in each batch request")
+            ->capture_default_str()
+            ->check(CLI::Range(1, 20));
+    cli.add_flag("--json", opts.json, "Output the results as json");
+
+    try {
+        cli.parse(argc, argv);
+        if (!mix.empty())
+            parse_mix(mix, opts.mix);
+        if (!opts.x25519_hex.empty())
+            opts.x25519 = x25519_pubkey::from_hex(opts.x25519_hex);
+        if (opts.omq_clients > 0 && (opts.omq.empty() || opts.x25519_hex.empty()))
+            throw std::invalid_argument{"--omq and --x25519 are required for OMQ clients"};
+        if (opts.mix[static_cast<size_t>(op::onion)] > 0 && opts.x25519_hex.empty())
+            throw std::invalid_argument{"--x25519 is required for onion requests"};
+        if (opts.https_clients + opts.omq_clients <= 0)
+            throw std::invalid_argument{"Need at least one client"};
+    } catch (const CLI::ParseError& e) {
+        return cli.exit(e);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+
+    if (sodium_init() < 0) {
+        std::cerr << "Failed to initialize libsodium\n";
+        return 1;
+    }
+
+    std::optional<oxenmq::OxenMQ> omq;
+    oxenmq::ConnectionID conn;
+    if (opts.omq_clients > 0) {
+        omq.emplace();
+        omq->start();
+        std::promise<void> connected;
+        conn = omq->connect_remote(
+                oxenmq::address{"curve://" + opts.omq + "/" + opts.x25519_hex},
+                [&](auto) { connected.set_value(); },
+                [&](auto, auto err) {
+                    connected.set_exception(std::make_exception_ptr(
+                            std::runtime_error{"Failed to connect: " + std::string{err}}));
+                });
+        try {
+            connected.get_future().get();
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+    }
+
+    std::vector<std::unique_ptr<client>> clients;
+    for (int i = 0; i < opts.https_clients; i++)
+        clients.push_back(std::make_unique<client>(opts, nullptr, oxenmq::ConnectionID{}));
+    for (int i = 0; i < opts.omq_clients; i++)
+        clients.push_back(std::make_unique<client>(opts, &*omq, conn));
+
+    std::cerr << "Running " << opts.https_clients << " HTTPS and " << opts.omq_clients
+              << " OMQ clients for " << opts.duration << "s\n";
+    auto started = std::chrono::steady_clock::now();
+    auto deadline =
+            started + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                              std::chrono::duration<double>{opts.duration});
+    std::vector<std::future<results>> running;
+    for (auto& c : clients)
+        running.push_back(
+                std::async(std::launch::async, [&c, deadline] { return c->run(deadline); }));
+
+    results all;
+    for (auto& r : running)
+        all.merge(r.get());
+    double elapsed =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    report(all, elapsed, opts.json);
+}
@@ -0,0 +1,697 @@
+// Replays a request capture (recorded by a node running with `--capture-file`) against a test node,
+// reproducing the captured mix, sizes and arrival times of requests as a benchmark load.
+//
+// The capture only holds the shapes of requests (see rpc::RequestCapture), so the replay builds
+// equivalent requests from generated accounts: each captured account number gets its own keypair,
+// stores get random data of the captured size, retrieves poll from the last stored hash when the
+// original gave one, and so on.  Each request is sent at its captured arrival time (divided by
+// `--speed`) over the transport it originally came in on, from a pool of worker threads.  Requests
+// that can't be replayed against a single node (onion requests that were relayed onward, and
+// methods we don't build requests for) are skipped.
+//
+// Build with `make replay` (from the build directory); run with `--help` for the options.  For
+// example, to replay a capture at twice the original speed against a local testnet node:
+//
+//     contrib/replay --capture requests.capture --https 127.0.0.1:22021 \
+//         --omq 127.0.0.1:22020 --x25519 PUBKEY --speed 2
+//
+// At the end it reports, per method, latency percentiles of the replayed requests next to those
+// captured on the original node, along with failures and how far behind schedule requests were
+// sent (if that grows large, the node -- or the replay, which needs --workers at least as large as
+// the number of requests in flight -- couldn't keep up).
+//
+// As with contrib/loadgen, the node must be run with a suitably raised client rate limit.
+
+#include <oxenss/crypto/channel_encryption.hpp>
+#include <oxenss/crypto/keys.h>
+
+#include <CLI/CLI.hpp>
+#include <cpr/cpr.h>
+#include <nlohmann/json.hpp>
+#include <oxenc/base64.h>
+#include <oxenc/bt_serialize.h>
+#include <oxenc/endian.h>
+#include <oxenc/hex.h>
+#include <oxenmq/oxenmq.h>
+#include <sodium/core.h>
+#include <sodium/crypto_box.h>
+#include <sodium/crypto_sign.h>
+#include <sodium/randombytes.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std::literals;
+using namespace oxen;
+using namespace oxen::crypto;
+using nlohmann::json;
+
+namespace {
+
+// How many of each account's most recently stored message hashes we keep around for expire and
+// delete requests
+constexpr size_t KEPT_HASHES = 50;
+
+struct options {
+    std::string capture;
+    std::string https;
+    std::string omq;
+    std::string x25519_hex;
+    x25519_pubkey x25519;
+    double speed = 1;
+    double limit = 0;
+    int workers = 64;
+    bool json = false;
+};
+
+struct account {
+    std::array<unsigned char, 32> ed_pk;
+    std::array<unsigned char, 64> ed_sk;
+    std::string pubkey;  // 05-prefixed session id
+
+    std::mutex mutex;
+    std::deque<std::string> hashes;
+    std::string monitor;  // The last monitor.messages entry we sent, for resending as a renewal
+
+    account() {
+        crypto_sign_keypair(ed_pk.data(), ed_sk.data());
+        std::array<unsigned char, 32> x_pk;
+        crypto_sign_ed25519_pk_to_curve25519(x_pk.data(), ed_pk.data());
+        pubkey = "05" + oxenc::to_hex(x_pk.begin(), x_pk.end());
+    }
+
+    std::string sign_raw(std::string_view msg) const {
+        std::string sig(64, '\0');
+        crypto_sign_detached(
+                reinterpret_cast<unsigned char*>(sig.data()),
+                nullptr,
+                reinterpret_cast<const unsigned char*>(msg.data()),
+                msg.size(),
+                ed_sk.data());
+        return sig;
+    }
+
+    // The signing/auth parameters shared by all signed requests
+    json auth_params(std::string_view sig_msg) const {
+        return json{
+                {"pubkey", pubkey},
+                {"pubkey_ed25519", oxenc::to_hex(ed_pk.begin(), ed_pk.end())},
+                {"signature", oxenc::to_base64(sign_raw(sig_msg))}};
+    }
+
+    void remember(std::string hash) {
+        std::lock_guard lock{mutex};
+        hashes.push_back(std::move(hash));
+        if (hashes.size() > KEPT_HASHES)
+            hashes.pop_front();
+    }
+
+    std::optional<std::string> last_hash() {
+        std::lock_guard lock{mutex};
+        if (hashes.empty())
+            return std::nullopt;
+        return hashes.back();
+    }
+
+    // Returns the `n` most recently stored hashes, padded out with made up ones (which the node
+    // won't find, but still has to look for) if we haven't stored that many.
+    std::vector<std::string> recent_hashes(size_t n) {
+        std::vector<std::string> result;
+        {
+            std::lock_guard lock{mutex};
+            result.assign(hashes.end() - std::min(n, hashes.size()), hashes.end());
+        }
+        while (result.size() < n) {
+            std::array<unsigned char, 32> h;
+            randombytes_buf(h.data(), h.size());
+            auto b64 = oxenc::to_base64(h.begin(), h.end());
+            b64.pop_back();  // Message hashes are unpadded base64
+            result.push_back(std::move(b64));
+        }
+        return result;
+    }
+};
+
+int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+            .count();
+}
+
+// A captured request that we replay
+struct replay_entry {
+    std::chrono::microseconds t;
+    std::string name;  // Method, or "onion"/"monitor"; what the results are grouped by
+    json entry;
+};
+
+struct method_results {
+    std::vector<double> latencies_ms;  // Successful requests only
+    std::vector<double> captured_ms;   // Captured latencies of the same requests
+    uint64_t failures = 0;
+    uint64_t hits = 0, captured_hits = 0;
+};
+
+struct results {
+    std::map<std::string, method_results> methods;
+    std::vector<double> lag_ms;  // How late each request was sent relative to its schedule
+
+    void merge(results&& r) {
+        for (auto& [name, m] : r.methods) {
+            auto& mine = methods[name];
+            mine.latencies_ms.insert(
+                    mine.latencies_ms.end(), m.latencies_ms.begin(), m.latencies_ms.end());
+            mine.captured_ms.insert(
+                    mine.captured_ms.end(), m.captured_ms.begin(), m.captured_ms.end());
+            mine.failures += m.failures;
+            mine.hits += m.hits;
+            mine.captured_hits += m.captured_hits;
+        }
+        lag_ms.insert(lag_ms.end(), r.lag_ms.begin(), r.lag_ms.end());
+    }
+};
+
+// Methods we can build requests for (and batch/sequence, if all their subrequests are)
+bool replayable(const json& e) {
+    auto method = e.value("method", ""s);
+    if (method == "batch" || method == "sequence") {
+        auto sub = e.find("sub");
+        return sub != e.end() && sub->is_array() && !sub->empty() &&
+               std::all_of(sub->begin(), sub->end(), replayable);
+    }
+    return method == "store" || method == "retrieve" || method == "expire" ||
+           method == "delete" || method == "get_swarm" || method == "info";
+}
+
+// Loads the replayable entries of a capture, in arrival order; counts the rest in `skipped`.
+std::vector<replay_entry> load_capture(
+        const options& opts, bool have_omq, std::map<std::string, uint64_t>& skipped) {
+    std::ifstream in{opts.capture};
+    if (!in)
+        throw std::runtime_error{"Unable to open " + opts.capture};
+    std::string line;
+    if (!std::getline(in, line) || !json::parse(line, nullptr, false).contains("capture"))
+        throw std::runtime_error{opts.capture + " is not a request capture"};
+
+    std::vector<replay_entry> entries;
+    while (std::getline(in, line)) {
+        auto e = json::parse(line, nullptr, false);
+        if (!e.is_object() || !e.contains("t") || !e.contains("kind"))
+            continue;
+        replay_entry r{std::chrono::microseconds{e["t"].get<int64_t>()}, "", std::move(e)};
+        if (opts.limit > 0 && r.t > std::chrono::duration<double>{opts.limit})
+            continue;
+        auto kind = r.entry["kind"].get<std::string>();
+        auto transport = r.entry.value("transport", ""s);
+        r.name = kind == "client" ? r.entry.value("method", "?"s) : kind;
+        bool ok;
+        if (kind == "client")
+            ok = replayable(r.entry) && (transport != "omq" || have_omq) &&
+                 (transport != "onion" || !opts.x25519_hex.empty());
+        else if (kind == "monitor")
+            ok = have_omq;
+        else
+            // Onion requests to us are replayed from their (separately captured) client request;
+            // those relayed onward can't be replayed against one node.
+            ok = false;
+        if (ok)
+            entries.push_back(std::move(r));
+        else
+            skipped[kind == "onion" ? "onion (" + r.entry.value("hop", "?"s) + ")"
+                                    : r.name + "/" + transport]++;
+    }
+    std::stable_sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+        return a.t < b.t;
+    });
+    return entries;
+}
+
+class replayer {
+  public:
+    replayer(const options& opts, std::vector<replay_entry> entries) :
+            opts_{opts}, entries_{std::move(entries)} {
+        // Make all the accounts up front so that keypair generation doesn't delay requests
+        for (auto& e : entries_)
+            add_accounts(e.entry);
+        accounts_.try_emplace(0);
+    }
+
+    void connect_omq() {
+        omq_.emplace();
+        omq_->start();
+        std::promise<void> connected;
+        omq_conn_ = omq_->connect_remote(
+                oxenmq::address{"curve://" + opts_.omq + "/" + opts_.x25519_hex},
+                [&](auto) { connected.set_value(); },
+                [&](auto, auto err) {
+                    connected.set_exception(std::make_exception_ptr(
+                            std::runtime_error{"Failed to connect: " + std::string{err}}));
+                });
+        connected.get_future().get();
+    }
+
+    size_t size() const { return entries_.size(); }
+
+    results run() {
+        started_ = std::chrono::steady_clock::now();
+        std::vector<std::future<results>> running;
+        for (int i = 0; i < opts_.workers; i++)
+            running.push_back(std::async(std::launch::async, [this] { return work(); }));
+        results all;
+        for (auto& r : running)
+            all.merge(r.get());
+        return all;
+    }
+
+  private:
+    const options& opts_;
+    const std::vector<replay_entry> entries_;
+    std::unordered_map<uint32_t, account> accounts_;
+    std::optional<oxenmq::OxenMQ> omq_;
+    oxenmq::ConnectionID omq_conn_;
+    std::atomic<size_t> next_{0};
+    std::chrono::steady_clock::time_point started_;
+
+    void add_accounts(const json& e) {
+        if (auto it = e.find("account"); it != e.end())
+            accounts_.try_emplace(it->get<uint32_t>());
+        if (auto it = e.find("sub"); it != e.end())
+            for (auto& s : *it)
+                add_accounts(s);
+    }
+
+    account& account_for(const json& e) {
+        return accounts_.at(e.value("account", uint32_t{0}));
+    }
+
+    results work() {
+        results res;
+        cpr::Session session;
+        session.SetVerifySsl(cpr::VerifySsl{false});
+        session.SetTimeout(30s);
+
+        for (size_t i; (i = next_++) < entries_.size();) {
+            auto& e = entries_[i];
+            auto scheduled = started_ + std::chrono::duration_cast<std::chrono::microseconds>(
+                                                e.t / opts_.speed);
+            std::this_thread::sleep_until(scheduled);
+            auto sent = std::chrono::steady_clock::now();
+            res.lag_ms.push_back(
+                    std::chrono::duration<double, std::milli>(sent - scheduled).count());
+
+            auto [ok, body] = send(session, e.entry);
+            auto elapsed = std::chrono::steady_clock::now() - sent;
+
+            auto& m = res.methods[e.name];
+            if (!ok) {
+                m.failures++;
+                continue;
+            }
+            m.latencies_ms.push_back(std::chrono::duration<double, std::milli>(elapsed).count());
+            if (auto lat = e.entry.find("latency_us"); lat != e.entry.end())
+                m.captured_ms.push_back(lat->get<double>() / 1000);
+            if (e.name == "retrieve") {
+                m.captured_hits += e.entry.value("hit", false);
+                auto j = json::parse(body, nullptr, false);
+                auto msgs = j.is_object() ? j.find("messages") : j.end();
+                m.hits += msgs != j.end() && msgs->is_array() && !msgs->empty();
+            }
+        }
+        return res;
+    }
+
+    std::pair<bool, std::string> send(cpr::Session& session, const json& e) {
+        auto kind = e["kind"].get<std::string>();
+        if (kind == "monitor")
+            return send_monitor(e);
+        auto req = request(e);
+        auto transport = e.value("transport", ""s);
+        std::pair<bool, std::string> res;
+        if (transport == "omq")
+            res = send_omq(req);
+        else if (transport == "onion")
+            res = send_onion(session, req);
+        else
+            res = send_https(session, req);
+        if (res.first)
+            remember_hashes(e, res.second);
+        return res;
+    }
+
+    std::string random_data(size_t b64_size) {
+        std::string data(b64_size * 3 / 4, '\0');
+        randombytes_buf(data.data(), data.size());
+        return oxenc::to_base64(data);
+    }
+
+    static std::string ns_sig_value(const json& e) {
+        auto ns = e.find("ns");
+        if (ns == e.end() || !ns->is_number_integer() || *ns == 0)
+            return "";
+        return std::to_string(ns->get<int>());
+    }
+
+    // Builds a request like the one described by captured entry `e`
+    json request(const json& e) {
+        auto method = e.value("method", ""s);
+        json params = json::object();
+
+        if (method == "batch" || method == "sequence") {
+            json subs = json::array();
+            for (auto& s : e["sub"])
+                subs.push_back(request(s));
+            params["requests"] = std::move(subs);
+        } else if (method == "info") {
+            // No parameters
+        } else if (method == "get_swarm") {
+            params["pubkey"] = account_for(e).pubkey;
+        } else {
+            auto& acc = account_for(e);
+            auto ns = ns_sig_value(e);
+            if (method == "store") {
+                auto ts = now_ms();
+                params = acc.auth_params("store" + ns + std::to_string(ts));
+                params["timestamp"] = ts;
+                params["sig_timestamp"] = ts;
+                params["ttl"] = std::max<int64_t>(e.value("ttl", int64_t{3'600'000}), 10'000);
+                params["data"] = random_data(e.value("data", size_t{100}));
+            } else if (method == "retrieve") {
+                auto ts = now_ms();
+                params = acc.auth_params("retrieve" + ns + std::to_string(ts));
+                params["timestamp"] = ts;
+                if (e.value("last_hash", false))
+                    if (auto h = acc.last_hash())
+                        params["last_hash"] = std::move(*h);
+                for (auto key : {"max_count", "max_size"})
+                    if (auto it = e.find(key); it != e.end())
+                        params[key] = *it;
+            } else if (method == "expire" || method == "delete") {
+                auto msgs = acc.recent_hashes(std::max<size_t>(e.value("count", size_t{1}), 1));
+                std::string sig_msg = method;
+                int64_t expiry = 0;
+                if (method == "expire") {
+                    expiry = now_ms() + std::max<int64_t>(e.value("ttl", int64_t{3'600'000}), 0);
+                    sig_msg += std::to_string(expiry);
+                }
+                for (auto& h : msgs)
+                    sig_msg += h;
+                params = acc.auth_params(sig_msg);
+                if (method == "expire")
+                    params["expiry"] = expiry;
+                params["messages"] = std::move(msgs);
+            }
+            if (!ns.empty())
+                params["namespace"] = std::stoi(ns);
+        }
+        return {{"method", std::move(method)}, {"params", std::move(params)}};
+    }
+
+    // Remembers the hashes of stored messages (including those of batch subrequests) from a
+    // response.
+    void remember_hashes(const json& e, std::string_view body) {
+        auto method = e.value("method", ""s);
+        if (method != "store" && method != "batch" && method != "sequence")
+            return;
+        auto j = json::parse(body, nullptr, false);
+        if (!j.is_object())
+            return;
+        if (method == "store") {
+            if (auto it = j.find("hash"); it != j.end() && it->is_string())
+                account_for(e).remember(it->get<std::string>());
+            return;
+        }
+        auto results = j.find("results");
+        if (results == j.end() || !results->is_array())
+            return;
+        auto& sub = e["sub"];
+        for (size_t i = 0; i < std::min(sub.size(), results->size()); i++) {
+            auto& r = (*results)[i];
+            if (sub[i].value("method", ""s) != "store" || !r.is_object() || !r.contains("body"))
+                continue;
+            if (auto it = r["body"].find("hash"); it != r["body"].end() && it->is_string())
+                account_for(sub[i]).remember(it->get<std::string>());
+        }
+    }
+
+    static bool ok_status(int status) { return status == 200; }
+
+    std::pair<bool, std::string> send_https(cpr::Session& session, const json& req) {
+        session.SetUrl(cpr::Url{"https://" + opts_.https + "/storage_rpc/v1"});
+        session.SetBody(cpr::Body{req.dump()});
+        auto r = session.Post();
+        return {ok_status(r.status_code), std::move(r.text)};
+    }
+
+    std::pair<bool, std::string> omq_request(std::string endpoint, std::string body) {
+        std::promise<std::pair<bool, std::string>> result;
+        auto fut = result.get_future();
+        omq_->request(
+                omq_conn_,
+                std::move(endpoint),
+                [&result](bool success, std::vector<std::string> data) {
+                    // Successful replies are just the body; failures are [code, body]
+                    bool ok = success && data.size() == 1;
+                    result.set_value({ok, ok ? std::move(data[0]) : ""s});
+                },
+                std::move(body),
+                oxenmq::send_option::request_timeout{30s});
+        return fut.get();
+    }
+
+    std::pair<bool, std::string> send_omq(const json& req) {
+        return omq_request("storage." + req["method"].get<std::string>(), req["params"].dump());
+    }
+
+    // Sends a request wrapped in a single hop onion request to the node itself.
+    std::pair<bool, std::string> send_onion(cpr::Session& session, const json& req) {
+        x25519_pubkey eph_pk;
+        x25519_seckey eph_sk;
+        crypto_box_keypair(eph_pk.data(), eph_sk.data());
+        ChannelEncryption e{eph_sk, eph_pk, false};
+
+        auto payload = req.dump();
+        auto data = encode_size(payload.size());
+        data += payload;
+        data += R"({"headers":[]})";
+        auto blob = e.encrypt(EncryptType::xchacha20, data, opts_.x25519);
+
+        auto body = encode_size(blob.size());
+        body += blob;
+        body += json{{"ephemeral_key", eph_pk.hex()},
+                     {"enc_type", to_string(EncryptType::xchacha20)}}
+                        .dump();
+
+        session.SetUrl(cpr::Url{"https://" + opts_.https + "/onion_req/v2"});
+        session.SetBody(cpr::Body{std::move(body)});
+        auto r = session.Post();
+        return {ok_status(r.status_code), ""};
+    }
+
+    // Sends a monitor.messages request with as many entries as captured, resending the previous
+    // entries of `renewed` of them (so that the node can renew those without verifying them again,
+    // as it does for push servers re-sending their subscriptions).
+    std::pair<bool, std::string> send_monitor(const json& e) {
+        size_t n = std::max<size_t>(e.value("size", size_t{1}), 1);
+        size_t renewed = e.value("renewed", size_t{0});
+        std::string body = "l";
+        // Spread the entries over the captured accounts, which is as close as we can get: the
+        // capture doesn't say which accounts were monitored.
+        auto it = accounts_.begin();
+        for (size_t i = 0; i < n; i++, ++it) {
+            if (it == accounts_.end())
+                it = accounts_.begin();
+            auto& acc = it->second;
+            std::lock_guard lock{acc.mutex};
+            if (i >= renewed || acc.monitor.empty()) {
+                auto ts = now_ms() / 1000;
+                acc.monitor = oxenc::bt_serialize(oxenc::bt_dict{
+                        {"P", std::string{reinterpret_cast<const char*>(acc.ed_pk.data()), 32}},
+                        {"d", 0},
+                        {"n", oxenc::bt_list{0}},
+                        {"s", acc.sign_raw("MONITOR" + acc.pubkey + std::to_string(ts) + "00")},
+                        {"t", ts}});
+            }
+            body += acc.monitor;
+        }
+        body += 'e';
+        return omq_request("monitor.messages", std::move(body));
+    }
+
+    static std::string encode_size(uint32_t s) {
+        oxenc::host_to_little_inplace(s);
+        return {reinterpret_cast<const char*>(&s), sizeof(s)};
+    }
+};
+
+double percentile(std::vector<double>& v, double q) {
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, static_cast<size_t>(q * v.size()))];
+}
+
+void report(
+        results& r,
+        const std::map<std::string, uint64_t>& skipped,
+        double elapsed,
+        bool as_json) {
+    constexpr std::array<double, 3> QUANTILES{0.5, 0.9, 0.99};
+    constexpr std::array<std::string_view, 3> QUANTILE_NAMES{"p50", "p90", "p99"};
+    json j;
+    if (!as_json) {
+        std::cout << std::left << std::setw(12) << "request" << std::right << std::setw(9) << "ok"
+                  << std::setw(8) << "failed";
+        for (auto name : QUANTILE_NAMES)
+            std::cout << std::setw(9) << name;
+        for (auto name : QUANTILE_NAMES)
+            std::cout << std::setw(14) << "orig " + std::string{name};
+        std::cout << "  (latencies in ms)\n";
+    }
+    uint64_t total = 0;
+    for (auto& [name, m] : r.methods) {
+        total += m.latencies_ms.size();
+        if (as_json) {
+            auto& o = j["requests"][name];
+            o["ok"] = m.latencies_ms.size();
+            o["failed"] = m.failures;
+            for (size_t q = 0; q < QUANTILES.size(); q++) {
+                auto qn = std::string{QUANTILE_NAMES[q]};
+                o[qn + "_ms"] = percentile(m.latencies_ms, QUANTILES[q]);
+                o["captured_" + qn + "_ms"] = percentile(m.captured_ms, QUANTILES[q]);
+            }
+            if (name == "retrieve") {
+                o["hits"] = m.hits;
+                o["captured_hits"] = m.captured_hits;
+            }
+            continue;
+        }
+        std::cout << std::left << std::setw(12) << name << std::right << std::setw(9)
+                  << m.latencies_ms.size() << std::setw(8) << m.failures << std::fixed
+                  << std::setprecision(2);
+        for (auto q : QUANTILES)
+            std::cout << std::setw(9) << percentile(m.latencies_ms, q);
+        for (auto q : QUANTILES)
+            std::cout << std::setw(14) << percentile(m.captured_ms, q);
+        std::cout << "\n";
+        if (name == "retrieve")
+            std::cout << "    retrieve hits: " << m.hits << " (captured: " << m.captured_hits
+                      << ")\n";
+    }
+    uint64_t total_skipped = 0;
+    for (auto& [what, n] : skipped)
+        total_skipped += n;
+    double lag_p50 = percentile(r.lag_ms, 0.5), lag_p99 = percentile(r.lag_ms, 0.99),
+           lag_max = r.lag_ms.empty() ? 0 : r.lag_ms.back();
+    if (as_json) {
+        j["duration"] = elapsed;
+        j["rate"] = total / elapsed;
+        j["skipped"] = skipped;
+        j["lag"] = {{"p50_ms", lag_p50}, {"p99_ms", lag_p99}, {"max_ms", lag_max}};
+        std::cout << j.dump(2) << "\n";
+        return;
+    }
+    std::cout << "\nTotal: " << total << " successful requests in " << std::setprecision(1)
+              << elapsed << "s (" << total / elapsed << " req/s)\n";
+    std::cout << "Schedule lag: p50 " << std::setprecision(2) << lag_p50 << "ms, p99 " << lag_p99
+              << "ms, max " << lag_max << "ms\n";
+    if (total_skipped) {
+        std::cout << "Skipped " << total_skipped << " captured requests:";
+        for (auto& [what, n] : skipped)
+            std::cout << " " << what << "=" << n;
+        std::cout << "\n";
+    }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    options opts;
+
+    CLI::App cli{"Oxen Storage Server request capture replay"};
+    cli.add_option("--capture", opts.capture, "Request capture file to replay")->required();
+    cli.add_option("--https", opts.https, "HTTPS address (IP:PORT) of the node")->required();
+    cli.add_option(
+            "--omq",
+            opts.omq,
+            "OMQ address (IP:PORT) of the node; OMQ and monitor requests are skipped without it");
+    cli.add_option(
+            "--x25519",
+            opts.x25519_hex,
+            "The node's x25519 pubkey (hex); required for OMQ and onion requests");
+    cli.add_option(
+               "--speed",
+               opts.speed,
+               "Replay speed relative to the capture: 2 sends requests twice as fast, and so on")
+            ->capture_default_str()
+            ->check(CLI::PositiveNumber);
+    cli.add_option(
+               "--limit",
+               opts.limit,
+               "Only replay the first this many seconds of the capture (0 for all of it)")
+            ->capture_default_str();
+    cli.add_option(
+               "--workers",
+               opts.workers,
+               "Number of threads sending requests, i.e. the most requests in flight at once")
+            ->capture_default_str()
+            ->check(CLI::PositiveNumber);
+    cli.add_flag("--json", opts.json, "Output the results as json");
+
+    std::map<std::string, uint64_t> skipped;
+    std::vector<replay_entry> entries;
+    try {
+        cli.parse(argc, argv);
+        if (!opts.x25519_hex.empty())
+            opts.x25519 = x25519_pubkey::from_hex(opts.x25519_hex);
+        if (!opts.omq.empty() && opts.x25519_hex.empty())
+            throw std::invalid_argument{"--x25519 is required with --omq"};
+        entries = load_capture(opts, !opts.omq.empty(), skipped);
+        if (entries.empty())
+            throw std::invalid_argument{"The capture has no requests that can be replayed"};
+    } catch (const CLI::ParseError& e) {
+        return cli.exit(e);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+
+    if (sodium_init() < 0) {
+        std::cerr << "Failed to initialize libsodium\n";
+        return 1;
+    }
+
+    replayer replay{opts, std::move(entries)};
+    if (!opts.omq.empty()) {
+        try {
+            replay.connect_omq();
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+    }
+
+    std::cerr << "Replaying " << replay.size() << " requests at " << opts.speed << "x speed\n";
+    auto started = std::chrono::steady_clock::now();
+    auto res = replay.run();
+    double elapsed =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    report(res, skipped, elapsed, opts.json);
+}
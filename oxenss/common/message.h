@@ -4,6 +4,9 @@
 #include "pubkey.h"
 
 #include <chrono>
+#include <functional>
+#include <memory>
+#include <string_view>
 
 namespace oxen {
 
@@ -43,4 +46,24 @@ struct message {
             data{std::move(data)} {}
 };
 
+/// Immutable, reference-counted message, used to hand a newly stored message (and its potentially
+/// large payload) to everything that needs to hold on to it without copying it.
+using shared_message = std::shared_ptr<const message>;
+
+/// Non-owning view of a stored message's values, used to pass retrieved messages on without
+/// copying them.  The referenced hash and data are only valid for as long as the producer of the
+/// view (e.g. the database result row) says they are.
+struct message_view {
+    std::string_view hash;
+    namespace_id msg_namespace;
+    std::chrono::system_clock::time_point timestamp;
+    std::chrono::system_clock::time_point expiry;
+    std::string_view data;
+};
+
+// Callback receiving messages one at a time as an account pubkey and a view of the message's
+// values, used to pass messages along (e.g. from a serialized batch into the database) without
+// building up a container of them.
+using message_sink = std::function<void(const user_pubkey_t& pubkey, const message_view& msg)>;
+
 }  // namespace oxen
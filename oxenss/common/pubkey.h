@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 
 namespace oxen {
@@ -56,6 +57,10 @@ class user_pubkey_t {
     // Returns the raw bytes that makes up the pubkey, including the type/network prefix byte.
     // Returns an empty string for an invalid (default constructed) pubkey.
     std::string prefixed_raw() const;
+
+    // Maps the pubkey into the 64-bit "swarm space" used to assign accounts to swarms (see
+    // snode::get_swarm_by_pk).  Must only be called on a valid pubkey.
+    uint64_t swarm_space() const;
 };
 
 }  // namespace oxen
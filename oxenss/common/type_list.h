@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cstddef>
+#include <type_traits>
+#include <utility>
 #include <variant>
 
 namespace oxen {
@@ -39,4 +42,22 @@ struct type_list_variant<type_list<T...>> {
 template <typename... T>
 using type_list_variant_t = typename type_list_variant<T...>::type;
 
+/// Tag type for passing a type as a value, e.g. to a generic lambda: `[](auto t) { using T =
+/// typename decltype(t)::type; ... }`.
+template <typename T>
+struct type_tag {
+    using type = T;
+};
+
+/// Invokes `f(type_tag<T>{})` for the `index`th type T of a type_list (which must be less than the
+/// number of types), and returns its result.  This is a jump table of direct calls, one per type,
+/// like std::visit: each one is instantiated with the concrete type so no type erasure is needed.
+template <typename F, typename... T>
+decltype(auto) type_list_visit(size_t index, F&& f, type_list<T...>) {
+    using R = std::common_type_t<std::invoke_result_t<F, type_tag<T>>...>;
+    static constexpr R (*table[])(F&&) = {
+            [](F&& f) -> R { return std::forward<F>(f)(type_tag<T>{}); }...};
+    return table[index](std::forward<F>(f));
+}
+
 }  // namespace oxen
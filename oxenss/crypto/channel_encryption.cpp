@@ -3,14 +3,19 @@
 #include <cassert>
 #include <exception>
 #include <iostream>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
 
 #include <openssl/evp.h>
 #include <sodium/crypto_aead_xchacha20poly1305.h>
 #include <sodium/crypto_auth_hmacsha256.h>
 #include <sodium/crypto_generichash.h>
 #include <sodium/crypto_scalarmult.h>
+#include <sodium/crypto_shorthash.h>
 #include <sodium/randombytes.h>
+#include <sodium/utils.h>
 
 namespace oxen::crypto {
 
@@ -194,7 +199,7 @@ std::string ChannelEncryption::encrypt_cbc(
             EVP_aes_256_cbc(),
             0,
             to_uchar(plaintext_),
-            calculate_shared_secret(private_key_, pubKey));
+            symmetric_key(EncryptType::aes_cbc, pubKey));
 }
 
 std::string ChannelEncryption::decrypt_cbc(
@@ -203,7 +208,7 @@ std::string ChannelEncryption::decrypt_cbc(
             EVP_aes_256_cbc(),
             0,
             to_uchar(ciphertext_),
-            calculate_shared_secret(private_key_, pubKey));
+            symmetric_key(EncryptType::aes_cbc, pubKey));
 }
 
 std::string ChannelEncryption::encrypt_gcm(
@@ -212,7 +217,7 @@ std::string ChannelEncryption::encrypt_gcm(
             EVP_aes_256_gcm(),
             16 /* tag length */,
             to_uchar(plaintext_),
-            derive_symmetric_key(private_key_, pubKey));
+            symmetric_key(EncryptType::aes_gcm, pubKey));
 }
 
 std::string ChannelEncryption::decrypt_gcm(
@@ -221,7 +226,7 @@ std::string ChannelEncryption::decrypt_gcm(
             EVP_aes_256_gcm(),
             16 /* tag length */,
             to_uchar(ciphertext_),
-            derive_symmetric_key(private_key_, pubKey));
+            symmetric_key(EncryptType::aes_gcm, pubKey));
 }
 
 static std::array<unsigned char, crypto_aead_xchacha20poly1305_ietf_KEYBYTES> xchacha20_shared_key(
@@ -245,6 +250,103 @@ static std::array<unsigned char, crypto_aead_xchacha20poly1305_ietf_KEYBYTES> xc
     return key;
 }
 
+struct ChannelEncryption::key_cache {
+    struct cache_key {
+        x25519_pubkey pubkey;
+        EncryptType type;
+        bool operator==(const cache_key& o) const { return pubkey == o.pubkey && type == o.type; }
+    };
+
+    // Remote pubkeys are chosen by whoever sends us a request, so we use a keyed hash rather than
+    // std::hash's use of the first pubkey bytes to keep anyone from deliberately colliding keys.
+    struct cache_key_hash {
+        std::array<unsigned char, crypto_shorthash_KEYBYTES> hash_key;
+        cache_key_hash() { randombytes_buf(hash_key.data(), hash_key.size()); }
+        size_t operator()(const cache_key& k) const {
+            uint64_t h;
+            crypto_shorthash(
+                    reinterpret_cast<unsigned char*>(&h),
+                    k.pubkey.data(),
+                    k.pubkey.size(),
+                    hash_key.data());
+            return h ^ static_cast<size_t>(k.type);
+        }
+    };
+
+    struct entry {
+        cache_key key;
+        std::array<unsigned char, 32> symmetric_key;
+        std::chrono::steady_clock::time_point expires;
+
+        ~entry() { sodium_memzero(symmetric_key.data(), symmetric_key.size()); }
+    };
+
+    std::mutex mutex;
+    std::list<entry> lru;
+    std::unordered_map<cache_key, decltype(lru)::iterator, cache_key_hash> index;
+    int64_t hits = 0, misses = 0;
+};
+
+ChannelEncryption::ChannelEncryption(
+        x25519_seckey private_key, x25519_pubkey public_key, bool server) :
+        private_key_{std::move(private_key)},
+        public_key_{std::move(public_key)},
+        server_{server},
+        key_cache_{std::make_unique<key_cache>()} {}
+
+ChannelEncryption::~ChannelEncryption() = default;
+
+ChannelEncryption::key_cache_stats ChannelEncryption::get_key_cache_stats() const {
+    std::lock_guard lock{key_cache_->mutex};
+    return {key_cache_->hits, key_cache_->misses, key_cache_->lru.size()};
+}
+
+std::array<unsigned char, 32> ChannelEncryption::symmetric_key(
+        EncryptType type, const x25519_pubkey& pubkey) const {
+    auto& cache = *key_cache_;
+    key_cache::cache_key k{pubkey, type};
+    auto now = std::chrono::steady_clock::now();
+    {
+        std::lock_guard lock{cache.mutex};
+        if (auto it = cache.index.find(k); it != cache.index.end()) {
+            if (it->second->expires > now) {
+                cache.hits++;
+                cache.lru.splice(cache.lru.begin(), cache.lru, it->second);
+                return it->second->symmetric_key;
+            }
+            cache.lru.erase(it->second);
+            cache.index.erase(it);
+        }
+        cache.misses++;
+    }
+
+    // Compute the key without holding the lock; this throws (and so doesn't cache anything) if
+    // the key exchange fails.
+    std::array<unsigned char, 32> key;
+    switch (type) {
+        case EncryptType::aes_cbc: key = calculate_shared_secret(private_key_, pubkey); break;
+        case EncryptType::aes_gcm: key = derive_symmetric_key(private_key_, pubkey); break;
+        case EncryptType::xchacha20:
+            key = xchacha20_shared_key(public_key_, private_key_, pubkey, !server_);
+            break;
+        default: throw std::runtime_error{"Invalid encryption type"};
+    }
+
+    std::lock_guard lock{cache.mutex};
+    if (!cache.index.count(k)) {  // Another thread might have beaten us to it
+        auto& e = cache.lru.emplace_front();
+        e.key = k;
+        e.symmetric_key = key;
+        e.expires = now + KEY_CACHE_EXPIRY;
+        cache.index.emplace(k, cache.lru.begin());
+        if (cache.lru.size() > KEY_CACHE_SIZE) {
+            cache.index.erase(cache.lru.back().key);
+            cache.lru.pop_back();
+        }
+    }
+    return key;
+}
+
 std::string ChannelEncryption::encrypt_xchacha20(
         std::string_view plaintext_, const x25519_pubkey& pubKey) const {
     auto plaintext = to_uchar(plaintext_);
@@ -254,7 +356,7 @@ std::string ChannelEncryption::encrypt_xchacha20(
             crypto_aead_xchacha20poly1305_ietf_NPUBBYTES + plaintext.size() +
             crypto_aead_xchacha20poly1305_ietf_ABYTES);
 
-    const auto key = xchacha20_shared_key(public_key_, private_key_, pubKey, !server_);
+    const auto key = symmetric_key(EncryptType::xchacha20, pubKey);
 
     // Generate random nonce, and stash it at the beginning of ciphertext:
     randombytes_buf(ciphertext.data(), crypto_aead_xchacha20poly1305_ietf_NPUBBYTES);
@@ -288,7 +390,7 @@ std::string ChannelEncryption::decrypt_xchacha20(
     if (ciphertext.size() < crypto_aead_xchacha20poly1305_ietf_ABYTES)
         throw std::runtime_error{"Invalid ciphertext: too short"};
 
-    const auto key = xchacha20_shared_key(public_key_, private_key_, pubKey, !server_);
+    const auto key = symmetric_key(EncryptType::xchacha20, pubKey);
 
     std::string plaintext;
     plaintext.resize(ciphertext.size() - crypto_aead_xchacha20poly1305_ietf_ABYTES);
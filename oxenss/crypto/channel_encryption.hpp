@@ -1,6 +1,10 @@
 #pragma once
 
 #include <oxenss/common/formattable.h>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <string_view>
 
@@ -31,10 +35,21 @@ inline constexpr std::string_view to_string(EncryptType type) {
 // Encryption/decription class for encryption/decrypting outgoing/incoming messages.
 class ChannelEncryption {
   public:
-    ChannelEncryption(x25519_seckey private_key, x25519_pubkey public_key, bool server = true) :
-            private_key_{std::move(private_key)},
-            public_key_{std::move(public_key)},
-            server_{server} {}
+    ChannelEncryption(x25519_seckey private_key, x25519_pubkey public_key, bool server = true);
+    ~ChannelEncryption();
+
+    // Derived symmetric keys are cached (keyed by remote pubkey and encryption type) so that
+    // repeated messages to or from the same remote key skip the key exchange.  The cache holds up
+    // to KEY_CACHE_SIZE keys, each for at most KEY_CACHE_EXPIRY after it was derived.
+    static constexpr size_t KEY_CACHE_SIZE = 10'000;
+    static constexpr std::chrono::seconds KEY_CACHE_EXPIRY = 10min;
+
+    struct key_cache_stats {
+        int64_t hits = 0;
+        int64_t misses = 0;
+        size_t size = 0;
+    };
+    key_cache_stats get_key_cache_stats() const;
 
     // Encrypts `plaintext` message using encryption `type`. `pubkey` is the recipients public
     // key. `reply` should be false for a client-to-snode message, and true on a returning
@@ -68,6 +83,13 @@ class ChannelEncryption {
     const x25519_seckey private_key_;
     const x25519_pubkey public_key_;
     bool server_;  // True if we are the server (i.e. the snode).
+
+    struct key_cache;
+    std::unique_ptr<key_cache> key_cache_;
+
+    // Returns the symmetric key used for `type` encryption with `pubkey`, from the cache if
+    // possible.
+    std::array<unsigned char, 32> symmetric_key(EncryptType type, const x25519_pubkey& pubkey) const;
 };
 
 }  // namespace oxen::crypto
@@ -3,7 +3,10 @@
 #include <oxenss/logging/oxen_logger.h>
 
 #include <cstring>
+#include <list>
+#include <mutex>
 #include <type_traits>
+#include <unordered_map>
 
 #include <oxenc/base32z.h>
 #include <oxenc/base64.h>
@@ -138,4 +141,49 @@ std::array<unsigned char, 32> subkey_verify_key(
     return subkey_pub;
 }
 
+namespace {
+
+    // LRU cache of pubkey||subkey -> derived verification key
+    struct subkey_cache {
+        std::mutex mutex;
+        std::list<std::pair<std::string, std::array<unsigned char, 32>>> lru;
+        std::unordered_map<std::string_view, decltype(lru)::iterator> index;
+    };
+
+}  // namespace
+
+std::array<unsigned char, 32> cached_subkey_verify_key(
+        const unsigned char* pubkey, const unsigned char* subkey) {
+    static subkey_cache cache;
+
+    std::string key;
+    key.reserve(64);
+    key.append(reinterpret_cast<const char*>(pubkey), 32);
+    key.append(reinterpret_cast<const char*>(subkey), 32);
+
+    {
+        std::lock_guard lock{cache.mutex};
+        if (auto it = cache.index.find(key); it != cache.index.end()) {
+            cache.lru.splice(cache.lru.begin(), cache.lru, it->second);
+            return it->second->second;
+        }
+    }
+
+    // Not cached: compute it without holding the lock (this throws, and so doesn't get cached, for
+    // an invalid pubkey/subkey).
+    auto verify_key = subkey_verify_key(pubkey, subkey);
+
+    std::lock_guard lock{cache.mutex};
+    // Another thread may have added it in the meantime
+    if (cache.index.count(key))
+        return verify_key;
+    auto& entry = cache.lru.emplace_front(std::move(key), verify_key);
+    cache.index.emplace(entry.first, cache.lru.begin());
+    if (cache.lru.size() > SUBKEY_CACHE_SIZE) {
+        cache.index.erase(cache.lru.back().first);
+        cache.lru.pop_back();
+    }
+    return verify_key;
+}
+
 }  // namespace oxen::crypto
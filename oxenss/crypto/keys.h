@@ -16,6 +16,9 @@ using namespace std::literals;
 
 constexpr std::string_view SUBKEY_HASH_KEY = "OxenSSSubkey"sv;
 
+// Maximum number of derived subkey verification keys that cached_subkey_verify_key remembers.
+inline constexpr size_t SUBKEY_CACHE_SIZE = 10'000;
+
 namespace detail {
     template <size_t Length>
     inline constexpr std::array<unsigned char, Length> null_bytes = {0};
@@ -99,6 +102,12 @@ std::array<unsigned char, 32> subkey_verify_key(std::string_view pubkey, std::st
 std::array<unsigned char, 32> subkey_verify_key(
         const unsigned char* pubkey, const unsigned char* subkey);
 
+/// Same as subkey_verify_key, but remembers the most recently used SUBKEY_CACHE_SIZE derived keys
+/// so that repeated requests using the same pubkey and subkey don't have to redo the scalar
+/// multiplication.  Safe to call from multiple threads.
+std::array<unsigned char, 32> cached_subkey_verify_key(
+        const unsigned char* pubkey, const unsigned char* subkey);
+
 }  // namespace oxen::crypto
 
 template <>
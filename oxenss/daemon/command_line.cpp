@@ -1,5 +1,6 @@
 #include "command_line.h"
 #include <oxenss/logging/oxen_logger.h>
+#include <oxenss/utils/affinity.hpp>
 #include <oxenss/version.h>
 
 #include <CLI/CLI.hpp>
@@ -34,6 +35,18 @@ static std::optional<std::filesystem::path> get_home_dir() {
     return std::nullopt;
 }
 
+// Validator for the thread placement options
+static const CLI::Validator cpu_set_validator{[](std::string& spec) -> std::string {
+    if (spec.empty())
+        return "";
+    try {
+        util::cpu_set::parse(spec);
+    } catch (const std::invalid_argument& e) {
+        return e.what();
+    }
+    return "";
+}};
+
 class WrapFormatter : public CLI::Formatter {
   private:
     size_t term_width_ = 0;
@@ -133,6 +146,372 @@ parse_result parse_cli_args(int argc, char* argv[]) {
                (options.data_dir / "storage-server.conf").u8string(),
                "Path to config file specifying additional command-line options")
             ->capture_default_str();
+    cli.add_option(
+               "--db-shards",
+               options.db_shards,
+               "Number of database files to split stored messages across (by account); values "
+               "greater than 1 allow concurrent writes for different accounts.  Changing this "
+               "migrates existing data to the new layout at startup")
+            ->type_name("N")
+            ->check(CLI::Range(1, 64))
+            ->capture_default_str();
+    cli.add_option(
+               "--db-cold-threshold",
+               options.db_cold_threshold,
+               "Store message payloads of at least this many bytes in append-only segment files "
+               "next to the database rather than in the database itself; 0 keeps everything in "
+               "the database")
+            ->type_name("BYTES")
+            ->capture_default_str();
+    cli.add_option(
+               "--db-online-migration",
+               options.db_online_migration,
+               "When the database needs migrating (after an upgrade from an old schema, or a "
+               "change of --db-shards), start serving right away and move the old data over in "
+               "the background, rather than migrating everything before starting up")
+            ->type_name("BOOL")
+            ->capture_default_str();
+    cli.add_option(
+               "--db-tuning",
+               options.db_tuning,
+               "Tune sqlite3 for large databases: memory-map the database files, use a larger "
+               "page cache (see --db-mmap-size and --db-cache-size), keep temporary tables in "
+               "memory, and checkpoint the write-ahead log from a background thread rather than "
+               "during writes")
+            ->type_name("BOOL")
+            ->capture_default_str();
+    cli.add_option(
+               "--db-mmap-size",
+               options.db_mmap_size,
+               "With --db-tuning, how much of each database file (in MiB) to access through a "
+               "memory map; 0 disables memory-mapped I/O")
+            ->type_name("MiB")
+            ->check(CLI::Range(0, 2047))
+            ->capture_default_str();
+    cli.add_option(
+               "--db-cache-size",
+               options.db_cache_size,
+               "With --db-tuning, the size (in MiB) of each database file's page cache")
+            ->type_name("MiB")
+            ->check(CLI::Range(1, 65536))
+            ->capture_default_str();
+    cli.add_option(
+               "--db-wal-autocheckpoint",
+               options.db_wal_autocheckpoint,
+               "Checkpoint the database write-ahead log once it reaches this many pages")
+            ->type_name("PAGES")
+            ->check(CLI::Range(1, 1000000))
+            ->capture_default_str();
+    cli.add_option(
+               "--db-ingest-journal",
+               options.db_ingest_journal,
+               "Acknowledge stores once they are synced to an append-only journal next to each "
+               "database file, and write them into the database in the background")
+            ->type_name("BOOL")
+            ->capture_default_str();
+    cli.add_option(
+               "--db-evict",
+               options.db_evict,
+               "When the database gets close to full, evict the messages that expire soonest "
+               "(in the background) to make room for new ones, rather than rejecting new "
+               "messages until enough old ones expire")
+            ->type_name("BOOL")
+            ->capture_default_str();
+    cli.add_option(
+               "--db-account-quota",
+               options.db_account_quota,
+               "With --db-evict, a soft limit (in MiB) on each account's stored messages: when "
+               "messages need to be evicted, accounts over the limit lose their soonest-expiring "
+               "messages first.  0 for no limit")
+            ->type_name("MiB")
+            ->capture_default_str();
+    cli.add_option(
+               "--https-threads",
+               options.https_threads,
+               "Number of threads (each with its own event loop) accepting and serving HTTPS "
+               "connections; values greater than 1 share the HTTPS port between them using "
+               "SO_REUSEPORT")
+            ->type_name("N")
+            ->check(CLI::Range(1, 64))
+            ->capture_default_str();
+    cli.add_option(
+               "--tls-session-tickets",
+               options.tls_session_tickets,
+               "Issue TLS session tickets so that returning clients can resume sessions without a "
+               "full handshake")
+            ->type_name("BOOL")
+            ->capture_default_str();
+    cli.add_option(
+               "--tls-ticket-rotation",
+               options.tls_ticket_rotation,
+               "How often (in hours) to rotate the TLS session ticket encryption key; tickets "
+               "issued under the previous key remain valid for one more rotation")
+            ->type_name("HOURS")
+            ->check(CLI::Range(1, 168))
+            ->capture_default_str();
+    cli.add_option(
+               "--tls-session-cache",
+               options.tls_session_cache,
+               "Number of TLS sessions to cache server-side for clients that don't use session "
+               "tickets, per HTTPS thread; 0 disables the cache")
+            ->type_name("N")
+            ->check(CLI::Range(0L, 1L << 20))
+            ->capture_default_str();
+    cli.add_option(
+               "--compress-min-size",
+               options.compress_min_size,
+               "Minimum size (in bytes) of a client response (such as a retrieve) to compress for "
+               "clients that accept compressed responses (via Accept-Encoding over HTTPS, or the "
+               "encoding request part over OMQ); 0 disables compression")
+            ->type_name("BYTES")
+            ->capture_default_str();
+    cli.add_option(
+               "--compress-level",
+               options.compress_level,
+               "Compression level for compressed responses, from 1 (fastest) to 9 (smallest)")
+            ->type_name("N")
+            ->check(CLI::Range(1, 9))
+            ->capture_default_str();
+    cli.add_option(
+               "--notify-batch-window",
+               options.notify_batch_window,
+               "Maximum time (in milliseconds) that new message notifications are held for "
+               "monitor subscribers that requested batched notify.messages delivery")
+            ->type_name("MS")
+            ->check(CLI::Range(1, 10000))
+            ->capture_default_str();
+    cli.add_option(
+               "--notify-batch-size",
+               options.notify_batch_size,
+               "Maximum size (in bytes) of a batched notify.messages message; larger batches are "
+               "sent early")
+            ->type_name("BYTES")
+            ->check(CLI::Range(1024, 8 * 1024 * 1024))
+            ->capture_default_str();
+    cli.add_option(
+               "--forward-batch-window",
+               options.forward_batch_window,
+               "Maximum time (in milliseconds) that recursive client requests are held to be "
+               "forwarded to each swarm member along with others as one sn.storage_cc_batch "
+               "request; 0 forwards each request individually.  Only enable this once all swarm "
+               "members support sn.storage_cc_batch.")
+            ->type_name("MS")
+            ->check(CLI::Range(0, 1000))
+            ->capture_default_str();
+    cli.add_option(
+               "--omq-general-threads",
+               options.omq_general_threads,
+               "Number of oxenmq worker threads shared by all request categories (in addition to "
+               "the threads reserved for particular categories)")
+            ->type_name("N")
+            ->check(CLI::Range(1, 256))
+            ->capture_default_str();
+    cli.add_option(
+               "--omq-sn-threads",
+               options.omq_sn_threads,
+               "Number of oxenmq worker threads reserved for requests from other service nodes "
+               "(swarm traffic, storage tests)")
+            ->type_name("N")
+            ->check(CLI::Range(0, 256))
+            ->capture_default_str();
+    cli.add_option(
+               "--omq-sn-queue",
+               options.omq_sn_queue,
+               "Maximum number of queued requests from other service nodes; further requests are "
+               "dropped")
+            ->type_name("N")
+            ->check(CLI::Range(1, 1'000'000))
+            ->capture_default_str();
+    cli.add_option(
+               "--omq-storage-threads",
+               options.omq_storage_threads,
+               "Number of oxenmq worker threads reserved for client requests made over OMQ")
+            ->type_name("N")
+            ->check(CLI::Range(0, 256))
+            ->capture_default_str();
+    cli.add_option(
+               "--omq-storage-queue",
+               options.omq_storage_queue,
+               "Maximum number of queued client requests made over OMQ; further requests are "
+               "dropped")
+            ->type_name("N")
+            ->check(CLI::Range(1, 1'000'000))
+            ->capture_default_str();
+    cli.add_option(
+               "--omq-monitor-threads",
+               options.omq_monitor_threads,
+               "Number of oxenmq worker threads reserved for monitor subscription requests")
+            ->type_name("N")
+            ->check(CLI::Range(0, 256))
+            ->capture_default_str();
+    cli.add_option(
+               "--omq-monitor-queue",
+               options.omq_monitor_queue,
+               "Maximum number of queued monitor subscription requests; further requests are "
+               "dropped")
+            ->type_name("N")
+            ->check(CLI::Range(1, 1'000'000))
+            ->capture_default_str();
+    cli.add_option(
+               "--https-worker-threads",
+               options.https_worker_threads,
+               "Number of oxenmq worker threads reserved for handling HTTPS requests (separate "
+               "from the --https-threads event loops that accept them)")
+            ->type_name("N")
+            ->check(CLI::Range(0, 256))
+            ->capture_default_str();
+    cli.add_option(
+               "--https-queue",
+               options.https_queue,
+               "Maximum number of queued HTTPS requests; further requests get a 503 reply")
+            ->type_name("N")
+            ->check(CLI::Range(1, 1'000'000))
+            ->capture_default_str();
+    cli.add_option(
+               "--shed-queue-wait",
+               options.shed_queue_wait,
+               "Average queue wait (in milliseconds) above which low-priority client requests "
+               "(retrieves, oxend and onion proxy requests) are rejected with a 503 until the "
+               "wait falls back below half of this; 0 never rejects them")
+            ->type_name("MS")
+            ->check(CLI::Range(0, 60'000))
+            ->capture_default_str();
+    cli.add_option(
+               "--cpus",
+               options.cpus,
+               "Run on these CPUs: a CPU list such as 0-7,16-23, or a NUMA node such as node0.  "
+               "This applies to every thread not placed by one of the more specific --*-cpus "
+               "options (e.g. the general oxenmq workers); by default threads can run anywhere")
+            ->type_name("CPUS")
+            ->check(cpu_set_validator);
+    cli.add_option(
+               "--https-cpus",
+               options.https_cpus,
+               "Run the HTTPS event loop threads (see --https-threads) on these CPUs")
+            ->type_name("CPUS")
+            ->check(cpu_set_validator);
+    cli.add_option(
+               "--omq-sn-cpus",
+               options.omq_sn_cpus,
+               "Run requests from other service nodes on these CPUs.  Workers move to a request "
+               "category's CPUs when they start one of its requests, so this also covers general "
+               "workers that pick up such requests")
+            ->type_name("CPUS")
+            ->check(cpu_set_validator);
+    cli.add_option(
+               "--omq-storage-cpus",
+               options.omq_storage_cpus,
+               "Run client requests made over OMQ on these CPUs")
+            ->type_name("CPUS")
+            ->check(cpu_set_validator);
+    cli.add_option(
+               "--omq-monitor-cpus",
+               options.omq_monitor_cpus,
+               "Run monitor subscription requests on these CPUs")
+            ->type_name("CPUS")
+            ->check(cpu_set_validator);
+    cli.add_option(
+               "--https-worker-cpus",
+               options.https_worker_cpus,
+               "Run the handling of HTTPS requests (see --https-worker-threads) on these CPUs")
+            ->type_name("CPUS")
+            ->check(cpu_set_validator);
+    cli.add_option(
+               "--db-cpus",
+               options.db_cpus,
+               "Run the database's background threads (checkpoints and the ingest journal) on "
+               "these CPUs")
+            ->type_name("CPUS")
+            ->check(cpu_set_validator);
+    cli.add_option(
+               "--rate-limit-burst",
+               options.rate_limit_burst,
+               "Maximum number of requests a client or service node can make in a burst before "
+               "being rate limited")
+            ->type_name("N")
+            ->check(CLI::Range(1, 1'000'000))
+            ->capture_default_str();
+    cli.add_option(
+               "--rate-limit-client",
+               options.rate_limit_client,
+               "Sustained number of requests per second allowed from a single client IP")
+            ->type_name("N")
+            ->check(CLI::Range(1, 1'000'000))
+            ->capture_default_str();
+    cli.add_option(
+               "--rate-limit-sn",
+               options.rate_limit_sn,
+               "Sustained number of requests per second allowed from a single service node")
+            ->type_name("N")
+            ->check(CLI::Range(1, 1'000'000))
+            ->capture_default_str();
+    cli.add_option(
+               "--rate-limit-max-clients",
+               options.rate_limit_max_clients,
+               "Maximum number of client IPs tracked for rate limiting; new clients beyond this "
+               "are rate limited until existing clients go idle")
+            ->type_name("N")
+            ->check(CLI::Range(1, 100'000'000))
+            ->capture_default_str();
+    cli.add_option(
+               "--rate-limit-ipv6-prefix",
+               options.rate_limit_ipv6_prefix,
+               "IPv6 clients are rate limited together by network prefix of this length (e.g. 64 "
+               "for a /64, 56 for a /56)")
+            ->type_name("BITS")
+            ->check(CLI::Range(32, 64))
+            ->capture_default_str();
+    cli.add_option(
+               "--trace-sample-rate",
+               options.trace_sample_rate,
+               "Fraction of client requests to trace in detail (timing each step of handling the "
+               "request); the slowest recent traces are available via the get_traces admin "
+               "endpoint")
+            ->type_name("FRACTION")
+            ->check(CLI::Range(0.0, 1.0))
+            ->capture_default_str();
+    cli.add_option(
+               "--trace-slow-ms",
+               options.trace_slow_ms,
+               "Also keep traces of client requests that take at least this long (in "
+               "milliseconds); 0 disables")
+            ->type_name("MS")
+            ->capture_default_str();
+    cli.add_option(
+               "--recursive-quorum",
+               options.recursive_quorum,
+               "Reply to recursive client requests (e.g. delete_all) once this fraction of the "
+               "swarm has answered, rather than waiting for every swarm member")
+            ->type_name("FRACTION")
+            ->check(CLI::Range(0.0, 1.0))
+            ->capture_default_str();
+    cli.add_option(
+               "--recursive-deadline-ms",
+               options.recursive_deadline_ms,
+               "Reply to recursive client requests after this many milliseconds even if the "
+               "--recursive-quorum hasn't been reached yet; 0 disables")
+            ->type_name("MS")
+            ->capture_default_str();
+    cli.add_option(
+               "--capture-file",
+               options.capture_file,
+               "Record the anonymized shapes and timings of a sample of incoming requests to this "
+               "file, for replaying as a benchmark load with contrib/replay (replaces any existing "
+               "file)")
+            ->type_name("FILE");
+    cli.add_option(
+               "--capture-sample-rate",
+               options.capture_sample_rate,
+               "Fraction of requests to record with --capture-file")
+            ->type_name("FRACTION")
+            ->check(CLI::Range(0.0, 1.0))
+            ->capture_default_str();
+    cli.add_option(
+               "--capture-max-size",
+               options.capture_max_size,
+               "Stop recording once the --capture-file reaches this size (in MiB)")
+            ->type_name("MIB")
+            ->capture_default_str();
     cli.add_option(
                "--log-level",
                options.log_level,
@@ -184,7 +563,7 @@ parse_result parse_cli_args(int argc, char* argv[]) {
                "--stats-access-key",
                options.stats_access_keys,
                "One or more public keys (x25519) that will be granted access to the "
-               "`get_stats` omq endpoint")
+               "`get_stats` omq endpoint and the /metrics/v1 HTTPS endpoint")
             ->type_name("PUBKEY");
     cli.set_version_flag("--version,-v", std::string{oxen::STORAGE_SERVER_VERSION_INFO});
 
@@ -16,6 +16,65 @@ struct command_line_options {
     bool testnet = false;
     std::string log_level = "info";
     std::filesystem::path data_dir;
+    size_t db_shards = 1;  // Number of database files to split messages across
+    size_t db_cold_threshold = 0;  // Payload size (bytes) to store in segment files; 0 = never
+    bool db_online_migration = true;  // Migrate old data in the background rather than at startup
+    // sqlite3 tuning (see db_tuning); the sizes only apply with db_tuning on
+    bool db_tuning = false;
+    uint32_t db_mmap_size = 1024;  // MiB per database file
+    uint32_t db_cache_size = 64;   // MiB per database file
+    uint32_t db_wal_autocheckpoint = 1000;  // pages
+    bool db_ingest_journal = false;  // Acknowledge stores from a journal (see db_tuning)
+    // Eviction of unexpired messages when the database gets full (see db_eviction)
+    bool db_evict = false;
+    uint32_t db_account_quota = 0;  // MiB; 0 = no quota
+    size_t https_threads = 1;  // Number of HTTPS event loop threads
+    // TLS session resumption (see server::tls_session_config for the defaults)
+    bool tls_session_tickets = true;
+    uint32_t tls_ticket_rotation = 12;  // hours
+    long tls_session_cache = 20480;
+    // Compression of large client responses (see util::compression_config for the defaults)
+    uint32_t compress_min_size = 16 * 1024;  // bytes; 0 = never compress
+    int compress_level = 3;
+    // notify.messages batching (see server::OMQ for the defaults)
+    uint32_t notify_batch_window = 100;  // milliseconds
+    uint32_t notify_batch_size = 256 * 1024;
+    uint32_t forward_batch_window = 0;  // milliseconds; 0 = don't batch
+    // Worker threads and queue sizes (see server::worker_config for the defaults)
+    int omq_general_threads = 1;
+    int omq_sn_threads = 2;
+    int omq_sn_queue = 1000;
+    int omq_storage_threads = 1;
+    int omq_storage_queue = 200;
+    int omq_monitor_threads = 1;
+    int omq_monitor_queue = 500;
+    int https_worker_threads = 2;
+    int https_queue = 1000;
+    uint32_t shed_queue_wait = 500;  // milliseconds; 0 = never shed
+    // Thread placement: CPU lists or NUMA nodes (see util::cpu_set); empty = no restriction
+    std::string cpus;  // Default for every thread not placed more specifically
+    std::string https_cpus;
+    std::string omq_sn_cpus;
+    std::string omq_storage_cpus;
+    std::string omq_monitor_cpus;
+    std::string https_worker_cpus;
+    std::string db_cpus;
+    // Rate limiting (see rpc::rate_limit_config for the defaults)
+    uint32_t rate_limit_burst = 600;
+    uint32_t rate_limit_client = 300;
+    uint32_t rate_limit_sn = 600;
+    uint32_t rate_limit_max_clients = 10000;
+    int rate_limit_ipv6_prefix = 64;
+    // Request tracing (see util::trace_config)
+    double trace_sample_rate = 0;
+    uint32_t trace_slow_ms = 0;  // 0 = don't keep slow traces
+    // Early replies to recursive requests (see rpc::recursive_config)
+    double recursive_quorum = 1.0;
+    uint32_t recursive_deadline_ms = 0;  // 0 = no deadline
+    // Request capture for load replay (see rpc::capture_config)
+    std::filesystem::path capture_file;
+    double capture_sample_rate = 0.01;
+    uint32_t capture_max_size = 1024;  // MiB
     std::string oxend_key;          // test only (but needed for backwards compatibility)
     std::string oxend_x25519_key;   // test only
     std::string oxend_ed25519_key;  // test only
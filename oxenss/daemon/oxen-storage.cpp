@@ -4,12 +4,15 @@
 #include <oxenss/crypto/keys.h>
 #include <oxenss/logging/oxen_logger.h>
 #include <oxenss/rpc/oxend_rpc.h>
+#include <oxenss/rpc/rate_limiter.h>
 #include <oxenss/rpc/request_handler.h>
 #include <oxenss/server/https.h>
 #include <oxenss/server/omq.h>
 #include <oxenss/server/server_certificates.h>
 #include <oxenss/snode/service_node.h>
 #include <oxenss/snode/swarm.h>
+#include <oxenss/utils/affinity.hpp>
+#include <oxenss/utils/compression.hpp>
 #include <oxenss/version.h>
 
 #include <oxenmq/oxenmq.h>
@@ -58,6 +61,15 @@ int main(int argc, char* argv[]) {
     if (!fs::exists(options.data_dir))
         fs::create_directories(options.data_dir);
 
+    // (The specs have already been validated by the command line parser)
+    auto cpus = [](const std::string& spec) {
+        return spec.empty() ? util::cpu_set{} : util::cpu_set::parse(spec);
+    };
+    // Threads start out on the CPUs of the thread that creates them, so placing the main thread
+    // first (before the logger, oxenmq, etc. start theirs) makes this the default for all of them.
+    const auto default_cpus = cpus(options.cpus);
+    default_cpus.apply();
+
     log::Level log_level;
     try {
         log_level = log::level_from_string(options.log_level);
@@ -90,6 +102,29 @@ int main(int argc, char* argv[]) {
 
     log::info(logcat, "Setting log level to {}", options.log_level);
     log::info(logcat, "Setting database location to {}", options.data_dir);
+    if (options.db_shards > 1)
+        log::info(logcat, "Splitting database across {} shards", options.db_shards);
+    if (options.db_cold_threshold > 0)
+        log::info(
+                logcat,
+                "Storing message payloads of {} bytes or more in segment files",
+                options.db_cold_threshold);
+    if (options.db_tuning)
+        log::info(
+                logcat,
+                "Using database tuning: {} MiB memory map, {} MiB page cache, background "
+                "checkpoints",
+                options.db_mmap_size,
+                options.db_cache_size);
+    if (options.db_ingest_journal)
+        log::info(logcat, "Acknowledging stores from the database ingest journal");
+    if (!default_cpus.empty())
+        log::info(logcat, "Running on CPUs {}", default_cpus.to_string());
+    if (options.db_evict)
+        log::info(
+                logcat,
+                "Evicting messages when the database is nearly full (account quota: {} MiB)",
+                options.db_account_quota);
     log::info(logcat, "Connecting to oxend @ {}", options.oxend_omq_rpc);
 
     if (sodium_init() != 0) {
@@ -144,16 +179,94 @@ int main(int argc, char* argv[]) {
 
         // Set up oxenmq now, but don't actually start it until after we set up the ServiceNode
         // instance (because ServiceNode and OxenmqServer reference each other).
-        auto oxenmq_server_ptr =
-                std::make_unique<server::OMQ>(me, private_key_x25519, stats_access_keys);
+        server::worker_config workers;
+        workers.general_threads = options.omq_general_threads;
+        workers.sn_threads = options.omq_sn_threads;
+        workers.sn_queue = options.omq_sn_queue;
+        workers.storage_threads = options.omq_storage_threads;
+        workers.storage_queue = options.omq_storage_queue;
+        workers.monitor_threads = options.omq_monitor_threads;
+        workers.monitor_queue = options.omq_monitor_queue;
+        workers.https_threads = options.https_worker_threads;
+        workers.https_queue = options.https_queue;
+        workers.shed_wait = std::chrono::milliseconds{options.shed_queue_wait};
+        workers.sn_cpus = cpus(options.omq_sn_cpus);
+        workers.storage_cpus = cpus(options.omq_storage_cpus);
+        workers.monitor_cpus = cpus(options.omq_monitor_cpus);
+        workers.https_cpus = cpus(options.https_worker_cpus);
+
+        util::compression_config compression;
+        compression.min_size = options.compress_min_size;
+        compression.level = options.compress_level;
+
+        auto oxenmq_server_ptr = std::make_unique<server::OMQ>(
+                me,
+                private_key_x25519,
+                stats_access_keys,
+                std::chrono::milliseconds{options.notify_batch_window},
+                options.notify_batch_size,
+                std::chrono::milliseconds{options.forward_batch_window},
+                workers,
+                compression);
         auto& oxenmq_server = *oxenmq_server_ptr;
 
-        snode::ServiceNode service_node{
-                me, private_key, oxenmq_server, options.data_dir, options.force_start};
+        db_tuning tuning;
+        tuning.wal_autocheckpoint = static_cast<int>(options.db_wal_autocheckpoint);
+        tuning.ingest_journal = options.db_ingest_journal;
+        tuning.thread_cpus = cpus(options.db_cpus);
+        if (options.db_tuning) {
+            tuning.mmap_size = int64_t{options.db_mmap_size} * 1024 * 1024;
+            tuning.cache_size = int64_t{options.db_cache_size} * 1024 * 1024;
+            tuning.temp_store_memory = true;
+            tuning.background_checkpoint = true;
+        }
 
-        rpc::RequestHandler request_handler{service_node, channel_encryption, private_key_ed25519};
+        db_eviction eviction;
+        eviction.enabled = options.db_evict;
+        eviction.account_quota = int64_t{options.db_account_quota} * 1024 * 1024;
 
-        rpc::RateLimiter rate_limiter{*oxenmq_server};
+        snode::ServiceNode service_node{
+                me,
+                private_key,
+                oxenmq_server,
+                options.data_dir,
+                options.db_shards,
+                options.db_cold_threshold,
+                options.db_online_migration,
+                tuning,
+                eviction,
+                options.force_start};
+
+        util::trace_config trace;
+        trace.sample_rate = options.trace_sample_rate;
+        trace.slow_threshold = std::chrono::milliseconds{options.trace_slow_ms};
+        rpc::recursive_config recursive;
+        recursive.quorum = options.recursive_quorum;
+        recursive.deadline = std::chrono::milliseconds{options.recursive_deadline_ms};
+        rpc::capture_config capture;
+        capture.file = options.capture_file;
+        capture.sample_rate = options.capture_sample_rate;
+        capture.max_size = uint64_t{options.capture_max_size} * 1024 * 1024;
+        rpc::RequestHandler request_handler{
+                service_node,
+                channel_encryption,
+                private_key_ed25519,
+                trace,
+                recursive,
+                capture};
+
+        rpc::rate_limit_config rate_limits;
+        rate_limits.bucket_size = options.rate_limit_burst;
+        rate_limits.token_rate = options.rate_limit_client;
+        rate_limits.token_rate_sn = options.rate_limit_sn;
+        rate_limits.max_clients = options.rate_limit_max_clients;
+        rate_limits.ipv6_prefix = static_cast<uint8_t>(options.rate_limit_ipv6_prefix);
+        rpc::RateLimiter rate_limiter{*oxenmq_server, rate_limits};
+
+        server::tls_session_config tls_sessions;
+        tls_sessions.tickets = options.tls_session_tickets;
+        tls_sessions.ticket_rotation = std::chrono::hours{options.tls_ticket_rotation};
+        tls_sessions.cache_size = options.tls_session_cache;
 
         server::HTTPS https_server{
                 service_node,
@@ -163,7 +276,13 @@ int main(int argc, char* argv[]) {
                 ssl_cert,
                 ssl_key,
                 ssl_dh,
-                {me.pubkey_legacy, private_key}};
+                {me.pubkey_legacy, private_key},
+                options.https_threads,
+                tls_sessions,
+                private_key_x25519,
+                stats_access_keys,
+                cpus(options.https_cpus),
+                compression};
 
         oxenmq_server.init(
                 &service_node,
@@ -197,6 +316,7 @@ int main(int argc, char* argv[]) {
         log::info(logcat, "Stopping omq server");
         oxenmq_server_ptr.reset();
         log::info(logcat, "Shutting down");
+        logging::shutdown();
     } catch (const std::exception& e) {
         // It seems possible for logging to throw its own exception,
         // in which case it will be propagated to libc...
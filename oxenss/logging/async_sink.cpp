@@ -0,0 +1,193 @@
+#include "async_sink.h"
+
+#include <fmt/format.h>
+
+namespace oxen::logging {
+
+using namespace std::literals;
+
+namespace {
+    size_t round_up_pow2(size_t n) {
+        size_t p = 2;
+        while (p < n)
+            p <<= 1;
+        return p;
+    }
+}  // namespace
+
+async_sink::async_sink(std::vector<spdlog::sink_ptr> sinks, size_t capacity) :
+        sinks_{std::move(sinks)},
+        mask_{round_up_pow2(capacity) - 1},
+        slots_{std::make_unique<slot[]>(mask_ + 1)} {
+    for (size_t i = 0; i <= mask_; i++)
+        slots_[i].seq.store(i, std::memory_order_relaxed);
+    writer_ = std::thread{[this] { run(); }};
+}
+
+async_sink::~async_sink() {
+    stop();
+}
+
+void async_sink::stop() {
+    {
+        std::lock_guard lock{mutex_};
+        if (stopping_)
+            return;
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    writer_.join();
+    running_ = false;
+    // Pick up anything queued while the writer was finishing up
+    while (pop_and_write())
+        ;
+    std::lock_guard lock{write_mutex_};
+    for (auto& s : sinks_)
+        s->flush();
+}
+
+bool async_sink::try_push(const spdlog::details::log_msg& msg) {
+    auto pos = head_.load(std::memory_order_relaxed);
+    while (true) {
+        auto& s = slots_[pos & mask_];
+        auto seq = s.seq.load(std::memory_order_acquire);
+        auto diff = static_cast<std::ptrdiff_t>(seq - pos);
+        if (diff == 0) {
+            if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                s.msg = spdlog::details::log_msg_buffer{msg};
+                s.seq.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            // The slot still holds the message from one lap ago: we're full
+            return false;
+        } else {
+            pos = head_.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool async_sink::pop_and_write() {
+    auto pos = tail_.load(std::memory_order_relaxed);
+    auto& s = slots_[pos & mask_];
+    if (s.seq.load(std::memory_order_acquire) != pos + 1)
+        return false;
+    write(s.msg);
+    s.seq.store(pos + mask_ + 1, std::memory_order_release);
+    tail_.store(pos + 1, std::memory_order_release);
+    written_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void async_sink::write(const spdlog::details::log_msg& msg) {
+    std::lock_guard lock{write_mutex_};
+    for (auto& s : sinks_) {
+        if (!s->should_log(msg.level))
+            continue;
+        try {
+            s->log(msg);
+        } catch (...) {
+            // Nowhere to report a failure to log; carry on with the other sinks.
+        }
+    }
+}
+
+void async_sink::log(const spdlog::details::log_msg& msg) {
+    if (!running_.load(std::memory_order_relaxed))
+        return write(msg);
+    if (try_push(msg)) {
+        if (sleeping_.load())
+            cv_.notify_one();
+        return;
+    }
+    if (msg.level >= spdlog::level::err)
+        return write(msg);
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void async_sink::flush() {
+    if (!running_) {
+        std::lock_guard lock{write_mutex_};
+        for (auto& s : sinks_)
+            s->flush();
+        return;
+    }
+    auto target = head_.load();
+    std::unique_lock lock{mutex_};
+    // The writer might not see the last messages yet if their producers are still storing them,
+    // so keep asking until it has gotten past them.
+    while (flushed_ < target && running_) {
+        flush_requested_ = true;
+        cv_.notify_one();
+        flushed_cv_.wait_for(lock, 10ms);
+    }
+}
+
+void async_sink::set_pattern(const std::string& pattern) {
+    std::lock_guard lock{write_mutex_};
+    for (auto& s : sinks_)
+        s->set_pattern(pattern);
+}
+
+void async_sink::set_formatter(std::unique_ptr<spdlog::formatter> formatter) {
+    std::lock_guard lock{write_mutex_};
+    for (auto& s : sinks_)
+        s->set_formatter(formatter->clone());
+}
+
+async_sink::stats async_sink::get_stats() const {
+    auto tail = tail_.load(std::memory_order_relaxed);
+    auto head = head_.load(std::memory_order_relaxed);
+    return {written_.load(std::memory_order_relaxed),
+            dropped_.load(std::memory_order_relaxed),
+            head > tail ? head - tail : 0};
+}
+
+void async_sink::run() {
+    auto ready = [this] {
+        auto pos = tail_.load(std::memory_order_relaxed);
+        return slots_[pos & mask_].seq.load(std::memory_order_acquire) == pos + 1;
+    };
+
+    std::unique_lock lock{mutex_, std::defer_lock};
+    while (true) {
+        bool wrote = false;
+        while (pop_and_write())
+            wrote = true;
+
+        if (auto dropped = dropped_.load(std::memory_order_relaxed); dropped > reported_dropped_) {
+            write(spdlog::details::log_msg{
+                    "logging",
+                    spdlog::level::warn,
+                    fmt::format(
+                            "Log writer fell behind; dropped {} log messages",
+                            dropped - reported_dropped_)});
+            reported_dropped_ = dropped;
+        }
+
+        lock.lock();
+        if (flush_requested_) {
+            lock.unlock();
+            {
+                std::lock_guard wlock{write_mutex_};
+                for (auto& s : sinks_)
+                    s->flush();
+            }
+            lock.lock();
+            flushed_ = tail_.load(std::memory_order_relaxed);
+            flush_requested_ = false;
+            flushed_cv_.notify_all();
+        }
+        if (stopping_ && !ready())
+            break;
+        if (!wrote) {
+            sleeping_ = true;
+            // The timeout covers a producer's notify racing with us going to sleep
+            cv_.wait_for(lock, 50ms, [&] { return stopping_ || flush_requested_ || ready(); });
+            sleeping_ = false;
+        }
+        lock.unlock();
+    }
+}
+
+}  // namespace oxen::logging
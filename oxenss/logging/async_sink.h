@@ -0,0 +1,88 @@
+#pragma once
+
+#include <spdlog/details/log_msg_buffer.h>
+#include <spdlog/sinks/sink.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace oxen::logging {
+
+// Sink that hands log messages off to a background thread which formats and writes them to the
+// wrapped sinks, so that logging from a request handler (possibly while holding a lock) costs a
+// copy of the message into a lock-free ring buffer rather than formatting, terminal and file I/O.
+//
+// If the buffer is full (i.e. the writer can't keep up) messages are dropped and counted, rather
+// than blocking the caller; errors and above are instead written synchronously so they don't get
+// lost.  The writer thread periodically logs a warning with the number of dropped messages.
+class async_sink final : public spdlog::sinks::sink {
+  public:
+    // `capacity` is rounded up to a power of 2.
+    async_sink(std::vector<spdlog::sink_ptr> sinks, size_t capacity = 8192);
+    ~async_sink() override;
+
+    void log(const spdlog::details::log_msg& msg) override;
+
+    // Blocks until everything logged before the call has been written, then flushes the wrapped
+    // sinks.
+    void flush() override;
+
+    void set_pattern(const std::string& pattern) override;
+    void set_formatter(std::unique_ptr<spdlog::formatter> formatter) override;
+
+    // Writes out anything still queued and stops the writer thread; everything logged after this
+    // is written synchronously.
+    void stop();
+
+    struct stats {
+        uint64_t written;  // Messages written by the writer thread
+        uint64_t dropped;  // Messages dropped because the buffer was full
+        size_t queued;     // Messages waiting to be written (approximate)
+    };
+    stats get_stats() const;
+
+  private:
+    struct slot {
+        // Vyukov-style sequence number: equals the enqueue position when the slot is free for that
+        // position, and position + 1 once the message for it has been stored.
+        std::atomic<size_t> seq;
+        spdlog::details::log_msg_buffer msg;
+    };
+
+    bool try_push(const spdlog::details::log_msg& msg);
+    bool pop_and_write();
+    void write(const spdlog::details::log_msg& msg);
+    void run();
+
+    const std::vector<spdlog::sink_ptr> sinks_;
+    const size_t mask_;
+    std::unique_ptr<slot[]> slots_;
+
+    alignas(64) std::atomic<size_t> head_{0};  // Next enqueue position (producers)
+    alignas(64) std::atomic<size_t> tail_{0};  // Next dequeue position (only the writer changes it)
+
+    std::atomic<uint64_t> written_{0};
+    std::atomic<uint64_t> dropped_{0};
+    uint64_t reported_dropped_ = 0;
+
+    // Serializes writes to the wrapped sinks between the writer thread and synchronous writes
+    std::mutex write_mutex_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;          // Wakes the writer thread
+    std::condition_variable flushed_cv_;  // Signalled when the writer has handled a flush request
+    std::atomic<bool> sleeping_{false};
+    std::atomic<bool> running_{true};
+    bool stopping_ = false;
+    bool flush_requested_ = false;
+    size_t flushed_ = 0;
+
+    std::thread writer_;
+};
+
+}  // namespace oxen::logging
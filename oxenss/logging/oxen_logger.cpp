@@ -3,16 +3,25 @@
 #include <fmt/std.h>
 
 #include <spdlog/sinks/rotating_file_sink.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
 #include <filesystem>
 
 namespace oxen::logging {
 
 static auto logcat = oxen::log::Cat("logging");
 
+// Everything is written through this by a background thread, so that logging doesn't block the
+// threads doing the actual work on terminal or disk I/O.
+static std::shared_ptr<async_sink> writer;
+
 void init(const std::filesystem::path& data_dir, oxen::log::Level log_level) {
 
     log::reset_level(log_level);
-    log::add_sink(log::Type::Print, "stdout");
+
+    std::vector<spdlog::sink_ptr> sinks;
+    auto stdout_sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
+    stdout_sink->set_pattern("[%Y-%m-%d %H:%M:%S.%e] [%n:%^%l%$|%s:%#] %v");
+    sinks.push_back(std::move(stdout_sink));
 
     auto log_location = data_dir / "storage.logs";
 
@@ -26,8 +35,10 @@ void init(const std::filesystem::path& data_dir, oxen::log::Level log_level) {
         auto file_sink = std::make_shared<spdlog::sinks::rotating_file_sink_mt>(
                 log_location, LOG_FILE_SIZE_LIMIT, EXTRA_FILES, rotate_on_open);
 
-        log::add_sink(std::move(file_sink));
+        sinks.push_back(std::move(file_sink));
     } catch (const spdlog::spdlog_ex& ex) {
+        writer = std::make_shared<async_sink>(std::move(sinks));
+        log::add_sink(writer);
         log::error(
                 logcat,
                 "Failed to open {} for logging: {}.  File logging disabled.",
@@ -36,7 +47,18 @@ void init(const std::filesystem::path& data_dir, oxen::log::Level log_level) {
         return;
     }
 
+    writer = std::make_shared<async_sink>(std::move(sinks));
+    log::add_sink(writer);
     log::info(logcat, "Writing logs to {}", log_location);
 }
 
+void shutdown() {
+    if (writer)
+        writer->stop();
+}
+
+async_sink::stats get_stats() {
+    return writer ? writer->get_stats() : async_sink::stats{};
+}
+
 }  // namespace oxen::logging
@@ -1,11 +1,48 @@
 #pragma once
 
 #include <filesystem>
+#include <type_traits>
+#include <utility>
 
+#include <fmt/format.h>
 #include <oxen/log.hpp>
 
+#include "async_sink.h"
+
 namespace oxen::logging {
 
 void init(const std::filesystem::path& data_dir, oxen::log::Level log_level);
 
+// Writes out any queued log messages and stops the background log writer; anything logged after
+// this is written synchronously.
+void shutdown();
+
+// Stats of the background log writer (all zero if init() hasn't been called).
+async_sink::stats get_stats();
+
+template <typename F>
+struct lazy_t {
+    F f;
+};
+
+// Wraps a callable producing a log argument so that it only gets called if the message is
+// actually formatted, i.e. if the log level is enabled.  For arguments that are expensive to
+// compute, such as encoding a message payload:
+//
+//     log::trace(logcat, "Storing message: {}", logging::lazy([&] { return to_base64(data); }));
+template <typename F>
+lazy_t<F> lazy(F f) {
+    return {std::move(f)};
+}
+
 }  // namespace oxen::logging
+
+template <typename F, typename Char>
+struct fmt::formatter<oxen::logging::lazy_t<F>, Char>
+        : fmt::formatter<std::decay_t<std::invoke_result_t<const F&>>, Char> {
+    template <typename FormatContext>
+    auto format(const oxen::logging::lazy_t<F>& val, FormatContext& ctx) const {
+        return fmt::formatter<std::decay_t<std::invoke_result_t<const F&>>, Char>::format(
+                val.f(), ctx);
+    }
+};
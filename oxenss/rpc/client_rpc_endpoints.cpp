@@ -1,10 +1,12 @@
 #include "client_rpc_endpoints.h"
 #include "request_handler.h"
 #include <oxenss/logging/oxen_logger.h>
+#include <oxenss/utils/base64.hpp>
 #include <oxenss/utils/string_utils.hpp>
 #include <oxenss/utils/time.hpp>
 #include <oxenss/version.h>
 
+#include <algorithm>
 #include <chrono>
 #include <limits>
 #include <type_traits>
@@ -27,7 +29,9 @@ namespace {
     template <typename T>
     constexpr bool is_timestamp = std::is_same_v<T, system_clock::time_point>;
     template <typename T>
-    constexpr bool is_str_array = std::is_same_v<T, std::vector<std::string>>;
+    constexpr bool is_sv_array = std::is_same_v<T, std::vector<std::string_view>>;
+    template <typename T>
+    constexpr bool is_str_array = std::is_same_v<T, std::vector<std::string>> || is_sv_array<T>;
     template <typename T>
     constexpr bool is_int_array = std::is_same_v<T, std::vector<int>>;
     template <typename T>
@@ -104,6 +108,12 @@ namespace {
                     return namespace_all;
             throw parse_error{
                     fmt::format("Invalid value given for '{}': expected integer or \"all\"", name)};
+        } else if constexpr (is_sv_array<T>) {
+            auto elems = std::make_optional<T>();
+            elems->reserve(it->size());
+            for (auto& x : *it)
+                elems->push_back(x.template get_ref<const std::string&>());
+            return elems;
         } else {
             return it->template get<T>();
         }
@@ -130,7 +140,9 @@ namespace {
             else if constexpr (is_str_array<T> || is_int_array<T>) {
                 auto elems = std::make_optional<T>();
                 for (auto l = params.consume_list_consumer(); !l.is_finished();)
-                    if constexpr (is_str_array<T>)
+                    if constexpr (is_sv_array<T>)
+                        elems->push_back(l.consume_string_view());
+                    else if constexpr (is_str_array<T>)
                         elems->push_back(l.consume_string());
                     else
                         elems->push_back(l.consume_integer<int>());
@@ -226,9 +238,9 @@ namespace {
     }
 
     template <typename RPC>
-    void load_pk(RPC& rpc, std::optional<std::string>& pk) {
+    void load_pk(RPC& rpc, const std::optional<std::string_view>& pk) {
         require("pubkey", pk);
-        if (!rpc.pubkey.load(std::move(*pk)))
+        if (!rpc.pubkey.load(*pk))
             throw parse_error{fmt::format(
                     "Pubkey must be {} hex digits ({} bytes) long",
                     USER_PUBKEY_SIZE_HEX,
@@ -245,7 +257,7 @@ namespace {
     void load_pk_signature(
             RPC& rpc,
             const Dict&,
-            std::optional<std::string>& pk,
+            const std::optional<std::string_view>& pk,
             const std::optional<std::string_view>& pk_ed,
             const std::optional<std::string_view>& sig) {
         load_pk(rpc, pk);
@@ -317,7 +329,6 @@ namespace {
 }  // namespace
 
 // Aliases used in `load_fields<...>` to make formatting less obtuse
-using Str = std::string;
 using SV = std::string_view;
 using TP = system_clock::time_point;
 template <typename T>
@@ -326,7 +337,7 @@ using Vec = std::vector<T>;
 template <typename Dict>
 static void load(store& s, Dict& d) {
     auto [data, expiry, msg_ns, pubkey_alt, pubkey, pk_ed25519, sig_ts, sig, subkey] =
-            load_fields<SV, TP, namespace_id, Str, Str, SV, TP, SV, SV>(
+            load_fields<SV, TP, namespace_id, SV, SV, SV, TP, SV, SV>(
                     d,
                     "data",
                     "expiry",
@@ -372,8 +383,6 @@ static void load(store& s, Dict& d) {
     require("data", data);
     if constexpr (std::is_same_v<Dict, json>) {
         // For json we require data be base64 encoded
-        if (!oxenc::is_base64(*data))
-            throw parse_error{"Invalid 'data' value: not base64 encoded"};
         static_assert(
                 store::MAX_MESSAGE_BODY % 3 == 0,
                 "MAX_MESSAGE_BODY should be divisible by 3 so that max base64 encoded size "
@@ -382,7 +391,10 @@ static void load(store& s, Dict& d) {
             throw parse_error{fmt::format(
                     "Message body exceeds maximum allowed length of {} bytes",
                     store::MAX_MESSAGE_BODY)};
-        s.data = oxenc::from_base64(*data);
+        auto decoded = util::base64_decode(*data);
+        if (!decoded)
+            throw parse_error{"Invalid 'data' value: not base64 encoded"};
+        s.data = std::move(*decoded);
     } else {
         // Otherwise (i.e. bencoded) then we take data as bytes
         if (data->size() > store::MAX_MESSAGE_BODY)
@@ -428,8 +440,9 @@ static void load(retrieve& r, Dict& d) {
           pk_ed25519,
           sig,
           subkey,
-          ts] =
-            load_fields<Str, Str, int, int, namespace_id, Str, Str, SV, SV, SV, TP>(
+          ts,
+          wait] =
+            load_fields<SV, SV, int, int, namespace_id, SV, SV, SV, SV, SV, TP, int64_t>(
                     d,
                     "lastHash",
                     "last_hash",
@@ -441,7 +454,8 @@ static void load(retrieve& r, Dict& d) {
                     "pubkey_ed25519",
                     "signature",
                     "subkey",
-                    "timestamp");
+                    "timestamp",
+                    "wait");
 
     require_exactly_one_of("pubkey", pubkey, "pubKey", pubKey, true);
     auto& pk = pubkey ? pubkey : pubKey;
@@ -460,7 +474,7 @@ static void load(retrieve& r, Dict& d) {
 
     require_at_most_one_of("last_hash", last_hash, "lastHash", lastHash);
     if (lastHash)
-        last_hash = std::move(lastHash);
+        last_hash = lastHash;
     if (last_hash) {
         if (last_hash->empty())  // Treat empty string as not provided
             last_hash.reset();
@@ -470,10 +484,13 @@ static void load(retrieve& r, Dict& d) {
         } else
             throw parse_error{"Invalid last_hash: expected base64 (43 chars)"};
     }
-    r.last_hash = std::move(last_hash);
+    if (last_hash)
+        r.last_hash.emplace(*last_hash);
 
     r.max_count = max_count;
     r.max_size = max_size;
+    if (wait && *wait > 0)
+        r.wait = std::chrono::milliseconds{*wait};
 }
 void retrieve::load_from(json params) {
     load(*this, params);
@@ -486,21 +503,29 @@ static bool is_valid_message_hash(std::string_view hash) {
     return (hash.size() == 43 && oxenc::is_base64(hash));
 }
 
+// Copies message hashes (parsed as views into the request) into the request's owned list.
+static void assign_messages(
+        std::vector<std::string>& out, const std::vector<std::string_view>& messages) {
+    out.reserve(messages.size());
+    for (auto m : messages)
+        out.emplace_back(m);
+}
+
 template <typename Dict>
 static void load(delete_msgs& dm, Dict& d) {
     auto [messages, pubkey, pubkey_ed25519, required, signature] =
-            load_fields<Vec<Str>, Str, SV, bool, SV>(
+            load_fields<Vec<SV>, SV, SV, bool, SV>(
                     d, "messages", "pubkey", "pubkey_ed25519", "required", "signature");
 
     load_pk_signature(dm, d, pubkey, pubkey_ed25519, signature);
     require("messages", messages);
-    dm.messages = std::move(*messages);
-    if (dm.messages.empty())
+    if (messages->empty())
         throw parse_error{"messages does not contain any message hashes"};
     dm.required = required.value_or(false);
-    for (const auto& m : dm.messages)
+    for (auto m : *messages)
         if (!is_valid_message_hash(m))
-            throw parse_error{"invalid message hash: " + m};
+            throw parse_error{fmt::format("invalid message hash: {}", m)};
+    assign_messages(dm.messages, *messages);
 }
 void delete_msgs::load_from(json params) {
     load(*this, params);
@@ -525,7 +550,7 @@ bt_value delete_msgs::to_bt() const {
 
 template <typename Dict>
 static void load(revoke_subkey& rs, Dict& d) {
-    auto [pubkey, pubkey_ed25519, revoke_subkey, signature] = load_fields<Str, SV, SV, SV>(
+    auto [pubkey, pubkey_ed25519, revoke_subkey, signature] = load_fields<SV, SV, SV, SV>(
             d, "pubkey", "pubkey_ed25519", "revoke_subkey", "signature");
     load_pk_signature(rs, d, pubkey, pubkey_ed25519, signature);
     require("revoke_subkey", revoke_subkey);
@@ -563,7 +588,7 @@ bt_value revoke_subkey::to_bt() const {
 template <typename Dict>
 static void load(delete_all& da, Dict& d) {
     auto [msgs_ns, pubkey, pubkey_ed25519, signature, timestamp] =
-            load_fields<namespace_var, Str, SV, SV, TP>(
+            load_fields<namespace_var, SV, SV, SV, TP>(
                     d, "namespace", "pubkey", "pubkey_ed25519", "signature", "timestamp");
 
     load_pk_signature(da, d, pubkey, pubkey_ed25519, signature);
@@ -592,7 +617,7 @@ bt_value delete_all::to_bt() const {
 template <typename Dict>
 static void load(delete_before& db, Dict& d) {
     auto [before, msgs_ns, pubkey, pubkey_ed25519, signature] =
-            load_fields<TP, namespace_var, Str, SV, SV>(
+            load_fields<TP, namespace_var, SV, SV, SV>(
                     d, "before", "namespace", "pubkey", "pubkey_ed25519", "signature");
 
     load_pk_signature(db, d, pubkey, pubkey_ed25519, signature);
@@ -621,7 +646,7 @@ bt_value delete_before::to_bt() const {
 template <typename Dict>
 static void load(expire_all& e, Dict& d) {
     auto [expiry, msgs_ns, pubkey, pubkey_ed25519, signature] =
-            load_fields<TP, namespace_var, Str, SV, SV>(
+            load_fields<TP, namespace_var, SV, SV, SV>(
                     d, "expiry", "namespace", "pubkey", "pubkey_ed25519", "signature");
 
     load_pk_signature(e, d, pubkey, pubkey_ed25519, signature);
@@ -650,7 +675,7 @@ bt_value expire_all::to_bt() const {
 template <typename Dict>
 static void load(expire_msgs& e, Dict& d) {
     auto [expiry, extend, messages, pubkey, pubkey_ed25519, shorten, signature, subkey] =
-            load_fields<TP, bool, Vec<Str>, Str, SV, bool, SV, SV>(
+            load_fields<TP, bool, Vec<SV>, SV, SV, bool, SV, SV>(
                     d,
                     "expiry",
                     "extend",
@@ -670,12 +695,12 @@ static void load(expire_msgs& e, Dict& d) {
     if (e.shorten && e.extend)
         throw parse_error{"cannot specify both 'shorten' and 'extend'"};
     require("messages", messages);
-    e.messages = std::move(*messages);
-    if (e.messages.empty())
+    if (messages->empty())
         throw parse_error{"messages does not contain any message hashes"};
-    for (const auto& m : e.messages)
+    for (auto m : *messages)
         if (!is_valid_message_hash(m))
-            throw parse_error{"invalid message hash: " + m};
+            throw parse_error{fmt::format("invalid message hash: {}", m)};
+    assign_messages(e.messages, *messages);
 }
 void expire_msgs::load_from(json params) {
     load(*this, params);
@@ -709,7 +734,7 @@ bt_value expire_msgs::to_bt() const {
 template <typename Dict>
 static void load(get_expiries& ge, Dict& d) {
     auto [messages, pubkey, pk_ed25519, sig, subkey, timestamp] =
-            load_fields<Vec<Str>, Str, SV, SV, SV, TP>(
+            load_fields<Vec<SV>, SV, SV, SV, SV, TP>(
                     d, "messages", "pubkey", "pubkey_ed25519", "signature", "subkey", "timestamp");
 
     load_pk_signature(ge, d, pubkey, pk_ed25519, sig);
@@ -717,9 +742,9 @@ static void load(get_expiries& ge, Dict& d) {
     require("timestamp", timestamp);
     ge.sig_ts = *timestamp;
     require("messages", messages);
-    ge.messages = std::move(*messages);
-    if (ge.messages.empty())
+    if (messages->empty())
         throw parse_error{"messages does not contain any message hashes"};
+    assign_messages(ge.messages, *messages);
 }
 void get_expiries::load_from(json params) {
     load(*this, params);
@@ -730,10 +755,10 @@ void get_expiries::load_from(bt_dict_consumer params) {
 
 template <typename Dict>
 static void load(get_swarm& g, Dict& d) {
-    auto [pubKey, pubkey] = load_fields<Str, Str>(d, "pubKey", "pubkey");
+    auto [pubKey, pubkey] = load_fields<SV, SV>(d, "pubKey", "pubkey");
 
     require_exactly_one_of("pubkey", pubkey, "pubKey", pubKey, true);
-    if (!g.pubkey.load(std::move(pubkey ? *pubkey : *pubKey)))
+    if (!g.pubkey.load(pubkey ? *pubkey : *pubKey))
         throw parse_error{fmt::format(
                 "Pubkey must be {} hex digits/{} bytes long",
                 USER_PUBKEY_SIZE_HEX,
@@ -751,11 +776,11 @@ inline const static std::unordered_set<std::string_view> allowed_oxend_endpoints
 
 template <typename Dict>
 static void load(oxend_request& o, Dict& d) {
-    auto endpoint = parse_field<std::string>(d, "endpoint");
+    auto endpoint = parse_field<std::string_view>(d, "endpoint");
     require("endpoint", endpoint);
+    if (!allowed_oxend_endpoints.count(*endpoint))
+        throw parse_error{fmt::format("Invalid oxend endpoint '{}'", *endpoint)};
     o.endpoint = *endpoint;
-    if (!allowed_oxend_endpoints.count(o.endpoint))
-        throw parse_error{fmt::format("Invalid oxend endpoint '{}'", o.endpoint)};
 
     if constexpr (std::is_same_v<Dict, json>) {
         if (auto it = d.find("params"); it != d.end() && !it->is_null())
@@ -777,17 +802,21 @@ void oxend_request::load_from(bt_dict_consumer params) {
     load(*this, params);
 }
 
-static client_subrequest as_subrequest(client_request&& req) {
-    return var::visit(
-            [](auto&& r) -> client_subrequest {
-                using T = std::decay_t<decltype(r)>;
-                if constexpr (type_list_contains<T, client_rpc_subrequests>)
-                    return std::move(r);
-                else
-                    throw parse_error{
-                            "Invalid batch subrequest: subrequests may not contain meta-requests"};
-            },
-            std::move(req));
+// Loads a batch subrequest straight into a client_subrequest
+template <typename Params>
+static client_subrequest load_subrequest(std::string_view method, Params&& params) {
+    auto endpoint = find_client_rpc(method);
+    if (!endpoint)
+        throw parse_error{
+                "Invalid batch subrequest: invalid method \"" + std::string{method} + "\""};
+    return visit_client_rpc(*endpoint, [&](auto t) -> client_subrequest {
+        using RPC = typename decltype(t)::type;
+        if constexpr (type_list_contains<RPC, client_rpc_subrequests>)
+            return load_request<RPC>(std::forward<Params>(params));
+        else
+            throw parse_error{
+                    "Invalid batch subrequest: subrequests may not contain meta-requests"};
+    });
 }
 
 void batch::load_from(json params) {
@@ -797,6 +826,7 @@ void batch::load_from(json params) {
     if (reqs_it->size() > BATCH_REQUEST_MAX)
         throw parse_error{"Invalid batch request: subrequest limit exceeded"};
 
+    subreqs.reserve(reqs_it->size());
     for (auto& j : *reqs_it) {
         if (!j.is_object())
             throw parse_error{"Invalid batch request: requests must be objects"};
@@ -805,12 +835,8 @@ void batch::load_from(json params) {
         if (meth_it == j.end() || params_it == j.end() || !meth_it->is_string() ||
             !params_it->is_object())
             throw parse_error{"Invalid batch request: subrequests must have method/params keys"};
-        auto method = meth_it->get<std::string_view>();
-        auto rpc_it = RequestHandler::client_rpc_endpoints.find(method);
-        if (rpc_it == RequestHandler::client_rpc_endpoints.end())
-            throw parse_error{
-                    "Invalid batch subrequest: invalid method \"" + std::string{method} + "\""};
-        subreqs.push_back(as_subrequest(rpc_it->second.load_req(std::move(*params_it))));
+        subreqs.push_back(
+                load_subrequest(meth_it->get<std::string_view>(), std::move(*params_it)));
     }
 }
 void batch::load_from(bt_dict_consumer params) {
@@ -818,6 +844,13 @@ void batch::load_from(bt_dict_consumer params) {
         throw parse_error{"Invalid batch request: no valid \"requests\" field"};
 
     auto requests = params.consume_list_consumer();
+    {
+        // Count the subrequests up front so that we can allocate them all at once
+        size_t count = 0;
+        for (auto l = requests; !l.is_finished() && count <= BATCH_REQUEST_MAX; count++)
+            l.skip_value();
+        subreqs.reserve(std::min(count, BATCH_REQUEST_MAX));
+    }
     while (!requests.is_finished()) {
         if (!requests.is_dict())
             throw parse_error{"Invalid batch request: requests must be dicts"};
@@ -827,18 +860,68 @@ void batch::load_from(bt_dict_consumer params) {
         if (!sr.skip_until("method") || !sr.is_string())
             throw parse_error{"Invalid batch request: subrequests must have a method"};
         auto method = sr.consume_string_view();
-        auto rpc_it = RequestHandler::client_rpc_endpoints.find(method);
-        if (rpc_it == RequestHandler::client_rpc_endpoints.end())
+        if (!find_client_rpc(method))
             throw parse_error{
                     "Invalid batch subrequest: invalid method \"" + std::string{method} + "\""};
         if (!sr.skip_until("params") || !sr.is_dict())
             throw parse_error{"Invalid batch request: subrequests must have a params dict"};
-        subreqs.push_back(as_subrequest(rpc_it->second.load_req(sr.consume_dict_consumer())));
+        subreqs.push_back(load_subrequest(method, sr.consume_dict_consumer()));
     }
     if (subreqs.empty())
         throw parse_error{"Invalid batch request: empty \"requests\" list"};
 }
 
+static void load_multi_subrequest(retrieve_multi& rm, retrieve&& r) {
+    if (r.max_size && *r.max_size != 0)
+        throw parse_error{
+                "Invalid retrieve_multi request: max_size must be given for the whole request, "
+                "not for the individual requests"};
+    rm.subreqs.push_back(std::move(r));
+}
+
+void retrieve_multi::load_from(json params) {
+    auto reqs_it = params.find("requests");
+    if (reqs_it == params.end() || !reqs_it->is_array() || reqs_it->empty())
+        throw parse_error{"Invalid retrieve_multi request: no valid \"requests\" field"};
+    if (reqs_it->size() > BATCH_REQUEST_MAX)
+        throw parse_error{"Invalid retrieve_multi request: request limit exceeded"};
+
+    subreqs.reserve(reqs_it->size());
+    for (auto& j : *reqs_it) {
+        if (!j.is_object())
+            throw parse_error{"Invalid retrieve_multi request: requests must be objects"};
+        retrieve r;
+        r.load_from(std::move(j));
+        load_multi_subrequest(*this, std::move(r));
+    }
+    if (auto it = params.find("max_size"); it != params.end() && !it->is_null()) {
+        if (!it->is_number_integer())
+            throw parse_error{"Invalid retrieve_multi request: max_size must be an integer"};
+        max_size = it->get<int>();
+    }
+}
+void retrieve_multi::load_from(bt_dict_consumer params) {
+    if (params.skip_until("max_size"))
+        max_size = params.consume_integer<int>();
+    // (bt dict keys are sorted, so "requests" can only come after "max_size")
+    if (!params.skip_until("requests") || !params.is_list())
+        throw parse_error{"Invalid retrieve_multi request: no valid \"requests\" field"};
+
+    auto requests = params.consume_list_consumer();
+    while (!requests.is_finished()) {
+        if (!requests.is_dict())
+            throw parse_error{"Invalid retrieve_multi request: requests must be dicts"};
+        if (subreqs.size() >= BATCH_REQUEST_MAX)
+            throw parse_error{"Invalid retrieve_multi request: request limit exceeded"};
+        retrieve r;
+        r.load_from(requests.consume_dict_consumer());
+        r.b64 = false;
+        load_multi_subrequest(*this, std::move(r));
+    }
+    if (subreqs.empty())
+        throw parse_error{"Invalid retrieve_multi request: empty \"requests\" list"};
+}
+
 // Copies an optional vector into a fixed-size array, substituting 0's for omitted vector elements,
 // and ignoring anything in the vector longer than the given size.  Gives nullopt if the input
 // vector is itself nullopt or empty.
@@ -914,14 +997,14 @@ static std::unique_ptr<client_request> load_ifelse_request(json& params, const s
     auto pit = it->find("params");
     if (mit == it->end() || !mit->is_string() || pit == it->end())
         throw parse_error{"Invalid ifelse request: " + key + " must have method/params keys"};
-    auto method = mit->get<std::string_view>();
-    auto rpc_it = RequestHandler::client_rpc_endpoints.find(method);
-    if (rpc_it == RequestHandler::client_rpc_endpoints.end())
+    auto endpoint = find_client_rpc(mit->get<std::string_view>());
+    if (!endpoint)
         throw parse_error{"Invalid ifelse request method \"" + key + "\""};
 
-    return var::visit(
-            [](auto&& r) { return std::make_unique<client_request>(std::move(r)); },
-            rpc_it->second.load_req(std::move(*pit)));
+    return visit_client_rpc(*endpoint, [&](auto t) {
+        return std::make_unique<client_request>(
+                load_request<typename decltype(t)::type>(std::move(*pit)));
+    });
 }
 
 static std::unique_ptr<client_request> load_ifelse_request(
@@ -933,16 +1016,16 @@ static std::unique_ptr<client_request> load_ifelse_request(
     auto req = params.consume_dict_consumer();
     if (!req.skip_until("method") || !req.is_string())
         throw parse_error{"Invalid ifelse request: " + key + " missing method"};
-    auto method = req.consume_string_view();
-    auto rpc_it = RequestHandler::client_rpc_endpoints.find(method);
-    if (rpc_it == RequestHandler::client_rpc_endpoints.end())
+    auto endpoint = find_client_rpc(req.consume_string_view());
+    if (!endpoint)
         throw parse_error{"Invalid ifelse request method \"" + key + "\""};
 
     if (!req.skip_until("params") || !req.is_dict())
         throw parse_error{"Invalid ifelse request: " + key + " missing params"};
-    return var::visit(
-            [](auto&& r) { return std::make_unique<client_request>(std::move(r)); },
-            rpc_it->second.load_req(req.consume_dict_consumer()));
+    return visit_client_rpc(*endpoint, [&](auto t) {
+        return std::make_unique<client_request>(
+                load_request<typename decltype(t)::type>(req.consume_dict_consumer()));
+    });
 }
 
 void ifelse::load_from(json params) {
@@ -3,6 +3,7 @@
 #include <array>
 #include <chrono>
 #include <cstddef>
+#include <cstdint>
 #include <optional>
 #include <stdexcept>
 #include <string>
@@ -42,6 +43,18 @@ struct endpoint {
     bool b64 = true;  // True if we need to base64-encode values (i.e. for json); false if we
                       // can deal with binary (i.e. bt-encoded)
 
+    // True if the response goes straight back to the client as-is (i.e. a top-level HTTP or OMQ
+    // request, rather than a subrequest or onion request).  Endpoints may then return a body that
+    // is already encoded in the final wire format (json, or bt-encoded if `b64` is false) instead
+    // of a json value.
+    bool direct = false;
+
+    // Set if this request's signature has already been verified (e.g. for subrequests of a batch,
+    // which get verified in parallel before dispatching) to the result of verification, in which
+    // case the request handler uses it rather than verifying again.  Whether the signing subkey
+    // (if any) has been revoked is still checked by the handler.
+    std::optional<bool> signature_verified;
+
     virtual ~endpoint() = default;
 };
 
@@ -58,6 +71,8 @@ struct no_args : endpoint {
 /// specific, but on failure there will be a `"failed": true` key possibly accompanied by one of
 /// the following:
 /// - "timeout": true if the inter-swarm request timed out
+/// - "pending": true if the swarm member hadn't answered yet when we replied (only if the storage
+///   server is configured to reply once a quorum of the swarm has answered, or after a deadline)
 /// - "code": X if the inter-swarm request returned error code X
 /// - "reason": a reason string, e.g. propagating a thrown exception messages
 /// - "bad_peer_response": true if the peer returned an unparseable response
@@ -207,6 +222,12 @@ struct store final : recursive {
 ///
 ///   Note that regardless of the two values the response will always include at least one message,
 ///   even if it would exceed the given maximum size.
+/// - `wait` (optional) if there are no messages to return, wait up to this many milliseconds (at
+///   most 51100) for a new message to arrive in the namespace before replying, rather than
+///   replying right away with no messages.  If a message arrives in time the reply includes it
+///   (and any others stored since `last_hash`); otherwise it is an ordinary empty reply.  This is
+///   only supported for direct OMQ requests (i.e. `storage.retrieve`); it is ignored otherwise,
+///   and also if the node already has too many retrieves waiting.
 ///
 /// Authentication parameters: these are optional during a transition period, up until Oxen
 /// hard-fork 19, and become required starting there.  During the transition period, *if* provided
@@ -244,6 +265,8 @@ struct retrieve final : endpoint {
     std::optional<std::string> last_hash;
     std::optional<int> max_count;
     std::optional<int> max_size;
+    std::optional<std::chrono::milliseconds> wait;
+    bool can_wait = false;  // Set for direct OMQ requests, which are the only ones that can wait
 
     bool check_signature = false;  // For transition; delete this once we require sigs always
     std::optional<std::array<unsigned char, 32>> pubkey_ed25519;
@@ -549,8 +572,10 @@ struct expire_all final : recursive {
 ///     - "updated": ascii-sorted list of hashes that had their expiries changed (messages that were
 ///       not found, and messages excluded by the shorten/extend options, are not included).
 ///     - "unchanged": dict of hashes to current expiries of hashes that were found, but did not get
-///       updated expiries due a given "shorten"/"extend" constraint in the request.  This field is
-///       only included when the "shorten" or "extend" parameter is explicitly given.
+///       updated expiries due a given "shorten"/"extend" constraint in the request, or (unless
+///       shortening) because they already expire shortly before the requested expiry (within 1% of
+///       the remaining time, and at most an hour).  This field is only included when the "shorten"
+///       or "extend" parameter is explicitly given, or when it isn't empty.
 ///     - "expiry": the expiry timestamp that was applied (which might be different from the request
 ///       expiry, e.g. if the requested value exceeded the permitted TTL).
 ///     - "signature": signature of:
@@ -738,12 +763,47 @@ struct sequence : batch {
     static constexpr auto names() { return NAMES("sequence"); }
 };
 
+/// Retrieves several accounts' and/or namespaces' messages at once.  This answers the same queries
+/// as a batch of `retrieve` requests, but does all of them in a single pass over the database
+/// (reading each account's details only once), and returns the messages that fit into a single
+/// size budget rather than requiring a fractional `max_size` on each subrequest.
+///
+/// Takes keys of:
+/// - "requests" -- list of 1 to 20 dicts, each of which contains the parameters of a `retrieve`
+///   request (including its authentication signature, where required), except that `max_size` may
+///   not be given.
+/// - "max_size" -- (optional) the maximum aggregate size of all the returned messages, as for the
+///   `max_size` of `retrieve` (i.e. in bytes if positive, or a fraction of the maximum if
+///   negative).  Defaults to the maximum.  The budget is used up by the requests in order, so once
+///   it has run out the later requests return no messages (with "more" set, if they have any).  As
+///   with `retrieve` the response always includes at least the first message found, even if that
+///   alone exceeds the budget.
+///
+/// Returns a dict of key "results" containing a list of one result per request, in the same order,
+/// each of which is a dict of:
+/// - "code" -- the numeric response code of this request (e.g. 200 for success, 401 for a failed
+///   signature, or 421 if this node is not in the account's swarm).
+/// - "body" -- on success, the same "messages" and "more" values as a `retrieve` response;
+///   otherwise the error message.
+///
+/// Note that this request cannot be used as a batch or sequence subrequest.
+struct retrieve_multi : endpoint {
+    static constexpr auto names() { return NAMES("retrieve_multi"); }
+
+    std::vector<client_subrequest> subreqs;  // Always rpc::retrieve requests
+    std::optional<int> max_size;
+
+    void load_from(nlohmann::json params) override;
+    void load_from(oxenc::bt_dict_consumer params) override;
+};
+
 struct ifelse;
 
 // All of the RPC types that can be invoked as top-level requests, i.e. all of the subrequest types
-// (which are invokable via batch/sequence), plus batch, sequence, and ifelse (which are not
-// batch-invokable).  These are loaded into the supported RPC interfaces at startup.
-using client_rpc_types = type_list_append_t<client_rpc_subrequests, batch, sequence, ifelse>;
+// (which are invokable via batch/sequence), plus batch, sequence, retrieve_multi, and ifelse (which
+// are not batch-invokable).  These are loaded into the supported RPC interfaces at startup.
+using client_rpc_types =
+        type_list_append_t<client_rpc_subrequests, batch, sequence, retrieve_multi, ifelse>;
 
 using client_request = type_list_variant_t<client_rpc_types>;
 
@@ -851,4 +911,112 @@ struct ifelse : endpoint {
     void load_from(oxenc::bt_dict_consumer params) override;
 };
 
+/// Loads a request of type RPC from json or bt-encoded params.  This is used for requests (and
+/// subrequests) initiated by a client, so recursive requests are set to recurse.
+template <typename RPC, typename Params>
+RPC load_request(Params&& params) {
+    RPC req;
+    req.load_from(std::forward<Params>(params));
+    if constexpr (std::is_base_of_v<recursive, RPC>)
+        req.recurse = true;
+    return req;
+}
+
+// Compile-time lookup of client RPC methods: every method name (including aliases) of the types
+// in client_rpc_types goes into a perfect hash table, so that finding a method takes one hash of
+// the name and one string comparison, and gives the index of its type in client_rpc_types with
+// which requests get dispatched straight to that type (see visit_client_rpc).
+
+struct client_rpc_method {
+    std::string_view name;
+    size_t index;  // Index of the method's type in client_rpc_types
+};
+
+namespace detail {
+    template <typename... RPC>
+    constexpr auto make_client_rpc_methods(type_list<RPC...>) {
+        std::array<client_rpc_method, (RPC::names().size() + ...)> methods{};
+        size_t n = 0, index = 0;
+        auto add = [&](const auto& names) {
+            for (auto name : names)
+                methods[n++] = {name, index};
+            index++;
+        };
+        (add(RPC::names()), ...);
+        return methods;
+    }
+
+    constexpr uint32_t method_hash(std::string_view name, uint32_t seed) {
+        // FNV-1a, with the seed mixed into the offset basis
+        uint32_t h = 2166136261u ^ seed;
+        for (char c : name) {
+            h ^= static_cast<unsigned char>(c);
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    template <size_t N>
+    constexpr size_t method_table_size() {
+        // Power of 2 with at least 4 slots per method, so that a seed without collisions is
+        // quick to find
+        size_t size = 1;
+        while (size < 4 * N)
+            size <<= 1;
+        return size;
+    }
+
+    template <size_t N>
+    struct method_table {
+        static constexpr size_t SIZE = method_table_size<N>();
+        uint32_t seed = 0;
+        std::array<int8_t, SIZE> slots{};  // Index into the methods array, or -1 if empty
+    };
+
+    // Finds the first seed for which the method names hash to distinct slots
+    template <size_t N>
+    constexpr method_table<N> make_method_table(const std::array<client_rpc_method, N>& methods) {
+        static_assert(N < 128);
+        method_table<N> t;
+        for (;; t.seed++) {
+            for (auto& s : t.slots)
+                s = -1;
+            bool collision = false;
+            for (size_t i = 0; i < N && !collision; i++) {
+                auto& slot = t.slots[method_hash(methods[i].name, t.seed) & (t.SIZE - 1)];
+                if (slot >= 0)
+                    collision = true;
+                else
+                    slot = static_cast<int8_t>(i);
+            }
+            if (!collision)
+                return t;
+        }
+    }
+}  // namespace detail
+
+/// All client RPC method names, in the order of client_rpc_types.
+inline constexpr auto client_rpc_methods = detail::make_client_rpc_methods(client_rpc_types{});
+
+namespace detail {
+    inline constexpr auto client_rpc_table = make_method_table(client_rpc_methods);
+}
+
+/// Returns the index in client_rpc_types of the endpoint with the given method name, or nullopt
+/// if there is no such method.
+constexpr std::optional<size_t> find_client_rpc(std::string_view method) {
+    auto& t = detail::client_rpc_table;
+    auto slot = t.slots[detail::method_hash(method, t.seed) & (t.SIZE - 1)];
+    if (slot < 0 || client_rpc_methods[slot].name != method)
+        return std::nullopt;
+    return client_rpc_methods[slot].index;
+}
+
+/// Invokes `f(type_tag<RPC>{})` with the RPC type at index `endpoint` of client_rpc_types (as
+/// returned by find_client_rpc), and returns its result.
+template <typename F>
+decltype(auto) visit_client_rpc(size_t endpoint, F&& f) {
+    return type_list_visit(endpoint, std::forward<F>(f), client_rpc_types{});
+}
+
 }  // namespace oxen::rpc
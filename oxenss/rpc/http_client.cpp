@@ -0,0 +1,232 @@
+#include "http_client.h"
+
+#include <oxenss/logging/oxen_logger.h>
+
+#include <curl/curl.h>
+
+#include <stdexcept>
+
+namespace oxen::rpc {
+
+static auto logcat = log::Cat("http");
+
+struct HttpClient::transfer {
+    CURL* easy = nullptr;
+    curl_slist* headers = nullptr;
+    std::string body;
+    callback_t on_done;
+    http_response response;
+    char error[CURL_ERROR_SIZE] = {0};
+
+    ~transfer() {
+        if (easy)
+            curl_easy_cleanup(easy);
+        if (headers)
+            curl_slist_free_all(headers);
+    }
+};
+
+namespace {
+
+    CURLM* as_multi(void* m) {
+        return static_cast<CURLM*>(m);
+    }
+
+    size_t on_body_data(char* data, size_t size, size_t nmemb, void* userdata) {
+        static_cast<http_response*>(userdata)->body.append(data, size * nmemb);
+        return size * nmemb;
+    }
+
+    std::string_view trim(std::string_view s) {
+        while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+            s.remove_prefix(1);
+        while (!s.empty() && (s.back() == ' ' || s.back() == '\t' || s.back() == '\r' ||
+                              s.back() == '\n'))
+            s.remove_suffix(1);
+        return s;
+    }
+
+    size_t on_header_line(char* data, size_t size, size_t nmemb, void* userdata) {
+        auto& res = *static_cast<http_response*>(userdata);
+        auto line = trim({data, size * nmemb});
+        if (line.substr(0, 5) == "HTTP/") {
+            // A new status line (e.g. after a "100 Continue") replaces anything we got before
+            res.status_line = line;
+            res.headers.clear();
+        } else if (auto colon = line.find(':'); colon != std::string_view::npos) {
+            res.headers.emplace_back(line.substr(0, colon), trim(line.substr(colon + 1)));
+        }
+        return size * nmemb;
+    }
+
+}  // namespace
+
+HttpClient::HttpClient() {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    auto* multi = curl_multi_init();
+    if (!multi)
+        throw std::runtime_error{"Failed to initialize curl multi handle"};
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, MAX_HOST_CONNECTIONS);
+    curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, MAX_IDLE_CONNECTIONS);
+    multi_ = multi;
+
+    thread_ = std::thread{[this] { run(); }};
+}
+
+HttpClient::~HttpClient() {
+    {
+        std::lock_guard lock{mutex_};
+        stop_ = true;
+    }
+    curl_multi_wakeup(as_multi(multi_));
+    thread_.join();
+    curl_multi_cleanup(as_multi(multi_));
+    curl_global_cleanup();
+}
+
+void HttpClient::post(
+        std::string url,
+        std::vector<std::pair<std::string, std::string>> headers,
+        std::string body,
+        std::chrono::milliseconds timeout,
+        callback_t on_done) {
+    auto t = std::make_unique<transfer>();
+    t->easy = curl_easy_init();
+    if (!t->easy) {
+        http_response res;
+        res.error = "Failed to initialize curl handle";
+        return on_done(std::move(res));
+    }
+    t->body = std::move(body);
+    t->on_done = std::move(on_done);
+    for (auto& [k, v] : headers)
+        t->headers = curl_slist_append(t->headers, (k + ": " + v).c_str());
+
+    auto* e = t->easy;
+    curl_easy_setopt(e, CURLOPT_URL, url.c_str());
+#if LIBCURL_VERSION_NUM >= 0x075500  // 7.85.0
+    curl_easy_setopt(e, CURLOPT_PROTOCOLS_STR, "http,https");
+#else
+    curl_easy_setopt(e, CURLOPT_PROTOCOLS, CURLPROTO_HTTP | CURLPROTO_HTTPS);
+#endif
+    curl_easy_setopt(e, CURLOPT_POST, 1L);
+    curl_easy_setopt(e, CURLOPT_POSTFIELDS, t->body.data());
+    curl_easy_setopt(e, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(t->body.size()));
+    curl_easy_setopt(e, CURLOPT_HTTPHEADER, t->headers);
+    curl_easy_setopt(e, CURLOPT_TIMEOUT_MS, static_cast<long>(timeout.count()));
+    curl_easy_setopt(e, CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1_2);
+    curl_easy_setopt(e, CURLOPT_FOLLOWLOCATION, 0L);
+    curl_easy_setopt(e, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(e, CURLOPT_TCP_KEEPALIVE, 1L);
+    // Prefer HTTP/2 over TLS, and wait for an existing connection that we can multiplex onto
+    // rather than opening a new one:
+    curl_easy_setopt(e, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(e, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(e, CURLOPT_WRITEFUNCTION, on_body_data);
+    curl_easy_setopt(e, CURLOPT_WRITEDATA, &t->response);
+    curl_easy_setopt(e, CURLOPT_HEADERFUNCTION, on_header_line);
+    curl_easy_setopt(e, CURLOPT_HEADERDATA, &t->response);
+    curl_easy_setopt(e, CURLOPT_ERRORBUFFER, t->error);
+    curl_easy_setopt(e, CURLOPT_PRIVATE, t.get());
+
+    {
+        std::lock_guard lock{mutex_};
+        if (!stop_ && queued_.size() < MAX_QUEUED) {
+            queued_.push_back(std::move(t));
+        }
+    }
+    if (t) {
+        log::warning(logcat, "Too many pending outbound requests; dropping request to {}", url);
+        http_response res;
+        res.error = "Too many pending requests";
+        return t->on_done(std::move(res));
+    }
+    curl_multi_wakeup(as_multi(multi_));
+}
+
+size_t HttpClient::pending() const {
+    std::lock_guard lock{mutex_};
+    return active_ + queued_.size();
+}
+
+void HttpClient::start(std::unique_ptr<transfer> t) {
+    if (auto rc = curl_multi_add_handle(as_multi(multi_), t->easy); rc != CURLM_OK) {
+        http_response res;
+        res.error = curl_multi_strerror(rc);
+        t->on_done(std::move(res));
+        return;
+    }
+    in_flight_.insert(t.release());  // Reclaimed in finish()
+    std::lock_guard lock{mutex_};
+    active_++;
+}
+
+void HttpClient::finish(transfer* t_ptr, int result) {
+    std::unique_ptr<transfer> t{t_ptr};
+    in_flight_.erase(t_ptr);
+    curl_multi_remove_handle(as_multi(multi_), t->easy);
+    {
+        std::lock_guard lock{mutex_};
+        active_--;
+    }
+
+    auto& res = t->response;
+    if (auto rc = static_cast<CURLcode>(result); rc != CURLE_OK) {
+        res = http_response{};
+        res.error = t->error[0] ? t->error : curl_easy_strerror(rc);
+        res.timed_out = rc == CURLE_OPERATION_TIMEDOUT;
+    } else {
+        curl_easy_getinfo(t->easy, CURLINFO_RESPONSE_CODE, &res.status_code);
+    }
+
+    try {
+        t->on_done(std::move(res));
+    } catch (const std::exception& e) {
+        log::error(logcat, "Outbound request callback raised an exception: {}", e.what());
+    }
+}
+
+void HttpClient::run() {
+    auto* multi = as_multi(multi_);
+    while (true) {
+        std::vector<std::unique_ptr<transfer>> starting;
+        {
+            std::lock_guard lock{mutex_};
+            if (stop_)
+                break;
+            while (!queued_.empty() && active_ + starting.size() < MAX_IN_FLIGHT) {
+                starting.push_back(std::move(queued_.front()));
+                queued_.pop_front();
+            }
+        }
+        for (auto& t : starting)
+            start(std::move(t));
+
+        int running = 0;
+        curl_multi_perform(multi, &running);
+
+        int remaining = 0;
+        while (auto* msg = curl_multi_info_read(multi, &remaining)) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            char* t = nullptr;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &t);
+            finish(reinterpret_cast<transfer*>(t), msg->data.result);
+        }
+
+        curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+    }
+
+    // Abandon anything still in progress
+    for (auto* t : in_flight_) {
+        curl_multi_remove_handle(multi, t->easy);
+        delete t;
+    }
+    in_flight_.clear();
+    std::lock_guard lock{mutex_};
+    queued_.clear();
+    active_ = 0;
+}
+
+}  // namespace oxen::rpc
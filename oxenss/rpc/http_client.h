@@ -0,0 +1,90 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+/// Persistent outbound HTTP(S) client used for forwarding onion requests to external servers.
+///
+/// All requests share a single libcurl multi handle driven by one event loop thread, so
+/// connections (and TLS sessions) to the same host are kept alive and reused across requests, and
+/// multiplexed over a single HTTP/2 connection when both libcurl and the remote support it.
+
+namespace oxen::rpc {
+
+struct http_response {
+    // Empty on success; otherwise the failure reason (in which case the fields below are unset).
+    std::string error;
+    bool timed_out = false;
+
+    long status_code = 0;
+    std::string status_line;
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+};
+
+class HttpClient {
+  public:
+    // Maximum number of requests that are in progress at once; further requests queue until a
+    // slot frees up.
+    inline constexpr static size_t MAX_IN_FLIGHT = 256;
+
+    // Maximum number of requests waiting for an in-flight slot; beyond this, requests fail
+    // immediately.
+    inline constexpr static size_t MAX_QUEUED = 4096;
+
+    // Maximum number of simultaneous connections to any one host.
+    inline constexpr static long MAX_HOST_CONNECTIONS = 8;
+
+    // Maximum number of idle connections kept open for reuse (across all hosts).
+    inline constexpr static long MAX_IDLE_CONNECTIONS = 64;
+
+    HttpClient();
+    ~HttpClient();
+
+    HttpClient(const HttpClient&) = delete;
+    HttpClient& operator=(const HttpClient&) = delete;
+
+    using callback_t = std::function<void(http_response)>;
+
+    // Queues a POST request.  `on_done` is invoked (from the client thread) with the response or
+    // failure once the request completes; it is not invoked at all if the client is destroyed
+    // before the request completes.
+    void post(
+            std::string url,
+            std::vector<std::pair<std::string, std::string>> headers,
+            std::string body,
+            std::chrono::milliseconds timeout,
+            callback_t on_done);
+
+    // Returns the number of requests currently in progress or queued.
+    size_t pending() const;
+
+  private:
+    struct transfer;
+
+    void* multi_;  // CURLM*
+    std::thread thread_;
+
+    mutable std::mutex mutex_;
+    bool stop_ = false;
+    std::deque<std::unique_ptr<transfer>> queued_;
+    size_t active_ = 0;
+
+    // Requests added to the multi handle; only accessed from the client thread.
+    std::unordered_set<transfer*> in_flight_;
+
+    void run();
+    void start(std::unique_ptr<transfer> t);
+    void finish(transfer* t, int result);
+};
+
+}  // namespace oxen::rpc
@@ -0,0 +1,198 @@
+#include "json_parse.h"
+
+#include <cstdint>
+#include <limits>
+#include <string>
+
+namespace oxen::rpc {
+
+using nlohmann::json;
+
+namespace {
+
+    // Nesting beyond this gets handed off to nlohmann (which is also where any error for it comes
+    // from).
+    constexpr int MAX_DEPTH = 32;
+
+    struct simple_parser {
+        const char* p;
+        const char* const end;
+
+        void skip_ws() {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+                ++p;
+        }
+
+        bool literal(std::string_view lit) {
+            if (static_cast<size_t>(end - p) < lit.size() || std::string_view{p, lit.size()} != lit)
+                return false;
+            p += lit.size();
+            return true;
+        }
+
+        // Scans a string (with p positioned at the opening quote) that contains no escapes, control
+        // characters, or non-ASCII bytes; fails if the string contains anything else.
+        bool string(std::string_view& out) {
+            const char* start = ++p;
+            for (; p < end; ++p) {
+                auto c = static_cast<unsigned char>(*p);
+                if (c == '"') {
+                    out = {start, static_cast<size_t>(p - start)};
+                    ++p;
+                    return true;
+                }
+                if (c == '\\' || c < 0x20 || c >= 0x80)
+                    return false;
+            }
+            return false;
+        }
+
+        // Integers only, producing the same unsigned (if non-negative) or signed value that
+        // nlohmann would.  Anything with a fraction or exponent, or that doesn't fit in a 64-bit
+        // integer, is left for the full parser.
+        bool number(json& out) {
+            bool neg = *p == '-';
+            if (neg)
+                ++p;
+            const char* start = p;
+            while (p < end && *p >= '0' && *p <= '9')
+                ++p;
+            auto len = p - start;
+            if (len == 0 || len > 20 || (len > 1 && *start == '0'))
+                return false;
+            if (p < end && (*p == '.' || *p == 'e' || *p == 'E'))
+                return false;
+            uint64_t val = 0;
+            for (auto d = start; d < p; ++d) {
+                auto digit = static_cast<uint64_t>(*d - '0');
+                if (val > (std::numeric_limits<uint64_t>::max() - digit) / 10)
+                    return false;
+                val = val * 10 + digit;
+            }
+            if (!neg)
+                out = val;
+            else if (val == 0 || val > static_cast<uint64_t>(std::numeric_limits<int64_t>::max()))
+                return false;
+            else
+                out = -static_cast<int64_t>(val);
+            return true;
+        }
+
+        bool object(json& out, int depth) {
+            ++p;
+            out = json::object();
+            skip_ws();
+            if (p < end && *p == '}') {
+                ++p;
+                return true;
+            }
+            while (true) {
+                std::string_view key;
+                if (p >= end || *p != '"' || !string(key))
+                    return false;
+                skip_ws();
+                if (p >= end || *p != ':')
+                    return false;
+                ++p;
+                skip_ws();
+                // As with nlohmann, a repeated key takes the last value
+                if (!value(out[std::string{key}], depth))
+                    return false;
+                skip_ws();
+                if (p >= end)
+                    return false;
+                if (*p == '}') {
+                    ++p;
+                    return true;
+                }
+                if (*p != ',')
+                    return false;
+                ++p;
+                skip_ws();
+            }
+        }
+
+        bool array(json& out, int depth) {
+            ++p;
+            out = json::array();
+            skip_ws();
+            if (p < end && *p == ']') {
+                ++p;
+                return true;
+            }
+            while (true) {
+                if (!value(out.emplace_back(), depth))
+                    return false;
+                skip_ws();
+                if (p >= end)
+                    return false;
+                if (*p == ']') {
+                    ++p;
+                    return true;
+                }
+                if (*p != ',')
+                    return false;
+                ++p;
+                skip_ws();
+            }
+        }
+
+        bool value(json& out, int depth) {
+            if (p >= end)
+                return false;
+            switch (*p) {
+                case '{': return depth < MAX_DEPTH && object(out, depth + 1);
+                case '[': return depth < MAX_DEPTH && array(out, depth + 1);
+                case '"': {
+                    std::string_view s;
+                    if (!string(s))
+                        return false;
+                    out = std::string{s};
+                    return true;
+                }
+                case 't':
+                    out = true;
+                    return literal("true");
+                case 'f':
+                    out = false;
+                    return literal("false");
+                case 'n':
+                    out = nullptr;
+                    return literal("null");
+                case '-':
+                case '0':
+                case '1':
+                case '2':
+                case '3':
+                case '4':
+                case '5':
+                case '6':
+                case '7':
+                case '8':
+                case '9': return number(out);
+                default: return false;
+            }
+        }
+    };
+
+}  // namespace
+
+std::optional<json> detail::parse_simple_json(std::string_view body) {
+    simple_parser parser{body.data(), body.data() + body.size()};
+    std::optional<json> result;
+    parser.skip_ws();
+    if (!parser.value(result.emplace(), 0))
+        return std::nullopt;
+    parser.skip_ws();
+    if (parser.p != parser.end)
+        return std::nullopt;
+    return result;
+}
+
+json parse_json(std::string_view body) {
+    if (auto parsed = detail::parse_simple_json(body))
+        return std::move(*parsed);
+    return json::parse(body, nullptr, false);
+}
+
+}  // namespace oxen::rpc
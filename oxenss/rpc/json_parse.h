@@ -0,0 +1,22 @@
+#pragma once
+
+#include <nlohmann/json.hpp>
+
+#include <optional>
+#include <string_view>
+
+namespace oxen::rpc {
+
+// Parses a json request body.  Typical request bodies (objects, arrays, plain ASCII strings,
+// integers, booleans, and nulls) are handled by a fast single-pass scanner that copies string
+// values straight out of the input; anything else (string escapes, non-ASCII strings, floating
+// point values, very deep nesting, or invalid json) falls back to nlohmann's parser.  Returns a
+// discarded value (i.e. `.is_discarded()` is true) if `body` is not valid json.
+nlohmann::json parse_json(std::string_view body);
+
+namespace detail {
+    // The fast path of parse_json: returns nullopt if `body` needs the full parser.
+    std::optional<nlohmann::json> parse_simple_json(std::string_view body);
+}  // namespace detail
+
+}  // namespace oxen::rpc
@@ -7,12 +7,30 @@
 #include <nlohmann/json.hpp>
 #include <oxenc/base64.h>
 
+#include <cassert>
+
 using nlohmann::json;
 
 namespace oxen::rpc {
 
 static auto logcat = log::Cat("rpc");
 
+namespace {
+
+    // Trims `plaintext` in place down to `inner`, which must be a view into `plaintext`, and
+    // returns it.  This lets the inner payload reuse the decrypted buffer rather than copying it
+    // into a fresh allocation.  `inner` (and any other view into `plaintext`) is invalidated.
+    std::string take_inner(std::string& plaintext, std::string_view inner) {
+        assert(inner.data() >= plaintext.data() &&
+               inner.data() + inner.size() <= plaintext.data() + plaintext.size());
+        auto pos = static_cast<size_t>(inner.data() - plaintext.data());
+        plaintext.resize(pos + inner.size());
+        plaintext.erase(0, pos);
+        return std::move(plaintext);
+    }
+
+}  // namespace
+
 ParsedInfo process_inner_request(std::string plaintext) {
 
     ParsedInfo ret;
@@ -25,11 +43,11 @@ ParsedInfo process_inner_request(std::string plaintext) {
         if (inner_json.count("headers")) {
             log::trace(logcat, "Found body: <{}>", ciphertext);
             auto& [body, json, b64] = ret.emplace<FinalDestinationInfo>();
-            body = std::move(ciphertext);
             if (auto it = inner_json.find("json"); it != inner_json.end())
                 json = it->get<bool>();
             if (auto it = inner_json.find("base64"); it != inner_json.end())
                 b64 = it->get<bool>();
+            body = take_inner(plaintext, ciphertext);
         } else if (auto it = inner_json.find("host"); it != inner_json.end()) {
             auto& [payload, host, port, protocol, target] = ret.emplace<RelayToServerInfo>();
 
@@ -63,9 +81,8 @@ ParsedInfo process_inner_request(std::string plaintext) {
             // the json and just hope that they never conflict with something the storage server
             // wants to use.
             //
-            payload = std::move(plaintext);
-            host = it->get<std::string>();
-            target = inner_json.at("target").get<std::string>();
+            host = std::move(it->get_ref<std::string&>());
+            target = std::move(inner_json.at("target").get_ref<std::string&>());
 
             if (auto p = inner_json.find("port"); p != inner_json.end())
                 port = p->get<uint16_t>();
@@ -73,12 +90,13 @@ ParsedInfo process_inner_request(std::string plaintext) {
                 port = 443;
 
             if (auto p = inner_json.find("protocol"); p != inner_json.end())
-                protocol = p->get<std::string>();
+                protocol = std::move(p->get_ref<std::string&>());
             else
                 protocol = "https";
+
+            payload = std::move(plaintext);
         } else {
             auto& [ctext, eph_key, enc_type, next] = ret.emplace<RelayToNodeInfo>();
-            ctext = std::move(ciphertext);
             next = crypto::ed25519_pubkey::from_hex(
                     inner_json.at("destination").get_ref<const std::string&>());
             eph_key = crypto::x25519_pubkey::from_hex(
@@ -87,6 +105,7 @@ ParsedInfo process_inner_request(std::string plaintext) {
                 enc_type = crypto::parse_enc_type(it->get_ref<const std::string&>());
             else
                 enc_type = crypto::EncryptType::aes_gcm;
+            ctext = take_inner(plaintext, ciphertext);
         }
     } catch (const std::exception& e) {
         log::debug(logcat, "Error parsing inner JSON in onion request: {}", e.what());
@@ -128,6 +147,7 @@ bool is_onion_url_target_allowed(std::string_view target) {
 
 /// We are expecting a payload of the following shape:
 /// | <4 bytes>: N | <N bytes>: ciphertext | <rest>: json as utf8 |
+/// The returned ciphertext is a view into `payload`.
 CiphertextPlusJson parse_combined_payload(std::string_view payload) {
 
     log::trace(logcat, "Parsing payload of length: {}", payload.size());
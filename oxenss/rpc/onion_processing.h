@@ -4,6 +4,7 @@
 #include "oxenss/crypto/keys.h"
 #include <nlohmann/json_fwd.hpp>
 #include <string>
+#include <string_view>
 #include <variant>
 
 namespace oxen::rpc {
@@ -13,7 +14,9 @@ namespace oxen::rpc {
 // starting at somewhere higher than 0.
 inline constexpr int MAX_ONION_HOPS = 15;
 
-using CiphertextPlusJson = std::pair<std::string, nlohmann::json>;
+// The ciphertext is a view into the payload passed to `parse_combined_payload`, and so is only
+// valid as long as that payload is.
+using CiphertextPlusJson = std::pair<std::string_view, nlohmann::json>;
 
 /// The request is to be forwarded to another SS node
 struct RelayToNodeInfo {
@@ -92,6 +95,8 @@ ParsedInfo process_ciphertext_v2(
 
 CiphertextPlusJson parse_combined_payload(std::string_view payload);
 
+// Parses a decrypted onion request.  The returned info takes over the `plaintext` buffer for
+// its body/ciphertext/payload rather than copying it, so callers should move it in.
 ParsedInfo process_inner_request(std::string plaintext);
 
 // Returns true if `target` is a permitted target for proxying http/https requests through an
@@ -1,9 +1,13 @@
 #include "rate_limiter.h"
 
 #include <chrono>
+#include <oxenc/endian.h>
 #include <oxenmq/oxenmq.h>
+#include <oxenss/utils/memory.hpp>
 
 #include <algorithm>
+#include <cstring>
+#include <functional>
 
 extern "C" {
 #include <arpa/inet.h>
@@ -11,50 +15,56 @@ extern "C" {
 
 namespace oxen::rpc {
 
-namespace {
+using namespace std::chrono;
 
-    using namespace std::chrono;
+RateLimiter::RateLimiter(oxenmq::OxenMQ& omq, rate_limit_config config) :
+        config_{config},
+        token_period_{1'000'000us / std::max<uint32_t>(config_.token_rate, 1)},
+        token_period_sn_{1'000'000us / std::max<uint32_t>(config_.token_rate_sn, 1)},
+        ipv6_mask_{~uint64_t{0} << (64 - std::clamp<int>(config_.ipv6_prefix, 32, 64))} {
+    const size_t ipv6_slots = std::max<size_t>(config_.ipv6_buckets / NUM_SHARDS, IPV6_PROBE);
+    for (auto& s : shards_)
+        s.ipv6_buckets.resize(ipv6_slots);
 
-    // Time between to consecutive tokens for clients
-    constexpr microseconds TOKEN_PERIOD_US = 1'000'000us / RateLimiter::TOKEN_RATE;
-
-    // Time between to consecutive tokens for snodes
-    constexpr microseconds TOKEN_PERIOD_SN_US = 1'000'000us / RateLimiter::TOKEN_RATE_SN;
-
-    constexpr microseconds FILL_EMPTY_BUCKET_US = TOKEN_PERIOD_US * RateLimiter::BUCKET_SIZE;
-
-}  // namespace
-
-RateLimiter::RateLimiter(oxenmq::OxenMQ& omq) {
     omq.add_timer(
             [this] {
-                std::lock_guard lock{mutex_};
-                clean_buckets(steady_clock::now());
+                auto& s = shards_[next_cleanup_];
+                next_cleanup_ = (next_cleanup_ + 1) % NUM_SHARDS;
+                std::lock_guard lock{s.mutex};
+                clean_buckets(s, steady_clock::now());
             },
-            10s);
+            duration_cast<milliseconds>(CLEANUP_INTERVAL) / NUM_SHARDS);
+}
+
+RateLimiter::shard& RateLimiter::shard_for(uint64_t hash) {
+    // Remix the hash so that shard selection doesn't correlate with the bucket placement inside
+    // the shard's unordered_map (which uses the same hash).
+    return shards_[((hash * 0x9E3779B97F4A7C15ULL) >> 60) & (NUM_SHARDS - 1)];
 }
 
-template <typename TokenBucket>
-static bool fill_bucket(
-        TokenBucket& bucket, steady_clock::time_point now, bool service_node = false) {
+bool RateLimiter::fill_bucket(TokenBucket& bucket, steady_clock::time_point now, bool sn) {
+    const auto token_period = sn ? token_period_sn_ : token_period_;
     auto elapsed_us = duration_cast<microseconds>(now - bucket.last_time_point);
     // clamp elapsed time to how long it takes to fill up the whole bucket
     // (simplifies overlow checking)
-    elapsed_us = std::min(elapsed_us, FILL_EMPTY_BUCKET_US);
-
-    const auto token_period = service_node ? TOKEN_PERIOD_SN_US : TOKEN_PERIOD_US;
+    elapsed_us = std::min(elapsed_us, token_period * config_.bucket_size);
 
     const uint32_t token_added = elapsed_us.count() / token_period.count();
     bucket.num_tokens += token_added;
-    if (bucket.num_tokens >= RateLimiter::BUCKET_SIZE) {
-        bucket.num_tokens = RateLimiter::BUCKET_SIZE;
+    if (bucket.num_tokens >= config_.bucket_size) {
+        bucket.num_tokens = config_.bucket_size;
         return true;
     }
     return false;
 }
 
-template <typename TokenBucket>
-static bool remove_token(TokenBucket& b, steady_clock::time_point now, bool sn = false) {
+bool RateLimiter::is_full(const TokenBucket& bucket, steady_clock::time_point now) const {
+    auto elapsed = duration_cast<microseconds>(now - bucket.last_time_point);
+    auto missing = config_.bucket_size - std::min(bucket.num_tokens, config_.bucket_size);
+    return elapsed >= token_period_ * missing;
+}
+
+bool RateLimiter::remove_token(TokenBucket& b, steady_clock::time_point now, bool sn) {
     fill_bucket(b, now, sn);
     if (b.num_tokens == 0)
         return false;
@@ -65,46 +75,112 @@ static bool remove_token(TokenBucket& b, steady_clock::time_point now, bool sn =
 
 bool RateLimiter::should_rate_limit(
         const crypto::legacy_pubkey& pubkey, steady_clock::time_point now) {
-    std::lock_guard lock{mutex_};
-    if (auto [it, ins] = snode_buckets_.emplace(pubkey, TokenBucket{BUCKET_SIZE - 1, now}); ins)
+    auto& s = shard_for(std::hash<crypto::legacy_pubkey>{}(pubkey));
+    std::lock_guard lock{s.mutex};
+    if (auto [it, ins] =
+                s.snode_buckets.emplace(pubkey, TokenBucket{config_.bucket_size - 1, now});
+        ins)
         return false;
     else
         return !remove_token(it->second, now, true);
 }
 
 bool RateLimiter::should_rate_limit_client(uint32_t ip, steady_clock::time_point now) {
-    std::lock_guard lock{mutex_};
+    auto& s = shard_for(ip);
+    std::lock_guard lock{s.mutex};
 
-    if (auto it = client_buckets_.find(ip); it != client_buckets_.end())
-        return !remove_token(it->second, now);
+    if (auto it = s.client_buckets.find(ip); it != s.client_buckets.end())
+        return !remove_token(it->second, now, false);
 
-    if (client_buckets_.size() >= MAX_CLIENTS) {
-        clean_buckets(now);
-        if (client_buckets_.size() >= MAX_CLIENTS)
+    if (num_clients_.load(std::memory_order_relaxed) >= config_.max_clients) {
+        // Only clean up this shard (rather than the whole table) to try to make room:
+        clean_buckets(s, now);
+        if (num_clients_.load(std::memory_order_relaxed) >= config_.max_clients)
             return true;
     }
-    client_buckets_.emplace(ip, TokenBucket{BUCKET_SIZE - 1, now});
+    s.client_buckets.emplace(ip, TokenBucket{config_.bucket_size - 1, now});
+    num_clients_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+bool RateLimiter::should_rate_limit_client_v6(
+        const std::array<unsigned char, 16>& ip, steady_clock::time_point now) {
+    constexpr std::array<unsigned char, 12> v4_mapped{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    if (std::equal(v4_mapped.begin(), v4_mapped.end(), ip.begin()))
+        return should_rate_limit_client(oxenc::load_big_to_host<uint32_t>(ip.data() + 12), now);
+
+    const uint64_t prefix = oxenc::load_big_to_host<uint64_t>(ip.data()) & ipv6_mask_;
+    const uint64_t hash = prefix * 0x9E3779B97F4A7C15ULL;
+    auto& s = shard_for(prefix);
+    std::lock_guard lock{s.mutex};
+
+    auto& slots = s.ipv6_buckets;
+    const size_t start = (hash >> 16) % slots.size();
+    ipv6_bucket* vacant = nullptr;
+    for (size_t i = 0; i < IPV6_PROBE; i++) {
+        auto& b = slots[(start + i) % slots.size()];
+        if (b.used && b.prefix == prefix)
+            return !remove_token(b.bucket, now, false);
+        if (!vacant && (!b.used || is_full(b.bucket, now)))
+            vacant = &b;
+    }
+    if (!vacant)
+        return true;
+    vacant->prefix = prefix;
+    vacant->bucket = TokenBucket{config_.bucket_size - 1, now};
+    vacant->used = true;
     return false;
 }
 
-bool RateLimiter::should_rate_limit_client(
-        const std::string& ip_dotted_quad, steady_clock::time_point now) {
-    struct in_addr ip;
-    int res = inet_pton(AF_INET, ip_dotted_quad.c_str(), &ip);
-    return res == 1 ? should_rate_limit_client(ip.s_addr, now) : false;
+bool RateLimiter::should_rate_limit_client_addr(
+        std::string_view addr, steady_clock::time_point now) {
+    if (addr.size() == 4)
+        return should_rate_limit_client(oxenc::load_big_to_host<uint32_t>(addr.data()), now);
+    if (addr.size() == 16) {
+        std::array<unsigned char, 16> ip;
+        std::memcpy(ip.data(), addr.data(), 16);
+        return should_rate_limit_client_v6(ip, now);
+    }
+    return true;
 }
 
-void RateLimiter::clean_buckets(steady_clock::time_point now) {
-    for (auto it = client_buckets_.begin(); it != client_buckets_.end();) {
-        if (fill_bucket(it->second, now))
-            it = client_buckets_.erase(it);
-        else
+bool RateLimiter::should_rate_limit_client(const std::string& ip, steady_clock::time_point now) {
+    if (struct in_addr ip4; inet_pton(AF_INET, ip.c_str(), &ip4) == 1)
+        return should_rate_limit_client(oxenc::big_to_host(ip4.s_addr), now);
+
+    std::string_view addr{ip};
+    if (addr.size() >= 2 && addr.front() == '[' && addr.back() == ']')
+        addr = addr.substr(1, addr.size() - 2);
+    std::array<unsigned char, 16> ip6;
+    if (inet_pton(AF_INET6, std::string{addr}.c_str(), ip6.data()) == 1)
+        return should_rate_limit_client_v6(ip6, now);
+    return false;
+}
+
+size_t RateLimiter::memory_usage() {
+    size_t bytes = 0;
+    for (auto& s : shards_) {
+        std::lock_guard lock{s.mutex};
+        bytes += util::memory_of(s.snode_buckets) + util::memory_of(s.client_buckets) +
+                 util::memory_of(s.ipv6_buckets);
+    }
+    return bytes;
+}
+
+void RateLimiter::clean_buckets(shard& s, steady_clock::time_point now) {
+    size_t removed = 0;
+    for (auto it = s.client_buckets.begin(); it != s.client_buckets.end();) {
+        if (fill_bucket(it->second, now, false)) {
+            it = s.client_buckets.erase(it);
+            removed++;
+        } else
             ++it;
     }
+    num_clients_.fetch_sub(removed, std::memory_order_relaxed);
 
-    for (auto it = snode_buckets_.begin(); it != snode_buckets_.end();) {
+    for (auto it = s.snode_buckets.begin(); it != s.snode_buckets.end();) {
         if (fill_bucket(it->second, now, true))
-            it = snode_buckets_.erase(it);
+            it = s.snode_buckets.erase(it);
         else
             ++it;
     }
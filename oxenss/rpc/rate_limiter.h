@@ -1,9 +1,14 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <chrono>
 #include <cstdint>
 #include <mutex>
+#include <string>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
 
 #include <oxenss/crypto/keys.h>
 
@@ -15,18 +20,44 @@ class OxenMQ;
 
 namespace oxen::rpc {
 
+struct rate_limit_config {
+    // Maximum number of requests that can be made in a burst
+    uint32_t bucket_size = 600;
+
+    // Tokens (requests) per second for clients and service nodes
+    uint32_t token_rate = 300;
+    uint32_t token_rate_sn = 600;
+
+    // Maximum number of client IPs we track at once; new clients beyond this are rate limited
+    // until some existing bucket refills.
+    uint32_t max_clients = 10000;
+
+    // IPv6 clients share a bucket per network prefix of this many bits (between 32 and 64), so
+    // that a client can't escape rate limiting by rotating through the addresses of its /64.
+    uint8_t ipv6_prefix = 64;
+
+    // Number of slots in the fixed-size IPv6 prefix bucket table.
+    uint32_t ipv6_buckets = 16384;
+};
+
 class RateLimiter {
   public:
-    // TODO: make those two constants command line parameters?
-    inline constexpr static uint32_t BUCKET_SIZE = 600;
+    // Defaults; these can be changed by passing a rate_limit_config to the constructor.
+    inline constexpr static uint32_t BUCKET_SIZE = rate_limit_config{}.bucket_size;
+    inline constexpr static uint32_t TOKEN_RATE = rate_limit_config{}.token_rate;
+    inline constexpr static uint32_t TOKEN_RATE_SN = rate_limit_config{}.token_rate_sn;
+    inline constexpr static uint32_t MAX_CLIENTS = rate_limit_config{}.max_clients;
+
+    // Buckets are split across this many independently locked shards (by hashed IP/pubkey) so
+    // that concurrent requests from different clients rarely contend on the same lock.
+    inline constexpr static size_t NUM_SHARDS = 16;
 
-    // Tokens (requests) per second
-    inline constexpr static uint32_t TOKEN_RATE = 300;  // Too much for a client??
-    inline constexpr static uint32_t TOKEN_RATE_SN = 600;
-    inline constexpr static uint32_t MAX_CLIENTS = 10000;
+    // How often we clean up (i.e. drop full buckets from) all shards; cleanup proceeds one shard
+    // at a time spread across this interval rather than locking everything at once.
+    inline constexpr static auto CLEANUP_INTERVAL = std::chrono::seconds{10};
 
     RateLimiter() = delete;
-    RateLimiter(oxenmq::OxenMQ& omq);
+    explicit RateLimiter(oxenmq::OxenMQ& omq, rate_limit_config config = {});
 
     bool should_rate_limit(
             const crypto::legacy_pubkey& pubkey,
@@ -35,24 +66,70 @@ class RateLimiter {
             uint32_t ip,
             std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
 
-    // Same as above, but takes a "a.b.c.d" string.  Returns false (i.e. don't rate limit) if
-    // the given address isn't parseable as an IPv4 address at all.
+    // Rate limits an IPv6 client, by its configured network prefix.  IPv4-mapped addresses
+    // (::ffff:a.b.c.d) are treated as the IPv4 address they map.
+    bool should_rate_limit_client_v6(
+            const std::array<unsigned char, 16>& ip,
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+    // Same as above, but takes a packed 4-byte (IPv4) or 16-byte (IPv6) network-order address.
+    // Returns true (i.e. rate limit) if given anything else.
+    bool should_rate_limit_client_addr(
+            std::string_view addr,
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+    // Same as above, but takes a "a.b.c.d" or IPv6 address string.  Returns false (i.e. don't
+    // rate limit) if the given address isn't parseable as an IP address at all.
     bool should_rate_limit_client(
-            const std::string& ip_dotted_quad,
+            const std::string& ip,
             std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
 
+    const rate_limit_config& config() const { return config_; }
+
+    // Returns an estimate of the memory (in bytes) held by the rate limiting buckets.
+    size_t memory_usage();
+
   private:
     struct TokenBucket {
         uint32_t num_tokens;
         std::chrono::steady_clock::time_point last_time_point;
     };
 
-    std::mutex mutex_;
+    // IPv6 buckets live in a fixed-size, open-addressed table (split across the shards) rather
+    // than a map: a prefix can only go in one of the IPV6_PROBE slots after the one it hashes to,
+    // and when all of them belong to other prefixes that haven't refilled the new prefix is rate
+    // limited.  A slot whose bucket has refilled is free for reuse, so no cleanup is needed.
+    inline constexpr static size_t IPV6_PROBE = 8;
+
+    struct ipv6_bucket {
+        uint64_t prefix;
+        TokenBucket bucket;
+        bool used = false;
+    };
+
+    struct alignas(64) shard {
+        std::mutex mutex;
+        std::unordered_map<crypto::legacy_pubkey, TokenBucket> snode_buckets;
+        std::unordered_map<uint32_t, TokenBucket> client_buckets;
+        std::vector<ipv6_bucket> ipv6_buckets;
+    };
+
+    const rate_limit_config config_;
+    const std::chrono::microseconds token_period_, token_period_sn_;
+    const uint64_t ipv6_mask_;
+
+    std::array<shard, NUM_SHARDS> shards_;
+    std::atomic<size_t> num_clients_{0};
+    size_t next_cleanup_ = 0;  // Only accessed from the cleanup timer
+
+    shard& shard_for(uint64_t hash);
 
-    std::unordered_map<crypto::legacy_pubkey, TokenBucket> snode_buckets_;
-    std::unordered_map<uint32_t, TokenBucket> client_buckets_;
+    bool fill_bucket(TokenBucket& bucket, std::chrono::steady_clock::time_point now, bool sn);
+    bool is_full(const TokenBucket& bucket, std::chrono::steady_clock::time_point now) const;
+    bool remove_token(TokenBucket& bucket, std::chrono::steady_clock::time_point now, bool sn);
 
-    void clean_buckets(std::chrono::steady_clock::time_point now);
+    // Drops full buckets from a shard; the shard's mutex must be held.
+    void clean_buckets(shard& s, std::chrono::steady_clock::time_point now);
 };
 
 }  // namespace oxen::rpc
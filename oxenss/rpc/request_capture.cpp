@@ -0,0 +1,187 @@
+#include "request_capture.h"
+
+#include <oxenss/utils/random.hpp>
+#include <oxenss/utils/time.hpp>
+
+#include <fmt/std.h>
+#include <oxen/log.hpp>
+#include <sodium/crypto_generichash.h>
+#include <sodium/randombytes.h>
+
+#include <cstring>
+#include <functional>
+#include <random>
+
+namespace oxen::rpc {
+
+static auto logcat = log::Cat("capture");
+
+using nlohmann::json;
+
+namespace {
+    // Subrequests of batch/sequence requests are described too, but not any deeper than this
+    constexpr int MAX_DEPTH = 2;
+
+    template <typename T>
+    void copy_number(json& out, const char* key, const json& params, const char* param) {
+        if (auto it = params.find(param); it != params.end() && it->is_number())
+            out[key] = it->get<T>();
+    }
+}  // namespace
+
+RequestCapture::RequestCapture(capture_config conf) : conf_{std::move(conf)} {
+    if (conf_.file.empty() || !(conf_.sample_rate > 0))
+        return;
+    randombytes_buf(account_key_.data(), account_key_.size());
+    out_.open(conf_.file, std::ios::out | std::ios::trunc);
+    if (!out_) {
+        log::error(logcat, "Unable to open request capture file {}", conf_.file);
+        return;
+    }
+    auto header = json{
+                          {"capture", 1},
+                          {"started", to_epoch_ms(std::chrono::system_clock::now())},
+                          {"sample_rate", conf_.sample_rate}}
+                          .dump();
+    out_ << header << '\n';
+    written_ = header.size() + 1;
+    enabled_ = true;
+    log::info(
+            logcat,
+            "Capturing {}% of requests to {}",
+            conf_.sample_rate * 100,
+            conf_.file);
+}
+
+std::shared_ptr<captured_request> RequestCapture::sample(
+        std::string_view kind, std::string_view transport, std::string_view method) {
+    if (!enabled_ ||
+        (conf_.sample_rate < 1 &&
+         std::uniform_real_distribution<double>{}(util::rng()) >= conf_.sample_rate))
+        return nullptr;
+    auto req = std::make_shared<captured_request>();
+    auto& e = req->entry;
+    e["t"] = std::chrono::duration_cast<std::chrono::microseconds>(req->started - started_)
+                     .count();
+    e["kind"] = kind;
+    if (!transport.empty())
+        e["transport"] = transport;
+    if (!method.empty())
+        e["method"] = method;
+    return req;
+}
+
+uint32_t RequestCapture::account_id(std::string_view pubkey) const {
+    // A keyed hash with a key that only lives as long as this process: the same pubkey always maps
+    // to the same id within a capture, but ids can't be matched back to pubkeys (or across
+    // captures).
+    unsigned char hash[crypto_generichash_BYTES_MIN];
+    crypto_generichash(
+            hash,
+            sizeof(hash),
+            reinterpret_cast<const unsigned char*>(pubkey.data()),
+            pubkey.size(),
+            account_key_.data(),
+            account_key_.size());
+    uint32_t id;
+    std::memcpy(&id, hash, sizeof(id));
+    return id;
+}
+
+static void describe_params(
+        json& out,
+        const json& params,
+        const std::function<uint32_t(std::string_view)>& account_id,
+        int depth) {
+    if (!params.is_object())
+        return;
+    if (auto it = params.find("pubkey"); it != params.end() && it->is_string())
+        out["account"] = account_id(it->get_ref<const std::string&>());
+    if (auto it = params.find("namespace"); it != params.end()) {
+        if (it->is_number_integer())
+            out["ns"] = it->get<int>();
+        else if (it->is_string() && it->get_ref<const std::string&>() == "all")
+            out["ns"] = "all";
+    }
+    if (auto it = params.find("data"); it != params.end() && it->is_string())
+        out["data"] = it->get_ref<const std::string&>().size();
+    if (auto it = params.find("ttl"); it != params.end() && it->is_number())
+        out["ttl"] = it->get<int64_t>();
+    else if (auto it = params.find("expiry"); it != params.end() && it->is_number())
+        out["ttl"] = it->get<int64_t>() - to_epoch_ms(std::chrono::system_clock::now());
+    if (auto it = params.find("last_hash"); it != params.end() && it->is_string() &&
+                                            !it->get_ref<const std::string&>().empty())
+        out["last_hash"] = true;
+    if (auto it = params.find("messages"); it != params.end() && it->is_array())
+        out["count"] = it->size();
+    copy_number<int64_t>(out, "max_count", params, "max_count");
+    copy_number<double>(out, "max_size", params, "max_size");
+
+    if (auto it = params.find("requests"); it != params.end() && it->is_array() && depth > 0) {
+        auto& sub = out["sub"] = json::array();
+        for (const auto& r : *it) {
+            auto& s = sub.emplace_back(json::object());
+            if (!r.is_object())
+                continue;
+            if (auto m = r.find("method"); m != r.end() && m->is_string())
+                s["method"] = *m;
+            if (auto p = r.find("params"); p != r.end())
+                describe_params(s, *p, account_id, depth - 1);
+        }
+    }
+}
+
+void RequestCapture::describe(captured_request& req, const json& params) const {
+    describe_params(
+            req.entry,
+            params,
+            [this](std::string_view pubkey) { return account_id(pubkey); },
+            MAX_DEPTH);
+}
+
+void RequestCapture::finish(captured_request& req, int status, std::string_view body) {
+    auto& e = req.entry;
+    e["status"] = status;
+    e["response"] = body.size();
+    if (status == 200 && e.value("method", "") == "retrieve")
+        // The response is already serialized (as JSON or bt-encoded); an empty message list is a
+        // miss.
+        e["hit"] = body.find(R"("messages":[])") == std::string_view::npos &&
+                   body.find("8:messageslee") == std::string_view::npos;
+    write(req);
+}
+
+void RequestCapture::finish(captured_request& req, int status, const json& body) {
+    auto& e = req.entry;
+    e["status"] = status;
+    e["response"] = body.dump().size();
+    if (status == 200 && e.value("method", "") == "retrieve") {
+        auto it = body.find("messages");
+        e["hit"] = it != body.end() && it->is_array() && !it->empty();
+    }
+    write(req);
+}
+
+void RequestCapture::write(captured_request& req) {
+    req.entry["latency_us"] = std::chrono::duration_cast<std::chrono::microseconds>(
+                                      std::chrono::steady_clock::now() - req.started)
+                                      .count();
+    auto line = req.entry.dump();
+
+    std::lock_guard lock{mutex_};
+    if (!enabled_)
+        return;
+    if (written_ + line.size() + 1 > conf_.max_size) {
+        log::warning(
+                logcat,
+                "Request capture file {} reached its maximum size; capturing stopped",
+                conf_.file);
+        out_.close();
+        enabled_ = false;
+        return;
+    }
+    out_ << line << '\n';
+    written_ += line.size() + 1;
+}
+
+}  // namespace oxen::rpc
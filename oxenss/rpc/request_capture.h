@@ -0,0 +1,99 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include <nlohmann/json.hpp>
+
+namespace oxen::rpc {
+
+// Request capture settings; see RequestCapture.
+struct capture_config {
+    // File to write captured requests to (replacing any existing file); capturing is off if
+    // empty.
+    std::filesystem::path file;
+
+    // Fraction of requests to capture.
+    double sample_rate = 0.01;
+
+    // Capturing stops once the file reaches this size.
+    uint64_t max_size = 1024ULL * 1024 * 1024;
+};
+
+// One request being captured: filled in with the shape of the request when it arrives, and with
+// the outcome when it completes.
+struct captured_request {
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    nlohmann::json entry;
+};
+
+// Records a sample of incoming requests (client RPC requests over HTTPS, OMQ and onion requests,
+// onion requests themselves, and monitor subscriptions) as anonymized request shapes with their
+// timing and outcome, for replaying a realistic load against a test node (see contrib/replay).
+//
+// The capture file is JSON lines: a header line {"capture": 1, "started": UNIX_MS, "sample_rate":
+// RATE}, then one line per request, in completion order, with keys:
+// - t -- when the request arrived, in microseconds since capturing started
+// - kind -- "client" (an RPC request), "onion" (an onion request, whatever its destination), or
+//   "monitor" (a monitor.messages subscription request)
+// - transport -- "https", "omq", or "onion" (for client requests that reached us inside an onion
+//   request)
+// - method -- the RPC method (client requests)
+// - account -- a small number standing in for the account pubkey: requests for the same account
+//   get the same number within one capture, but it can't be traced back to the pubkey
+// - ns, data (size of the message data), ttl (in ms), last_hash (true if given), count (number of
+//   hashes given), max_count, max_size -- request parameters, as far as they are present
+// - sub -- for batch and sequence requests, the (same format) shapes of the subrequests
+// - size -- size of the request (onion: ciphertext; monitor: number of entries)
+// - hop -- for onion requests, what they turned out to be: "final" (for us), "relay" (to another
+//   service node), "proxy" (to an external server), or "error"
+// - renewed -- for monitor requests, how many entries renewed an existing subscription
+// - status -- HTTP status of the response
+// - response -- size of the response body
+// - hit -- for retrieves, whether any messages were returned
+// - latency_us -- time from arrival until the response was ready
+//
+// Keys, hashes, signatures and message data are never recorded.
+//
+// All methods are thread-safe.
+class RequestCapture {
+  public:
+    explicit RequestCapture(capture_config conf = {});
+
+    bool enabled() const { return enabled_; }
+
+    // Decides whether to capture a request; returns the entry to fill in if so, nullptr
+    // otherwise.
+    std::shared_ptr<captured_request> sample(
+            std::string_view kind, std::string_view transport, std::string_view method = "");
+
+    // Adds the anonymized shape of client request parameters to an entry.
+    void describe(captured_request& req, const nlohmann::json& params) const;
+
+    // Records the outcome of a request and writes the entry out.
+    void finish(captured_request& req, int status, std::string_view body);
+    void finish(captured_request& req, int status, const nlohmann::json& body);
+
+  private:
+    const capture_config conf_;
+    std::atomic<bool> enabled_ = false;
+    std::array<unsigned char, 32> account_key_;  // Keys the account anonymization hash
+    const std::chrono::steady_clock::time_point started_ = std::chrono::steady_clock::now();
+
+    std::mutex mutex_;
+    std::ofstream out_;
+    uint64_t written_ = 0;
+
+    uint32_t account_id(std::string_view pubkey) const;
+    void write(captured_request& req);
+};
+
+}  // namespace oxen::rpc
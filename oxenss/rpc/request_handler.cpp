@@ -1,25 +1,31 @@
 #include "request_handler.h"
 #include <oxenss/crypto/channel_encryption.hpp>
 #include "client_rpc_endpoints.h"
+#include "json_parse.h"
 #include <oxen/log.hpp>
 #include <oxenss/server/utils.h>
 #include <oxenss/server/omq.h>
 #include <oxenss/logging/oxen_logger.h>
 #include <oxenss/snode/service_node.h>
+#include <oxenss/utils/base64.hpp>
 #include <oxenss/utils/string_utils.hpp>
 #include <oxenss/utils/time.hpp>
 #include <oxenss/version.h>
 #include <oxenss/common/mainnet.h>
 #include <oxenss/common/format.h>
 
+#include <atomic>
+#include <charconv>
 #include <chrono>
+#include <cmath>
 #include <future>
+#include <map>
 
-#include <cpr/cpr.h>
 #include <nlohmann/json.hpp>
 #include <oxenc/base32z.h>
 #include <oxenc/base64.h>
 #include <oxenc/hex.h>
+#include <oxenmq/batch.h>
 #include <oxenmq/oxenmq.h>
 #include <sodium/crypto_core_ed25519.h>
 #include <sodium/crypto_generichash.h>
@@ -28,6 +34,7 @@
 #include <sodium/crypto_sign.h>
 #include <stdexcept>
 #include <type_traits>
+#include <unordered_map>
 #include <variant>
 
 using nlohmann::json;
@@ -54,7 +61,7 @@ std::string to_string(const Response& res) {
 }
 
 namespace {
-    json swarm_to_json(const std::optional<snode::SwarmInfo>& swarm) {
+    json swarm_to_json(const snode::SwarmInfo* swarm) {
         if (!swarm)
             return json{
                     {"snodes", json::array()},
@@ -89,78 +96,128 @@ namespace {
         j["hf"] = sn.hf();
     }
 
-    std::string obfuscate_pubkey(const user_pubkey_t& pk) {
-        const auto& pk_raw = pk.raw();
-        if (pk_raw.empty())
-            return "(none)";
-        return oxenc::to_hex(pk_raw.begin(), pk_raw.begin() + 2) + u8"…" +
-               oxenc::to_hex(std::prev(pk_raw.end()), pk_raw.end());
-    }
-
-    template <typename RPC, typename Params>
-    RPC load_request(Params&& params) {
-        RPC req;
-        req.load_from(std::forward<Params>(params));
-        if constexpr (std::is_base_of_v<rpc::recursive, RPC>)
-            // This func is only called for loading subrequests and http_json requests, both of
-            // which are only initiated by a top-level client so we are always going to recurse:
-            req.recurse = true;
-        return req;
-    }
+    // Builds a retrieve response directly in its final wire format (json, or a bt-encoded dict)
+    // from retrieved message views, without building an intermediate json object.  The result has
+    // exactly the same keys and values as the json response we would otherwise build (and then
+    // dump or convert to bt), i.e.:
+    //
+    //     {"hf": [19, 3], "messages": [{"data": ..., "expiration": ..., "hash": ...,
+    //      "timestamp": ...}, ...], "more": false, "t": ...}
+    //
+    // with keys in sorted order (as required for bt-encoding, and as nlohmann::json produces).
+    class retrieve_response_writer {
+        std::string out;
+        const bool bt;
+        bool first = true;
+
+        void append_int(int64_t val) {
+            char buf[20];
+            auto [p, ec] = std::to_chars(buf, buf + sizeof(buf), val);
+            out.append(buf, p - buf);
+        }
+        void append_bt_int(int64_t val) {
+            out += 'i';
+            append_int(val);
+            out += 'e';
+        }
+        void append_bt_string(std::string_view s) {
+            append_int(s.size());
+            out += ':';
+            out += s;
+        }
+        void append_json_string(std::string_view s) {
+            out += '"';
+            for (char c : s) {
+                if (c == '"' || c == '\\') {
+                    out += '\\';
+                    out += c;
+                } else if (static_cast<unsigned char>(c) < 0x20) {
+                    constexpr auto hex = "0123456789abcdef"sv;
+                    out += "\\u00"sv;
+                    out += hex[c >> 4];
+                    out += hex[c & 0xf];
+                } else
+                    out += c;
+            }
+            out += '"';
+        }
 
-    template <typename RPC>
-    void register_client_rpc_endpoint(RequestHandler::rpc_map& regs) {
-        RequestHandler::rpc_handler calls;
-        calls.load_req = [](std::variant<json, oxenc::bt_dict_consumer> params) -> client_request {
-            return std::visit(
-                    [](auto&& params) { return load_request<RPC>(std::move(params)); },
-                    std::move(params));
-        };
-        calls.http_json = [](RequestHandler& h, json params, std::function<void(Response)> cb) {
-            auto req = load_request<RPC>(std::move(params));
-            h.process_client_req(std::move(req), std::move(cb));
-        };
-        calls.omq = [](rpc::RequestHandler& h,
-                       std::string_view params,
-                       [[maybe_unused]] bool forwarded,
-                       std::function<void(rpc::Response)> cb) {
-            RPC req;
-            if (params.empty())
-                params = "{}"sv;
-            if (params.front() == 'd') {
-                req.load_from(oxenc::bt_dict_consumer{params});
-                req.b64 = false;
+      public:
+        // Starts a response; `bt` specifies whether we are writing bt-encoded or json output.  In
+        // json mode message data gets base64-encoded; in bt mode it is included as raw bytes.
+        retrieve_response_writer(bool bt, const snode::hf_revision& hf) : bt{bt} {
+            out.reserve(256);
+            if (bt) {
+                out += "d2:hfl"sv;
+                append_bt_int(hf.first);
+                append_bt_int(hf.second);
+                out += "e8:messagesl"sv;
             } else {
-                auto body = nlohmann::json::parse(params, nullptr, false);
-                if (body.is_discarded()) {
-                    log::debug(logcat, "Bad OMQ client request: not valid json or bt_dict");
-                    return cb(rpc::Response{
-                            http::BAD_REQUEST, "invalid body: expected json or bt_dict"sv});
-                }
-                req.load_from(std::move(body));
-            }
-            if constexpr (std::is_base_of_v<rpc::recursive, RPC>) {
-                req.recurse = !forwarded;
-            } else if (forwarded) {
-                return cb(rpc::Response{
-                        http::BAD_REQUEST,
-                        "invalid request: received invalid forwarded non-forwardable request"sv});
+                out += "{\"hf\":["sv;
+                append_int(hf.first);
+                out += ',';
+                append_int(hf.second);
+                out += "],\"messages\":["sv;
             }
+        }
 
-            h.process_client_req(std::move(req), std::move(cb));
-        };
+        void append(const message_view& msg) {
+            const size_t data_size = bt ? msg.data.size() : (msg.data.size() + 2) / 3 * 4;
+            // Each message has about 70 bytes of keys, punctuation, and timestamps; reserve
+            // enough space up front so that we don't have to reallocate while appending.
+            // (std::string grows geometrically on reserve, so this is amortized).
+            out.reserve(out.size() + data_size + msg.hash.size() + 100);
+
+            if (bt) {
+                out += "d4:data"sv;
+                append_bt_string(msg.data);
+                out += "10:expiration"sv;
+                append_bt_int(to_epoch_ms(msg.expiry));
+                out += "4:hash"sv;
+                append_bt_string(msg.hash);
+                out += "9:timestamp"sv;
+                append_bt_int(to_epoch_ms(msg.timestamp));
+                out += 'e';
+            } else {
+                if (!first)
+                    out += ',';
+                out += "{\"data\":\""sv;
+                auto pos = out.size();
+                out.resize(pos + util::base64_encoded_size(msg.data.size()));
+                util::base64_encode(msg.data, out.data() + pos);
+                out += "\",\"expiration\":"sv;
+                append_int(to_epoch_ms(msg.expiry));
+                out += ",\"hash\":"sv;
+                append_json_string(msg.hash);
+                out += ",\"timestamp\":"sv;
+                append_int(to_epoch_ms(msg.timestamp));
+                out += '}';
+            }
+            first = false;
+        }
 
-        for (auto& name : RPC::names()) {
-            [[maybe_unused]] auto [it, ins] = regs.emplace(name, calls);
-            assert(ins);
+        // Finishes the response, returning the encoded value.  The writer must not be used
+        // after calling this.
+        std::string finish(bool more, std::chrono::system_clock::time_point now) {
+            if (bt) {
+                out += more ? "e4:morei1e1:t"sv : "e4:morei0e1:t"sv;
+                append_bt_int(to_epoch_ms(now));
+                out += 'e';
+            } else {
+                out += more ? "],\"more\":true,\"t\":"sv : "],\"more\":false,\"t\":"sv;
+                append_int(to_epoch_ms(now));
+                out += '}';
+            }
+            return std::move(out);
         }
-    }
+    };
 
-    template <typename... RPC>
-    RequestHandler::rpc_map register_client_rpc_endpoints(type_list<RPC...>) {
-        RequestHandler::rpc_map regs;
-        (register_client_rpc_endpoint<RPC>(regs), ...);
-        return regs;
+    std::string obfuscate_pubkey(const user_pubkey_t& pk) {
+        const auto& pk_raw = pk.raw();
+        if (pk_raw.empty())
+            return "(none)";
+        return oxenc::to_hex(pk_raw.begin(), pk_raw.begin() + 2) + u8"…" +
+               oxenc::to_hex(std::prev(pk_raw.end()), pk_raw.end());
     }
 
     // For any integer (or timestamp) arguments convert to string using the provided buffer;
@@ -253,9 +310,12 @@ namespace {
         return data;
     }
 
+    // Verifies a signature of the given message parts, using the ed25519 pubkey (for a 05-prefixed
+    // account, if given) or the pubkey itself, and optional subkey.  This only does the
+    // cryptographic verification; checking whether a subkey is revoked is up to the caller (see
+    // verify_request_signature).
     template <typename... T>
     bool verify_signature(
-            oxen::Database& db,
             const user_pubkey_t& pubkey,
             const std::optional<std::array<unsigned char, 32>>& pk_ed25519,
             const std::optional<std::array<unsigned char, 32>>& subkey,
@@ -281,15 +341,10 @@ namespace {
 
         std::array<unsigned char, 32> subkey_pub;
         if (subkey) {
-            if (db.subkey_revoked(*subkey)) {
-                log::warning(logcat, "Signature verification failed: subkey previously revoked");
-                return false;
-            }
-
             // Compute our verification key: (c + H("OxenSSSubkey" || c || A)) A and use that
             // instead of A for verification:
             try {
-                subkey_pub = crypto::subkey_verify_key(pk, subkey->data());
+                subkey_pub = crypto::cached_subkey_verify_key(pk, subkey->data());
             } catch (const std::invalid_argument& ex) {
                 log::warning(logcat, "Signature verification failed: {}", ex.what());
                 return false;
@@ -307,6 +362,157 @@ namespace {
         return verified;
     }
 
+    const std::optional<std::array<unsigned char, 32>> no_subkey;
+
+    // Invokes `f` with the arguments to verify_signature (i.e. the pubkey, ed25519 pubkey, subkey,
+    // signature, and signed message parts) for a signed request.  The same definitions are used
+    // when handling requests, and for verifying batch subrequests signatures in parallel before
+    // they get dispatched.
+    template <typename F>
+    auto with_signature(const rpc::store& r, F&& f) {
+        return f(
+                r.pubkey,
+                r.pubkey_ed25519,
+                r.subkey,
+                *r.signature,
+                "store",
+                r.msg_namespace == namespace_id::Default ? "" : to_string(r.msg_namespace),
+                *r.sig_ts);
+    }
+    template <typename F>
+    auto with_signature(const rpc::retrieve& r, F&& f) {
+        return f(
+                r.pubkey,
+                r.pubkey_ed25519,
+                r.subkey,
+                r.signature,
+                "retrieve",
+                r.msg_namespace != namespace_id::Default ? std::to_string(to_int(r.msg_namespace))
+                                                         : ""s,
+                r.timestamp);
+    }
+    template <typename F>
+    auto with_signature(const rpc::delete_all& r, F&& f) {
+        return f(
+                r.pubkey,
+                r.pubkey_ed25519,
+                no_subkey,
+                r.signature,
+                "delete_all",
+                signature_value(r.msg_namespace),
+                r.timestamp);
+    }
+    template <typename F>
+    auto with_signature(const rpc::delete_msgs& r, F&& f) {
+        return f(r.pubkey, r.pubkey_ed25519, no_subkey, r.signature, "delete", r.messages);
+    }
+    template <typename F>
+    auto with_signature(const rpc::revoke_subkey& r, F&& f) {
+        return f(
+                r.pubkey,
+                r.pubkey_ed25519,
+                no_subkey,
+                r.signature,
+                "revoke_subkey",
+                util::view_guts(r.revoke_subkey));
+    }
+    template <typename F>
+    auto with_signature(const rpc::delete_before& r, F&& f) {
+        return f(
+                r.pubkey,
+                r.pubkey_ed25519,
+                no_subkey,
+                r.signature,
+                "delete_before",
+                signature_value(r.msg_namespace),
+                r.before);
+    }
+    template <typename F>
+    auto with_signature(const rpc::expire_all& r, F&& f) {
+        return f(
+                r.pubkey,
+                r.pubkey_ed25519,
+                no_subkey,
+                r.signature,
+                "expire_all",
+                signature_value(r.msg_namespace),
+                r.expiry);
+    }
+    template <typename F>
+    auto with_signature(const rpc::expire_msgs& r, F&& f) {
+        return f(
+                r.pubkey,
+                r.pubkey_ed25519,
+                r.subkey,
+                r.signature,
+                "expire",
+                r.shorten  ? "shorten"
+                : r.extend ? "extend"
+                           : "",
+                r.expiry,
+                r.messages);
+    }
+    template <typename F>
+    auto with_signature(const rpc::get_expiries& r, F&& f) {
+        return f(
+                r.pubkey,
+                r.pubkey_ed25519,
+                r.subkey,
+                r.signature,
+                "get_expiries",
+                r.sig_ts,
+                r.messages);
+    }
+
+    template <typename RPC>
+    constexpr bool is_signed_request = std::is_same_v<RPC, rpc::store> ||
+                                       std::is_same_v<RPC, rpc::retrieve> ||
+                                       std::is_same_v<RPC, rpc::delete_all> ||
+                                       std::is_same_v<RPC, rpc::delete_msgs> ||
+                                       std::is_same_v<RPC, rpc::revoke_subkey> ||
+                                       std::is_same_v<RPC, rpc::delete_before> ||
+                                       std::is_same_v<RPC, rpc::expire_all> ||
+                                       std::is_same_v<RPC, rpc::expire_msgs> ||
+                                       std::is_same_v<RPC, rpc::get_expiries>;
+
+    // Returns true if the given request carries a signature that its handler will verify
+    template <typename RPC>
+    bool has_signature(const RPC& req) {
+        if constexpr (std::is_same_v<RPC, rpc::store>)
+            return req.signature.has_value();
+        else if constexpr (std::is_same_v<RPC, rpc::retrieve>)
+            return req.check_signature;
+        else
+            return is_signed_request<RPC>;
+    }
+
+    // Verifies the signature of a signed request, rejecting the request if it uses a revoked
+    // subkey.  If the signature was already verified (see
+    // RequestHandler::preverify_signatures) then we use that result rather than verifying again.
+    template <typename RPC>
+    bool verify_request_signature(oxen::Database& db, const RPC& req) {
+        return with_signature(
+                req,
+                [&](const user_pubkey_t& pubkey,
+                    const auto& pk_ed25519,
+                    const auto& subkey,
+                    const auto& sig,
+                    const auto&... parts) {
+                    if (subkey && db.subkey_revoked(*subkey)) {
+                        log::warning(
+                                logcat, "Signature verification failed: subkey previously revoked");
+                        return false;
+                    }
+                    if (req.signature_verified) {
+                        if (!*req.signature_verified)
+                            log::debug(logcat, "Signature verification failed");
+                        return *req.signature_verified;
+                    }
+                    util::traced span{"verify_signature"};
+                    return verify_signature(pubkey, pk_ed25519, subkey, sig, parts...);
+                });
+    }
+
     template <typename... T>
     std::array<unsigned char, 64> create_signature(
             const crypto::ed25519_seckey& sk, const T&... val) {
@@ -323,24 +529,25 @@ namespace {
 
 }  // namespace
 
-const RequestHandler::rpc_map RequestHandler::client_rpc_endpoints =
-        register_client_rpc_endpoints(rpc::client_rpc_types{});
-
-std::string compute_hash_blake2b_b64(std::vector<std::string_view> parts) {
+hash_b64 blake2b_b64_parts(const std::string_view* parts, size_t count) {
     constexpr size_t HASH_SIZE = 32;
+    static_assert(util::base64_encoded_size(HASH_SIZE) == hash_b64::SIZE + 1);
     crypto_generichash_state state;
     crypto_generichash_init(&state, nullptr, 0, HASH_SIZE);
-    for (const auto& s : parts)
+    for (size_t i = 0; i < count; i++)
         crypto_generichash_update(
-                &state, reinterpret_cast<const unsigned char*>(s.data()), s.size());
-    std::array<unsigned char, HASH_SIZE> hash;
-    crypto_generichash_final(&state, hash.data(), HASH_SIZE);
-
-    std::string b64hash = oxenc::to_base64(hash.begin(), hash.end());
-    // Trim padding:
-    while (!b64hash.empty() && b64hash.back() == '=')
-        b64hash.pop_back();
-    return b64hash;
+                &state, reinterpret_cast<const unsigned char*>(parts[i].data()), parts[i].size());
+    std::array<char, HASH_SIZE> hash;
+    crypto_generichash_final(&state, reinterpret_cast<unsigned char*>(hash.data()), HASH_SIZE);
+
+    // Encodes with one character of padding, which view() leaves off
+    hash_b64 result;
+    util::base64_encode({hash.data(), hash.size()}, result.b64.data());
+    return result;
+}
+
+std::string compute_hash_blake2b_b64(std::initializer_list<std::string_view> parts) {
+    return blake2b_b64_parts(parts.begin(), parts.size()).str();
 }
 
 // FIXME: remove this after fully transitioned to HF19.3
@@ -372,42 +579,196 @@ std::string computeMessageHash(
     char* ns_buf_ptr = ns_buf.data();
     std::string_view ns_for_hash =
             ns != namespace_id::Default ? detail::to_hashable(to_int(ns), ns_buf_ptr) : ""sv;
-    return compute_hash(
-            compute_hash_blake2b_b64, std::string_view{&netid, 1}, pubkey.raw(), ns_for_hash, data);
+    return blake2b_b64(std::string_view{&netid, 1}, pubkey.raw(), ns_for_hash, data).str();
 }
 
 RequestHandler::RequestHandler(
-        snode::ServiceNode& sn, const crypto::ChannelEncryption& ce, crypto::ed25519_seckey edsk) :
-        service_node_{sn}, channel_cipher_(ce), ed25519_sk_{std::move(edsk)} {
-    // Periodically clean up any proxy request futures
-    service_node_.omq_server()->add_timer(
-            [this] {
-                pending_proxy_requests_.remove_if(
-                        [](auto& f) { return f.wait_for(0ms) == std::future_status::ready; });
-            },
-            1s);
+        snode::ServiceNode& sn,
+        const crypto::ChannelEncryption& ce,
+        crypto::ed25519_seckey edsk,
+        util::trace_config trace,
+        recursive_config recursive,
+        capture_config capture) :
+        service_node_{sn},
+        channel_cipher_(ce),
+        ed25519_sk_{std::move(edsk)},
+        tracer_{std::move(trace)},
+        capture_{std::move(capture)},
+        recursive_{recursive} {}
+
+std::function<void(Response)> RequestHandler::capture_response(
+        std::shared_ptr<captured_request> req, std::function<void(Response)> cb) {
+    return [this, req = std::move(req), cb = std::move(cb)](Response res) {
+        if (auto* j = std::get_if<json>(&res.body))
+            capture_.finish(*req, res.status.first, *j);
+        else
+            capture_.finish(*req, res.status.first, view_body(res));
+        cb(std::move(res));
+    };
+}
+
+struct RequestHandler::encoded_swarm {
+    json value;                // {"snodes": [...], "swarm": "..."}
+    std::string json_members;  // `value` serialized as json, without the enclosing {}
+    std::string bt_members;    // `value` bt-encoded, without the enclosing d...e
+
+    explicit encoded_swarm(const snode::SwarmInfo* swarm) : value{swarm_to_json(swarm)} {
+        json_members = value.dump();
+        json_members = json_members.substr(1, json_members.size() - 2);
+        bt_members = server::bt_serialize_json(value);
+        bt_members = bt_members.substr(1, bt_members.size() - 2);
+    }
+};
+
+struct RequestHandler::swarm_responses {
+    std::shared_ptr<const snode::Swarm> swarm;  // The snapshot these were encoded from
+    std::unordered_map<snode::swarm_id_t, encoded_swarm> swarms;
+    encoded_swarm none{nullptr};  // For when we don't know any swarms
+};
+
+std::shared_ptr<const RequestHandler::encoded_swarm> RequestHandler::swarm_response(
+        const user_pubkey_t& pk) {
+    auto swarm = service_node_.swarm();
+    auto cached = std::atomic_load(&swarm_responses_);
+    if (!cached || cached->swarm != swarm) {
+        std::lock_guard lock{swarm_responses_mutex_};
+        cached = std::atomic_load(&swarm_responses_);
+        if (!cached || cached->swarm != swarm) {
+            auto fresh = std::make_shared<swarm_responses>();
+            fresh->swarm = swarm;
+            if (swarm)
+                for (const auto& s : swarm->all_valid_swarms())
+                    fresh->swarms.try_emplace(s.swarm_id, &s);
+            log::debug(logcat, "Encoded get_swarm responses for {} swarms", fresh->swarms.size());
+            std::atomic_store(&swarm_responses_, fresh);
+            cached = std::move(fresh);
+        }
+    }
+
+    const encoded_swarm* result = &cached->none;
+    if (auto* info = swarm ? swarm->find_swarm(pk) : nullptr)
+        if (auto it = cached->swarms.find(info->swarm_id); it != cached->swarms.end())
+            result = &it->second;
+    return {std::move(cached), result};
 }
 
 Response RequestHandler::handle_wrong_swarm(const user_pubkey_t& pubKey) {
     log::trace(logcat, "Got client request to a wrong swarm");
 
-    json swarm = swarm_to_json(service_node_.get_swarm(pubKey));
+    json swarm = swarm_response(pubKey)->value;
     add_misc_response_fields(swarm, service_node_);
     return {http::MISDIRECTED_REQUEST, std::move(swarm)};
 }
 
 struct swarm_response {
-    std::mutex mutex;
-    int pending;
+    // Where the response of one swarm peer goes.  Each slot is only written by the callback for
+    // its peer, which sets `done` once it has finished writing; after that it belongs to whoever
+    // sends the reply.
+    struct peer_slot {
+        std::string ed25519_hex;
+        nlohmann::json result;
+        std::string raw;  // See `bt`
+        std::atomic<bool> done{false};
+    };
+
     bool b64;
+    // True if the final response goes straight back to a bt-encoded OMQ request, in which case
+    // successful peer responses are kept (in `raw_swarm`) as the bt-encoded dicts we got from the
+    // peers and spliced into the bt-encoded response as-is rather than converted to json and
+    // back.
+    bool bt = false;
+    // Our own result; only touched by the thread handling the request until `local_done` is set.
     nlohmann::json result;
+    std::map<std::string, std::string> raw_swarm;
     std::function<void(rpc::Response)> cb;
+
+    std::unique_ptr<peer_slot[]> peers;
+    size_t peer_count = 0;
+    // How many peers need to have answered before we reply (see recursive_config)
+    size_t quorum = 0;
+    std::atomic<size_t> answered{0};
+    std::atomic<bool> local_done{false};
+    std::atomic<bool> deadline_passed{false};
+    std::atomic<bool> replied{false};
 };
 
+// Returns true if `bt` is a valid bt-encoded dict, setting `failed` to whether it contains a
+// top-level "failed" key.
+static bool check_peer_bt_response(std::string_view bt, bool& failed) {
+    failed = false;
+    try {
+        oxenc::bt_dict_consumer d{bt};
+        while (!d.is_finished()) {
+            if (d.key() == "failed")
+                failed = true;
+            d.skip_value();
+        }
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+// Builds the bt-encoded response for a `bt` swarm response, merging the raw peer responses into
+// the "swarm" dict.
+static std::string serialize_bt_swarm_response(swarm_response& res) {
+    std::string out;
+    out += 'd';
+    bool wrote_swarm = false;
+    auto write_swarm = [&] {
+        out += "5:swarmd";
+        static const json no_swarm = json::object();
+        auto found = res.result.find("swarm");
+        const json& json_swarm = found != res.result.end() ? *found : no_swarm;
+        auto jit = json_swarm.begin();
+        auto jend = json_swarm.end();
+        auto rit = res.raw_swarm.begin();
+        while (jit != jend || rit != res.raw_swarm.end()) {
+            if (rit == res.raw_swarm.end() || (jit != jend && jit.key() < rit->first)) {
+                server::bt_append_string(out, jit.key());
+                server::bt_append_json(out, jit.value());
+                ++jit;
+            } else {
+                server::bt_append_string(out, rit->first);
+                out += rit->second;
+                ++rit;
+            }
+        }
+        out += 'e';
+        wrote_swarm = true;
+    };
+    for (auto& [k, v] : res.result.items()) {
+        if (!wrote_swarm && (k == "swarm" || (k > "swarm" && !res.raw_swarm.empty()))) {
+            write_swarm();
+            if (k == "swarm")
+                continue;
+        }
+        server::bt_append_string(out, k);
+        server::bt_append_json(out, v);
+    }
+    if (!wrote_swarm && !res.raw_swarm.empty())
+        write_swarm();
+    out += 'e';
+    return out;
+}
+
 // Replies to a recursive swarm request via its callback; sends an http::OK unless all of the
 // swarm entries returned things with "failed" in them, in which case we send back an
 // INTERNAL_SERVER_ERROR along with the response.
+//
+// Peers that haven't answered yet (because we're replying early on reaching a quorum or the
+// deadline) are included in the swarm results as failed with "pending" set.
 void reply_or_fail(const std::shared_ptr<swarm_response>& res) {
+    for (size_t i = 0; i < res->peer_count; i++) {
+        auto& peer = res->peers[i];
+        if (!peer.done.load(std::memory_order_acquire))
+            res->result["swarm"][peer.ed25519_hex] = json{{"failed", true}, {"pending", true}};
+        else if (!peer.raw.empty())
+            res->raw_swarm[peer.ed25519_hex] = std::move(peer.raw);
+        else
+            res->result["swarm"][peer.ed25519_hex] = std::move(peer.result);
+    }
+
     auto res_code = http::INTERNAL_SERVER_ERROR;
     for (const auto& [snode, reply] : res->result.items()) {
         if (!reply.count("failed")) {
@@ -415,23 +776,84 @@ void reply_or_fail(const std::shared_ptr<swarm_response>& res) {
             break;
         }
     }
+    if (res->bt && !res->raw_swarm.empty()) {
+        if (res_code != http::OK)
+            for (auto& [snode, reply] : res->raw_swarm) {
+                bool failed;
+                if (check_peer_bt_response(reply, failed) && !failed) {
+                    res_code = http::OK;
+                    break;
+                }
+            }
+        return res->cb(Response{res_code, serialize_bt_swarm_response(*res)});
+    }
     res->cb(Response{res_code, std::move(res->result)});
 }
 
+// Sends the reply to a recursive request if we have our own result, and have heard back from
+// enough of the swarm (or have run out of time waiting) -- unless we already replied.
+static void maybe_reply(const std::shared_ptr<swarm_response>& res) {
+    if (!res->local_done)
+        return;
+    if (res->answered < res->quorum && !res->deadline_passed)
+        return;
+    if (res->replied.exchange(true))
+        return;
+    reply_or_fail(res);
+}
+
+// Called by the request handler once it has finished putting its own result into `res->result`.
+static void finish_local(std::shared_ptr<swarm_response> res) {
+    res->local_done = true;
+    maybe_reply(res);
+}
+
 static void distribute_command(
         snode::ServiceNode& sn,
-        std::shared_ptr<swarm_response>& res,
+        const std::shared_ptr<swarm_response>& res,
         std::string_view cmd,
-        const rpc::recursive& req) {
+        const rpc::recursive& req,
+        const recursive_config& conf) {
     auto peers = sn.get_swarm_peers();
-    res->pending += peers.size();
-
-    for (auto& peer : peers) {
-        sn.omq_server()->request(
-                peer.pubkey_x25519.view(),
-                "sn.storage_cc",
-                [res, peer, cmd](bool success, auto parts) {
-                    json peer_result;
+    if (peers.empty())
+        return;
+
+    res->peer_count = peers.size();
+    res->peers = std::make_unique<swarm_response::peer_slot[]>(peers.size());
+    res->quorum = conf.quorum >= 1.0
+                        ? peers.size()
+                        : std::min(
+                                  peers.size(),
+                                  static_cast<size_t>(std::ceil(conf.quorum * peers.size())));
+    for (size_t i = 0; i < peers.size(); i++)
+        res->peers[i].ed25519_hex = peers[i].pubkey_ed25519.hex();
+
+    if (conf.deadline.count() > 0 && res->quorum > 0) {
+        auto timer = std::make_shared<oxenmq::TimerID>();
+        auto& timer_ref = *timer;
+        sn.omq_server()->add_timer(
+                timer_ref,
+                [&sn, res, timer = std::move(timer)] {
+                    sn.omq_server()->cancel_timer(*timer);
+                    res->deadline_passed = true;
+                    maybe_reply(res);
+                },
+                conf.deadline);
+    }
+
+    const auto request = bt_serialize(req.to_bt());
+    for (size_t i = 0; i < peers.size(); i++) {
+        auto& peer = peers[i];
+        util::async_traced wait;
+        if (util::current_trace())
+            wait = util::async_traced{fmt::format("distribute {} to {}", cmd, peer.pubkey_legacy)};
+        sn.omq_server().forward_client_request(
+                peer.pubkey_x25519,
+                cmd,
+                request,
+                [res, &slot = res->peers[i], peer, cmd, wait](bool success, auto parts) {
+                    wait.finish();
+                    json& peer_result = slot.result;
                     if (!success)
                         log::warning(
                                 logcat,
@@ -439,7 +861,18 @@ static void distribute_command(
                                 peer.pubkey_legacy,
                                 cmd);
                     bool good_result = success && parts.size() == 1;
-                    if (good_result) {
+                    bool raw = false;
+                    if (good_result && res->bt) {
+                        bool failed;
+                        good_result = check_peer_bt_response(parts[0], failed);
+                        if (!good_result)
+                            log::warning(
+                                    logcat,
+                                    "Received unparseable response to {} from {}",
+                                    cmd,
+                                    peer.pubkey_legacy);
+                        raw = good_result;
+                    } else if (good_result) {
                         try {
                             peer_result = server::bt_to_json(oxenc::bt_dict_consumer{parts[0]});
                         } catch (const std::exception& e) {
@@ -453,11 +886,6 @@ static void distribute_command(
                         }
                     }
 
-                    std::lock_guard lock{res->mutex};
-
-                    // If we're the last response then we reply:
-                    bool send_reply = --res->pending == 0;
-
                     if (!good_result) {
                         peer_result = json{{"failed", true}};
                         if (!success)
@@ -473,37 +901,39 @@ static void distribute_command(
                             *it = oxenc::to_base64(it->get_ref<const std::string&>());
                     }
 
-                    res->result["swarm"][peer.pubkey_ed25519.hex()] = std::move(peer_result);
+                    if (raw)
+                        slot.raw = std::string{parts[0]};
 
-                    if (send_reply)
-                        reply_or_fail(res);
-                },
-                cmd,
-                bt_serialize(req.to_bt()),
-                oxenmq::send_option::request_timeout{5s});
+                    slot.done.store(true, std::memory_order_release);
+                    res->answered++;
+                    maybe_reply(res);
+                });
     }
 }
 
 template <typename RPC, typename = std::enable_if_t<std::is_base_of_v<rpc::recursive, RPC>>>
-std::pair<std::shared_ptr<swarm_response>, std::unique_lock<std::mutex>> static setup_recursive_request(
-        snode::ServiceNode& sn, RPC& req, std::function<void(Response)> cb) {
+static std::shared_ptr<swarm_response> setup_recursive_request(
+        snode::ServiceNode& sn,
+        RPC& req,
+        std::function<void(Response)> cb,
+        const recursive_config& conf) {
     auto res = std::make_shared<swarm_response>();
     res->cb = std::move(cb);
-    res->pending = 1;
     res->b64 = req.b64;
+    res->bt = req.direct && !req.b64;
 
-    std::unique_lock<std::mutex> lock{res->mutex, std::defer_lock};
-    if (req.recurse) {
+    if (req.recurse)
         // Send it off to our peers right away, before we process it ourselves
-        distribute_command(sn, res, RPC::names()[0], req);
-        lock.lock();
-    }
-    return {std::move(res), std::move(lock)};
+        distribute_command(sn, res, RPC::names()[0], req, conf);
+    return res;
 }
 
 void RequestHandler::process_client_req(rpc::store&& req, std::function<void(Response)> cb) {
 #ifndef NDEBUG
-    log::trace(logcat, "Storing message: {}", oxenc::to_base64(req.data));
+    log::trace(
+            logcat,
+            "Storing message: {}",
+            logging::lazy([&] { return oxenc::to_base64(req.data); }));
 #endif
 
     if (!service_node_.is_pubkey_for_us(req.pubkey))
@@ -542,15 +972,7 @@ void RequestHandler::process_client_req(rpc::store&& req, std::function<void(Res
                     http::NOT_ACCEPTABLE, "store signature timestamp too far from current time"sv});
         }
 
-        if (!verify_signature(
-                    service_node_.get_db(),
-                    req.pubkey,
-                    req.pubkey_ed25519,
-                    req.subkey,
-                    *req.signature,
-                    "store",
-                    req.msg_namespace == namespace_id::Default ? "" : to_string(req.msg_namespace),
-                    *req.sig_ts)) {
+        if (!verify_request_signature(service_node_.get_db(), req)) {
             log::debug(logcat, "store: signature verification failed");
             return cb(Response{http::UNAUTHORIZED, "store signature verification failed"sv});
         }
@@ -558,7 +980,7 @@ void RequestHandler::process_client_req(rpc::store&& req, std::function<void(Res
 
     bool entry_router = req.recurse == true;
 
-    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb));
+    auto res = setup_recursive_request(service_node_, req, std::move(cb), recursive_);
     auto& mine = req.recurse
                        ? res->result["swarm"][service_node_.own_address().pubkey_ed25519.hex()]
                        : res->result;
@@ -620,8 +1042,7 @@ void RequestHandler::process_client_req(rpc::store&& req, std::function<void(Res
                     : "",
             obfuscate_pubkey(req.pubkey));
 
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    finish_local(std::move(res));
 }
 
 void RequestHandler::process_client_req(
@@ -661,37 +1082,56 @@ void RequestHandler::process_client_req(
 
 void RequestHandler::process_client_req(
         rpc::get_swarm&& req, std::function<void(rpc::Response)> cb) {
-    const auto swarm = service_node_.get_swarm(req.pubkey);
+    const auto swarm = swarm_response(req.pubkey);
 
     log::debug(
             logcat,
             "get swarm for {}, swarm size: {}",
             obfuscate_pubkey(req.pubkey),
-            swarm ? swarm->snodes.size() : 0);
+            swarm->value["snodes"].size());
+
+    if (req.direct) {
+        // The response goes straight back to the client, so we can just wrap the pre-encoded
+        // swarm in the other (sorted) response keys rather than building and serializing json.
+        auto& hf = service_node_.hf();
+        auto t = to_epoch_ms(system_clock::now());
+        std::vector<std::pair<std::string, std::string>> headers;
+        std::string body;
+        if (req.b64) {
+            body = fmt::format(
+                    "{{\"hf\":[{},{}],{},\"t\":{}}}", hf.first, hf.second, swarm->json_members, t);
+            headers.emplace_back("Content-Type", "application/json");
+        } else
+            body = fmt::format(
+                    "d2:hfli{}ei{}ee{}1:ti{}ee", hf.first, hf.second, swarm->bt_members, t);
+        return cb(Response{http::OK, std::move(body), std::move(headers)});
+    }
 
-    auto body = swarm_to_json(swarm);
+    auto body = swarm->value;
     add_misc_response_fields(body, service_node_);
 
 #ifndef NDEBUG
-    log::trace(logcat, "swarm details for pk {}: {}", obfuscate_pubkey(req.pubkey), body.dump());
+    log::trace(
+            logcat,
+            "swarm details for pk {}: {}",
+            obfuscate_pubkey(req.pubkey),
+            logging::lazy([&] { return body.dump(); }));
 #endif
 
     cb(Response{http::OK, std::move(body)});
 }
 
-void RequestHandler::process_client_req(
-        rpc::retrieve&& req, std::function<void(rpc::Response)> cb) {
+std::optional<Response> RequestHandler::check_retrieve(
+        const rpc::retrieve& req, system_clock::time_point now) {
     if (!service_node_.is_pubkey_for_us(req.pubkey))
-        return cb(handle_wrong_swarm(req.pubkey));
-
-    auto now = system_clock::now();
+        return handle_wrong_swarm(req.pubkey);
 
     // At HF19 start requiring authentication for all retrievals (except legacy closed groups, which
     // can't be authenticated for technical reasons).
     if (req.msg_namespace != namespace_id::LegacyClosed) {
         if (!req.check_signature) {
             log::debug(logcat, "retrieve: request signature required");
-            return cb(Response{http::UNAUTHORIZED, "retrieve: request signature required"sv});
+            return Response{http::UNAUTHORIZED, "retrieve: request signature required"sv};
         }
     }
 
@@ -702,26 +1142,45 @@ void RequestHandler::process_client_req(
                     logcat,
                     "retrieve: invalid timestamp ({}s from now)",
                     duration_cast<seconds>(req.timestamp - now).count());
-            return cb(Response{
-                    http::NOT_ACCEPTABLE, "retrieve timestamp too far from current time"sv});
+            return Response{http::NOT_ACCEPTABLE, "retrieve timestamp too far from current time"sv};
         }
 
-        if (!verify_signature(
-                    service_node_.get_db(),
-                    req.pubkey,
-                    req.pubkey_ed25519,
-                    req.subkey,
-                    req.signature,
-                    "retrieve",
-                    req.msg_namespace != namespace_id::Default
-                            ? std::to_string(to_int(req.msg_namespace))
-                            : ""s,
-                    req.timestamp)) {
+        if (!verify_request_signature(service_node_.get_db(), req)) {
             log::debug(logcat, "retrieve: signature verification failed");
-            return cb(Response{http::UNAUTHORIZED, "retrieve signature verification failed"sv});
+            return Response{http::UNAUTHORIZED, "retrieve signature verification failed"sv};
         }
     }
 
+    return std::nullopt;
+}
+
+// Converts a negative (i.e. fractional) or too large retrieve max_size into the actual limit
+static int retrieve_size_limit(int max_size) {
+    if (max_size < 0)
+        return RETRIEVE_MAX_SIZE / -max_size;
+    return std::min<int>(max_size, RETRIEVE_MAX_SIZE);
+}
+
+// Builds the "messages" value of a retrieve response
+static json retrieve_messages_json(std::vector<message>& msgs, bool b64) {
+    json messages = json::array();
+    for (auto& msg : msgs) {
+        messages.push_back(json{
+                {"hash", msg.hash},
+                {"timestamp", to_epoch_ms(msg.timestamp)},
+                {"expiration", to_epoch_ms(msg.expiry)},
+                {"data", b64 ? util::base64_encode(msg.data) : std::move(msg.data)},
+        });
+    }
+    return messages;
+}
+
+void RequestHandler::process_client_req(
+        rpc::retrieve&& req, std::function<void(rpc::Response)> cb) {
+    auto now = system_clock::now();
+    if (auto error = check_retrieve(req, now))
+        return cb(std::move(*error));
+
     // Treat 0 count/size as unspecified:
     if (req.max_count && *req.max_count == 0)
         req.max_count.reset();
@@ -734,10 +1193,14 @@ void RequestHandler::process_client_req(
 
     // For negative max sizes, we treat it as a fraction of the max size, e.g. -1 means max; -5
     // means 1/5 of the max:
-    if (req.max_size && *req.max_size < 0) {
-        req.max_size = RETRIEVE_MAX_SIZE / -*req.max_size;
-    } else if (!req.max_size || *req.max_size > RETRIEVE_MAX_SIZE)
-        req.max_size = RETRIEVE_MAX_SIZE;
+    req.max_size = retrieve_size_limit(req.max_size.value_or(RETRIEVE_MAX_SIZE));
+
+    if (req.direct) {
+        service_node_.record_retrieve_request();
+        if (req.wait && req.can_wait)
+            return retrieve_or_wait(std::move(req), std::move(cb));
+        return shared_retrieve(req, std::move(cb));
+    }
 
     std::vector<message> msgs;
     bool more = false;
@@ -759,27 +1222,203 @@ void RequestHandler::process_client_req(
 
     log::trace(logcat, "Retrieved {} messages for {}", msgs.size(), obfuscate_pubkey(req.pubkey));
 
-    json messages = json::array();
-    for (const auto& msg : msgs) {
-        messages.push_back(json{
-                {"hash", msg.hash},
-                {"timestamp", to_epoch_ms(msg.timestamp)},
-                {"expiration", to_epoch_ms(msg.expiry)},
-                {"data", req.b64 ? oxenc::to_base64(msg.data) : std::move(msg.data)},
-        });
-    }
-
-    json res{{"messages", std::move(messages)}, {"more", more}};
+    json res{{"messages", retrieve_messages_json(msgs, req.b64)}, {"more", more}};
     add_misc_response_fields(res, service_node_, now);
 
     return cb(Response{http::OK, std::move(res)});
 }
 
-void RequestHandler::process_client_req(rpc::info&&, std::function<void(rpc::Response)> cb) {
-    return cb(Response{
-            http::OK,
-            json{{"version", STORAGE_SERVER_VERSION},
-                 {"timestamp", to_epoch_ms(system_clock::now())}}});
+std::optional<Response> RequestHandler::direct_retrieve(const rpc::retrieve& req, bool or_empty) {
+    // The response is going straight back to the client, so we can write it in its final form
+    // directly from the database results without making intermediate copies.
+    retrieve_response_writer out{!req.b64, service_node_.hf()};
+    size_t count = 0;
+    bool more;
+    try {
+        more = service_node_.get_db().retrieve(
+                req.pubkey,
+                req.msg_namespace,
+                req.last_hash.value_or(""),
+                [&](const message_view& msg) {
+                    out.append(msg);
+                    count++;
+                },
+                req.max_count,
+                req.max_size);
+    } catch (const std::exception& e) {
+        auto msg = fmt::format(
+                "Internal Server Error. Could not retrieve messages for {}",
+                obfuscate_pubkey(req.pubkey));
+        log::critical(logcat, msg);
+        return Response{http::INTERNAL_SERVER_ERROR, std::move(msg)};
+    }
+
+    log::trace(logcat, "Retrieved {} messages for {}", count, obfuscate_pubkey(req.pubkey));
+    if (count == 0 && !or_empty)
+        return std::nullopt;
+
+    std::vector<std::pair<std::string, std::string>> headers;
+    if (req.b64)
+        headers.emplace_back("Content-Type", "application/json");
+    return Response{http::OK, out.finish(more, system_clock::now()), std::move(headers)};
+}
+
+void RequestHandler::shared_retrieve(const rpc::retrieve& req, std::function<void(Response)> cb) {
+    // The key has to cover everything that affects the response: the account (including its
+    // network prefix), namespace, last hash, limits (max_size is always set by now), and
+    // encoding.  It also includes the account's change token, so that a retrieve arriving after a
+    // store or delete never gets the result of one that started before it.  The last hash goes
+    // last so that no separators are needed.
+    std::string key = req.pubkey.prefixed_raw();
+    key += req.b64 ? 'j' : 'b';
+    const int64_t fields[4] = {
+            static_cast<int64_t>(service_node_.get_db().account_token(req.pubkey)),
+            static_cast<int64_t>(req.msg_namespace),
+            req.max_count.value_or(0),
+            *req.max_size};
+    key.append(reinterpret_cast<const char*>(fields), sizeof(fields));
+    key += req.last_hash.value_or("");
+
+    bool ran = retrieve_flights_.run(
+            key,
+            [&] { return *direct_retrieve(req, true); },
+            [cb = std::move(cb)](const Response& res) { cb(res); });
+    if (!ran)
+        log::trace(
+                logcat,
+                "Joined in-flight retrieve for {} instead of querying",
+                obfuscate_pubkey(req.pubkey));
+}
+
+void RequestHandler::retrieve_or_wait(rpc::retrieve&& req, std::function<void(Response)> cb) {
+    if (auto res = direct_retrieve(req, false))
+        return cb(std::move(*res));
+
+    // Nothing yet, so park the request until a message arrives or the wait is over, and then
+    // retrieve again (and reply with whatever we get, even if nothing).  `replied` makes sure
+    // that only one of the wakeup and the recheck below replies.
+    struct waiting {
+        rpc::retrieve req;
+        std::function<void(Response)> cb;
+        std::atomic<bool> replied{false};
+    };
+    auto w = std::make_shared<waiting>();
+    w->req = std::move(req);
+    w->cb = std::move(cb);
+    auto& r = w->req;
+    auto parked = service_node_.omq_server().park_retrieve(
+            r.pubkey, r.msg_namespace, *r.wait, [this, w] {
+                if (!w->replied.exchange(true))
+                    shared_retrieve(w->req, w->cb);
+            });
+    if (!parked) {
+        log::debug(
+                logcat,
+                "Too many waiting retrieves; not waiting for {}",
+                obfuscate_pubkey(r.pubkey));
+        return shared_retrieve(r, std::move(w->cb));
+    }
+
+    // A message stored between our first retrieve and parking wouldn't have woken us, so check
+    // once more now that we're parked.  (This is cheap: the empty result above is cached.)  If
+    // that finds something we no longer need to wait, so we give up our place among the waiters
+    // rather than holding it until the wait runs out.
+    if (auto res = direct_retrieve(r, false); res && !w->replied.exchange(true)) {
+        service_node_.omq_server().unpark_retrieve(r.pubkey, *parked);
+        w->cb(std::move(*res));
+    }
+}
+
+void RequestHandler::process_client_req(
+        rpc::retrieve_multi&& req, std::function<void(rpc::Response)> cb) {
+    assert(!req.subreqs.empty());
+
+    auto subreqs = std::make_shared<std::vector<client_subrequest>>(std::move(req.subreqs));
+    preverify_signatures(
+            *subreqs,
+            [this, subreqs, max_size = req.max_size, b64 = req.b64, cb = std::move(cb)] {
+                dispatch_retrieve_multi(*subreqs, max_size, b64, cb);
+            });
+}
+
+void RequestHandler::dispatch_retrieve_multi(
+        std::vector<client_subrequest>& subreqs,
+        std::optional<int> max_size,
+        bool b64,
+        const std::function<void(Response)>& cb) {
+    auto now = system_clock::now();
+    json results = json::array();
+    std::vector<Database::retrieve_query> queries;
+    std::vector<size_t> query_result;  // The `results` index of each of `queries`
+    for (auto& sr : subreqs) {
+        auto& r = var::get<rpc::retrieve>(sr);
+        auto& res = results.emplace_back();
+        if (auto error = check_retrieve(r, now)) {
+            res["code"] = error->status.first;
+            if (auto* j = std::get_if<json>(&error->body))
+                res["body"] = std::move(*j);
+            else
+                res["body"] = std::string{view_body(*error)};
+            continue;
+        }
+        query_result.push_back(results.size() - 1);
+        auto& q = queries.emplace_back();
+        q.pubkey = r.pubkey;
+        q.ns = r.msg_namespace;
+        q.last_hash = r.last_hash.value_or("");
+        if (r.max_count && *r.max_count > 0)
+            q.max_results = *r.max_count;
+    }
+
+    if (!max_size || *max_size == 0)
+        max_size = RETRIEVE_MAX_SIZE;
+
+    if (!queries.empty()) {
+        std::vector<Database::retrieve_result> found;
+        try {
+            found = service_node_.get_db().retrieve_multi(
+                    queries, retrieve_size_limit(*max_size), b64);
+            for (size_t i = 0; i < queries.size(); i++)
+                service_node_.record_retrieve_request();
+        } catch (const std::exception& e) {
+            log::critical(
+                    logcat, "Internal Server Error. Could not retrieve messages: {}", e.what());
+            return cb(Response{
+                    http::INTERNAL_SERVER_ERROR,
+                    "Internal Server Error. Could not retrieve messages"sv});
+        }
+        for (size_t i = 0; i < found.size(); i++) {
+            auto& res = results[query_result[i]];
+            res["code"] = http::OK.first;
+            res["body"] = json{
+                    {"messages", retrieve_messages_json(found[i].messages, b64)},
+                    {"more", found[i].more}};
+        }
+        log::trace(logcat, "Retrieved messages for {} retrieve_multi requests", queries.size());
+    }
+
+    json body{{"results", std::move(results)}};
+    add_misc_response_fields(body, service_node_, now);
+    cb(Response{http::OK, std::move(body)});
+}
+
+void RequestHandler::process_client_req(rpc::info&& req, std::function<void(rpc::Response)> cb) {
+    auto now = to_epoch_ms(system_clock::now());
+    if (req.direct) {
+        // Everything but the timestamp (which sorts first) is fixed, so encode that just once.
+        static const auto& v = STORAGE_SERVER_VERSION;
+        static const std::string json_version =
+                fmt::format(",\"version\":[{},{},{}]}}", v[0], v[1], v[2]);
+        static const std::string bt_version =
+                fmt::format("7:versionli{}ei{}ei{}eee", v[0], v[1], v[2]);
+        if (req.b64)
+            return cb(Response{
+                    http::OK,
+                    "{\"timestamp\":" + std::to_string(now) + json_version,
+                    {{"Content-Type", "application/json"}}});
+        return cb(Response{http::OK, "d9:timestampi" + std::to_string(now) + "e" + bt_version});
+    }
+    return cb(Response{http::OK, json{{"version", STORAGE_SERVER_VERSION}, {"timestamp", now}}});
 }
 
 namespace {
@@ -841,20 +1480,12 @@ void RequestHandler::process_client_req(
         return cb(
                 Response{http::NOT_ACCEPTABLE, "delete_all timestamp too far from current time"sv});
     }
-    if (!verify_signature(
-                service_node_.get_db(),
-                req.pubkey,
-                req.pubkey_ed25519,
-                std::nullopt,  // no subkey allowed
-                req.signature,
-                "delete_all",
-                signature_value(req.msg_namespace),
-                req.timestamp)) {
+    if (!verify_request_signature(service_node_.get_db(), req)) {
         log::debug(logcat, "delete_all: signature verification failed");
         return cb(Response{http::UNAUTHORIZED, "delete_all signature verification failed"sv});
     }
 
-    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb));
+    auto res = setup_recursive_request(service_node_, req, std::move(cb), recursive_);
 
     // If we're recursive then put our stuff inside "swarm" alongside all the other results,
     // otherwise keep it top-level
@@ -887,8 +1518,7 @@ void RequestHandler::process_client_req(
     if (req.recurse)
         add_misc_response_fields(res->result, service_node_, now);
 
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    finish_local(std::move(res));
 }
 
 void RequestHandler::process_client_req(rpc::delete_msgs&& req, std::function<void(Response)> cb) {
@@ -897,14 +1527,7 @@ void RequestHandler::process_client_req(rpc::delete_msgs&& req, std::function<vo
     if (!service_node_.is_pubkey_for_us(req.pubkey))
         return cb(handle_wrong_swarm(req.pubkey));
 
-    if (!verify_signature(
-                service_node_.get_db(),
-                req.pubkey,
-                req.pubkey_ed25519,
-                std::nullopt,  // no subkey allowed
-                req.signature,
-                "delete",
-                req.messages)) {
+    if (!verify_request_signature(service_node_.get_db(), req)) {
         log::debug(logcat, "delete_msgs: signature verification failed");
         return cb(Response{http::UNAUTHORIZED, "delete_msgs signature verification failed"sv});
     }
@@ -931,7 +1554,7 @@ void RequestHandler::process_client_req(rpc::delete_msgs&& req, std::function<vo
         };
     }
 
-    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb));
+    auto res = setup_recursive_request(service_node_, req, std::move(cb), recursive_);
 
     // If we're recursive then put our stuff inside "swarm" alongside all the other results,
     // otherwise keep it top-level
@@ -947,8 +1570,7 @@ void RequestHandler::process_client_req(rpc::delete_msgs&& req, std::function<vo
     if (req.recurse)
         add_misc_response_fields(res->result, service_node_);
 
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    finish_local(std::move(res));
 }
 
 void RequestHandler::process_client_req(
@@ -958,19 +1580,12 @@ void RequestHandler::process_client_req(
     if (!service_node_.is_pubkey_for_us(req.pubkey))
         return cb(handle_wrong_swarm(req.pubkey));
 
-    if (!verify_signature(
-                service_node_.get_db(),
-                req.pubkey,
-                req.pubkey_ed25519,
-                std::nullopt,  // no subkey allowed
-                req.signature,
-                "revoke_subkey",
-                util::view_guts(req.revoke_subkey))) {
+    if (!verify_request_signature(service_node_.get_db(), req)) {
         log::debug(logcat, "revoke_subkey: signature verification failed");
         return cb(Response{http::UNAUTHORIZED, "revoke_subkey signature verification failed"sv});
     }
 
-    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb));
+    auto res = setup_recursive_request(service_node_, req, std::move(cb), recursive_);
 
     // Put our stuff inside "swarm" alongside all the other results
     auto& mine = req.recurse
@@ -984,8 +1599,7 @@ void RequestHandler::process_client_req(
     if (req.recurse)
         add_misc_response_fields(res->result, service_node_);
 
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    finish_local(std::move(res));
 }
 
 void RequestHandler::process_client_req(
@@ -1004,20 +1618,12 @@ void RequestHandler::process_client_req(
         return cb(Response{http::UNAUTHORIZED, "delete_before timestamp too far in the future"sv});
     }
 
-    if (!verify_signature(
-                service_node_.get_db(),
-                req.pubkey,
-                req.pubkey_ed25519,
-                std::nullopt,  // no subkey allowed
-                req.signature,
-                "delete_before",
-                signature_value(req.msg_namespace),
-                req.before)) {
+    if (!verify_request_signature(service_node_.get_db(), req)) {
         log::debug(logcat, "delete_before: signature verification failed");
         return cb(Response{http::UNAUTHORIZED, "delete_before signature verification failed"sv});
     }
 
-    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb));
+    auto res = setup_recursive_request(service_node_, req, std::move(cb), recursive_);
 
     // If we're recursive then put our stuff inside "swarm" alongside all the other results,
     // otherwise keep it top-level
@@ -1049,8 +1655,7 @@ void RequestHandler::process_client_req(
     if (req.recurse)
         add_misc_response_fields(res->result, service_node_, now);
 
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    finish_local(std::move(res));
 }
 
 void RequestHandler::process_client_req(rpc::expire_all&& req, std::function<void(Response)> cb) {
@@ -1069,20 +1674,12 @@ void RequestHandler::process_client_req(rpc::expire_all&& req, std::function<voi
                 Response{http::NOT_ACCEPTABLE, "expire_all timestamp should be >= current time"sv});
     }
 
-    if (!verify_signature(
-                service_node_.get_db(),
-                req.pubkey,
-                req.pubkey_ed25519,
-                std::nullopt,  // no subkey allowed
-                req.signature,
-                "expire_all",
-                signature_value(req.msg_namespace),
-                req.expiry)) {
+    if (!verify_request_signature(service_node_.get_db(), req)) {
         log::debug(logcat, "expire_all: signature verification failed");
         return cb(Response{http::UNAUTHORIZED, "expire_all signature verification failed"sv});
     }
 
-    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb));
+    auto res = setup_recursive_request(service_node_, req, std::move(cb), recursive_);
 
     // If we're recursive then put our stuff inside "swarm" alongside all the other results,
     // otherwise keep it top-level
@@ -1113,8 +1710,7 @@ void RequestHandler::process_client_req(rpc::expire_all&& req, std::function<voi
     if (req.recurse)
         add_misc_response_fields(res->result, service_node_, now);
 
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    finish_local(std::move(res));
 }
 void RequestHandler::process_client_req(rpc::expire_msgs&& req, std::function<void(Response)> cb) {
     log::debug(logcat, "processing expire {} request", req.recurse ? "direct" : "forwarded");
@@ -1145,23 +1741,12 @@ void RequestHandler::process_client_req(rpc::expire_msgs&& req, std::function<vo
                 http::BAD_REQUEST,
                 "expire: shorten parameter cannot be used with subkey authentication"sv});
 
-    if (!verify_signature(
-                service_node_.get_db(),
-                req.pubkey,
-                req.pubkey_ed25519,
-                req.subkey,
-                req.signature,
-                "expire",
-                req.shorten  ? "shorten"
-                : req.extend ? "extend"
-                             : "",
-                req.expiry,
-                req.messages)) {
+    if (!verify_request_signature(service_node_.get_db(), req)) {
         log::debug(logcat, "expire: signature verification failed");
         return cb(Response{http::UNAUTHORIZED, "expire: signature verification failed"sv});
     }
 
-    auto [res, lock] = setup_recursive_request(service_node_, req, std::move(cb));
+    auto res = setup_recursive_request(service_node_, req, std::move(cb), recursive_);
 
     // If we're recursive then put our stuff inside "swarm" alongside all the other results,
     // otherwise keep it top-level
@@ -1173,36 +1758,27 @@ void RequestHandler::process_client_req(rpc::expire_msgs&& req, std::function<vo
                          ? TTL_MAXIMUM_PRIVATE
                          : TTL_MAXIMUM;
     auto expiry = std::min(std::chrono::system_clock::now() + max_ttl, req.expiry);
+    std::map<std::string, int64_t> unchanged;
     auto updated = service_node_.get_db().update_expiry(
             req.pubkey,
             req.messages,
             expiry,
             /*extend_only=*/req.extend || req.subkey,
-            /*shorten_only=*/req.shorten);
+            /*shorten_only=*/req.shorten,
+            &unchanged);
     std::sort(updated.begin(), updated.end());
 
-    std::map<std::string, int64_t> unchanged;
-    if (req.extend || req.shorten) {
-        std::vector<std::string> unchanged_hashes;
-        for (const auto& m : req.messages)
-            if (!std::binary_search(updated.begin(), updated.end(), m))
-                unchanged_hashes.push_back(m);
-        if (!unchanged_hashes.empty())
-            unchanged = service_node_.get_db().get_expiries(req.pubkey, unchanged_hashes);
-    }
-
     auto sig = create_signature(
             ed25519_sk_, req.pubkey.prefixed_hex(), expiry, req.messages, updated, unchanged);
     mine["expiry"] = to_epoch_ms(expiry);
     mine["updated"] = std::move(updated);
-    if (req.shorten || req.extend)
+    if (req.shorten || req.extend || !unchanged.empty())
         mine["unchanged"] = std::move(unchanged);
     mine["signature"] = req.b64 ? oxenc::to_base64(sig.begin(), sig.end()) : util::view_guts(sig);
     if (req.recurse)
         add_misc_response_fields(res->result, service_node_, now);
 
-    if (--res->pending == 0)
-        reply_or_fail(std::move(res));
+    finish_local(std::move(res));
 }
 
 void RequestHandler::process_client_req(rpc::get_expiries&& req, std::function<void(Response)> cb) {
@@ -1221,15 +1797,7 @@ void RequestHandler::process_client_req(rpc::get_expiries&& req, std::function<v
                 http::NOT_ACCEPTABLE, "get_expiries timestamp too far from current time"sv});
     }
 
-    if (!verify_signature(
-                service_node_.get_db(),
-                req.pubkey,
-                req.pubkey_ed25519,
-                req.subkey,
-                req.signature,
-                "get_expiries",
-                req.sig_ts,
-                req.messages)) {
+    if (!verify_request_signature(service_node_.get_db(), req)) {
         log::debug(logcat, "get_expiries: signature verification failed");
         return cb(Response{http::UNAUTHORIZED, "get_expiries signature verification failed"sv});
     }
@@ -1253,7 +1821,19 @@ void RequestHandler::process_client_req(rpc::batch&& req, std::function<void(rpc
     for (size_t i = 0; i < req.subreqs.size(); i++)
         subresults->emplace_back();
 
-    for (size_t i = 0; i < req.subreqs.size(); i++) {
+    auto subreqs = std::make_shared<std::vector<client_subrequest>>(std::move(req.subreqs));
+    preverify_signatures(*subreqs, [this, subreqs, subresults, cb = std::move(cb)] {
+        dispatch_grouped(*subreqs, cb, [this, subreqs, subresults](auto cb) {
+            dispatch_batch(*subreqs, subresults, std::move(cb));
+        });
+    });
+}
+
+void RequestHandler::dispatch_batch(
+        std::vector<client_subrequest>& subreqs,
+        std::shared_ptr<json> subresults,
+        std::function<void(rpc::Response)> cb) {
+    for (size_t i = 0; i < subreqs.size(); i++) {
         auto handler = [subresults, i, cb](Response r) {
             json& subres = (*subresults)[i];
             subres["code"] = r.status.first;
@@ -1274,8 +1854,117 @@ void RequestHandler::process_client_req(rpc::batch&& req, std::function<void(rpc
                 [this, handler = std::move(handler)](auto&& s) {
                     process_client_req(std::move(s), std::move(handler));
                 },
-                req.subreqs[i]);
+                subreqs[i]);
+    }
+}
+
+void RequestHandler::preverify_signatures(
+        std::vector<client_subrequest>& subreqs, std::function<void()> done) {
+    std::vector<std::function<void()>> jobs;
+    for (auto& subreq : subreqs)
+        var::visit(
+                [&jobs](auto& r) {
+                    using RPC = std::remove_cv_t<std::remove_reference_t<decltype(r)>>;
+                    if constexpr (is_signed_request<RPC>)
+                        if (has_signature(r))
+                            jobs.push_back([&r] {
+                                r.signature_verified = with_signature(r, [](const auto&... args) {
+                                    return verify_signature(args...);
+                                });
+                            });
+                },
+                subreq);
+
+    // Not worth the thread hand-offs for a single signature
+    if (jobs.size() < 2)
+        return done();
+
+    util::async_traced span{"verify_signatures"};
+    span.value("count", jobs.size());
+    oxenmq::Batch<void> batch;
+    batch.reserve(jobs.size());
+    for (auto& job : jobs)
+        batch.add_job(std::move(job));
+    batch.completion([done = std::move(done), span, trace = util::current_trace()](auto&&) {
+        span.finish();
+        util::trace_scope scope{trace};
+        done();
+    });
+    service_node_.omq_server()->batch(std::move(batch));
+}
+
+namespace {
+    // What a batch or sequence subrequest does with the database, if anything
+    std::optional<Database::batch_access> batch_access(const client_subrequest& subreq) {
+        return var::visit(
+                [](const auto& r) -> std::optional<Database::batch_access> {
+                    using RPC = std::remove_cv_t<std::remove_reference_t<decltype(r)>>;
+                    // The swarm-recursive requests are the ones that change messages
+                    if constexpr (std::is_same_v<RPC, rpc::store>)
+                        return Database::batch_access{r.pubkey, true, r.data.size()};
+                    else if constexpr (std::is_base_of_v<rpc::recursive, RPC>)
+                        return Database::batch_access{r.pubkey, true};
+                    else if constexpr (
+                            std::is_same_v<RPC, rpc::retrieve> ||
+                            std::is_same_v<RPC, rpc::get_expiries>)
+                        return Database::batch_access{r.pubkey};
+                    else
+                        return std::nullopt;
+                },
+                subreq);
     }
+
+    // A response held back until its database batch has been committed
+    struct held_response {
+        std::mutex mutex;
+        bool holding = true;
+        bool failed = false;  // Set if the batch's writes couldn't be committed
+        std::optional<Response> response;
+    };
+}  // namespace
+
+void RequestHandler::dispatch_grouped(
+        const std::vector<client_subrequest>& subreqs,
+        std::function<void(Response)> cb,
+        const std::function<void(std::function<void(Response)>)>& dispatch) {
+    std::vector<Database::batch_access> accesses;
+    for (const auto& subreq : subreqs)
+        if (auto access = batch_access(subreq))
+            accesses.push_back(std::move(*access));
+    auto batch = service_node_.get_db().begin_batch(accesses);
+    if (!batch)
+        return dispatch(std::move(cb));
+
+    // Subrequests that don't recurse through the swarm finish right away, so the response can be
+    // ready before the batch commits: if we sent it then, the client could go on to make requests
+    // that don't yet see its changes.
+    // Responses that only come later (after waiting for the swarm) went through the batch too, so
+    // they also have to fail if the batch didn't get committed.
+    auto held = std::make_shared<held_response>();
+    dispatch([held, cb](Response r) {
+        {
+            std::lock_guard lock{held->mutex};
+            if (held->holding) {
+                held->response = std::move(r);
+                return;
+            }
+            if (held->failed)
+                r = Response{http::INTERNAL_SERVER_ERROR, "request failed"sv};
+        }
+        cb(std::move(r));
+    });
+    bool committed = batch.commit();
+
+    std::optional<Response> response;
+    {
+        std::lock_guard lock{held->mutex};
+        held->holding = false;
+        held->failed = !committed;
+        response = std::move(held->response);
+    }
+    if (response)
+        cb(committed ? std::move(*response)
+                     : Response{http::INTERNAL_SERVER_ERROR, "request failed"sv});
 }
 
 namespace {
@@ -1283,6 +1972,7 @@ namespace {
         std::vector<client_subrequest> subreqs;
         json subresults = json::array();
         std::function<void(Response r)> subresult_callback;
+        std::function<void(Response r)> cb;  // Gets the final response
     };
 }  // namespace
 
@@ -1312,7 +2002,7 @@ void RequestHandler::process_client_req(
     //
     auto manager = std::make_shared<sequence_manager>();
     manager->subreqs = std::move(req.subreqs);
-    manager->subresult_callback = [this, manager, cb = std::move(cb)](Response r) {
+    manager->subresult_callback = [this, manager](Response r) {
         json& subres = manager->subresults.emplace_back();
         auto status = r.status.first;
         subres["code"] = status;
@@ -1322,8 +2012,12 @@ void RequestHandler::process_client_req(
             subres["body"] = std::string{view_body(r)};
 
         if (status < 200 || status > 299 || manager->subresults.size() >= manager->subreqs.size()) {
+            // Clearing the callback destroys this lambda (and maybe the manager), so take what
+            // we still need first
+            auto done = std::move(manager->cb);
+            auto results = std::move(manager->subresults);
             manager->subresult_callback = nullptr;
-            cb(Response{http::OK, json({{"results", std::move(manager->subresults)}})});
+            done(Response{http::OK, json({{"results", std::move(results)}})});
         } else {
             // subrequest was successful and we're not done, so fire off the next one
             var::visit(
@@ -1334,11 +2028,18 @@ void RequestHandler::process_client_req(
         }
     };
 
-    var::visit(
-            [&](auto&& subreq) {
-                process_client_req(std::move(subreq), manager->subresult_callback);
-            },
-            manager->subreqs[0]);
+    // Whatever runs without waiting on the swarm (i.e. up to and including the first request that
+    // recurses) gets its database work grouped.
+    preverify_signatures(manager->subreqs, [this, manager, cb = std::move(cb)] {
+        dispatch_grouped(manager->subreqs, cb, [this, manager](auto cb) {
+            manager->cb = std::move(cb);
+            var::visit(
+                    [&](auto&& subreq) {
+                        process_client_req(std::move(subreq), manager->subresult_callback);
+                    },
+                    manager->subreqs[0]);
+        });
+    });
 }
 
 void RequestHandler::process_client_req(rpc::ifelse&& req, std::function<void(rpc::Response)> cb) {
@@ -1369,11 +2070,75 @@ void RequestHandler::process_client_req(rpc::ifelse&& req, std::function<void(rp
             std::move(*subreq));
 }
 
+namespace {
+    // Starts a trace of a request (if the tracer wants one), backdated to include the time the
+    // request spent in transport and queued.
+    std::shared_ptr<util::request_trace> start_trace(
+            util::Tracer* tracer,
+            std::string_view method,
+            const RequestHandler::request_timing& timing,
+            std::chrono::steady_clock::time_point now) {
+        if (!tracer || !tracer->enabled())
+            return nullptr;
+        auto queued = now - timing.queue.value_or(0s);
+        auto received = queued - timing.transport.value_or(0s);
+        auto trace = tracer->start(std::string{method}, received);
+        if (trace && timing.transport)
+            trace->add("https_receive", 0, received, *timing.transport);
+        if (trace && timing.queue)
+            trace->add("queue_wait", 0, queued, *timing.queue);
+        return trace;
+    }
+}  // namespace
+
+RequestHandler::request_timer::request_timer(
+        snode::rpc_latency_t* lat,
+        const request_timing& timing,
+        util::Tracer* tracer,
+        std::string_view method) :
+        lat_{lat},
+        db_started_{Database::thread_time()},
+        tracer_{tracer},
+        trace_{start_trace(tracer, method, timing, started_)},
+        scope_{trace_} {
+    if (!lat_)
+        return;
+    if (timing.transport)
+        lat_->transport.record(*timing.transport);
+    if (timing.queue)
+        lat_->queue.record(*timing.queue);
+}
+
+RequestHandler::request_timer::~request_timer() {
+    if (lat_)
+        lat_->db.record(Database::thread_time() - db_started_);
+}
+
+std::function<void(Response)> RequestHandler::request_timer::wrap(
+        std::function<void(Response)> cb) const {
+    if (!lat_ && !trace_)
+        return cb;
+    return [lat = lat_, started = started_, tracer = tracer_, trace = trace_, cb = std::move(cb)](
+                   Response res) {
+        if (lat)
+            lat->handler.record(std::chrono::steady_clock::now() - started);
+        {
+            util::trace_scope scope{trace};
+            cb(std::move(res));
+        }
+        if (trace)
+            tracer->finish(trace);
+    };
+}
+
 void RequestHandler::process_client_req(
-        std::string_view req_json, std::function<void(Response)> cb) {
+        std::string_view req_json,
+        std::function<void(Response)> cb,
+        bool direct,
+        const request_timing& timing) {
     log::trace(logcat, "process_client_req str <{}>", req_json);
 
-    json body = json::parse(req_json, nullptr, false);
+    json body = parse_json(req_json);
     if (body.is_discarded()) {
         log::debug(logcat, "Bad client request: invalid json");
         return cb(Response{http::BAD_REQUEST, "invalid json"sv});
@@ -1399,15 +2164,40 @@ void RequestHandler::process_client_req(
         return cb(Response{http::BAD_REQUEST, "invalid json: no `params` field"sv});
     }
 
-    process_client_req(method_name, std::move(*params_it), std::move(cb));
+    process_client_req(method_name, std::move(*params_it), std::move(cb), direct, timing);
+}
+
+bool RequestHandler::low_priority(std::string_view method) {
+    return method == rpc::retrieve::names()[0] || method == rpc::retrieve_multi::names()[0] ||
+           method == rpc::oxend_request::names()[0];
 }
 
 void RequestHandler::process_client_req(
-        std::string_view method_name, json params, std::function<void(Response)> cb) {
-    if (auto it = client_rpc_endpoints.find(method_name); it != client_rpc_endpoints.end()) {
+        std::string_view method_name,
+        json params,
+        std::function<void(Response)> cb,
+        bool direct,
+        const request_timing& timing) {
+    if (auto endpoint = find_client_rpc(method_name)) {
+        // Sampled before shedding so that the capture includes the requests we shed
+        if (auto req = capture_.sample("client", direct ? "https" : "onion", method_name)) {
+            capture_.describe(*req, params);
+            cb = capture_response(std::move(req), std::move(cb));
+        }
+        if (low_priority(method_name) &&
+            service_node_.omq_server().load_shedder().shed_low_priority()) {
+            log::debug(logcat, "Shedding {} request: server overloaded", method_name);
+            return cb(Response{http::SERVICE_UNAVAILABLE, "Server busy, try again later"sv});
+        }
         log::debug(logcat, "Process client request: {}", method_name);
+        auto timer = time_request(method_name, timing);
+        cb = timer.wrap(std::move(cb));
         try {
-            return it->second.http_json(*this, std::move(params), cb);
+            return visit_client_rpc(*endpoint, [&](auto t) {
+                auto req = load_request<typename decltype(t)::type>(std::move(params));
+                req.direct = direct;
+                process_client_req(std::move(req), cb);
+            });
         } catch (const rpc::parse_error& e) {
             // These exceptions carry a failure message to send back to the client
             log::debug(logcat, "Invalid request: {}", e.what());
@@ -1424,6 +2214,43 @@ void RequestHandler::process_client_req(
     return cb({http::BAD_REQUEST, "no method " + std::string{method_name}});
 }
 
+void RequestHandler::process_omq_client_req(
+        size_t endpoint,
+        std::string_view params,
+        bool forwarded,
+        std::function<void(Response)> cb) {
+    visit_client_rpc(endpoint, [&](auto t) {
+        using RPC = typename decltype(t)::type;
+        RPC req;
+        if (params.empty())
+            params = "{}"sv;
+        if (params.front() == 'd') {
+            req.load_from(oxenc::bt_dict_consumer{params});
+            req.b64 = false;
+        } else {
+            auto body = parse_json(params);
+            if (body.is_discarded()) {
+                log::debug(logcat, "Bad OMQ client request: not valid json or bt_dict");
+                return cb(Response{http::BAD_REQUEST, "invalid body: expected json or bt_dict"sv});
+            }
+            req.load_from(std::move(body));
+        }
+        // OMQ replies are always sent back as-is:
+        req.direct = true;
+        if constexpr (std::is_same_v<RPC, rpc::retrieve>)
+            req.can_wait = !forwarded;
+        if constexpr (std::is_base_of_v<rpc::recursive, RPC>) {
+            req.recurse = !forwarded;
+        } else if (forwarded) {
+            return cb(Response{
+                    http::BAD_REQUEST,
+                    "invalid request: received invalid forwarded non-forwardable request"sv});
+        }
+
+        process_client_req(std::move(req), std::move(cb));
+    });
+}
+
 Response RequestHandler::process_retrieve_all() {
     std::vector<message> msgs;
     try {
@@ -1509,7 +2336,7 @@ Response RequestHandler::wrap_proxy_response(
 
     std::string ciphertext = channel_cipher_.encrypt(enc_type, body, client_key);
     if (base64)
-        ciphertext = oxenc::to_base64(std::move(ciphertext));
+        ciphertext = util::base64_encode(ciphertext);
 
     return Response{http::OK, std::move(ciphertext)};
 }
@@ -1524,9 +2351,24 @@ void RequestHandler::process_onion_req(std::string_view ciphertext, OnionRequest
 
     service_node_.record_onion_request();
 
-    var::visit(
-            [&](auto&& x) { process_onion_req(std::move(x), std::move(data)); },
-            process_ciphertext_v2(channel_cipher_, ciphertext, data.ephem_key, data.enc_type));
+    auto parsed =
+            process_ciphertext_v2(channel_cipher_, ciphertext, data.ephem_key, data.enc_type);
+
+    if (auto req = capture_.sample("onion", "")) {
+        req->entry["size"] = ciphertext.size();
+        req->entry["hop"] = var::visit(
+                [](const auto& x) {
+                    using T = std::decay_t<decltype(x)>;
+                    return std::is_same_v<T, FinalDestinationInfo> ? "final"
+                         : std::is_same_v<T, RelayToNodeInfo>      ? "relay"
+                         : std::is_same_v<T, RelayToServerInfo>    ? "proxy"
+                                                                   : "error";
+                },
+                parsed);
+        data.cb = capture_response(std::move(req), std::move(data.cb));
+    }
+
+    var::visit([&](auto&& x) { process_onion_req(std::move(x), std::move(data)); }, parsed);
 }
 
 void RequestHandler::process_onion_req(FinalDestinationInfo&& info, OnionRequestMetadata&& data) {
@@ -1619,39 +2461,31 @@ void RequestHandler::process_onion_req(RelayToServerInfo&& info, OnionRequestMet
 
     service_node_.record_proxy_request();
 
-    pending_proxy_requests_.emplace_front(cpr::PostCallback(
-            [&omq = *service_node_.omq_server(), cb = std::move(data.cb)](cpr::Response r) {
+    proxy_client_.post(
+            urlstr,
+            {{"User-Agent", "Oxen Storage Server/" + std::string{STORAGE_SERVER_VERSION_STRING}},
+             {"Content-Type", "application/octet-stream"}},
+            std::move(info.payload),
+            ONION_URL_TIMEOUT,
+            [url = urlstr, cb = std::move(data.cb)](http_response r) {
                 Response res;
-                if (r.error.code != cpr::ErrorCode::OK) {
-                    log::debug(
-                            logcat,
-                            "Onion proxied request to {} failed: {}",
-                            r.url.str(),
-                            r.error.message);
-                    res.body = r.error.message;
-                    if (r.error.code == cpr::ErrorCode::OPERATION_TIMEDOUT)
+                if (!r.error.empty()) {
+                    log::debug(logcat, "Onion proxied request to {} failed: {}", url, r.error);
+                    res.body = std::move(r.error);
+                    if (r.timed_out)
                         res.status = http::GATEWAY_TIMEOUT;
                     else
                         res.status = http::BAD_GATEWAY;
                 } else {
                     res.status.first = r.status_code;
-                    res.status.second = r.status_line;
-                    for (auto& [k, v] : r.header)
+                    res.status.second = std::move(r.status_line);
+                    for (auto& [k, v] : r.headers)
                         res.headers.emplace_back(std::move(k), std::move(v));
-                    res.body = std::move(r.text);
+                    res.body = std::move(r.body);
                 }
 
                 cb(std::move(res));
-            },
-            cpr::Url{std::move(urlstr)},
-            cpr::Header{
-                    {"User-Agent",
-                     "Oxen Storage Server/" + std::string{STORAGE_SERVER_VERSION_STRING}},
-                    {"Content-Type", "application/octet-stream"}},
-            cpr::Timeout{ONION_URL_TIMEOUT},
-            cpr::Ssl(cpr::ssl::TLSv1_2{}),
-            cpr::Redirect{0L},
-            cpr::Body{std::move(info.payload)}));
+            });
 }
 
 void RequestHandler::process_onion_req(
@@ -2,17 +2,25 @@
 
 #include <oxenss/crypto/channel_encryption.hpp>
 #include "client_rpc_endpoints.h"
+#include "http_client.h"
 #include "onion_processing.h"
+#include "request_capture.h"
 #include <oxenc/bt_serialize.h>
 #include <oxenss/crypto/keys.h>
 #include <oxenss/snode/service_node.h>
 #include <oxenss/utils/string_utils.hpp>
 #include <oxenss/server/utils.h>
+#include <oxenss/utils/single_flight.hpp>
 #include <oxenss/utils/time.hpp>
+#include <oxenss/utils/trace.hpp>
 
+#include <array>
 #include <chrono>
 #include <forward_list>
 #include <future>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <string_view>
 #include <type_traits>
@@ -113,11 +121,32 @@ namespace detail {
 
 }  // namespace detail
 
+/// An unpadded base64 blake2b hash (i.e. a message hash), held in place rather than allocated.
+struct hash_b64 {
+    static constexpr size_t SIZE = 43;
+    std::array<char, SIZE + 1> b64;  // (+1 for the padding that the encoder writes)
+
+    std::string_view view() const { return {b64.data(), SIZE}; }
+    operator std::string_view() const { return view(); }
+    std::string str() const { return std::string{view()}; }
+};
+
+/// Streams the concatenation of the `count` strings at `parts` through blake2b and returns the
+/// unpadded base64 hash, without allocating.
+hash_b64 blake2b_b64_parts(const std::string_view* parts, size_t count);
+
+/// Same as above for a fixed number of parts, given directly as strings or string_views.
+template <typename... T>
+hash_b64 blake2b_b64(const T&... parts) {
+    const std::array<std::string_view, sizeof...(T)> views{std::string_view{parts}...};
+    return blake2b_b64_parts(views.data(), views.size());
+}
+
 /// Compute a hash from the given strings, concatenated together.
-std::string compute_hash_blake2b_b64(std::vector<std::string_view> parts);
+std::string compute_hash_blake2b_b64(std::initializer_list<std::string_view> parts);
 
 /// Computes a message hash based on its constituent parts.  Takes a function (which accepts a
-/// container of string_views) and any number of std::string, std::string_view, system_clock
+/// braced list of string_views) and any number of std::string, std::string_view, system_clock
 /// values, or integer values.  Strings are concatenated; integers are converted to strings via
 /// std::to_chars; clock values are treated as integer milliseconds-since-unix-epoch values.
 template <typename Func, typename... T>
@@ -154,13 +183,49 @@ struct OnionRequestMetadata {
     crypto::EncryptType enc_type = crypto::EncryptType::aes_gcm;
 };
 
+/// How long recursive requests (e.g. delete_all with recursion) wait for the rest of the swarm
+/// before replying to the client.  By default we wait for every peer to answer (or for its
+/// request to time out); with a quorum or deadline set we can reply sooner, in which case the
+/// peers we haven't heard from yet are in the response with "failed" and "pending" set.
+struct recursive_config {
+    // Reply once at least this fraction of the swarm peers (rounded up) has answered.
+    double quorum = 1.0;
+    // If set, reply once this much time has passed even if we haven't reached the quorum.
+    std::chrono::milliseconds deadline{0};
+};
+
 class RequestHandler {
 
     snode::ServiceNode& service_node_;
     const crypto::ChannelEncryption& channel_cipher_;
     const crypto::ed25519_seckey ed25519_sk_;
 
-    std::forward_list<std::future<void>> pending_proxy_requests_;
+    // Persistent client used for onion requests that we forward on to an external server
+    HttpClient proxy_client_;
+
+    // Traces of sampled and slow client requests
+    util::Tracer tracer_;
+
+    // Anonymized shapes of sampled requests, for replaying against a test node
+    RequestCapture capture_;
+
+    const recursive_config recursive_;
+
+    // The snodes/swarm part of the get_swarm (and wrong swarm) responses of every swarm, encoded
+    // once per swarm snapshot rather than for every request; see swarm_response().
+    struct encoded_swarm;
+    struct swarm_responses;
+    std::shared_ptr<const swarm_responses> swarm_responses_;
+    std::mutex swarm_responses_mutex_;
+
+    // Returns the encoded swarm of `pk` from the current swarm snapshot, (re)encoding all swarms
+    // first if the snapshot has changed since we last did.
+    std::shared_ptr<const encoded_swarm> swarm_response(const user_pubkey_t& pk);
+
+    // Direct retrieves in flight, keyed by everything that determines their response (see
+    // shared_retrieve), so that identical concurrent polls of a busy account (such as a closed
+    // group polled by all of its members) share one database query and encoded response.
+    util::SingleFlight<std::string, Response> retrieve_flights_;
 
     // Wrap response `res` to an intermediate node
     Response wrap_proxy_response(
@@ -191,11 +256,24 @@ class RequestHandler {
     RequestHandler(
             snode::ServiceNode& sn,
             const crypto::ChannelEncryption& ce,
-            crypto::ed25519_seckey ed_sk);
+            crypto::ed25519_seckey ed_sk,
+            util::trace_config trace = {},
+            recursive_config recursive = {},
+            capture_config capture = {});
+
+    const util::Tracer& tracer() const { return tracer_; }
+
+    RequestCapture& capture() { return capture_; }
+
+    // Returns `cb` wrapped to record the response in the captured request `req` (see
+    // RequestCapture) before passing it on.
+    std::function<void(Response)> capture_response(
+            std::shared_ptr<captured_request> req, std::function<void(Response)> cb);
 
     // Handlers for parsed client requests
     void process_client_req(rpc::store&& req, std::function<void(Response)> cb);
     void process_client_req(rpc::retrieve&& req, std::function<void(Response)> cb);
+    void process_client_req(rpc::retrieve_multi&& req, std::function<void(Response)> cb);
     void process_client_req(rpc::get_swarm&& req, std::function<void(Response)> cb);
     void process_client_req(rpc::oxend_request&& req, std::function<void(Response)> cb);
     void process_client_req(rpc::info&&, std::function<void(Response)> cb);
@@ -210,32 +288,134 @@ class RequestHandler {
     void process_client_req(rpc::ifelse&&, std::function<void(Response)> cb);
     void process_client_req(rpc::revoke_subkey&& req, std::function<void(Response)> cb);
 
-    struct rpc_handler {
-        std::function<client_request(std::variant<nlohmann::json, oxenc::bt_dict_consumer> params)>
-                load_req;
-        std::function<void(RequestHandler&, nlohmann::json, std::function<void(Response)>)>
-                http_json;
-        std::function<void(
-                RequestHandler&,
-                std::string_view params,
-                bool recurse,
-                std::function<void(Response)>)>
-                omq;
+    // Verifies the signatures of any signed batch/sequence subrequests in parallel across the
+    // oxenmq worker threads, storing the results in each subrequest's `signature_verified`, then
+    // calls `done`.  Does the verification inline (i.e. when dispatched) instead if there isn't
+    // more than one signature to verify.  `subreqs` must stay alive until `done` is called.
+    void preverify_signatures(std::vector<client_subrequest>& subreqs, std::function<void()> done);
+
+  private:
+    // Checks a retrieve request's swarm and authentication, returning the error response if it
+    // can't be answered; returns nullopt if it can.
+    std::optional<Response> check_retrieve(
+            const rpc::retrieve& req, std::chrono::system_clock::time_point now);
+
+    // Performs a checked retrieve request whose response goes straight back to the client,
+    // building the response in its final form.  If there are no messages then this returns
+    // nullopt unless `or_empty` is true.
+    std::optional<Response> direct_retrieve(const rpc::retrieve& req, bool or_empty);
+
+    // Answers a checked direct retrieve request (even if there are no messages) like
+    // direct_retrieve, except that if an identical retrieve is already in flight then this waits
+    // for it and replies with a copy of its response instead of querying the database again.
+    void shared_retrieve(const rpc::retrieve& req, std::function<void(Response)> cb);
+
+    // Answers a direct retrieve request with a `wait`: right away if there are messages,
+    // otherwise once a message arrives or the wait is over (see OMQ::park_retrieve).
+    void retrieve_or_wait(rpc::retrieve&& req, std::function<void(Response)> cb);
+
+    // Answers the (already verified) retrieve requests of a retrieve_multi request
+    void dispatch_retrieve_multi(
+            std::vector<client_subrequest>& subreqs,
+            std::optional<int> max_size,
+            bool b64,
+            const std::function<void(Response)>& cb);
+
+    // Dispatches the (already verified) subrequests of a batch request
+    void dispatch_batch(
+            std::vector<client_subrequest>& subreqs,
+            std::shared_ptr<nlohmann::json> subresults,
+            std::function<void(Response)> cb);
+
+    // Calls `dispatch`, which starts the (already verified) subrequests of a batch or sequence,
+    // with their database work grouped into a database batch (see Database::begin_batch).
+    // `dispatch` gets passed the callback for the final response, which holds back a response
+    // given before the batch's changes have been committed until they are.
+    void dispatch_grouped(
+            const std::vector<client_subrequest>& subreqs,
+            std::function<void(Response)> cb,
+            const std::function<void(std::function<void(Response)>)>& dispatch);
+
+  public:
+    // Returns true for the client methods that get turned away first when we are overloaded (see
+    // server::LoadShedder): the reads that clients poll with and simply retry (and that mostly
+    // return nothing new), and proxied oxend requests.
+    static bool low_priority(std::string_view method);
+
+    // How long a client request spent in the stages before it reached the request handler, for
+    // the endpoint latency stats (see snode::rpc_latency_t).  Unset stages aren't recorded.
+    struct request_timing {
+        std::optional<std::chrono::steady_clock::duration> transport;
+        std::optional<std::chrono::steady_clock::duration> queue;
     };
 
-    using rpc_map = std::unordered_map<std::string_view, rpc_handler>;
+    // Records the handling of one client request in its endpoint's latency stats: the given
+    // pre-dispatch timings right away, the database time the calling thread spends while the
+    // timer exists, and the handler latency once the callback returned by `wrap()` gets invoked.
+    // Does nothing for unknown endpoints.
+    //
+    // If the tracer decides to trace the request, this also makes the trace current on the
+    // calling thread while the timer exists (and while the wrapped callback runs), and hands the
+    // trace back to the tracer once the wrapped callback returns.
+    class request_timer {
+        snode::rpc_latency_t* lat_;
+        std::chrono::steady_clock::time_point started_ = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::duration db_started_;
+        util::Tracer* tracer_;
+        std::shared_ptr<util::request_trace> trace_;
+        util::trace_scope scope_;
+
+      public:
+        request_timer(
+                snode::rpc_latency_t* lat,
+                const request_timing& timing,
+                util::Tracer* tracer = nullptr,
+                std::string_view method = "");
+        ~request_timer();
+        request_timer(const request_timer&) = delete;
+        request_timer& operator=(const request_timer&) = delete;
+
+        std::function<void(Response)> wrap(std::function<void(Response)> cb) const;
+    };
 
-    static const rpc_map client_rpc_endpoints;
+    request_timer time_request(std::string_view method, const request_timing& timing = {}) {
+        return {service_node_.rpc_latency(method), timing, &tracer_, method};
+    }
 
     // Process a client request taking encoded json to be parsed containing something like
     // `{"method": "abc", "params": {"some_arg": 1}}`, dispatching to the appropriate request
     // handler.
-    void process_client_req(std::string_view req_json, std::function<void(Response)> cb);
+    //
+    // `direct` should be set when the response will be returned as-is to the client (i.e. for
+    // direct HTTP requests, but not onion requests) to allow endpoints to return pre-encoded json
+    // response bodies for requests where that avoids a lot of copying (such as retrieve); see
+    // `rpc::endpoint::direct`.
+    //
+    // `timing` is recorded in the endpoint's latency stats, along with the time spent here.
+    void process_client_req(
+            std::string_view req_json,
+            std::function<void(Response)> cb,
+            bool direct = false,
+            const request_timing& timing = {});
 
     // Processes a pre-parsed client request taking the method name ("store", "retrieve", etc.)
     // and the json params object.
     void process_client_req(
-            std::string_view method, nlohmann::json params, std::function<void(Response)> cb);
+            std::string_view method,
+            nlohmann::json params,
+            std::function<void(Response)> cb,
+            bool direct = false,
+            const request_timing& timing = {});
+
+    // Processes a client request received over OMQ for the endpoint with index `endpoint` (see
+    // rpc::find_client_rpc), with json or bt-encoded `params`.  `forwarded` is set for requests
+    // forwarded from another swarm member, which don't recurse and which are only allowed for
+    // recursive endpoints.
+    void process_omq_client_req(
+            size_t endpoint,
+            std::string_view params,
+            bool forwarded,
+            std::function<void(Response)> cb);
 
     // Processes a swarm test request; if it succeeds the callback is immediately invoked,
     // otherwise the test is scheduled for retries for some time until it succeeds, fails, or
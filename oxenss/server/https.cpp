@@ -9,16 +9,29 @@
 #include <oxenss/utils/string_utils.hpp>
 #include <oxenss/utils/file.hpp>
 
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
+#include <cstdlib>
 #include <nlohmann/json.hpp>
 #include <oxenc/base64.h>
 #include <oxenc/endian.h>
 #include <oxenc/hex.h>
 #include <oxenmq/oxenmq.h>
+#include <sodium/crypto_generichash.h>
+#include <sodium/crypto_scalarmult.h>
+#include <sodium/utils.h>
 #include <variant>
 
 #include <uWebSockets/App.h>
 
+extern "C" {
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+}
+
 namespace oxen::server {
 
 static auto logcat = log::Cat("server");
@@ -61,129 +74,210 @@ HTTPS::HTTPS(
         const std::filesystem::path& ssl_cert,
         const std::filesystem::path& ssl_key,
         const std::filesystem::path& ssl_dh,
-        crypto::legacy_keypair legacy_keys) :
+        crypto::legacy_keypair legacy_keys,
+        size_t threads,
+        tls_session_config tls,
+        const crypto::x25519_seckey& x25519_key,
+        const std::vector<crypto::x25519_pubkey>& stats_access_keys,
+        util::cpu_set loop_cpus,
+        util::compression_config compression) :
+        loop_cpus_{std::move(loop_cpus)},
+        compression_{compression},
+        bind_{std::move(bind)},
         service_node_{sn},
         omq_{*service_node_.omq_server()},
         request_handler_{rh},
         rate_limiter_{rl},
         legacy_keys_{std::move(legacy_keys)} {
+    for (const auto& pk : stats_access_keys) {
+        std::array<unsigned char, 32> secret;
+        if (crypto_scalarmult(secret.data(), x25519_key.data(), pk.data()) != 0) {
+            log::warning(logcat, "Invalid stats access key {}; ignoring it", pk);
+            continue;
+        }
+        stats_secrets_.emplace(pk.view(), secret);
+    }
+
     // Add a category for handling incoming https requests
+    const auto& workers = service_node_.omq_server().workers();
     omq_.add_category(
-            "https",
-            oxenmq::AuthLevel::basic,
-            2,    // minimum # of threads reserved threads for this category
-            1000  // max queued requests
-    );
+            "https", oxenmq::AuthLevel::basic, workers.https_threads, workers.https_queue);
 
     // uWS is designed to work from a single thread, which is good (we pull off the requests and
     // then stick them into the LMQ job queue to be scheduled along with other jobs).  But as a
     // consequence, we need to create everything inside that thread.  We *also* need to get the
     // (thread local) event loop pointer back from the thread so that we can shut it down later
     // (injecting a callback into it is one of the few thread-safe things we can do across
-    // threads).
+    // threads).  When running multiple loops each one is a fully independent uWS app (with its
+    // own thread, loop, and listening sockets).
     //
-    // Things we need in the owning thread, fulfilled from the http thread:
+    // Things we need in the owning thread, fulfilled from each http thread:
 
     // - the uWS::Loop* for the event loop thread (which is thread_local).  We can get this
-    // during
-    //   thread startup, after the thread does basic initialization.
-    std::promise<uWS::Loop*> loop_promise;
-    auto loop_future = loop_promise.get_future();
+    //   during thread startup, after the thread does basic initialization.
+    std::vector<std::future<uWS::Loop*>> loop_futures;
 
     // - the us_listen_socket_t* on which the server is listening.  We can't get this until we
     //   actually start listening, so wait until `start()` for it.  (We also double-purpose it
-    //   to send back an exception if one fires during startup).
-    std::promise<std::vector<us_listen_socket_t*>> startup_success_promise;
-    startup_success_ = startup_success_promise.get_future();
+    //   to send back an exception if one fires during startup).  (Stored in the event_loop).
 
-    // Things we need to send from the owning thread to the event loop thread:
-    // - a signal when the thread should bind to the port and start the event loop (when we call
+    // Things we need to send from the owning thread to the event loop threads:
+    // - a signal when the threads should bind to the port and start the event loop (when we call
     //   start()).
-    // startup_promise_
+    auto startup_future = startup_promise_.get_future().share();
 
     uWS::SocketContextOptions https_opts{
             .key_file_name = ssl_key.c_str(),
             .cert_file_name = ssl_cert.c_str(),
             .dh_params_file_name = ssl_dh.c_str()};
 
-    server_thread_ = std::thread{
-            [this, bind = std::move(bind), &https_opts](
-                    std::promise<uWS::Loop*> loop_promise,
-                    std::future<bool> startup_future,
-                    std::promise<std::vector<us_listen_socket_t*>> startup_success) {
-                uWS::SSLApp https{https_opts};
-                try {
-                    create_endpoints(https);
-                } catch (...) {
-                    loop_promise.set_exception(std::current_exception());
-                    return;
-                }
-                // We've initialized, signal the calling thread
-                loop_promise.set_value(uWS::Loop::get());
-                // Now wait until we get the signal to go (sent when the caller calls start() call).
-                if (!startup_future.get())
-                    // False means cancel, i.e. we got destroyed/shutdown without start() being
-                    // called
-                    return;
-
-                // we don't currently do cors
-                // cors_ = {...};
+    // With multiple loops every loop binds the same ports, letting the kernel balance accepted
+    // connections across them.  (We check that nothing else has the port during start()).
+    const int listen_opts = threads > 1 ? LIBUS_LISTEN_DEFAULT : LIBUS_LISTEN_EXCLUSIVE_PORT;
+
+    loops_.resize(std::max<size_t>(threads, 1));
+    for (auto& l : loops_) {
+        std::promise<uWS::Loop*> loop_promise;
+        loop_futures.push_back(loop_promise.get_future());
+        std::promise<std::vector<us_listen_socket_t*>> startup_success_promise;
+        l.startup_success = startup_success_promise.get_future();
+
+        l.thread = std::thread{
+                [this, &https_opts, listen_opts, tls](
+                        std::promise<uWS::Loop*> loop_promise,
+                        std::shared_future<bool> startup_future,
+                        std::promise<std::vector<us_listen_socket_t*>> startup_success) {
+                    util::set_thread_name("https");
+                    loop_cpus_.apply();
+                    uWS::SSLApp https{https_opts};
+                    try {
+                        configure_tls_sessions(https.getNativeHandle(), tls);
+                        create_endpoints(https);
+                    } catch (...) {
+                        loop_promise.set_exception(std::current_exception());
+                        return;
+                    }
+                    // We've initialized, signal the calling thread
+                    loop_promise.set_value(uWS::Loop::get());
+                    // Now wait until we get the signal to go (sent when the caller calls start()
+                    // call).
+                    if (!startup_future.get())
+                        // False means cancel, i.e. we got destroyed/shutdown without start()
+                        // being called
+                        return;
 
-                std::vector<us_listen_socket_t*> listening;
-                try {
-                    bool required_bind_failed = false;
-                    for (const auto& [addr, port, required] : bind)
-                        https.listen(
-                                addr,
-                                port,
-                                LIBUS_LISTEN_EXCLUSIVE_PORT,
-                                [&listening,
-                                 req = required,
-                                 &required_bind_failed,
-                                 addr = fmt::format("{}:{}", addr, port)](
-                                        us_listen_socket_t* sock) {
-                                    if (sock) {
-                                        log::info(logcat, "HTTPS server listening at {}", addr);
-                                        listening.push_back(sock);
-                                    } else if (req) {
-                                        required_bind_failed = true;
-                                        log::critical(
-                                                logcat,
-                                                "HTTPS server failed to bind to required address "
-                                                "{}",
-                                                addr);
-                                    } else {
-                                        log::warning(
-                                                logcat,
-                                                "HTTPS server failed to bind to (non-required) "
-                                                "address {}",
-                                                addr);
-                                    }
-                                });
-
-                    if (listening.empty() || required_bind_failed) {
-                        std::ostringstream error;
-                        error << "RPC HTTP server failed to bind; ";
-                        if (listening.empty())
-                            error << "no valid bind address(es) given; ";
-                        error << "tried to bind to:";
-                        for (const auto& [addr, port, required] : bind)
-                            error << ' ' << addr << ':' << port;
-                        throw std::runtime_error{error.str()};
+                    // we don't currently do cors
+                    // cors_ = {...};
+
+                    std::vector<us_listen_socket_t*> listening;
+                    try {
+                        bool required_bind_failed = false;
+                        for (const auto& [addr, port, required] : bind_)
+                            https.listen(
+                                    addr,
+                                    port,
+                                    listen_opts,
+                                    [&listening,
+                                     req = required,
+                                     &required_bind_failed,
+                                     addr = fmt::format("{}:{}", addr, port)](
+                                            us_listen_socket_t* sock) {
+                                        if (sock) {
+                                            log::info(
+                                                    logcat, "HTTPS server listening at {}", addr);
+                                            listening.push_back(sock);
+                                        } else if (req) {
+                                            required_bind_failed = true;
+                                            log::critical(
+                                                    logcat,
+                                                    "HTTPS server failed to bind to required "
+                                                    "address {}",
+                                                    addr);
+                                        } else {
+                                            log::warning(
+                                                    logcat,
+                                                    "HTTPS server failed to bind to (non-required) "
+                                                    "address {}",
+                                                    addr);
+                                        }
+                                    });
+
+                        if (listening.empty() || required_bind_failed) {
+                            std::ostringstream error;
+                            error << "RPC HTTP server failed to bind; ";
+                            if (listening.empty())
+                                error << "no valid bind address(es) given; ";
+                            error << "tried to bind to:";
+                            for (const auto& [addr, port, required] : bind_)
+                                error << ' ' << addr << ':' << port;
+                            throw std::runtime_error{error.str()};
+                        }
+                    } catch (...) {
+                        for (auto* s : listening)
+                            us_listen_socket_close(/*ssl=*/true, s);
+                        startup_success.set_exception(std::current_exception());
+                        return;
                     }
-                } catch (...) {
-                    startup_success.set_exception(std::current_exception());
-                    return;
-                }
-                startup_success.set_value(std::move(listening));
+                    startup_success.set_value(std::move(listening));
 
-                https.run();
-            },
-            std::move(loop_promise),
-            startup_promise_.get_future(),
-            std::move(startup_success_promise)};
+                    https.run();
+                },
+                std::move(loop_promise),
+                startup_future,
+                std::move(startup_success_promise)};
+    }
 
-    loop_ = loop_future.get();
+    std::exception_ptr init_error;
+    for (size_t i = 0; i < loops_.size(); i++) {
+        try {
+            loops_[i].loop = loop_futures[i].get();
+        } catch (...) {
+            if (!init_error)
+                init_error = std::current_exception();
+        }
+    }
+    if (init_error) {
+        // Abort the threads that did initialize, and let the exception propagate
+        shutdown(true);
+        std::rethrow_exception(init_error);
+    }
+}
+
+void HTTPS::check_ports_available() const {
+    for (const auto& [addr, port, required] : bind_) {
+        sockaddr_storage sa{};
+        socklen_t sa_len;
+        if (auto* sin = reinterpret_cast<sockaddr_in*>(&sa);
+            inet_pton(AF_INET, addr.c_str(), &sin->sin_addr) == 1) {
+            sin->sin_family = AF_INET;
+            sin->sin_port = htons(port);
+            sa_len = sizeof(sockaddr_in);
+        } else if (auto* sin6 = reinterpret_cast<sockaddr_in6*>(&sa);
+                   inet_pton(AF_INET6, addr.c_str(), &sin6->sin6_addr) == 1) {
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_port = htons(port);
+            sa_len = sizeof(sockaddr_in6);
+        } else {
+            continue;  // Not something we can check; leave it up to uWS
+        }
+
+        // Binding without SO_REUSEPORT fails if anything is listening on the port
+        int fd = ::socket(sa.ss_family, SOCK_STREAM, 0);
+        if (fd < 0)
+            continue;
+        int on = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        bool in_use =
+                ::bind(fd, reinterpret_cast<sockaddr*>(&sa), sa_len) != 0 && errno == EADDRINUSE;
+        ::close(fd);
+
+        if (in_use) {
+            if (required)
+                throw std::runtime_error{fmt::format(
+                        "RPC HTTP server failed to bind; {}:{} is already in use", addr, port)};
+            log::warning(logcat, "HTTPS bind address {}:{} is already in use", addr, port);
+        }
+    }
 }
 
 bool HTTPS::check_ready(HttpResponse& res) {
@@ -236,13 +330,19 @@ namespace {
         HTTPS& https;
         oxenmq::OxenMQ& omq;
         HttpResponse& res;
+        // The event loop that owns the connection; all writes to `res` must happen in this loop's
+        // thread, so replies from other threads get deferred into it.
+        uWS::Loop* loop;
         Request request;
         std::vector<std::pair<std::string, std::string>> extra_headers;
+        // How the response body may be compressed (from the request's Accept-Encoding)
+        util::content_encoding encoding{util::content_encoding::identity};
         bool aborted{false};
         bool replied{false};
 
+        // Must be constructed from the connection's event loop thread.
         call_data(HTTPS& https, oxenmq::OxenMQ& omq, HttpResponse& res) :
-                https{https}, omq{omq}, res{res} {}
+                https{https}, omq{omq}, res{res}, loop{uWS::Loop::get()} {}
 
         // If we have to drop the request because we are overloaded we want to reply with an
         // error (so that we close the connection instead of leaking it and leaving it hanging).
@@ -250,7 +350,7 @@ namespace {
         ~call_data() {
             if (replied || aborted)
                 return;
-            https.loop_defer([&https = https, &res = res] {
+            loop->defer([&https = https, &res = res] {
                 https.error_response(
                         res, http::SERVICE_UNAVAILABLE, "Server busy, try again later");
             });
@@ -277,12 +377,42 @@ namespace {
         if (!data || data->replied)
             return;
         data->replied = true;
-        data->https.loop_defer(
-                [data = std::move(data), res = std::move(res), force_close]() mutable {
-                    if (data->aborted)
-                        return;
-                    queue_response_internal(data->https, data->res, std::move(res), force_close);
-                });
+        // Serialize here, rather than in the http thread, so that the http thread only has to
+        // write out the response.
+        if (auto* j = std::get_if<json>(&res.body)) {
+            util::traced span{"serialize_response"};
+            res.body = j->dump();
+            if (std::none_of(begin(res.headers), end(res.headers), [](const auto& h) {
+                    return util::string_iequal(h.first, "content-type");
+                }))
+                res.headers.emplace_back("Content-Type", "application/json");
+        }
+        // Compress large responses for clients that accept it (also here, to keep the work off
+        // the http thread)
+        if (data->encoding != util::content_encoding::identity) {
+            res.headers.emplace_back("Vary", "Accept-Encoding");
+            if (view_body(res).size() >= data->https.compression().min_size) {
+                util::traced span{"compress_response"};
+                if (auto* sv = std::get_if<std::string_view>(&res.body))
+                    res.body = std::string{*sv};
+                try {
+                    if (util::maybe_compress(
+                                std::get<std::string>(res.body),
+                                data->encoding,
+                                data->https.compression()))
+                        res.headers.emplace_back(
+                                "Content-Encoding", std::string{util::to_string(data->encoding)});
+                } catch (const std::exception& e) {
+                    log::warning(logcat, "Failed to compress response: {}", e.what());
+                }
+            }
+        }
+        auto* loop = data->loop;
+        loop->defer([data = std::move(data), res = std::move(res), force_close]() mutable {
+            if (data->aborted)
+                return;
+            queue_response_internal(data->https, data->res, std::move(res), force_close);
+        });
     }
 
     std::string get_remote_address(HttpResponse& res) {
@@ -439,6 +569,25 @@ void HTTPS::create_endpoints(uWS::SSLApp& https) {
         log::trace(logcat, "POST /onion_req/v2");
         process_onion_req_v2(*req, *res);
     });
+    https.get("/metrics/v1", [this](HttpResponse* res, HttpRequest* req) {
+        if (!check_stats_auth(*req))
+            return error_response(*res, http::FORBIDDEN);
+        handle_request(*this, omq_, *req, *res, [this](std::shared_ptr<call_data> data) {
+            auto& request = data->request;
+            data->omq.inject_task(
+                    "https",
+                    "https:" + request.uri,
+                    request.remote_addr,
+                    [this, data = std::move(data)]() mutable {
+                        service_node_.omq_server().workers().https_cpus.apply();
+                        if (data->replied || data->aborted)
+                            return;
+                        rpc::Response res{http::OK, service_node_.get_metrics()};
+                        res.headers.emplace_back("Content-Type", "text/plain; version=0.0.4");
+                        queue_response(std::move(data), std::move(res));
+                    });
+        });
+    });
     // Deprecated; use /storage_rpc/v1 with method=info instead
     https.get("/get_stats/v1", [this](HttpResponse* res, HttpRequest* /*req*/) {
         queue_response_internal(
@@ -462,21 +611,46 @@ void HTTPS::create_endpoints(uWS::SSLApp& https) {
     });
 }
 
+bool HTTPS::check_stats_auth(HttpRequest& req) const {
+    if (stats_secrets_.empty())
+        return false;
+    auto parts = util::split(req.getHeader("x-oxen-stats-auth"), ":");
+    if (parts.size() != 3 || parts[0].size() != 64 || parts[2].size() != 64 ||
+        !oxenc::is_hex(parts[0]) || !oxenc::is_hex(parts[2]))
+        return false;
+    auto it = stats_secrets_.find(oxenc::from_hex(parts[0]));
+    int64_t timestamp;
+    if (it == stats_secrets_.end() || !util::parse_int(parts[1], timestamp))
+        return false;
+    auto now = std::chrono::duration_cast<std::chrono::seconds>(
+                       std::chrono::system_clock::now().time_since_epoch())
+                       .count();
+    if (std::abs(now - timestamp) > STATS_AUTH_TOLERANCE.count())
+        return false;
+
+    auto msg = "metrics:"s;
+    msg += parts[1];
+    std::array<unsigned char, 32> mac, expected;
+    oxenc::from_hex(parts[2].begin(), parts[2].end(), mac.begin());
+    crypto_generichash(
+            expected.data(),
+            expected.size(),
+            reinterpret_cast<const unsigned char*>(msg.data()),
+            msg.size(),
+            it->second.data(),
+            it->second.size());
+    return sodium_memcmp(mac.data(), expected.data(), mac.size()) == 0;
+}
+
 bool HTTPS::should_rate_limit_client(std::string_view addr) {
-    if (addr.size() != 4)
-        return true;
-    uint32_t ip;
-    std::memcpy(&ip, addr.data(), 4);
-    oxenc::big_to_host_inplace(ip);
-    return rate_limiter_.should_rate_limit_client(ip);
+    // IPv4 or IPv6 (limited by network prefix); anything else is always rate limited
+    return rate_limiter_.should_rate_limit_client_addr(addr);
 }
 
 void HTTPS::process_storage_rpc_req(HttpRequest& req, HttpResponse& res) {
     auto addr = res.getRemoteAddress();
-    if (addr.size() != 4) {
-        // We don't (currently?) support IPv6 at all (SS published IPs are only IPv4) so if we
-        // somehow get an IPv6 address then it isn't a proper SS request so just drop it.
-        log::warning(logcat, "incoming client request is not IPv4; dropping it");
+    if (addr.size() != 4 && addr.size() != 16) {
+        log::warning(logcat, "incoming client request has an unknown address type; dropping it");
         return error_response(res, http::BAD_REQUEST);
     }
     if (should_rate_limit_client(addr)) {
@@ -496,16 +670,26 @@ void HTTPS::process_storage_rpc_req(HttpRequest& req, HttpResponse& res) {
             res,
             [this,
              started = std::chrono::steady_clock::now()](std::shared_ptr<call_data> data) mutable {
+                auto received = std::chrono::steady_clock::now();
                 auto& omq = data->omq;
                 auto& request = data->request;
+                if (compression_.min_size > 0)
+                    if (auto it = request.headers.find("accept-encoding");
+                        it != request.headers.end())
+                        data->encoding = util::accept_encoding(it->second);
                 omq.inject_task(
                         "https",
                         "https:" + request.uri,
                         request.remote_addr,
-                        [this, data = std::move(data), started]() mutable {
+                        [this, data = std::move(data), started, received]() mutable {
+                            service_node_.omq_server().workers().https_cpus.apply();
                             if (data->replied || data->aborted)
                                 return;
 
+                            rpc::RequestHandler::request_timing timing{
+                                    received - started,
+                                    std::chrono::steady_clock::now() - received};
+                            service_node_.omq_server().load_shedder().record_wait(*timing.queue);
                             try {
                                 request_handler_.process_client_req(
                                         data->request.body,
@@ -517,7 +701,9 @@ void HTTPS::process_storage_rpc_req(HttpRequest& req, HttpResponse& res) {
                                                             std::chrono::steady_clock::now() -
                                                             started));
                                             queue_response(std::move(data), std::move(response));
-                                        });
+                                        },
+                                        /*direct=*/true,
+                                        timing);
                             } catch (const std::exception& e) {
                                 auto error = "Exception caught with processing client request: "s +
                                              e.what();
@@ -537,12 +723,16 @@ void HTTPS::process_onion_req_v2(HttpRequest& req, HttpResponse& res) {
             res,
             [this,
              started = std::chrono::steady_clock::now()](std::shared_ptr<call_data> data) mutable {
-                auto& omq = data->omq;
-                auto& request = data->request;
-                omq.inject_task(
-                        "https",
-                        "https:" + request.uri,
-                        request.remote_addr,
+                // Proxying onion requests for clients is low priority work: when we are overloaded
+                // we turn them away here, before doing any of the decryption work.  (Dropping
+                // `data` replies with a 503).
+                if (service_node_.omq_server().load_shedder().shed_low_priority()) {
+                    log::debug(logcat, "Shedding onion request: server overloaded");
+                    return;
+                }
+                // If the queue is full the job (and thus `data`) gets destroyed, which replies
+                // with a 503.
+                bool queued = service_node_.onion_queue().submit(
                         [this, data = std::move(data), started]() mutable {
                             if (data->replied || data->aborted)
                                 return;
@@ -590,6 +780,8 @@ void HTTPS::process_onion_req_v2(HttpRequest& req, HttpResponse& res) {
                                 queue_response(std::move(data), {http::BAD_REQUEST, msg});
                             }
                         });
+                if (!queued)
+                    log::debug(logcat, "Onion request queue is full, dropping onion request");
             });
 }
 
@@ -597,36 +789,56 @@ void HTTPS::start() {
     if (sent_startup_)
         throw std::logic_error{"Cannot call HTTPS::start() more than once"};
 
+    if (loops_.size() > 1)
+        check_ports_available();
+
     startup_promise_.set_value(true);
     sent_startup_ = true;
-    listen_socks_ = startup_success_.get();
+
+    std::exception_ptr error;
+    for (auto& l : loops_) {
+        try {
+            l.listen_socks = l.startup_success.get();
+        } catch (...) {
+            if (!error)
+                error = std::current_exception();
+        }
+    }
+    if (error)
+        std::rethrow_exception(error);
+    log::info(logcat, "HTTPS server started with {} event loop thread(s)", loops_.size());
 }
 
 void HTTPS::shutdown(bool join) {
-    if (!server_thread_.joinable())
+    if (std::none_of(loops_.begin(), loops_.end(), [](auto& l) { return l.thread.joinable(); }))
         return;
 
     if (!sent_shutdown_) {
         log::trace(logcat, "initiating shutdown");
+        closing_ = true;
         if (!sent_startup_) {
             startup_promise_.set_value(false);
             sent_startup_ = true;
-        } else if (!listen_socks_.empty()) {
-            loop_defer([this] {
-                log::trace(logcat, "closing {} listening sockets", listen_socks_.size());
-                for (auto* s : listen_socks_)
-                    us_listen_socket_close(/*ssl=*/true, s);
-                listen_socks_.clear();
-
-                closing_ = true;
-            });
+        } else {
+            for (auto& l : loops_) {
+                if (l.listen_socks.empty())
+                    continue;
+                l.loop->defer([&l] {
+                    log::trace(logcat, "closing {} listening sockets", l.listen_socks.size());
+                    for (auto* s : l.listen_socks)
+                        us_listen_socket_close(/*ssl=*/true, s);
+                    l.listen_socks.clear();
+                });
+            }
         }
         sent_shutdown_ = true;
     }
 
-    log::trace(logcat, "joining https server thread");
+    log::trace(logcat, "joining https server threads");
     if (join)
-        server_thread_.join();
+        for (auto& l : loops_)
+            if (l.thread.joinable())
+                l.thread.join();
     log::trace(logcat, "done shutdown");
 }
 
@@ -3,11 +3,17 @@
 #include <oxenss/crypto/keys.h>
 #include <oxenss/rpc/rate_limiter.h>
 #include <oxenss/rpc/request_handler.h>
+#include <oxenss/utils/affinity.hpp>
+#include <oxenss/utils/compression.hpp>
 #include <oxenss/version.h>
+#include "tls_sessions.h"
 #include "utils.h"
 
+#include <array>
+#include <atomic>
 #include <filesystem>
 #include <future>
+#include <unordered_map>
 #include <unordered_set>
 
 #include <uWebSockets/App.h>
@@ -22,6 +28,9 @@ using namespace std::literals;
 // Maximum incoming HTTPS request size, in bytes.
 inline constexpr uint64_t MAX_REQUEST_BODY_SIZE = 10 * 1024 * 1024;
 
+// How far a /metrics/v1 request's authentication timestamp may be from our current time
+inline constexpr auto STATS_AUTH_TOLERANCE = 60s;
+
 // Full uWebSocket http request/response objects:
 using HttpRequest = uWS::HttpRequest;
 using HttpResponse = uWS::HttpResponse<true /*SSL*/>;
@@ -33,6 +42,20 @@ class HTTPS {
     // \param bind {address,port,required} tuples to bind to.  If `required` is set then the
     // constructor will throw if binding fails, if not then the construction will succeed as
     // long as at least one bind address works.
+    //
+    // \param threads the number of uWebSockets event loops to run, each in its own thread.  With
+    // more than one, every loop listens on each bind address using SO_REUSEPORT and the kernel
+    // spreads incoming connections across them.
+    //
+    // \param tls TLS session resumption (tickets and cache) settings.
+    //
+    // \param stats_access_keys the x25519 pubkeys allowed to fetch /metrics/v1 (see
+    // check_stats_auth), authenticated using our x25519 key `x25519_key`.
+    //
+    // \param loop_cpus if not empty, the CPUs to run the event loop threads on.
+    //
+    // \param compression when (and how hard) to compress /storage_rpc/v1 responses for clients
+    // that send an Accept-Encoding we support.
     HTTPS(snode::ServiceNode& sn,
           rpc::RequestHandler& rh,
           rpc::RateLimiter& rl,
@@ -40,19 +63,25 @@ class HTTPS {
           const std::filesystem::path& ssl_cert,
           const std::filesystem::path& ssl_key,
           const std::filesystem::path& ssl_dh,
-          crypto::legacy_keypair legacy_keys);
+          crypto::legacy_keypair legacy_keys,
+          size_t threads = 1,
+          tls_session_config tls = {},
+          const crypto::x25519_seckey& x25519_key = {},
+          const std::vector<crypto::x25519_pubkey>& stats_access_keys = {},
+          util::cpu_set loop_cpus = {},
+          util::compression_config compression = {});
 
     ~HTTPS();
 
-    /// Starts the event loop in the thread handling http requests.  Core must have been
-    /// initialized and OxenMQ started.  Will propagate an exception from the thread if startup
+    /// Starts the event loops in the threads handling http requests.  Core must have been
+    /// initialized and OxenMQ started.  Will propagate an exception from a thread if startup
     /// fails.
     void start();
 
-    /// Closes the http server connection.  Can safely be called multiple times, or to abort a
+    /// Closes the http server connections.  Can safely be called multiple times, or to abort a
     /// startup if called before start().
     ///
-    /// \param join - if true, wait for the server thread to exit.  If false then joining will
+    /// \param join - if true, wait for the server threads to exit.  If false then joining will
     /// occur during destruction.
     void shutdown(bool join = false);
 
@@ -69,18 +98,12 @@ class HTTPS {
     /// handles cors headers by adding any needed headers to the given vector
     void handle_cors(HttpRequest& req, http::headers& extra_headers);
 
-    // Posts a callback to the uWebSockets thread loop controlling this connection; all writes
-    // must be done from that thread, and so this method is provided to defer a callback from
-    // another thread into that one.  The function should have signature `void ()`.
-    template <typename Func>
-    void loop_defer(Func&& f) {
-        loop_->defer(std::forward<Func>(f));
-    }
-
     const std::string& server_header() const { return server_header_; }
 
     bool closing() const { return closing_; }
 
+    const util::compression_config& compression() const { return compression_; }
+
     snode::ServiceNode& service_node() { return service_node_; }
 
   private:
@@ -92,26 +115,45 @@ class HTTPS {
 
     bool should_rate_limit_client(std::string_view addr);
 
+    // Throws if one of the (required) bind ports is already in use, which SO_REUSEPORT listening
+    // would otherwise happily share with whoever has it.
+    void check_ports_available() const;
+
     void process_storage_rpc_req(HttpRequest& req, HttpResponse& res);
     void process_onion_req_v2(HttpRequest& req, HttpResponse& res);
 
-    // A promise we send from outside into the event loop thread to signal it to start.  We sent
-    // "true" to go ahead with binding + starting the event loop, or false to abort.
+    // Returns true if the request carries a valid `X-Oxen-Stats-Auth: PUBKEY:TIMESTAMP:MAC`
+    // header, where PUBKEY (hex) is one of the stats access keys, TIMESTAMP (unix seconds) is
+    // within STATS_AUTH_TOLERANCE of now, and MAC (hex) is the 32-byte keyed BLAKE2b hash of
+    // "metrics:TIMESTAMP" keyed with the X25519 shared secret of PUBKEY and our x25519 key.
+    bool check_stats_auth(HttpRequest& req) const;
+
+    // A promise we send from outside into the event loop threads to signal them to start.  We
+    // send "true" to go ahead with binding + starting the event loops, or false to abort.
     std::promise<bool> startup_promise_;
-    // A future (promise held by the thread) that delivers us the listening uSockets sockets so
-    // that, when we want to shut down, we can tell uWebSockets to close them (which will then
-    // run off the end of the event loop).  This also doubles to propagate listen exceptions
-    // back to us.
-    std::future<std::vector<us_listen_socket_t*>> startup_success_;
     // Whether we have sent the startup/shutdown signals
     bool sent_startup_{false}, sent_shutdown_{false};
 
-    // The uWebSockets event loop pointer (so that we can inject a callback to shut it down)
-    uWS::Loop* loop_{nullptr};
-    // The socket(s) we are listening on
-    std::vector<us_listen_socket_t*> listen_socks_;
-    // The thread in which the uWebSockets event listener is running
-    std::thread server_thread_;
+    struct event_loop {
+        // The uWebSockets event loop pointer (so that we can inject a callback to shut it down)
+        uWS::Loop* loop{nullptr};
+        // A future (promise held by the thread) that delivers us the listening uSockets sockets
+        // so that, when we want to shut down, we can tell uWebSockets to close them (which will
+        // then run off the end of the event loop).  This also doubles to propagate listen
+        // exceptions back to us.
+        std::future<std::vector<us_listen_socket_t*>> startup_success;
+        // The socket(s) this loop is listening on
+        std::vector<us_listen_socket_t*> listen_socks;
+        // The thread in which the uWebSockets event loop is running
+        std::thread thread;
+    };
+    std::vector<event_loop> loops_;
+    // CPUs to run the event loop threads on (if not empty)
+    const util::cpu_set loop_cpus_;
+    // Response compression settings
+    const util::compression_config compression_;
+    // The addresses we bind to
+    std::vector<std::tuple<std::string, uint16_t, bool>> bind_;
     // Cached string we send for the Server header
     std::string server_header_ =
             "Oxen Storage Server/" + std::string{STORAGE_SERVER_VERSION_STRING};
@@ -120,8 +162,8 @@ class HTTPS {
     // header entirely.
     std::unordered_set<std::string> cors_;
     // Will be set to true when we're trying to shut down which closes any connections as we
-    // reply to them.  Should only be read/write from inside the uWS loop.
-    bool closing_ = false;
+    // reply to them.
+    std::atomic<bool> closing_{false};
     // If true then always reply with 'Access-Control-Allow-Origin: *' to allow anything.
     bool cors_any_ = false;
     // Our owning service node
@@ -134,6 +176,8 @@ class HTTPS {
     rpc::RateLimiter& rate_limiter_;
     // Keys for signing responses
     crypto::legacy_keypair legacy_keys_;
+    // Shared secrets with the keys allowed to access /metrics/v1, keyed by the raw pubkey
+    std::unordered_map<std::string, std::array<unsigned char, 32>> stats_secrets_;
 
     friend void queue_response_internal(
             HTTPS& https, HttpResponse& r, rpc::Response res, bool force_close);
@@ -0,0 +1,39 @@
+#include "load_shedder.h"
+
+namespace oxen::server {
+
+void LoadShedder::record_wait(std::chrono::steady_clock::duration wait) {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(wait).count();
+    if (us < 0)
+        us = 0;
+    auto avg = avg_wait_.load(std::memory_order_relaxed);
+    int64_t updated;
+    do {
+        updated = avg + (us - avg) / WAIT_WEIGHT;
+    } while (!avg_wait_.compare_exchange_weak(avg, updated, std::memory_order_relaxed));
+
+    if (target_ <= 0)
+        return;
+    if (updated > target_) {
+        if (!shedding_.exchange(true, std::memory_order_relaxed))
+            episodes_.fetch_add(1, std::memory_order_relaxed);
+    } else if (updated < target_ / 2) {
+        shedding_.store(false, std::memory_order_relaxed);
+    }
+}
+
+bool LoadShedder::shed_low_priority() {
+    if (!shedding())
+        return false;
+    shed_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+LoadShedder::stats LoadShedder::get_stats() const {
+    return {average_wait(),
+            shedding(),
+            shed_.load(std::memory_order_relaxed),
+            episodes_.load(std::memory_order_relaxed)};
+}
+
+}  // namespace oxen::server
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace oxen::server {
+
+using namespace std::literals;
+
+/// Decides when to turn away low-priority client requests (such as polling retrieves and proxied
+/// client requests) because the server is falling behind, so that the work that has to get done
+/// -- stores, swarm traffic, storage tests -- isn't starved by work that clients simply retry.
+///
+/// The decision is based on how long jobs have recently been waiting in the worker queues: callers
+/// feed in measured queue waits, which are averaged (exponentially weighted, each new wait counting
+/// for 1/WAIT_WEIGHT).  Shedding starts once the average wait goes above the target and stops once
+/// it falls below half the target, so that we don't flap on and off around the target.
+///
+/// All methods are thread-safe and lock-free.
+class LoadShedder {
+  public:
+    static constexpr auto DEFAULT_TARGET_WAIT = 500ms;
+    static constexpr int64_t WAIT_WEIGHT = 8;
+
+    // Constructs a shedder that sheds while the average wait is above `target`; a target of 0
+    // disables shedding entirely (waits are still averaged, for the stats).
+    explicit LoadShedder(std::chrono::milliseconds target = DEFAULT_TARGET_WAIT) :
+            target_{std::chrono::duration_cast<std::chrono::microseconds>(target).count()} {}
+
+    // Records the time a job spent waiting in a queue before it started running.
+    void record_wait(std::chrono::steady_clock::duration wait);
+
+    // Returns true if a low-priority request should be rejected now, counting it as shed.
+    bool shed_low_priority();
+
+    // Returns true if we are currently shedding low-priority requests.
+    bool shedding() const { return shedding_.load(std::memory_order_relaxed); }
+
+    std::chrono::microseconds average_wait() const {
+        return std::chrono::microseconds{avg_wait_.load(std::memory_order_relaxed)};
+    }
+
+    std::chrono::milliseconds target() const {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::microseconds{target_});
+    }
+
+    struct stats {
+        std::chrono::microseconds average_wait;
+        bool shedding;
+        uint64_t shed;      // Requests rejected
+        uint64_t episodes;  // Number of times we started shedding
+    };
+    stats get_stats() const;
+
+  private:
+    const int64_t target_;              // microseconds
+    std::atomic<int64_t> avg_wait_{0};  // microseconds
+    std::atomic<bool> shedding_{false};
+    std::atomic<uint64_t> shed_{0};
+    std::atomic<uint64_t> episodes_{0};
+};
+
+}  // namespace oxen::server
@@ -0,0 +1,186 @@
+#include "monitor_index.h"
+#include "../utils/memory.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <mutex>
+
+namespace oxen::server {
+
+bool MonitorIndex::ns_set::contains(namespace_id ns) const {
+    if (auto bit = to_int(ns) - NS_BITSET_MIN; bit >= 0 && bit < 64)
+        return bits >> bit & 1;
+    return std::binary_search(overflow.begin(), overflow.end(), ns);
+}
+
+void MonitorIndex::ns_set::add(const std::vector<namespace_id>& namespaces) {
+    std::vector<namespace_id> extra;
+    for (auto ns : namespaces) {
+        if (auto bit = to_int(ns) - NS_BITSET_MIN; bit >= 0 && bit < 64)
+            bits |= uint64_t{1} << bit;
+        else
+            extra.push_back(ns);
+    }
+    if (extra.empty())
+        return;
+    if (overflow.empty()) {
+        overflow = std::move(extra);
+        return;
+    }
+    std::vector<namespace_id> merged;
+    merged.reserve(overflow.size() + extra.size());
+    std::set_union(
+            overflow.begin(),
+            overflow.end(),
+            extra.begin(),
+            extra.end(),
+            std::back_inserter(merged));
+    overflow = std::move(merged);
+}
+
+bool MonitorIndex::subscribe(
+        const account_key& account,
+        const std::vector<namespace_id>& namespaces,
+        const oxenmq::ConnectionID& conn,
+        bool want_data,
+        bool batch,
+        std::chrono::steady_clock::time_point now,
+        std::chrono::seconds ttl,
+        const auth_digest& auth) {
+    auto expiry = now + std::min<std::chrono::seconds>(ttl, MAX_TTL);
+    auto tick = tick_of(expiry);
+
+    std::unique_lock lock{mutex_};
+    if (next_tick_ == INT64_MIN)
+        next_tick_ = tick_of(now);
+
+    auto& subs = accounts_[account];
+    auto it = std::find_if(
+            subs.begin(), subs.end(), [&conn](const auto& s) { return s.conn == conn; });
+    bool renewed = it != subs.end();
+    if (!renewed) {
+        it = subs.insert(subs.end(), subscription{conn});
+        count_++;
+    }
+    it->namespaces.add(namespaces);
+    it->want_data |= want_data;
+    it->batch |= batch;
+    it->auth = auth;
+    it->expiry = expiry;
+    if (!renewed || it->wheel_tick != tick) {
+        it->wheel_tick = tick;
+        wheel_[static_cast<uint64_t>(tick) % WHEEL_SLOTS].push_back(account);
+    }
+    return renewed;
+}
+
+bool MonitorIndex::renew(
+        const account_key& account,
+        const oxenmq::ConnectionID& conn,
+        const auth_digest& auth,
+        std::chrono::steady_clock::time_point now,
+        std::chrono::seconds ttl) {
+    if (auth == auth_digest{})
+        return false;
+    auto expiry = now + std::min<std::chrono::seconds>(ttl, MAX_TTL);
+    auto tick = tick_of(expiry);
+
+    std::unique_lock lock{mutex_};
+    auto acc = accounts_.find(account);
+    if (acc == accounts_.end())
+        return false;
+    auto it = std::find_if(acc->second.begin(), acc->second.end(), [&conn](const auto& s) {
+        return s.conn == conn;
+    });
+    // A lapsed subscription (not yet removed by expire()) goes through the full check again.
+    if (it == acc->second.end() || it->auth != auth || it->expiry < now)
+        return false;
+    it->expiry = expiry;
+    if (it->wheel_tick != tick) {
+        it->wheel_tick = tick;
+        wheel_[static_cast<uint64_t>(tick) % WHEEL_SLOTS].push_back(account);
+    }
+    return true;
+}
+
+void MonitorIndex::find(
+        const account_key& account,
+        namespace_id ns,
+        std::vector<subscriber>& out,
+        std::chrono::steady_clock::time_point now) const {
+    std::shared_lock lock{mutex_};
+    auto it = accounts_.find(account);
+    if (it == accounts_.end())
+        return;
+    for (const auto& s : it->second)
+        if (s.expiry >= now && s.namespaces.contains(ns))
+            out.push_back({s.conn, s.want_data, s.batch});
+}
+
+size_t MonitorIndex::expire(std::chrono::steady_clock::time_point now) {
+    auto cur = tick_of(now);
+    size_t removed = 0;
+
+    std::unique_lock lock{mutex_};
+    if (next_tick_ == INT64_MIN || next_tick_ >= cur)
+        return 0;
+    // If we've fallen more than a full turn of the wheel behind then every slot needs visiting
+    // exactly once:
+    next_tick_ = std::max<int64_t>(next_tick_, cur - static_cast<int64_t>(WHEEL_SLOTS));
+
+    for (; next_tick_ < cur; next_tick_++) {
+        auto slot = static_cast<uint64_t>(next_tick_) % WHEEL_SLOTS;
+        std::vector<account_key> keep;
+        for (const auto& key : wheel_[slot]) {
+            auto it = accounts_.find(key);
+            if (it == accounts_.end())
+                continue;
+            auto& subs = it->second;
+            bool scheduled_here = false;
+            subs.erase(
+                    std::remove_if(
+                            subs.begin(),
+                            subs.end(),
+                            [&](const subscription& s) {
+                                if (s.expiry < now) {
+                                    removed++;
+                                    return true;
+                                }
+                                // Still live, and due in a later turn of the wheel at this slot:
+                                if (s.wheel_tick >= cur &&
+                                    static_cast<uint64_t>(s.wheel_tick) % WHEEL_SLOTS == slot)
+                                    scheduled_here = true;
+                                return false;
+                            }),
+                    subs.end());
+            if (subs.empty())
+                accounts_.erase(it);
+            if (scheduled_here)
+                keep.push_back(key);
+        }
+        wheel_[slot] = std::move(keep);
+    }
+
+    count_ -= removed;
+    return removed;
+}
+
+size_t MonitorIndex::size() const {
+    std::shared_lock lock{mutex_};
+    return count_;
+}
+
+size_t MonitorIndex::memory_usage() const {
+    std::shared_lock lock{mutex_};
+    size_t bytes = util::memory_of(accounts_);
+    for (const auto& [account, subs] : accounts_) {
+        bytes += util::memory_of(subs);
+        for (const auto& sub : subs)
+            bytes += util::memory_of(sub.namespaces.overflow);
+    }
+    for (const auto& slot : wheel_)
+        bytes += util::memory_of(slot);
+    return bytes;
+}
+
+}  // namespace oxen::server
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <shared_mutex>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <oxenmq/connections.h>
+
+#include "../common/namespace.h"
+
+namespace oxen::server {
+
+using namespace std::literals;
+
+/// Index of monitor.messages subscriptions, organized for fast lookups when fanning out
+/// notifications of newly stored messages.
+///
+/// Accounts are keyed by their fixed-size, 33-byte prefixed pubkey.  Each subscription keeps its
+/// namespaces as a bitset over the commonly used namespace range (with a sorted overflow list for
+/// anything outside it), so that the per-message namespace check is a single bit test.  Expiries
+/// are tracked in a timer wheel of one-minute slots so that expire() only has to visit the
+/// accounts with a subscription due to expire rather than scanning everything.
+///
+/// All methods are thread-safe.
+class MonitorIndex {
+  public:
+    using account_key = std::array<unsigned char, 33>;
+
+    // How long a subscription lasts if not renewed.
+    static constexpr auto DEFAULT_TTL = 65min;
+
+    // Granularity and size of the expiry timer wheel.  TTLs longer than the wheel covers are
+    // clamped to it.
+    static constexpr auto WHEEL_TICK = 1min;
+    static constexpr size_t WHEEL_SLOTS = 128;
+    static constexpr auto MAX_TTL = WHEEL_TICK * (WHEEL_SLOTS - 1);
+
+    // Namespaces in [NS_BITSET_MIN, NS_BITSET_MIN + 64) are stored in the bitset; others in the
+    // overflow list.
+    static constexpr int NS_BITSET_MIN = -32;
+
+    // Returns the account key of a 33-byte prefixed pubkey; `pubkey` must be exactly 33 bytes.
+    static account_key make_key(std::string_view pubkey) {
+        account_key k;
+        std::memcpy(k.data(), pubkey.data(), k.size());
+        return k;
+    }
+
+    // Digest of the (verified) request that authorized a subscription, which lets renewals with
+    // the identical request skip signature verification; all zeros means none.
+    using auth_digest = std::array<unsigned char, 16>;
+
+    // Adds a subscription of `conn` to new messages for the given account in the given (sorted)
+    // namespaces.  If `conn` already has a subscription to the account then this renews it,
+    // adding the namespaces to the already-subscribed ones and turning on `want_data` and `batch`
+    // if set.  `auth`, if given, is remembered for renew().  Returns true if this renewed an
+    // existing subscription, false if it added a new one.
+    bool subscribe(
+            const account_key& account,
+            const std::vector<namespace_id>& namespaces,
+            const oxenmq::ConnectionID& conn,
+            bool want_data,
+            bool batch,
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now(),
+            std::chrono::seconds ttl = DEFAULT_TTL,
+            const auth_digest& auth = {});
+
+    // Renews the subscription of `conn` to `account` if it was last authorized by a request with
+    // the same (non-zero) `auth` digest, which, since the request is identical, can't change its
+    // namespaces or flags.  Returns false (changing nothing) if there is no such subscription.
+    bool renew(
+            const account_key& account,
+            const oxenmq::ConnectionID& conn,
+            const auth_digest& auth,
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now(),
+            std::chrono::seconds ttl = DEFAULT_TTL);
+
+    struct subscriber {
+        oxenmq::ConnectionID conn;
+        bool want_data;  // Wants the message data included in notifications
+        bool batch;      // Wants notifications batched into notify.messages
+    };
+
+    // Appends the subscribers to `account` with an active subscription for messages in namespace
+    // `ns` to `out`.
+    void find(
+            const account_key& account,
+            namespace_id ns,
+            std::vector<subscriber>& out,
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now()) const;
+
+    // Removes subscriptions that have expired, visiting only the timer wheel slots that have
+    // passed since the last call.  Returns the number of subscriptions removed.
+    size_t expire(std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+    // Returns the number of subscriptions (including any expired but not yet removed ones).
+    size_t size() const;
+
+    // Returns an estimate of the memory (in bytes) held by the index.
+    size_t memory_usage() const;
+
+  private:
+    struct ns_set {
+        uint64_t bits = 0;
+        std::vector<namespace_id> overflow;  // sorted
+
+        bool contains(namespace_id ns) const;
+        void add(const std::vector<namespace_id>& namespaces);
+    };
+
+    struct subscription {
+        oxenmq::ConnectionID conn;
+        ns_set namespaces;
+        bool want_data = false;
+        bool batch = false;
+        std::chrono::steady_clock::time_point expiry;
+        int64_t wheel_tick = 0;  // Tick of the wheel slot this subscription is scheduled in
+        auth_digest auth{};      // Digest of the request that last authorized it
+
+        explicit subscription(oxenmq::ConnectionID c) : conn{std::move(c)} {}
+    };
+
+    struct key_hash {
+        size_t operator()(const account_key& k) const {
+            // Pubkeys are effectively random, so some bytes of the key itself (skipping the
+            // network prefix) make a perfectly good hash.
+            size_t h;
+            std::memcpy(&h, k.data() + 1, sizeof(h));
+            return h;
+        }
+    };
+
+    static int64_t tick_of(std::chrono::steady_clock::time_point t) {
+        return std::chrono::duration_cast<std::chrono::minutes>(t.time_since_epoch()).count();
+    }
+
+    mutable std::shared_mutex mutex_;
+    std::unordered_map<account_key, std::vector<subscription>, key_hash> accounts_;
+    size_t count_ = 0;
+
+    // Slot `t % WHEEL_SLOTS` holds the accounts with a subscription expiring during tick `t`.  An
+    // account can appear in a slot more than once, or for a subscription that has since been
+    // renewed; expire() checks the actual expiries.
+    std::array<std::vector<account_key>, WHEEL_SLOTS> wheel_;
+    int64_t next_tick_ = INT64_MIN;  // The next wheel tick that expire() needs to process
+};
+
+}  // namespace oxen::server
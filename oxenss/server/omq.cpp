@@ -8,7 +8,9 @@
 #include <oxenss/rpc/rate_limiter.h>
 #include <oxenss/rpc/request_handler.h>
 #include "omq_logger.h"
+#include <oxenss/snode/serialization.h>
 #include <oxenss/snode/service_node.h>
+#include <oxenss/utils/memory.hpp>
 #include <oxenss/utils/string_utils.hpp>
 
 #include <chrono>
@@ -48,23 +50,30 @@ std::string OMQ::peer_lookup(std::string_view pubkey_bin) const {
 void OMQ::handle_sn_data(oxenmq::Message& message) {
     log::debug(logcat, "[LMQ] handle_sn_data");
     log::debug(logcat, "[LMQ]   thread id: {}", std::this_thread::get_id());
-    log::debug(logcat, "[LMQ]   from: {}", oxenc::to_hex(message.conn.pubkey()));
-
-    std::stringstream ss;
-
-    // We are only expecting a single part message, so consider removing this
-    for (auto& part : message.data) {
-        ss << part;
-    }
+    log::debug(
+            logcat,
+            "[LMQ]   from: {}",
+            logging::lazy([&] { return oxenc::to_hex(message.conn.pubkey()); }));
 
     // TODO: proces push batch should move to "Request handler"
-    service_node_->process_push_batch(ss.str());
+    if (message.data.size() == 1) {
+        // The normal case: process the batch in place, without copying it
+        service_node_->process_push_batch(message.data.front());
+    } else {
+        std::string batch;
+        for (auto& part : message.data)
+            batch += part;
+        service_node_->process_push_batch(batch);
+    }
 
     log::debug(logcat, "[LMQ] send reply");
 
     // TODO: Investigate if the above could fail and whether we should report
     // that to the sending SN
-    message.send_reply();
+
+    // Tell the sender the newest serialization version we understand so that it can use it for
+    // subsequent batches.  (Older storage servers reply with nothing, which means v1).
+    message.send_reply(std::to_string(snode::SERIALIZATION_VERSION_LATEST));
 };
 
 void OMQ::handle_ping(oxenmq::Message& message) {
@@ -196,7 +205,18 @@ void OMQ::handle_onion_request(oxenmq::Message& message) {
         return;
     }
 
-    handle_onion_request(data.first, std::move(data.second), message.send_later());
+    // Process it on the onion queue rather than tying up an "sn" worker; that means we have to
+    // copy the payload, since the message data doesn't outlive this call.
+    auto send = message.send_later();
+    if (!service_node_->onion_queue().submit(
+                [this,
+                 payload = std::string{data.first},
+                 data = std::move(data.second),
+                 send]() mutable { handle_onion_request(payload, std::move(data), send); })) {
+        log::debug(logcat, "Onion request queue is full, rejecting onion request");
+        send.reply(
+                std::to_string(http::SERVICE_UNAVAILABLE.first), "Onion request queue is full"s);
+    }
 }
 
 void OMQ::handle_get_stats(oxenmq::Message& message) {
@@ -208,6 +228,53 @@ void OMQ::handle_get_stats(oxenmq::Message& message) {
     message.send_reply(payload);
 }
 
+OMQ::memory_usage OMQ::get_memory_usage() {
+    memory_usage mem;
+    mem.monitors = monitors_.memory_usage();
+    mem.retrieve_waiters = retrieve_waiters_.memory_usage();
+    {
+        std::lock_guard lock{forward_mutex_};
+        mem.forward_batches = util::memory_of(forward_batches_);
+        for (const auto& [peer, batch] : forward_batches_)
+            mem.forward_batches += util::memory_of(peer) + util::memory_of(batch.data) +
+                                   util::memory_of(batch.callbacks);
+    }
+    if (rate_limiter_)
+        mem.rate_limiter = rate_limiter_->memory_usage();
+    return mem;
+}
+
+void OMQ::handle_get_traces(oxenmq::Message& message) {
+    log::debug(logcat, "Received get_traces request via OMQ");
+
+    auto to_ms = [](auto d) { return std::chrono::duration<double, std::milli>{d}.count(); };
+
+    auto traces = nlohmann::json::array();
+    for (auto& trace : request_handler_->tracer().slowest()) {
+        auto spans = trace->spans();
+        auto root_start = spans.front().start;
+        auto& t = traces.emplace_back();
+        t["method"] = spans.front().name;
+        t["started"] = std::chrono::duration<double>{trace->started.time_since_epoch()}.count();
+        t["duration_ms"] = to_ms(spans.front().duration);
+        t["sampled"] = trace->sampled;
+        auto& js = t["spans"] = nlohmann::json::array();
+        for (auto& span : spans) {
+            auto& s = js.emplace_back();
+            s["name"] = span.name;
+            s["parent"] = span.parent;
+            s["start_ms"] = to_ms(span.start - root_start);
+            s["duration_ms"] = to_ms(span.duration);
+            if (!span.detail.empty())
+                s["detail"] = span.detail;
+            for (auto& [k, v] : span.values)
+                s[k] = v;
+        }
+    }
+
+    message.send_reply(traces.dump());
+}
+
 oxenc::bt_value json_to_bt(nlohmann::json j) {
     if (j.is_object()) {
         oxenc::bt_dict res;
@@ -235,6 +302,54 @@ oxenc::bt_value json_to_bt(nlohmann::json j) {
     throw std::runtime_error{"internal error"};
 }
 
+void bt_append_string(std::string& out, std::string_view s) {
+    out += std::to_string(s.size());
+    out += ':';
+    out += s;
+}
+
+void bt_append_json(std::string& out, const nlohmann::json& j) {
+    // NB: nlohmann::json objects keep their keys in sorted (std::map) order, which is exactly the
+    // ordering that bt-encoded dicts require.
+    if (j.is_object()) {
+        out += 'd';
+        for (auto& [k, v] : j.items()) {
+            bt_append_string(out, k);
+            bt_append_json(out, v);
+        }
+        out += 'e';
+    } else if (j.is_array()) {
+        out += 'l';
+        for (auto& v : j)
+            bt_append_json(out, v);
+        out += 'e';
+    } else if (j.is_string()) {
+        bt_append_string(out, j.get_ref<const std::string&>());
+    } else if (j.is_boolean() || j.is_number_integer()) {
+        // (includes unsigned)
+        out += 'i';
+        if (j.is_boolean())
+            out += j.get<bool>() ? '1' : '0';
+        else if (j.is_number_unsigned())
+            out += std::to_string(j.get<uint64_t>());
+        else
+            out += std::to_string(j.get<int64_t>());
+        out += 'e';
+    } else {
+        log::warning(
+                logcat,
+                "client request returned json with an unhandled value type, unable to convert to "
+                "bt");
+        throw std::runtime_error{"internal error"};
+    }
+}
+
+std::string bt_serialize_json(const nlohmann::json& j) {
+    std::string out;
+    bt_append_json(out, j);
+    return out;
+}
+
 nlohmann::json bt_to_json(oxenc::bt_dict_consumer d) {
     nlohmann::json j = nlohmann::json::object();
     while (!d.is_finished()) {
@@ -276,14 +391,12 @@ nlohmann::json bt_to_json(oxenc::bt_list_consumer l) {
 
 void OMQ::handle_client_request(std::string_view method, oxenmq::Message& message, bool forwarded) {
     log::debug(logcat, "Handling OMQ RPC request for {}", method);
-    auto it = rpc::RequestHandler::client_rpc_endpoints.find(method);
-
-    // This endpoint shouldn't have been registered if it isn't in here:
-    assert(it != rpc::RequestHandler::client_rpc_endpoints.end());
 
     const size_t full_size = forwarded ? 2 : 1;
     const size_t empty_body = full_size - 1;
-    if (message.data.size() != empty_body && message.data.size() != full_size) {
+    // Direct requests can add the compression encodings they accept after the parameters
+    const bool with_encoding = !forwarded && message.data.size() == full_size + 1;
+    if (message.data.size() != empty_body && message.data.size() != full_size && !with_encoding) {
         log::warning(
                 logcat,
                 "Invalid {}OMQ RPC request for {}: incorrect number of message parts ({})",
@@ -305,102 +418,176 @@ void OMQ::handle_client_request(std::string_view method, oxenmq::Message& messag
                 std::to_string(http::TOO_MANY_REQUESTS.first),
                 "Too many requests, try again later");
     }
+    if (!forwarded && rpc::RequestHandler::low_priority(method) &&
+        load_shedder_.shed_low_priority()) {
+        log::debug(
+                logcat, "Shedding {} request from {}: server overloaded", method, message.remote);
+        return message.send_reply(
+                std::to_string(http::SERVICE_UNAVAILABLE.first), "Server busy, try again later");
+    }
 
-    try {
-        std::string_view params = message.data.size() == full_size ? message.data.back() : ""sv;
-        it->second.omq(
-                *request_handler_,
-                params,
-                forwarded,
-                [send = message.send_later(),
-                 bt_encoded = !params.empty() && params.front() == 'd'](rpc::Response res) {
-                    std::string dump;
-                    std::string_view body;
-                    if (auto* j = std::get_if<nlohmann::json>(&res.body)) {
-                        if (bt_encoded)
-                            dump = bt_serialize(json_to_bt(std::move(*j)));
-                        else
-                            dump = j->dump();
-                        body = dump;
-                    } else
-                        body = view_body(res);
-
-                    if (res.status == http::OK) {
-                        log::debug(
-                                logcat,
-                                "OMQ RPC request successful, returning {}-byte {} response",
-                                body.size(),
-                                dump.empty() ? "text"
-                                : bt_encoded ? "bt"
-                                             : "json");
-                        // Success: return just the body
-                        send.reply(body);
-                    } else {
-                        // On error return [errcode, body]
-                        log::debug(
-                                logcat,
-                                "OMQ RPC request failed, replying with [{}, {}]",
-                                res.status.first,
-                                body);
-                        send.reply(std::to_string(res.status.first), body);
+    std::string_view params = message.data.size() >= full_size ? message.data[full_size - 1] : ""sv;
+    auto encoding = with_encoding && compression_.min_size > 0
+                          ? util::accept_encoding(message.data.back())
+                          : util::content_encoding::identity;
+    run_client_request(
+            method,
+            params,
+            forwarded,
+            [this, encoding, send = message.send_later()](
+                    std::string_view code, std::string_view body) {
+                if (code.empty() && encoding != util::content_encoding::identity &&
+                    body.size() >= compression_.min_size) {
+                    std::string compressed{body};
+                    try {
+                        if (util::maybe_compress(compressed, encoding, compression_))
+                            return send.reply(util::to_string(encoding), compressed);
+                    } catch (const std::exception& e) {
+                        log::warning(logcat, "Failed to compress response: {}", e.what());
                     }
-                });
+                }
+                if (code.empty())
+                    send.reply(body);
+                else
+                    send.reply(code, body);
+            });
+}
+
+void OMQ::run_client_request(
+        std::string_view method,
+        std::string_view params,
+        bool forwarded,
+        std::function<void(std::string_view code, std::string_view body)> reply_to) {
+    auto endpoint = rpc::find_client_rpc(method);
+    if (!endpoint) {
+        // Client endpoints are only registered for valid methods, so this can only happen for a
+        // forwarded request (where the method is part of the request).
+        log::warning(logcat, "Invalid forwarded client request for unknown method {}", method);
+        return reply_to(std::to_string(http::BAD_REQUEST.first), "invalid request: unknown method");
+    }
+
+    try {
+        auto timer = request_handler_->time_request(method);
+        auto reply = [reply_to,
+                      bt_encoded = !params.empty() && params.front() == 'd'](rpc::Response res) {
+            std::string dump;
+            std::string_view body;
+            if (auto* j = std::get_if<nlohmann::json>(&res.body)) {
+                util::traced span{"serialize_response"};
+                if (bt_encoded)
+                    dump = bt_serialize_json(*j);
+                else
+                    dump = j->dump();
+                body = dump;
+            } else
+                body = view_body(res);
+
+            if (res.status == http::OK) {
+                log::debug(
+                        logcat,
+                        "OMQ RPC request successful, returning {}-byte {} response",
+                        body.size(),
+                        dump.empty() ? "text"
+                        : bt_encoded ? "bt"
+                                     : "json");
+                // Success: return just the body
+                reply_to(""sv, body);
+            } else {
+                // On error return [errcode, body]
+                log::debug(
+                        logcat,
+                        "OMQ RPC request failed, replying with [{}, {}]",
+                        res.status.first,
+                        body);
+                reply_to(std::to_string(res.status.first), body);
+            }
+        };
+        std::function<void(rpc::Response)> cb = timer.wrap(std::move(reply));
+        // Forwarded requests were already captured (if sampled) by the node they came in on
+        if (auto req = forwarded ? nullptr
+                                 : request_handler_->capture().sample("client", "omq", method)) {
+            nlohmann::json j;
+            try {
+                j = !params.empty() && params.front() == 'd'
+                          ? bt_to_json(oxenc::bt_dict_consumer{params})
+                          : nlohmann::json::parse(params, nullptr, false);
+            } catch (const std::exception&) {
+                // Invalid params: the endpoint will reject the request
+            }
+            request_handler_->capture().describe(*req, j);
+            cb = request_handler_->capture_response(std::move(req), std::move(cb));
+        }
+        request_handler_->process_omq_client_req(*endpoint, params, forwarded, std::move(cb));
     } catch (const rpc::parse_error& e) {
         // These exceptions carry a failure message to send back to the client
         log::debug(logcat, "Invalid request: {}", e.what());
-        message.send_reply(
-                std::to_string(http::BAD_REQUEST.first), "invalid request: "s + e.what());
+        reply_to(std::to_string(http::BAD_REQUEST.first), "invalid request: "s + e.what());
     } catch (const std::exception& e) {
         // Other exceptions might contain something sensitive or irrelevant so warn about it and
         // send back a generic message.
         log::warning(logcat, "Client request raised an exception: {}", e.what());
-        message.send_reply(std::to_string(http::INTERNAL_SERVER_ERROR.first), "request failed");
+        reply_to(std::to_string(http::INTERNAL_SERVER_ERROR.first), "request failed");
     }
 }
 
 OMQ::OMQ(
         const snode::sn_record& me,
         const crypto::x25519_seckey& privkey,
-        const std::vector<crypto::x25519_pubkey>& stats_access_keys) :
+        const std::vector<crypto::x25519_pubkey>& stats_access_keys,
+        std::chrono::milliseconds notify_batch_window,
+        size_t notify_batch_max_size,
+        std::chrono::milliseconds forward_batch_window,
+        const worker_config& workers,
+        util::compression_config compression) :
         omq_{std::string{me.pubkey_x25519.view()},
              std::string{privkey.view()},
              true,                                         // is service node
              [this](auto pk) { return peer_lookup(pk); },  // SN-by-key lookup func
              omq_logger,
-             oxenmq::LogLevel::info} {
+             oxenmq::LogLevel::info},
+        workers_{workers},
+        compression_{compression},
+        load_shedder_{workers.shed_wait},
+        notify_batch_window_{notify_batch_window},
+        notify_batch_max_size_{notify_batch_max_size},
+        forward_batch_window_{forward_batch_window},
+        notify_queue_{"notify", 1, NOTIFY_QUEUE_SIZE} {
     for (const auto& key : stats_access_keys)
         stats_access_keys_.emplace(key.view());
 
     // clang-format off
 
     // Endpoints invoked by other SNs
-    omq_.add_category("sn", oxenmq::Access{oxenmq::AuthLevel::none, true, false}, 2 /*reserved threads*/, 1000 /*max queue*/)
-        .add_request_command("data", [this](auto& m) { handle_sn_data(m); })
-        .add_request_command("ping", [this](auto& m) { handle_ping(m); })
-        .add_request_command("storage_test", [this](auto& m) { handle_storage_test(m); }) // NB: requires a 60s request timeout
-        .add_request_command("onion_request", [this](auto& m) { handle_onion_request(m); })
+    omq_.add_category("sn", oxenmq::Access{oxenmq::AuthLevel::none, true, false}, workers_.sn_threads, workers_.sn_queue)
+        .add_request_command("data", [this](auto& m) { workers_.sn_cpus.apply(); handle_sn_data(m); })
+        .add_request_command("ping", [this](auto& m) { workers_.sn_cpus.apply(); handle_ping(m); })
+        .add_request_command("storage_test", [this](auto& m) { workers_.sn_cpus.apply(); handle_storage_test(m); }) // NB: requires a 60s request timeout
+        .add_request_command("onion_request", [this](auto& m) { workers_.sn_cpus.apply(); handle_onion_request(m); })
         .add_request_command("storage_cc", [this](auto& m) {
+            workers_.sn_cpus.apply();
             if (m.data.size() >= 2) return handle_client_request(m.data[0], m, true);
             log::warning(logcat, "Invalid forwarded client request: incorrect number of message parts ({})",  m.data.size());
         })
+        .add_request_command("storage_cc_batch", [this](auto& m) { workers_.sn_cpus.apply(); handle_client_request_batch(m); })
         ;
 
     // storage.WHATEVER (e.g. storage.store, storage.retrieve, etc.) endpoints are invokable by
     // anyone (i.e. clients) and have the same WHATEVER endpoints as the "method" values for the
     // HTTPS /storage_rpc/v1 endpoint.
-    auto st_cat = omq_.add_category("storage", oxenmq::AuthLevel::none, 1 /*reserved threads*/, 200 /*max queue*/);
-    for (const auto& [name, _cb] : rpc::RequestHandler::client_rpc_endpoints)
-        st_cat.add_request_command(std::string{name}, [this, name=name](auto& m) { handle_client_request(name, m); });
+    auto st_cat = omq_.add_category("storage", oxenmq::AuthLevel::none, workers_.storage_threads, workers_.storage_queue);
+    for (const auto& method : rpc::client_rpc_methods)
+        st_cat.add_request_command(std::string{method.name}, [this, name=method.name](auto& m) { workers_.storage_cpus.apply(); handle_client_request(name, m); });
 
     // monitor.* endpoints are used to subscribe to events such as new messages arriving for an
     // account.
-    omq_.add_category("monitor", oxenmq::AuthLevel::none, 1 /*reserved threads*/, 500 /*max queue*/)
-        .add_request_command("messages", [this](auto& m) { handle_monitor_messages(m); })
+    omq_.add_category("monitor", oxenmq::AuthLevel::none, workers_.monitor_threads, workers_.monitor_queue)
+        .add_request_command("messages", [this](auto& m) { workers_.monitor_cpus.apply(); handle_monitor_messages(m); })
         ;
 
     // Endpoints invokable by a local admin
     omq_.add_category("service", oxenmq::AuthLevel::admin)
         .add_request_command("get_stats", [this](auto& m) { handle_get_stats(m); })
+        .add_request_command("get_traces", [this](auto& m) { handle_get_traces(m); })
         ;
 
     // We send a sub.block to oxend to tell it to push new block notifications to us via this
@@ -412,7 +599,22 @@ OMQ::OMQ(
         });
 
     // clang-format on
-    omq_.set_general_threads(1);
+    omq_.set_general_threads(workers_.general_threads);
+
+    omq_.add_timer([this] { monitors_.expire(); }, MonitorIndex::WHEEL_TICK);
+    omq_.add_timer(
+            [this] {
+                std::vector<RetrieveWaiters::callback> expired;
+                retrieve_waiters_.expire(expired);
+                resume_retrieves(std::move(expired));
+            },
+            RetrieveWaiters::WHEEL_TICK);
+    omq_.add_timer(
+            [this] { notify_queue_.submit([this] { flush_notify_batches(); }); },
+            notify_batch_window_);
+    if (forward_batch_window_ > 0ms)
+        omq_.add_timer([this] { flush_forward_batches(); }, forward_batch_window_);
+    omq_.add_timer([this] { probe_queue_wait(); }, SHED_PROBE_INTERVAL);
 
     omq_.MAX_MSG_SIZE =
             10 * 1024 * 1024;  // 10 MB (needed by the fileserver, and swarm msg serialization)
@@ -421,6 +623,24 @@ OMQ::OMQ(
     omq_.EPHEMERAL_ROUTING_ID = false;
 }
 
+void OMQ::probe_queue_wait() {
+    auto now = std::chrono::steady_clock::now();
+    if (shed_probe_pending_.load()) {
+        // The previous probe is still waiting, so the wait is at least as long as it has been so
+        // far; recording that now lets us react without waiting for the backlog to clear.
+        std::chrono::steady_clock::time_point sent{
+                std::chrono::steady_clock::duration{shed_probe_sent_.load()}};
+        load_shedder_.record_wait(now - sent);
+        return;
+    }
+    shed_probe_sent_ = now.time_since_epoch().count();
+    shed_probe_pending_ = true;
+    omq_.job([this, now] {
+        load_shedder_.record_wait(std::chrono::steady_clock::now() - now);
+        shed_probe_pending_ = false;
+    });
+}
+
 void OMQ::connect_oxend(const oxenmq::address& oxend_rpc) {
     // Establish our persistent connection to oxend.
     auto start = std::chrono::steady_clock::now();
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <functional>
 #include <memory>
-#include <shared_mutex>
+#include <mutex>
 #include <string>
 #include <string_view>
 #include <unordered_map>
@@ -14,6 +17,12 @@
 
 #include "../common/message.h"
 #include "../snode/sn_record.h"
+#include "../utils/affinity.hpp"
+#include "../utils/compression.hpp"
+#include "../utils/work_queue.hpp"
+#include "load_shedder.h"
+#include "monitor_index.h"
+#include "retrieve_waiters.h"
 
 namespace oxen::rpc {
 class RequestHandler;
@@ -32,30 +41,42 @@ using namespace std::literals;
 
 oxenc::bt_value json_to_bt(nlohmann::json j);
 
+// Appends the bt-encoded serialization of `j` to `out`.  This produces the same result as
+// `bt_serialize(json_to_bt(j))`, but writes directly rather than building an intermediate
+// bt_value tree.  Throws on json values that have no bt representation (null, floats).
+void bt_append_json(std::string& out, const nlohmann::json& j);
+
+// Returns the bt-encoded serialization of `j`; see bt_append_json.
+std::string bt_serialize_json(const nlohmann::json& j);
+
+// Appends a bt-encoded string value to `out`.
+void bt_append_string(std::string& out, std::string_view s);
+
 nlohmann::json bt_to_json(oxenc::bt_dict_consumer d);
 nlohmann::json bt_to_json(oxenc::bt_list_consumer l);
 
-struct MonitorData {
-    static constexpr auto MONITOR_EXPIRY_TIME = 65min;
-
-    std::chrono::steady_clock::time_point expiry;  // When this notify reg expires
-    std::vector<namespace_id> namespaces;          // sorted namespace_ids
-    oxenmq::ConnectionID push_conn;                // ConnectionID to push notifications to
-    bool want_data;                                // true if the subscriber wants msg data
-
-    MonitorData(
-            std::vector<namespace_id> namespaces,
-            oxenmq::ConnectionID conn,
-            bool data,
-            std::chrono::seconds ttl = MONITOR_EXPIRY_TIME) :
-            expiry{std::chrono::steady_clock::now() + ttl},
-            namespaces{std::move(namespaces)},
-            push_conn{std::move(conn)},
-            want_data{data} {}
-
-    void reset_expiry(std::chrono::seconds ttl = MONITOR_EXPIRY_TIME) {
-        expiry = std::chrono::steady_clock::now() + ttl;
-    }
+// Worker thread and queue sizing of the oxenmq command categories, and the queue wait above which
+// we start shedding low-priority client requests (see LoadShedder).  The thread counts of the
+// categories are threads reserved for that category's jobs, in addition to the general threads
+// that are shared by all categories; the queue sizes are the number of jobs of the category that
+// can be waiting before further requests get dropped.
+//
+// The CPU sets, if not empty, restrict the workers running each category's jobs to those CPUs.
+// oxenmq doesn't keep a category's jobs on its reserved threads (general threads run them too, and
+// reserved threads go on to run other jobs), so a worker gets moved to a category's CPUs when it
+// starts one of its jobs, and stays there until it runs a job of a category with a different set.
+struct worker_config {
+    int general_threads = 1;
+    int sn_threads = 2;  // Swarm traffic: sn.* requests from other service nodes
+    int sn_queue = 1000;
+    int storage_threads = 1;  // storage.* client requests over OMQ
+    int storage_queue = 200;
+    int monitor_threads = 1;
+    int monitor_queue = 500;
+    int https_threads = 2;  // Client requests over HTTPS
+    int https_queue = 1000;
+    util::cpu_set sn_cpus, storage_cpus, monitor_cpus, https_cpus;
+    std::chrono::milliseconds shed_wait = LoadShedder::DEFAULT_TARGET_WAIT;
 };
 
 class OMQ {
@@ -69,9 +90,71 @@ class OMQ {
 
     rpc::RateLimiter* rate_limiter_ = nullptr;
 
+    const worker_config workers_;
+
+    // When (and how hard) to compress client responses for requests that ask for it
+    const util::compression_config compression_;
+
+    // Measures worker queue waits and decides when to reject low-priority requests.  The general
+    // queue is probed every SHED_PROBE_INTERVAL (oxenmq doesn't report queue waits itself), and
+    // the HTTPS server also records the wait of each request it injects.
+    LoadShedder load_shedder_;
+    static constexpr auto SHED_PROBE_INTERVAL = 100ms;
+    std::atomic<bool> shed_probe_pending_{false};
+    std::atomic<std::chrono::steady_clock::rep> shed_probe_sent_{0};
+
+    // Queues a job on the general workers measuring how long it waits to run.
+    void probe_queue_wait();
+
+    // Maximum number of messages waiting to have notifications sent; beyond this notifications
+    // are dropped.
+    static constexpr size_t NOTIFY_QUEUE_SIZE = 10000;
+
+    // Maximum time a batched notification waits before being sent, and maximum encoded size of a
+    // notify.messages batch.
+    const std::chrono::milliseconds notify_batch_window_;
+    const size_t notify_batch_max_size_;
+
     // Tracks accounts we are monitoring for OMQ push notification messages
-    std::unordered_multimap<std::string, MonitorData> monitoring_;
-    mutable std::shared_mutex monitoring_mutex_;
+    MonitorIndex monitors_;
+
+    // notify.messages batches waiting to be sent; only accessed from the notify queue.  Batching
+    // is intended for a handful of push server connections, so this is just searched linearly.
+    struct notify_batch {
+        oxenmq::ConnectionID conn;
+        std::string data;  // bt-encoded list, without the closing 'e'
+    };
+    std::vector<notify_batch> notify_batches_;
+
+    // Long-polling retrieves waiting for a new message (see park_retrieve)
+    RetrieveWaiters retrieve_waiters_;
+
+    // Dispatches the callbacks of waiting retrieves that have been woken or timed out
+    void resume_retrieves(std::vector<RetrieveWaiters::callback>&& resumes);
+
+    // Maximum time a forwarded client request (to a swarm peer) waits to be sent along with
+    // others for the same peer as a single sn.storage_cc_batch; 0 disables batching, i.e. each
+    // goes out as its own sn.storage_cc.
+    const std::chrono::milliseconds forward_batch_window_;
+
+    // Forwarded client requests waiting to be sent to each peer (by x25519 pubkey)
+    struct forward_batch {
+        std::string data;  // bt-encoded list of [METHOD, BODY] lists, without the closing 'e'
+        std::vector<std::function<void(bool, std::vector<std::string>)>> callbacks;
+    };
+    std::mutex forward_mutex_;
+    std::unordered_map<std::string, forward_batch> forward_batches_;
+
+    // Sends a peer's batch (which must be non-empty) and resets it.
+    void send_forward_batch(const std::string& peer, forward_batch& batch);
+
+    // Sends all pending forward batches; called every forward batch window.
+    void flush_forward_batches();
+
+    // Notifications are encoded and sent from here rather than from the thread storing the
+    // message.  It has a single thread so that notifications go out in the order messages were
+    // stored.  This is after `omq_` so that it gets stopped before `omq_` is destroyed.
+    util::WorkQueue notify_queue_;
 
     // Get node's address
     std::string peer_lookup(std::string_view pubkey_bin) const;
@@ -94,6 +177,21 @@ class OMQ {
     // sn.storage_test
     void handle_storage_test(oxenmq::Message& message);
 
+    // sn.storage_cc_batch: a batch of forwarded client requests, as sent by
+    // forward_client_request.  The single message part is a bt-encoded list of [METHOD, BODY]
+    // lists; the single reply part is a bt-encoded list (see encode_batch_replies) of the reply
+    // parts of each request, in the same order.
+    void handle_client_request_batch(oxenmq::Message& message);
+
+    // Runs a client request, passing the reply to `reply` as ("", BODY) on success or
+    // (ERRCODE, BODY) on failure (including if `method` isn't a client endpoint).  `params` only
+    // needs to stay valid during the call.
+    void run_client_request(
+            std::string_view method,
+            std::string_view params,
+            bool forwarded,
+            std::function<void(std::string_view code, std::string_view body)> reply);
+
     /// storage.(whatever) -- client request handling.  These reply with [BODY] on success or
     /// [CODE, BODY] on failure (where BODY typically is some sort of error message).
     ///
@@ -108,6 +206,14 @@ class OMQ {
     ///
     /// Failure responses are an HTTP error number and a plain text failure string.
     ///
+    /// A direct (i.e. not forwarded) request may include a second part after the parameters (which
+    /// may be empty) listing the compression encodings the client accepts, in the format of an HTTP
+    /// Accept-Encoding header (e.g. "gzip" or "deflate").  Successful responses large enough to
+    /// be worth compressing then come back as [ENCODING, COMPRESSED_VALUE] instead of [VALUE],
+    /// where ENCODING is the encoding used; the size limits of the request (such as retrieve's
+    /// `max_size`) apply to the uncompressed value.  Responses that aren't compressed, and
+    /// failures (which always have a numeric ERRCODE), are returned as above.
+    ///
     /// `forwarded` is set if this request was forwarded from another swarm member rather than
     /// being direct from the client; the request is handled identically except that these
     /// forwarded requests are not-reforwarded again, and the method name is prepended on the
@@ -135,6 +241,8 @@ class OMQ {
     ///   documentation).
     /// - n -- list of namespace ids to monitor for new messages; the ids must be valid (i.e. -32768
     ///   through 32767), must be sorted in numeric order, and must contain no duplicates.
+    /// - b -- set to 1 to receive notifications for this subscription in batches (see below) rather
+    ///   than one message per notification.
     /// - d -- set to 1 if the caller wants the full message data, 0 (or omitted) will omit the data
     ///   from notifications.
     /// - t -- signature timestamp, in integer unix seconds (*not* milliseconds), associated with
@@ -151,7 +259,11 @@ class OMQ {
     ///
     /// If the request validates then the connection is subscribed (for 65 minutes) to new incoming
     /// messages in the given namespace(s).  A caller should renew subscriptions periodically by
-    /// re-submitting the subscription request (with at most 1h between re-subscriptions).
+    /// re-submitting the subscription request (with at most 1h between re-subscriptions).  A
+    /// renewal that re-submits exactly the same entry (byte for byte) as the one that last
+    /// authorized the connection's subscription is accepted without verifying the signature again
+    /// (the timestamp must still be valid); large lists of entries that do need verification are
+    /// verified in parallel across worker threads.
     ///
     /// The reply to the subscription request is either a bencoded dict or list of dicts containing
     /// the following keys.  In the case of a list of subscriptions in the request, the returned
@@ -185,6 +297,12 @@ class OMQ {
     /// - z -- the expiry (milliseconds since unix epoch) of the message.
     /// - ~ -- the message data, if requested.
     ///
+    /// If the subscription requested batching (`b`) then notifications are instead collected for
+    /// a short time (100ms by default) and sent together as "notify.messages" with a second part
+    /// containing a bt-encoded list of the notification dicts described above.  A batch is sent
+    /// early if it reaches the (configurable) size limit.  Notifications for subscriptions with
+    /// and without batching on the same connection are not ordered relative to each other.
+    ///
     /// Note: if the same connection submits multiple simultaneous subscriptions then the subsequent
     /// subscriptions add to earlier subscriptions.  This has some implications:
     ///
@@ -192,6 +310,7 @@ class OMQ {
     ///   any of the matching subscription requests on that same connection.
     /// - All pubkey/subkey/ed25519 pubkeys that access the same account are treated as the same
     ///   subscription.
+    /// - Batching, once requested, applies for as long as the subscription is renewed.
     /// - The data key (`~`) will be present in a notification if *any* subscription request for the
     ///   same account on the same connection requested data.  Same a flag only expires when the
     ///   subscription itself expires, but, like namespaces, persists as long as the subscription is
@@ -211,6 +330,18 @@ class OMQ {
 
     void handle_get_stats(oxenmq::Message& message);
 
+    /// Returns the slowest recent traced client requests (see util::Tracer) as a json list, slowest
+    /// first.  Each trace has keys:
+    /// - "method" -- the request method
+    /// - "started" -- when the request was received, in unix seconds
+    /// - "duration_ms" -- how long the request took to handle
+    /// - "sampled" -- true if the trace was randomly sampled, false if it was kept for being slow
+    /// - "spans" -- list of the timed steps in handling the request.  Each has "name", "parent"
+    ///   (index of the enclosing span; -1 for the first, root span), "start_ms" (offset from the
+    ///   start of the request), "duration_ms", an optional "detail" string (e.g. the SQL of a
+    ///   database statement), plus any step-specific integer counters.
+    void handle_get_traces(oxenmq::Message& message);
+
     // Access pubkeys for the 'service' command category (for access stats & logs), in binary.
     std::unordered_set<std::string> stats_access_keys_;
 
@@ -219,9 +350,20 @@ class OMQ {
     void connect_oxend(const oxenmq::address& oxend_rpc);
 
   public:
+    static constexpr auto DEFAULT_NOTIFY_BATCH_WINDOW = 100ms;
+    static constexpr size_t DEFAULT_NOTIFY_BATCH_MAX_SIZE = 256 * 1024;
+    // Maximum number of requests in one sn.storage_cc_batch; we send a batch early once it has
+    // this many.
+    static constexpr size_t FORWARD_BATCH_MAX = 100;
+
     OMQ(const snode::sn_record& me,
         const crypto::x25519_seckey& privkey,
-        const std::vector<crypto::x25519_pubkey>& stats_access_keys_hex);
+        const std::vector<crypto::x25519_pubkey>& stats_access_keys_hex,
+        std::chrono::milliseconds notify_batch_window = DEFAULT_NOTIFY_BATCH_WINDOW,
+        size_t notify_batch_max_size = DEFAULT_NOTIFY_BATCH_MAX_SIZE,
+        std::chrono::milliseconds forward_batch_window = 0ms,
+        const worker_config& workers = {},
+        util::compression_config compression = {});
 
     // Initialize oxenmq; return a future that completes once we have connected to and
     // initialized from oxend.
@@ -235,6 +377,20 @@ class OMQ {
     oxenmq::OxenMQ& operator*() { return omq_; }
     oxenmq::OxenMQ* operator->() { return &omq_; }
 
+    const worker_config& workers() const { return workers_; }
+
+    LoadShedder& load_shedder() { return load_shedder_; }
+    const LoadShedder& load_shedder() const { return load_shedder_; }
+
+    // Estimated memory (in bytes) held by the request-handling state we keep; see util::memory_of.
+    struct memory_usage {
+        size_t monitors = 0;          // Monitor subscriptions
+        size_t retrieve_waiters = 0;  // Long-polling retrieves
+        size_t forward_batches = 0;   // Forwarded client requests waiting to be batched
+        size_t rate_limiter = 0;      // Rate limiting buckets
+    };
+    memory_usage get_memory_usage();
+
     // Returns the OMQ ConnectionID for the connection to oxend.
     const oxenmq::ConnectionID& oxend_conn() const { return oxend_conn_; }
 
@@ -262,8 +418,55 @@ class OMQ {
     static std::pair<std::string_view, rpc::OnionRequestMetadata> decode_onion_data(
             std::string_view data);
 
-    // Called during message submission to send notifications to anyone subscribed to them.
-    void send_notifies(message msg);
+    // Forwards a recursive client request to a swarm peer, calling `cb` with whether we got a
+    // reply and the reply parts (as for a `sn.storage_cc` request).  If forward batching is
+    // enabled the request is held for up to the batch window so that it can go out with any other
+    // requests for the same peer as a single `sn.storage_cc_batch` request.  `body` only needs to
+    // stay valid during the call, so the same encoded request can be forwarded to every peer.
+    void forward_client_request(
+            const crypto::x25519_pubkey& peer,
+            std::string_view method,
+            std::string_view body,
+            std::function<void(bool success, std::vector<std::string> parts)> cb);
+
+    // Encodes and decodes the reply to a sn.storage_cc_batch: a bt-encoded list containing, for
+    // each request of the batch, the list of reply parts sn.storage_cc would have replied with.
+    // decode_batch_replies throws if the data isn't validly encoded.
+    static std::string encode_batch_replies(const std::vector<std::vector<std::string>>& replies);
+    static std::vector<std::vector<std::string>> decode_batch_replies(std::string_view data);
+
+    // Called during message submission to send notifications to anyone subscribed to them.  This
+    // only looks up the subscribers; the notifications themselves are built and sent from the
+    // notify queue.
+    void send_notifies(shared_message msg);
+
+    // Parks a long-polling retrieve that found no messages until a new message is stored for the
+    // account in namespace `ns` or `wait` passes (clamped to RetrieveWaiters::MAX_WAIT), then
+    // calls `resume` (once, from a worker thread), unless unpark_retrieve() gets called first.
+    // Returns nullopt, without parking it, if too many retrieves are already waiting.
+    std::optional<RetrieveWaiters::waiter_id> park_retrieve(
+            const user_pubkey_t& pubkey,
+            namespace_id ns,
+            std::chrono::milliseconds wait,
+            std::function<void()> resume);
+
+    // Removes a retrieve parked by park_retrieve that got answered some other way, freeing up its
+    // place among the account's (and the server's) waiting retrieves.
+    void unpark_retrieve(const user_pubkey_t& pubkey, RetrieveWaiters::waiter_id id);
+
+  private:
+    // Encodes and sends (or batches) the notifications for `msg`; called from the notify queue.
+    void send_notifies(const message& msg, const std::vector<MonitorIndex::subscriber>& subs);
+
+    // Appends an encoded notification to the connection's batch, sending the batch first if
+    // this notification would take it past the size limit.
+    void queue_notify_batch(const oxenmq::ConnectionID& conn, std::string_view notification);
+
+    // Sends a batch (if non-empty) and resets it.
+    void send_notify_batch(notify_batch& batch);
+
+    // Sends all pending batches; called (via the notify queue) every batch window.
+    void flush_notify_batches();
 };
 
 }  // namespace oxen::server
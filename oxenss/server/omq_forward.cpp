@@ -0,0 +1,184 @@
+#include "omq.h"
+#include "utils.h"
+#include <oxenss/logging/oxen_logger.h>
+
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <oxenc/bt_serialize.h>
+#include <oxenc/hex.h>
+
+namespace oxen::server {
+
+using namespace std::literals;
+
+static auto logcat = log::Cat("server");
+
+std::string OMQ::encode_batch_replies(const std::vector<std::vector<std::string>>& replies) {
+    std::string out = "l";
+    for (const auto& parts : replies) {
+        out += 'l';
+        for (const auto& part : parts)
+            bt_append_string(out, part);
+        out += 'e';
+    }
+    out += 'e';
+    return out;
+}
+
+std::vector<std::vector<std::string>> OMQ::decode_batch_replies(std::string_view data) {
+    std::vector<std::vector<std::string>> replies;
+    oxenc::bt_list_consumer list{data};
+    while (!list.is_finished()) {
+        auto parts = list.consume_list_consumer();
+        auto& reply = replies.emplace_back();
+        while (!parts.is_finished())
+            reply.push_back(parts.consume_string());
+    }
+    return replies;
+}
+
+void OMQ::forward_client_request(
+        const crypto::x25519_pubkey& peer,
+        std::string_view method,
+        std::string_view body,
+        std::function<void(bool success, std::vector<std::string> parts)> cb) {
+    if (forward_batch_window_ == 0ms) {
+        omq_.request(
+                peer.view(),
+                "sn.storage_cc",
+                std::move(cb),
+                method,
+                body,
+                oxenmq::send_option::request_timeout{5s});
+        return;
+    }
+
+    std::lock_guard lock{forward_mutex_};
+    auto& batch = forward_batches_[std::string{peer.view()}];
+    if (batch.data.empty())
+        batch.data = "l";
+    batch.data += 'l';
+    bt_append_string(batch.data, method);
+    bt_append_string(batch.data, body);
+    batch.data += 'e';
+    batch.callbacks.push_back(std::move(cb));
+    if (batch.callbacks.size() >= FORWARD_BATCH_MAX)
+        send_forward_batch(std::string{peer.view()}, batch);
+}
+
+void OMQ::send_forward_batch(const std::string& peer, forward_batch& batch) {
+    batch.data += 'e';
+    log::debug(
+            logcat,
+            "Forwarding batch of {} client requests to {}",
+            batch.callbacks.size(),
+            oxenc::to_hex(peer));
+    omq_.request(
+            peer,
+            "sn.storage_cc_batch",
+            [callbacks = std::move(batch.callbacks)](bool success, std::vector<std::string> data) {
+                std::vector<std::vector<std::string>> replies;
+                if (success && data.size() == 1) {
+                    try {
+                        replies = decode_batch_replies(data[0]);
+                    } catch (const std::exception& e) {
+                        log::warning(logcat, "Invalid sn.storage_cc_batch reply: {}", e.what());
+                    }
+                } else if (success) {
+                    // A failure of the batch as a whole (e.g. a [CODE, REASON] reply): pass it on
+                    // to every request in the batch.
+                    replies.assign(callbacks.size(), std::move(data));
+                }
+                if (success && replies.size() != callbacks.size())
+                    log::warning(
+                            logcat,
+                            "sn.storage_cc_batch reply has {} replies for {} requests",
+                            replies.size(),
+                            callbacks.size());
+                for (size_t i = 0; i < callbacks.size(); i++) {
+                    if (i < replies.size())
+                        callbacks[i](true, std::move(replies[i]));
+                    else if (success)
+                        // A reply we can't make sense of: give back no parts, which gets reported
+                        // as a bad peer response.
+                        callbacks[i](true, {});
+                    else
+                        callbacks[i](false, {});
+                }
+            },
+            std::move(batch.data),
+            oxenmq::send_option::request_timeout{5s});
+    batch = {};
+}
+
+void OMQ::flush_forward_batches() {
+    std::lock_guard lock{forward_mutex_};
+    for (auto& [peer, batch] : forward_batches_)
+        if (!batch.callbacks.empty())
+            send_forward_batch(peer, batch);
+    // Start afresh each window so that we don't accumulate batches for peers that have left our
+    // swarm.
+    forward_batches_.clear();
+}
+
+void OMQ::handle_client_request_batch(oxenmq::Message& message) {
+    if (message.data.size() != 1) {
+        log::warning(
+                logcat,
+                "Invalid forwarded client request batch: incorrect number of message parts ({})",
+                message.data.size());
+        return message.send_reply(
+                std::to_string(http::BAD_REQUEST.first),
+                "Invalid request: expected 1 message part");
+    }
+
+    std::vector<std::pair<std::string_view, std::string_view>> requests;
+    try {
+        oxenc::bt_list_consumer list{message.data[0]};
+        while (!list.is_finished()) {
+            auto req = list.consume_list_consumer();
+            auto& [method, body] = requests.emplace_back();
+            method = req.consume_string_view();
+            body = req.consume_string_view();
+            if (!req.is_finished())
+                throw std::runtime_error{"expected [METHOD, BODY]"};
+        }
+    } catch (const std::exception& e) {
+        log::warning(logcat, "Invalid forwarded client request batch: {}", e.what());
+        return message.send_reply(
+                std::to_string(http::BAD_REQUEST.first), "Invalid request: "s + e.what());
+    }
+    if (requests.empty())
+        return message.send_reply(encode_batch_replies({}));
+
+    // Each request's reply goes into its own slot; whichever request finishes last sends back the
+    // whole lot.
+    struct batch_replies {
+        std::vector<std::vector<std::string>> replies;
+        std::atomic<size_t> pending;
+        std::optional<oxenmq::Message::DeferredSend> send;
+    };
+    auto batch = std::make_shared<batch_replies>();
+    batch->replies.resize(requests.size());
+    batch->pending = requests.size();
+    batch->send.emplace(message.send_later());
+
+    log::debug(logcat, "Handling batch of {} forwarded client requests", requests.size());
+    for (size_t i = 0; i < requests.size(); i++) {
+        run_client_request(
+                requests[i].first,
+                requests[i].second,
+                true,
+                [batch, i](std::string_view code, std::string_view body) {
+                    auto& reply = batch->replies[i];
+                    if (!code.empty())
+                        reply.emplace_back(code);
+                    reply.emplace_back(body);
+                    if (batch->pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                        batch->send->reply(encode_batch_replies(batch->replies));
+                });
+    }
+}
+
+}  // namespace oxen::server
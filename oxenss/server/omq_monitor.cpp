@@ -1,17 +1,23 @@
 #include "omq.h"
 #include "../common/namespace.h"
 #include "../rpc/client_rpc_endpoints.h"
+#include "../rpc/request_handler.h"
 #include "../utils/time.hpp"
 
+#include <algorithm>
 #include <chrono>
+#include <cstring>
+#include <memory>
+#include <optional>
 #include <oxen/log.hpp>
-#include <tuple>
 #include <type_traits>
 #include <utility>
 #include <oxenc/bt_producer.h>
 #include <oxenc/hex.h>
+#include <sodium/crypto_generichash.h>
 #include <sodium/crypto_sign.h>
 #include <sodium/crypto_sign_ed25519.h>
+#include <sodium/randombytes.h>
 
 namespace oxen::server {
 
@@ -35,15 +41,43 @@ namespace {
         out.append("error", std::move(message));
     }
 
-    // {pubkey (bytes), pubkey (hex), namespaces, want_data}
-    using sub_info = std::tuple<std::string, std::string, std::vector<namespace_id>, bool>;
+    // Subscription lists at least this long have their signatures verified in parallel, in jobs
+    // of VERIFY_CHUNK entries, rather than one after another on the monitor thread.
+    constexpr size_t PARALLEL_VERIFY_MIN = 32;
+    constexpr size_t VERIFY_CHUNK = 16;
+
+    // One entry of a monitor.messages request, as it goes through parsing, renewal and signature
+    // verification.
+    struct sub_request {
+        // Set if the entry failed; the remaining fields are only meaningful if this isn't set.
+        std::optional<std::pair<MonitorResponse, std::string>> error;
+
+        std::string pubkey;  // 33-byte account pubkey
+        std::string pubkey_hex;
+        std::array<unsigned char, 32> ed_pk;
+        std::optional<std::array<unsigned char, 32>> subkey_tag;
+        std::array<unsigned char, 64> signature;
+        std::chrono::seconds timestamp;
+        std::vector<namespace_id> namespaces;
+        bool want_data = false;
+        bool batch = false;
+
+        MonitorIndex::auth_digest auth;  // Digest of the encoded request entry
+        bool renewed = false;            // Renewed an existing subscription without verification
+        bool verified = false;           // Signature verified; ready to subscribe
+
+        void fail(MonitorResponse r, std::string message) {
+            error.emplace(r, std::move(message));
+        }
+    };
 
-    void handle_monitor_message_single(
-            oxenc::bt_dict_consumer d, oxenc::bt_dict_producer& out, std::vector<sub_info>& subs) {
+    // Parses (and checks everything short of the signature of) one subscription entry.
+    void parse_monitor_request(oxenc::bt_dict_consumer d, sub_request& req) {
 
         // Values we receive, in bt-dict order:
         std::string_view ed_pk;       // P
         std::string_view subkey_tag;  // S
+        bool batch = false;           // b
         bool want_data = false;       // d
         using namespace_int = std::underlying_type_t<namespace_id>;
         std::vector<namespace_id> namespaces;  // n
@@ -56,8 +90,7 @@ namespace {
             if (d.skip_until("P")) {
                 ed_pk = d.consume_string_view();
                 if (ed_pk.size() != 32)
-                    return monitor_error(
-                            out,
+                    return req.fail(
                             MonitorResponse::BAD_PUBKEY,
                             "Provided P= Session Ed25519 pubkey must be 32 bytes");
             }
@@ -66,12 +99,14 @@ namespace {
             if (d.skip_until("S")) {
                 subkey_tag = d.consume_string_view();
                 if (subkey_tag.size() != 32)
-                    return monitor_error(
-                            out,
-                            MonitorResponse::BAD_PUBKEY,
-                            "Provided S= subkey tag must be 32 bytes");
+                    return req.fail(
+                            MonitorResponse::BAD_PUBKEY, "Provided S= subkey tag must be 32 bytes");
             }
 
+            // Batch notifications into notify.messages (optional)
+            if (d.skip_until("b"))
+                batch = d.consume_integer<bool>();
+
             // Send full data (optional)
             if (d.skip_until("d"))
                 want_data = d.consume_integer<bool>();
@@ -86,8 +121,7 @@ namespace {
                     if (nsi > namespaces.back())
                         namespaces.push_back(nsi);
                     else
-                        return monitor_error(
-                                out,
+                        return req.fail(
                                 MonitorResponse::BAD_NS,
                                 "Invalid n= namespace list: namespaces must be ascending");
                 }
@@ -100,10 +134,8 @@ namespace {
                     throw std::runtime_error{"Cannot provide both p= and P= pubkey values"};
                 pubkey = d.consume_string();
                 if (pubkey.size() != 33)
-                    monitor_error(
-                            out,
-                            MonitorResponse::BAD_PUBKEY,
-                            "Provided p= pubkey must be 33 bytes");
+                    return req.fail(
+                            MonitorResponse::BAD_PUBKEY, "Provided p= pubkey must be 33 bytes");
             } else if (ed_pk.empty()) {
                 throw std::runtime_error{"Either p= or P= must be given"};
             }
@@ -112,16 +144,14 @@ namespace {
                 throw std::runtime_error{"required signature is missing"};
             signature = d.consume_string_view();
             if (signature.size() != 64)
-                return monitor_error(
-                        out, MonitorResponse::BAD_SIG, "Provided s= signature must be 64 bytes");
+                return req.fail(MonitorResponse::BAD_SIG, "Provided s= signature must be 64 bytes");
 
             if (!d.skip_until("t"))
                 throw std::runtime_error{"required signature timestamp is missing"};
             timestamp = std::chrono::seconds{d.consume_integer<int64_t>()};
 
         } catch (const std::exception& ex) {
-            return monitor_error(
-                    out,
+            return req.fail(
                     MonitorResponse::BAD_ARGS,
                     fmt::format("Invalid arguments: invalid {}= value: {}", d.key(), ex.what()));
         }
@@ -130,8 +160,7 @@ namespace {
         auto now = std::chrono::system_clock::now();
         auto ts = std::chrono::system_clock::time_point(timestamp);
         if (bool too_old = ts < now - 14 * 24h; too_old || ts > now + 24h) {
-            return monitor_error(
-                    out,
+            return req.fail(
                     MonitorResponse::BAD_TS,
                     "Invalid t= signature timestamp: timestamp is "s +
                             (too_old ? "too old" : "in the future"));
@@ -145,94 +174,82 @@ namespace {
                         reinterpret_cast<unsigned char*>(pubkey.data() + 1),
                         reinterpret_cast<const unsigned char*>(ed_pk.data()));
                 rc != 0)
-                return monitor_error(
-                        out, MonitorResponse::BAD_PUBKEY, "Invalid P= ed25519 public key");
+                return req.fail(MonitorResponse::BAD_PUBKEY, "Invalid P= ed25519 public key");
         } else {
             // No Session Ed25519, so assume the pubkey (without prefix byte) is Ed25519
             ed_pk = pubkey;
             ed_pk.remove_prefix(1);
         }
 
-        std::string_view verify_key = ed_pk;
-        std::array<unsigned char, 32> subkey_pub;
-        if (!subkey_tag.empty()) {
+        std::memcpy(req.ed_pk.data(), ed_pk.data(), req.ed_pk.size());
+        if (!subkey_tag.empty())
+            std::memcpy(req.subkey_tag.emplace().data(), subkey_tag.data(), 32);
+        std::memcpy(req.signature.data(), signature.data(), req.signature.size());
+        req.pubkey_hex = oxenc::to_hex(pubkey);
+        req.pubkey = std::move(pubkey);
+        req.timestamp = timestamp;
+        req.namespaces = std::move(namespaces);
+        req.want_data = want_data;
+        req.batch = batch;
+    }
+
+    // Computes the digest that lets a renewal with the very same (already verified) request
+    // entry skip signature verification.  The digest is keyed with a per-process random key so
+    // that nobody can search for a colliding entry offline.
+    MonitorIndex::auth_digest entry_digest(std::string_view entry) {
+        static const auto key = [] {
+            std::array<unsigned char, crypto_generichash_KEYBYTES> k;
+            randombytes_buf(k.data(), k.size());
+            return k;
+        }();
+        MonitorIndex::auth_digest digest;
+        crypto_generichash(
+                digest.data(),
+                digest.size(),
+                reinterpret_cast<const unsigned char*>(entry.data()),
+                entry.size(),
+                key.data(),
+                key.size());
+        return digest;
+    }
+
+    // Checks the signature of a parsed entry, setting either `verified` or the error.
+    void verify_monitor_request(sub_request& req) {
+        std::array<unsigned char, 32> verify_key = req.ed_pk;
+        if (req.subkey_tag) {
             try {
-                subkey_pub = crypto::subkey_verify_key(ed_pk, subkey_tag);
+                verify_key =
+                        crypto::cached_subkey_verify_key(req.ed_pk.data(), req.subkey_tag->data());
             } catch (const std::invalid_argument& ex) {
                 auto m = fmt::format("Signature verification failed: {}", ex.what());
                 log::warning(logcat, "{}", m);
-                return monitor_error(out, MonitorResponse::BAD_SIG, m);
+                return req.fail(MonitorResponse::BAD_SIG, m);
             }
-            verify_key = std::string_view{
-                    reinterpret_cast<const char*>(subkey_pub.data()), subkey_pub.size()};
         }
-        assert(verify_key.size() == 32);
-
-        auto pubkey_hex = oxenc::to_hex(pubkey);
 
         auto sig_msg = fmt::format(
                 "MONITOR{:s}{:d}{:d}{}",
-                pubkey_hex,
-                timestamp.count(),
-                want_data,
-                fmt::join(namespaces, ","));
+                req.pubkey_hex,
+                req.timestamp.count(),
+                req.want_data,
+                fmt::join(req.namespaces, ","));
 
         if (0 != crypto_sign_verify_detached(
-                         reinterpret_cast<const unsigned char*>(signature.data()),
+                         req.signature.data(),
                          reinterpret_cast<const unsigned char*>(sig_msg.data()),
                          sig_msg.size(),
-                         reinterpret_cast<const unsigned char*>(verify_key.data()))) {
+                         verify_key.data())) {
             log::debug(logcat, "monitor.messages signature verification failed");
-            return monitor_error(out, MonitorResponse::BAD_SIG, "Signature verification failed");
+            return req.fail(MonitorResponse::BAD_SIG, "Signature verification failed");
         }
-
-        subs.emplace_back(
-                std::move(pubkey), std::move(pubkey_hex), std::move(namespaces), want_data);
-        out.append("success", 1);
+        req.verified = true;
     }
 
-    // Merges sorted vectors a and b together, returns the sorted, combined vector (but without any
-    // duplicates).  We avoid reallocating the vectors when possible (i.e. if either is a subset of
-    // the other).
-    std::vector<namespace_id> merge_namespaces(
-            std::vector<namespace_id> a, std::vector<namespace_id> b) {
-        // If the first arg of b comes before a, then our only subset case can be b as a superset of
-        // a, so swap arguments so that the subset case always involves `a` as the superset.
-        if (!b.empty() && (a.empty() || b.front() < a.front()))
-            a.swap(b);
-        // Figure out if a is a superset of b (in which case we can just return a):
-        auto ita = a.begin(), itb = b.begin();
-        while (ita != a.end() && itb != b.end()) {
-            if (*itb > *ita)
-                ita++;  // We have an element only in a, which is fine, skip it
-            else if (*itb == *ita) {
-                ita++;  // The element is in both, which is fine.
-                itb++;
-            } else
-                break;  // We found a b that isn't in a, so we don't have a subset.
-        }
-        if (itb == b.end())
-            return a;  // We hit the end of b without any violations above, which means everything
-                       // in b is already in a.
-
-        // Otherwise we need to merge them into a new sorted container c:
-        std::vector<namespace_id> c;
-        ita = a.begin();
-        itb = b.begin();
-        while (ita != a.end() || itb != b.end()) {
-            if (itb == b.end())
-                c.push_back(*ita++);
-            else if (ita == a.end())
-                c.push_back(*itb++);
-            else if (*ita < *itb)
-                c.push_back(*ita++);
-            else if (*ita == *itb) {
-                c.push_back(*ita++);
-                itb++;  // Value is in both vectors, but we only want it once
-            } else
-                c.push_back(*itb++);
-        }
-        return c;
+    void write_result(oxenc::bt_dict_producer& out, const sub_request& req) {
+        if (req.error)
+            monitor_error(out, req.error->first, req.error->second);
+        else
+            out.append("success", 1);
     }
 
 }  // namespace
@@ -249,25 +266,27 @@ void OMQ::handle_monitor_messages(oxenmq::Message& message) {
         return;
     }
     const auto& m = message.data[0];
-
-    std::string result;
-    std::vector<sub_info> subs;
+    const bool is_list = m.front() == 'l';
+
+    auto reqs = std::make_shared<std::vector<sub_request>>();
+    auto parse = [&](std::string_view entry) {
+        auto& req = reqs->emplace_back();
+        parse_monitor_request(oxenc::bt_dict_consumer{entry}, req);
+        if (req.error)
+            return;
+        // Push servers re-send the same signed entries to keep their subscriptions alive; if this
+        // one is byte-for-byte what authorized the subscription last time then all it needs is
+        // its expiry bumped.
+        req.auth = entry_digest(entry);
+        req.renewed = monitors_.renew(MonitorIndex::make_key(req.pubkey), message.conn, req.auth);
+    };
     try {
-        if (m.front() == 'd') {
-            result.resize(256);
-            oxenc::bt_dict_producer out{result.data(), result.size()};
-            handle_monitor_message_single(oxenc::bt_dict_consumer{m}, out, subs);
-            result.resize(out.view().size());
+        if (!is_list) {
+            parse(m);
         } else {
-            result += 'l';
             oxenc::bt_list_consumer l{m};
-            std::array<char, 256> buf;
-            while (!l.is_finished()) {
-                oxenc::bt_dict_producer out{buf.data(), buf.size()};
-                handle_monitor_message_single(l.consume_dict_consumer(), out, subs);
-                result.append(out.view());
-            }
-            result += 'e';
+            while (!l.is_finished())
+                parse(l.consume_dict_data());
         }
     } catch (const std::exception& e) {
         message.send_reply(oxenc::bt_serialize(oxenc::bt_dict{
@@ -276,40 +295,78 @@ void OMQ::handle_monitor_messages(oxenmq::Message& message) {
         return;
     }
 
-    if (!subs.empty()) {
-        std::unique_lock lock{monitoring_mutex_};
-        for (auto& [pubkey, pubkey_hex, namespaces, want_data] : subs) {
-            bool found = false;
-            for (auto [it, end] = monitoring_.equal_range(pubkey); it != end; ++it) {
-                auto& mon_data = it->second;
-                if (mon_data.push_conn == message.conn) {
-                    mon_data.namespaces =
-                            merge_namespaces(std::move(mon_data.namespaces), std::move(namespaces));
-                    log::debug(
-                            logcat,
-                            "monitor.messages sub renewed for {} monitoring namespace(s) {}",
-                            pubkey_hex,
-                            fmt::join(mon_data.namespaces, ", "));
-                    mon_data.reset_expiry();
-                    mon_data.want_data |= want_data;
-                    found = true;
-                    break;
-                }
-            }
-            if (!found) {
+    std::vector<sub_request*> unverified;
+    for (auto& req : *reqs)
+        if (!req.error && !req.renewed)
+            unverified.push_back(&req);
+
+    auto captured = request_handler_ ? request_handler_->capture().sample("monitor", "omq")
+                                     : nullptr;
+    if (captured) {
+        captured->entry["size"] = reqs->size();
+        captured->entry["renewed"] = std::count_if(
+                reqs->begin(), reqs->end(), [](const auto& r) { return r.renewed; });
+    }
+
+    auto finish = [this, reqs, is_list, conn = message.conn, captured](auto&& reply) {
+        std::string result;
+        if (is_list)
+            result += 'l';
+        std::array<char, 256> buf;
+        for (auto& req : *reqs) {
+            if (req.verified) {
+                bool renewed = monitors_.subscribe(
+                        MonitorIndex::make_key(req.pubkey),
+                        req.namespaces,
+                        conn,
+                        req.want_data,
+                        req.batch,
+                        std::chrono::steady_clock::now(),
+                        MonitorIndex::DEFAULT_TTL,
+                        req.auth);
                 log::debug(
                         logcat,
-                        "monitor.messages new subscription for {} monitoring namespace(s) {}",
-                        pubkey_hex,
-                        fmt::join(namespaces, ", "));
-                monitoring_.emplace(
-                        std::piecewise_construct,
-                        std::forward_as_tuple(std::move(pubkey)),
-                        std::forward_as_tuple(std::move(namespaces), message.conn, want_data));
+                        "monitor.messages {} for {} monitoring namespace(s) {}",
+                        renewed ? "sub renewed" : "new subscription",
+                        req.pubkey_hex,
+                        fmt::join(req.namespaces, ", "));
+            } else if (req.renewed) {
+                log::trace(logcat, "monitor.messages sub renewed for {}", req.pubkey_hex);
             }
+            oxenc::bt_dict_producer out{buf.data(), buf.size()};
+            write_result(out, req);
+            result.append(out.view());
         }
+        if (is_list)
+            result += 'e';
+        if (captured)
+            request_handler_->capture().finish(*captured, 200, std::string_view{result});
+        reply(std::move(result));
+    };
+
+    if (unverified.size() < PARALLEL_VERIFY_MIN) {
+        for (auto* req : unverified)
+            verify_monitor_request(*req);
+        return finish([&message](std::string result) { message.send_reply(result); });
     }
-    message.send_reply(result);
+
+    oxenmq::Batch<void> batch;
+    batch.reserve((unverified.size() + VERIFY_CHUNK - 1) / VERIFY_CHUNK);
+    for (size_t i = 0; i < unverified.size(); i += VERIFY_CHUNK) {
+        batch.add_job([this,
+                       reqs,
+                       chunk = std::vector<sub_request*>(
+                               unverified.begin() + i,
+                               unverified.begin() + std::min(i + VERIFY_CHUNK, unverified.size()))] {
+            workers_.monitor_cpus.apply();
+            for (auto* req : chunk)
+                verify_monitor_request(*req);
+        });
+    }
+    batch.completion([finish = std::move(finish), send = message.send_later()](auto&&) {
+        finish([&send](std::string result) { send.reply(result); });
+    });
+    omq_.batch(std::move(batch));
 }
 
 static void write_metadata(
@@ -321,23 +378,55 @@ static void write_metadata(
     d.append("z", to_epoch_ms(msg.expiry));
 }
 
-void OMQ::send_notifies(message msg) {
-    auto pubkey = msg.pubkey.prefixed_raw();
-    auto now = std::chrono::steady_clock::now();
-    std::vector<oxenmq::ConnectionID> relay_to, relay_to_with_data;
-    {
-        std::shared_lock lock{monitoring_mutex_};
-        for (auto [it, end] = monitoring_.equal_range(pubkey); it != end; ++it) {
-            const auto& mon_data = it->second;
-            if (mon_data.expiry >= now &&
-                std::binary_search(
-                        mon_data.namespaces.begin(), mon_data.namespaces.end(), msg.msg_namespace))
-                (mon_data.want_data ? relay_to_with_data : relay_to).push_back(mon_data.push_conn);
-        }
-    }
+void OMQ::send_notifies(shared_message msg) {
+    auto pubkey = msg->pubkey.prefixed_raw();
+    if (pubkey.size() != USER_PUBKEY_SIZE_BYTES)
+        return;
+
+    std::vector<RetrieveWaiters::callback> woken;
+    retrieve_waiters_.wake(RetrieveWaiters::make_key(pubkey), msg->msg_namespace, woken);
+    resume_retrieves(std::move(woken));
+
+    std::vector<MonitorIndex::subscriber> subs;
+    monitors_.find(MonitorIndex::make_key(pubkey), msg->msg_namespace, subs);
+    if (subs.empty())
+        return;
+
+    bool queued = notify_queue_.submit(
+            [this, msg = std::move(msg), subs = std::move(subs)] { send_notifies(*msg, subs); });
+    if (!queued)
+        log::warning(logcat, "Notification queue is full; dropping new message notifications");
+}
+
+std::optional<RetrieveWaiters::waiter_id> OMQ::park_retrieve(
+        const user_pubkey_t& pubkey,
+        namespace_id ns,
+        std::chrono::milliseconds wait,
+        std::function<void()> resume) {
+    auto pk = pubkey.prefixed_raw();
+    if (pk.size() != USER_PUBKEY_SIZE_BYTES)
+        return std::nullopt;
+    return retrieve_waiters_.add(RetrieveWaiters::make_key(pk), ns, wait, std::move(resume));
+}
+
+void OMQ::unpark_retrieve(const user_pubkey_t& pubkey, RetrieveWaiters::waiter_id id) {
+    auto pk = pubkey.prefixed_raw();
+    if (pk.size() == USER_PUBKEY_SIZE_BYTES)
+        retrieve_waiters_.cancel(RetrieveWaiters::make_key(pk), id);
+}
 
-    if (relay_to.empty() && relay_to_with_data.empty())
+void OMQ::resume_retrieves(std::vector<RetrieveWaiters::callback>&& resumes) {
+    if (resumes.empty())
         return;
+    log::trace(logcat, "Resuming {} waiting retrieve(s)", resumes.size());
+    // Each resumed retrieve goes back to the database, so we spread them over the worker threads
+    // rather than running them all here (which is either the storing thread or the timer).
+    for (auto& resume : resumes)
+        omq_.job(std::move(resume));
+}
+
+void OMQ::send_notifies(const message& msg, const std::vector<MonitorIndex::subscriber>& subs) {
+    auto pubkey = msg.pubkey.prefixed_raw();
 
     // We output a dict with keys (in order):
     // - @ pubkey
@@ -354,34 +443,62 @@ void OMQ::send_notifies(message msg) {
                                    + 3 + 16  // 1:z and i1658784776010e plus a byte to grow
                                    + 10;     // safety margin
 
-    std::string data;
-    if (!relay_to_with_data.empty())
-        data.resize(
-                metadata_size  // all the metadata above
-                + 3            // 1:~
-                + 8            // 76800: plus a couple bytes to grow
-                + msg.data.size());
-    else
-        data.resize(metadata_size);
-
-    if (!relay_to.empty()) {
-        oxenc::bt_dict_producer d{data.data(), data.size()};
-        write_metadata(d, pubkey, msg);
-        data.resize(d.view().size());
-
-        for (const auto& conn : relay_to)
-            omq_.send(conn, "notify.message", data);
+    // Encoded lazily, for whichever of them the subscribers need:
+    std::string metadata, with_data;
+    auto notification = [&](bool want_data) -> const std::string& {
+        auto& data = want_data ? with_data : metadata;
+        if (data.empty()) {
+            size_t size = metadata_size;  // all the metadata above
+            if (want_data)
+                size += 3    // 1:~
+                      + 8    // 76800: plus a couple bytes to grow
+                      + msg.data.size();
+            data.resize(size);
+            oxenc::bt_dict_producer d{data.data(), data.size()};
+            write_metadata(d, pubkey, msg);
+            if (want_data)
+                d.append("~", msg.data);
+            data.resize(d.view().size());
+        }
+        return data;
+    };
+
+    for (const auto& s : subs) {
+        if (s.batch)
+            queue_notify_batch(s.conn, notification(s.want_data));
+        else
+            omq_.send(s.conn, "notify.message", notification(s.want_data));
     }
+}
 
-    if (!relay_to_with_data.empty()) {
-        oxenc::bt_dict_producer d{data.data(), data.size()};
-        write_metadata(d, pubkey, msg);
-        d.append("~", msg.data);
-        data.resize(d.view().size());
+void OMQ::queue_notify_batch(const oxenmq::ConnectionID& conn, std::string_view notification) {
+    auto it = std::find_if(notify_batches_.begin(), notify_batches_.end(), [&conn](auto& b) {
+        return b.conn == conn;
+    });
+    if (it == notify_batches_.end())
+        it = notify_batches_.insert(it, notify_batch{conn, "l"});
+    else if (it->data.size() + notification.size() + 1 > notify_batch_max_size_)
+        send_notify_batch(*it);
+
+    it->data += notification;
+    if (it->data.size() + 1 >= notify_batch_max_size_)
+        send_notify_batch(*it);
+}
 
-        for (const auto& conn : relay_to_with_data)
-            omq_.send(conn, "notify.message", data);
-    }
+void OMQ::send_notify_batch(notify_batch& batch) {
+    if (batch.data.size() <= 1)
+        return;
+    batch.data += 'e';
+    omq_.send(batch.conn, "notify.messages", batch.data);
+    batch.data = "l";
+}
+
+void OMQ::flush_notify_batches() {
+    for (auto& b : notify_batches_)
+        send_notify_batch(b);
+    // Start afresh each window so that we don't accumulate batches for connections that have
+    // gone away.
+    notify_batches_.clear();
 }
 
 }  // namespace oxen::server
@@ -0,0 +1,129 @@
+#include "retrieve_waiters.h"
+#include "../utils/memory.hpp"
+
+#include <algorithm>
+
+namespace oxen::server {
+
+std::optional<RetrieveWaiters::waiter_id> RetrieveWaiters::add(
+        const account_key& account,
+        namespace_id ns,
+        std::chrono::milliseconds wait,
+        callback resume,
+        std::chrono::steady_clock::time_point now) {
+    auto deadline = now + std::min<std::chrono::milliseconds>(wait, MAX_WAIT);
+
+    std::lock_guard lock{mutex_};
+    if (count_ >= max_waiters_)
+        return std::nullopt;
+    if (next_tick_ == INT64_MIN)
+        next_tick_ = tick_of(now);
+    // `now` can be behind an expire() that got the lock first: a tick it has already gone past
+    // would only get visited again a full turn of the wheel later.
+    auto tick = std::max(tick_of(deadline), next_tick_);
+
+    auto& waiters = accounts_[account];
+    if (waiters.size() >= max_per_account_)
+        return std::nullopt;
+    auto id = next_id_++;
+    waiters.push_back(waiter{ns, deadline, tick, id, std::move(resume)});
+    count_++;
+    wheel_[static_cast<uint64_t>(tick) % WHEEL_SLOTS].push_back(account);
+    return id;
+}
+
+bool RetrieveWaiters::cancel(const account_key& account, waiter_id id) {
+    callback dropped;  // Destroyed (along with whatever it captured) after unlocking
+    std::lock_guard lock{mutex_};
+    auto it = accounts_.find(account);
+    if (it == accounts_.end())
+        return false;
+    auto& waiters = it->second;
+    auto w = std::find_if(
+            waiters.begin(), waiters.end(), [id](const waiter& w) { return w.id == id; });
+    if (w == waiters.end())
+        return false;
+    dropped = std::move(w->resume);
+    waiters.erase(w);
+    count_--;
+    // (As with wake(), the wheel entry gets cleaned up by expire())
+    if (waiters.empty())
+        accounts_.erase(it);
+    return true;
+}
+
+void RetrieveWaiters::wake(const account_key& account, namespace_id ns, std::vector<callback>& out) {
+    std::lock_guard lock{mutex_};
+    auto it = accounts_.find(account);
+    if (it == accounts_.end())
+        return;
+    auto& waiters = it->second;
+    auto woken = std::stable_partition(
+            waiters.begin(), waiters.end(), [ns](const waiter& w) { return w.ns != ns; });
+    for (auto w = woken; w != waiters.end(); ++w)
+        out.push_back(std::move(w->resume));
+    count_ -= waiters.end() - woken;
+    waiters.erase(woken, waiters.end());
+    // (We leave the account's wheel entries for expire() to clean up)
+    if (waiters.empty())
+        accounts_.erase(it);
+}
+
+void RetrieveWaiters::expire(std::vector<callback>& out, std::chrono::steady_clock::time_point now) {
+    auto cur = tick_of(now);
+
+    std::lock_guard lock{mutex_};
+    if (next_tick_ == INT64_MIN || next_tick_ >= cur)
+        return;
+    // If we've fallen more than a full turn of the wheel behind then every slot needs visiting
+    // exactly once:
+    next_tick_ = std::max<int64_t>(next_tick_, cur - static_cast<int64_t>(WHEEL_SLOTS));
+
+    for (; next_tick_ < cur; next_tick_++) {
+        auto slot = static_cast<uint64_t>(next_tick_) % WHEEL_SLOTS;
+        std::vector<account_key> keep;
+        for (const auto& key : wheel_[slot]) {
+            auto it = accounts_.find(key);
+            if (it == accounts_.end())
+                continue;
+            auto& waiters = it->second;
+            bool scheduled_here = false;
+            auto expired = std::stable_partition(
+                    waiters.begin(), waiters.end(), [&](const waiter& w) {
+                        if (w.deadline <= now)
+                            return false;
+                        // Still waiting, and due in a later turn of the wheel at this slot:
+                        if (w.wheel_tick >= cur &&
+                            static_cast<uint64_t>(w.wheel_tick) % WHEEL_SLOTS == slot)
+                            scheduled_here = true;
+                        return true;
+                    });
+            for (auto w = expired; w != waiters.end(); ++w)
+                out.push_back(std::move(w->resume));
+            count_ -= waiters.end() - expired;
+            waiters.erase(expired, waiters.end());
+            if (waiters.empty())
+                accounts_.erase(it);
+            if (scheduled_here)
+                keep.push_back(key);
+        }
+        wheel_[slot] = std::move(keep);
+    }
+}
+
+size_t RetrieveWaiters::size() const {
+    std::lock_guard lock{mutex_};
+    return count_;
+}
+
+size_t RetrieveWaiters::memory_usage() const {
+    std::lock_guard lock{mutex_};
+    size_t bytes = util::memory_of(accounts_);
+    for (const auto& [account, waiters] : accounts_)
+        bytes += util::memory_of(waiters);
+    for (const auto& slot : wheel_)
+        bytes += util::memory_of(slot);
+    return bytes;
+}
+
+}  // namespace oxen::server
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "../common/namespace.h"
+
+namespace oxen::server {
+
+using namespace std::literals;
+
+/// Retrieve requests that found nothing and are waiting for a new message to arrive in the
+/// account and namespace they retrieve from (or for their wait to time out): the server side of a
+/// long-polling retrieve.
+///
+/// Waiters are kept per account, keyed (like MonitorIndex subscriptions) by the 33-byte prefixed
+/// pubkey, so that storing a message finds the waiters to wake with one lookup.  Timeouts are
+/// tracked in a timer wheel of WHEEL_TICK slots so that expire() only has to visit the accounts
+/// with a waiter due to time out.
+///
+/// All methods are thread-safe.  Waiter callbacks are never invoked by this class: the methods that
+/// remove waiters hand back their callbacks for the caller to invoke (or dispatch) outside the
+/// lock.
+class RetrieveWaiters {
+  public:
+    using account_key = std::array<unsigned char, 33>;
+    using callback = std::function<void()>;
+    using waiter_id = uint64_t;
+
+    // Granularity and size of the timeout timer wheel.  Waits longer than the wheel covers are
+    // clamped to it.
+    static constexpr auto WHEEL_TICK = 100ms;
+    static constexpr size_t WHEEL_SLOTS = 512;
+    static constexpr auto MAX_WAIT = WHEEL_TICK * (WHEEL_SLOTS - 1);
+
+    // Default limit on the number of waiters of a single account; retrieves beyond it don't wait.
+    static constexpr size_t DEFAULT_MAX_PER_ACCOUNT = 16;
+
+    // Default limit on the number of waiters in total.
+    static constexpr size_t DEFAULT_MAX_WAITERS = 100'000;
+
+    explicit RetrieveWaiters(
+            size_t max_waiters = DEFAULT_MAX_WAITERS,
+            size_t max_per_account = DEFAULT_MAX_PER_ACCOUNT) :
+            max_waiters_{max_waiters}, max_per_account_{max_per_account} {}
+
+    // Returns the account key of a 33-byte prefixed pubkey; `pubkey` must be exactly 33 bytes.
+    static account_key make_key(std::string_view pubkey) {
+        account_key k;
+        std::memcpy(k.data(), pubkey.data(), k.size());
+        return k;
+    }
+
+    // Adds a waiter for a new message in namespace `ns` of `account`.  `resume` gets handed back
+    // (exactly once) by `wake()` when such a message arrives, or by `expire()` once `wait` has
+    // passed, unless it gets cancel()led first.  Returns an id for cancel(), or nullopt (without
+    // adding it) if the account or the server already has as many waiters as allowed, in which
+    // case the caller should answer the retrieve right away.
+    std::optional<waiter_id> add(
+            const account_key& account,
+            namespace_id ns,
+            std::chrono::milliseconds wait,
+            callback resume,
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+    // Removes a waiter of `account` that no longer needs to wait (e.g. because its retrieve got
+    // answered some other way) without handing back its callback.  Returns false if it isn't
+    // waiting any more.
+    bool cancel(const account_key& account, waiter_id id);
+
+    // Removes the waiters of `account` waiting on namespace `ns`, appending their callbacks to
+    // `out`.
+    void wake(const account_key& account, namespace_id ns, std::vector<callback>& out);
+
+    // Removes the waiters whose wait has passed, visiting only the timer wheel slots that have
+    // passed since the last call, and appends their callbacks to `out`.
+    void expire(
+            std::vector<callback>& out,
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+    // Returns the number of waiters.
+    size_t size() const;
+
+    // Returns an estimate of the memory (in bytes) held by the waiters, not counting what their
+    // callbacks have captured beyond what fits inside the callbacks themselves.
+    size_t memory_usage() const;
+
+  private:
+    struct waiter {
+        namespace_id ns;
+        std::chrono::steady_clock::time_point deadline;
+        int64_t wheel_tick;
+        waiter_id id;
+        callback resume;
+    };
+
+    struct key_hash {
+        size_t operator()(const account_key& k) const {
+            // Pubkeys are effectively random, so some bytes of the key itself (skipping the
+            // network prefix) make a perfectly good hash.
+            size_t h;
+            std::memcpy(&h, k.data() + 1, sizeof(h));
+            return h;
+        }
+    };
+
+    static int64_t tick_of(std::chrono::steady_clock::time_point t) {
+        return t.time_since_epoch() / WHEEL_TICK;
+    }
+
+    const size_t max_waiters_;
+    const size_t max_per_account_;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<account_key, std::vector<waiter>, key_hash> accounts_;
+    size_t count_ = 0;
+    waiter_id next_id_ = 0;
+
+    // Slot `t % WHEEL_SLOTS` holds the accounts with a waiter timing out during tick `t`.  An
+    // account can appear in a slot more than once, or for waiters that have since been woken;
+    // expire() checks the actual deadlines.
+    std::array<std::vector<account_key>, WHEEL_SLOTS> wheel_;
+    int64_t next_tick_ = INT64_MIN;  // The next wheel tick that expire() needs to process
+};
+
+}  // namespace oxen::server
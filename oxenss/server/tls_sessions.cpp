@@ -0,0 +1,189 @@
+#include "tls_sessions.h"
+
+extern "C" {
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+}
+
+#include <oxenss/logging/oxen_logger.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <optional>
+
+namespace oxen::server {
+
+static auto logcat = log::Cat("server");
+
+namespace {
+
+    struct ticket_key {
+        std::array<unsigned char, 16> name;
+        std::array<unsigned char, 32> hmac_key;
+        std::array<unsigned char, 32> aes_key;
+        std::chrono::steady_clock::time_point created;
+
+        ticket_key() {
+            if (RAND_bytes(name.data(), name.size()) != 1 ||
+                RAND_bytes(hmac_key.data(), hmac_key.size()) != 1 ||
+                RAND_bytes(aes_key.data(), aes_key.size()) != 1)
+                throw std::runtime_error{"Failed to generate TLS session ticket key"};
+            created = std::chrono::steady_clock::now();
+        }
+        ~ticket_key() {
+            OPENSSL_cleanse(hmac_key.data(), hmac_key.size());
+            OPENSSL_cleanse(aes_key.data(), aes_key.size());
+        }
+    };
+
+    std::once_flag init_once;
+    // SSL ex_data slot marking connections whose handshake we have already counted (OpenSSL can
+    // report a completed handshake more than once per connection, e.g. when sending TLS 1.3
+    // tickets).
+    int counted_index = -1;
+    std::atomic<uint64_t> full_handshakes{0}, resumed_handshakes{0};
+
+    std::mutex ticket_mutex;
+    std::chrono::seconds ticket_rotation;
+    // Tickets are issued with the current key; tickets from the previous key are still accepted.
+    std::optional<ticket_key> current_key, previous_key;
+
+    // Returns the current key, first rotating it if it is due.  ticket_mutex must be held.
+    const ticket_key& get_current_key() {
+        auto now = std::chrono::steady_clock::now();
+        if (!current_key || now - current_key->created >= ticket_rotation) {
+            previous_key.reset();
+            if (current_key)
+                previous_key.emplace(*current_key);
+            current_key.emplace();
+            log::debug(logcat, "Rotated TLS session ticket key");
+        }
+        return *current_key;
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    using mac_ctx = EVP_MAC_CTX;
+    bool init_mac(mac_ctx* hctx, const ticket_key& key) {
+        OSSL_PARAM params[] = {
+                OSSL_PARAM_construct_octet_string(
+                        OSSL_MAC_PARAM_KEY,
+                        const_cast<unsigned char*>(key.hmac_key.data()),
+                        key.hmac_key.size()),
+                OSSL_PARAM_construct_utf8_string(
+                        OSSL_MAC_PARAM_DIGEST, const_cast<char*>("SHA256"), 0),
+                OSSL_PARAM_construct_end()};
+        return EVP_MAC_CTX_set_params(hctx, params) == 1;
+    }
+#else
+    using mac_ctx = HMAC_CTX;
+    bool init_mac(mac_ctx* hctx, const ticket_key& key) {
+        return HMAC_Init_ex(hctx, key.hmac_key.data(), key.hmac_key.size(), EVP_sha256(), nullptr) ==
+               1;
+    }
+#endif
+
+    // OpenSSL session ticket callback: sets up the cipher and mac to encrypt a new ticket (`enc`
+    // true), or to decrypt a ticket presented by a client.  Returns 1 on success, 2 on success for
+    // a ticket that should be replaced, 0 if the ticket key is unknown (i.e. do a full handshake),
+    // and -1 on error.
+    int ticket_key_cb(
+            SSL* ssl,
+            unsigned char* key_name,
+            unsigned char* iv,
+            EVP_CIPHER_CTX* cctx,
+            mac_ctx* hctx,
+            int enc) {
+        std::lock_guard lock{ticket_mutex};
+        const auto& current = get_current_key();
+        if (enc) {
+            if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+                return -1;
+            std::memcpy(key_name, current.name.data(), current.name.size());
+            if (EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, current.aes_key.data(), iv) !=
+                        1 ||
+                !init_mac(hctx, current))
+                return -1;
+            return 1;
+        }
+
+        // We replace tickets from the previous key, and always replace TLS 1.3 tickets: clients
+        // only use those once, and OpenSSL won't issue a new one on a resumed handshake unless we
+        // ask for it here.
+        const ticket_key* key = nullptr;
+        int result = SSL_version(ssl) >= TLS1_3_VERSION ? 2 : 1;
+        if (std::memcmp(key_name, current.name.data(), current.name.size()) == 0)
+            key = &current;
+        else if (
+                previous_key &&
+                std::memcmp(key_name, previous_key->name.data(), previous_key->name.size()) == 0) {
+            key = &*previous_key;
+            result = 2;
+        } else
+            return 0;
+
+        if (EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, key->aes_key.data(), iv) != 1 ||
+            !init_mac(hctx, *key))
+            return -1;
+        return result;
+    }
+
+    void on_tls_info(const SSL* ssl, int where, int /*ret*/) {
+        if (!(where & SSL_CB_HANDSHAKE_DONE) || SSL_get_ex_data(ssl, counted_index))
+            return;
+        SSL_set_ex_data(const_cast<SSL*>(ssl), counted_index, const_cast<int*>(&counted_index));
+        (SSL_session_reused(ssl) ? resumed_handshakes : full_handshakes)
+                .fetch_add(1, std::memory_order_relaxed);
+    }
+
+}  // namespace
+
+void configure_tls_sessions(void* ssl_ctx, const tls_session_config& config) {
+    auto* ctx = static_cast<SSL_CTX*>(ssl_ctx);
+
+    std::call_once(init_once, [&config] {
+        counted_index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        std::lock_guard lock{ticket_mutex};
+        ticket_rotation = std::max<std::chrono::seconds>(config.ticket_rotation, std::chrono::minutes{1});
+    });
+
+    static constexpr unsigned char session_id_context[] = "oxen-storage-server";
+    SSL_CTX_set_session_id_context(ctx, session_id_context, sizeof(session_id_context) - 1);
+
+    if (config.cache_size > 0) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx, config.cache_size);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+    SSL_CTX_set_timeout(ctx, config.session_timeout.count());
+
+    if (config.tickets) {
+        SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb);
+#else
+        SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_cb);
+#endif
+    } else {
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    }
+
+    SSL_CTX_set_info_callback(ctx, on_tls_info);
+}
+
+tls_handshake_stats get_tls_handshake_stats() {
+    return {full_handshakes.load(std::memory_order_relaxed),
+            resumed_handshakes.load(std::memory_order_relaxed)};
+}
+
+}  // namespace oxen::server
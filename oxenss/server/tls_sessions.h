@@ -0,0 +1,43 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+/// TLS session resumption for the HTTPS listener: stateless session tickets (encrypted with
+/// periodically rotated keys shared by every listener in the process, so a ticket issued by one
+/// HTTPS event loop can be redeemed on any other) plus a server-side session cache.
+
+namespace oxen::server {
+
+struct tls_session_config {
+    // Whether to issue session tickets.  If false, resumption relies on the server-side cache
+    // alone.
+    bool tickets = true;
+
+    // How often the ticket encryption key is replaced.  Tickets issued under the previous key are
+    // still accepted (and get replaced with a fresh ticket), so a ticket stays usable for between
+    // one and two rotation periods.
+    std::chrono::seconds ticket_rotation = std::chrono::hours{12};
+
+    // Maximum number of sessions held in the server-side cache of each HTTPS event loop; 0
+    // disables the cache.
+    long cache_size = 20480;
+
+    // How long a cached session remains resumable.
+    std::chrono::seconds session_timeout = std::chrono::hours{2};
+};
+
+// Enables session resumption on the given SSL_CTX* according to `config`, and hooks the context
+// into the handshake counters.  The ticket rotation period is process-wide and is taken from the
+// first call.
+void configure_tls_sessions(void* ssl_ctx, const tls_session_config& config);
+
+struct tls_handshake_stats {
+    uint64_t full = 0;     // Handshakes that negotiated a new session
+    uint64_t resumed = 0;  // Handshakes that resumed a session (from a ticket or the cache)
+};
+
+// Returns the handshake counts of all contexts set up with configure_tls_sessions().
+tls_handshake_stats get_tls_handshake_stats();
+
+}  // namespace oxen::server
@@ -4,6 +4,7 @@
 #include <oxenss/logging/oxen_logger.h>
 #include <oxenss/utils/random.hpp>
 
+#include <algorithm>
 #include <chrono>
 
 namespace oxen::snode {
@@ -50,11 +51,13 @@ static void check_incoming_tests_impl(
 }
 
 void reachability_testing::check_incoming_tests(const clock::time_point& now) {
+    std::lock_guard lock{mutex_};
     check_incoming_tests_impl("HTTP", now, startup, last_https);
     check_incoming_tests_impl("OxenMQ", now, startup, last_omq);
 }
 
 void reachability_testing::incoming_ping(ReachType type, const clock::time_point& now) {
+    std::lock_guard lock{mutex_};
     (type == ReachType::OMQ ? last_omq : last_https).last_test = now;
 }
 
@@ -90,8 +93,8 @@ std::optional<sn_record> reachability_testing::next_random(
     auto& all = swarm.all_funded_nodes();
     testing_queue.reserve(all.size());
 
-    for (const auto& [pk, _sn] : all)
-        testing_queue.push_back(pk);
+    for (const auto& sn : all)
+        testing_queue.push_back(sn.pubkey_legacy);
 
     std::shuffle(testing_queue.begin(), testing_queue.end(), util::rng());
 
@@ -99,24 +102,57 @@ std::optional<sn_record> reachability_testing::next_random(
     return next_random(swarm, now, false);
 }
 
-std::vector<std::pair<sn_record, int>> reachability_testing::get_failing(
-        const Swarm& swarm, const clock::time_point& now) {
+void reachability_testing::get_failing(
+        const Swarm& swarm,
+        const clock::time_point& now,
+        size_t max,
+        std::vector<std::pair<sn_record, int>>& result) {
     // Our failing_queue puts the oldest retest times at the top, so pop them off into our
     // result until the top node should be retested sometime in the future
-    std::vector<std::pair<sn_record, int>> result;
-    while (result.size() < MAX_RETESTS_PER_TICK && !failing_queue.empty()) {
+    size_t added = 0;
+    while (added < max && !failing_queue.empty()) {
         auto& [pk, retest_time, failures] = failing_queue.top();
         if (retest_time > now)
             break;
-        if (auto sn = swarm.find_node(pk))
+        if (auto sn = swarm.find_node(pk)) {
             result.emplace_back(std::move(*sn), failures);
-        else  // Node is apparently no longer active, so stop testing it.
-            remove_node_from_failing(pk);
+            added++;
+        } else  // Node is apparently no longer active, so stop testing it.
+            failing.erase(pk);
         failing_queue.pop();
     }
+}
+
+std::vector<std::pair<sn_record, int>> reachability_testing::start_tests(
+        const Swarm& swarm, const clock::time_point& now) {
+    std::lock_guard lock{mutex_};
+    std::vector<std::pair<sn_record, int>> result;
+    int slots = MAX_IN_FLIGHT - in_flight_;
+    if (slots <= 0)
+        return result;
+
+    // Retests come first: they are for nodes that already look broken, and we don't want them to
+    // be held up behind general tests.
+    get_failing(swarm, now, std::min(slots, MAX_RETESTS_PER_TICK), result);
+    if (static_cast<int>(result.size()) < slots)
+        if (auto rando = next_random(swarm, now))
+            result.emplace_back(std::move(*rando), 0);
+
+    in_flight_ += static_cast<int>(result.size());
     return result;
 }
 
+void reachability_testing::test_done() {
+    std::lock_guard lock{mutex_};
+    if (in_flight_ > 0)
+        in_flight_--;
+}
+
+int reachability_testing::in_flight() const {
+    std::lock_guard lock{mutex_};
+    return in_flight_;
+}
+
 void reachability_testing::add_failing_node(
         const crypto::legacy_pubkey& pk, int previous_failures) {
     using namespace std::chrono;
@@ -128,11 +164,13 @@ void reachability_testing::add_failing_node(
     if (next_test_in > TESTING_BACKOFF_MAX)
         next_test_in = TESTING_BACKOFF_MAX;
 
+    std::lock_guard lock{mutex_};
     failing.insert(pk);
     failing_queue.emplace(pk, steady_clock::now() + next_test_in, previous_failures + 1);
 }
 
 void reachability_testing::remove_node_from_failing(const crypto::legacy_pubkey& pk) {
+    std::lock_guard lock{mutex_};
     failing.erase(pk);
 }
 
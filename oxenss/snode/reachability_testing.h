@@ -4,6 +4,7 @@
 #include "sn_record.h"
 
 #include <chrono>
+#include <mutex>
 #include <queue>
 #include <random>
 #include <unordered_map>
@@ -62,6 +63,11 @@ class reachability_testing {
     // recommissioned).
     inline static constexpr int MAX_RETESTS_PER_TICK = 4;
 
+    // The maximum number of tests (each an HTTPS and an OMQ ping) that we have in flight at once;
+    // once we reach it, due tests wait (retests keep their place in the failing queue) until
+    // earlier tests finish.
+    inline static constexpr int MAX_IN_FLIGHT = 32;
+
     // Maximum time without a ping before we start whining about it.
     //
     // We have a probability of about 0.368* of *not* getting pinged within a ping interval
@@ -78,6 +84,12 @@ class reachability_testing {
     using clock = std::chrono::steady_clock;
 
   private:
+    // All of the below is guarded by this; the public methods are thread-safe.
+    mutable std::mutex mutex_;
+
+    // Number of tests started by start_tests() that haven't been ended with test_done() yet.
+    int in_flight_ = 0;
+
     // Queue of pubkeys of service nodes to test; we pop off the back of this until the queue
     // empties then we refill it with a shuffled list of all pubkeys then pull off of it until
     // it is empty again, etc.
@@ -104,27 +116,24 @@ class reachability_testing {
     detail::incoming_test_state last_omq;
 
   public:
-    // If it is time to perform another random test, this returns the next node to test from the
-    // testing queue and returns it, also updating the timer for the next test.  If it is not
-    // yet time, or if the queue is empty and cannot current be replenished, returns
-    // std::nullopt.  If the queue empties then this builds a new one by shuffling current
-    // public keys in the swarm's "all nodes" then starts using the new queue for this an
-    // subsequent calls.
-    //
-    // `requeue` is mainly for internal use: if false it avoids rebuilding the queue if we run
-    // out (and instead just return nullopt).
-    std::optional<sn_record> next_random(
-            const Swarm& swarm, const clock::time_point& now = clock::now(), bool requeue = true);
-
-    // Removes and returns up to MAX_RETESTS_PER_TICK nodes that are due to be tested (i.e.
-    // next-testing-time <= now).  Returns [snrecord, #previous-failures] for each.
-    std::vector<std::pair<sn_record, int>> get_failing(
+    // Returns the tests that are due now: up to MAX_RETESTS_PER_TICK failing nodes due for a
+    // retest (as [snrecord, #previous-failures]), plus a random node (with 0 previous failures)
+    // if it is time for another general test -- but only as many as keep us within MAX_IN_FLIGHT
+    // outstanding tests.  Each returned test counts as in flight until test_done() gets called
+    // for it.
+    std::vector<std::pair<sn_record, int>> start_tests(
             const Swarm& swarm, const clock::time_point& now = clock::now());
 
+    // Ends a test returned by start_tests().
+    void test_done();
+
+    // Number of tests currently in flight.
+    int in_flight() const;
+
     // Adds a bad node pubkey to the failing list, to be re-tested soon (with a backoff
     // depending on `failures`; see TESTING_BACKOFF).  `previous_failures` should be the number
     // of previous failures *before* this one, i.e. 0 for a random general test; or the failure
-    // count returned by `get_failing` for repeated failures.
+    // count returned by `start_tests` for repeated failures.
     void add_failing_node(const crypto::legacy_pubkey& pk, int previous_failures = 0);
 
     // Removes a node from the set of failing nodes; should be called whenever we stop testing a
@@ -136,6 +145,27 @@ class reachability_testing {
 
     // Check whether we received incoming pings recently
     void check_incoming_tests(const clock::time_point& now = clock::now());
+
+  private:
+    // If it is time to perform another random test, this returns the next node to test from the
+    // testing queue and returns it, also updating the timer for the next test.  If it is not
+    // yet time, or if the queue is empty and cannot current be replenished, returns
+    // std::nullopt.  If the queue empties then this builds a new one by shuffling current
+    // public keys in the swarm's "all nodes" then starts using the new queue for this an
+    // subsequent calls.
+    //
+    // `requeue` is mainly for internal use: if false it avoids rebuilding the queue if we run
+    // out (and instead just return nullopt).
+    std::optional<sn_record> next_random(
+            const Swarm& swarm, const clock::time_point& now, bool requeue = true);
+
+    // Removes and appends to `result` up to `max` nodes that are due to be tested (i.e.
+    // next-testing-time <= now), as [snrecord, #previous-failures].
+    void get_failing(
+            const Swarm& swarm,
+            const clock::time_point& now,
+            size_t max,
+            std::vector<std::pair<sn_record, int>>& result);
 };
 
 }  // namespace oxen::snode
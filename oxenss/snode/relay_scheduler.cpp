@@ -0,0 +1,311 @@
+#include "relay_scheduler.h"
+
+#include <oxen/log.hpp>
+
+#include <algorithm>
+#include <tuple>
+
+namespace oxen::snode {
+
+static auto logcat = log::Cat("snode");
+
+RelayScheduler::RelayScheduler(send_fn send, load_fn load, relay_config config) :
+        send_{std::move(send)}, load_{std::move(load)}, config_{config} {}
+
+void RelayScheduler::relay(const sn_record& peer, ranges_t ranges) {
+    {
+        std::lock_guard lock{mutex_};
+        if (stopped_)
+            return;
+        auto& p = peers_[peer.pubkey_legacy];
+        p.peer = peer;  // Keep the latest contact details
+        if (std::any_of(p.jobs.begin(), p.jobs.end(), [&](const job& j) {
+                return j.ranges == ranges;
+            }))
+            return;
+
+        auto& j = p.jobs.emplace_back();
+        j.id = p.next_job++;
+        j.ranges = std::move(ranges);
+        if (!j.ranges.empty())
+            j.acked.next = j.ranges.front().first;
+
+        auto now = std::chrono::steady_clock::now();
+        auto cp = std::find_if(p.checkpoints.begin(), p.checkpoints.end(), [&](const auto& c) {
+            return c.ranges == j.ranges;
+        });
+        if (cp != p.checkpoints.end()) {
+            if (cp->expiry >= now) {
+                j.acked = cp->pos;
+                p.stats.resumed++;
+                log::info(
+                        logcat,
+                        "Resuming relay to {} from checkpoint ({:.1f}% done)",
+                        peer.pubkey_legacy,
+                        progress(j) * 100);
+            }
+            p.checkpoints.erase(cp);
+        }
+        j.load_pos = j.acked;
+        p.last_active = now;
+    }
+    pump(peer.pubkey_legacy);
+}
+
+void RelayScheduler::collect_sends(
+        peer_state& p, std::chrono::steady_clock::time_point now, std::vector<pending_send>& out) {
+    if (p.jobs.empty() || now < p.retry_at)
+        return;
+    auto& j = p.jobs.front();
+    size_t in_flight = std::count_if(j.batches.begin(), j.batches.end(), [](const batch& b) {
+        return b.state == batch_state::in_flight;
+    });
+    for (auto& b : j.batches) {
+        if (in_flight >= config_.window)
+            break;
+        if (b.state != batch_state::queued)
+            continue;
+        b.state = batch_state::in_flight;
+        in_flight++;
+        if (b.attempts > 0)
+            log::debug(
+                    logcat,
+                    "Retrying relay batch to {} (attempt {})",
+                    p.peer.pubkey_legacy,
+                    b.attempts + 1);
+        out.push_back(
+                {p.peer,
+                 b.data,
+                 [this, pk = p.peer.pubkey_legacy, seq = b.seq](bool success) {
+                     on_reply(pk, seq, success);
+                 }});
+    }
+}
+
+void RelayScheduler::pump(const crypto::legacy_pubkey& pk) {
+    while (true) {
+        std::vector<pending_send> sends;
+        std::optional<std::tuple<sn_record, ranges_t, relay_position>> to_load;
+        uint64_t job_id = 0;
+        {
+            std::lock_guard lock{mutex_};
+            if (stopped_)
+                return;
+            auto it = peers_.find(pk);
+            if (it == peers_.end())
+                return;
+            auto& p = it->second;
+            auto now = std::chrono::steady_clock::now();
+
+            // Retire finished relays
+            while (!p.jobs.empty() && p.jobs.front().loaded_all() &&
+                   p.jobs.front().batches.empty()) {
+                log::debug(logcat, "Finished relay to {}", pk);
+                p.jobs.pop_front();
+            }
+
+            collect_sends(p, now, sends);
+
+            if (!p.loading && !p.jobs.empty() && now >= p.retry_at) {
+                auto& j = p.jobs.front();
+                bool have_queued =
+                        std::any_of(j.batches.begin(), j.batches.end(), [](const batch& b) {
+                            return b.state == batch_state::queued;
+                        });
+                if (!j.loaded_all() && !have_queued && j.batches.size() < config_.window) {
+                    p.loading = true;
+                    to_load.emplace(p.peer, j.ranges, j.load_pos);
+                    job_id = j.id;
+                }
+            }
+        }
+
+        for (auto& s : sends)
+            send_(s.peer, *s.data, std::move(s.done));
+
+        if (!to_load)
+            return;
+
+        std::optional<relay_chunk> chunk;
+        try {
+            auto& [peer, ranges, from] = *to_load;
+            chunk = load_(peer, ranges, from);
+        } catch (const std::exception& e) {
+            log::error(logcat, "Failed to load relay data for {}: {}", pk, e.what());
+        }
+
+        std::lock_guard lock{mutex_};
+        auto it = peers_.find(pk);
+        if (it == peers_.end())
+            return;
+        auto& p = it->second;
+        p.loading = false;
+        // The relay may have been abandoned (or stopped) while we were loading
+        if (stopped_ || p.jobs.empty() || p.jobs.front().id != job_id)
+            continue;
+        auto& j = p.jobs.front();
+        if (!chunk) {
+            // Try again after a backoff; this isn't the peer's fault, so doesn't count towards
+            // abandoning it.
+            p.retry_at = std::chrono::steady_clock::now() + config_.backoff_max;
+            return;
+        }
+        relay_position next = chunk->next.value_or(relay_position{j.ranges.size(), 0});
+        for (auto& data : chunk->batches) {
+            auto& b = j.batches.emplace_back();
+            b.data = std::make_shared<const std::string>(std::move(data));
+            b.seq = p.next_seq++;
+        }
+        if (!j.batches.empty())
+            j.batches.back().checkpoint = next;
+        else
+            j.acked = next;
+        j.load_pos = next;
+        // Loop back around to send what we just loaded (or load the next chunk, if this one was
+        // empty)
+    }
+}
+
+void RelayScheduler::on_reply(const crypto::legacy_pubkey& pk, uint64_t seq, bool success) {
+    {
+        std::lock_guard lock{mutex_};
+        if (stopped_)
+            return;
+        auto it = peers_.find(pk);
+        if (it == peers_.end() || it->second.jobs.empty())
+            return;
+        auto& p = it->second;
+        auto& j = p.jobs.front();
+        auto bit = std::find_if(
+                j.batches.begin(), j.batches.end(), [seq](const batch& b) { return b.seq == seq; });
+        if (bit == j.batches.end() || bit->state != batch_state::in_flight)
+            return;  // Belongs to a relay we have since abandoned
+        auto now = std::chrono::steady_clock::now();
+        p.last_active = now;
+
+        if (success) {
+            bit->state = batch_state::done;
+            p.failures = 0;
+            p.stats.sent++;
+            p.stats.sent_bytes += bit->data->size();
+            while (!j.batches.empty() && j.batches.front().state == batch_state::done) {
+                if (j.batches.front().checkpoint)
+                    j.acked = *j.batches.front().checkpoint;
+                j.batches.pop_front();
+            }
+        } else {
+            p.stats.failures++;
+            p.failures++;
+            if (++bit->attempts >= config_.max_attempts) {
+                log::warning(
+                        logcat,
+                        "Giving up relaying to {} after {} failed attempts ({:.1f}% done)",
+                        pk,
+                        bit->attempts,
+                        progress(j) * 100);
+                abandon(p, now);
+                return;
+            }
+            bit->state = batch_state::queued;
+            auto backoff = std::min<std::chrono::milliseconds>(
+                    config_.backoff_base * (1 << std::min(p.failures - 1, 16)),
+                    config_.backoff_max);
+            p.retry_at = std::max(p.retry_at, now + backoff);
+            log::debug(
+                    logcat, "Relay batch to {} failed; retrying in {}ms", pk, backoff.count());
+            return;
+        }
+    }
+    pump(pk);
+}
+
+void RelayScheduler::abandon(peer_state& p, std::chrono::steady_clock::time_point now) {
+    for (auto& j : p.jobs) {
+        p.checkpoints.push_back({std::move(j.ranges), j.acked, now + config_.checkpoint_ttl});
+        p.stats.abandoned++;
+    }
+    p.jobs.clear();
+    p.failures = 0;
+    p.retry_at = {};
+}
+
+void RelayScheduler::tick(std::chrono::steady_clock::time_point now) {
+    std::vector<crypto::legacy_pubkey> due;
+    {
+        std::lock_guard lock{mutex_};
+        if (stopped_)
+            return;
+        for (auto it = peers_.begin(); it != peers_.end();) {
+            auto& p = it->second;
+            p.checkpoints.erase(
+                    std::remove_if(
+                            p.checkpoints.begin(),
+                            p.checkpoints.end(),
+                            [now](const checkpoint& c) { return c.expiry < now; }),
+                    p.checkpoints.end());
+            if (p.jobs.empty() && p.checkpoints.empty() && !p.loading &&
+                p.last_active + config_.checkpoint_ttl < now) {
+                it = peers_.erase(it);
+                continue;
+            }
+            if (!p.jobs.empty() && p.retry_at != std::chrono::steady_clock::time_point{} &&
+                p.retry_at <= now) {
+                p.retry_at = {};
+                due.push_back(it->first);
+            }
+            ++it;
+        }
+    }
+    for (auto& pk : due)
+        pump(pk);
+}
+
+void RelayScheduler::stop() {
+    decltype(peers_) dropped;
+    {
+        std::lock_guard lock{mutex_};
+        stopped_ = true;
+        dropped.swap(peers_);
+    }
+}
+
+double RelayScheduler::progress(const job& j) {
+    if (j.acked.range >= j.ranges.size())
+        return 1.0;
+    long double total = 0, done = 0;
+    for (size_t i = 0; i < j.ranges.size(); i++) {
+        auto [lo, hi] = j.ranges[i];
+        long double size = static_cast<long double>(hi - lo) + 1;
+        total += size;
+        if (i < j.acked.range)
+            done += size;
+        else if (i == j.acked.range)
+            done += static_cast<long double>(j.acked.next - lo);
+    }
+    return static_cast<double>(done / total);
+}
+
+std::unordered_map<crypto::legacy_pubkey, RelayScheduler::peer_stats> RelayScheduler::get_stats()
+        const {
+    std::unordered_map<crypto::legacy_pubkey, peer_stats> result;
+    std::lock_guard lock{mutex_};
+    for (const auto& [pk, p] : peers_) {
+        auto& s = result[pk];
+        s = p.stats;
+        s.relays = p.jobs.size();
+        s.progress = 1.0;
+        if (!p.jobs.empty()) {
+            const auto& j = p.jobs.front();
+            for (const auto& b : j.batches) {
+                if (b.state == batch_state::queued)
+                    s.queued++;
+                else if (b.state == batch_state::in_flight)
+                    s.in_flight++;
+            }
+            s.progress = progress(j);
+        }
+    }
+    return result;
+}
+
+}  // namespace oxen::snode
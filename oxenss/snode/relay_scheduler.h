@@ -0,0 +1,194 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <oxenss/crypto/keys.h>
+#include "sn_record.h"
+
+namespace oxen::snode {
+
+using namespace std::literals;
+
+// Maximum number of relay batches we have outstanding to any one peer at a time.  Each batch can
+// be up to SERIALIZATION_BATCH_SIZE, so this bounds both what we push into our outgoing socket
+// and what piles up in the peer's "sn" category queue.
+inline constexpr size_t RELAY_WINDOW = 2;
+
+// How many times we try to send the same batch to a peer before giving up on it (and everything
+// else queued for that peer).  The job's progress is kept so that relaying the same data to the
+// peer again later picks up where it left off.
+inline constexpr int RELAY_MAX_ATTEMPTS = 8;
+
+// Delay before retrying after a failure; this doubles with each consecutive failure to the same
+// peer, up to RELAY_BACKOFF_MAX.
+inline constexpr auto RELAY_BACKOFF_BASE = 1s;
+inline constexpr auto RELAY_BACKOFF_MAX = 60s;
+
+// How long we remember the progress of an abandoned relay to a peer.
+inline constexpr auto RELAY_CHECKPOINT_TTL = 1h;
+
+// How often the scheduler wants tick() to be called.
+inline constexpr auto RELAY_TICK_INTERVAL = 1s;
+
+// Position within a relay of a list of swarm space ranges: the data still to be sent starts at the
+// `next` swarm space value of range `range`.
+struct relay_position {
+    size_t range = 0;
+    uint64_t next = 0;
+
+    bool operator==(const relay_position& o) const { return range == o.range && next == o.next; }
+};
+
+// One loaded piece of a relay: the serialized batches covering the swarm space from the position
+// it was loaded at up to (but not including) `next`.  `next` is nullopt if this piece reaches the
+// end of the relay.
+struct relay_chunk {
+    std::vector<std::string> batches;
+    std::optional<relay_position> next;
+};
+
+struct relay_config {
+    size_t window = RELAY_WINDOW;
+    int max_attempts = RELAY_MAX_ATTEMPTS;
+    std::chrono::milliseconds backoff_base = RELAY_BACKOFF_BASE;
+    std::chrono::milliseconds backoff_max = RELAY_BACKOFF_MAX;
+    std::chrono::seconds checkpoint_ttl = RELAY_CHECKPOINT_TTL;
+};
+
+/// Schedules the relaying of stored messages (e.g. when bootstrapping a new swarm member) to other
+/// service nodes.
+///
+/// A relay, to one peer, covers a list of swarm space ranges.  Rather than loading and sending
+/// everything at once, the scheduler loads the data one chunk at a time as the peer accepts it,
+/// keeping at most `window` batches in flight to each peer.  Failed batches are retried with
+/// exponential backoff; a peer that keeps failing gets abandoned, but the position up to which it
+/// has acknowledged everything is kept as a checkpoint so that a later relay of the same ranges to
+/// it resumes from there rather than starting over.
+///
+/// The scheduler itself doesn't know about the network or the database: `send` delivers one batch
+/// to a peer and must (eventually, and exactly once) invoke the given callback with whether it
+/// succeeded; `load` loads the chunk of a relay to a peer starting at a position.  Neither is called with the
+/// scheduler's lock held, and `load` is only ever running once per peer at a time.
+///
+/// All methods are thread-safe.
+class RelayScheduler {
+  public:
+    using ranges_t = std::vector<std::pair<uint64_t, uint64_t>>;
+    using send_fn = std::function<void(
+            const sn_record& peer, const std::string& batch, std::function<void(bool)> done)>;
+    using load_fn = std::function<relay_chunk(
+            const sn_record& peer, const ranges_t& ranges, relay_position from)>;
+
+    RelayScheduler(send_fn send, load_fn load, relay_config config = {});
+
+    // Queues a relay of the given swarm space ranges to `peer`, after anything already queued for
+    // it.  Does nothing if the same relay is already queued for the peer.
+    void relay(const sn_record& peer, ranges_t ranges);
+
+    // Retries sends whose backoff has elapsed and forgets expired checkpoints and idle peers.
+    // Should be called every RELAY_TICK_INTERVAL.
+    void tick(std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+    // Drops everything queued and stops sending anything new.  Callbacks for batches already in
+    // flight are still accepted (and ignored).
+    void stop();
+
+    struct peer_stats {
+        size_t relays = 0;     // Relays queued (including the current one)
+        size_t queued = 0;     // Loaded batches waiting to be sent
+        size_t in_flight = 0;  // Batches sent and awaiting a reply
+        uint64_t sent = 0;     // Batches successfully delivered
+        uint64_t sent_bytes = 0;
+        uint64_t failures = 0;   // Failed sends
+        uint64_t abandoned = 0;  // Relays given up on after repeated failures
+        uint64_t resumed = 0;    // Relays resumed from a checkpoint
+        double progress = 0;     // Fraction of the current relay's swarm space acknowledged
+    };
+
+    std::unordered_map<crypto::legacy_pubkey, peer_stats> get_stats() const;
+
+  private:
+    enum class batch_state { queued, in_flight, done };
+
+    struct batch {
+        std::shared_ptr<const std::string> data;
+        uint64_t seq;
+        batch_state state = batch_state::queued;
+        int attempts = 0;
+        // Set on the last batch of a chunk: the position that is reached once this and everything
+        // before it has been delivered.
+        std::optional<relay_position> checkpoint;
+    };
+
+    // The end of a relay is represented by the position {ranges.size(), 0}.
+    struct job {
+        uint64_t id;
+        ranges_t ranges;
+        relay_position acked;       // Everything before this has been delivered
+        relay_position load_pos;    // Where the next chunk gets loaded from
+        std::deque<batch> batches;  // Loaded but not yet delivered, in order
+
+        bool loaded_all() const { return load_pos.range >= ranges.size(); }
+    };
+
+    struct checkpoint {
+        ranges_t ranges;
+        relay_position pos;
+        std::chrono::steady_clock::time_point expiry;
+    };
+
+    struct peer_state {
+        sn_record peer;
+        std::deque<job> jobs;
+        std::vector<checkpoint> checkpoints;
+        bool loading = false;
+        int failures = 0;  // Consecutive failures
+        std::chrono::steady_clock::time_point retry_at{};
+        std::chrono::steady_clock::time_point last_active{};
+        uint64_t next_seq = 0, next_job = 0;
+        peer_stats stats;
+    };
+
+    // A send to make once the lock is released
+    struct pending_send {
+        sn_record peer;
+        std::shared_ptr<const std::string> data;
+        std::function<void(bool)> done;
+    };
+
+    const send_fn send_;
+    const load_fn load_;
+    const relay_config config_;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<crypto::legacy_pubkey, peer_state> peers_;
+    bool stopped_ = false;
+
+    // Sends and loads whatever the peer has room for; called without the lock held.
+    void pump(const crypto::legacy_pubkey& pk);
+
+    // Collects the sends the peer has room for; called with the lock held.
+    void collect_sends(
+            peer_state& p,
+            std::chrono::steady_clock::time_point now,
+            std::vector<pending_send>& out);
+
+    void on_reply(const crypto::legacy_pubkey& pk, uint64_t seq, bool success);
+
+    // Drops the peer's jobs, remembering their progress; called with the lock held.
+    void abandon(peer_state& p, std::chrono::steady_clock::time_point now);
+
+    static double progress(const job& j);
+};
+
+}  // namespace oxen::snode
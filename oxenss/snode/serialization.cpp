@@ -8,60 +8,176 @@
 #include <oxenc/base64.h>
 #include <oxenc/bt_serialize.h>
 
+#include <algorithm>
 #include <chrono>
+#include <limits>
+#include <stdexcept>
 
 namespace oxen::snode {
 
 static auto logcat = log::Cat("snode");
 
-std::vector<std::string> serialize_messages(
-        std::function<const message*()> next_msg, uint8_t version) {
-    std::vector<std::string> res;
+size_t serialized_size(const message& msg) {
+    return 1 +                      // version byte
+           2 +                      // l...e
+           36 +                     // 33:pubkey
+           2 * 15 +                 // millisecond epochs (13 digits) + `i...e`
+           (4 + msg.hash.size()) +  // xxx:HASH
+           (6 + msg.data.size())    // xxxxx:DATA
+            ;
+}
+
+namespace {
 
-    if (version == SERIALIZATION_VERSION_BT) {
+    std::string serialize_bt(const std::vector<const message*>& msgs) {
         oxenc::bt_list l;
-        size_t counter = 2;
-        while (auto* msg = next_msg()) {
-            size_t ser_size = 1 +                       // version byte
-                              2 +                       // l...e
-                              36 +                      // 33:pubkey
-                              2 * 15 +                  // millisecond epochs (13 digits) + `i...e`
-                              (4 + msg->hash.size()) +  // xxx:HASH
-                              (6 + msg->data.size())    // xxxxx:DATA
-                    ;
-            counter += ser_size;
-            if (!l.empty() && counter > SERIALIZATION_BATCH_SIZE) {
-                // Adding this message would push us over the limit, so finish it off and start
-                // a new serialization piece.
-                std::ostringstream oss;
-                oss << SERIALIZATION_VERSION_BT << oxenc::bt_serializer(l);
-                res.push_back(oss.str());
-                l.clear();
-                counter = 1 + 2 + ser_size;
-            }
-            assert(msg->pubkey);
+        for (auto* msg : msgs)
             l.push_back(oxenc::bt_list{
                     {msg->pubkey.prefixed_raw(),
                      msg->hash,
                      to_epoch_ms(msg->timestamp),
                      to_epoch_ms(msg->expiry),
                      msg->data}});
+
+        std::ostringstream oss;
+        oss << SERIALIZATION_VERSION_BT << oxenc::bt_serializer(l);
+        return oss.str();
+    }
+
+    // v2 is:
+    //
+    //     l i<BASE_TIMESTAMP>e i<BASE_EXPIRY>e l GROUP... e e
+    //
+    // where each GROUP is the messages of one account:
+    //
+    //     l 33:<PUBKEY> l MSG... e e
+    //
+    // and each MSG is:
+    //
+    //     l <HASH> i<NAMESPACE>e i<TIMESTAMP - BASE_TIMESTAMP>e i<EXPIRY - BASE_EXPIRY>e <DATA> e
+    //
+    // with the bases being the smallest timestamp and expiry in the batch.
+    std::string serialize_grouped(const std::vector<const message*>& msgs) {
+        int64_t base_ts = 0, base_exp = 0;
+        if (!msgs.empty()) {
+            base_ts = base_exp = std::numeric_limits<int64_t>::max();
+            for (auto* msg : msgs) {
+                base_ts = std::min(base_ts, to_epoch_ms(msg->timestamp));
+                base_exp = std::min(base_exp, to_epoch_ms(msg->expiry));
+            }
+        }
+
+        // The hashes and data are serialized from views, rather than copied into the bt_list
+        oxenc::bt_list groups, items;
+        const message* group_start = nullptr;
+        auto finish_group = [&] {
+            if (group_start)
+                groups.push_back(
+                        oxenc::bt_list{{group_start->pubkey.prefixed_raw(), std::move(items)}});
+            items = oxenc::bt_list{};
+        };
+        for (auto* msg : msgs) {
+            if (!group_start || !(msg->pubkey == group_start->pubkey)) {
+                finish_group();
+                group_start = msg;
+            }
+            items.push_back(oxenc::bt_list{
+                    {std::string_view{msg->hash},
+                     int64_t{to_int(msg->msg_namespace)},
+                     to_epoch_ms(msg->timestamp) - base_ts,
+                     to_epoch_ms(msg->expiry) - base_exp,
+                     std::string_view{msg->data}}});
         }
+        finish_group();
 
         std::ostringstream oss;
-        oss << uint8_t{1} /* version*/ << oxenc::bt_serializer(l);
-        res.push_back(oss.str());
-    } else {
+        oss << SERIALIZATION_VERSION_GROUPED
+            << oxenc::bt_serializer(oxenc::bt_list{{base_ts, base_exp, std::move(groups)}});
+        return oss.str();
+    }
+
+}  // namespace
+
+std::vector<std::string> serialize_messages(
+        std::function<const message*()> next_msg, uint8_t version) {
+    std::string (*encode)(const std::vector<const message*>&);
+    if (version == SERIALIZATION_VERSION_BT)
+        encode = serialize_bt;
+    else if (version == SERIALIZATION_VERSION_GROUPED)
+        encode = serialize_grouped;
+    else {
         log::critical(logcat, "Invalid serialization version {}", +version);
         throw std::logic_error{"Invalid serialization version " + std::to_string(version)};
     }
 
+    std::vector<std::string> res;
+    std::vector<const message*> batch;
+    size_t counter = 2;
+    while (auto* msg = next_msg()) {
+        size_t ser_size = serialized_size(*msg);
+        counter += ser_size;
+        if (!batch.empty() && counter > SERIALIZATION_BATCH_SIZE) {
+            // Adding this message would push us over the limit, so finish it off and start a new
+            // serialization piece.
+            res.push_back(encode(batch));
+            batch.clear();
+            counter = 1 + 2 + ser_size;
+        }
+        assert(msg->pubkey);
+        batch.push_back(msg);
+    }
+    res.push_back(encode(batch));
+
     return res;
 }
 
-std::vector<message> deserialize_messages(std::string_view slice) {
-    log::trace(logcat, "=== Deserializing ===");
+namespace {
+
+    void for_each_bt(std::string_view slice, const message_sink& f) {
+        oxenc::bt_list_consumer l{slice};
+        user_pubkey_t pubkey;
+        while (!l.is_finished()) {
+            auto m = l.consume_list_consumer();
+            if (!pubkey.load(m.consume_string_view()))
+                throw std::runtime_error{"invalid pubkey"};
+            message_view msg;
+            msg.hash = m.consume_string_view();
+            msg.msg_namespace = namespace_id::Default;  // v1 doesn't carry it
+            msg.timestamp = from_epoch_ms(m.consume_integer<int64_t>());
+            msg.expiry = from_epoch_ms(m.consume_integer<int64_t>());
+            msg.data = m.consume_string_view();
+            f(pubkey, msg);
+        }
+    }
+
+    void for_each_grouped(std::string_view slice, const message_sink& f) {
+        oxenc::bt_list_consumer l{slice};
+        auto base_ts = l.consume_integer<int64_t>();
+        auto base_exp = l.consume_integer<int64_t>();
+        auto groups = l.consume_list_consumer();
+        user_pubkey_t pubkey;
+        while (!groups.is_finished()) {
+            auto group = groups.consume_list_consumer();
+            if (!pubkey.load(group.consume_string_view()))
+                throw std::runtime_error{"invalid pubkey"};
+            auto items = group.consume_list_consumer();
+            while (!items.is_finished()) {
+                auto m = items.consume_list_consumer();
+                message_view msg;
+                msg.hash = m.consume_string_view();
+                msg.msg_namespace = static_cast<namespace_id>(
+                        m.consume_integer<std::underlying_type_t<namespace_id>>());
+                msg.timestamp = from_epoch_ms(base_ts + m.consume_integer<int64_t>());
+                msg.expiry = from_epoch_ms(base_exp + m.consume_integer<int64_t>());
+                msg.data = m.consume_string_view();
+                f(pubkey, msg);
+            }
+        }
+    }
 
+}  // namespace
+
+void for_each_message(std::string_view slice, const message_sink& f) {
     // v0 (now unsupported) didn't send a version at all, and sent things incredibly
     // inefficiently. v1+ put the version as the first byte (but can't use any of
     // '0'..'9','a'..'f','A'..'F' because v0 started out with a hex pubkey).
@@ -71,30 +187,30 @@ std::vector<message> deserialize_messages(std::string_view slice) {
         slice.remove_prefix(1);
     }
 
-    if (version != SERIALIZATION_VERSION_BT) {
-        log::error(logcat, "Invalid deserialization version {}", +version);
-        return {};
-    }
+    if (version == SERIALIZATION_VERSION_BT)
+        for_each_bt(slice, f);
+    else if (version == SERIALIZATION_VERSION_GROUPED)
+        for_each_grouped(slice, f);
+    else
+        throw std::runtime_error{"unsupported serialization version " + std::to_string(+version)};
+}
+
+std::vector<message> deserialize_messages(std::string_view slice) {
+    log::trace(logcat, "=== Deserializing ===");
 
-    // v1:
     std::vector<message> result;
     try {
-        oxenc::bt_list_consumer l{slice};
-        while (!l.is_finished()) {
-            auto& item = result.emplace_back();
-            auto m = l.consume_list_consumer();
-            if (!item.pubkey.load(m.consume_string_view())) {
-                log::debug(logcat, "Unable to deserialize(v1) pubkey");
-                return {};
-            }
-            item.hash = m.consume_string();
-            item.timestamp = from_epoch_ms(m.consume_integer<int64_t>());
-            item.expiry = from_epoch_ms(m.consume_integer<int64_t>());
-            item.data = m.consume_string();
-        }
+        for_each_message(slice, [&result](const user_pubkey_t& pubkey, const message_view& m) {
+            result.emplace_back(
+                    pubkey,
+                    std::string{m.hash},
+                    m.msg_namespace,
+                    m.timestamp,
+                    m.expiry,
+                    std::string{m.data});
+        });
     } catch (const std::exception& e) {
-        throw e;
-        log::debug(logcat, "Failed to deserialize(v1): {}", e.what());
+        log::error(logcat, "Failed to deserialize messages: {}", e.what());
         return {};
     }
 
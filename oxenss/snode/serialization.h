@@ -12,6 +12,30 @@ inline constexpr size_t SERIALIZATION_BATCH_SIZE = 9'000'000;
 // Newer serialization version based on bt-encoding.
 inline constexpr uint8_t SERIALIZATION_VERSION_BT = 1;
 
+// bt-encoded version that groups consecutive messages of the same account so that the pubkey is
+// only sent once per group, sends timestamps and expiries as offsets from the batch's earliest
+// ones, and includes the message namespace (which v1 does not carry).
+inline constexpr uint8_t SERIALIZATION_VERSION_GROUPED = 2;
+
+// Not a serialization of its own: peers advertising this (or later) also accept snapshot images of
+// the messages of a range of accounts (see Database::export_snapshot) as sn.data batches, which
+// relays of whole swarm space ranges (i.e. bootstrapping) then send instead of message batches.
+// Other batches to such peers use SERIALIZATION_VERSION_GROUPED.
+inline constexpr uint8_t SERIALIZATION_VERSION_SNAPSHOT = 3;
+
+// The newest version we can produce and understand.  Peers advertise this in their sn.data replies
+// so that we know which version we can send them.
+inline constexpr uint8_t SERIALIZATION_VERSION_LATEST = SERIALIZATION_VERSION_SNAPSHOT;
+
+// Returns the approximate number of bytes that `msg` contributes to a serialized batch.  This is
+// what serialize_messages uses to decide when to split batches, and can be used by callers that
+// want to accumulate messages into batches that will serialize into a single piece.  (This is
+// computed for SERIALIZATION_VERSION_BT.  The grouped version sends each account's pubkey only
+// once, so is usually smaller, but with every message from a different account it can take up to
+// 12 bytes more per message, for the namespace and the group's list, plus about 35 bytes per
+// batch for the base timestamp and expiry.)
+size_t serialized_size(const message& msg);
+
 std::vector<std::string> serialize_messages(
         std::function<const message*()> next_msg, uint8_t version);
 
@@ -24,6 +48,14 @@ std::vector<std::string> serialize_messages(It begin, It end, uint8_t version) {
             version);
 }
 
+// Invokes `f` with each message of a serialized batch (of any supported version) without building
+// up a vector of them: the message_view's hash and data point into `blob`, and the pubkey
+// reference is only valid for the duration of the call.  Throws if the batch is invalid or of an
+// unsupported version, possibly after `f` has already been called for some of its messages.
+void for_each_message(std::string_view blob, const message_sink& f);
+
+// Deserializes a batch of messages of any supported version.  Returns an empty vector if the
+// batch is invalid or of an unsupported version.
 std::vector<message> deserialize_messages(std::string_view blob);
 
 }  // namespace oxen::snode
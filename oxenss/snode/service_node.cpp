@@ -5,7 +5,12 @@
 #include <oxenss/common/mainnet.h>
 #include <oxenss/rpc/request_handler.h>
 #include <oxenss/server/omq.h>
+#include <oxenss/server/tls_sessions.h>
 #include <oxenss/logging/oxen_logger.h>
+#include <oxenss/utils/affinity.hpp>
+#include <oxenss/utils/compression.hpp>
+#include <oxenss/utils/file.hpp>
+#include <oxenss/utils/memory.hpp>
 #include <oxenss/utils/string_utils.hpp>
 #include <oxenss/utils/random.hpp>
 
@@ -15,11 +20,14 @@
 #include <nlohmann/json.hpp>
 #include <oxenc/base32z.h>
 #include <oxenc/base64.h>
+#include <oxenc/bt_serialize.h>
 #include <oxenc/endian.h>
 #include <oxenc/hex.h>
 #include <oxenmq/oxenmq.h>
 
 #include <algorithm>
+#include <iterator>
+#include <limits>
 
 using json = nlohmann::json;
 
@@ -35,32 +43,70 @@ using MISSING_PUBKEY_THRESHOLD = std::ratio<3, 100>;
 /// TODO: there should be config.h to store constants like these
 constexpr std::chrono::seconds OXEND_PING_INTERVAL = 30s;
 
+// Names of all client RPC endpoints, for the per-endpoint stats
+static std::vector<std::string_view> client_rpc_names() {
+    std::vector<std::string_view> names;
+    for (const auto& method : rpc::client_rpc_methods)
+        names.push_back(method.name);
+    return names;
+}
+
 ServiceNode::ServiceNode(
         sn_record address,
         const crypto::legacy_seckey& skey,
         server::OMQ& omq_server,
         const std::filesystem::path& db_location,
+        const size_t db_shards,
+        const size_t db_cold_threshold,
+        const bool db_online_migration,
+        const db_tuning& tuning,
+        const db_eviction& eviction,
         const bool force_start) :
         force_start_{force_start},
-        db_{std::make_unique<Database>(db_location)},
+        db_{std::make_unique<Database>(
+                db_location,
+                db_shards,
+                db_cold_threshold,
+                db_online_migration,
+                tuning,
+                eviction)},
+        snapshot_path_{db_location / "swarm-snapshot"},
         our_address_{std::move(address)},
         our_seckey_{skey},
         omq_server_{omq_server},
-        all_stats_{*omq_server} {
-    swarm_ = std::make_unique<Swarm>(our_address_);
+        all_stats_{*omq_server, client_rpc_names()},
+        relay_scheduler_{
+                [this](const sn_record& sn, const std::string& blob, auto done) {
+                    relay_data_reliable(blob, sn, std::move(done));
+                },
+                [this](const sn_record& sn, const auto& ranges, relay_position from) {
+                    return load_relay_chunk(sn, ranges, from);
+                }},
+        onion_queue_{
+                "onion",
+                std::clamp<size_t>(
+                        std::thread::hardware_concurrency() / 2, 2, ONION_QUEUE_MAX_THREADS),
+                ONION_QUEUE_SIZE} {
+    swarm_ = std::make_shared<const Swarm>(our_address_);
+
+    load_swarm_snapshot();
 
     log::info(logcat, "Requesting initial swarm state");
 
     omq_server->add_timer(
-            [this] {
-                std::lock_guard l{sn_mutex_};
-                db_->clean_expired();
-            },
-            Database::CLEANUP_PERIOD);
+            [this] { db_->clean_expired(Database::EXPIRY_TIME_BUDGET); }, Database::CLEANUP_PERIOD);
+
+    if (db_->migrating())
+        omq_server->add_timer(
+                [this] { db_->migrate_pending(Database::MIGRATION_TIME_BUDGET); },
+                Database::MIGRATION_PERIOD);
+
+    omq_server_->add_timer([this] { relay_scheduler_.tick(); }, RELAY_TICK_INTERVAL);
 
     // Periodically clean up any https request futures
     omq_server_->add_timer(
             [this] {
+                std::lock_guard lock{outstanding_https_mutex_};
                 outstanding_https_reqs_.remove_if(
                         [](auto& f) { return f.wait_for(0ms) == std::future_status::ready; });
             },
@@ -89,6 +135,15 @@ void ServiceNode::on_oxend_connected() {
     oxend_ping();
     omq_server_->add_timer([this] { oxend_ping(); }, OXEND_PING_INTERVAL);
     omq_server_->add_timer([this] { ping_peers(); }, reachability_testing::TESTING_TIMER_INTERVAL);
+    omq_server_->add_timer([this] { send_reachability_reports(); }, REACHABILITY_REPORT_INTERVAL);
+
+    if (std::unique_lock lock{sn_mutex_}; snapshot_sns_) {
+        // We can already serve from the snapshot: oxend's update gets applied whenever it arrives.
+        omq_server_->set_active_sns(std::move(*snapshot_sns_));
+        snapshot_sns_.reset();
+        log::info(logcat, "Serving from the saved swarm snapshot until oxend sends a block update");
+        return;
+    }
 
     std::unique_lock lock{first_response_mutex_};
     while (true) {
@@ -110,19 +165,76 @@ static T get_or(const json& j, std::string_view key, std::common_type_t<T> defau
     return default_val;
 }
 
-static block_update parse_swarm_update(const std::string& response_body) {
-    if (response_body.empty()) {
-        log::critical(logcat, "Bad oxend rpc response: no response body");
-        throw std::runtime_error("Failed to parse swarm update");
-    }
+namespace {
+    // Collects the service node entries of a get_service_nodes response into a block_update.
+    struct swarm_update_builder {
+        block_update bu;
+        // map (not unordered_map) because we need the eventual swarm list to be sorted
+        std::map<swarm_id_t, std::vector<sn_record>> swarm_map;
+        int missing_aux_pks = 0, total = 0;
+
+        // Called for each funded node: `pk_ed25519` and `pk_x25519` are empty if oxend doesn't
+        // have them; `make_record` parses the rest of the node info into an sn_record.
+        template <typename F>
+        void add(
+                std::string_view pk,
+                std::string_view pk_ed25519,
+                std::string_view pk_x25519,
+                F&& make_record,
+                swarm_id_t swarm_id) {
+            total++;
+            if (pk_x25519.empty() || pk_ed25519.empty()) {
+                // These will always either both be present or neither present.  If they are
+                // missing there isn't much we can do: it means the remote hasn't transmitted
+                // them yet (or our local oxend hasn't received them yet).
+                missing_aux_pks++;
+                log::debug(
+                        logcat,
+                        "ed25519/x25519 pubkeys are missing from service node info {}",
+                        pk.size() == 32 ? oxenc::to_hex(pk) : std::string{pk});
+                return;
+            }
 
-    // map (not unordered_map) because we need the eventual swarm list to be sorted
-    std::map<swarm_id_t, std::vector<sn_record>> swarm_map;
-    block_update bu;
+            sn_record sn = make_record();
+
+            /// Storing decommissioned nodes (with dummy swarm id) in
+            /// a separate data structure as it seems less error prone
+            if (swarm_id == INVALID_SWARM_ID) {
+                bu.decommissioned_nodes.push_back(std::move(sn));
+            } else {
+                bu.active_x25519_pubkeys.emplace(sn.pubkey_x25519.view());
 
-    log::trace(logcat, "swarm response: <{}>", response_body);
+                swarm_map[swarm_id].push_back(std::move(sn));
+            }
+        }
 
-    try {
+        block_update finish() {
+            if (missing_aux_pks >
+                MISSING_PUBKEY_THRESHOLD::num * total / MISSING_PUBKEY_THRESHOLD::den) {
+                log::warning(
+                        logcat,
+                        "Missing ed25519/x25519 pubkeys for {}/{} service nodes; "
+                        "oxend may be out of sync with the network",
+                        missing_aux_pks,
+                        total);
+            }
+
+            for (auto& [swarm_id, snodes] : swarm_map)
+                bu.swarms.push_back(SwarmInfo{swarm_id, std::move(snodes)});
+
+            return std::move(bu);
+        }
+    };
+
+    // Loads a pubkey from a bt-encoded response, where it is given as raw bytes (we also accept
+    // hex, which is what older oxends send).
+    template <typename Key>
+    Key pubkey_from_bt(std::string_view v) {
+        return v.size() == Key{}.size() ? Key::from_bytes(v) : Key::from_hex(v);
+    }
+
+    void parse_swarm_update_json(std::string_view response_body, swarm_update_builder& b) {
+        auto& bu = b.bu;
         json result = json::parse(response_body, nullptr, true);
 
         bu.height = result.at("height").get<uint64_t>();
@@ -131,11 +243,9 @@ static block_update parse_swarm_update(const std::string& response_body) {
         bu.snode_revision = get_or<int>(result, "snode_revision", 0);
         bu.unchanged = get_or<bool>(result, "unchanged", false);
         if (bu.unchanged)
-            return bu;
-
-        const json service_node_states = result.at("service_node_states");
+            return;
 
-        int missing_aux_pks = 0, total = 0;
+        const json& service_node_states = result.at("service_node_states");
 
         for (const auto& sn_json : service_node_states) {
             /// We want to include (test) decommissioned nodes, but not
@@ -144,64 +254,148 @@ static block_update parse_swarm_update(const std::string& response_body) {
                 continue;
             }
 
-            total++;
             const auto& pk_hex = sn_json.at("service_node_pubkey").get_ref<const std::string&>();
 
             const auto pk_x25519_hex = sn_json.value<std::string>("pubkey_x25519", "");
             const auto pk_ed25519_hex = sn_json.value<std::string>("pubkey_ed25519", "");
 
-            if (pk_x25519_hex.empty() || pk_ed25519_hex.empty()) {
-                // These will always either both be present or neither present.  If they are
-                // missing there isn't much we can do: it means the remote hasn't transmitted
-                // them yet (or our local oxend hasn't received them yet).
-                missing_aux_pks++;
-                log::debug(
-                        logcat,
-                        "ed25519/x25519 pubkeys are missing from service node info {}",
-                        pk_hex);
-                continue;
-            }
+            b.add(
+                    pk_hex,
+                    pk_ed25519_hex,
+                    pk_x25519_hex,
+                    [&] {
+                        return sn_record{
+                                sn_json.at("public_ip").get_ref<const std::string&>(),
+                                sn_json.at("storage_port").get<uint16_t>(),
+                                sn_json.at("storage_lmq_port").get<uint16_t>(),
+                                crypto::legacy_pubkey::from_hex(pk_hex),
+                                crypto::ed25519_pubkey::from_hex(pk_ed25519_hex),
+                                crypto::x25519_pubkey::from_hex(pk_x25519_hex)};
+                    },
+                    sn_json.at("swarm_id").get<swarm_id_t>());
+        }
+    }
 
-            auto sn = sn_record{
-                    sn_json.at("public_ip").get_ref<const std::string&>(),
-                    sn_json.at("storage_port").get<uint16_t>(),
-                    sn_json.at("storage_lmq_port").get<uint16_t>(),
-                    crypto::legacy_pubkey::from_hex(pk_hex),
-                    crypto::ed25519_pubkey::from_hex(pk_ed25519_hex),
-                    crypto::x25519_pubkey::from_hex(pk_x25519_hex)};
+    // Parses one service_node_states entry of a bt-encoded response.  The fields are the same as
+    // the json version, except that bools are integers and pubkeys are bytes.
+    void parse_sn_state_bt(oxenc::bt_dict_consumer sn, swarm_update_builder& b) {
+        std::optional<bool> funded;
+        std::optional<std::string_view> pk, ip;
+        std::string_view pk_ed25519, pk_x25519;
+        std::optional<uint16_t> port, omq_port;
+        std::optional<swarm_id_t> swarm_id;
+        while (!sn.is_finished()) {
+            auto key = sn.key();
+            if (key == "funded")
+                funded = sn.consume_integer<int>() != 0;
+            else if (key == "public_ip")
+                ip = sn.consume_string_view();
+            else if (key == "pubkey_ed25519")
+                pk_ed25519 = sn.consume_string_view();
+            else if (key == "pubkey_x25519")
+                pk_x25519 = sn.consume_string_view();
+            else if (key == "service_node_pubkey")
+                pk = sn.consume_string_view();
+            else if (key == "storage_lmq_port")
+                omq_port = sn.consume_integer<uint16_t>();
+            else if (key == "storage_port")
+                port = sn.consume_integer<uint16_t>();
+            else if (key == "swarm_id")
+                swarm_id = sn.consume_integer<swarm_id_t>();
+            else
+                sn.skip_value();
+        }
 
-            const swarm_id_t swarm_id = sn_json.at("swarm_id").get<swarm_id_t>();
+        if (!funded)
+            throw std::runtime_error{"service node entry without funded"};
+        if (!*funded)
+            return;
+        if (!pk || !swarm_id)
+            throw std::runtime_error{"service node entry without service_node_pubkey/swarm_id"};
+
+        b.add(
+                *pk,
+                pk_ed25519,
+                pk_x25519,
+                [&] {
+                    if (!ip || !port || !omq_port)
+                        throw std::runtime_error{"service node entry without ip/ports"};
+                    return sn_record{
+                            std::string{*ip},
+                            *port,
+                            *omq_port,
+                            pubkey_from_bt<crypto::legacy_pubkey>(*pk),
+                            pubkey_from_bt<crypto::ed25519_pubkey>(pk_ed25519),
+                            pubkey_from_bt<crypto::x25519_pubkey>(pk_x25519)};
+                },
+                *swarm_id);
+    }
 
-            /// Storing decommissioned nodes (with dummy swarm id) in
-            /// a separate data structure as it seems less error prone
-            if (swarm_id == INVALID_SWARM_ID) {
-                bu.decommissioned_nodes.push_back(std::move(sn));
+    void parse_swarm_update_bt(std::string_view response_body, swarm_update_builder& b) {
+        auto& bu = b.bu;
+        oxenc::bt_dict_consumer result{response_body};
+        bool got_height = false, got_hash = false, got_hf = false, got_states = false;
+        bu.snode_revision = 0;
+        while (!result.is_finished()) {
+            auto key = result.key();
+            if (key == "block_hash") {
+                // Keep this as hex, as in the json response: the tester/testee derivation uses it
+                auto hash = result.consume_string_view();
+                bu.block_hash = hash.size() == 32 ? oxenc::to_hex(hash) : std::string{hash};
+                got_hash = true;
+            } else if (key == "hardfork") {
+                bu.hardfork = result.consume_integer<int>();
+                got_hf = true;
+            } else if (key == "height") {
+                bu.height = result.consume_integer<uint64_t>();
+                got_height = true;
+            } else if (key == "service_node_states") {
+                auto states = result.consume_list_consumer();
+                while (!states.is_finished())
+                    parse_sn_state_bt(states.consume_dict_consumer(), b);
+                got_states = true;
+            } else if (key == "snode_revision") {
+                bu.snode_revision = result.consume_integer<int>();
+            } else if (key == "unchanged") {
+                bu.unchanged = result.consume_integer<int>() != 0;
             } else {
-                bu.active_x25519_pubkeys.emplace(sn.pubkey_x25519.view());
-
-                swarm_map[swarm_id].push_back(std::move(sn));
+                result.skip_value();
             }
         }
+        if (!(got_height && got_hash && got_hf))
+            throw std::runtime_error{"response is missing height/block_hash/hardfork"};
+        if (!bu.unchanged && !got_states)
+            throw std::runtime_error{"response is missing service_node_states"};
+    }
+}  // namespace
 
-        if (missing_aux_pks >
-            MISSING_PUBKEY_THRESHOLD::num * total / MISSING_PUBKEY_THRESHOLD::den) {
-            log::warning(
-                    logcat,
-                    "Missing ed25519/x25519 pubkeys for {}/{} service nodes; "
-                    "oxend may be out of sync with the network",
-                    missing_aux_pks,
-                    total);
-        }
-    } catch (const std::exception& e) {
-        log::critical(logcat, "Bad oxend rpc response: invalid json ({})", e.what());
+// Parses a get_service_nodes response, which can be either json or bt-encoded (depending on how
+// we made the request).
+static block_update parse_swarm_update(std::string_view response_body) {
+    if (response_body.empty()) {
+        log::critical(logcat, "Bad oxend rpc response: no response body");
         throw std::runtime_error("Failed to parse swarm update");
     }
 
-    for (auto const& swarm : swarm_map) {
-        bu.swarms.emplace_back(SwarmInfo{swarm.first, swarm.second});
+    log::trace(logcat, "swarm response: <{}>", logging::lazy([&] {
+                   return response_body.front() == 'd' ? oxenc::to_hex(response_body)
+                                                     : std::string{response_body};
+               }));
+
+    swarm_update_builder b;
+    try {
+        if (response_body.front() == 'd')
+            parse_swarm_update_bt(response_body, b);
+        else
+            parse_swarm_update_json(response_body, b);
+    } catch (const std::exception& e) {
+        log::critical(logcat, "Bad oxend rpc response: invalid response ({})", e.what());
+        throw std::runtime_error("Failed to parse swarm update");
     }
+    if (b.bu.unchanged)
+        return std::move(b.bu);
 
-    return bu;
+    return b.finish();
 }
 
 void ServiceNode::bootstrap_data() {
@@ -329,17 +523,21 @@ void ServiceNode::bootstrap_data() {
 
 void ServiceNode::shutdown() {
     shutting_down_ = true;
+    relay_scheduler_.stop();
+    onion_queue_.stop();
 }
 
 bool ServiceNode::snode_ready(std::string* reason) {
+    return snode_ready(swarm().get(), reason);
+}
+
+bool ServiceNode::snode_ready(const Swarm* swarm, std::string* reason) {
     if (shutting_down()) {
         if (reason)
             *reason = "shutting down";
         return false;
     }
 
-    std::lock_guard guard(sn_mutex_);
-
     std::vector<std::string> problems;
 
     if (!hf_at_least(STORAGE_SERVER_HARDFORK))
@@ -347,7 +545,7 @@ bool ServiceNode::snode_ready(std::string* reason) {
                 "not yet on hardfork {}.{}",
                 STORAGE_SERVER_HARDFORK.first,
                 STORAGE_SERVER_HARDFORK.second));
-    if (!swarm_ || !swarm_->is_valid())
+    if (!swarm || !swarm->is_valid())
         problems.push_back("not in any swarm");
     if (syncing_)
         problems.push_back("not done syncing");
@@ -375,16 +573,28 @@ void ServiceNode::send_onion_to_sn(
             omq_server_.encode_onion_data(payload, data));
 }
 
-void ServiceNode::relay_data_reliable(const std::string& blob, const sn_record& sn) const {
+void ServiceNode::relay_data_reliable(
+        const std::string& blob, const sn_record& sn, std::function<void(bool)> done) const {
     log::debug(
             logcat, "Relaying data to: {} (x25519 pubkey {})", sn.pubkey_legacy, sn.pubkey_x25519);
 
     omq_server_->request(
             sn.pubkey_x25519.view(),
             "sn.data",
-            [](bool success, auto&& /*data*/) {
-                if (!success)
-                    log::error(logcat, "Failed to relay batch data: timeout");
+            [this, pk = sn.pubkey_legacy, done = std::move(done)](bool success, auto&& data) {
+                if (!success) {
+                    log::warning(logcat, "Failed to relay batch data to {}: timeout", pk);
+                    all_stats_.record_push_failed(pk);
+                } else if (!data.empty()) {
+                    // Newer peers reply with the newest serialization version they accept
+                    int version = 0;
+                    if (util::parse_int(data.front(), version) && version > 0) {
+                        std::lock_guard lock{relay_versions_mutex_};
+                        relay_versions_[pk] = static_cast<uint8_t>(
+                                std::min<int>(version, SERIALIZATION_VERSION_LATEST));
+                    }
+                }
+                done(success);
             },
             blob);
 }
@@ -402,10 +612,11 @@ void ServiceNode::record_retrieve_request() {
 }
 
 bool ServiceNode::process_store(message msg, bool* new_msg) {
-    std::lock_guard guard{sn_mutex_};
+    // NB: no sn_mutex_ lock here: the database is safe to use concurrently, and this way stores
+    // don't have to wait behind swarm updates.
 
     /// only accept a message if we are in a swarm
-    if (!swarm_) {
+    if (!swarm()) {
         // This should never be printed now that we have "snode_ready"
         log::error(logcat, "error: my swarm in not initialized");
         return false;
@@ -413,12 +624,17 @@ bool ServiceNode::process_store(message msg, bool* new_msg) {
 
     all_stats_.bump_store_requests();
 
-    /// store in the database (if not already present)
-    auto stored = db_->store(msg);
+    /// store in the database (if not already present).  The database's retrieve cache and the
+    /// notifications share the one copy of the message.
+    auto shared = std::make_shared<const message>(std::move(msg));
+    auto stored = db_->store(shared);
     if (stored) {
-        log::trace(logcat, *stored ? "saved message: {}" : "message already exists: {}", msg.data);
+        log::trace(
+                logcat,
+                *stored ? "saved message: {}" : "message already exists: {}",
+                shared->data);
         if (*stored)
-            omq_server_.send_notifies(std::move(msg));
+            omq_server_.send_notifies(std::move(shared));
     }
     if (new_msg)
         *new_msg = stored.value_or(false);
@@ -426,24 +642,13 @@ bool ServiceNode::process_store(message msg, bool* new_msg) {
     return true;
 }
 
-void ServiceNode::save_bulk(const std::vector<message>& msgs) {
-    std::lock_guard guard(sn_mutex_);
-
-    try {
-        db_->bulk_store(msgs);
-    } catch (const std::exception& e) {
-        log::error(logcat, "failed to save batch to the database: {}", e.what());
-        return;
-    }
-
-    log::trace(logcat, "saved messages count: {}", msgs.size());
-}
-
 void ServiceNode::on_bootstrap_update(block_update&& bu) {
     // Used in a callback to needs a mutex even if it is private
     std::lock_guard guard(sn_mutex_);
 
-    swarm_->apply_swarm_changes(std::move(bu.swarms));
+    auto swarm = std::make_shared<Swarm>(*swarm_);
+    swarm->apply_swarm_changes(std::move(bu.swarms));
+    set_swarm(std::move(swarm));
     target_height_ = std::max(target_height_, bu.height);
 
     if (syncing_)
@@ -470,6 +675,62 @@ static SnodeStatus derive_snode_status(const block_update& bu, const sn_record&
     return SnodeStatus::UNSTAKED;
 }
 
+void ServiceNode::load_swarm_snapshot() {
+    std::lock_guard lock{sn_mutex_};
+
+    std::pair<block_update, std::chrono::system_clock::time_point> snapshot;
+    try {
+        if (!std::filesystem::exists(snapshot_path_))
+            return;
+        snapshot = parse_swarm_snapshot(util::slurp_file(snapshot_path_));
+    } catch (const std::exception& e) {
+        log::warning(logcat, "Ignoring unreadable swarm snapshot {}: {}", snapshot_path_, e.what());
+        return;
+    }
+    auto& [bu, taken] = snapshot;
+
+    if (auto age = std::chrono::system_clock::now() - taken; age > SWARM_SNAPSHOT_MAX_AGE) {
+        log::info(
+                logcat,
+                "Not using swarm snapshot from {} ago; waiting for oxend",
+                util::friendly_duration(age));
+        return;
+    }
+
+    hf_revision hf{bu.hardfork, bu.snode_revision};
+    auto swarm = std::make_shared<Swarm>(*swarm_);
+    const SwarmEvents events = swarm->derive_swarm_events(bu.swarms);
+    swarm->set_swarm_id(events.our_swarm_id);
+    if (!swarm->is_valid() || hf < STORAGE_SERVER_HARDFORK) {
+        log::info(logcat, "Not using swarm snapshot: we were not active in a swarm");
+        return;
+    }
+
+    hardfork_ = hf;
+    block_height_ = bu.height;
+    block_hash_ = bu.block_hash;
+    block_hashes_cache_.insert_or_assign(bu.height, bu.block_hash);
+    status_ = derive_snode_status(bu, our_address_);
+    swarm->update_state(std::move(bu.swarms), bu.decommissioned_nodes, events, true);
+    set_swarm(std::move(swarm));
+    snapshot_sns_ = std::move(bu.active_x25519_pubkeys);
+    syncing_ = false;
+    active_ = true;
+
+    log::info(logcat, "Loaded swarm snapshot at height {}, swarm {}", bu.height, events.our_swarm_id);
+}
+
+void ServiceNode::save_swarm_snapshot(const block_update& bu) const {
+    auto tmp = snapshot_path_;
+    tmp += ".tmp";
+    try {
+        util::dump_file(tmp, serialize_swarm_snapshot(bu, std::chrono::system_clock::now()));
+        std::filesystem::rename(tmp, snapshot_path_);
+    } catch (const std::exception& e) {
+        log::warning(logcat, "Failed to save swarm snapshot {}: {}", snapshot_path_, e.what());
+    }
+}
+
 void ServiceNode::on_swarm_update(block_update&& bu) {
     hf_revision net_ver{bu.hardfork, bu.snode_revision};
     if (hardfork_ != net_ver) {
@@ -503,6 +764,7 @@ void ServiceNode::on_swarm_update(block_update&& bu) {
 
         block_height_ = bu.height;
         block_hash_ = bu.block_hash;
+        save_swarm_snapshot(bu);
 
         while (block_hashes_cache_.size() >= BLOCK_HASH_CACHE_SIZE)
             block_hashes_cache_.erase(block_hashes_cache_.begin());
@@ -516,7 +778,19 @@ void ServiceNode::on_swarm_update(block_update&& bu) {
 
     omq_server_->set_active_sns(std::move(bu.active_x25519_pubkeys));
 
-    const SwarmEvents events = swarm_->derive_swarm_events(bu.swarms);
+    // Most blocks don't change the service node list at all, in which case there's nothing to
+    // re-derive and we can keep sharing the current swarm state (we still need new tester/testee
+    // pairs for the new block hash, though).
+    if (swarm_->is_current(bu.swarms, bu.decommissioned_nodes) && snode_ready(swarm_.get())) {
+        log::debug(logcat, "Service node list unchanged at height {}", bu.height);
+        update_test_pairs();
+        return;
+    }
+
+    // We build the updated swarm state in a copy and then publish it once we're done.
+    auto swarm = std::make_shared<Swarm>(*swarm_);
+
+    const SwarmEvents events = swarm->derive_swarm_events(bu.swarms);
 
     // TODO: check our node's state
 
@@ -527,12 +801,13 @@ void ServiceNode::on_swarm_update(block_update&& bu) {
         status_ = status;
     }
 
-    swarm_->set_swarm_id(events.our_swarm_id);
+    swarm->set_swarm_id(events.our_swarm_id);
 
-    if (std::string reason; !snode_ready(&reason)) {
+    if (std::string reason; !snode_ready(swarm.get(), &reason)) {
         log::warning(logcat, "Storage server is still not ready: {}", reason);
-        swarm_->update_state(
+        swarm->update_state(
                 std::move(bu.swarms), std::move(bu.decommissioned_nodes), events, false);
+        set_swarm(std::move(swarm));
         return;
     } else {
         if (!active_) {
@@ -544,10 +819,11 @@ void ServiceNode::on_swarm_update(block_update&& bu) {
         }
     }
 
-    swarm_->update_state(std::move(bu.swarms), std::move(bu.decommissioned_nodes), events, true);
+    swarm->update_state(std::move(bu.swarms), std::move(bu.decommissioned_nodes), events, true);
+    set_swarm(std::move(swarm));
 
     if (!events.new_snodes.empty()) {
-        relay_messages(db_->retrieve_all(), events.new_snodes);
+        relay_all_messages(events.new_snodes);
     }
 
     if (!events.new_swarms.empty()) {
@@ -592,14 +868,28 @@ void ServiceNode::update_swarms() {
     if (got_first_response_ && !block_hash_.empty())
         params["poll_block_hash"] = block_hash_;
 
+    // We ask for a bt-encoded response (by making a bt-encoded request), which is both smaller
+    // and much cheaper to parse than json, unless oxend has previously refused to give us one.
+    const bool bt = oxend_bt_;
+
     omq_server_.oxend_request(
             "rpc.get_service_nodes",
-            [this](bool success, std::vector<std::string> data) {
+            [this, bt](bool success, std::vector<std::string> data) {
                 updating_swarms_ = false;
                 if (!success || data.size() < 2) {
                     log::critical(logcat, "Failed to contact local oxend for service node list");
                     return;
                 }
+                if (bt && (data[0] != "200" || data[1].empty() || data[1].front() != 'd')) {
+                    log::warning(
+                            logcat,
+                            "oxend did not accept a bt-encoded service node request ({}); "
+                            "falling back to json",
+                            data[0]);
+                    std::lock_guard lock{sn_mutex_};
+                    oxend_bt_ = false;
+                    return;
+                }
                 try {
                     std::lock_guard lock{sn_mutex_};
                     block_update bu = parse_swarm_update(data[1]);
@@ -632,7 +922,9 @@ void ServiceNode::update_swarms() {
                                                     "Pre-loaded hash {} for height {}",
                                                     hash,
                                                     h);
+                                            std::lock_guard lock{sn_mutex_};
                                             block_hashes_cache_.insert_or_assign(h, hash);
+                                            update_test_pairs();
                                         }
                                     },
                                     "{\"height\":[" + util::int_to_string(h) + "]}");
@@ -678,7 +970,7 @@ void ServiceNode::update_swarms() {
                     log::error(logcat, "Exception caught on swarm update: {}", e.what());
                 }
             },
-            params.dump());
+            bt ? server::bt_serialize_json(params) : params.dump());
 }
 
 void ServiceNode::update_last_ping(ReachType type) {
@@ -686,11 +978,10 @@ void ServiceNode::update_last_ping(ReachType type) {
 }
 
 void ServiceNode::ping_peers() {
-    std::lock_guard lock{sn_mutex_};
-
     // TODO: Don't do anything until we are fully funded
 
-    if (status_ == SnodeStatus::UNSTAKED || status_ == SnodeStatus::UNKNOWN) {
+    const SnodeStatus status = status_;
+    if (status == SnodeStatus::UNSTAKED || status == SnodeStatus::UNKNOWN) {
         log::trace(logcat, "Skipping peer testing (unstaked)");
         return;
     }
@@ -700,21 +991,25 @@ void ServiceNode::ping_peers() {
     // Check if we've been tested (reached) recently ourselves
     reach_records_.check_incoming_tests(now);
 
-    if (status_ == SnodeStatus::DECOMMISSIONED) {
+    if (status == SnodeStatus::DECOMMISSIONED) {
         log::trace(logcat, "Skipping peer testing (decommissioned)");
         return;
     }
 
-    /// We always test nodes due to be tested plus one general, non-failing node.
+    /// We test nodes due to be tested plus one general, non-failing node, as far as the limit
+    /// on tests in flight allows.
 
-    auto to_test = reach_records_.get_failing(*swarm_, now);
-    if (auto rando = reach_records_.next_random(*swarm_, now))
-        to_test.emplace_back(std::move(*rando), 0);
+    auto swarm = this->swarm();
+    auto to_test = reach_records_.start_tests(*swarm, now);
 
     if (to_test.empty())
         log::trace(logcat, "no nodes to test this tick");
     else
-        log::debug(logcat, "{} nodes to test", to_test.size());
+        log::debug(
+                logcat,
+                "{} nodes to test ({} tests in flight)",
+                to_test.size(),
+                reach_records_.in_flight());
     for (const auto& [sn, prev_fails] : to_test)
         test_reachability(sn, prev_fails);
 }
@@ -732,6 +1027,7 @@ void ServiceNode::test_reachability(const sn_record& sn, int previous_failures)
         // unnecessary since oxend will already fail the service node for not sending uptime
         // proofs.
         log::debug(logcat, "Skipping HTTPS test of {}: no public IP received yet");
+        reach_records_.test_done();
         return;
     }
 
@@ -753,7 +1049,7 @@ void ServiceNode::test_reachability(const sn_record& sn, int previous_failures)
     };
 
     log::debug(logcat, "Sending HTTPS ping to {} @ {}", sn.pubkey_legacy, url.str());
-    outstanding_https_reqs_.emplace_front(cpr::PostCallback(
+    auto https_req = cpr::PostCallback(
             [this, &omq = *omq_server(), test_results, previous_failures](cpr::Response r) {
                 auto& [sn, result] = *test_results;
                 auto& pk = sn.pubkey_legacy;
@@ -800,7 +1096,11 @@ void ServiceNode::test_reachability(const sn_record& sn, int previous_failures)
                     cpr::ssl::VerifyStatus{false}),
             cpr::Redirect{0L},
             std::move(headers),
-            std::move(body)));
+            std::move(body));
+    {
+        std::lock_guard lock{outstanding_https_mutex_};
+        outstanding_https_reqs_.push_front(std::move(https_req));
+    }
 
     // test omq port:
     omq_server_->request(
@@ -958,94 +1258,87 @@ void ServiceNode::send_storage_test_req(
 }
 
 void ServiceNode::report_reachability(const sn_record& sn, bool reachable, int previous_failures) {
-    auto cb = [sn_pk = sn.pubkey_legacy, reachable](bool success, std::vector<std::string> data) {
-        if (!success) {
-            log::warning(
-                    logcat,
-                    "Could not report node status: {}",
-                    data.empty() ? "unknown reason" : data[0]);
-            return;
-        }
+    reach_records_.test_done();
 
-        if (data.size() < 2 || data[1].empty()) {
-            log::warning(logcat, "Empty body on Oxend report node status");
-            return;
-        }
+    {
+        std::lock_guard lock{reach_reports_mutex_};
+        reach_reports_[sn.pubkey_legacy] = reachable;
+    }
 
-        try {
-            const auto status = json::parse(data[1]).at("status").get<std::string>();
+    if (!reachable)
+        reach_records_.add_failing_node(sn.pubkey_legacy, previous_failures);
+    else if (previous_failures > 0)
+        reach_records_.remove_node_from_failing(sn.pubkey_legacy);
+}
 
-            if (status == "OK") {
-                log::debug(
+void ServiceNode::send_reachability_reports() {
+    decltype(reach_reports_) reports;
+    {
+        std::lock_guard lock{reach_reports_mutex_};
+        reports.swap(reach_reports_);
+    }
+    if (reports.empty())
+        return;
+
+    // oxend takes results one node at a time, so a batch is a burst of report_peer_status
+    // requests; what we save is a request for each repeated result within the batch window.
+    log::debug(logcat, "Reporting reachability of {} nodes to oxend", reports.size());
+    for (const auto& [pk, reachable] : reports) {
+        auto cb = [sn_pk = pk, reachable = reachable](
+                          bool success, std::vector<std::string> data) {
+            if (!success) {
+                log::warning(
                         logcat,
-                        "Successfully reported {} node: {}",
-                        reachable ? "reachable" : "UNREACHABLE",
-                        sn_pk);
-            } else {
-                log::warning(logcat, "Could not report node: {}", status);
+                        "Could not report node status: {}",
+                        data.empty() ? "unknown reason" : data[0]);
+                return;
             }
-        } catch (...) {
-            log::error(logcat, "Could not report node status: bad json in response");
-        }
-    };
 
-    json params{{"type", "storage"}, {"pubkey", sn.pubkey_legacy.hex()}, {"passed", reachable}};
+            if (data.size() < 2 || data[1].empty()) {
+                log::warning(logcat, "Empty body on Oxend report node status");
+                return;
+            }
 
-    omq_server_.oxend_request("admin.report_peer_status", std::move(cb), params.dump());
+            try {
+                const auto status = json::parse(data[1]).at("status").get<std::string>();
 
-    if (!reachable || previous_failures > 0) {
-        std::lock_guard guard(sn_mutex_);
-        if (!reachable)
-            reach_records_.add_failing_node(sn.pubkey_legacy, previous_failures);
-        else
-            reach_records_.remove_node_from_failing(sn.pubkey_legacy);
+                if (status == "OK") {
+                    log::debug(
+                            logcat,
+                            "Successfully reported {} node: {}",
+                            reachable ? "reachable" : "UNREACHABLE",
+                            sn_pk);
+                } else {
+                    log::warning(logcat, "Could not report node: {}", status);
+                }
+            } catch (...) {
+                log::error(logcat, "Could not report node status: bad json in response");
+            }
+        };
+
+        json params{{"type", "storage"}, {"pubkey", pk.hex()}, {"passed", reachable}};
+        omq_server_.oxend_request("admin.report_peer_status", std::move(cb), params.dump());
     }
 }
 
-// Deterministically selects two random swarm members; returns the pair on success, nullopt on
-// failure.
-std::optional<std::pair<sn_record, sn_record>> ServiceNode::derive_tester_testee(
-        uint64_t blk_height) {
-    std::lock_guard guard(sn_mutex_);
-
-    std::vector<sn_record> members = swarm_->other_nodes();
-    members.push_back(our_address_);
-
+// Deterministically selects two random swarm members (of `members`, which includes us) from the
+// block hash; returns the pair on success, nullopt on failure.
+static std::optional<std::pair<sn_record, sn_record>> select_tester_testee(
+        std::vector<sn_record> members, const std::string& block_hash) {
     if (members.size() < 2) {
         log::trace(logcat, "Could not initiate peer test: swarm too small");
         return std::nullopt;
     }
 
-    std::sort(members.begin(), members.end(), [](const auto& a, const auto& b) {
-        return a.pubkey_legacy < b.pubkey_legacy;
-    });
-
-    std::string block_hash;
-    if (blk_height == block_height_) {
-        block_hash = block_hash_;
-    } else if (blk_height < block_height_) {
-        log::trace(
-                logcat,
-                "got storage test request for an older block: {}/{}",
-                blk_height,
-                block_height_);
-
-        if (auto it = block_hashes_cache_.find(blk_height); it != block_hashes_cache_.end()) {
-            block_hash = it->second;
-        } else {
-            log::debug(logcat, "Could not find hash for a given block height");
-            return std::nullopt;
-        }
-    } else {
-        log::debug(logcat, "Could not find hash: block height is in the future");
-        return std::nullopt;
-    }
-
     if (block_hash.size() < sizeof(uint64_t)) {
         log::error(logcat, "Could not initiate peer test: invalid block hash");
         return std::nullopt;
     }
 
+    std::sort(members.begin(), members.end(), [](const auto& a, const auto& b) {
+        return a.pubkey_legacy < b.pubkey_legacy;
+    });
+
     std::mt19937_64 mt{oxenc::load_little_to_host<uint64_t>(block_hash.data())};
     const auto tester_idx = util::uniform_distribution_portable(mt, members.size());
 
@@ -1057,21 +1350,59 @@ std::optional<std::pair<sn_record, sn_record>> ServiceNode::derive_tester_testee
     return std::make_pair(std::move(members[tester_idx]), std::move(members[testee_idx]));
 }
 
+void ServiceNode::update_test_pairs() {
+    auto pairs = std::make_shared<test_pairs>();
+    pairs->height = block_height_;
+
+    std::vector<sn_record> members;
+    if (auto swarm = this->swarm())
+        members = swarm->other_nodes();
+    members.push_back(our_address_);
+
+    for (const auto& [height, hash] : block_hashes_cache_)
+        pairs->pairs.emplace(height, select_tester_testee(members, hash));
+    // The current block is normally in the cache, too, but not necessarily (e.g. if it was
+    // evicted by a flood of pre-loaded hashes)
+    if (!block_hash_.empty() && !pairs->pairs.count(block_height_))
+        pairs->pairs.emplace(block_height_, select_tester_testee(members, block_hash_));
+
+    std::atomic_store(&test_pairs_, std::shared_ptr<const test_pairs>{std::move(pairs)});
+}
+
+std::optional<std::pair<sn_record, sn_record>> ServiceNode::derive_tester_testee(
+        uint64_t blk_height) {
+    auto pairs = std::atomic_load(&test_pairs_);
+
+    if (blk_height > pairs->height) {
+        log::debug(logcat, "Could not find hash: block height is in the future");
+        return std::nullopt;
+    }
+    if (blk_height < pairs->height)
+        log::trace(
+                logcat,
+                "got storage test request for an older block: {}/{}",
+                blk_height,
+                pairs->height);
+
+    auto it = pairs->pairs.find(blk_height);
+    if (it == pairs->pairs.end()) {
+        log::debug(logcat, "Could not find hash for a given block height");
+        return std::nullopt;
+    }
+    return it->second;
+}
+
 std::pair<MessageTestStatus, std::string> ServiceNode::process_storage_test_req(
         uint64_t blk_height,
         const crypto::legacy_pubkey& tester_pk,
         const std::string& msg_hash_hex) {
-    std::lock_guard guard(sn_mutex_);
+    // NB: no sn_mutex_ lock here: everything we need is in the test_pairs_ snapshot, and this way
+    // storage tests don't contend with swarm updates and the other things holding it.
 
     // 1. Check height, retry if we are behind
-    std::string block_hash;
-
-    if (blk_height > block_height_) {
+    if (auto height = std::atomic_load(&test_pairs_)->height; blk_height > height) {
         log::debug(
-                logcat,
-                "Our blockchain is behind, height: {}, requested: {}",
-                block_height_,
-                blk_height);
+                logcat, "Our blockchain is behind, height: {}, requested: {}", height, blk_height);
         return {MessageTestStatus::RETRY, ""};
     }
 
@@ -1098,11 +1429,11 @@ std::pair<MessageTestStatus, std::string> ServiceNode::process_storage_test_req(
     }
 
     // 3. If for a current/past block, try to respond right away
-    auto msg = db_->retrieve_by_hash(msg_hash_hex);
-    if (!msg)
+    auto data = db_->retrieve_payload(msg_hash_hex);
+    if (!data)
         return {MessageTestStatus::RETRY, ""};
 
-    return {MessageTestStatus::SUCCESS, std::move(msg->data)};
+    return {MessageTestStatus::SUCCESS, std::move(*data)};
 }
 
 void ServiceNode::initiate_peer_test() {
@@ -1143,67 +1474,121 @@ void ServiceNode::initiate_peer_test() {
     }
 }
 
-void ServiceNode::bootstrap_swarms(const std::vector<swarm_id_t>& swarms) const {
-    std::lock_guard guard(sn_mutex_);
-
-    if (swarms.empty())
-        log::info(logcat, "Bootstrapping all swarms");
-    else if (logcat->level() <= log::Level::info)
-        log::info(logcat, "Bootstrapping swarms: [{}]", util::join(", ", swarms));
-
-    const auto& all_swarms = swarm_->all_valid_swarms();
+relay_chunk ServiceNode::load_relay_chunk(
+        const sn_record& peer, const RelayScheduler::ranges_t& ranges, relay_position from) const {
+    uint8_t version = SERIALIZATION_VERSION_BT;
+    {
+        std::lock_guard lock{relay_versions_mutex_};
+        if (auto it = relay_versions_.find(peer.pubkey_legacy); it != relay_versions_.end())
+            version = it->second;
+    }
 
-    std::unordered_map<user_pubkey_t, swarm_id_t> pk_swarm_cache;
-    std::unordered_map<swarm_id_t, std::vector<message>> to_relay;
+    relay_chunk chunk;
+    auto hi = ranges[from.range].second;
+    if (version >= SERIALIZATION_VERSION_SNAPSHOT) {
+        // The peer can take the whole chunk as a database snapshot, which it merges in one go
+        // rather than storing message by message.
+        std::string image;
+        if (auto next = db_->export_snapshot(from.next, hi, SERIALIZATION_BATCH_SIZE, image))
+            chunk.next = relay_position{from.range, *next};
+        else if (from.range + 1 < ranges.size())
+            chunk.next = relay_position{from.range + 1, ranges[from.range + 1].first};
+        if (!image.empty())
+            chunk.batches.push_back(std::move(image));
+        log::debug(
+                logcat,
+                "Loaded a {}-byte snapshot to relay from [{}, {}]",
+                chunk.batches.empty() ? 0 : chunk.batches.front().size(),
+                from.next,
+                hi);
+        return chunk;
+    }
 
-    std::vector<message> all_entries = db_->retrieve_all();
-    log::debug(logcat, "We have {} messages", all_entries.size());
-    for (auto& entry : all_entries) {
-        if (!entry.pubkey) {
-            log::error(logcat, "Invalid pubkey in a message while bootstrapping other nodes");
-            continue;
+    std::vector<message> msgs;
+    size_t size = 2;  // l...e
+    uint64_t last_space = 0;
+    bool finished = db_->retrieve_by_swarm_space(from.next, hi, [&](message&& msg) {
+        if (!msg.pubkey) {
+            log::error(logcat, "Invalid pubkey in a message while relaying");
+            return true;
         }
-
-        auto [it, ins] = pk_swarm_cache.try_emplace(entry.pubkey);
-        if (ins) {
-            auto swarm = get_swarm_by_pk(all_swarms, entry.pubkey);
-            it->second = swarm ? swarm->swarm_id : INVALID_SWARM_ID;
+        auto space = msg.pubkey.swarm_space();
+        auto msg_size = serialized_size(msg);
+        // Only stop between accounts so that the next chunk can start at a swarm space value
+        // without skipping or repeating anything.
+        if (!msgs.empty() && space != last_space && size + msg_size > SERIALIZATION_BATCH_SIZE) {
+            chunk.next = relay_position{from.range, space};
+            return false;
         }
-        auto swarm_id = it->second;
-
-        if (swarms.empty() || std::find(swarms.begin(), swarms.end(), swarm_id) != swarms.end())
-            to_relay[swarm_id].push_back(std::move(entry));
-    }
-
-    log::trace(logcat, "Bootstrapping {} swarms", to_relay.size());
+        last_space = space;
+        size += msg_size;
+        msgs.push_back(std::move(msg));
+        return true;
+    });
+    if (finished && from.range + 1 < ranges.size())
+        chunk.next = relay_position{from.range + 1, ranges[from.range + 1].first};
 
-    std::unordered_map<swarm_id_t, size_t> swarm_id_to_idx;
-    for (size_t i = 0; i < all_swarms.size(); ++i)
-        swarm_id_to_idx.emplace(all_swarms[i].swarm_id, i);
+    if (!msgs.empty())
+        chunk.batches = serialize_messages(msgs.begin(), msgs.end(), version);
+    log::debug(
+            logcat,
+            "Loaded {} messages in {} batches to relay from [{}, {}]",
+            msgs.size(),
+            chunk.batches.size(),
+            from.next,
+            hi);
+    return chunk;
+}
 
-    for (const auto& [swarm_id, items] : to_relay)
-        relay_messages(items, all_swarms[swarm_id_to_idx[swarm_id]].snodes);
+void ServiceNode::relay_all_messages(const std::vector<sn_record>& snodes) const {
+    // New swarm members only need the accounts that belong to our swarm (we may still be holding
+    // messages for accounts that have moved elsewhere):
+    auto swarm = this->swarm();
+    auto ranges = swarm->swarm_space_ranges(swarm->our_swarm_id());
+    if (ranges.empty())
+        ranges.emplace_back(0, std::numeric_limits<uint64_t>::max());
+    for (const auto& sn : snodes)
+        relay_scheduler_.relay(sn, ranges);
+    log::debug(logcat, "Queued relays of our messages to {} new snodes", snodes.size());
 }
 
-void ServiceNode::relay_messages(
-        const std::vector<message>& messages, const std::vector<sn_record>& snodes) const {
-    std::vector<std::string> batches =
-            serialize_messages(messages.begin(), messages.end(), SERIALIZATION_VERSION_BT);
+void ServiceNode::bootstrap_swarms(const std::vector<swarm_id_t>& swarms) const {
+    if (swarms.empty())
+        log::info(logcat, "Bootstrapping all swarms");
+    else if (logcat->level() <= log::Level::info)
+        log::info(logcat, "Bootstrapping swarms: [{}]", util::join(", ", swarms));
 
-    if (logcat->level() <= log::Level::debug) {
-        log::debug(logcat, "Relayed messages:");
-        for (auto msg : batches)
-            log::debug(logcat, "    {}", msg);
-        log::debug(logcat, "To Snodes:");
-        for (auto sn : snodes)
-            log::debug(logcat, "    {}", sn.pubkey_legacy);
+    auto swarm = this->swarm();
+    const auto& all_swarms = swarm->all_valid_swarms();
 
-        log::debug(logcat, "Serialised batches: {}", batches.size());
+    // Each swarm only needs the accounts in the swarm space ranges that belong to it, and we can
+    // select exactly those from the database rather than working out the swarm of every message.
+    size_t bootstrapped = 0;
+    auto bootstrap = [&](const SwarmInfo& target) {
+        auto ranges = swarm->swarm_space_ranges(target.swarm_id);
+        if (ranges.empty())
+            return;
+        for (const auto& sn : target.snodes)
+            relay_scheduler_.relay(sn, ranges);
+        bootstrapped++;
+    };
+
+    if (swarms.empty()) {
+        for (const auto& target : all_swarms)
+            bootstrap(target);
+    } else {
+        for (auto swarm_id : swarms) {
+            auto it = std::lower_bound(
+                    all_swarms.begin(),
+                    all_swarms.end(),
+                    swarm_id,
+                    [](const SwarmInfo& s, swarm_id_t v) { return s.swarm_id < v; });
+            if (it != all_swarms.end() && it->swarm_id == swarm_id)
+                bootstrap(*it);
+        }
     }
 
-    for (const sn_record& sn : snodes)
-        for (auto& batch : batches)
-            relay_data_reliable(batch, sn);
+    log::debug(logcat, "Queued bootstrap relays for {} swarms", bootstrapped);
 }
 
 void to_json(nlohmann::json& j, const test_result& val) {
@@ -1217,8 +1602,10 @@ static nlohmann::json to_json(const all_stats_t& stats) {
         auto& p = peers[pk.hex()];
 
         p["requests_failed"] = stats.requests_failed;
-        p["pushes_failed"] = stats.requests_failed;
-        p["storage_tests"] = stats.storage_tests;
+        p["pushes_failed"] = stats.pushes_failed;
+        auto& tests = p["storage_tests"] = json::array();
+        for (const auto& t : stats.storage_tests)
+            tests.push_back(t);
     }
 
     auto [window, recent] = stats.get_recent_requests();
@@ -1241,6 +1628,58 @@ std::string ServiceNode::get_stats_for_session_client() const {
     return json{{"version", STORAGE_SERVER_VERSION_STRING}}.dump();
 }
 
+namespace {
+
+    // Converts a latency histogram into a json object with the total count and sum (in
+    // microseconds), plus the count of each bucket keyed by its upper bound in microseconds (the
+    // last being "inf").
+    json histogram_to_json(const util::latency_histogram::snapshot& h) {
+        json buckets = json::object();
+        for (size_t i = 0; i < h.counts.size(); i++)
+            buckets[i < util::latency_histogram::BUCKETS.size()
+                            ? std::to_string(util::latency_histogram::BUCKETS[i].count())
+                            : "inf"] = h.counts[i];
+        return {{"count", h.count},
+                {"sum_us", h.sum_us},
+                {"p50_us", h.quantile(0.5).count()},
+                {"p99_us", h.quantile(0.99).count()},
+                {"buckets", std::move(buckets)}};
+    }
+
+    // Appends a latency histogram, as a Prometheus histogram (in seconds) with the given name and
+    // labels, to `out`.
+    void histogram_to_prometheus(
+            std::string& out,
+            std::string_view name,
+            std::string_view labels,
+            const util::latency_histogram::snapshot& h) {
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < h.counts.size(); i++) {
+            cumulative += h.counts[i];
+            if (i < util::latency_histogram::BUCKETS.size())
+                fmt::format_to(
+                        std::back_inserter(out),
+                        "{}_bucket{{{},le=\"{}\"}} {}\n",
+                        name,
+                        labels,
+                        std::chrono::duration<double>(util::latency_histogram::BUCKETS[i])
+                                .count(),
+                        cumulative);
+            else
+                fmt::format_to(
+                        std::back_inserter(out),
+                        "{}_bucket{{{},le=\"+Inf\"}} {}\n",
+                        name,
+                        labels,
+                        cumulative);
+        }
+        fmt::format_to(
+                std::back_inserter(out), "{}_sum{{{}}} {}\n", name, labels, h.sum_us / 1e6);
+        fmt::format_to(std::back_inserter(out), "{}_count{{{}}} {}\n", name, labels, h.count);
+    }
+
+}  // namespace
+
 std::string ServiceNode::get_stats() const {
     auto val = to_json(all_stats_);
 
@@ -1252,9 +1691,231 @@ std::string ServiceNode::get_stats() const {
     val["db_used"] = db_->get_used_bytes();
     val["db_max"] = Database::SIZE_LIMIT;
 
+    auto st_stats = db_->get_statement_cache_stats();
+    val["db_statement_cache"] = {
+            {"hits", st_stats.hits},
+            {"misses", st_stats.misses},
+            {"evictions", st_stats.evictions},
+            {"cached", st_stats.cached},
+            {"prepare_time_us", st_stats.prepare_time.count()}};
+
+    auto io = db_->get_io_stats();
+    val["db_io"] = {
+            {"cache_used", io.cache_used},
+            {"cache_hits", io.cache_hits},
+            {"cache_misses", io.cache_misses},
+            {"cache_writes", io.cache_writes},
+            {"cache_spills", io.cache_spills},
+            {"checkpoints", io.checkpoints},
+            {"checkpointed", io.checkpointed},
+            {"checkpoint_busy", io.checkpoint_busy},
+            {"checkpoint_us", io.checkpoint_time.count()},
+            {"readers", io.readers},
+            {"journaled", io.journaled},
+            {"journal_syncs", io.journal_syncs},
+            {"journal_waiting", io.journal_waiting}};
+
+    auto rc = db_->get_retrieve_cache_stats();
+    val["db_retrieve_cache"] = {
+            {"hits", rc.hits},
+            {"misses", rc.misses},
+            {"hit_rate",
+             rc.hits + rc.misses > 0 ? static_cast<double>(rc.hits) / (rc.hits + rc.misses) : 0.0},
+            {"fills", rc.fills},
+            {"invalidations", rc.invalidations},
+            {"evictions", rc.evictions},
+            {"accounts", rc.accounts},
+            {"bytes", rc.bytes}};
+
+    auto hf = db_->get_hash_filter_stats();
+    val["db_hash_filter"] = {
+            {"lookups", hf.lookups},
+            {"skipped", hf.skipped},
+            {"false_positives", hf.false_positives},
+            {"false_positive_rate",
+             hf.false_positives + hf.skipped > 0
+                     ? static_cast<double>(hf.false_positives) / (hf.false_positives + hf.skipped)
+                     : 0.0},
+            {"entries", hf.entries},
+            {"capacity", hf.capacity},
+            {"bytes", hf.bytes},
+            {"rebuilds", hf.rebuilds}};
+
+    auto cold = db_->get_segment_stats();
+    val["db_cold"] = {
+            {"segments", cold.segments},
+            {"bytes", cold.bytes},
+            {"appended", cold.appended},
+            {"removed", cold.removed}};
+
+    auto expiry = db_->get_expiry_stats();
+    val["db_expiry"] = {
+            {"passes", expiry.passes},
+            {"deleted", expiry.deleted},
+            {"evicted", expiry.evicted},
+            {"over_quota", expiry.over_quota},
+            {"incomplete", expiry.incomplete},
+            {"last_deleted", expiry.last_deleted},
+            {"last_us", expiry.last_duration.count()},
+            {"max_us", expiry.max_duration.count()},
+            {"total_us", expiry.total_duration.count()}};
+
+    auto onion = onion_queue_.get_stats();
+    val["onion_queue"] = {
+            {"threads", onion.threads},
+            {"queued", onion.queued},
+            {"max_queued", onion.max_queued},
+            {"processed", onion.processed},
+            {"rejected", onion.rejected},
+            {"wait", histogram_to_json(onion.wait)},
+            {"run", histogram_to_json(onion.run)}};
+
+    auto shed = omq_server_.load_shedder().get_stats();
+    val["load_shedding"] = {
+            {"target_wait_ms", omq_server_.load_shedder().target().count()},
+            {"average_wait_us", shed.average_wait.count()},
+            {"shedding", shed.shedding},
+            {"shed", shed.shed},
+            {"episodes", shed.episodes}};
+
+    auto& rpc_latency = val["rpc_latency"] = json::object();
+    for (const auto& [method, lat] : all_stats_.rpc_latencies()) {
+        auto handler = lat.handler.get();
+        if (handler.count == 0)
+            continue;
+        rpc_latency[std::string{method}] = {
+                {"transport", histogram_to_json(lat.transport.get())},
+                {"queue", histogram_to_json(lat.queue.get())},
+                {"handler", histogram_to_json(handler)},
+                {"db", histogram_to_json(lat.db.get())}};
+    }
+
+    auto logs = logging::get_stats();
+    val["log"] = {{"written", logs.written}, {"dropped", logs.dropped}, {"queued", logs.queued}};
+
+    auto tls = server::get_tls_handshake_stats();
+    val["tls_handshakes"] = {{"full", tls.full}, {"resumed", tls.resumed}};
+
+    auto compression = util::get_compression_stats();
+    val["response_compression"] = {
+            {"compressed", compression.compressed},
+            {"bytes_in", compression.bytes_in},
+            {"bytes_out", compression.bytes_out}};
+
+    auto& memory = val["memory"] = json::object();
+    if (auto alloc = util::get_allocator_stats(); alloc.available) {
+        auto arenas = json::array();
+        for (const auto& a : alloc.arenas)
+            arenas.push_back(
+                    {{"index", a.index},
+                     {"threads", a.threads},
+                     {"small_allocated", a.small_allocated},
+                     {"large_allocated", a.large_allocated},
+                     {"active", a.active},
+                     {"dirty", a.dirty}});
+        memory["jemalloc"] = {
+                {"allocated", alloc.allocated},
+                {"active", alloc.active},
+                {"metadata", alloc.metadata},
+                {"resident", alloc.resident},
+                {"mapped", alloc.mapped},
+                {"retained", alloc.retained},
+                {"arenas", std::move(arenas)}};
+    }
+    auto dbmem = db_->get_memory_stats();
+    memory["sqlite"] = {
+            {"used", dbmem.sqlite_used},
+            {"highwater", dbmem.sqlite_highwater},
+            {"allocations", dbmem.sqlite_allocations},
+            {"page_cache", dbmem.page_cache},
+            {"statements", dbmem.statements},
+            {"schema", dbmem.schema}};
+    auto omqmem = omq_server_.get_memory_usage();
+    size_t outstanding_https;
+    {
+        std::lock_guard lock{outstanding_https_mutex_};
+        outstanding_https =
+                std::distance(outstanding_https_reqs_.begin(), outstanding_https_reqs_.end());
+    }
+    memory["tracked"] = {
+            {"monitors", omqmem.monitors},
+            {"retrieve_waiters", omqmem.retrieve_waiters},
+            {"forward_batches", omqmem.forward_batches},
+            {"rate_limiter", omqmem.rate_limiter},
+            {"retrieve_cache", dbmem.retrieve_cache},
+            {"hash_filters", dbmem.hash_filters},
+            {"owner_caches", dbmem.owner_caches},
+            {"ingest_journal", dbmem.journal}};
+    // (A count: the size of each depends on the request and its response)
+    memory["outstanding_https_requests"] = outstanding_https;
+
+    auto& threads = val["threads"] = json::array();
+    for (const auto& t : util::thread_cpu_times())
+        threads.push_back(
+                {{"tid", t.tid},
+                 {"name", t.name},
+                 {"user_ms", t.user.count()},
+                 {"system_ms", t.system.count()},
+                 {"last_cpu", t.last_cpu}});
+
+    auto& relays = val["relays"] = json::object();
+    for (const auto& [pk, r] : relay_scheduler_.get_stats())
+        relays[pk.hex()] = {
+                {"relays", r.relays},
+                {"queued", r.queued},
+                {"in_flight", r.in_flight},
+                {"sent", r.sent},
+                {"sent_bytes", r.sent_bytes},
+                {"failures", r.failures},
+                {"abandoned", r.abandoned},
+                {"resumed", r.resumed},
+                {"progress", r.progress}};
+
     return val.dump();
 }
 
+std::string ServiceNode::get_metrics() const {
+    std::string out;
+    auto out_it = std::back_inserter(out);
+
+    out += "# TYPE oxenss_rpc_latency_seconds histogram\n";
+    for (const auto& [method, lat] : all_stats_.rpc_latencies()) {
+        auto handler = lat.handler.get();
+        if (handler.count == 0)
+            continue;
+        for (auto [phase, h] :
+             {std::pair{"transport", lat.transport.get()},
+              std::pair{"queue", lat.queue.get()},
+              std::pair{"handler", handler},
+              std::pair{"db", lat.db.get()}})
+            histogram_to_prometheus(
+                    out,
+                    "oxenss_rpc_latency_seconds",
+                    fmt::format("method=\"{}\",phase=\"{}\"", method, phase),
+                    h);
+    }
+
+    auto onion = onion_queue_.get_stats();
+    out += "# TYPE oxenss_onion_queue_seconds histogram\n";
+    histogram_to_prometheus(out, "oxenss_onion_queue_seconds", "phase=\"wait\"", onion.wait);
+    histogram_to_prometheus(out, "oxenss_onion_queue_seconds", "phase=\"run\"", onion.run);
+
+    out += "# TYPE oxenss_requests_total counter\n";
+    for (auto [type, count] :
+         {std::pair{"store", all_stats_.get_total_store_requests()},
+          std::pair{"retrieve", all_stats_.get_total_retrieve_requests()},
+          std::pair{"onion", all_stats_.get_total_onion_requests()},
+          std::pair{"proxy", all_stats_.get_total_proxy_requests()}})
+        fmt::format_to(out_it, "oxenss_requests_total{{type=\"{}\"}} {}\n", type, count);
+
+    out += "# TYPE oxenss_messages_stored gauge\n";
+    fmt::format_to(out_it, "oxenss_messages_stored {}\n", db_->get_message_count());
+    out += "# TYPE oxenss_db_used_bytes gauge\n";
+    fmt::format_to(out_it, "oxenss_db_used_bytes {}\n", db_->get_used_bytes());
+
+    return out;
+}
+
 std::string ServiceNode::get_status_line() const {
     // This produces a short, single-line status string, used when running as a
     // systemd Type=notify service to update the service Status line.  The
@@ -1273,12 +1934,16 @@ std::string ServiceNode::get_status_line() const {
     if (syncing_)
         s << "; SYNCING";
     s << "; sw=";
-    if (!swarm_ || !swarm_->is_valid())
+    if (auto sw = swarm(); !sw || !sw->is_valid())
         s << "NONE";
     else {
-        std::string swarm = fmt::format("{:016x}", swarm_->our_swarm_id());
+        std::string swarm = fmt::format("{:016x}", sw->our_swarm_id());
         s << swarm.substr(0, 4) << u8"…" << swarm.substr(swarm.size() - 3);
-        s << "(n=" << (1 + swarm_->other_nodes().size()) << ")";
+        s << "(n=" << (1 + sw->other_nodes().size()) << ")";
+    }
+    if (auto m = db_->get_migration_progress()) {
+        auto total = m->migrated + m->remaining;
+        s << "; MIGRATING " << (total > 0 ? 100 * m->migrated / total : 0) << "%";
     }
     s << "; " << db_->get_message_count() << " msgs";
 
@@ -1306,50 +1971,54 @@ std::string ServiceNode::get_status_line() const {
     return s.str();
 }
 
-void ServiceNode::process_push_batch(const std::string& blob) {
-    std::lock_guard guard(sn_mutex_);
-
+void ServiceNode::process_push_batch(std::string_view blob) {
     if (blob.empty())
         return;
 
-    std::vector<message> items = deserialize_messages(blob);
+    log::debug(logcat, "Got a batch of messages from peers, size: {}", blob.size());
 
-    log::trace(logcat, "Saving all: begin");
-
-    log::debug(logcat, "Got {} messages from peers, size: {}", items.size(), blob.size());
-
-    save_bulk(items);
-
-    log::trace(logcat, "Saving all: end");
+    // Stream the messages straight out of the serialized batch into the database rather than
+    // deserializing them all into messages first.  Snapshots (from peers bootstrapping us) get
+    // merged into the database directly.
+    try {
+        if (Database::is_snapshot(blob)) {
+            auto stored = db_->import_snapshot(blob);
+            log::debug(logcat, "Stored {} messages from a peer's snapshot", stored);
+        } else
+            db_->bulk_store([blob](const message_sink& store) { for_each_message(blob, store); });
+    } catch (const std::exception& e) {
+        log::error(logcat, "failed to save batch to the database: {}", e.what());
+    }
 }
 
 bool ServiceNode::is_pubkey_for_us(const user_pubkey_t& pk) const {
-    std::lock_guard guard(sn_mutex_);
-
-    if (!swarm_) {
+    auto swarm = this->swarm();
+    if (!swarm) {
         log::error(logcat, "Swarm data missing");
         return false;
     }
-    return swarm_->is_pubkey_for_us(pk);
+    return swarm->is_pubkey_for_us(pk);
 }
 
 std::optional<SwarmInfo> ServiceNode::get_swarm(const user_pubkey_t& pk) const {
-    std::lock_guard guard(sn_mutex_);
-
-    if (!swarm_) {
+    auto swarm = this->swarm();
+    if (!swarm) {
         log::error(logcat, "Swarm data missing");
         return {};
     }
 
-    if (auto* swarm = get_swarm_by_pk(swarm_->all_valid_swarms(), pk))
-        return *swarm;
+    if (auto* sw = swarm->find_swarm(pk))
+        return *sw;
     return std::nullopt;
 }
 
 std::vector<sn_record> ServiceNode::get_swarm_peers() const {
-    std::lock_guard guard{sn_mutex_};
+    return swarm()->other_nodes();
+}
 
-    return swarm_->other_nodes();
+void ServiceNode::set_swarm(std::shared_ptr<const Swarm> swarm) {
+    std::atomic_store(&swarm_, std::move(swarm));
+    update_test_pairs();
 }
 
 }  // namespace oxen::snode
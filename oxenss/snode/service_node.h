@@ -1,6 +1,7 @@
 #pragma once
 
 #include <chrono>
+#include <filesystem>
 #include <forward_list>
 #include <future>
 #include <map>
@@ -9,10 +10,13 @@
 #include <optional>
 #include <string>
 #include <string_view>
+#include <unordered_map>
 
 #include <oxenss/storage/database.hpp>
 #include <oxenss/crypto/keys.h>
+#include <oxenss/utils/work_queue.hpp>
 #include "reachability_testing.h"
+#include "relay_scheduler.h"
 #include "stats.h"
 #include "swarm.h"
 
@@ -34,9 +38,24 @@ inline constexpr auto SN_PING_TIMEOUT = 5s;
 // How long we wait for a storage test response (HTTPS until HF19, then OMQ)
 inline constexpr auto STORAGE_TEST_TIMEOUT = 15s;
 
+// How often we send the reachability test results collected since the last report to oxend
+inline constexpr auto REACHABILITY_REPORT_INTERVAL = 1s;
+
 // Timeout for bootstrap node OMQ requests
 inline constexpr auto BOOTSTRAP_TIMEOUT = 10s;
 
+// We save the swarm state of each new block to a snapshot file in the data directory, and start
+// serving from it at startup (rather than waiting for oxend's first block update) if it is no older
+// than this.
+inline constexpr auto SWARM_SNAPSHOT_MAX_AGE = 1h;
+
+// Maximum number of onion requests waiting to be processed; beyond this we reject new onion
+// requests until the queue drains.
+inline constexpr size_t ONION_QUEUE_SIZE = 1000;
+
+// Maximum number of threads used to process onion requests
+inline constexpr size_t ONION_QUEUE_MAX_THREADS = 8;
+
 /// We test based on the height a few blocks back to minimise discrepancies between nodes (we
 /// could also use checkpoints, but that is still not bulletproof: swarms are calculated based
 /// on the latest block, so they might be still different and thus derive different pairs)
@@ -78,9 +97,12 @@ constexpr std::string_view to_string(SnodeStatus status) {
 
 /// All service node logic that is not network-specific
 class ServiceNode {
-    bool syncing_ = true;
+    std::atomic<bool> syncing_ = true;
     bool active_ = false;
     bool got_first_response_ = false;
+    // Whether we request (and so get back) bt-encoded service node lists from oxend; cleared if
+    // oxend rejects such a request.  Guarded by sn_mutex_.
+    bool oxend_bt_ = true;
     std::condition_variable first_response_cv_;
     std::mutex first_response_mutex_;
     bool force_start_ = false;
@@ -89,10 +111,20 @@ class ServiceNode {
     uint64_t block_height_ = 0;
     uint64_t target_height_ = 0;
     std::string block_hash_;
-    std::unique_ptr<Swarm> swarm_;
+    // The current swarm state.  This is an immutable snapshot that is only ever replaced (via
+    // set_swarm(), by the swarm update code while holding sn_mutex_), never modified in place, so
+    // that readers can load it without taking any lock.
+    std::shared_ptr<const Swarm> swarm_;
     std::unique_ptr<Database> db_;
 
-    SnodeStatus status_ = SnodeStatus::UNKNOWN;
+    // Where we save the swarm state for restarts; see SWARM_SNAPSHOT_MAX_AGE.
+    const std::filesystem::path snapshot_path_;
+    // Set if we started from a saved swarm snapshot, and so don't need to wait for oxend before
+    // serving.  Holds the snapshot's active node x25519 pubkeys until oxenmq gets started.
+    std::optional<oxenmq::pubkey_set> snapshot_sns_;
+
+    // Set by the swarm update code; also read (without sn_mutex_) by the reachability testing.
+    std::atomic<SnodeStatus> status_ = SnodeStatus::UNKNOWN;
 
     const sn_record our_address_;
     const crypto::legacy_seckey our_seckey_;
@@ -100,6 +132,17 @@ class ServiceNode {
     /// Cache for block_height/block_hash mapping
     std::map<uint64_t, std::string> block_hashes_cache_;
 
+    // What answering a storage test needs to know about recent blocks, derived from
+    // block_hashes_cache_ and the swarm: the current height and, for each block in the cache, the
+    // tester/testee pair (nullopt if our swarm is too small for one).  Like swarm_, an immutable
+    // snapshot that gets replaced (by update_test_pairs(), with sn_mutex_ held) whenever the block
+    // cache or the swarm changes, so that storage tests don't need to take sn_mutex_.
+    struct test_pairs {
+        uint64_t height = 0;
+        std::map<uint64_t, std::optional<std::pair<sn_record, sn_record>>> pairs;
+    };
+    std::shared_ptr<const test_pairs> test_pairs_ = std::make_shared<test_pairs>();
+
     // Need to make sure we only use this to get OxenMQ object and
     // not call any method that would in turn call a method in SN
     // causing a deadlock
@@ -115,19 +158,51 @@ class ServiceNode {
 
     reachability_testing reach_records_;
 
+    // Reachability results waiting to be reported to oxend: they get sent together, with only the
+    // latest result for each node, every REACHABILITY_REPORT_INTERVAL.
+    std::mutex reach_reports_mutex_;
+    std::unordered_map<crypto::legacy_pubkey, bool> reach_reports_;
+
     mutable all_stats_t all_stats_;
 
     mutable std::recursive_mutex sn_mutex_;
 
+    mutable std::mutex outstanding_https_mutex_;
     std::forward_list<std::future<void>> outstanding_https_reqs_;
 
-    // Save multiple messages to the database at once (i.e. in a single transaction)
-    void save_bulk(const std::vector<message>& msgs);
+    // Paces the relaying of stored messages to new swarm members and bootstrapped swarms.
+    mutable RelayScheduler relay_scheduler_;
+
+    // Serialization versions that peers have told us (in sn.data replies) they accept; peers not
+    // in here get SERIALIZATION_VERSION_BT.
+    mutable std::mutex relay_versions_mutex_;
+    mutable std::unordered_map<crypto::legacy_pubkey, uint8_t> relay_versions_;
+
+    // Onion requests are decrypted and processed here rather than on the oxenmq or https threads
+    // so that a flood of onion requests can't starve out other requests.  This is last so that it
+    // gets stopped before anything else here is destroyed.
+    util::WorkQueue onion_queue_;
+
+    // Publishes a new swarm snapshot; should only be called with sn_mutex_ held.
+    void set_swarm(std::shared_ptr<const Swarm> swarm);
+
+    // Recomputes and publishes test_pairs_; should only be called with sn_mutex_ held.
+    void update_test_pairs();
+
+    // snode_ready implementation that checks the given swarm rather than the published one.
+    bool snode_ready(const Swarm* swarm, std::string* reason);
 
     void on_bootstrap_update(block_update&& bu);
 
     void on_swarm_update(block_update&& bu);
 
+    // Loads the swarm snapshot, if there is a recent enough one (see SWARM_SNAPSHOT_MAX_AGE), and
+    // applies it so that we can serve before hearing from oxend.  Called during construction.
+    void load_swarm_snapshot();
+
+    // Saves the given (about to be applied) block update as the swarm snapshot.
+    void save_swarm_snapshot(const block_update& bu) const;
+
     void bootstrap_data();
 
     void bootstrap_swarms(const std::vector<swarm_id_t>& swarms = {}) const;
@@ -136,23 +211,36 @@ class ServiceNode {
     /// (called when our old node got dissolved)
     void salvage_data() const;  // mutex not needed
 
-    /// Reliably push message/batch to a service node
+    /// Push a serialized batch of messages to a service node, calling `done` with whether it
+    /// was accepted.
     void relay_data_reliable(
             const std::string& blob,
-            const sn_record& address) const;  // mutex not needed
+            const sn_record& address,
+            std::function<void(bool success)> done) const;  // mutex not needed
 
-    void relay_messages(
-            const std::vector<message>& msgs,
-            const std::vector<sn_record>& snodes) const;  // mutex not needed
+    // Loads and serializes the next piece of a relay for the relay scheduler: the messages from
+    // `from` onwards within one of the swarm space ranges, up to about SERIALIZATION_BATCH_SIZE,
+    // in the newest serialization version that the peer has told us it accepts.
+    relay_chunk load_relay_chunk(
+            const sn_record& peer,
+            const RelayScheduler::ranges_t& ranges,
+            relay_position from) const;  // mutex not needed
+
+    // Queues relays of all of our stored messages that belong to our swarm to the given snodes.
+    void relay_all_messages(const std::vector<sn_record>& snodes) const;
 
     // Conducts any ping peer tests that are due; (this is designed to be called frequently and
-    // does nothing if there are no tests currently due).
+    // does nothing if there are no tests currently due, or if too many are already in flight).
+    // Doesn't take sn_mutex_.
     void ping_peers();
 
+    // Sends the queued reachability results to oxend.
+    void send_reachability_reports();
+
     /// Pings oxend (as required for uptime proofs)
     void oxend_ping();
 
-    /// Return tester/testee pair based on block_height
+    /// Return tester/testee pair based on block_height (from test_pairs_; doesn't lock sn_mutex_)
     std::optional<std::pair<sn_record, sn_record>> derive_tester_testee(uint64_t block_height);
 
     /// Send a request to a SN under test
@@ -171,8 +259,8 @@ class ServiceNode {
     // Initiate node ping tests
     void test_reachability(const sn_record& sn, int previous_failures);
 
-    // Reports node reachability result to oxend and, if a failure, queues the node for
-    // retesting.
+    // Ends a reachability test: queues the result to be reported to oxend and, if a failure,
+    // queues the node for retesting.
     void report_reachability(const sn_record& sn, bool reachable, int previous_failures);
 
   public:
@@ -181,11 +269,19 @@ class ServiceNode {
             const crypto::legacy_seckey& skey,
             server::OMQ& omq_server,
             const std::filesystem::path& db_location,
+            size_t db_shards,
+            size_t db_cold_threshold,
+            bool db_online_migration,
+            const db_tuning& tuning,
+            const db_eviction& eviction,
             bool force_start);
 
     Database& get_db() { return *db_; }
     const Database& get_db() const { return *db_; }
 
+    // Queue used for processing incoming onion requests
+    util::WorkQueue& onion_queue() { return onion_queue_; }
+
     // Return info about this node as it is advertised to other nodes
     const sn_record& own_address() { return our_address_; }
 
@@ -198,6 +294,12 @@ class ServiceNode {
     void record_onion_request();
     void record_retrieve_request();
 
+    // Returns the latency stats of the given client RPC endpoint (nullptr if there is no such
+    // endpoint).
+    rpc_latency_t* rpc_latency(std::string_view endpoint) {
+        return all_stats_.rpc_latency(endpoint);
+    }
+
     /// Sends an onion request to the next SS
     void send_onion_to_sn(
             const sn_record& sn,
@@ -235,7 +337,7 @@ class ServiceNode {
     bool process_store(message msg, bool* new_msg = nullptr);
 
     /// Process incoming blob of messages: add to DB if new
-    void process_push_batch(const std::string& blob);
+    void process_push_batch(std::string_view blob);
 
     // Attempt to find an answer (message body) to the storage test
     std::pair<MessageTestStatus, std::string> process_storage_test_req(
@@ -254,13 +356,20 @@ class ServiceNode {
 
     std::string get_stats() const;
 
+    // Returns request latency histograms and basic counters in the Prometheus text exposition
+    // format.
+    std::string get_metrics() const;
+
     std::string get_status_line() const;
 
+    // Returns the current swarm state snapshot.  The returned snapshot will not change, but may
+    // become outdated (i.e. if swarms change while it is being used).
+    std::shared_ptr<const Swarm> swarm() const { return std::atomic_load(&swarm_); }
+
     template <typename PubKey>
     std::optional<sn_record> find_node(const PubKey& pk) const {
-        std::lock_guard guard{sn_mutex_};
-        if (swarm_)
-            return swarm_->find_node(pk);
+        if (auto swarm = this->swarm())
+            return swarm->find_node(pk);
         return std::nullopt;
     }
 
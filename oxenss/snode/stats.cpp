@@ -8,12 +8,22 @@
 
 namespace oxen::snode {
 
-all_stats_t::all_stats_t(oxenmq::OxenMQ& omq) {
+all_stats_t::all_stats_t(
+        oxenmq::OxenMQ& omq, const std::vector<std::string_view>& rpc_endpoints) {
+    for (auto name : rpc_endpoints)
+        rpc_latency_.try_emplace(name);
     omq.add_timer([this] { cleanup(); }, STATS_CLEANUP_INTERVAL);
 }
 
+all_stats_t::peer_shard& all_stats_t::local_peer_shard() {
+    static std::atomic<size_t> next_shard{0};
+    thread_local const size_t shard = next_shard++ % PEER_STATS_SHARDS;
+    return peer_shards_[shard];
+}
+
 static void cleanup_old(
-        std::deque<test_result>& tests, std::chrono::system_clock::time_point cutoff_time) {
+        util::ring_buffer<test_result, STORAGE_TESTS_KEPT>& tests,
+        std::chrono::system_clock::time_point cutoff_time) {
     while (!tests.empty() && tests.front().timestamp <= cutoff_time)
         tests.pop_front();
 }
@@ -36,16 +46,43 @@ void all_stats_t::cleanup() {
         last_rotate = std::chrono::steady_clock::now();
     }
 
-    {
-        // Clean up old peer report stats
-        std::lock_guard lock{peer_report_mutex};
-
-        const auto cutoff = std::chrono::system_clock::now() - ROLLING_WINDOW;
-        for (auto& [kv, stats] : peer_report_)
+    // Clean up old peer report stats
+    const auto cutoff = std::chrono::system_clock::now() - ROLLING_WINDOW;
+    for (auto& shard : peer_shards_) {
+        std::lock_guard lock{shard.mutex};
+        for (auto& [kv, stats] : shard.peers)
             cleanup_old(stats.storage_tests, cutoff);
     }
 }
 
+std::unordered_map<crypto::legacy_pubkey, peer_stats_t> all_stats_t::peer_report() const {
+    std::unordered_map<crypto::legacy_pubkey, peer_stats_t> report;
+    std::vector<test_result> tests;
+    for (auto& shard : peer_shards_) {
+        std::lock_guard lock{shard.mutex};
+        for (auto& [pk, stats] : shard.peers) {
+            auto [it, inserted] = report.try_emplace(pk, stats);
+            if (inserted)
+                continue;
+            auto& merged = it->second;
+            merged.requests_failed += stats.requests_failed;
+            merged.pushes_failed += stats.pushes_failed;
+
+            // Test results for one peer recorded on different threads: interleave them by time,
+            // keeping the newest.
+            tests.assign(merged.storage_tests.begin(), merged.storage_tests.end());
+            tests.insert(tests.end(), stats.storage_tests.begin(), stats.storage_tests.end());
+            std::stable_sort(tests.begin(), tests.end(), [](const auto& a, const auto& b) {
+                return a.timestamp < b.timestamp;
+            });
+            merged.storage_tests.clear();
+            for (auto& t : tests)
+                merged.storage_tests.push_back(t);
+        }
+    }
+    return report;
+}
+
 std::pair<std::chrono::steady_clock::duration, period_stats> all_stats_t::get_recent_requests()
         const {
     std::pair<std::chrono::steady_clock::duration, period_stats> result;
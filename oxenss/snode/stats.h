@@ -1,12 +1,17 @@
 #pragma once
 
 #include "sn_record.h"
+#include <oxenss/utils/histogram.hpp>
+#include <oxenss/utils/ring_buffer.hpp>
 
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <deque>
 #include <mutex>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
 
 namespace oxenmq {
 class OxenMQ;
@@ -24,6 +29,14 @@ inline constexpr std::chrono::seconds STATS_CLEANUP_INTERVAL = 10min;
 // STATS_WINDOWS*STATS_CLEANUP_INTERVAL plus however long since the last cleanup.
 inline constexpr size_t RECENT_STATS_COUNT = 6;
 
+// How many of the most recent storage test results we keep per peer.  We test a given peer far less
+// often than this over the rolling window in which we keep test results.
+inline constexpr size_t STORAGE_TESTS_KEPT = 64;
+
+// How many shards the peer stats are split into; each thread records into its own shard (threads
+// share shards once there are more threads than this).
+inline constexpr size_t PEER_STATS_SHARDS = 16;
+
 enum class ResultType { OK, MISMATCH, OTHER, REJECTED };
 
 struct test_result {
@@ -49,7 +62,8 @@ struct peer_stats_t {
     // causing this node to give up re-transmitting
     uint64_t pushes_failed = 0;
 
-    std::deque<test_result> storage_tests;
+    // Oldest first
+    util::ring_buffer<test_result, STORAGE_TESTS_KEPT> storage_tests;
 };
 
 struct period_stats {
@@ -57,6 +71,14 @@ struct period_stats {
              onion_requests = 0;
 };
 
+// Latencies of one client RPC endpoint, split into the phases of handling a request.
+struct rpc_latency_t {
+    util::latency_histogram transport;  // Receiving the request (HTTPS requests only)
+    util::latency_histogram queue;      // Waiting for a worker thread (HTTPS requests only)
+    util::latency_histogram handler;    // From dispatching the request until its response is ready
+    util::latency_histogram db;         // Database time while dispatching the request
+};
+
 class all_stats_t {
     // ===== This node's stats =====
     std::atomic<uint64_t> total_client_store_requests{0}, current_client_store_requests{0},
@@ -72,39 +94,62 @@ class all_stats_t {
     std::chrono::steady_clock::time_point last_rotate = std::chrono::steady_clock::now();
     mutable std::mutex prev_stats_mutex;
 
-    // stats per every peer in our swarm (including former peers)
-    std::unordered_map<crypto::legacy_pubkey, peer_stats_t> peer_report_;
-    mutable std::mutex peer_report_mutex;
+    // Latencies per client RPC endpoint.  The set of endpoints is fixed at construction, so lookups
+    // need no locking.
+    std::unordered_map<std::string_view, rpc_latency_t> rpc_latency_;
+
+    // stats per every peer in our swarm (including former peers), split into per-thread shards
+    // that get merged when read.
+    struct alignas(64) peer_shard {
+        std::unordered_map<crypto::legacy_pubkey, peer_stats_t> peers;
+        mutable std::mutex mutex;
+    };
+    std::array<peer_shard, PEER_STATS_SHARDS> peer_shards_;
+
+    // Returns the calling thread's shard
+    peer_shard& local_peer_shard();
 
     // remove old test entries and reset counters, update reset time
     void cleanup();
 
   public:
-    explicit all_stats_t(oxenmq::OxenMQ& omq);
+    // `rpc_endpoints` are the names of the client RPC endpoints to keep latencies for; the names
+    // must stay valid for the lifetime of this object.
+    all_stats_t(oxenmq::OxenMQ& omq, const std::vector<std::string_view>& rpc_endpoints);
+
+    // Returns the latencies of the given client RPC endpoint, or nullptr if it's not one we know.
+    rpc_latency_t* rpc_latency(std::string_view endpoint) {
+        auto it = rpc_latency_.find(endpoint);
+        return it != rpc_latency_.end() ? &it->second : nullptr;
+    }
+    const std::unordered_map<std::string_view, rpc_latency_t>& rpc_latencies() const {
+        return rpc_latency_;
+    }
 
-    // Returns the number of failed requests for the given pubkey over the last ROLLING_WINDOW
+    // Records a failed request to the given peer
     void record_request_failed(const crypto::legacy_pubkey& sn) {
-        std::lock_guard lock{peer_report_mutex};
-        peer_report_[sn].requests_failed++;
+        auto& shard = local_peer_shard();
+        std::lock_guard lock{shard.mutex};
+        shard.peers[sn].requests_failed++;
     }
 
-    // Returns the number of failed pushes for the given pubkey over the last ROLLING_WINDOW
+    // Records a series of failed pushes to the given peer
     void record_push_failed(const crypto::legacy_pubkey& sn) {
-        std::lock_guard lock{peer_report_mutex};
-        peer_report_[sn].pushes_failed++;
+        auto& shard = local_peer_shard();
+        std::lock_guard lock{shard.mutex};
+        shard.peers[sn].pushes_failed++;
     }
 
     // Records a storage test result for the given peer
     void record_storage_test_result(const crypto::legacy_pubkey& sn, ResultType result) {
-        std::lock_guard lock{peer_report_mutex};
-        peer_report_[sn].storage_tests.push_back({std::chrono::system_clock::now(), result});
+        auto& shard = local_peer_shard();
+        std::lock_guard lock{shard.mutex};
+        shard.peers[sn].storage_tests.push_back({std::chrono::system_clock::now(), result});
     }
 
-    // Returns a copy of the current peer report
-    std::unordered_map<crypto::legacy_pubkey, peer_stats_t> peer_report() const {
-        std::lock_guard lock{peer_report_mutex};
-        return peer_report_;
-    }
+    // Returns the current peer report, merged from all shards.  Each shard is only locked while
+    // its own (fixed size) entries get merged in.
+    std::unordered_map<crypto::legacy_pubkey, peer_stats_t> peer_report() const;
 
     void bump_proxy_requests() {
         total_proxy_requests++;
@@ -4,7 +4,11 @@
 #include <oxenss/utils/string_utils.hpp>
 
 #include <cstdlib>
+#include <cstring>
+#include <numeric>
 #include <ostream>
+#include <stdexcept>
+#include <type_traits>
 #include <unordered_map>
 #include <oxenc/endian.h>
 
@@ -140,7 +144,72 @@ void Swarm::apply_swarm_changes(std::vector<SwarmInfo>&& new_swarms) {
     log::trace(logcat, "Applying swarm changes");
 
     preserve_ips(new_swarms, all_valid_swarms_);
+    // Node details (ips, ports, swarm membership) change far more often than the set of swarms,
+    // and the lookup only depends on the latter.
+    const bool same_ids = std::equal(
+            new_swarms.begin(),
+            new_swarms.end(),
+            all_valid_swarms_.begin(),
+            all_valid_swarms_.end(),
+            [](const SwarmInfo& a, const SwarmInfo& b) { return a.swarm_id == b.swarm_id; });
     all_valid_swarms_ = std::move(new_swarms);
+    if (!same_ids)
+        lookup_ = std::make_shared<const SwarmLookup>(all_valid_swarms_);
+    applied_active_ = false;
+}
+
+static bool has_ip(const sn_record& sn) {
+    return sn.ip != "0.0.0.0" && sn.port != 0 && sn.omq_port != 0;
+}
+
+static bool missing_ip(const sn_record& sn) {
+    return sn.ip == "0.0.0.0" && sn.port == 0 && sn.omq_port == 0;
+}
+
+// Returns true if `incoming` has the same pubkeys and ip/ports as our existing record `sn`.  If
+// `preserved` then a missing ip/port in `incoming` also counts as the same when we have one (since
+// preserve_ips would keep ours).
+static bool same_details(const sn_record& sn, const sn_record& incoming, bool preserved) {
+    if (sn.pubkey_legacy != incoming.pubkey_legacy ||
+        sn.pubkey_ed25519 != incoming.pubkey_ed25519 ||
+        sn.pubkey_x25519 != incoming.pubkey_x25519)
+        return false;
+    if (preserved && missing_ip(incoming) && has_ip(sn))
+        return true;
+    return sn.ip == incoming.ip && sn.port == incoming.port && sn.omq_port == incoming.omq_port;
+}
+
+bool Swarm::same_funded(const std::vector<sn_record>& decommissioned) const {
+    size_t count = decommissioned.size();
+    for (const auto& si : all_valid_swarms_)
+        count += si.snodes.size();
+    if (count != funded_->records().size())
+        return false;
+
+    auto known = [this](const sn_record& sn) {
+        auto* ours = funded_->find(sn.pubkey_legacy);
+        return ours && same_details(*ours, sn, false);
+    };
+    for (const auto& si : all_valid_swarms_)
+        if (!std::all_of(si.snodes.begin(), si.snodes.end(), known))
+            return false;
+    return std::all_of(decommissioned.begin(), decommissioned.end(), known);
+}
+
+bool Swarm::is_current(
+        const std::vector<SwarmInfo>& swarms, const std::vector<sn_record>& decommissioned) const {
+    if (!applied_active_ || swarms.size() != all_valid_swarms_.size())
+        return false;
+    for (size_t i = 0; i < swarms.size(); i++) {
+        const auto& ours = all_valid_swarms_[i];
+        const auto& theirs = swarms[i];
+        if (ours.swarm_id != theirs.swarm_id || ours.snodes.size() != theirs.snodes.size())
+            return false;
+        for (size_t j = 0; j < ours.snodes.size(); j++)
+            if (!same_details(ours.snodes[j], theirs.snodes[j], true))
+                return false;
+    }
+    return same_funded(decommissioned);
 }
 
 void Swarm::update_state(
@@ -148,6 +217,7 @@ void Swarm::update_state(
         const std::vector<sn_record>& decommissioned,
         const SwarmEvents& events,
         bool active) {
+    applied_active_ = false;
     if (active) {
         // The following only makes sense for active nodes in a swarm
 
@@ -181,65 +251,201 @@ void Swarm::update_state(
                 [this](const sn_record& record) { return record != our_address_; });
     }
 
-    // Store a copy of every node in a separate data structure
-    all_funded_nodes_.clear();
-    all_funded_ed25519_.clear();
-    all_funded_x25519_.clear();
+    applied_active_ = active;
 
-    for (const auto& si : all_valid_swarms_) {
-        for (const auto& sn : si.snodes) {
-            all_funded_nodes_.emplace(sn.pubkey_legacy, sn);
-        }
-    }
+    // Store a copy of every node in a separate data structure (unless we already have exactly
+    // these nodes, which is the common case when only our own swarm's state changed)
+    if (same_funded(decommissioned))
+        return;
 
-    for (const auto& sn : decommissioned) {
-        all_funded_nodes_.emplace(sn.pubkey_legacy, sn);
-    }
+    std::vector<sn_record> nodes;
+    nodes.reserve(
+            decommissioned.size() +
+            std::accumulate(
+                    all_valid_swarms_.begin(),
+                    all_valid_swarms_.end(),
+                    size_t{0},
+                    [](size_t n, const SwarmInfo& si) { return n + si.snodes.size(); }));
+
+    for (const auto& si : all_valid_swarms_)
+        nodes.insert(nodes.end(), si.snodes.begin(), si.snodes.end());
+    nodes.insert(nodes.end(), decommissioned.begin(), decommissioned.end());
 
-    for (const auto& [pk, sn] : all_funded_nodes_) {
-        all_funded_ed25519_.emplace(sn.pubkey_ed25519, pk);
-        all_funded_x25519_.emplace(sn.pubkey_x25519, pk);
+    funded_ = std::make_shared<const node_index>(std::move(nodes));
+}
+
+Swarm::node_index::node_index(std::vector<sn_record> records) {
+    size_t size = 16;
+    while (size < 2 * records.size())
+        size <<= 1;
+    legacy_.resize(size);
+    ed25519_.resize(size);
+    x25519_.resize(size);
+    const size_t mask = size - 1;
+
+    // Returns the slot for `pk` in `table`: either the empty slot to put it in, or the slot
+    // already holding it.
+    auto slot_for = [&](std::vector<uint32_t>& table, const auto& pk, auto field) -> uint32_t& {
+        using Key = std::decay_t<decltype(pk)>;
+        for (size_t i = std::hash<Key>{}(pk) & mask;; i = (i + 1) & mask)
+            if (!table[i] || records_[table[i] - 1].*field == pk)
+                return table[i];
+    };
+
+    records_.reserve(records.size());
+    for (auto& sn : records) {
+        auto& legacy = slot_for(legacy_, sn.pubkey_legacy, &sn_record::pubkey_legacy);
+        if (legacy)
+            continue;
+        records_.push_back(std::move(sn));
+        const auto& rec = records_.back();
+        const auto idx = static_cast<uint32_t>(records_.size());
+        legacy = idx;
+        if (auto& ed = slot_for(ed25519_, rec.pubkey_ed25519, &sn_record::pubkey_ed25519); !ed)
+            ed = idx;
+        if (auto& x = slot_for(x25519_, rec.pubkey_x25519, &sn_record::pubkey_x25519); !x)
+            x = idx;
     }
 }
 
+template <typename Key>
+const sn_record* Swarm::node_index::find(
+        const std::vector<uint32_t>& table, Key sn_record::*field, const Key& pk) const {
+    if (table.empty())
+        return nullptr;
+    const size_t mask = table.size() - 1;
+    for (size_t i = std::hash<Key>{}(pk) & mask; table[i]; i = (i + 1) & mask)
+        if (const auto& sn = records_[table[i] - 1]; sn.*field == pk)
+            return &sn;
+    return nullptr;
+}
+
+const sn_record* Swarm::node_index::find(const crypto::legacy_pubkey& pk) const {
+    return find(legacy_, &sn_record::pubkey_legacy, pk);
+}
+const sn_record* Swarm::node_index::find(const crypto::ed25519_pubkey& pk) const {
+    return find(ed25519_, &sn_record::pubkey_ed25519, pk);
+}
+const sn_record* Swarm::node_index::find(const crypto::x25519_pubkey& pk) const {
+    return find(x25519_, &sn_record::pubkey_x25519, pk);
+}
+
 std::optional<sn_record> Swarm::find_node(const crypto::legacy_pubkey& pk) const {
-    if (auto it = all_funded_nodes_.find(pk); it != all_funded_nodes_.end())
-        return it->second;
+    if (auto* sn = funded_->find(pk))
+        return *sn;
     return std::nullopt;
 }
 
 std::optional<sn_record> Swarm::find_node(const crypto::ed25519_pubkey& pk) const {
-    if (auto it = all_funded_ed25519_.find(pk); it != all_funded_ed25519_.end())
-        return find_node(it->second);
+    if (auto* sn = funded_->find(pk))
+        return *sn;
     return std::nullopt;
 }
 
 std::optional<sn_record> Swarm::find_node(const crypto::x25519_pubkey& pk) const {
-    if (auto it = all_funded_x25519_.find(pk); it != all_funded_x25519_.end())
-        return find_node(it->second);
+    if (auto* sn = funded_->find(pk))
+        return *sn;
     return std::nullopt;
 }
 
 uint64_t pubkey_to_swarm_space(const user_pubkey_t& pk) {
-    const auto bytes = pk.raw();
-    assert(bytes.size() == 32);
-
-    uint64_t res = 0;
-    for (size_t i = 0; i < 4; i++) {
-        uint64_t buf;
-        std::memcpy(&buf, bytes.data() + i * 8, 8);
-        res ^= buf;
-    }
-    oxenc::big_to_host_inplace(res);
-
-    return res;
+    return pk.swarm_space();
 }
 
 bool Swarm::is_pubkey_for_us(const user_pubkey_t& pk) const {
-    auto* swarm = get_swarm_by_pk(all_valid_swarms_, pk);
+    auto* swarm = find_swarm(pk);
     return swarm && cur_swarm_id_ == swarm->swarm_id;
 }
 
+std::vector<std::pair<uint64_t, uint64_t>> Swarm::swarm_space_ranges(swarm_id_t swarm) const {
+    auto it = std::lower_bound(
+            all_valid_swarms_.begin(),
+            all_valid_swarms_.end(),
+            swarm,
+            [](const SwarmInfo& s, swarm_id_t v) { return s.swarm_id < v; });
+    if (it == all_valid_swarms_.end() || it->swarm_id != swarm)
+        return {};
+    return lookup_->ranges(it - all_valid_swarms_.begin());
+}
+
+const SwarmInfo* Swarm::find_swarm(const user_pubkey_t& pk) const {
+    auto i = lookup_->find(pubkey_to_swarm_space(pk));
+    return i >= 0 ? &all_valid_swarms_[i] : nullptr;
+}
+
+SwarmLookup::SwarmLookup(const std::vector<SwarmInfo>& swarms) {
+    const size_t n = swarms.size();
+    if (n == 0)
+        return;
+
+    // Things closer to the lower of two adjacent swarm ids `a` and `b` (or exactly in the middle)
+    // belong to `a`, so `a` owns values up to and including `a + (b-a)/2`.  (See get_swarm_by_pk
+    // for the reference implementation).
+    if (n > 1) {
+        const uint64_t first = swarms.front().swarm_id, last = swarms.back().swarm_id;
+        // The last swarm owns everything up to the wraparound midpoint between it and the first
+        // swarm; this can land at either end of the swarm space:
+        const uint64_t wrap_mid = last + static_cast<uint64_t>(first - last) / 2;
+        const bool wrapped = wrap_mid < last;
+
+        bounds_.reserve(n);
+        owners_.reserve(n + 1);
+        if (wrapped) {
+            bounds_.push_back(wrap_mid);
+            owners_.push_back(n - 1);
+        }
+        for (size_t i = 0; i + 1 < n; i++) {
+            const uint64_t a = swarms[i].swarm_id, b = swarms[i + 1].swarm_id;
+            assert(a < b);
+            bounds_.push_back(a + (b - a) / 2);
+            owners_.push_back(i);
+        }
+        if (!wrapped) {
+            bounds_.push_back(wrap_mid);
+            owners_.push_back(n - 1);
+        }
+        // Everything above the last bound goes to whichever swarm is beyond (via wraparound if
+        // needed) the last bound:
+        owners_.push_back(wrapped ? n - 1 : 0);
+    } else {
+        owners_.push_back(0);
+    }
+
+    if (bounds_.empty())
+        return;
+    radix_.resize((size_t{1} << RADIX_BITS) + 1);
+    size_t r = 0;
+    for (size_t bucket = 0; bucket + 1 < radix_.size(); bucket++) {
+        const uint64_t bucket_min = static_cast<uint64_t>(bucket) << (64 - RADIX_BITS);
+        while (r < bounds_.size() && bounds_[r] < bucket_min)
+            r++;
+        radix_[bucket] = r;
+    }
+    radix_.back() = bounds_.size();
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> SwarmLookup::ranges(size_t idx) const {
+    std::vector<std::pair<uint64_t, uint64_t>> result;
+    // Region r covers (bounds_[r-1], bounds_[r]], with the first region starting at 0 and the
+    // last (r == bounds_.size()) extending to the top of the swarm space.
+    for (size_t r = 0; r < owners_.size(); r++) {
+        if (owners_[r] != idx)
+            continue;
+        if (r > 0 && bounds_[r - 1] == std::numeric_limits<uint64_t>::max())
+            continue;  // Empty region above a bound at the very top
+        uint64_t lo = r == 0 ? 0 : bounds_[r - 1] + 1;
+        uint64_t hi = r < bounds_.size() ? bounds_[r] : std::numeric_limits<uint64_t>::max();
+        if (lo > hi)
+            continue;
+        // Merge with the previous region if they are adjacent
+        if (!result.empty() && result.back().second + 1 == lo)
+            result.back().second = hi;
+        else
+            result.emplace_back(lo, hi);
+    }
+    return result;
+}
+
 const SwarmInfo* get_swarm_by_pk(
         const std::vector<SwarmInfo>& all_swarms, const user_pubkey_t& pk) {
 
@@ -295,4 +501,138 @@ std::pair<int, int> count_missing_data(const block_update& bu) {
     return result;
 }
 
+namespace {
+    // Swarm snapshot format (all integers little-endian):
+    //
+    //     "SWS1" | u64 taken (unix seconds) | u64 height | i32 hardfork | i32 snode revision |
+    //     u8 N | N bytes block hash | u32 swarm count | swarms... | u32 count | decommissioned...
+    //
+    // where each swarm is `u64 swarm id | u32 count | nodes...` and each node is
+    // `32 bytes legacy pubkey | 32 bytes ed25519 | 32 bytes x25519 | u16 port | u16 omq port |
+    // u8 N | N bytes ip`.
+    constexpr std::string_view SNAPSHOT_MAGIC{"SWS1"};
+
+    template <typename T>
+    void append_int(std::string& out, T val) {
+        oxenc::host_to_little_inplace(val);
+        out.append(reinterpret_cast<const char*>(&val), sizeof(val));
+    }
+
+    void append_short_string(std::string& out, std::string_view s) {
+        if (s.size() > 255)
+            throw std::runtime_error{"swarm snapshot string too long"};
+        out += static_cast<char>(s.size());
+        out += s;
+    }
+
+    void append_record(std::string& out, const sn_record& sn) {
+        out += sn.pubkey_legacy.view();
+        out += sn.pubkey_ed25519.view();
+        out += sn.pubkey_x25519.view();
+        append_int(out, sn.port);
+        append_int(out, sn.omq_port);
+        append_short_string(out, sn.ip);
+    }
+
+    // Consumes values from the front of a snapshot, throwing if it runs out.
+    struct snapshot_reader {
+        std::string_view data;
+
+        std::string_view take(size_t n) {
+            if (data.size() < n)
+                throw std::runtime_error{"truncated swarm snapshot"};
+            auto result = data.substr(0, n);
+            data.remove_prefix(n);
+            return result;
+        }
+
+        template <typename T>
+        T integer() {
+            T val;
+            std::memcpy(&val, take(sizeof(T)).data(), sizeof(T));
+            oxenc::little_to_host_inplace(val);
+            return val;
+        }
+
+        std::string_view short_string() { return take(integer<uint8_t>()); }
+
+        sn_record record() {
+            sn_record sn;
+            sn.pubkey_legacy = crypto::legacy_pubkey::from_bytes(take(32));
+            sn.pubkey_ed25519 = crypto::ed25519_pubkey::from_bytes(take(32));
+            sn.pubkey_x25519 = crypto::x25519_pubkey::from_bytes(take(32));
+            sn.port = integer<uint16_t>();
+            sn.omq_port = integer<uint16_t>();
+            sn.ip = short_string();
+            return sn;
+        }
+    };
+}  // namespace
+
+std::string serialize_swarm_snapshot(
+        const block_update& bu, std::chrono::system_clock::time_point taken) {
+    std::string out;
+    size_t nodes = bu.decommissioned_nodes.size();
+    for (const auto& si : bu.swarms)
+        nodes += si.snodes.size();
+    out.reserve(64 + bu.block_hash.size() + 12 * bu.swarms.size() + 120 * nodes);
+
+    out += SNAPSHOT_MAGIC;
+    append_int(out, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::seconds>(
+                                                  taken.time_since_epoch())
+                                                  .count()));
+    append_int(out, bu.height);
+    append_int(out, static_cast<int32_t>(bu.hardfork));
+    append_int(out, static_cast<int32_t>(bu.snode_revision));
+    append_short_string(out, bu.block_hash);
+    append_int(out, static_cast<uint32_t>(bu.swarms.size()));
+    for (const auto& si : bu.swarms) {
+        append_int(out, si.swarm_id);
+        append_int(out, static_cast<uint32_t>(si.snodes.size()));
+        for (const auto& sn : si.snodes)
+            append_record(out, sn);
+    }
+    append_int(out, static_cast<uint32_t>(bu.decommissioned_nodes.size()));
+    for (const auto& sn : bu.decommissioned_nodes)
+        append_record(out, sn);
+    return out;
+}
+
+std::pair<block_update, std::chrono::system_clock::time_point> parse_swarm_snapshot(
+        std::string_view data) {
+    snapshot_reader in{data};
+    if (in.take(SNAPSHOT_MAGIC.size()) != SNAPSHOT_MAGIC)
+        throw std::runtime_error{"not a swarm snapshot"};
+
+    std::pair<block_update, std::chrono::system_clock::time_point> result;
+    auto& [bu, taken] = result;
+    taken = std::chrono::system_clock::time_point{std::chrono::seconds{in.integer<uint64_t>()}};
+    bu.height = in.integer<uint64_t>();
+    bu.hardfork = in.integer<int32_t>();
+    bu.snode_revision = in.integer<int32_t>();
+    bu.block_hash = in.short_string();
+    // Don't trust the counts for reserving: each node takes at least 101 bytes
+    auto swarms = in.integer<uint32_t>();
+    bu.swarms.reserve(std::min<size_t>(swarms, in.data.size() / 12));
+    for (uint32_t i = 0; i < swarms; i++) {
+        auto& si = bu.swarms.emplace_back();
+        si.swarm_id = in.integer<uint64_t>();
+        auto count = in.integer<uint32_t>();
+        si.snodes.reserve(std::min<size_t>(count, in.data.size() / 101));
+        for (uint32_t j = 0; j < count; j++) {
+            si.snodes.push_back(in.record());
+            bu.active_x25519_pubkeys.emplace(si.snodes.back().pubkey_x25519.view());
+        }
+    }
+    auto decommissioned = in.integer<uint32_t>();
+    bu.decommissioned_nodes.reserve(std::min<size_t>(decommissioned, in.data.size() / 101));
+    for (uint32_t i = 0; i < decommissioned; i++)
+        bu.decommissioned_nodes.push_back(in.record());
+    if (!in.data.empty())
+        throw std::runtime_error{"unexpected trailing data in swarm snapshot"};
+    if (!std::is_sorted(bu.swarms.begin(), bu.swarms.end()))
+        throw std::runtime_error{"swarm snapshot swarms are not sorted"};
+    return result;
+}
+
 }  // namespace oxen::snode
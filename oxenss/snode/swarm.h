@@ -1,9 +1,13 @@
 #pragma once
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <oxenmq/auth.h>
 #include <limits>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
@@ -49,6 +53,18 @@ const SwarmInfo* get_swarm_by_pk(std::vector<SwarmInfo>&& all_swarms, const user
 // decommissioned nodes in either count).
 std::pair<int, int> count_missing_data(const block_update& bu);
 
+/// Serializes a block update into a compact binary snapshot, along with the time `taken` at which
+/// it was current, so that a restarted node can resume from its last known swarm state rather
+/// than waiting for oxend.  `active_x25519_pubkeys` is not included (it gets rebuilt from the
+/// swarms when parsing), nor is `unchanged`.
+std::string serialize_swarm_snapshot(
+        const block_update& bu, std::chrono::system_clock::time_point taken);
+
+/// Parses a snapshot produced by serialize_swarm_snapshot, returning the block update and the time
+/// it was taken.  Throws std::runtime_error if the snapshot is invalid.
+std::pair<block_update, std::chrono::system_clock::time_point> parse_swarm_snapshot(
+        std::string_view data);
+
 /// In rare cases (such as when oxend has just been reset/resynced, and our initial swarm data came
 /// from a bootstrap node) we might have existing data that has valid ip/port info in it, but new
 /// data that does not: in such a case we want to preserve the old data before replacing the swarm
@@ -60,6 +76,54 @@ void preserve_ips(std::vector<SwarmInfo>& new_swarms, const std::vector<SwarmInf
 /// has a swarm id closest to this pubkey-derived value.
 uint64_t pubkey_to_swarm_space(const user_pubkey_t& pk);
 
+/// Precomputed routing index for swarm space -> swarm lookups, giving the same results as
+/// get_swarm_by_pk but without the binary search and distance calculations.
+///
+/// When built we resolve the midpoints between adjacent swarm ids (including the wraparound
+/// midpoint between the last and first swarms) into a sorted array of region upper bounds, where
+/// each region has a single closest swarm.  A radix table on the top bits of the swarm space value
+/// then gives the first candidate region for a value, from which we typically need to check just
+/// one or two bounds.
+class SwarmLookup {
+  public:
+    static constexpr int RADIX_BITS = 12;
+
+  private:
+    // Inclusive swarm space upper bound of each region, in ascending order
+    std::vector<uint64_t> bounds_;
+    // Indices (into the swarm vector) of the closest swarm for each region; this has one more
+    // element than bounds_, for the final region above the last bound.  Empty if there are no
+    // swarms.
+    std::vector<uint32_t> owners_;
+    // radix_[i] is the index of the first region that can contain values with top bits == i; this
+    // has an extra element at the end (== bounds_.size()) so that radix_[i+1] is always valid.
+    std::vector<uint32_t> radix_;
+
+  public:
+    SwarmLookup() = default;
+
+    /// Builds the lookup index for the given swarms, which must be sorted by swarm id.
+    explicit SwarmLookup(const std::vector<SwarmInfo>& swarms);
+
+    /// Returns the index in the swarm vector this was built from of the swarm responsible for the
+    /// given swarm space value.  Returns -1 if the lookup was built from an empty swarm list.
+    int64_t find(uint64_t swarm_space) const {
+        if (owners_.empty())
+            return -1;
+        if (bounds_.empty())
+            return owners_.front();
+        auto bucket = swarm_space >> (64 - RADIX_BITS);
+        auto it = std::lower_bound(
+                bounds_.begin() + radix_[bucket], bounds_.begin() + radix_[bucket + 1], swarm_space);
+        return owners_[it - bounds_.begin()];
+    }
+
+    /// Returns the inclusive [lo, hi] swarm space ranges that map to the swarm at index `idx` of
+    /// the swarm vector this was built from.  There are at most two (when the swarm's region wraps
+    /// around the end of the swarm space).
+    std::vector<std::pair<uint64_t, uint64_t>> ranges(size_t idx) const;
+};
+
 struct SwarmEvents {
     /// our (potentially new) swarm id
     swarm_id_t our_swarm_id;
@@ -76,15 +140,50 @@ struct SwarmEvents {
 
 class Swarm {
 
+    /// Every funded node (including decommissioned ones) in one contiguous table, with an
+    /// open-addressing index on each pubkey type so that any lookup is a single probe sequence.
+    /// These are shared between successive Swarm snapshots and only rebuilt when the node list
+    /// actually changes.
+    class node_index {
+        std::vector<sn_record> records_;
+        // Linear probing tables (power-of-2 sized, at most half full) of 1 + the index into
+        // records_ of the node with the given pubkey, or 0 for an empty slot.
+        std::vector<uint32_t> legacy_;
+        std::vector<uint32_t> ed25519_;
+        std::vector<uint32_t> x25519_;
+
+        template <typename Key>
+        const sn_record* find(
+                const std::vector<uint32_t>& table, Key sn_record::*field, const Key& pk) const;
+
+      public:
+        node_index() = default;
+        /// Builds the index.  If any pubkey appears more than once the first node with it wins
+        /// (and a node with a repeated legacy pubkey is dropped from the table entirely).
+        explicit node_index(std::vector<sn_record> records);
+
+        const std::vector<sn_record>& records() const { return records_; }
+
+        const sn_record* find(const crypto::legacy_pubkey& pk) const;
+        const sn_record* find(const crypto::ed25519_pubkey& pk) const;
+        const sn_record* find(const crypto::x25519_pubkey& pk) const;
+    };
+
     swarm_id_t cur_swarm_id_ = INVALID_SWARM_ID;
     /// Note: this excludes the "dummy" swarm
     std::vector<SwarmInfo> all_valid_swarms_;
     sn_record our_address_;
     std::vector<sn_record> swarm_peers_;
-    /// This includes decommissioned nodes
-    std::unordered_map<crypto::legacy_pubkey, sn_record> all_funded_nodes_;
-    std::unordered_map<crypto::ed25519_pubkey, crypto::legacy_pubkey> all_funded_ed25519_;
-    std::unordered_map<crypto::x25519_pubkey, crypto::legacy_pubkey> all_funded_x25519_;
+    std::shared_ptr<const node_index> funded_ = std::make_shared<const node_index>();
+    /// Lookup index for all_valid_swarms_; rebuilt whenever the set of swarm ids changes
+    std::shared_ptr<const SwarmLookup> lookup_ = std::make_shared<SwarmLookup>();
+    /// True if our state was last set by an active update_state(), and so is exactly what
+    /// applying the same swarms and decommissioned nodes again would produce.
+    bool applied_active_ = false;
+
+    /// Returns true if all_valid_swarms_ plus `decommissioned` hold exactly the nodes (with the
+    /// same details) of funded_, i.e. the funded node indices don't need rebuilding.
+    bool same_funded(const std::vector<sn_record>& decommissioned) const;
 
     /// Check if `sid` is an existing (active) swarm
     bool is_existing_swarm(swarm_id_t sid) const;
@@ -107,8 +206,24 @@ class Swarm {
 
     void apply_swarm_changes(std::vector<SwarmInfo>&& new_swarms);
 
+    /// Returns true if applying the given swarms and decommissioned nodes (as an active update)
+    /// would leave us exactly as we are, in which case the update can be skipped entirely.  This
+    /// is the usual case: most new blocks don't change the service node list.
+    bool is_current(
+            const std::vector<SwarmInfo>& swarms,
+            const std::vector<sn_record>& decommissioned) const;
+
     bool is_pubkey_for_us(const user_pubkey_t& pk) const;
 
+    /// Returns a pointer to the element of all_valid_swarms() responsible for the given pubkey;
+    /// this is equivalent to `get_swarm_by_pk(all_valid_swarms(), pk)`, but faster.  Returns
+    /// nullptr if there are no swarms.
+    const SwarmInfo* find_swarm(const user_pubkey_t& pk) const;
+
+    /// Returns the inclusive swarm space ranges of the pubkeys that belong to the given swarm (see
+    /// SwarmLookup::ranges).  Empty if the swarm doesn't exist.
+    std::vector<std::pair<uint64_t, uint64_t>> swarm_space_ranges(swarm_id_t swarm) const;
+
     const std::vector<sn_record>& other_nodes() const { return swarm_peers_; }
 
     const std::vector<SwarmInfo>& all_valid_swarms() const { return all_valid_swarms_; }
@@ -121,9 +236,8 @@ class Swarm {
 
     void set_swarm_id(swarm_id_t sid);
 
-    const std::unordered_map<crypto::legacy_pubkey, sn_record>& all_funded_nodes() const {
-        return all_funded_nodes_;
-    }
+    /// Every fully-funded SN (including decommissioned ones), in no particular order
+    const std::vector<sn_record>& all_funded_nodes() const { return funded_->records(); }
 
     // Get the node with public key `pk` if exists; these search *all* fully-funded SNs
     // (including decommissioned ones), not just the current swarm.
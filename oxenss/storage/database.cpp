@@ -1,17 +1,36 @@
 #include "database.hpp"
+#include "hash_filter.hpp"
+#include "journal.hpp"
 #include "SQLiteCpp/Statement.h"
 #include "SQLiteCpp/Transaction.h"
 #include "oxenss/logging/oxen_logger.h"
+#include "oxenss/utils/base64.hpp"
+#include "oxenss/utils/memory.hpp"
+#include "oxenss/utils/random.hpp"
 #include "oxenss/utils/string_utils.hpp"
 #include "oxenss/utils/time.hpp"
+#include "oxenss/utils/trace.hpp"
 #include <oxenc/hex.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <exception>
+#include <future>
+#include <limits>
+#include <list>
+#include <mutex>
+#include <optional>
 #include <shared_mutex>
+#include <stdexcept>
 #include <thread>
 #include <type_traits>
+#include <unordered_map>
 #include <unordered_set>
 #include <utility>
 
@@ -49,19 +68,74 @@ namespace {
         st.bindNoCopy(i, static_cast<const void*>(blob.data()), blob.size());
     }
 
+    // Message hashes are stored in the database by key: the 32 hash bytes (as a blob) for hashes
+    // that are the unpadded base64 encoding of 32 bytes (i.e. all the hashes we compute), and the
+    // hash itself (as text) for any other hash.  This roughly halves the size of the hash columns
+    // and indices, and lets lookups compare fixed-size blobs.  The hash_text() SQL function turns a
+    // stored key back into the hash.
+    constexpr size_t HASH_BYTES = 32;
+    constexpr size_t HASH_B64_SIZE = 43;  // Unpadded
+    using packed_hash = std::array<char, HASH_BYTES>;
+
+    // Returns the packed bytes of `hash` if it is stored as a blob, nullopt otherwise.
+    std::optional<packed_hash> pack_hash(std::string_view hash) {
+        if (hash.size() != HASH_B64_SIZE)
+            return std::nullopt;
+        auto bytes = util::base64_decode(hash);
+        if (!bytes || bytes->size() != HASH_BYTES)
+            return std::nullopt;
+        // Only accept the encoding we would produce ourselves (rather than, say, the URL-safe
+        // alphabet or non-zero trailing bits) so that unpacking gives back exactly `hash`.
+        char b64[util::base64_encoded_size(HASH_BYTES)];
+        util::base64_encode(*bytes, b64);
+        if (hash != std::string_view{b64, HASH_B64_SIZE})
+            return std::nullopt;
+        packed_hash packed;
+        std::memcpy(packed.data(), bytes->data(), HASH_BYTES);
+        return packed;
+    }
+
+    // Wrapper for binding a message hash by its key (see pack_hash) through the templated binding
+    // code below, e.g. `exec_query(st, owner, hash_binder{hash})`.
+    struct hash_binder {
+        std::string_view hash;
+        explicit hash_binder(std::string_view h) : hash{h} {}
+    };
+
+    // Binds the key of a message hash at parameter index i.
+    void bind_hash(SQLite::Statement& st, int i, std::string_view hash) {
+        if (auto packed = pack_hash(hash))
+            st.bind(i, static_cast<const void*>(packed->data()), static_cast<int>(HASH_BYTES));
+        else
+            st.bind(i, std::string{hash});
+    }
+
     // Called from exec_query and similar to bind statement parameters for immediate execution.
     // strings (and c strings) use no-copy binding; user_pubkey_t values use *two* sequential
-    // binding slots for pubkey (first) and type (second); integer values are bound by value.
-    // You can bind a blob (by reference, like strings) by passing `blob_binder{data}`.
+    // binding slots for pubkey (first) and type (second); optional<segment_ref> values use
+    // *three*, for segment, offset and size (all NULL if empty); integer values are bound by value.
+    // You can bind a blob (by reference, like strings) by passing `blob_binder{data}`, and a
+    // message hash's key by passing `hash_binder{hash}`.
     template <typename T>
     void bind_oneshot(SQLite::Statement& st, int& i, const T& val) {
         if constexpr (std::is_same_v<T, std::string> || is_cstr<T>)
             st.bindNoCopy(i++, val);
         else if constexpr (std::is_same_v<T, blob_binder>)
             bind_blob_ref(st, i++, val.data);
+        else if constexpr (std::is_same_v<T, hash_binder>)
+            bind_hash(st, i++, val.hash);
         else if constexpr (std::is_same_v<T, user_pubkey_t>) {
             bind_blob_ref(st, i++, val.raw());
             st.bind(i++, val.type());
+        } else if constexpr (std::is_same_v<T, std::optional<segment_ref>>) {
+            if (val) {
+                st.bind(i++, val->segment);
+                st.bind(i++, val->offset);
+                st.bind(i++, val->size);
+            } else {
+                for (int j = 0; j < 3; j++)
+                    st.bind(i++);
+            }
         } else if constexpr (std::is_same_v<T, namespace_id>)
             st.bind(i++, static_cast<std::underlying_type_t<namespace_id>>(val));
         else
@@ -221,6 +295,64 @@ namespace {
         return results;
     }
 
+    // Builds a query of the form `PREFIX ?,?,...,? SUFFIX` with `count` placeholders.
+    std::string multi_in_query(std::string_view prefix, size_t count, std::string_view suffix) {
+        std::string query;
+        query.reserve(prefix.size() + (count == 0 ? 0 : 2 * count - 1) + suffix.size());
+        query += prefix;
+        for (size_t i = 0; i < count; i++) {
+            if (i > 0)
+                query += ',';
+            query += '?';
+        }
+        query += suffix;
+        return query;
+    }
+
+    // Tracks the aggregate size of the messages returned by a retrieve (or by all the queries of a
+    // retrieve_multi) against its `max_size`.
+    struct retrieve_budget {
+        std::optional<size_t> max_size;
+        bool size_b64;
+        size_t per_message_overhead;
+        size_t used = 0;
+        size_t count = 0;
+
+        // Adds the message to the total, returning false (without adding it) if it doesn't fit.
+        // The first message always fits.
+        bool take(const message_view& m) {
+            if (max_size) {
+                size_t size = per_message_overhead + m.hash.size() +
+                              (size_b64 ? m.data.size() * 4 / 3 : m.data.size());
+                if (count > 0 && used + size > *max_size)
+                    return false;
+                used += size;
+            }
+            count++;
+            return true;
+        }
+    };
+
+}  // namespace
+
+// One shard's part of a batch opened by Database::begin_batch
+struct batch_shard {
+    DatabaseImpl* impl;
+    // If set then we hold the shard's write_mutex and have a transaction open on its shared
+    // connection, which the batch's reads use as well; otherwise a read transaction is open on the
+    // thread's read-only connection.
+    std::unique_lock<std::recursive_mutex> write_lock;
+    // Retrieve cache fill token, taken before the batch's first read
+    uint64_t token;
+    // Accounts changed by the batch, to drop from the retrieve cache again once committed
+    std::vector<user_pubkey_t> changed;
+    // Subkeys revoked by the batch, to add to Database::revoked_subkeys once committed
+    std::vector<std::string> revoked;
+};
+
+namespace {
+    // The shards of the batch open on this thread, if any
+    thread_local std::vector<batch_shard>* thread_batch = nullptr;
 }  // namespace
 
 class DatabaseImpl {
@@ -231,18 +363,137 @@ class DatabaseImpl {
     // keep track of db full errorss so we don't print them on every store
     std::atomic<int> db_full_counter = 0;
 
+    // Held while making changes to the database.  sqlite3 transactions belong to the connection,
+    // not the thread, so without this a write from one thread could end up inside (or interfere
+    // with) an explicit transaction that another thread has open on the same connection.
+    // Recursive because a batch (see Database::begin_batch) holds it across the writes it makes.
+    std::recursive_mutex write_mutex;
+
+    // Bounded LRU cache of prepared statements, keyed by query.  Each thread has its own cache
+    // that is only ever accessed from that thread.
+    struct statement_cache {
+        // Most recently used statements are at the front
+        std::list<std::pair<std::string, std::shared_ptr<SQLite::Statement>>> lru;
+        // Views into the `lru` query strings
+        std::unordered_map<std::string_view, decltype(lru)::iterator> index;
+    };
+
+    // Each thread's statements: those on the shared connection (`db`), and those on the thread's
+    // own read-only connection (see prepared_read_st), which gets opened on first use.
+    struct thread_statements {
+        statement_cache writer;
+        std::unique_ptr<SQLite::Database> reader_db;
+        statement_cache reader;  // (Declared after reader_db so that it gets destroyed first)
+    };
+
     // SQLiteCpp's statements are not thread-safe, so we prepare them thread-locally when needed
-    std::unordered_map<std::thread::id, std::unordered_map<std::string, SQLite::Statement>>
-            prepared_sts;
+    std::unordered_map<std::thread::id, thread_statements> prepared_sts;
     std::shared_mutex prepared_sts_mutex;
 
+    // Statement cache counters; see Database::statement_cache_stats.
+    std::atomic<int64_t> st_hits = 0, st_misses = 0, st_evictions = 0, st_cached = 0,
+                         st_prepare_ns = 0;
+
+    // Newest messages of recently polled accounts in this shard.  Kept in sync with the database
+    // by everything that changes messages (while holding write_mutex, so that the cache sees the
+    // changes in the same order as the database).
+    RetrieveCache retrieve_cache;
+
+    // The hashes of the messages in this shard, so that deletes, expiry updates and expiry lookups
+    // naming messages we don't have can skip the query (see maybe_stored).  Kept in sync by
+    // temporary triggers on the messages table (see hash_filter_triggers): inserted hashes get
+    // added straight away (so a rolled back insert just leaves a false positive), but deleted
+    // hashes are only removed once their transaction commits.  Replaced by a resized one (while
+    // holding write_mutex) when it gets too full or too empty; see resize_hash_filter().
+    std::shared_ptr<HashFilter> hash_filter;
+    // Hashes deleted by the transaction in progress.  Only touched while holding write_mutex.
+    std::vector<std::string> uncommitted_removes;
+    // Hash filter counters; see Database::hash_filter_stats.
+    std::atomic<int64_t> hf_lookups = 0, hf_skipped = 0, hf_false_positives = 0, hf_rebuilds = 0;
+
+    // Owner ids of accounts in this shard, so that most queries can use the id directly rather than
+    // looking it up in the owners table first.  Owner rows disappear when their last message is
+    // deleted (via the owner_autoclean trigger), and newly inserted ones disappear again if their
+    // transaction gets rolled back; the sqlite update, commit and rollback hooks keep this in sync
+    // with both.
+    struct owner_cache {
+        std::shared_mutex mutex;
+        std::unordered_map<user_pubkey_t, int64_t> ids;
+        std::unordered_map<int64_t, user_pubkey_t> pubkeys;
+        // Owner rows inserted by the transaction in progress
+        std::vector<int64_t> uncommitted;
+        // Incremented whenever anything gets removed; lookups don't add what they found if this
+        // changed while they were looking it up.
+        uint64_t generation = 0;
+    } owners;
+
+    // Message payloads stored outside of the database (see Database::Database).  Rows with such
+    // a payload have an empty `data` and set the cold_segment/cold_offset/cold_size columns.
+    SegmentStore cold;
+
     int page_size;
 
-    DatabaseImpl(Database& parent, const std::filesystem::path& db_path) :
+    // The size limit of this database (and of its payload segments)
+    const int64_t size_limit;
+
+    // The owner id after which the next eviction pass continues checking account quotas
+    int64_t quota_cursor = 0;
+
+    // Where the database lives, and how it is tuned, for opening more connections to it
+    const std::filesystem::path path;
+    const db_tuning tuning;
+
+    // Set if the database still has the table of messages from the original database schema, to
+    // be migrated in the background; see read_legacy().
+    bool legacy_pending = false;
+
+    // Background checkpointing (see db_tuning::background_checkpoint).  `checkpoint_db` is a
+    // second connection so that checkpoints don't hold the mutex of `db` (which every query on this
+    // shard needs); checkpoint_wanted gets set by the WAL hook once the WAL reaches
+    // `checkpoint_pages`.
+    std::optional<SQLite::Database> checkpoint_db;
+    int checkpoint_pages = 0;
+    std::atomic<bool> checkpoint_wanted = false;
+    std::atomic<int64_t> checkpoints = 0, checkpointed = 0, checkpoint_busy = 0, checkpoint_ns = 0;
+
+    // Ingest journal (see db_tuning::ingest_journal); null unless in use.  Journaled messages wait
+    // in `journal_pending` (in journal order, and indexed by hash) until they have been written
+    // into the database.  `journal_mutex` is held while appending, so that nothing new gets into
+    // the journal while it is being emptied; it must never be taken while holding write_mutex.
+    // `journal_db` is a separate connection for the checkpoints that make sure journaled messages
+    // are on disk before the journal gets emptied.
+    std::unique_ptr<IngestJournal> journal;
+    std::optional<SQLite::Database> journal_db;
+    std::mutex journal_mutex;
+    std::vector<shared_message> journal_pending;
+    std::unordered_map<std::string_view, shared_message> journal_index;
+    std::atomic<int64_t> journal_waiting = 0;  // journal_pending.size(), for checking unlocked
+    // Set when writing journaled messages into the database fails because it is full: stores then
+    // bypass the journal (so that they can report it) until one succeeds again.
+    std::atomic<bool> journal_full = false;
+    std::atomic<int64_t> journaled = 0;
+
+    // sqlite3_db_status counters accumulated so far; see get_io_stats().
+    std::atomic<int64_t> cache_hits = 0, cache_misses = 0, cache_writes = 0, cache_spills = 0;
+
+    // Opens (creating or upgrading, if necessary) the database file `db_file`, which will be
+    // limited to `size_limit` bytes (as will its payload segments).  If `defer_legacy` is true then
+    // messages in the original database schema are left for the caller to move over with
+    // read_legacy(), rather than being migrated before the constructor returns.
+    DatabaseImpl(
+            Database& parent,
+            const std::filesystem::path& db_file,
+            int64_t size_limit,
+            bool defer_legacy = false,
+            const db_tuning& tuning = {}) :
             parent{parent},
-            db{db_path / std::filesystem::u8path("storage.db"),
+            db{db_file,
                SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE | SQLite::OPEN_FULLMUTEX,
-               SQLite_busy_timeout.count()} {
+               SQLite_busy_timeout.count()},
+            cold{std::filesystem::u8path(db_file.u8string() + "-segments"), size_limit},
+            size_limit{size_limit},
+            path{db_file},
+            tuning{tuning} {
         // Don't fail on these because we can still work even if they fail
         if (int rc = db.tryExec("PRAGMA journal_mode = WAL"); rc != SQLITE_OK)
             log::error(logcat, "Failed to set journal mode to WAL: {}", sqlite3_errstr(rc));
@@ -250,6 +501,9 @@ class DatabaseImpl {
         if (int rc = db.tryExec("PRAGMA synchronous = NORMAL"); rc != SQLITE_OK)
             log::error(logcat, "Failed to set synchronous mode to NORMAL: {}", sqlite3_errstr(rc));
 
+        apply_tuning(db);
+        pragma(db, "wal_autocheckpoint = " + std::to_string(tuning.wal_autocheckpoint));
+
         if (int rc = db.tryExec("PRAGMA foreign_keys = ON"); rc != SQLITE_OK) {
             auto m = fmt::format(
                     "Failed to enable foreign keys constraints: {}", sqlite3_errstr(rc));
@@ -265,11 +519,17 @@ class DatabaseImpl {
             throw std::runtime_error{"Foreign key support is required"};
         }
 
+        register_functions(db);
+
+        sqlite3_update_hook(db.getHandle(), &DatabaseImpl::on_update, this);
+        sqlite3_commit_hook(db.getHandle(), &DatabaseImpl::on_commit, this);
+        sqlite3_rollback_hook(db.getHandle(), &DatabaseImpl::on_rollback, this);
+
         page_size = db.execAndGet("PRAGMA page_size").getInt();
         // Would use a placeholder here, but sqlite3 apparently doesn't support them for
         // PRAGMAs.
         if (int rc = db.tryExec(
-                    "PRAGMA max_page_count = " + std::to_string(Database::SIZE_LIMIT / page_size));
+                    "PRAGMA max_page_count = " + std::to_string(size_limit / page_size));
             rc != SQLITE_OK) {
             auto m = fmt::format("Failed to set max page count: {}", sqlite3_errstr(rc));
             log::critical(logcat, m);
@@ -280,12 +540,33 @@ class DatabaseImpl {
             create_schema();
         }
 
-        bool have_namespace = false;
+        bool have_swarm_space = false;
+        SQLite::Statement owner_cols{db, "PRAGMA main.table_info(owners)"};
+        while (owner_cols.executeStep()) {
+            auto [cid, name] = get<int64_t, std::string>(owner_cols);
+            if (name == "swarm_space")
+                have_swarm_space = true;
+        }
+
+        if (!have_swarm_space) {
+            log::info(logcat, "Upgrading database schema");
+            SQLite::Transaction transaction{db};
+            db.exec(R"(
+DROP TRIGGER IF EXISTS owned_messages_insert;
+ALTER TABLE owners ADD COLUMN swarm_space INTEGER;
+UPDATE owners SET swarm_space = swarm_space(pubkey);
+            )");
+            transaction.commit();
+        }
+
+        bool have_namespace = false, have_cold = false;
         SQLite::Statement msg_cols{db, "PRAGMA main.table_info(messages)"};
         while (msg_cols.executeStep()) {
             auto [cid, name] = get<int64_t, std::string>(msg_cols);
             if (name == "namespace")
                 have_namespace = true;
+            else if (name == "cold_segment")
+                have_cold = true;
         }
 
         if (!have_namespace) {
@@ -298,6 +579,19 @@ ALTER TABLE messages ADD COLUMN namespace INTEGER NOT NULL DEFAULT 0;
             )");
         }
 
+        if (!have_cold) {
+            log::info(logcat, "Upgrading database schema");
+            SQLite::Transaction transaction{db};
+            db.exec(R"(
+DROP TRIGGER IF EXISTS owned_messages_insert;
+DROP VIEW IF EXISTS owned_messages;
+ALTER TABLE messages ADD COLUMN cold_segment INTEGER;
+ALTER TABLE messages ADD COLUMN cold_offset INTEGER;
+ALTER TABLE messages ADD COLUMN cold_size INTEGER;
+            )");
+            transaction.commit();
+        }
+
         if (!db.tableExists("revoked_subkeys")) {
             log::info(logcat, "Upgrading database schema");
             db.exec(R"(
@@ -322,11 +616,195 @@ CREATE TRIGGER IF NOT EXISTS subkey_autoclean
             )");
         }
 
+        if (db.execAndGet("PRAGMA user_version").getInt() < SCHEMA_VERSION)
+            upgrade_hash_keys();
+
         views_triggers_indices();
 
+        if (db.tableExists("Data")) {
+            if (defer_legacy) {
+                log::warning(
+                        logcat,
+                        "Old database schema detected; its messages will be migrated in the "
+                        "background");
+                // Lets us move individual accounts' (and look up individual) messages ahead of
+                // the rest; much cheaper than the migration itself.
+                db.exec(R"(
+CREATE INDEX IF NOT EXISTS legacy_data_owner ON Data(Owner);
+CREATE INDEX IF NOT EXISTS legacy_data_hash ON Data(Hash);
+                )");
+                legacy_pending = true;
+            } else {
+                migrate_legacy();
+            }
+        }
+
+        drop_lost_payloads();
+
+        build_hash_filter();
+        hash_filter_triggers();
+
+        // Only now, so that any migration above still gets checkpointed as it goes
+        if (tuning.background_checkpoint) {
+            checkpoint_db.emplace(db_file, SQLite::OPEN_READWRITE, SQLite_busy_timeout.count());
+            // The connection doesn't know it's in WAL mode (and so has nothing to checkpoint)
+            // until it has read the database header
+            checkpoint_db->execAndGet("PRAGMA journal_mode");
+            checkpoint_pages = std::max(tuning.wal_autocheckpoint, 1);
+            // Replaces sqlite3's own automatic checkpointing, which is also done through this hook
+            sqlite3_wal_hook(db.getHandle(), &DatabaseImpl::on_wal, this);
+        }
+
         log::info(logcat, "Database setup complete");
     }
 
+    // Sets a PRAGMA on a connection, logging (but otherwise ignoring) failure.
+    static void pragma(SQLite::Database& conn, const std::string& setting) {
+        if (int rc = conn.tryExec("PRAGMA " + setting); rc != SQLITE_OK)
+            log::error(logcat, "Failed to set PRAGMA {}: {}", setting, sqlite3_errstr(rc));
+    }
+
+    // Applies the per-connection settings of `tuning` to a connection.
+    void apply_tuning(SQLite::Database& conn) {
+        if (tuning.mmap_size > 0)
+            pragma(conn, "mmap_size = " + std::to_string(tuning.mmap_size));
+        if (tuning.cache_size > 0)  // Negative values are in KiB, positive ones in pages
+            pragma(conn, "cache_size = -" + std::to_string(tuning.cache_size / 1024));
+        if (tuning.temp_store_memory)
+            pragma(conn, "temp_store = MEMORY");
+    }
+
+    // Registers our SQL functions (used by the schema's triggers and queries) on a connection.
+    static void register_functions(SQLite::Database& conn) {
+        for (auto [name, fn] :
+             {std::pair{"swarm_space", &DatabaseImpl::sql_swarm_space},
+              std::pair{"hash_text", &DatabaseImpl::sql_hash_text},
+              std::pair{"hash_key", &DatabaseImpl::sql_hash_key}}) {
+            if (int rc = sqlite3_create_function_v2(
+                        conn.getHandle(),
+                        name,
+                        1,
+                        SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                        nullptr,
+                        fn,
+                        nullptr,
+                        nullptr,
+                        nullptr);
+                rc != SQLITE_OK) {
+                auto m = fmt::format(
+                        "Failed to register {} function: {}", name, sqlite3_errstr(rc));
+                log::critical(logcat, m);
+                throw std::runtime_error{m};
+            }
+        }
+    }
+
+    // Builds a hash filter (sized for twice as many messages as we have now) of the hashes
+    // currently stored, replacing the current one.  Called from the constructor, and otherwise
+    // while holding write_mutex outside of any transaction, so that nothing changes meanwhile.
+    void build_hash_filter() {
+        auto started = std::chrono::steady_clock::now();
+        auto count = db.execAndGet("SELECT COUNT(*) FROM messages").getInt64();
+        auto filter = std::make_shared<HashFilter>(2 * static_cast<size_t>(count));
+        SQLite::Statement st{db, "SELECT hash_text(hash) FROM messages"};
+        while (st.executeStep()) {
+            auto hash = st.getColumn(0);
+            filter->add(std::string_view{hash.getText(), static_cast<size_t>(hash.getBytes())});
+        }
+        std::atomic_store(&hash_filter, std::move(filter));
+        log::debug(
+                logcat,
+                "Built hash filter of {} messages in {}ms",
+                count,
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - started)
+                        .count());
+    }
+
+    // Rebuilds the hash filter if it has more entries than it was sized for (and so more false
+    // positives than we want), or a lot fewer (and so is wasting memory).  Must be called while
+    // holding write_mutex, outside of any transaction.
+    void resize_hash_filter() {
+        auto filter = std::atomic_load(&hash_filter);
+        auto entries = static_cast<size_t>(std::max<int64_t>(filter->entries(), 0));
+        if (entries <= filter->capacity() &&
+            (filter->capacity() == HashFilter::MIN_CAPACITY || entries > filter->capacity() / 8))
+            return;
+        build_hash_filter();
+        hf_rebuilds++;
+    }
+
+    // Creates the temporary (i.e. belonging to just this connection) triggers that keep the hash
+    // filter in sync with the messages table.  We only write through `db`, so the other
+    // connections don't need them.
+    void hash_filter_triggers() {
+        for (auto [name, fn] :
+             {std::pair{"hash_filter_add", &DatabaseImpl::sql_hash_filter_add},
+              std::pair{"hash_filter_remove", &DatabaseImpl::sql_hash_filter_remove}}) {
+            if (int rc = sqlite3_create_function_v2(
+                        db.getHandle(), name, 1, SQLITE_UTF8, this, fn, nullptr, nullptr, nullptr);
+                rc != SQLITE_OK) {
+                auto m = fmt::format(
+                        "Failed to register {} function: {}", name, sqlite3_errstr(rc));
+                log::critical(logcat, m);
+                throw std::runtime_error{m};
+            }
+        }
+        db.exec(R"(
+CREATE TEMP TRIGGER hash_filter_insert AFTER INSERT ON main.messages FOR EACH ROW
+    BEGIN
+        SELECT hash_filter_add(hash_text(NEW.hash));
+    END;
+CREATE TEMP TRIGGER hash_filter_delete AFTER DELETE ON main.messages FOR EACH ROW
+    BEGIN
+        SELECT hash_filter_remove(hash_text(OLD.hash));
+    END;
+        )");
+    }
+
+    static std::string_view sql_text(sqlite3_value* v) {
+        return {reinterpret_cast<const char*>(sqlite3_value_text(v)),
+                static_cast<size_t>(sqlite3_value_bytes(v))};
+    }
+
+    // Implementations of the SQL functions called by the hash filter triggers.
+    static void sql_hash_filter_add(sqlite3_context* ctx, int, sqlite3_value** argv) {
+        auto& impl = *static_cast<DatabaseImpl*>(sqlite3_user_data(ctx));
+        std::atomic_load(&impl.hash_filter)->add(sql_text(argv[0]));
+        sqlite3_result_null(ctx);
+    }
+    static void sql_hash_filter_remove(sqlite3_context* ctx, int, sqlite3_value** argv) {
+        auto& impl = *static_cast<DatabaseImpl*>(sqlite3_user_data(ctx));
+        impl.uncommitted_removes.emplace_back(sql_text(argv[0]));
+        sqlite3_result_null(ctx);
+    }
+
+    // Returns the hashes of `hashes` that the hash filter says we might have: `hashes` itself if
+    // that's all of them, otherwise `kept`, which we fill with the ones that passed.
+    const std::vector<std::string>& maybe_stored(
+            const std::vector<std::string>& hashes, std::vector<std::string>& kept) {
+        auto filter = std::atomic_load(&hash_filter);
+        size_t i = 0;
+        while (i < hashes.size() && filter->maybe_contains(hashes[i]))
+            i++;
+        hf_lookups += hashes.size();
+        if (i == hashes.size())
+            return hashes;
+        kept.assign(hashes.begin(), hashes.begin() + i);
+        for (i++; i < hashes.size(); i++)
+            if (filter->maybe_contains(hashes[i]))
+                kept.push_back(hashes[i]);
+        hf_skipped += hashes.size() - kept.size();
+        return kept;
+    }
+
+    // Counts the hashes that passed the hash filter (see maybe_stored) but turned out not to be
+    // stored after all.
+    void hash_filter_misses(size_t passed, size_t found) {
+        if (passed > found)
+            hf_false_positives += passed - found;
+    }
+
     void create_schema() {
         SQLite::Transaction transaction{db};
 
@@ -335,102 +813,198 @@ CREATE TABLE owners (
     id INTEGER PRIMARY KEY,
     type INTEGER NOT NULL,
     pubkey BLOB NOT NULL,
+    swarm_space INTEGER, -- see DatabaseImpl::swarm_space_key
 
     UNIQUE(pubkey, type)
 );
 
 CREATE TABLE messages (
     id INTEGER PRIMARY KEY,
-    hash TEXT NOT NULL,
+    hash BLOB NOT NULL, -- see pack_hash
     owner INTEGER NOT NULL REFERENCES owners(id),
     namespace INTEGER NOT NULL DEFAULT 0,
     timestamp INTEGER NOT NULL,
     expiry INTEGER NOT NULL,
     data BLOB NOT NULL,
+    cold_segment INTEGER, -- see DatabaseImpl::cold
+    cold_offset INTEGER,
+    cold_size INTEGER,
 
     UNIQUE(hash)
 );
         )");
+        db.exec("PRAGMA user_version = " + std::to_string(SCHEMA_VERSION));
 
-        if (db.tableExists("Data")) {
-            log::warning(logcat, "Old database schema detected; performing migration...");
-
-            // Migratation from old table structure:
-            //
-            // CREATE TABLE Data(
-            //    Hash VARCHAR(128) NOT NULL,
-            //    Owner VARCHAR(256) NOT NULL,
-            //    TTL INTEGER NOT NULL,
-            //    Timestamp INTEGER NOT NULL,
-            //    TimeExpires INTEGER NOT NULL,
-            //    Nonce VARCHAR(128) NOT NULL,
-            //    Data BLOB
-            // );
-
-            SQLite::Statement ins_owner{
-                    db, "INSERT INTO owners (type, pubkey) VALUES (?, ?) RETURNING id"};
-
-            std::unordered_map<std::string, int> owner_ids;
-            SQLite::Statement old_owners{db, "SELECT DISTINCT Owner FROM Data"};
-            while (old_owners.executeStep()) {
-                int type;
-                std::array<char, 32> pubkey;
-                std::string old_owner = old_owners.getColumn(0);
-                if (old_owner.size() == 66 && util::starts_with(old_owner, "05") &&
-                    oxenc::is_hex(old_owner)) {
-                    type = 5;
-                    oxenc::from_hex(old_owner.begin() + 2, old_owner.end(), pubkey.begin());
-                } else if (old_owner.size() == 64 && oxenc::is_hex(old_owner)) {
-                    type = 0;
-                    oxenc::from_hex(old_owner.begin(), old_owner.end(), pubkey.begin());
-                } else {
-                    log::warning(
-                            logcat, "Found invalid owner pubkey '{}' during migration; ignoring");
-                    continue;
-                }
+        transaction.commit();
+    }
 
-                int id = exec_and_get<int>(ins_owner, type, old_owner);
-                ins_owner.reset();
-                owner_ids.emplace(std::move(old_owner), id);
-            }
+    // Version of the schema changes that we can't detect from the tables' columns, kept in the
+    // database's user_version:
+    //
+    // 1 - message hashes are stored by key (see pack_hash), and messages_owner covers the columns
+    //     that retrieves and hash lookups read other than the payload.
+    static constexpr int SCHEMA_VERSION = 1;
 
-            log::warning(
-                    logcat, "Migrated {} owner pubkeys.  Migrating messages...", owner_ids.size());
+    // Converts the message hashes of a database from before schema version 1 to their keys, and
+    // drops the indices that views_triggers_indices then recreates in their current form.
+    void upgrade_hash_keys() {
+        log::warning(logcat, "Upgrading database schema: converting message hashes...");
+        auto started = std::chrono::steady_clock::now();
+        SQLite::Transaction transaction{db};
+        // messages_hash duplicates the index of the UNIQUE(hash) constraint
+        db.exec(R"(
+DROP INDEX IF EXISTS messages_hash;
+DROP INDEX IF EXISTS messages_owner;
+        )");
+        int converted =
+                db.exec("UPDATE messages SET hash = hash_key(hash) WHERE typeof(hash) = 'text'");
+        db.exec("PRAGMA user_version = " + std::to_string(SCHEMA_VERSION));
+        transaction.commit();
+        log::warning(
+                logcat,
+                "Converted {} message hashes in {}s",
+                converted,
+                std::chrono::duration_cast<std::chrono::seconds>(
+                        std::chrono::steady_clock::now() - started)
+                        .count());
+    }
 
-            SQLite::Statement ins_msg{
-                    db,
-                    "INSERT INTO messages (hash, owner, timestamp, expiry, "
-                    "data) VALUES (?, ?, ?, ?, ?)"};
+    // Migration from the original table structure:
+    //
+    // CREATE TABLE Data(
+    //    Hash VARCHAR(128) NOT NULL,
+    //    Owner VARCHAR(256) NOT NULL,
+    //    TTL INTEGER NOT NULL,
+    //    Timestamp INTEGER NOT NULL,
+    //    TimeExpires INTEGER NOT NULL,
+    //    Nonce VARCHAR(128) NOT NULL,
+    //    Data BLOB
+    // );
+    //
+    // where Owner is the hex pubkey, with a 05 prefix for Session ids.
 
-            SQLite::Statement sel_msgs{
-                    db,
-                    "SELECT Hash, Owner, Timestamp, TimeExpires, Data FROM Data ORDER BY rowid"};
-            int msgs = 0, bad_owners = 0;
-            while (sel_msgs.executeStep()) {
-                auto [hash, owner, ts, exp, data] =
-                        get<const char*, const char*, int64_t, int64_t, std::string>(sel_msgs);
-                auto it = owner_ids.find(owner);
-                if (it == owner_ids.end()) {
-                    bad_owners++;
-                    continue;
-                }
-                exec_query(ins_msg, hash, it->second, ts, exp, data);
-                ins_msg.reset();
-                msgs++;
-            }
+    static constexpr auto LEGACY_COLUMNS = "rowid, Hash, Owner, Timestamp, TimeExpires, Data";
 
-            log::warning(
-                    logcat,
-                    "Migrated {} messages ({} invalid owner ids); dropping old Data table",
-                    msgs,
-                    bad_owners);
+    // Parses a legacy Owner value; returns an invalid pubkey if it isn't valid.
+    user_pubkey_t legacy_owner(std::string_view owner) {
+        std::string pubkey(32, '\0');
+        if (owner.size() == 66 && util::starts_with(owner, "05") && oxenc::is_hex(owner)) {
+            oxenc::from_hex(owner.begin() + 2, owner.end(), pubkey.begin());
+            return load_pubkey(5, std::move(pubkey));
+        }
+        if (owner.size() == 64 && oxenc::is_hex(owner)) {
+            oxenc::from_hex(owner.begin(), owner.end(), pubkey.begin());
+            return load_pubkey(0, std::move(pubkey));
+        }
+        return {};
+    }
 
-            db.exec("DROP TABLE Data");
+    // Inverse of legacy_owner; returns an empty string for pubkeys that can't have legacy rows.
+    static std::string legacy_owner_hex(const user_pubkey_t& pubkey) {
+        if (pubkey.type() == 0)
+            return pubkey.hex();
+        if (pubkey.type() == 5)
+            return "05" + pubkey.hex();
+        return "";
+    }
 
-            log::warning(logcat, "Data migration complete!");
+    // Appends the unexpired, validly owned messages in the rows selected by `st` (which selects
+    // LEGACY_COLUMNS) to `out`.  Returns the last rowid, if there were any rows.
+    std::optional<int64_t> load_legacy(SQLite::Statement& st, std::vector<message>& out) {
+        auto now = to_epoch_ms(std::chrono::system_clock::now());
+        std::optional<int64_t> last;
+        while (st.executeStep()) {
+            auto [rowid, hash, owner, ts, exp, data] =
+                    get<int64_t, std::string, std::string, int64_t, int64_t, std::string>(st);
+            last = rowid;
+            if (exp <= now)
+                continue;
+            auto pubkey = legacy_owner(owner);
+            if (!pubkey) {
+                log::debug(logcat, "Found invalid owner pubkey '{}' during migration", owner);
+                continue;
+            }
+            out.emplace_back(
+                    std::move(pubkey),
+                    std::move(hash),
+                    namespace_id::Default,
+                    from_epoch_ms(ts),
+                    from_epoch_ms(exp),
+                    std::move(data));
         }
+        return last;
+    }
 
-        transaction.commit();
+    // Reads (up to) `limit` legacy rows after rowid `after` into `out` (see load_legacy).  Returns
+    // the last rowid read, or nullopt if there are no rows left.
+    std::optional<int64_t> read_legacy(int64_t after, size_t limit, std::vector<message>& out) {
+        SQLite::Statement st{
+                db,
+                fmt::format(
+                        "SELECT {} FROM Data WHERE rowid > ? ORDER BY rowid LIMIT ?",
+                        LEGACY_COLUMNS)};
+        st.bind(1, after);
+        st.bind(2, static_cast<int64_t>(limit));
+        return load_legacy(st, out);
+    }
+
+    // Reads the legacy rows of one account into `out`.
+    void read_legacy(const user_pubkey_t& pubkey, std::vector<message>& out) {
+        auto owner = legacy_owner_hex(pubkey);
+        if (owner.empty())
+            return;
+        SQLite::Statement st{
+                db, fmt::format("SELECT {} FROM Data WHERE Owner = ?", LEGACY_COLUMNS)};
+        st.bind(1, owner);
+        load_legacy(st, out);
+    }
+
+    // Looks up a legacy message by hash.
+    std::optional<message> read_legacy(const std::string& hash) {
+        SQLite::Statement st{db, fmt::format("SELECT {} FROM Data WHERE Hash = ?", LEGACY_COLUMNS)};
+        st.bind(1, hash);
+        std::vector<message> found;
+        load_legacy(st, found);
+        if (found.empty())
+            return std::nullopt;
+        return std::move(found.front());
+    }
+
+    // Removes legacy rows once they have been migrated: all rows up to `through`, or all of one
+    // account's rows.
+    void delete_legacy(int64_t through) {
+        std::lock_guard lock{write_mutex};
+        exec_query(db, "DELETE FROM Data WHERE rowid <= ?", through);
+    }
+    void delete_legacy(const user_pubkey_t& pubkey) {
+        auto owner = legacy_owner_hex(pubkey);
+        if (owner.empty())
+            return;
+        std::lock_guard lock{write_mutex};
+        exec_query(db, "DELETE FROM Data WHERE Owner = ?", owner);
+    }
+
+    // Drops the (by now empty) legacy table.
+    void drop_legacy() {
+        std::lock_guard lock{write_mutex};
+        db.exec("DROP TABLE IF EXISTS Data");
+        legacy_pending = false;
+    }
+
+    // Migrates all the legacy rows into this database before returning.
+    void migrate_legacy() {
+        log::warning(logcat, "Old database schema detected; performing migration...");
+        std::vector<message> chunk;
+        int64_t last = 0, count = 0;
+        while (auto l = read_legacy(last, Database::MIGRATION_CHUNK_SIZE, chunk)) {
+            last = *l;
+            bulk_store(chunk);
+            count += chunk.size();
+            chunk.clear();
+        }
+        log::warning(logcat, "Migrated {} messages; dropping old Data table", count);
+        drop_legacy();
+        log::warning(logcat, "Data migration complete!");
     }
 
     void views_triggers_indices() {
@@ -447,25 +1021,31 @@ CREATE TRIGGER IF NOT EXISTS owner_autoclean
     END;
 
 CREATE INDEX IF NOT EXISTS messages_expiry ON messages(expiry);
-CREATE INDEX IF NOT EXISTS messages_owner ON messages(owner, namespace, timestamp);
-CREATE INDEX IF NOT EXISTS messages_hash ON messages(hash);
+CREATE INDEX IF NOT EXISTS messages_owner ON messages(owner, namespace, id, hash, timestamp, expiry);
+CREATE INDEX IF NOT EXISTS owners_swarm_space ON owners(swarm_space);
+CREATE INDEX IF NOT EXISTS messages_cold ON messages(cold_segment) WHERE cold_segment IS NOT NULL;
 
 CREATE VIEW IF NOT EXISTS owned_messages AS
-    SELECT owners.id AS oid, type, pubkey, messages.id AS mid, hash, namespace, timestamp, expiry, data
+    SELECT owners.id AS oid, type, pubkey, messages.id AS mid, hash, namespace, timestamp, expiry, data,
+        cold_segment, cold_offset, cold_size
     FROM messages JOIN owners ON messages.owner = owners.id;
 
 CREATE TRIGGER IF NOT EXISTS owned_messages_insert
     INSTEAD OF INSERT ON owned_messages FOR EACH ROW WHEN NEW.oid IS NULL
     BEGIN
-        INSERT INTO owners (type, pubkey) VALUES (NEW.type, NEW.pubkey) ON CONFLICT DO NOTHING;
-        INSERT INTO messages (id, hash, owner, namespace, timestamp, expiry, data) VALUES (
+        INSERT INTO owners (type, pubkey, swarm_space) VALUES (NEW.type, NEW.pubkey, swarm_space(NEW.pubkey))
+            ON CONFLICT DO NOTHING;
+        INSERT INTO messages (id, hash, owner, namespace, timestamp, expiry, data, cold_segment, cold_offset, cold_size) VALUES (
             NEW.mid,
             NEW.hash,
             (SELECT id FROM owners WHERE type = NEW.type AND pubkey = NEW.pubkey),
             NEW.namespace,
             NEW.timestamp,
             NEW.expiry,
-            NEW.data
+            NEW.data,
+            NEW.cold_segment,
+            NEW.cold_offset,
+            NEW.cold_size
         );
     END;
         )");
@@ -473,27 +1053,376 @@ CREATE TRIGGER IF NOT EXISTS owned_messages_insert
         transaction.commit();
     }
 
+    // Deletes messages whose payload segment is missing or shorter than the message needs, which
+    // can happen if we crashed before the tail of a segment made it to disk.
+    void drop_lost_payloads() {
+        SQLite::Statement ends{
+                db,
+                "SELECT cold_segment, MAX(cold_offset + cold_size) FROM messages"
+                " WHERE cold_segment IS NOT NULL GROUP BY cold_segment"};
+        std::vector<std::pair<int64_t, int64_t>> short_segments;
+        while (ends.executeStep()) {
+            auto [seg, end] = get<int64_t, int64_t>(ends);
+            if (auto size = cold.size(seg); end > size)
+                short_segments.emplace_back(seg, size);
+        }
+        if (short_segments.empty())
+            return;
+
+        SQLite::Transaction t{db};
+        SQLite::Statement del{
+                db,
+                "DELETE FROM messages WHERE cold_segment = ? AND cold_offset + cold_size > ?"};
+        int dropped = 0;
+        for (auto& [seg, size] : short_segments) {
+            dropped += exec_query(del, seg, size);
+            del.reset();
+        }
+        t.commit();
+        log::warning(logcat, "Deleted {} messages with lost payloads", dropped);
+    }
+
+    // True if a payload of the given size should be stored in a segment rather than the database.
+    bool cold_payload(size_t size) const {
+        return parent.cold_threshold > 0 && size >= parent.cold_threshold &&
+               size < static_cast<size_t>(SegmentStore::SEGMENT_SIZE);
+    }
+
+    // Returns the payload of a message row whose data, cold_segment, cold_offset and cold_size are
+    // columns `col` through `col+3` of `st`.  For a payload held in a segment, `hold` is set to
+    // keep the returned view valid.  Returns nullopt if the payload's segment is gone.
+    std::optional<std::string_view> payload_view(
+            SQLite::Statement& st, int col, std::shared_ptr<const SegmentStore::mapping>& hold) {
+        if (st.isColumnNull(col + 1)) {
+            auto data = st.getColumn(col);
+            return std::string_view{
+                    static_cast<const char*>(data.getBlob()),
+                    static_cast<size_t>(data.getBytes())};
+        }
+        auto p = cold.read(
+                {st.getColumn(col + 1).getInt64(),
+                 st.getColumn(col + 2).getInt64(),
+                 st.getColumn(col + 3).getInt64()});
+        if (!p) {
+            log::warning(logcat, "Message payload missing from segment storage");
+            return std::nullopt;
+        }
+        hold = std::move(p->map);
+        return p->data;
+    }
+
+    // Same as above, but returns a copy.
+    std::optional<std::string> payload(SQLite::Statement& st, int col) {
+        std::shared_ptr<const SegmentStore::mapping> hold;
+        if (auto data = payload_view(st, col, hold))
+            return std::string{*data};
+        return std::nullopt;
+    }
+
+    // Reclaims the space of expired payloads held in segments: removes sealed segments that no
+    // message refers to any more, and moves the remaining payloads out of (at most) one sealed
+    // segment with less than Database::COLD_COMPACT_RATIO of its bytes still in use so that it can
+    // be removed, too.  Uses one-shot statements, rather than prepared_st, as this gets called
+    // from clean_expired's fan_out.
+    void compact_cold() {
+        auto sealed = cold.sealed();
+        if (sealed.empty())
+            return;
+
+        // Payloads only get appended to the current segment, and always get inserted (while still
+        // holding the lock) before anything else gets appended, so a sealed segment can't gain new
+        // references; but compaction itself must not overlap with other writes.
+        std::lock_guard lock{write_mutex};
+        std::unordered_map<int64_t, int64_t> live;
+        {
+            SQLite::Statement st{
+                    db,
+                    "SELECT cold_segment, SUM(cold_size) FROM messages"
+                    " WHERE cold_segment IS NOT NULL GROUP BY cold_segment"};
+            while (st.executeStep()) {
+                auto [seg, bytes] = get<int64_t, int64_t>(st);
+                live[seg] = bytes;
+            }
+        }
+
+        std::optional<int64_t> sparsest;
+        double sparsest_ratio = Database::COLD_COMPACT_RATIO;
+        for (auto& [seg, size] : sealed) {
+            auto it = live.find(seg);
+            if (it == live.end()) {
+                cold.remove(seg);
+                continue;
+            }
+            if (double ratio = size > 0 ? it->second / static_cast<double>(size) : 1.0;
+                ratio < sparsest_ratio) {
+                sparsest = seg;
+                sparsest_ratio = ratio;
+            }
+        }
+        if (!sparsest)
+            return;
+
+        std::vector<std::pair<int64_t, segment_ref>> moved;
+        {
+            SQLite::Statement st{
+                    db, "SELECT id, cold_offset, cold_size FROM messages WHERE cold_segment = ?"};
+            st.bind(1, *sparsest);
+            while (st.executeStep()) {
+                auto [id, offset, size] = get<int64_t, int64_t, int64_t>(st);
+                auto p = cold.read({*sparsest, offset, size});
+                std::optional<segment_ref> ref;
+                if (p)
+                    ref = cold.append(p->data);
+                if (!ref) {
+                    log::warning(logcat, "Unable to compact payload segment {}", *sparsest);
+                    return;
+                }
+                moved.emplace_back(id, *ref);
+            }
+        }
+        // The copies have to be on disk before anything points at them (and before the originals
+        // go away)
+        cold.sync();
+
+        SQLite::Transaction t{db};
+        SQLite::Statement upd{
+                db,
+                "UPDATE messages SET cold_segment = ?, cold_offset = ?, cold_size = ?"
+                " WHERE id = ?"};
+        for (auto& [id, ref] : moved) {
+            exec_query(upd, std::optional{ref}, id);
+            upd.reset();
+        }
+        t.commit();
+        cold.remove(*sparsest);
+        log::debug(
+                logcat,
+                "Compacted payload segment {}: moved {} payloads",
+                *sparsest,
+                moved.size());
+    }
+
+    // Results of one shard's part of a Database::clean_expired() call
+    struct cleanup_result {
+        int64_t deleted = 0;     // Expired messages deleted
+        int64_t evicted = 0;     // Unexpired messages evicted
+        int64_t over_quota = 0;  // ... of which were from accounts over the quota
+        bool done = true;        // False if the time budget ran out first
+    };
+
+    // Returns the bytes of the database pages in use, i.e. not counting free pages.
+    int64_t used_bytes() {
+        return (oneshot_get<int64_t>("PRAGMA page_count") -
+                oneshot_get<int64_t>("PRAGMA freelist_count")) *
+               page_size;
+    }
+
+    // Evicts unexpired messages if this shard's used space is above the high-water mark of
+    // `policy`: first those of accounts over the quota (checking up to EVICTION_QUOTA_ACCOUNTS
+    // accounts), then the soonest-to-expire messages of anyone, a chunk at a time, until it is down
+    // to the low-water mark or `deadline` passes.  Always evicts at least one chunk when over the
+    // high-water mark.  Uses one-shot statements, rather than prepared_st, as this gets called
+    // from clean_expired's fan_out.
+    void evict(
+            const db_eviction& policy,
+            std::optional<std::chrono::steady_clock::time_point> deadline,
+            cleanup_result& result) {
+        if (used_bytes() <= policy.high_water * size_limit)
+            return;
+        auto out_of_time = [&deadline] {
+            return deadline && std::chrono::steady_clock::now() >= *deadline;
+        };
+
+        int64_t evicted = 0, over_quota = 0;
+        if (policy.account_quota > 0) {
+            for (auto owner : over_quota_owners(policy.account_quota)) {
+                while (true) {
+                    int n = evict_over_quota(owner, policy.account_quota);
+                    over_quota += n;
+                    if (n < Database::EVICTION_CHUNK_SIZE || out_of_time())
+                        break;
+                }
+                if (out_of_time()) {
+                    result.done = false;
+                    break;
+                }
+            }
+            evicted = over_quota;
+        }
+
+        // The messages_expiry index gives us the soonest-to-expire messages directly.  We also
+        // need the accounts of the evicted messages, to drop them from the retrieve cache.
+        SQLite::Statement accounts{
+                db,
+                "SELECT type, pubkey FROM owners WHERE id IN"
+                " (SELECT owner FROM messages ORDER BY expiry LIMIT ?)"};
+        SQLite::Statement del{
+                db,
+                "DELETE FROM messages WHERE id IN"
+                " (SELECT id FROM messages ORDER BY expiry LIMIT ?)"
+                " RETURNING length(data)"};
+        // Deleting scattered rows rarely frees whole pages, so the used page count hardly moves
+        // until sqlite3 reuses the space; instead we work out once how much to free, and count the
+        // payloads of what we delete towards it.  Only payloads stored inline count, as payloads in
+        // segments don't take up any pages (their space is released by compact_cold).
+        const auto low_water = static_cast<int64_t>(policy.low_water * size_limit);
+        int64_t to_free = used_bytes() - low_water;
+        bool first = true;
+        while (to_free > 0) {
+            if (!first && out_of_time()) {
+                result.done = false;
+                break;
+            }
+            first = false;
+            int n;
+            {
+                std::lock_guard lock{write_mutex};
+                SQLite::Transaction transaction{db};
+                auto affected = get_all<uint8_t, std::string>(
+                        accounts, Database::EVICTION_CHUNK_SIZE);
+                accounts.reset();
+                auto sizes = get_all<int64_t>(del, Database::EVICTION_CHUNK_SIZE);
+                del.reset();
+                n = static_cast<int>(sizes.size());
+                for (auto size : sizes)
+                    to_free -= size;
+                transaction.commit();
+                for (auto& [type, pubkey] : affected)
+                    retrieve_cache.invalidate(load_pubkey(type, std::move(pubkey)));
+            }
+            evicted += n;
+            if (n < Database::EVICTION_CHUNK_SIZE)
+                break;
+        }
+
+        if (evicted > 0)
+            log::warning(
+                    logcat,
+                    "Database {} is nearly full: evicted {} unexpired messages ({} from accounts "
+                    "over quota)",
+                    path.filename().u8string(),
+                    evicted,
+                    over_quota);
+        result.evicted += evicted;
+        result.over_quota += over_quota;
+    }
+
+    // Returns the owner ids of the accounts whose messages add up to more than `quota` bytes,
+    // among the next Database::EVICTION_QUOTA_ACCOUNTS accounts after `quota_cursor` (wrapping
+    // around once we reach the end).
+    std::vector<int64_t> over_quota_owners(int64_t quota) {
+        SQLite::Statement st{
+                db,
+                "SELECT owner, SUM(length(data) + IFNULL(cold_size, 0)) FROM messages"
+                " WHERE owner > ? GROUP BY owner ORDER BY owner LIMIT ?"};
+        st.bind(1, quota_cursor);
+        st.bind(2, Database::EVICTION_QUOTA_ACCOUNTS);
+        std::vector<int64_t> over;
+        int checked = 0;
+        while (st.executeStep()) {
+            auto [owner, bytes] = get<int64_t, int64_t>(st);
+            if (bytes > quota)
+                over.push_back(owner);
+            quota_cursor = owner;
+            checked++;
+        }
+        if (checked < Database::EVICTION_QUOTA_ACCOUNTS)
+            quota_cursor = 0;
+        return over;
+    }
+
+    // Evicts up to EVICTION_CHUNK_SIZE of an account's soonest-to-expire messages beyond what fits
+    // in `quota` bytes (keeping the messages that expire last).  Returns the number evicted.
+    int evict_over_quota(int64_t owner, int64_t quota) {
+        std::lock_guard lock{write_mutex};
+        SQLite::Transaction transaction{db};
+        SQLite::Statement account{db, "SELECT type, pubkey FROM owners WHERE id = ?"};
+        auto pubkey = exec_and_maybe_get<uint8_t, std::string>(account, owner);
+        if (!pubkey)
+            return 0;
+        int n = exec_query(
+                db,
+                "DELETE FROM messages WHERE id IN (SELECT id FROM"
+                " (SELECT id, SUM(length(data) + IFNULL(cold_size, 0))"
+                " OVER (ORDER BY expiry DESC, id DESC) AS kept FROM messages WHERE owner = ?)"
+                " WHERE kept > ? LIMIT ?)",
+                owner,
+                quota,
+                Database::EVICTION_CHUNK_SIZE);
+        transaction.commit();
+        if (n > 0) {
+            auto& [type, pk] = *pubkey;
+            retrieve_cache.invalidate(load_pubkey(type, std::move(pk)));
+        }
+        return n;
+    }
+
     /** Wrapper around a SQLite::Statement that calls `tryReset()` on destruction of the
-     * wrapper. */
+     * wrapper.  The wrapper shares ownership of the statement so that it stays valid even if the
+     * cache evicts it while in use. */
     class StatementWrapper {
-        SQLite::Statement& st;
+        std::shared_ptr<SQLite::Statement> st;
+
+        // If the calling thread is tracing a request then we record a span for the statement's
+        // use, with its SQL and how many steps (total, and in full table scans) it took.
+        std::shared_ptr<util::request_trace> trace;
+        int span = -1;
+        int vm_steps = 0, scan_steps = 0;
 
       public:
         /// Whether we should reset on destruction; can be set to false if needed.
         bool reset_on_destruction = true;
 
-        explicit StatementWrapper(SQLite::Statement& st) noexcept : st{st} {}
+        explicit StatementWrapper(std::shared_ptr<SQLite::Statement> st) : st{std::move(st)} {
+            if (auto& t = util::current_trace(); t && this->st) {
+                trace = t;
+                span = trace->begin("sql", util::current_span());
+                trace->set_detail(span, this->st->getQuery());
+                auto* raw = this->st->getPreparedStatement();
+                vm_steps = sqlite3_stmt_status(raw, SQLITE_STMTSTATUS_VM_STEP, 0);
+                scan_steps = sqlite3_stmt_status(raw, SQLITE_STMTSTATUS_FULLSCAN_STEP, 0);
+            }
+        }
+        StatementWrapper(StatementWrapper&&) = default;
         ~StatementWrapper() noexcept {
-            if (reset_on_destruction)
-                st.tryReset();
+            if (st && trace) {
+                auto* raw = st->getPreparedStatement();
+                trace->end(span);
+                try {
+                    trace->set_value(
+                            span,
+                            "vm_steps",
+                            sqlite3_stmt_status(raw, SQLITE_STMTSTATUS_VM_STEP, 0) - vm_steps);
+                    trace->set_value(
+                            span,
+                            "scan_steps",
+                            sqlite3_stmt_status(raw, SQLITE_STMTSTATUS_FULLSCAN_STEP, 0) -
+                                    scan_steps);
+                } catch (...) {
+                }
+            }
+            if (st && reset_on_destruction)
+                st->tryReset();
         }
-        SQLite::Statement& operator*() noexcept { return st; }
-        SQLite::Statement* operator->() noexcept { return &st; }
-        operator SQLite::Statement&() noexcept { return st; }
+        SQLite::Statement& operator*() noexcept { return *st; }
+        SQLite::Statement* operator->() noexcept { return st.get(); }
+        operator SQLite::Statement&() noexcept { return *st; }
     };
 
-    StatementWrapper prepared_st(const std::string& query) {
-        std::unordered_map<std::string, SQLite::Statement>* sts;
+    // Prepares a statement, updating the prepare time counter.
+    std::shared_ptr<SQLite::Statement> prepare(SQLite::Database& conn, const std::string& query) {
+        auto started = std::chrono::steady_clock::now();
+        auto st = std::make_shared<SQLite::Statement>(conn, query);
+        st_prepare_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                 std::chrono::steady_clock::now() - started)
+                                 .count();
+        return st;
+    }
+
+    // Returns the calling thread's statements, opening its read-only connection if `reader` is
+    // true and it doesn't have one yet.
+    thread_statements& thread_sts(bool reader) {
+        thread_statements* sts;
         {
             std::shared_lock rlock{prepared_sts_mutex};
             if (auto it = prepared_sts.find(std::this_thread::get_id()); it != prepared_sts.end())
@@ -504,9 +1433,133 @@ CREATE TRIGGER IF NOT EXISTS owned_messages_insert
                 sts = &prepared_sts.try_emplace(std::this_thread::get_id()).first->second;
             }
         }
-        if (auto qit = sts->find(query); qit != sts->end())
-            return StatementWrapper{qit->second};
-        return StatementWrapper{sts->try_emplace(query, db, query).first->second};
+        if (reader && !sts->reader_db) {
+            auto conn = std::make_unique<SQLite::Database>(
+                    path,
+                    SQLite::OPEN_READONLY | SQLite::OPEN_FULLMUTEX,
+                    SQLite_busy_timeout.count());
+            apply_tuning(*conn);
+            register_functions(*conn);
+            // get_io_stats() looks at other threads' connections
+            std::unique_lock wlock{prepared_sts_mutex};
+            sts->reader_db = std::move(conn);
+        }
+        return *sts;
+    }
+
+    // Returns a prepared statement for `query` on the shared connection, from the calling thread's
+    // statement cache.
+    StatementWrapper prepared_st(const std::string& query) { return cached_st(query, false); }
+
+    // Same as prepared_st, but on the calling thread's own read-only connection, so that reads
+    // from different threads don't serialize on the shared connection's mutex (or wait for its
+    // writers).  Only for queries that don't need to see the changes of a transaction that the
+    // calling thread has open on the shared connection: the read-only connection only sees
+    // committed changes.  (Inside a batch transaction, which its reads must see, this gives a
+    // statement on the shared connection instead.)
+    StatementWrapper prepared_read_st(const std::string& query) { return cached_st(query, true); }
+
+    // Returns the calling thread's read-only connection (see prepared_read_st), e.g. to run
+    // several reads in one transaction.
+    SQLite::Database& reader_db() { return *thread_sts(true).reader_db; }
+
+    // Returns this shard's part of the batch open on the calling thread, if any.
+    batch_shard* batch_here() {
+        if (thread_batch)
+            for (auto& b : *thread_batch)
+                if (b.impl == this)
+                    return &b;
+        return nullptr;
+    }
+
+    // True if the calling thread has a batch transaction open on the shared connection, whose
+    // changes its reads must see.
+    bool batch_writing() {
+        auto* b = batch_here();
+        return b && b->write_lock;
+    }
+
+    // Returns the retrieve cache fill token for a read that is about to start.  Inside a batch
+    // that is the batch's token, since its snapshot may predate a new one.
+    uint64_t fill_token() {
+        if (auto* b = batch_here())
+            return b->token;
+        return retrieve_cache.fill_token();
+    }
+
+    // Drops a changed account from the retrieve cache.  Called with write_mutex held; inside a
+    // batch transaction the account gets dropped again after the commit, since other threads can
+    // refill the cache from what was committed before.
+    void changed(const user_pubkey_t& pubkey) {
+        retrieve_cache.invalidate(pubkey);
+        if (auto* b = batch_here(); b && b->write_lock)
+            b->changed.push_back(pubkey);
+    }
+
+    StatementWrapper cached_st(const std::string& query, bool reader) {
+        if (reader && batch_writing())
+            reader = false;
+        auto& sts = thread_sts(reader);
+        auto* cache = reader ? &sts.reader : &sts.writer;
+        if (auto qit = cache->index.find(query); qit != cache->index.end()) {
+            st_hits++;
+            cache->lru.splice(cache->lru.begin(), cache->lru, qit->second);
+            return StatementWrapper{qit->second->second};
+        }
+
+        st_misses++;
+        auto st = prepare(reader ? *sts.reader_db : db, query);
+        if (cache->lru.size() >= Database::STATEMENT_CACHE_SIZE) {
+            cache->index.erase(cache->lru.back().first);
+            cache->lru.pop_back();
+            st_evictions++;
+            st_cached--;
+        }
+        cache->lru.emplace_front(query, st);
+        cache->index.emplace(cache->lru.front().first, cache->lru.begin());
+        st_cached++;
+        return StatementWrapper{std::move(st)};
+    }
+
+    // Returns a statement for a query of the form `PREFIX ?,?,...,? SUFFIX` where the `?,...,?`
+    // placeholders (which must be the last parameters of the query) are bound to the keys of the
+    // message hashes `hashes` (see bind_hash), starting at parameter `first`.  Other parameters are
+    // left for the caller to bind.
+    //
+    // To keep the number of distinct statements down, the number of placeholders is rounded up to
+    // a power of 2, with the extra placeholders bound to repeats of the last value (so this is
+    // only suitable for `IN (...)` lists).  Lists longer than Database::MAX_CACHED_IN_ARITY get a
+    // one-off, uncached statement.
+    //
+    // If `reader` is true then the statement is on the thread's read-only connection, as with
+    // prepared_read_st.
+    StatementWrapper prepared_in_st(
+            std::string_view prefix,
+            std::string_view suffix,
+            int first,
+            const std::vector<std::string>& hashes,
+            bool reader = false) {
+        if (reader && batch_writing())
+            reader = false;
+        size_t arity = hashes.size();
+        if (arity > 1 && arity <= Database::MAX_CACHED_IN_ARITY) {
+            size_t bucket = 1;
+            while (bucket < arity)
+                bucket <<= 1;
+            arity = bucket;
+        }
+        auto query = multi_in_query(prefix, arity, suffix);
+        std::optional<StatementWrapper> st;
+        if (arity <= Database::MAX_CACHED_IN_ARITY)
+            st.emplace(cached_st(query, reader));
+        else {
+            st_misses++;
+            auto& sts = thread_sts(reader);
+            st.emplace(prepare(reader ? *sts.reader_db : db, query));
+        }
+        for (size_t i = 0; i < arity; i++)
+            bind_hash(*st, first + i, hashes[std::min(i, hashes.size() - 1)]);
+        return std::move(*st);
     }
 
     template <typename... T>
@@ -519,150 +1572,2110 @@ CREATE TRIGGER IF NOT EXISTS owned_messages_insert
         return exec_and_get<T...>(prepared_st(query), bind...);
     }
 
+    // Prepares and executes a single-row query without using (or adding to) the thread-local
+    // prepared statement cache.  This is used for queries that are run in parallel across shards
+    // from short-lived threads, which would otherwise populate the cache with statements for
+    // threads that will never be seen again.
+    template <typename... T, typename... Bind>
+    auto oneshot_get(const char* query, const Bind&... bind) {
+        SQLite::Statement st{db, query};
+        return exec_and_get<T...>(st, bind...);
+    }
+
     user_pubkey_t load_pubkey(uint8_t type, std::string pk) { return {type, std::move(pk)}; }
-};
 
-Database::Database(const std::filesystem::path& db_path) :
-        impl{std::make_unique<DatabaseImpl>(*this, db_path)} {
-    clean_expired();
-}
+    // Owners store their swarm space value (see user_pubkey_t::swarm_space) so that we can select
+    // the accounts in a swarm space range without having to compute it for every stored pubkey.
+    // sqlite3 integers are signed, so we store it offset by 2^63 to keep the ordering intact.
+    static int64_t swarm_space_key(uint64_t swarm_space) {
+        return static_cast<int64_t>(swarm_space ^ (uint64_t{1} << 63));
+    }
 
-Database::~Database() = default;
+    // Implementation of the `swarm_space(pubkey)` SQL function, returning the swarm_space_key of
+    // a 32-byte pubkey blob (or NULL for anything else).
+    static void sql_swarm_space(sqlite3_context* ctx, int, sqlite3_value** argv) {
+        if (sqlite3_value_type(argv[0]) != SQLITE_BLOB || sqlite3_value_bytes(argv[0]) != 32) {
+            sqlite3_result_null(ctx);
+            return;
+        }
+        user_pubkey_t pk{
+                0, std::string{static_cast<const char*>(sqlite3_value_blob(argv[0])), 32}};
+        sqlite3_result_int64(ctx, swarm_space_key(pk.swarm_space()));
+    }
 
-void Database::clean_expired() {
-    impl->prepared_exec(
-            "DELETE FROM messages WHERE expiry <= ?",
-            to_epoch_ms(std::chrono::system_clock::now()));
-}
+    // Implementation of the `hash_text(key)` SQL function, returning the message hash of a stored
+    // hash key (see pack_hash).
+    static void sql_hash_text(sqlite3_context* ctx, int, sqlite3_value** argv) {
+        if (sqlite3_value_type(argv[0]) != SQLITE_BLOB ||
+            sqlite3_value_bytes(argv[0]) != static_cast<int>(HASH_BYTES)) {
+            sqlite3_result_value(ctx, argv[0]);
+            return;
+        }
+        char b64[util::base64_encoded_size(HASH_BYTES)];
+        util::base64_encode(
+                {static_cast<const char*>(sqlite3_value_blob(argv[0])), HASH_BYTES}, b64);
+        sqlite3_result_text(ctx, b64, static_cast<int>(HASH_B64_SIZE), SQLITE_TRANSIENT);
+    }
+
+    // Implementation of the `hash_key(hash)` SQL function, the inverse of hash_text (used to
+    // convert the text hashes of older databases).
+    static void sql_hash_key(sqlite3_context* ctx, int, sqlite3_value** argv) {
+        if (sqlite3_value_type(argv[0]) == SQLITE_TEXT)
+            if (auto packed = pack_hash(sql_text(argv[0]))) {
+                sqlite3_result_blob(
+                        ctx, packed->data(), static_cast<int>(HASH_BYTES), SQLITE_TRANSIENT);
+                return;
+            }
+        sqlite3_result_value(ctx, argv[0]);
+    }
+
+    // Removes an owner from the owner cache; called with the owner cache lock held.
+    void forget_owner(int64_t id) {
+        if (auto it = owners.pubkeys.find(id); it != owners.pubkeys.end()) {
+            owners.ids.erase(it->second);
+            owners.pubkeys.erase(it);
+        }
+        owners.generation++;
+    }
+
+    // sqlite3 hooks keeping the owner cache in sync with the owners table (and applying the hash
+    // filter's pending removals).  These get invoked by whichever thread is making the change, and
+    // must not touch the database connection.
+    static void on_update(void* self, int op, const char*, const char* table, sqlite3_int64 id) {
+        if (std::string_view{table} != "owners")
+            return;
+        auto& impl = *static_cast<DatabaseImpl*>(self);
+        std::unique_lock lock{impl.owners.mutex};
+        if (op == SQLITE_INSERT)
+            impl.owners.uncommitted.push_back(id);
+        else if (op == SQLITE_DELETE)
+            impl.forget_owner(id);
+    }
+    static int on_commit(void* self) {
+        auto& impl = *static_cast<DatabaseImpl*>(self);
+        if (!impl.uncommitted_removes.empty()) {
+            auto filter = std::atomic_load(&impl.hash_filter);
+            for (auto& hash : impl.uncommitted_removes)
+                filter->remove(hash);
+            impl.uncommitted_removes.clear();
+        }
+        std::unique_lock lock{impl.owners.mutex};
+        impl.owners.uncommitted.clear();
+        return 0;  // Non-zero would turn the commit into a rollback
+    }
+    static void on_rollback(void* self) {
+        auto& impl = *static_cast<DatabaseImpl*>(self);
+        impl.uncommitted_removes.clear();
+        std::unique_lock lock{impl.owners.mutex};
+        for (auto id : impl.owners.uncommitted)
+            impl.forget_owner(id);
+        impl.owners.uncommitted.clear();
+    }
+
+    // sqlite3 WAL hook, invoked after each commit with the number of pages in the WAL, when
+    // checkpointing in the background.
+    static int on_wal(void* self, sqlite3*, const char*, int pages) {
+        auto& impl = *static_cast<DatabaseImpl*>(self);
+        if (pages >= impl.checkpoint_pages && !impl.checkpoint_wanted.exchange(true)) {
+            // Lock (and release) the mutex so that we can't notify between the checkpointer
+            // checking the flags and going to sleep.
+            {
+                std::lock_guard lock{impl.parent.checkpoint_mutex};
+            }
+            impl.parent.checkpoint_cv.notify_one();
+        }
+        return SQLITE_OK;
+    }
+
+    // Copies as much of the WAL into the database as we can without waiting for readers or
+    // writers.  Called from the checkpointer thread.
+    void checkpoint() {
+        auto started = std::chrono::steady_clock::now();
+        int wal_pages = 0, copied = 0;
+        int rc = sqlite3_wal_checkpoint_v2(
+                checkpoint_db->getHandle(),
+                nullptr,
+                SQLITE_CHECKPOINT_PASSIVE,
+                &wal_pages,
+                &copied);
+        if (rc != SQLITE_OK && rc != SQLITE_BUSY) {
+            log::warning(logcat, "Database checkpoint failed: {}", sqlite3_errstr(rc));
+            return;
+        }
+        checkpoints++;
+        if (copied > 0)
+            checkpointed += copied;
+        if (rc == SQLITE_BUSY || copied < wal_pages)
+            checkpoint_busy++;
+        checkpoint_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                 std::chrono::steady_clock::now() - started)
+                                 .count();
+    }
+
+    // Adds the sqlite3_db_status counters of the shared and all read-only connections to our
+    // totals, resetting them so that the 32-bit sqlite3 counters don't overflow.  Returns the
+    // number of bytes of page cache the connections are currently using.
+    int64_t collect_db_status() {
+        std::pair<int, std::atomic<int64_t>*> counters[] = {
+                {SQLITE_DBSTATUS_CACHE_HIT, &cache_hits},
+                {SQLITE_DBSTATUS_CACHE_MISS, &cache_misses},
+                {SQLITE_DBSTATUS_CACHE_WRITE, &cache_writes},
+                {SQLITE_DBSTATUS_CACHE_SPILL, &cache_spills}};
+        int64_t cache_used = 0;
+        auto collect = [&](SQLite::Database& conn) {
+            int current = 0, highwater = 0;
+            sqlite3_db_status(
+                    conn.getHandle(), SQLITE_DBSTATUS_CACHE_USED, &current, &highwater, 0);
+            cache_used += current;
+            for (auto& [op, total] : counters) {
+                sqlite3_db_status(conn.getHandle(), op, &current, &highwater, 1);
+                *total += current;
+            }
+        };
+        collect(db);
+        std::shared_lock lock{prepared_sts_mutex};
+        for (auto& [id, sts] : prepared_sts)
+            if (sts.reader_db)
+                collect(*sts.reader_db);
+        return cache_used;
+    }
+
+    // Adds the memory used by this database's connections and caches to `stats`.
+    void add_memory_stats(Database::memory_stats& stats) {
+        auto collect = [&stats](SQLite::Database& conn) {
+            for (auto [op, total] :
+                 {std::pair{SQLITE_DBSTATUS_CACHE_USED, &stats.page_cache},
+                  std::pair{SQLITE_DBSTATUS_STMT_USED, &stats.statements},
+                  std::pair{SQLITE_DBSTATUS_SCHEMA_USED, &stats.schema}}) {
+                int current = 0, highwater = 0;
+                sqlite3_db_status(conn.getHandle(), op, &current, &highwater, 0);
+                *total += current;
+            }
+        };
+        collect(db);
+        if (checkpoint_db)
+            collect(*checkpoint_db);
+        if (journal_db)
+            collect(*journal_db);
+        {
+            std::shared_lock lock{prepared_sts_mutex};
+            for (auto& [id, sts] : prepared_sts)
+                if (sts.reader_db)
+                    collect(*sts.reader_db);
+        }
+
+        stats.retrieve_cache += retrieve_cache.get_stats().bytes;
+        stats.hash_filters += std::atomic_load(&hash_filter)->bytes();
+        {
+            std::shared_lock lock{owners.mutex};
+            // (Each entry also holds a heap-allocated 32-byte pubkey)
+            stats.owner_caches += util::memory_of(owners.ids) + util::memory_of(owners.pubkeys) +
+                                  (owners.ids.size() + owners.pubkeys.size()) *
+                                          (32 + 1 + util::ALLOC_OVERHEAD);
+        }
+        if (journal) {
+            std::lock_guard lock{journal_mutex};
+            stats.journal += util::memory_of(journal_pending) + util::memory_of(journal_index);
+            for (auto& m : journal_pending)
+                stats.journal += sizeof(message) + util::ALLOC_OVERHEAD + util::memory_of(m->hash) +
+                                 util::memory_of(m->data);
+        }
+    }
+
+    // Returns the number of read-only connections currently open.
+    int64_t reader_count() {
+        std::shared_lock lock{prepared_sts_mutex};
+        return std::count_if(prepared_sts.begin(), prepared_sts.end(), [](const auto& sts) {
+            return (bool)sts.second.reader_db;
+        });
+    }
+
+    // Returns the owner id of the given pubkey if it is in the owner cache (without looking it up
+    // otherwise).  If `generation` is given it gets set to the cache generation we looked at.
+    std::optional<int64_t> cached_owner_id(
+            const user_pubkey_t& pubkey, uint64_t* generation = nullptr) {
+        std::shared_lock lock{owners.mutex};
+        if (auto it = owners.ids.find(pubkey); it != owners.ids.end())
+            return it->second;
+        if (generation)
+            *generation = owners.generation;
+        return std::nullopt;
+    }
+
+    // Returns the owner id of the given pubkey, or nullopt if it has no messages in this shard.
+    //
+    // If `reader` is true then a cache miss gets looked up on the thread's read-only connection
+    // (see prepared_read_st).  What it finds doesn't get cached, however: its snapshot can be
+    // older than the owner cache, and so still have an owner whose removal the cache already saw.
+    std::optional<int64_t> owner_id(const user_pubkey_t& pubkey, bool reader = false) {
+        uint64_t generation;
+        if (auto id = cached_owner_id(pubkey, &generation))
+            return id;
+        static const std::string query = "SELECT id FROM owners WHERE pubkey = ? AND type = ?";
+        if (reader)
+            return exec_and_maybe_get<int64_t>(prepared_read_st(query), pubkey);
+        auto st = prepared_st(query);
+        auto id = exec_and_maybe_get<int64_t>(st, pubkey);
+        if (id) {
+            std::unique_lock lock{owners.mutex};
+            if (owners.generation == generation) {
+                if (owners.ids.size() >= Database::OWNER_CACHE_SIZE) {
+                    owners.ids.clear();
+                    owners.pubkeys.clear();
+                }
+                owners.ids.emplace(pubkey, *id);
+                owners.pubkeys.emplace(*id, pubkey);
+            }
+        }
+        return id;
+    }
+
+    // Implementation of Database::retrieve_by_swarm_space for this database.  Returns false if
+    // iteration was stopped by `f` returning false.
+    bool retrieve_by_swarm_space(
+            uint64_t lo,
+            uint64_t hi,
+            const std::function<bool(message&& msg)>& f,
+            size_t chunk_size) {
+        if (chunk_size < 1)
+            chunk_size = 1;
+
+        struct owner_row {
+            int64_t id;
+            uint8_t type;
+            std::string pubkey;
+        };
+        std::vector<owner_row> owners;
+        std::vector<message> chunk;
+        chunk.reserve(chunk_size);
+
+        auto flush = [&] {
+            for (auto& msg : chunk)
+                if (!f(std::move(msg)))
+                    return false;
+            chunk.clear();
+            return true;
+        };
+
+        // Page through the owners in the range (using just the owners table and its swarm_space
+        // index), then load the messages of each of them.  As with retrieve_all, statements are
+        // reset before invoking any callbacks.
+        int64_t last_ss = swarm_space_key(lo), last_id = std::numeric_limits<int64_t>::min();
+        while (true) {
+            owners.clear();
+            {
+                auto st = prepared_st(
+                        "SELECT id, type, pubkey, swarm_space FROM owners"
+                        " WHERE swarm_space <= ? AND (swarm_space, id) > (?, ?)"
+                        " ORDER BY swarm_space, id LIMIT ?");
+                st->bind(1, swarm_space_key(hi));
+                st->bind(2, last_ss);
+                st->bind(3, last_id);
+                st->bind(4, static_cast<int64_t>(chunk_size));
+                while (st->executeStep()) {
+                    auto [id, type, pubkey, ss] =
+                            get<int64_t, uint8_t, std::string, int64_t>(st);
+                    owners.push_back({id, type, std::move(pubkey)});
+                    last_ss = ss;
+                    last_id = id;
+                }
+            }
+
+            for (auto& o : owners) {
+                {
+                    auto st = prepared_st(
+                            "SELECT hash_text(hash), namespace, timestamp, expiry, data,"
+                            " cold_segment, cold_offset, cold_size FROM messages WHERE owner = ?"
+                            " ORDER BY id");
+                    st->bind(1, o.id);
+                    while (st->executeStep()) {
+                        auto [hash, ns, ts, exp] =
+                                get<std::string, namespace_id, int64_t, int64_t>(st);
+                        auto data = payload(st, 4);
+                        if (!data)
+                            continue;
+                        chunk.emplace_back(
+                                load_pubkey(o.type, o.pubkey),
+                                std::move(hash),
+                                ns,
+                                from_epoch_ms(ts),
+                                from_epoch_ms(exp),
+                                std::move(*data));
+                    }
+                }
+                if (chunk.size() >= chunk_size && !flush())
+                    return false;
+            }
+
+            if (owners.size() < chunk_size)
+                return flush();
+        }
+    }
+
+    // Appends the messages selected by `st` (which selects MESSAGE_COLUMNS) to `out`, skipping any
+    // whose payload has been lost and, if `unexpired_only` is set, any that have expired.  Returns
+    // the id of the last row, if there were any.
+    static constexpr auto MESSAGE_COLUMNS =
+            "mid, type, pubkey, hash_text(hash), namespace, timestamp, expiry, data,"
+            " cold_segment, cold_offset, cold_size";
+    std::optional<int64_t> load_messages(
+            SQLite::Statement& st, std::vector<message>& out, bool unexpired_only) {
+        auto now = to_epoch_ms(std::chrono::system_clock::now());
+        std::optional<int64_t> last;
+        while (st.executeStep()) {
+            auto [id, type, pubkey, hash, ns, ts, exp] =
+                    get<int64_t, uint8_t, std::string, std::string, namespace_id, int64_t, int64_t>(
+                            st);
+            last = id;
+            if (unexpired_only && exp <= now)
+                continue;
+            auto data = payload(st, 7);
+            if (!data)
+                continue;
+            out.emplace_back(
+                    load_pubkey(type, std::move(pubkey)),
+                    std::move(hash),
+                    ns,
+                    from_epoch_ms(ts),
+                    from_epoch_ms(exp),
+                    std::move(*data));
+        }
+        return last;
+    }
+
+    // Reads (up to) `limit` messages with ids after `after`, in id order, into `out` (see
+    // load_messages).  Returns the last id read, or nullopt if there are none left.
+    std::optional<int64_t> read_messages(
+            int64_t after, size_t limit, std::vector<message>& out, bool unexpired_only = false) {
+        auto st = prepared_st(fmt::format(
+                "SELECT {} FROM owned_messages WHERE mid > ? ORDER BY mid LIMIT ?",
+                MESSAGE_COLUMNS));
+        st->bind(1, after);
+        st->bind(2, static_cast<int64_t>(limit));
+        return load_messages(st, out, unexpired_only);
+    }
+
+    // Reads the unexpired messages of one account into `out`.
+    void read_messages(const user_pubkey_t& pubkey, std::vector<message>& out) {
+        auto owner = owner_id(pubkey);
+        if (!owner)
+            return;
+        auto st = prepared_st(
+                fmt::format("SELECT {} FROM owned_messages WHERE oid = ?", MESSAGE_COLUMNS));
+        st->bind(1, *owner);
+        load_messages(st, out, true);
+    }
+
+    // Deletes messages once they have been migrated elsewhere: all messages with ids up to
+    // `through`, or all of one account's messages.
+    void delete_messages(int64_t through) {
+        std::lock_guard lock{write_mutex};
+        prepared_exec("DELETE FROM messages WHERE id <= ?", through);
+    }
+    void delete_messages(const user_pubkey_t& pubkey) {
+        std::lock_guard lock{write_mutex};
+        if (auto owner = owner_id(pubkey))
+            prepared_exec("DELETE FROM messages WHERE owner = ?", *owner);
+    }
+
+    // Implementation of Database::retrieve (and of each query of retrieve_multi) for this database,
+    // after any migration of the account.  Passes the messages that fit within `max_results` and
+    // `budget` to `f`, returning true if there are more than that.
+    //
+    // `owner` is the account's owner id; it gets looked up and set (to nullopt if the account has
+    // no messages here) the first time it is needed, if not already set.  `token` is the retrieve
+    // cache fill token, which the caller must have obtained before any of the reads whose results
+    // this might cache.
+    bool retrieve(
+            const user_pubkey_t& pubkey,
+            namespace_id ns,
+            const std::string& last_hash,
+            std::optional<std::optional<int64_t>>& owner,
+            uint64_t token,
+            std::optional<size_t> max_results,
+            retrieve_budget& budget,
+            const std::function<void(const message_view& msg)>& f) {
+        if (max_results && *max_results < 1)
+            max_results = 1;
+
+        // Applies the limits, then passes the message on; returns false if the limits have been
+        // reached (in which case there are more messages than we are returning).
+        size_t count = 0;
+        auto emit = [&](const message_view& m) {
+            if (max_results && count >= *max_results)
+                return false;
+            if (!budget.take(m))
+                return false;
+            f(m);
+            count++;
+            return true;
+        };
+
+        auto& cache = retrieve_cache;
+        if (auto cached = cache.find(pubkey, ns, last_hash)) {
+            for (auto& m : *cached)
+                if (!emit(message_view{
+                            m->hash, m->msg_namespace, m->timestamp, m->expiry, m->data}))
+                    return true;
+            return false;
+        }
+
+        // The read-only connection is safe here, even for filling the cache: everything that
+        // changes messages commits before updating the cache, so a change our read misses changes
+        // the fill token.
+        if (!owner)
+            owner = owner_id(pubkey, true);
+        const auto& ownerid = *owner;
+        if (!ownerid) {
+            cache.fill(token, pubkey, ns, std::nullopt, {});
+            return false;
+        }
+
+        std::optional<std::pair<int64_t, int64_t>> last;  // id and expiry of last_hash
+        if (!last_hash.empty()) {
+            auto st = prepared_read_st(
+                    "SELECT id, expiry FROM messages"
+                    " WHERE owner = ? AND namespace = ? AND hash = ?");
+            last = exec_and_maybe_get<int64_t, int64_t>(
+                    st, *ownerid, to_int(ns), hash_binder{last_hash});
+        }
+
+        auto st = prepared_read_st(
+                last ? "SELECT hash_text(hash), namespace, timestamp, expiry, data, cold_segment,"
+                       " cold_offset, cold_size FROM messages"
+                       " WHERE owner = ? AND namespace = ? AND id > ? ORDER BY id LIMIT ?"
+                     : "SELECT hash_text(hash), namespace, timestamp, expiry, data, cold_segment,"
+                       " cold_offset, cold_size FROM messages"
+                       " WHERE owner = ? AND namespace = ? ORDER BY id LIMIT ?");
+        int pos = 1;
+        st->bind(pos++, *ownerid);
+        st->bind(pos++, to_int(ns));
+        if (last)
+            st->bind(pos++, last->first);
+        st->bind(pos++, max_results ? static_cast<int>(*max_results) + 1 : -1);
+
+        // If everything we return fits in the cache then it is the newest messages of the
+        // namespace, so we keep copies of them to fill the cache with; anything larger we leave
+        // uncached (the client's next poll will most likely be an empty one, which will fill it).
+        std::vector<message> recent;
+        bool cacheable = true;
+        std::shared_ptr<const SegmentStore::mapping> hold;
+        while (st->executeStep()) {
+            // Access the hash and data in place rather than copying them out of the result row
+            // (the pointers remain valid until the next step or reset) or, for payloads held in a
+            // segment, out of the mapped segment.
+            auto data = payload_view(*st, 4, hold);
+            if (!data) {
+                cacheable = false;
+                recent.clear();
+                continue;
+            }
+            auto hash_col = st->getColumn(0);
+            message_view m{
+                    std::string_view{hash_col.getText(), static_cast<size_t>(hash_col.getBytes())},
+                    static_cast<namespace_id>(st->getColumn(1).getInt64()),
+                    from_epoch_ms(st->getColumn(2).getInt64()),
+                    from_epoch_ms(st->getColumn(3).getInt64()),
+                    *data};
+
+            if (!emit(m))
+                return true;
+
+            if (!cacheable)
+                continue;
+            if (recent.size() < RetrieveCache::RECENT_MESSAGES)
+                recent.emplace_back(
+                        std::string{m.hash},
+                        m.msg_namespace,
+                        m.timestamp,
+                        m.expiry,
+                        std::string{m.data});
+            else {
+                cacheable = false;
+                recent.clear();
+            }
+        }
+
+        if (cacheable) {
+            std::optional<RetrieveCache::anchor> before;
+            if (last)
+                before = RetrieveCache::anchor{last_hash, from_epoch_ms(last->second)};
+            cache.fill(token, pubkey, ns, std::move(before), std::move(recent));
+        }
+
+        return false;
+    }
+
+    // Implementation of Database::retrieve_all for this database (i.e. for a single shard).
+    // Returns false if iteration was stopped by `f` returning false.
+    bool retrieve_all(const std::function<bool(message&& msg)>& f, size_t chunk_size) {
+        if (chunk_size < 1)
+            chunk_size = 1;
+
+        std::vector<message> chunk;
+        chunk.reserve(chunk_size);
+        auto last_id = std::numeric_limits<int64_t>::min();
+        // The statement gets reset when each read returns, *before* we invoke the callbacks, so
+        // that the callback is free to make other database calls.
+        while (auto last = read_messages(last_id, chunk_size, chunk)) {
+            last_id = *last;
+            for (auto& msg : chunk)
+                if (!f(std::move(msg)))
+                    return false;
+            chunk.clear();
+        }
+        return true;
+    }
+
+    // Inserts a single message; returns true if inserted, false if it already exists, nullopt if
+    // the database is full; throws on other errors.
+    std::optional<bool> insert_message(const message& msg) {
+        try {
+            std::string_view data = msg.data;
+            std::optional<segment_ref> cold_ref;
+            if (cold_payload(data.size())) {
+                // Check for a duplicate first, so that we don't append payloads that the insert
+                // would then reject.
+                if (exec_and_maybe_get<int64_t>(
+                            prepared_st("SELECT id FROM messages WHERE hash = ?"),
+                            hash_binder{msg.hash}))
+                    return false;
+                cold_ref = cold.append(data);
+                if (!cold_ref) {
+                    if (db_full_counter++ % Database::DB_FULL_FREQUENCY == 0)
+                        log::error(logcat, "Failed to store message: payload segments are full");
+                    return std::nullopt;
+                }
+                data = ""sv;
+            }
+
+            // If we already know the owner we can insert straight into messages; otherwise the
+            // owned_messages insert trigger looks it up (or creates it) for us.
+            if (auto owner = owner_id(msg.pubkey))
+                exec_query(
+                        prepared_st("INSERT INTO messages (owner, hash, namespace, timestamp, "
+                                    "expiry, data, cold_segment, cold_offset, cold_size)"
+                                    " VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)"),
+                        *owner,
+                        hash_binder{msg.hash},
+                        msg.msg_namespace,
+                        to_epoch_ms(msg.timestamp),
+                        to_epoch_ms(msg.expiry),
+                        blob_binder{data},
+                        cold_ref);
+            else
+                exec_query(
+                        prepared_st("INSERT INTO owned_messages (pubkey, type, hash, namespace, "
+                                    "timestamp, expiry, data, cold_segment, cold_offset, cold_size)"
+                                    " VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)"),
+                        msg.pubkey,
+                        hash_binder{msg.hash},
+                        msg.msg_namespace,
+                        to_epoch_ms(msg.timestamp),
+                        to_epoch_ms(msg.expiry),
+                        blob_binder{data},
+                        cold_ref);
+        } catch (const SQLite::Exception& e) {
+            if (int rc = e.getErrorCode(); rc == SQLITE_CONSTRAINT)
+                return false;
+            else if (rc == SQLITE_FULL) {
+                if (db_full_counter++ % Database::DB_FULL_FREQUENCY == 0)
+                    log::error(logcat, "Failed to store message: database is full");
+                return std::nullopt;
+            } else {
+                log::error(logcat, "Failed to store message: {}", e.getErrorStr());
+                throw;
+            }
+        }
+        return true;
+    }
+
+    // Group commit for individual message stores: rather than having each store() run in its own
+    // implicit transaction, concurrent callers queue their messages here and whichever caller
+    // finds no commit in progress takes over inserting everything queued (up to
+    // Database::STORE_BATCH_MAX) in one transaction.  Stores that arrive while that commit is
+    // running queue up for the next one, so batches grow naturally with load without adding any
+    // latency when the node is quiet.
+    struct pending_store {
+        const message* msg;
+        const shared_message* shared;  // Set if `msg` is shared, so the cache can share it, too
+        std::optional<bool> result;
+        std::exception_ptr error;
+        bool done = false;
+    };
+    std::mutex store_mutex;
+    std::condition_variable store_cv;
+    std::deque<pending_store*> store_queue;
+    bool store_committing = false;
+
+    std::optional<bool> store(const message& msg, const shared_message* shared = nullptr) {
+        if (batch_writing()) {
+            // Goes into the batch's transaction, for which we already hold write_mutex
+            auto result = insert_message(msg);
+            if (result && *result)
+                changed(msg.pubkey);
+            return result;
+        }
+        if (journal) {
+            if (!journal_full)
+                return journal_store(msg, shared);
+            apply_journal(&msg.pubkey);
+        }
+        pending_store mine{&msg, shared};
+        std::unique_lock lock{store_mutex};
+        store_queue.push_back(&mine);
+        std::vector<pending_store*> batch;
+        while (!mine.done) {
+            if (store_committing) {
+                store_cv.wait(lock);
+                continue;
+            }
+            store_committing = true;
+            batch.clear();
+            while (!store_queue.empty() && batch.size() < Database::STORE_BATCH_MAX) {
+                batch.push_back(store_queue.front());
+                store_queue.pop_front();
+            }
+            lock.unlock();
+            commit_stores(batch);
+            lock.lock();
+            for (auto* p : batch)
+                p->done = true;
+            store_committing = false;
+            store_cv.notify_all();
+        }
+        if (mine.error)
+            std::rethrow_exception(mine.error);
+        return mine.result;
+    }
+
+    // Inserts a batch of queued stores.  Called without store_mutex held.
+    void commit_stores(const std::vector<pending_store*>& batch) {
+        std::lock_guard lock{write_mutex};
+        insert_stores(batch);
+        for (auto* p : batch) {
+            if (p->result && *p->result)
+                retrieve_cache.inserted(*p->msg, p->shared ? *p->shared : nullptr);
+            if (journal && !p->error)
+                journal_full = !p->result;
+        }
+    }
+
+    // Opens the ingest journal of this database; see db_tuning::ingest_journal.
+    void open_journal() {
+        journal = std::make_unique<IngestJournal>(
+                std::filesystem::u8path(path.u8string() + "-ingest"));
+        journal_db.emplace(path, SQLite::OPEN_READWRITE, SQLite_busy_timeout.count());
+        journal_db->execAndGet("PRAGMA journal_mode");
+    }
+
+    // Journals a store: returns false right away if the message is already stored (or journaled),
+    // otherwise returns true once its journal record is on disk.  The message gets written into
+    // the database later, by apply_journal().
+    std::optional<bool> journal_store(const message& msg, const shared_message* shared) {
+        if (journal_waiting) {
+            std::lock_guard lock{journal_mutex};
+            if (journal_index.count(msg.hash))
+                return false;
+        }
+        if (std::atomic_load(&hash_filter)->maybe_contains(msg.hash) &&
+            exec_and_maybe_get<int64_t>(
+                    prepared_read_st("SELECT id FROM messages WHERE hash = ?"),
+                    hash_binder{msg.hash}))
+            return false;
+
+        auto sm = shared ? *shared : std::make_shared<const message>(msg);
+        uint64_t seq;
+        {
+            std::lock_guard lock{journal_mutex};
+            if (!journal_index.emplace(sm->hash, sm).second)
+                return false;
+            try {
+                seq = journal->append(*sm);
+            } catch (...) {
+                journal_index.erase(sm->hash);
+                throw;
+            }
+            journal_pending.push_back(sm);
+            journal_waiting = journal_pending.size();
+        }
+        // The store gets acknowledged (and sent to monitors) before it reaches the database, so
+        // the account's token has to change now for a retrieve that follows not to get joined to
+        // one that started before the store.
+        retrieve_cache.touch(msg.pubkey);
+        {
+            std::lock_guard lock{parent.journal_mutex};
+        }
+        parent.journal_cv.notify_one();
+
+        journal->sync(seq);
+        journaled++;
+        return true;
+    }
+
+    // Returns the journaled message with the given hash if it hasn't been written into the
+    // database yet, null otherwise.
+    shared_message journaled_message(const std::string& hash) {
+        if (!journal_waiting)
+            return nullptr;
+        std::lock_guard lock{journal_mutex};
+        auto it = journal_index.find(hash);
+        return it == journal_index.end() ? nullptr : it->second;
+    }
+
+    // Writes journaled messages (all of them, or just those of `pubkey`) into the database.
+    void apply_journal(const user_pubkey_t* pubkey = nullptr) {
+        if (!journal_waiting)
+            return;
+        std::vector<shared_message> msgs;
+        {
+            std::lock_guard lock{journal_mutex};
+            for (auto& m : journal_pending)
+                if (!pubkey || m->pubkey == *pubkey)
+                    msgs.push_back(m);
+        }
+        if (msgs.empty())
+            return;
+        commit_journaled(msgs);
+        std::lock_guard lock{journal_mutex};
+        forget_journaled(msgs);
+    }
+
+    // Inserts journaled messages, in the same batches as concurrent stores.  Messages that can't
+    // be inserted (e.g. because the database is full) are dropped, as the store would have been.
+    void commit_journaled(const std::vector<shared_message>& msgs) {
+        std::vector<pending_store> stores;
+        std::vector<pending_store*> batch;
+        for (size_t i = 0; i < msgs.size(); i += Database::STORE_BATCH_MAX) {
+            stores.clear();
+            batch.clear();
+            for (size_t j = i; j < std::min(msgs.size(), i + Database::STORE_BATCH_MAX); j++)
+                stores.push_back({msgs[j].get(), &msgs[j]});
+            for (auto& p : stores)
+                batch.push_back(&p);
+            commit_stores(batch);
+            for (auto& p : stores) {
+                if (p.error) {
+                    try {
+                        std::rethrow_exception(p.error);
+                    } catch (const std::exception& e) {
+                        log::error(
+                                logcat,
+                                "Failed to store journaled message {}: {}",
+                                p.msg->hash,
+                                e.what());
+                    }
+                }
+            }
+        }
+    }
+
+    // Drops written messages from the pending ones.  Called with journal_mutex held.
+    void forget_journaled(const std::vector<shared_message>& msgs) {
+        std::unordered_set<const message*> done;
+        for (auto& m : msgs)
+            if (auto it = journal_index.find(m->hash);
+                it != journal_index.end() && it->second == m) {
+                journal_index.erase(it);
+                done.insert(m.get());
+            }
+        journal_pending.erase(
+                std::remove_if(
+                        journal_pending.begin(),
+                        journal_pending.end(),
+                        [&done](const auto& m) { return done.count(m.get()) > 0; }),
+                journal_pending.end());
+        journal_waiting = journal_pending.size();
+    }
+
+    // Empties the journal once it has grown past Database::JOURNAL_TRUNCATE_SIZE (or whatever its
+    // size, with `force`).  New stores wait while this writes anything still pending into the
+    // database and syncs it.
+    void maybe_truncate_journal(bool force = false) {
+        if (!journal || (!force && journal->size() < Database::JOURNAL_TRUNCATE_SIZE))
+            return;
+        std::lock_guard lock{journal_mutex};
+        if (!journal_pending.empty()) {
+            auto msgs = journal_pending;
+            commit_journaled(msgs);
+            forget_journaled(msgs);
+        }
+        if (sync_committed(*journal_db))
+            journal->truncate();
+    }
+
+    // Makes sure that everything committed to this database so far is on disk, returning false if
+    // that couldn't be done right now.  With synchronous = NORMAL commits aren't synced by
+    // themselves; a checkpoint syncs the WAL and then the database file, but only for the frames
+    // it manages to copy (a passive one stops at the first frame a reader still needs), so this
+    // only counts as synced if the checkpoint got through the whole WAL.
+    static bool sync_committed(SQLite::Database& conn) {
+        int log_frames = -1, checkpointed = -1;
+        int rc = sqlite3_wal_checkpoint_v2(
+                conn.getHandle(),
+                nullptr,
+                SQLITE_CHECKPOINT_PASSIVE,
+                &log_frames,
+                &checkpointed);
+        if (rc != SQLITE_OK) {
+            if (rc != SQLITE_BUSY)
+                log::warning(logcat, "Database checkpoint failed: {}", sqlite3_errstr(rc));
+            return false;
+        }
+        return checkpointed == log_frames;
+    }
+
+    // Called with write_mutex held.
+    void insert_stores(const std::vector<pending_store*>& batch) {
+
+        auto insert = [this](pending_store& p) {
+            p.error = nullptr;
+            try {
+                p.result = insert_message(*p.msg);
+            } catch (...) {
+                p.result.reset();
+                p.error = std::current_exception();
+            }
+        };
+
+        if (batch.size() == 1)
+            return insert(*batch.front());
+
+        try {
+            db.exec("BEGIN IMMEDIATE");
+        } catch (...) {
+            for (auto* p : batch)
+                p->error = std::current_exception();
+            return;
+        }
+
+        bool in_tx = true;
+        for (size_t i = 0; i < batch.size(); i++) {
+            insert(*batch[i]);
+            if (in_tx && sqlite3_get_autocommit(db.getHandle())) {
+                // Some errors (notably SQLITE_FULL) make sqlite roll back the entire transaction,
+                // which undoes anything we already inserted in this batch: redo those ones, and
+                // let the rest of the batch finish without a transaction.
+                in_tx = false;
+                for (size_t j = 0; j < i; j++)
+                    insert(*batch[j]);
+            }
+        }
+
+        if (in_tx) {
+            try {
+                db.exec("COMMIT");
+            } catch (const SQLite::Exception& e) {
+                log::error(logcat, "Failed to commit batch of stored messages: {}", e.what());
+                db.tryExec("ROLLBACK");
+                for (auto* p : batch) {
+                    p->result.reset();
+                    p->error = std::current_exception();
+                }
+                return;
+            }
+        }
+        log::trace(logcat, "Group-committed {} message stores", batch.size());
+    }
+
+    // Implementation of Database::bulk_store for this database.  `items` is a container of either
+    // `message`s or `const message*`s.
+    template <typename Container>
+    void bulk_store(const Container& items) {
+        constexpr auto deref = [](const auto& m) -> const message& {
+            if constexpr (std::is_pointer_v<std::decay_t<decltype(m)>>)
+                return *m;
+            else
+                return m;
+        };
+
+        bulk_store_from([&items, &deref](const auto& store) {
+            for (auto& item : items) {
+                auto& m = deref(item);
+                store(m.pubkey,
+                      message_view{m.hash, m.msg_namespace, m.timestamp, m.expiry, m.data});
+            }
+        });
+    }
+
+    // Returns `prefix`, then `rows` comma-separated copies of `row`, then `suffix`: a multi-row
+    // INSERT query.
+    static std::string multi_row_query(
+            std::string_view prefix, std::string_view row, size_t rows, std::string_view suffix) {
+        std::string q;
+        q.reserve(prefix.size() + rows * (row.size() + 1) + suffix.size());
+        q += prefix;
+        for (size_t i = 0; i < rows; i++) {
+            if (i > 0)
+                q += ',';
+            q += row;
+        }
+        q += suffix;
+        return q;
+    }
+
+    // Calls `f(offset, size)` to split `n` items into chunks of Database::BULK_STORE_ROWS, followed
+    // by decreasing powers of 2 for the remainder.
+    template <typename F>
+    static void bulk_chunks(size_t n, F&& f) {
+        size_t i = 0;
+        for (; n - i >= Database::BULK_STORE_ROWS; i += Database::BULK_STORE_ROWS)
+            f(i, Database::BULK_STORE_ROWS);
+        for (size_t size = Database::BULK_STORE_ROWS / 2; size > 0; size /= 2)
+            if (n - i >= size) {
+                f(i, size);
+                i += size;
+            }
+    }
+
+    // A message buffered by bulk_store_from.  We have to copy the message, since the views we get
+    // given don't outlive the sink call.
+    struct bulk_row {
+        int64_t* owner;  // Into bulk_store_from's `seen`, as that might not be resolved yet
+        std::string hash;
+        namespace_id ns;
+        int64_t timestamp;
+        int64_t expiry;
+        std::string data;
+        std::optional<segment_ref> cold_ref;
+    };
+
+    // Stores, in one transaction, the messages that `source` produces by calling the store
+    // callback it is given with a pubkey and message_view for each one.  Returns the number of
+    // messages inserted (i.e. not counting ones we already had).
+    //
+    // Messages are buffered and inserted Database::BULK_STORE_ROWS at a time with multi-row
+    // INSERTs.  Before each such insert the buffered messages' owners that aren't in the owner
+    // cache get looked up or created together, with multi-row owner upserts.
+    template <typename Source>
+    int64_t bulk_store_from(Source&& source) {
+        // Values of `seen` for owners we haven't resolved yet, or failed to
+        constexpr int64_t UNRESOLVED = -2, FAILED = -1;
+
+        std::lock_guard lock{write_mutex};
+        SQLite::Transaction t{db};
+        std::optional<StatementWrapper> find_hash;
+
+        // Owner ids of the accounts we've seen so far.  Messages typically arrive grouped by
+        // account, so we also remember the last one to skip the map lookups.
+        std::unordered_map<user_pubkey_t, int64_t> seen;
+        std::optional<user_pubkey_t> last_pubkey;
+        int64_t* last_owner = nullptr;
+
+        // Buffered messages (of which the first `buffered` are in use; the rest are kept around
+        // to reuse their string buffers), and the accounts they need that we have to resolve.
+        std::vector<bulk_row> rows;
+        size_t buffered = 0;
+        std::vector<const user_pubkey_t*> unresolved;
+        int64_t inserted = 0;
+
+        auto resolve_owners = [&] {
+            bulk_chunks(unresolved.size(), [&](size_t offset, size_t size) {
+                // DO UPDATE rather than DO NOTHING so that existing owners also return their id
+                auto st = prepared_st(multi_row_query(
+                        "INSERT INTO owners (pubkey, type, swarm_space) VALUES ",
+                        "(?, ?, ?)",
+                        size,
+                        " ON CONFLICT (pubkey, type) DO UPDATE SET swarm_space = "
+                        "excluded.swarm_space RETURNING id, pubkey, type"));
+                for (size_t i = 0; i < size; i++) {
+                    auto& pk = *unresolved[offset + i];
+                    bind_pubkey(st, 3 * i + 1, 3 * i + 2, pk);
+                    st->bind(3 * i + 3, swarm_space_key(pk.swarm_space()));
+                }
+                while (st->executeStep()) {
+                    auto [id, pubkey, type] = get<int64_t, std::string, int>(st);
+                    if (auto it = seen.find(user_pubkey_t{type, std::move(pubkey)});
+                        it != seen.end())
+                        it->second = id;
+                }
+            });
+            for (auto* pk : unresolved) {
+                if (auto& id = seen[*pk]; id == UNRESOLVED) {
+                    log::error(
+                            logcat, "Failed to insert owner {} for bulk store", pk->prefixed_hex());
+                    id = FAILED;
+                }
+            }
+            unresolved.clear();
+        };
+
+        auto flush = [&] {
+            resolve_owners();
+            // Drop the messages of accounts we couldn't get an owner row for
+            auto end = std::stable_partition(
+                    rows.begin(), rows.begin() + buffered, [](const bulk_row& r) {
+                        return *r.owner >= 0;
+                    });
+            size_t n = end - rows.begin();
+            bulk_chunks(n, [&](size_t offset, size_t size) {
+                auto st = prepared_st(multi_row_query(
+                        "INSERT INTO messages (owner, hash, namespace, timestamp, expiry, data,"
+                        " cold_segment, cold_offset, cold_size) VALUES ",
+                        "(?, ?, ?, ?, ?, ?, ?, ?, ?)",
+                        size,
+                        " ON CONFLICT DO NOTHING"));
+                int param = 1;
+                for (size_t i = offset; i < offset + size; i++) {
+                    auto& r = rows[i];
+                    bind_oneshot(st, param, *r.owner);
+                    bind_oneshot(st, param, hash_binder{r.hash});
+                    bind_oneshot(st, param, r.ns);
+                    bind_oneshot(st, param, r.timestamp);
+                    bind_oneshot(st, param, r.expiry);
+                    bind_oneshot(st, param, blob_binder{r.data});
+                    bind_oneshot(st, param, r.cold_ref);
+                }
+                inserted += st->exec();
+            });
+            buffered = 0;
+        };
+
+        source([&](const user_pubkey_t& pubkey, const message_view& m) {
+            if (!pubkey)
+                return;
+            if (!last_pubkey || !(*last_pubkey == pubkey)) {
+                auto [it, ins] = seen.emplace(pubkey, UNRESOLVED);
+                if (ins) {
+                    if (auto ownerid = cached_owner_id(pubkey))
+                        it->second = *ownerid;
+                    else
+                        unresolved.push_back(&it->first);
+                }
+                last_pubkey = pubkey;
+                last_owner = &it->second;
+            }
+            if (*last_owner == FAILED)
+                return;
+
+            std::string_view data = m.data;
+            std::optional<segment_ref> cold_ref;
+            if (cold_payload(data.size())) {
+                // As in insert_message, don't append the payload of a message we already have
+                // (including any we have buffered).
+                flush();
+                if (!find_hash)
+                    find_hash.emplace(prepared_st("SELECT id FROM messages WHERE hash = ?"));
+                bool dupe = exec_and_maybe_get<int64_t>(**find_hash, hash_binder{m.hash})
+                                    .has_value();
+                (*find_hash)->reset();
+                if (dupe)
+                    return;
+                cold_ref = cold.append(data);
+                if (!cold_ref) {
+                    if (db_full_counter++ % Database::DB_FULL_FREQUENCY == 0)
+                        log::error(
+                                logcat, "Failed to bulk store message: payload segments are full");
+                    return;
+                }
+                data = ""sv;
+            }
+
+            if (buffered == rows.size())
+                rows.emplace_back();
+            auto& r = rows[buffered++];
+            r.owner = last_owner;
+            r.hash.assign(m.hash);
+            r.ns = m.msg_namespace;
+            r.timestamp = to_epoch_ms(m.timestamp);
+            r.expiry = to_epoch_ms(m.expiry);
+            r.data.assign(data);
+            r.cold_ref = cold_ref;
+            if (buffered == Database::BULK_STORE_ROWS)
+                flush();
+        });
+        flush();
+
+        t.commit();
+        for (auto& [pubkey, ownerid] : seen)
+            retrieve_cache.invalidate(pubkey);
+        return inserted;
+    }
+
+    // Schema of the message snapshots made by Database::export_snapshot.  This is deliberately
+    // separate from our own schema (hashes are text, accounts aren't normalized into a table of
+    // their own) so that the two can change independently; SNAPSHOT_VERSION, kept in the image's
+    // user_version, has to change whenever this does.
+    static constexpr int SNAPSHOT_VERSION = 1;
+    static constexpr auto SNAPSHOT_SCHEMA = R"(
+CREATE TABLE messages (
+    pubkey BLOB NOT NULL,
+    type INTEGER NOT NULL,
+    hash TEXT NOT NULL,
+    namespace INTEGER NOT NULL,
+    timestamp INTEGER NOT NULL,
+    expiry INTEGER NOT NULL,
+    data BLOB NOT NULL
+);
+    )";
+
+    // Detaches the snapshot attached by import_snapshot when it goes out of scope.
+    struct snapshot_attachment {
+        SQLite::Database& db;
+        ~snapshot_attachment() {
+            if (int rc = db.tryExec("DETACH snapshot"); rc != SQLITE_OK)
+                log::error(logcat, "Failed to detach snapshot: {}", sqlite3_errstr(rc));
+        }
+    };
+
+    // Merges the messages of a snapshot image (see Database::export_snapshot) of the accounts with
+    // swarm space values in [lo, hi] into this database, returning the number of messages stored.
+    // The image gets attached, in place, as the `snapshot` schema so that everything goes in with
+    // one INSERT ... SELECT for the owners and one for the messages, in a single transaction; only
+    // payloads that belong in segments have to be copied out, to go through bulk_store_from.  The
+    // snapshot's rows get the same checks that deserializing a batch would give them.  The image
+    // must already have passed check_snapshot.
+    int64_t import_snapshot(std::string_view image, uint64_t lo, uint64_t hi) {
+        constexpr auto valid_rows =
+                " swarm_space(s.pubkey) BETWEEN ? AND ? AND s.type BETWEEN 0 AND 255"
+                " AND typeof(s.hash) = 'text' AND typeof(s.data) = 'blob'"
+                " AND s.namespace BETWEEN ? AND ? AND s.expiry > ?"sv;
+        auto lo_key = swarm_space_key(lo), hi_key = swarm_space_key(hi);
+        auto now = to_epoch_ms(std::chrono::system_clock::now());
+        // Payloads with sizes in [cold_min, cold_max) belong in segments (see cold_payload)
+        int64_t cold_min = parent.cold_threshold > 0 ? parent.cold_threshold
+                                                      : std::numeric_limits<int64_t>::max();
+        int64_t cold_max = SegmentStore::SEGMENT_SIZE;
+
+        int64_t inserted = 0;
+        std::vector<message> cold_msgs;
+        {
+            std::lock_guard lock{write_mutex};
+            db.exec("ATTACH ':memory:' AS snapshot");
+            snapshot_attachment attached{db};
+            // The image only gets read, so sqlite3 can use it where it is rather than copying it
+            if (int rc = sqlite3_deserialize(
+                        db.getHandle(),
+                        "snapshot",
+                        reinterpret_cast<unsigned char*>(const_cast<char*>(image.data())),
+                        static_cast<sqlite3_int64>(image.size()),
+                        static_cast<sqlite3_int64>(image.size()),
+                        SQLITE_DESERIALIZE_READONLY);
+                rc != SQLITE_OK)
+                throw std::runtime_error{"Failed to load snapshot: "s + sqlite3_errstr(rc)};
+
+            std::vector<user_pubkey_t> accounts;
+            {
+                SQLite::Statement st{
+                        db,
+                        fmt::format(
+                                "SELECT DISTINCT s.type, s.pubkey FROM snapshot.messages s"
+                                " WHERE{}",
+                                valid_rows)};
+                for (auto& [type, pubkey] : get_all<uint8_t, std::string>(
+                             st, lo_key, hi_key, NAMESPACE_MIN, NAMESPACE_MAX, now))
+                    accounts.push_back(load_pubkey(type, std::move(pubkey)));
+            }
+            if (accounts.empty())
+                return 0;
+
+            SQLite::Transaction t{db};
+            exec_query(
+                    db,
+                    fmt::format(
+                            "INSERT INTO owners (type, pubkey, swarm_space)"
+                            " SELECT DISTINCT s.type, s.pubkey, swarm_space(s.pubkey)"
+                            " FROM snapshot.messages s WHERE{} ON CONFLICT DO NOTHING",
+                            valid_rows)
+                            .c_str(),
+                    lo_key,
+                    hi_key,
+                    NAMESPACE_MIN,
+                    NAMESPACE_MAX,
+                    now);
+            // Rows go in in the snapshot's order, which keeps each account's messages in the order
+            // we would have stored them in.
+            inserted = exec_query(
+                    db,
+                    fmt::format(
+                            "INSERT INTO messages (owner, hash, namespace, timestamp, expiry, data)"
+                            " SELECT owners.id, hash_key(s.hash), s.namespace, s.timestamp,"
+                            " s.expiry, s.data FROM snapshot.messages s JOIN owners"
+                            " ON owners.pubkey = s.pubkey AND owners.type = s.type WHERE{}"
+                            " AND NOT (length(s.data) >= ? AND length(s.data) < ?)"
+                            " ORDER BY s.rowid ON CONFLICT DO NOTHING",
+                            valid_rows)
+                            .c_str(),
+                    lo_key,
+                    hi_key,
+                    NAMESPACE_MIN,
+                    NAMESPACE_MAX,
+                    now,
+                    cold_min,
+                    cold_max);
+            t.commit();
+            for (auto& pubkey : accounts)
+                retrieve_cache.invalidate(pubkey);
+
+            if (parent.cold_threshold > 0) {
+                SQLite::Statement st{
+                        db,
+                        fmt::format(
+                                "SELECT s.type, s.pubkey, s.hash, s.namespace, s.timestamp,"
+                                " s.expiry, s.data FROM snapshot.messages s WHERE{}"
+                                " AND length(s.data) >= ? AND length(s.data) < ?"
+                                " ORDER BY s.rowid",
+                                valid_rows)};
+                for (auto& [type, pubkey, hash, ns, ts, exp, data] : get_all<
+                             uint8_t,
+                             std::string,
+                             std::string,
+                             namespace_id,
+                             int64_t,
+                             int64_t,
+                             std::string>(
+                             st,
+                             lo_key,
+                             hi_key,
+                             NAMESPACE_MIN,
+                             NAMESPACE_MAX,
+                             now,
+                             cold_min,
+                             cold_max))
+                    cold_msgs.emplace_back(
+                            load_pubkey(type, std::move(pubkey)),
+                            std::move(hash),
+                            ns,
+                            from_epoch_ms(ts),
+                            from_epoch_ms(exp),
+                            std::move(data));
+            }
+        }
+
+        if (!cold_msgs.empty())
+            inserted += bulk_store_from([&cold_msgs](const auto& store) {
+                for (auto& m : cold_msgs)
+                    store(m.pubkey,
+                          message_view{m.hash, m.msg_namespace, m.timestamp, m.expiry, m.data});
+            });
+        return inserted;
+    }
+};
+
+namespace {
+
+    // Time this thread has spent in Database calls; see Database::thread_time().
+    thread_local std::chrono::steady_clock::duration thread_db_time{0};
+    thread_local int db_timer_depth = 0;
+
+    // Adds the time until its destruction to the thread's database time.  Nested timers (i.e.
+    // Database calls made by other Database calls) don't count again.
+    struct db_timer {
+        std::chrono::steady_clock::time_point started;
+        db_timer() {
+            if (db_timer_depth++ == 0)
+                started = std::chrono::steady_clock::now();
+        }
+        ~db_timer() {
+            if (--db_timer_depth == 0)
+                thread_db_time += std::chrono::steady_clock::now() - started;
+        }
+        db_timer(const db_timer&) = delete;
+        db_timer& operator=(const db_timer&) = delete;
+    };
+
+    // Returns the filename to use for shard `i` of `n`
+    std::string shard_filename(size_t i, size_t n) {
+        if (n == 1)
+            return "storage.db";
+        return fmt::format("storage-{}-of-{}.db", i + 1, n);
+    }
+
+    // Returns true if `filename` is a database filename for any shard configuration
+    bool is_shard_filename(std::string_view filename) {
+        if (filename == "storage.db")
+            return true;
+        if (!util::starts_with(filename, "storage-") || !util::ends_with(filename, ".db"))
+            return false;
+        filename.remove_prefix(8);
+        filename.remove_suffix(3);
+        auto of = filename.find("-of-");
+        if (of == std::string_view::npos)
+            return false;
+        size_t i, n;
+        return util::parse_int(filename.substr(0, of), i) &&
+               util::parse_int(filename.substr(of + 4), n) && i >= 1 && i <= n;
+    }
+
+    // Invokes `f(shard)` for each of the given shards, returning a vector of the results.  If there
+    // is more than one shard then the calls happen in parallel, in separate threads.  Note that
+    // because these may run in short-lived threads, `f` should not be using the thread-local
+    // prepared statement cache (i.e. `prepared_st`).
+    template <typename F>
+    auto fan_out(const std::vector<std::unique_ptr<DatabaseImpl>>& shards, F&& f) {
+        using R = decltype(f(*shards.front()));
+        std::vector<R> results;
+        results.reserve(shards.size());
+        if (shards.size() == 1) {
+            results.push_back(f(*shards.front()));
+            return results;
+        }
+        std::vector<std::future<R>> futures;
+        futures.reserve(shards.size());
+        for (auto& shard : shards)
+            futures.push_back(std::async(std::launch::async, [&f, &shard] { return f(*shard); }));
+        for (auto& fut : futures)
+            results.push_back(fut.get());
+        return results;
+    }
+
+}  // namespace
+
+// A table of messages waiting for online migration.  For the legacy table, `last` and `end` are
+// rowids of the Data table; otherwise they are message ids.
+struct Database::migration_source {
+    DatabaseImpl* impl;
+    // Keeps the database open if it isn't one of our shards (and then gets deleted once migrated)
+    std::shared_ptr<DatabaseImpl> stale;
+    std::filesystem::path stale_path;
+    bool legacy;  // Migrating the legacy Data table rather than messages
+    int64_t last;  // Everything up to here has been moved
+    int64_t end;   // The highest row when we started, for progress estimates
+
+    migration_source(DatabaseImpl& impl, bool legacy) : impl{&impl}, legacy{legacy} {
+        std::tie(last, end) = impl.oneshot_get<int64_t, int64_t>(
+                legacy ? "SELECT COALESCE(MIN(rowid) - 1, 0), COALESCE(MAX(rowid), 0) FROM Data"
+                       : "SELECT COALESCE(MIN(id) - 1, 0), COALESCE(MAX(id), 0) FROM messages");
+    }
+};
+
+namespace {
+    void remove_database_files(const std::filesystem::path& db) {
+        for (auto suffix : {"", "-wal", "-shm"}) {
+            std::error_code ec;
+            std::filesystem::remove(db.u8string() + suffix, ec);
+        }
+        std::error_code ec;
+        std::filesystem::remove_all(db.u8string() + "-segments", ec);
+    }
+}  // namespace
+
+Database::Database(
+        const std::filesystem::path& db_path,
+        size_t shard_count,
+        size_t cold_threshold,
+        bool online_migration,
+        const db_tuning& tuning,
+        const db_eviction& eviction) :
+        cold_threshold{cold_threshold}, eviction{eviction} {
+    if (shard_count < 1 || shard_count > MAX_SHARDS)
+        throw std::invalid_argument{fmt::format(
+                "Invalid database shard count {}: must be between 1 and {}",
+                shard_count,
+                MAX_SHARDS)};
+
+    if (shard_count > 1)
+        shard_span = std::numeric_limits<uint64_t>::max() / shard_count + 1;
+
+    std::unordered_set<std::string> current;
+    for (size_t i = 0; i < shard_count; i++) {
+        auto filename = shard_filename(i, shard_count);
+        shards.push_back(std::make_unique<DatabaseImpl>(
+                *this,
+                db_path / std::filesystem::u8path(filename),
+                SIZE_LIMIT / static_cast<int64_t>(shard_count),
+                online_migration,
+                tuning));
+        if (shards.back()->legacy_pending)
+            migrations.push_back(std::make_unique<migration_source>(*shards.back(), true));
+        current.insert(std::move(filename));
+    }
+    if (shard_count > 1)
+        log::info(logcat, "Using {} database shards", shard_count);
+
+    if (tuning.background_checkpoint)
+        checkpointer = std::thread{[this, cpus = tuning.thread_cpus] {
+            util::set_thread_name("db-checkpoint");
+            cpus.apply();
+            run_checkpoints();
+        }};
+
+    // The threads use `this`, so they must not outlive a constructor that throws
+    try {
+        replay_journals(db_path);
+        if (tuning.ingest_journal) {
+            for (auto& impl : shards)
+                impl->open_journal();
+            journal_applier = std::thread{[this, cpus = tuning.thread_cpus] {
+                util::set_thread_name("db-journal");
+                cpus.apply();
+                run_journal();
+            }};
+        }
+
+        std::vector<std::filesystem::path> stale;
+        for (const auto& entry : std::filesystem::directory_iterator{db_path}) {
+            auto filename = entry.path().filename().u8string();
+            if (entry.is_regular_file() && is_shard_filename(filename) && !current.count(filename))
+                stale.push_back(entry.path());
+        }
+        for (const auto& old_db : stale)
+            migrate_from(old_db, online_migration);
+
+        if (!migrations.empty()) {
+            migrating_ = true;
+            log::warning(logcat, "Migrating old messages in the background");
+        }
+
+        for (auto& impl : shards) {
+            SQLite::Statement st{impl->db, "SELECT subkey FROM revoked_subkeys"};
+            while (st.executeStep())
+                revoked_subkeys.insert(get<std::string>(st));
+        }
+
+        clean_expired();
+    } catch (...) {
+        stop_threads();
+        throw;
+    }
+}
+
+Database::~Database() {
+    stop_threads();
+}
+
+void Database::stop_threads() {
+    if (journal_applier.joinable()) {
+        {
+            std::lock_guard lock{journal_mutex};
+            journal_stop = true;
+        }
+        journal_cv.notify_one();
+        journal_applier.join();
+        for (auto& impl : shards) {
+            try {
+                impl->maybe_truncate_journal(true);
+            } catch (const std::exception& e) {
+                log::error(logcat, "Failed to empty ingest journal: {}", e.what());
+            }
+        }
+    }
+    if (checkpointer.joinable()) {
+        {
+            std::lock_guard lock{checkpoint_mutex};
+            checkpoint_stop = true;
+        }
+        checkpoint_cv.notify_one();
+        checkpointer.join();
+    }
+}
+
+void Database::run_checkpoints() {
+    auto wanted = [this] {
+        return std::any_of(shards.begin(), shards.end(), [](const auto& impl) {
+            return impl->checkpoint_wanted.load();
+        });
+    };
+    std::unique_lock lock{checkpoint_mutex};
+    while (true) {
+        checkpoint_cv.wait(lock, [&] { return checkpoint_stop || wanted(); });
+        if (checkpoint_stop)
+            break;
+        lock.unlock();
+        for (auto& impl : shards)
+            if (impl->checkpoint_wanted.exchange(false))
+                impl->checkpoint();
+        lock.lock();
+    }
+}
+
+void Database::run_journal() {
+    auto waiting = [this] {
+        return std::any_of(shards.begin(), shards.end(), [](const auto& impl) {
+            return impl->journal_waiting > 0;
+        });
+    };
+    std::unique_lock lock{journal_mutex};
+    while (true) {
+        journal_cv.wait(lock, [&] { return journal_stop || waiting(); });
+        if (journal_stop)
+            break;
+        lock.unlock();
+        bool failed = false;
+        for (auto& impl : shards) {
+            try {
+                impl->apply_journal();
+                impl->maybe_truncate_journal();
+            } catch (const std::exception& e) {
+                log::error(logcat, "Failed to apply ingest journal: {}", e.what());
+                failed = true;
+            }
+        }
+        lock.lock();
+        // Don't spin on whatever is failing
+        if (failed)
+            journal_cv.wait_for(lock, 1s, [this] { return journal_stop; });
+    }
+}
+
+void Database::apply_journal(const user_pubkey_t& pubkey) {
+    shard_for(pubkey)->apply_journal(&pubkey);
+}
+
+void Database::replay_journals(const std::filesystem::path& db_path) {
+    constexpr std::string_view suffix = "-ingest";
+    std::vector<std::filesystem::path> journals;
+    for (const auto& entry : std::filesystem::directory_iterator{db_path}) {
+        auto filename = entry.path().filename().u8string();
+        std::string_view db_name{filename};
+        if (!entry.is_regular_file() || !util::ends_with(db_name, suffix))
+            continue;
+        db_name.remove_suffix(suffix.size());
+        if (is_shard_filename(db_name))
+            journals.push_back(entry.path());
+    }
+
+    for (const auto& path : journals) {
+        std::vector<message> msgs;
+        IngestJournal{path}.replay([&](const IngestJournal::record& r) {
+            msgs.emplace_back(
+                    shards.front()->load_pubkey(r.type, std::string{r.pubkey}),
+                    std::string{r.hash},
+                    r.ns,
+                    from_epoch_ms(r.timestamp),
+                    from_epoch_ms(r.expiry),
+                    std::string{r.data});
+        });
+        if (!msgs.empty()) {
+            log::warning(
+                    logcat,
+                    "Replaying {} messages from ingest journal {}",
+                    msgs.size(),
+                    path.u8string());
+            store_all(msgs);
+            bool synced = true;
+            for (auto& impl : shards)
+                synced = DatabaseImpl::sync_committed(impl->db) && synced;
+            // Replaying again next time is harmless (the messages are already stored by then)
+            if (!synced) {
+                log::warning(
+                        logcat, "Keeping {} until replayed messages are synced", path.u8string());
+                continue;
+            }
+        }
+        std::filesystem::remove(path);
+    }
+}
+
+size_t Database::shard_index(const user_pubkey_t& pubkey) const {
+    if (!shard_span)
+        return 0;
+    return std::min<size_t>(pubkey.swarm_space() / shard_span, shards.size() - 1);
+}
+
+DatabaseImpl* Database::shard_for(const user_pubkey_t& pubkey) {
+    return shards[shard_index(pubkey)].get();
+}
+
+void Database::migrate_from(const std::filesystem::path& old_db, bool online) {
+    log::warning(
+            logcat,
+            "Found database {} from a different shard configuration; migrating its data{}",
+            old_db.u8string(),
+            online ? " in the background" : "");
+    auto old = std::make_shared<DatabaseImpl>(*this, old_db, SIZE_LIMIT, online);
+
+    // Revoked subkeys have to come along (right away, even when migrating online), so that revoked
+    // subkeys stay revoked.
+    SQLite::Statement revoked{
+            old->db,
+            "SELECT type, pubkey, subkey, revoked_subkeys.timestamp FROM revoked_subkeys"
+            " JOIN owners ON revoked_subkeys.owner = owners.id"};
+    int64_t malformed = 0;
+    while (revoked.executeStep()) {
+        auto [type, pk, subkey, ts] = get<uint8_t, std::string, std::string, int64_t>(revoked);
+        // Legacy rows can have a NULL (or otherwise broken) owner pubkey, which we can't move
+        if (pk.size() != 32) {
+            malformed++;
+            continue;
+        }
+        auto pubkey = old->load_pubkey(type, std::move(pk));
+        auto* shard = shard_for(pubkey);
+        // The account's messages might not have been moved yet
+        exec_query(
+                shard->prepared_st("INSERT INTO owners (pubkey, type, swarm_space) VALUES (?, ?, ?)"
+                                   " ON CONFLICT DO NOTHING"),
+                pubkey,
+                DatabaseImpl::swarm_space_key(pubkey.swarm_space()));
+        exec_query(
+                shard->prepared_st(
+                        "INSERT INTO revoked_subkeys (owner, subkey, timestamp) VALUES ((SELECT"
+                        " id FROM owners WHERE pubkey = ? AND type = ?), ?, ?)"
+                        " ON CONFLICT DO NOTHING"),
+                pubkey,
+                blob_binder{subkey},
+                ts);
+    }
+    if (malformed > 0)
+        log::warning(
+                logcat,
+                "Skipped {} revoked subkeys with an invalid account pubkey in {}",
+                malformed,
+                old_db.u8string());
+
+    if (online) {
+        if (old->legacy_pending)
+            migrations.push_back(std::make_unique<migration_source>(*old, true));
+        auto& src = *migrations.emplace_back(std::make_unique<migration_source>(*old, false));
+        src.stale = std::move(old);
+        src.stale_path = old_db;
+        return;
+    }
+
+    size_t count = 0;
+    std::vector<message> batch;
+    auto flush = [this, &batch] {
+        store_all(batch);
+        batch.clear();
+    };
+    old->retrieve_all(
+            [&](message&& msg) {
+                batch.push_back(std::move(msg));
+                if (batch.size() >= 1000)
+                    flush();
+                count++;
+                return true;
+            },
+            1000);
+    flush();
+    old.reset();
+
+    remove_database_files(old_db);
+
+    log::warning(logcat, "Migrated {} messages from {}", count, old_db.u8string());
+}
+
+bool Database::migrate_chunk() {
+    std::lock_guard lock{migration_mutex};
+    if (migrations.empty())
+        return false;
+    auto& src = *migrations.front();
+
+    std::vector<message> chunk;
+    auto last = src.legacy ? src.impl->read_legacy(src.last, MIGRATION_CHUNK_SIZE, chunk)
+                           : src.impl->read_messages(src.last, MIGRATION_CHUNK_SIZE, chunk, true);
+    if (last) {
+        // Store first, delete after, so that if we get interrupted in between the worst case is
+        // moving the chunk again (which doesn't get stored twice) on the next startup.
+        store_all(chunk);
+        if (src.legacy)
+            src.impl->delete_legacy(*last);
+        else
+            src.impl->delete_messages(*last);
+        src.last = *last;
+        migrated_ += chunk.size();
+        return true;
+    }
+
+    if (src.legacy)
+        src.impl->drop_legacy();
+    if (src.stale) {
+        auto path = std::move(src.stale_path);
+        src.stale.reset();
+        remove_database_files(path);
+        log::warning(logcat, "Finished migrating {}", path.u8string());
+    }
+    migrations.pop_front();
+
+    if (!migrations.empty())
+        return true;
+    migrating_ = false;
+    migrated_accounts.clear();
+    log::warning(logcat, "Background migration complete: moved {} messages", migrated_);
+    return false;
+}
+
+void Database::migrate_account(const user_pubkey_t& pubkey) {
+    if (!migrating_.load(std::memory_order_relaxed))
+        return;
+    std::lock_guard lock{migration_mutex};
+    if (migrations.empty() || !migrated_accounts.insert(pubkey).second)
+        return;
+
+    std::vector<message> msgs;
+    for (auto& src : migrations) {
+        if (src->legacy)
+            src->impl->read_legacy(pubkey, msgs);
+        else
+            src->impl->read_messages(pubkey, msgs);
+    }
+    if (msgs.empty())
+        return;
+    store_all(msgs);
+    for (auto& src : migrations) {
+        if (src->legacy)
+            src->impl->delete_legacy(pubkey);
+        else
+            src->impl->delete_messages(pubkey);
+    }
+    migrated_ += msgs.size();
+}
+
+void Database::migrate_pending(std::optional<std::chrono::milliseconds> budget) {
+    if (!migrating())
+        return;
+    auto deadline = std::chrono::steady_clock::now() + budget.value_or(0ms);
+    while (migrate_chunk() && (!budget || std::chrono::steady_clock::now() < deadline))
+        ;
+}
+
+std::optional<Database::migration_progress> Database::get_migration_progress() {
+    if (!migrating())
+        return std::nullopt;
+    std::lock_guard lock{migration_mutex};
+    if (migrations.empty())
+        return std::nullopt;
+    migration_progress progress;
+    progress.migrated = migrated_;
+    for (auto& src : migrations)
+        progress.remaining += std::max<int64_t>(src->end - src->last, 0);
+    return progress;
+}
+
+void Database::clean_expired(std::optional<std::chrono::milliseconds> budget) {
+    auto started = std::chrono::steady_clock::now();
+    auto now = to_epoch_ms(std::chrono::system_clock::now());
+    std::optional<std::chrono::steady_clock::time_point> deadline;
+    if (budget)
+        deadline = started + *budget;
+
+    auto results = fan_out(shards, [this, now, deadline](DatabaseImpl& impl) {
+        DatabaseImpl::cleanup_result result;
+        SQLite::Statement st{
+                impl.db,
+                "DELETE FROM messages WHERE id IN"
+                " (SELECT id FROM messages WHERE expiry <= ? ORDER BY expiry LIMIT ?)"};
+        while (true) {
+            int n;
+            {
+                std::lock_guard lock{impl.write_mutex};
+                n = exec_query(st, now, EXPIRY_CHUNK_SIZE);
+                st.reset();
+            }
+            result.deleted += n;
+            if (n < EXPIRY_CHUNK_SIZE)
+                break;
+            if (deadline && std::chrono::steady_clock::now() >= *deadline) {
+                result.done = false;
+                return result;
+            }
+        }
+
+        {
+            std::lock_guard lock{impl.write_mutex};
+            impl.resize_hash_filter();
+        }
+        try {
+            impl.compact_cold();
+        } catch (const std::exception& e) {
+            log::error(logcat, "Failed to compact payload segments: {}", e.what());
+        }
+        if (eviction.enabled) {
+            try {
+                impl.evict(eviction, deadline, result);
+            } catch (const std::exception& e) {
+                log::error(logcat, "Failed to evict messages: {}", e.what());
+            }
+        }
+        return result;
+    });
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - started);
+    int64_t deleted = 0, evicted = 0, over_quota = 0;
+    bool finished = true;
+    for (auto& r : results) {
+        deleted += r.deleted;
+        evicted += r.evicted;
+        over_quota += r.over_quota;
+        finished = finished && r.done;
+    }
+    if (!finished)
+        log::debug(
+                logcat,
+                "Deleted {} expired messages in {}us; leaving the rest for later",
+                deleted,
+                elapsed.count());
+
+    std::lock_guard lock{expiry_stats_mutex};
+    auto& stats = expiry_stats_;
+    stats.passes++;
+    stats.deleted += deleted;
+    stats.evicted += evicted;
+    stats.over_quota += over_quota;
+    if (!finished)
+        stats.incomplete++;
+    stats.last_deleted = deleted;
+    stats.last_duration = elapsed;
+    stats.max_duration = std::max(stats.max_duration, elapsed);
+    stats.total_duration += elapsed;
+}
+
+std::chrono::steady_clock::duration Database::thread_time() {
+    return thread_db_time;
+}
+
+Database::expiry_stats Database::get_expiry_stats() {
+    std::lock_guard lock{expiry_stats_mutex};
+    return expiry_stats_;
+}
+
+SegmentStore::stats Database::get_segment_stats() {
+    SegmentStore::stats total;
+    for (auto& impl : shards) {
+        auto s = impl->cold.get_stats();
+        total.segments += s.segments;
+        total.bytes += s.bytes;
+        total.appended += s.appended;
+        total.removed += s.removed;
+    }
+    return total;
+}
+
+namespace {
+    template <typename T>
+    T sum(const std::vector<T>& vals) {
+        T total{0};
+        for (auto& v : vals)
+            total += v;
+        return total;
+    }
+}  // namespace
 
 int64_t Database::get_message_count() {
-    return impl->prepared_get<int64_t>("SELECT COUNT(*) FROM messages");
+    return sum(fan_out(shards, [](DatabaseImpl& impl) {
+        return impl.oneshot_get<int64_t>("SELECT COUNT(*) FROM messages");
+    }));
 }
 
 int64_t Database::get_owner_count() {
-    return impl->prepared_get<int64_t>("SELECT COUNT(*) FROM owners");
+    return sum(fan_out(shards, [](DatabaseImpl& impl) {
+        return impl.oneshot_get<int64_t>("SELECT COUNT(*) FROM owners");
+    }));
 }
 
 int64_t Database::get_used_bytes() {
-    return impl->prepared_get<int64_t>("PRAGMA page_count") * impl->page_size;
+    int64_t total = 0;
+    for (auto& impl : shards)
+        total += impl->prepared_get<int64_t>("PRAGMA page_count") * impl->page_size;
+    return total;
+}
+
+Database::statement_cache_stats Database::get_statement_cache_stats() {
+    statement_cache_stats stats;
+    int64_t prepare_ns = 0;
+    for (auto& impl : shards) {
+        stats.hits += impl->st_hits;
+        stats.misses += impl->st_misses;
+        stats.evictions += impl->st_evictions;
+        stats.cached += impl->st_cached;
+        prepare_ns += impl->st_prepare_ns;
+    }
+    stats.prepare_time = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::nanoseconds{prepare_ns});
+    return stats;
+}
+
+Database::io_stats Database::get_io_stats() {
+    io_stats stats;
+    int64_t checkpoint_ns = 0;
+    for (auto& impl : shards) {
+        stats.cache_used += impl->collect_db_status();
+        stats.cache_hits += impl->cache_hits;
+        stats.cache_misses += impl->cache_misses;
+        stats.cache_writes += impl->cache_writes;
+        stats.cache_spills += impl->cache_spills;
+        stats.readers += impl->reader_count();
+        stats.checkpoints += impl->checkpoints;
+        stats.checkpointed += impl->checkpointed;
+        stats.checkpoint_busy += impl->checkpoint_busy;
+        checkpoint_ns += impl->checkpoint_ns;
+        stats.journaled += impl->journaled;
+        stats.journal_waiting += impl->journal_waiting;
+        if (impl->journal)
+            stats.journal_syncs += impl->journal->get_stats().syncs;
+    }
+    stats.checkpoint_time = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::nanoseconds{checkpoint_ns});
+    return stats;
+}
+
+Database::memory_stats Database::get_memory_stats() {
+    memory_stats stats;
+    sqlite3_int64 current = 0, highwater = 0;
+    sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &current, &highwater, 0);
+    stats.sqlite_used = current;
+    stats.sqlite_highwater = highwater;
+    sqlite3_status64(SQLITE_STATUS_MALLOC_COUNT, &current, &highwater, 0);
+    stats.sqlite_allocations = current;
+    for (auto& impl : shards)
+        impl->add_memory_stats(stats);
+    return stats;
 }
 
 static std::optional<message> get_message(DatabaseImpl& impl, SQLite::Statement& st) {
     std::optional<message> msg;
     while (st.executeStep()) {
         assert(!msg);
-        auto [hash, otype, opubkey, ns, ts, exp, data] =
-                get<std::string, uint8_t, std::string, namespace_id, int64_t, int64_t, std::string>(
-                        st);
+        auto [hash, otype, opubkey, ns, ts, exp] =
+                get<std::string, uint8_t, std::string, namespace_id, int64_t, int64_t>(st);
+        auto data = impl.payload(st, 6);
+        if (!data)
+            continue;
         msg.emplace(
                 impl.load_pubkey(otype, std::move(opubkey)),
                 std::move(hash),
                 ns,
                 from_epoch_ms(ts),
                 from_epoch_ms(exp),
-                std::move(data));
+                std::move(*data));
     }
     return msg;
 }
 
 std::optional<message> Database::retrieve_random() {
     clean_expired();
+    DatabaseImpl* impl = shards.front().get();
+    if (shards.size() > 1) {
+        // Pick a shard with probability proportional to the number of messages it holds so that
+        // every message remains equally likely to be selected.
+        auto counts = fan_out(shards, [](DatabaseImpl& impl) {
+            return impl.oneshot_get<int64_t>("SELECT COUNT(*) FROM messages");
+        });
+        int64_t total = sum(counts);
+        if (total == 0)
+            return std::nullopt;
+        auto r = static_cast<int64_t>(util::uniform_distribution_portable(util::rng(), total));
+        for (size_t i = 0; i < counts.size(); i++) {
+            if (r < counts[i]) {
+                impl = shards[i].get();
+                break;
+            }
+            r -= counts[i];
+        }
+    }
     auto st = impl->prepared_st(
-            "SELECT hash, type, pubkey, namespace, timestamp, expiry, data"
-            " FROM owned_messages "
+            "SELECT hash_text(hash), type, pubkey, namespace, timestamp, expiry, data,"
+            " cold_segment, cold_offset, cold_size FROM owned_messages "
             " WHERE mid = (SELECT id FROM messages ORDER BY RANDOM() LIMIT 1)");
     return get_message(*impl, st);
 }
 
 std::optional<message> Database::retrieve_by_hash(const std::string& msg_hash) {
-    auto st = impl->prepared_st(
-            "SELECT hash, type, pubkey, namespace, timestamp, expiry, data"
-            " FROM owned_messages WHERE hash = ?");
-    st->bindNoCopy(1, msg_hash);
-    return get_message(*impl, st);
+    db_timer timer;
+    for (auto& impl : shards)
+        if (auto msg = impl->journaled_message(msg_hash))
+            return *msg;
+    auto find = [&msg_hash](DatabaseImpl& impl) {
+        auto st = impl.prepared_read_st(
+                "SELECT hash_text(hash), type, pubkey, namespace, timestamp, expiry, data,"
+                " cold_segment, cold_offset, cold_size FROM owned_messages WHERE hash = ?");
+        bind_hash(st, 1, msg_hash);
+        return get_message(impl, st);
+    };
+    for (auto& impl : shards)
+        if (auto msg = find(*impl))
+            return msg;
+
+    // Storage tests pick messages by hash, so also look through those we haven't migrated yet
+    if (migrating()) {
+        std::lock_guard lock{migration_mutex};
+        for (auto& src : migrations)
+            if (auto msg = src->legacy ? src->impl->read_legacy(msg_hash) : find(*src->impl))
+                return msg;
+    }
+    return std::nullopt;
+}
+
+std::optional<std::string> Database::retrieve_payload(const std::string& msg_hash) {
+    db_timer timer;
+    for (auto& impl : shards)
+        if (auto msg = impl->journaled_message(msg_hash))
+            return msg->data;
+    for (auto& impl : shards) {
+        auto st = impl->prepared_read_st(
+                "SELECT data, cold_segment, cold_offset, cold_size FROM messages WHERE hash = ?");
+        bind_hash(st, 1, msg_hash);
+        if (st->executeStep())
+            return impl->payload(st, 0);
+    }
+
+    if (migrating())
+        if (auto msg = retrieve_by_hash(msg_hash))
+            return std::move(msg->data);
+    return std::nullopt;
 }
 
 std::optional<bool> Database::store(const message& msg) {
-    auto st = impl->prepared_st(
-            "INSERT INTO owned_messages (pubkey, type, hash, namespace, timestamp, expiry, data)"
-            " VALUES (?, ?, ?, ?, ?, ?, ?)");
+    db_timer timer;
+    migrate_account(msg.pubkey);
+    return shard_for(msg.pubkey)->store(msg);
+}
 
-    try {
-        exec_query(
-                st,
-                msg.pubkey,
-                msg.hash,
-                msg.msg_namespace,
-                to_epoch_ms(msg.timestamp),
-                to_epoch_ms(msg.expiry),
-                blob_binder{msg.data});
-    } catch (const SQLite::Exception& e) {
-        if (int rc = e.getErrorCode(); rc == SQLITE_CONSTRAINT)
-            return false;
-        else if (rc == SQLITE_FULL) {
-            if (impl->db_full_counter++ % DB_FULL_FREQUENCY == 0)
-                log::error(logcat, "Failed to store message: database is full");
-            return std::nullopt;
-        } else {
-            log::error(logcat, "Failed to store message: {}", e.getErrorStr());
-            throw;
-        }
-    }
-    return true;
+std::optional<bool> Database::store(const shared_message& msg) {
+    db_timer timer;
+    migrate_account(msg->pubkey);
+    return shard_for(msg->pubkey)->store(*msg, &msg);
 }
 
 void Database::bulk_store(const std::vector<message>& items) {
-    SQLite::Transaction t{impl->db};
-    auto get_owner = impl->prepared_st("SELECT id FROM owners WHERE pubkey = ? AND type = ?");
-    auto insert_owner = impl->prepared_st(
-            "INSERT INTO owners (pubkey, type) VALUES (?, ?) ON CONFLICT DO NOTHING RETURNING id");
-    std::unordered_map<user_pubkey_t, int64_t> seen;
-    for (auto& m : items) {
-        if (!m.pubkey)
-            continue;
-        if (auto [it, ins] = seen.emplace(m.pubkey, 0); ins) {
-            auto ownerid = exec_and_maybe_get<int64_t>(get_owner, m.pubkey);
-            get_owner->reset();
-            if (!ownerid) {
-                ownerid = exec_and_maybe_get<int64_t>(insert_owner, m.pubkey);
-                insert_owner->reset();
-            }
-            if (ownerid)
-                it->second = *ownerid;
-            else {
-                log::error(
-                        logcat,
-                        "Failed to insert owner {} for bulk store",
-                        m.pubkey.prefixed_hex());
-                seen.erase(it);
-            }
-        }
+    if (migrating()) {
+        std::unordered_set<user_pubkey_t> pubkeys;
+        for (auto& m : items)
+            if (m.pubkey && pubkeys.insert(m.pubkey).second)
+                migrate_account(m.pubkey);
     }
+    store_all(items);
+}
 
-    auto insert_message = impl->prepared_st(
-            "INSERT INTO messages (owner, hash, namespace, timestamp, expiry, data)"
-            " VALUES (?, ?, ?, ?, ?, ?)"
-            " ON CONFLICT DO NOTHING");
+void Database::store_all(const std::vector<message>& items) {
+    db_timer timer;
+    if (shards.size() == 1)
+        return shards.front()->bulk_store(items);
 
-    for (auto& m : items) {
-        if (!m.pubkey)
-            continue;
-        auto owner_it = seen.find(m.pubkey);
-        if (owner_it == seen.end())
-            continue;
+    std::vector<std::vector<const message*>> by_shard(shards.size());
+    for (auto& m : items)
+        if (m.pubkey)
+            by_shard[shard_index(m.pubkey)].push_back(&m);
+    for (size_t i = 0; i < shards.size(); i++)
+        if (!by_shard[i].empty())
+            shards[i]->bulk_store(by_shard[i]);
+}
 
-        exec_query(
-                insert_message,
-                owner_it->second,
-                m.hash,
-                m.msg_namespace,
-                to_epoch_ms(m.timestamp),
-                to_epoch_ms(m.expiry),
-                blob_binder{m.data});
-        insert_message->reset();
+void Database::bulk_store(const message_source& source) {
+    db_timer timer;
+    if (migrating()) {
+        std::unordered_set<user_pubkey_t> pubkeys;
+        source([&](const user_pubkey_t& pubkey, const message_view&) {
+            if (pubkey)
+                pubkeys.insert(pubkey);
+        });
+        for (auto& pubkey : pubkeys)
+            migrate_account(pubkey);
+    }
+    if (shards.size() == 1) {
+        shards.front()->bulk_store_from(source);
+        return;
     }
 
-    t.commit();
+    // Make a first pass over everything to find out which shards we need (which also means that
+    // if the source is going to fail then it does so before we store anything), then a pass for
+    // each of those shards storing its messages.
+    std::vector<bool> used(shards.size());
+    source([&](const user_pubkey_t& pubkey, const message_view&) {
+        if (pubkey)
+            used[shard_index(pubkey)] = true;
+    });
+    for (size_t i = 0; i < shards.size(); i++) {
+        if (!used[i])
+            continue;
+        shards[i]->bulk_store_from([&](const auto& store) {
+            source([&](const user_pubkey_t& pubkey, const message_view& m) {
+                if (pubkey && shard_index(pubkey) == i)
+                    store(pubkey, m);
+            });
+        });
+    }
 }
 
 std::pair<std::vector<message>, bool> Database::retrieve(
@@ -673,265 +3686,776 @@ std::pair<std::vector<message>, bool> Database::retrieve(
         std::optional<size_t> max_size,
         const bool size_b64,
         const size_t per_message_overhead) {
+    db_timer timer;
+    std::pair<std::vector<message>, bool> result{};
+    auto& [results, more] = result;
+    more = retrieve(
+            pubkey,
+            ns,
+            last_hash,
+            [&results](const message_view& m) {
+                results.emplace_back(
+                        std::string{m.hash},
+                        m.msg_namespace,
+                        m.timestamp,
+                        m.expiry,
+                        std::string{m.data});
+            },
+            max_results,
+            max_size,
+            size_b64,
+            per_message_overhead);
+    return result;
+}
+
+bool Database::retrieve(
+        const user_pubkey_t& pubkey,
+        namespace_id ns,
+        const std::string& last_hash,
+        const std::function<void(const message_view& msg)>& f,
+        std::optional<size_t> max_results,
+        std::optional<size_t> max_size,
+        const bool size_b64,
+        const size_t per_message_overhead) {
+    db_timer timer;
+    migrate_account(pubkey);
+    apply_journal(pubkey);
+    auto* impl = shard_for(pubkey);
 
-    auto owner_st = impl->prepared_st("SELECT id FROM owners WHERE pubkey = ? AND type = ?");
-    auto ownerid = exec_and_maybe_get<int64_t>(owner_st, pubkey);
-    if (!ownerid)
-        return {};
+    retrieve_budget budget{max_size, size_b64, per_message_overhead};
+    std::optional<std::optional<int64_t>> owner;
+    return impl->retrieve(
+            pubkey,
+            ns,
+            last_hash,
+            owner,
+            impl->fill_token(),
+            max_results,
+            budget,
+            f);
+}
 
-    if (max_results && *max_results < 1)
-        max_results = 1;
+std::vector<Database::retrieve_result> Database::retrieve_multi(
+        const std::vector<retrieve_query>& queries,
+        std::optional<size_t> max_size,
+        const bool size_b64,
+        const size_t per_message_overhead) {
+    db_timer timer;
+    std::vector<retrieve_result> results(queries.size());
 
-    std::optional<int64_t> last_id;
-    if (!last_hash.empty()) {
-        auto st = impl->prepared_st(
-                "SELECT id FROM messages WHERE owner = ? AND namespace = ? AND hash = ?");
-        last_id = exec_and_maybe_get<int64_t>(st, *ownerid, to_int(ns), last_hash);
+    // All of a shard's queries run in one read transaction, so that they see the same snapshot
+    // and each account's owner only gets looked up once.  The shard's cache fill token gets taken
+    // before the transaction starts reading, so that it covers all of the fills.
+    struct shard_read {
+        uint64_t token;
+        SQLite::Transaction txn;
+        std::unordered_map<user_pubkey_t, std::optional<std::optional<int64_t>>> owners;
+    };
+    std::unordered_map<DatabaseImpl*, std::unique_ptr<shard_read>> reads;
+    retrieve_budget budget{max_size, size_b64, per_message_overhead};
+
+    // Migrations write, so get them out of the way before starting any of the reads
+    for (const auto& q : queries) {
+        migrate_account(q.pubkey);
+        apply_journal(q.pubkey);
     }
 
-    auto st = impl->prepared_st(
-            last_id ? "SELECT hash, namespace, timestamp, expiry, data FROM messages "
-                      "WHERE owner = ? AND namespace = ? AND id > ? ORDER BY id LIMIT ?"
-                    : "SELECT hash, namespace, timestamp, expiry, data FROM messages "
-                      "WHERE owner = ? AND namespace = ? ORDER BY id LIMIT ?");
-    int pos = 1;
-    st->bind(pos++, *ownerid);
-    st->bind(pos++, to_int(ns));
-    if (last_id)
-        st->bind(pos++, *last_id);
-    st->bind(pos++, max_results ? static_cast<int>(*max_results) + 1 : -1);
+    for (size_t i = 0; i < queries.size(); i++) {
+        const auto& q = queries[i];
+        auto& r = results[i];
+        auto* impl = shard_for(q.pubkey);
+        auto& read = reads[impl];
+        if (!read) {
+            auto token = impl->retrieve_cache.fill_token();
+            read.reset(new shard_read{token, SQLite::Transaction{impl->reader_db()}, {}});
+        }
+        r.more = impl->retrieve(
+                q.pubkey,
+                q.ns,
+                q.last_hash,
+                read->owners[q.pubkey],
+                read->token,
+                q.max_results,
+                budget,
+                [&r](const message_view& m) {
+                    r.messages.emplace_back(
+                            std::string{m.hash},
+                            m.msg_namespace,
+                            m.timestamp,
+                            m.expiry,
+                            std::string{m.data});
+                });
+    }
+    // We only read, so there's nothing to commit: the transactions just end (rolling back) here.
+    return results;
+}
 
-    std::pair<std::vector<message>, bool> result{};
-    auto& [results, more] = result;
+uint64_t Database::account_token(const user_pubkey_t& pubkey) {
+    return shard_for(pubkey)->retrieve_cache.account_token(pubkey);
+}
 
-    size_t agg_size = 0;
-    while (st->executeStep()) {
-        auto [hash, ns, ts, exp, data] =
-                get<std::string, namespace_id, int64_t, int64_t, std::string>(st);
-        if (max_results && results.size() >= *max_results) {
-            more = true;
-            break;
+struct Database::batch_scope::state {
+    std::vector<batch_shard> shards;
+    bool ended = false;
+
+    // Commits the write transactions and ends the read ones; returns false if any write
+    // transaction failed to commit.
+    bool end() {
+        db_timer timer;
+        ended = true;
+        if (thread_batch == &shards)
+            thread_batch = nullptr;
+        bool ok = true;
+        for (auto& b : shards) {
+            auto* impl = b.impl;
+            if (!b.write_lock) {
+                // Only read, so there's nothing to commit
+                impl->reader_db().tryExec("ROLLBACK");
+                continue;
+            }
+            bool committed = false;
+            if (sqlite3_get_autocommit(impl->db.getHandle()))
+                log::error(logcat, "Batch transaction got rolled back before it was committed");
+            else if (int rc = impl->db.tryExec("COMMIT"); rc != SQLITE_OK) {
+                log::error(logcat, "Failed to commit batch transaction: {}", sqlite3_errstr(rc));
+                impl->db.tryExec("ROLLBACK");
+            } else
+                committed = true;
+            if (committed && !b.revoked.empty()) {
+                std::unique_lock lock{impl->parent.revoked_subkeys_mutex};
+                for (auto& subkey : b.revoked)
+                    impl->parent.revoked_subkeys.insert(std::move(subkey));
+            }
+            if (!committed) {
+                ok = false;
+                // Deletions that got undone may already have been taken out of the hash filter
+                // (by the commit hook of a commit that then failed), which would make us skip
+                // messages we still have.
+                impl->build_hash_filter();
+                impl->hf_rebuilds++;
+            }
+            for (const auto& pubkey : b.changed)
+                impl->retrieve_cache.invalidate(pubkey);
         }
-        if (max_size) {
-            agg_size += per_message_overhead;
-            agg_size += hash.size();
-            agg_size += size_b64 ? data.size() * 4 / 3 : data.size();
-            if (!results.empty() && agg_size > *max_size) {
-                more = true;
+        return ok;
+    }
+
+    ~state() {
+        if (!ended)
+            end();
+        // (The write locks get released as `shards` gets destroyed)
+    }
+};
+
+bool Database::batch_scope::commit() {
+    bool ok = !state_ || state_->end();
+    state_.reset();
+    return ok;
+}
+
+Database::batch_scope::batch_scope() = default;
+Database::batch_scope::batch_scope(batch_scope&&) noexcept = default;
+Database::batch_scope& Database::batch_scope::operator=(batch_scope&&) noexcept = default;
+Database::batch_scope::~batch_scope() = default;
+
+Database::batch_scope Database::begin_batch(const std::vector<batch_access>& accesses) {
+    db_timer timer;
+    batch_scope scope;
+    if (thread_batch || accesses.size() < 2)
+        return scope;
+
+    struct shard_use {
+        int reads = 0, writes = 0;
+        int64_t store_size = 0;
+    };
+    std::vector<shard_use> use(shards.size());
+    int writes = 0;
+    for (const auto& a : accesses) {
+        auto& u = use[shard_index(a.pubkey)];
+        (a.write ? u.writes : u.reads)++;
+        u.store_size += a.store_size;
+        writes += a.write;
+    }
+
+    // Migrations and journaled stores get written by themselves, so get them out of the way
+    // before the batch's snapshots and transactions start.
+    for (const auto& a : accesses) {
+        migrate_account(a.pubkey);
+        apply_journal(a.pubkey);
+    }
+
+    auto st = std::make_unique<batch_scope::state>();
+    st->shards.reserve(shards.size());
+    try {
+        // Writes only get grouped if every shard they go to can take them, as a write to a shard
+        // outside of the batch could deadlock.  Shards get locked in order, so that concurrent
+        // batches don't deadlock against each other.
+        bool group_writes = writes > 1 && !migrating();
+        for (size_t i = 0; i < shards.size() && group_writes; i++) {
+            if (!use[i].writes)
+                continue;
+            auto* impl = shards[i].get();
+            if (impl->journal) {
+                group_writes = false;
+                break;
+            }
+            std::unique_lock lock{impl->write_mutex};
+            if (use[i].store_size > 0 &&
+                impl->used_bytes() + 2 * use[i].store_size + BATCH_HEADROOM > impl->size_limit) {
+                group_writes = false;
                 break;
             }
+            impl->db.exec("BEGIN IMMEDIATE");
+            auto token = impl->retrieve_cache.fill_token();
+            st->shards.push_back(batch_shard{impl, std::move(lock), token, {}});
+        }
+        if (!group_writes)
+            // Ends (committing nothing) any transactions we already started
+            st = std::make_unique<batch_scope::state>();
+
+        for (size_t i = 0; i < shards.size(); i++) {
+            if (use[i].writes || use[i].reads < 2)
+                continue;
+            auto* impl = shards[i].get();
+            // The snapshot starts with the first read, which is after we take the token
+            auto token = impl->retrieve_cache.fill_token();
+            impl->reader_db().exec("BEGIN");
+            st->shards.push_back(batch_shard{impl, {}, token, {}});
         }
+    } catch (const std::exception& e) {
+        log::error(logcat, "Failed to start batch transaction: {}", e.what());
+        st.reset();
+        return scope;
+    }
 
-        results.emplace_back(
-                std::move(hash), ns, from_epoch_ms(ts), from_epoch_ms(exp), std::move(data));
+    if (!st->shards.empty()) {
+        thread_batch = &st->shards;
+        scope.state_ = std::move(st);
     }
+    return scope;
+}
 
-    return result;
+RetrieveCache::stats Database::get_retrieve_cache_stats() {
+    RetrieveCache::stats total;
+    for (auto& impl : shards) {
+        auto s = impl->retrieve_cache.get_stats();
+        total.hits += s.hits;
+        total.misses += s.misses;
+        total.fills += s.fills;
+        total.invalidations += s.invalidations;
+        total.evictions += s.evictions;
+        total.accounts += s.accounts;
+        total.bytes += s.bytes;
+    }
+    return total;
+}
+
+Database::hash_filter_stats Database::get_hash_filter_stats() {
+    hash_filter_stats total;
+    for (auto& impl : shards) {
+        total.lookups += impl->hf_lookups;
+        total.skipped += impl->hf_skipped;
+        total.false_positives += impl->hf_false_positives;
+        total.rebuilds += impl->hf_rebuilds;
+        auto filter = std::atomic_load(&impl->hash_filter);
+        total.entries += filter->entries();
+        total.capacity += filter->capacity();
+        total.bytes += filter->bytes();
+    }
+    return total;
 }
 
 std::vector<message> Database::retrieve_all() {
     std::vector<message> results;
-    auto st = impl->prepared_st(
-            "SELECT type, pubkey, hash, namespace, timestamp, expiry, data"
-            " FROM owned_messages ORDER BY mid");
-
-    while (st->executeStep()) {
-        auto [type, pubkey, hash, ns, ts, exp, data] =
-                get<uint8_t, std::string, std::string, namespace_id, int64_t, int64_t, std::string>(
-                        st);
-        results.emplace_back(
-                impl->load_pubkey(type, pubkey),
-                std::move(hash),
-                ns,
-                from_epoch_ms(ts),
-                from_epoch_ms(exp),
-                std::move(data));
+    retrieve_all([&results](message&& msg) {
+        results.push_back(std::move(msg));
+        return true;
+    });
+    return results;
+}
+
+void Database::retrieve_all(const std::function<bool(message&& msg)>& f, size_t chunk_size) {
+    for (auto& impl : shards) {
+        impl->apply_journal();
+        if (!impl->retrieve_all(f, chunk_size))
+            return;
     }
+}
 
-    return results;
+bool Database::retrieve_by_swarm_space(
+        uint64_t lo,
+        uint64_t hi,
+        const std::function<bool(message&& msg)>& f,
+        size_t chunk_size) {
+    if (lo > hi)
+        return true;
+    for (size_t i = 0; i < shards.size(); i++) {
+        // Skip shards whose swarm space range doesn't overlap the requested one
+        if (shard_span && (hi / shard_span < i || std::min(lo / shard_span, shards.size() - 1) > i))
+            continue;
+        shards[i]->apply_journal();
+        if (!shards[i]->retrieve_by_swarm_space(lo, hi, f, chunk_size))
+            return false;
+    }
+    return true;
+}
+
+std::optional<uint64_t> Database::export_snapshot(
+        uint64_t lo, uint64_t hi, size_t max_size, std::string& image) {
+    db_timer timer;
+    image.clear();
+
+    SQLite::Database snap{":memory:", SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE};
+    snap.exec(DatabaseImpl::SNAPSHOT_SCHEMA);
+    snap.exec("PRAGMA user_version = " + std::to_string(DatabaseImpl::SNAPSHOT_VERSION));
+    SQLite::Transaction t{snap};
+    SQLite::Statement insert{
+            snap,
+            "INSERT INTO messages (pubkey, type, hash, namespace, timestamp, expiry, data)"
+            " VALUES (?, ?, ?, ?, ?, ?, ?)"};
+
+    auto now = to_epoch_ms(std::chrono::system_clock::now());
+    std::optional<uint64_t> next;
+    size_t size = 0, count = 0;
+    uint64_t last_space = 0;
+    retrieve_by_swarm_space(lo, hi, [&](message&& msg) {
+        if (!msg.pubkey || to_epoch_ms(msg.expiry) <= now)
+            return true;
+        auto space = msg.pubkey.swarm_space();
+        auto msg_size = msg.pubkey.raw().size() + msg.hash.size() + msg.data.size();
+        // As with relay chunks, only stop between accounts so that the next snapshot can start at
+        // a swarm space value without skipping or repeating anything.
+        if (count > 0 && space != last_space && size + msg_size > max_size) {
+            next = space;
+            return false;
+        }
+        last_space = space;
+        size += msg_size;
+        count++;
+        exec_query(
+                insert,
+                msg.pubkey,
+                msg.hash,
+                msg.msg_namespace,
+                to_epoch_ms(msg.timestamp),
+                to_epoch_ms(msg.expiry),
+                blob_binder{msg.data});
+        insert.reset();
+        return true;
+    });
+    t.commit();
+    if (count == 0)
+        return next;
+
+    sqlite3_int64 image_size = 0;
+    auto* data = sqlite3_serialize(snap.getHandle(), "main", &image_size, 0);
+    if (!data)
+        throw std::runtime_error{"Failed to serialize snapshot"};
+    image.assign(reinterpret_cast<const char*>(data), static_cast<size_t>(image_size));
+    sqlite3_free(data);
+    log::debug(logcat, "Exported snapshot of {} messages ({} bytes)", count, image.size());
+    return next;
+}
+
+bool Database::is_snapshot(std::string_view blob) {
+    // Every sqlite3 database file starts with this (including the null terminator)
+    constexpr auto header = "SQLite format 3\0"sv;
+    return blob.substr(0, header.size()) == header;
+}
+
+namespace {
+    // Checks a snapshot image that came from a peer before it gets attached to any of our own
+    // connections, where reading it could set off whatever views or triggers it contains (with
+    // our registered functions available to them).  It gets opened on a throwaway connection
+    // instead, which doesn't trust its schema, and has to be intact, of the version we understand,
+    // and contain exactly the snapshot table and nothing else.  Throws if it isn't.
+    void check_snapshot(std::string_view image) {
+        SQLite::Database snap{":memory:", SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE};
+        auto* handle = snap.getHandle();
+        sqlite3_db_config(handle, SQLITE_DBCONFIG_DEFENSIVE, 1, nullptr);
+        sqlite3_db_config(handle, SQLITE_DBCONFIG_TRUSTED_SCHEMA, 0, nullptr);
+        if (int rc = sqlite3_deserialize(
+                    handle,
+                    "main",
+                    reinterpret_cast<unsigned char*>(const_cast<char*>(image.data())),
+                    static_cast<sqlite3_int64>(image.size()),
+                    static_cast<sqlite3_int64>(image.size()),
+                    SQLITE_DESERIALIZE_READONLY);
+            rc != SQLITE_OK)
+            throw std::runtime_error{"Failed to load snapshot: "s + sqlite3_errstr(rc)};
+
+        if (int v = snap.execAndGet("PRAGMA user_version").getInt();
+            v != DatabaseImpl::SNAPSHOT_VERSION)
+            throw std::runtime_error{"Unsupported snapshot version " + std::to_string(v)};
+
+        // sqlite3 keeps the CREATE statement as it was given (without the trailing semicolon)
+        std::string_view table{DatabaseImpl::SNAPSHOT_SCHEMA};
+        table.remove_prefix(table.find("CREATE"));
+        table = table.substr(0, table.rfind(')') + 1);
+        SQLite::Statement schema{snap, "SELECT type, name, tbl_name, sql FROM sqlite_schema"};
+        auto objects = get_all<std::string, std::string, std::string, std::string>(schema);
+        if (objects.size() != 1 ||
+            objects[0] != std::tuple{"table"s, "messages"s, "messages"s, std::string{table}})
+            throw std::runtime_error{"Snapshot schema is not a message snapshot"};
+
+        SQLite::Statement check{snap, "PRAGMA quick_check"};
+        if (get_all<std::string>(check) != std::vector{"ok"s})
+            throw std::runtime_error{"Snapshot image is corrupt"};
+    }
+}  // namespace
+
+int64_t Database::import_snapshot(std::string_view image) {
+    db_timer timer;
+    check_snapshot(image);
+    int64_t inserted = 0;
+    // Each shard takes the accounts in its own part of the swarm space
+    for (size_t i = 0; i < shards.size(); i++) {
+        uint64_t lo = i * shard_span;
+        uint64_t hi = i + 1 < shards.size() ? (i + 1) * shard_span - 1
+                                            : std::numeric_limits<uint64_t>::max();
+        inserted += shards[i]->import_snapshot(image, lo, hi);
+    }
+    return inserted;
 }
 
+namespace {
+    // Drops the account from the shard's retrieve cache if `changed` (the messages affected by a
+    // delete or update) isn't empty, then passes `changed` through.  Must be called while still
+    // holding the shard's write_mutex.
+    template <typename T>
+    std::vector<T> invalidated(
+            DatabaseImpl* impl, const user_pubkey_t& pubkey, std::vector<T> changed) {
+        if (!changed.empty())
+            impl->changed(pubkey);
+        return changed;
+    }
+}  // namespace
+
 std::vector<std::pair<namespace_id, std::string>> Database::delete_all(
         const user_pubkey_t& pubkey) {
+    db_timer timer;
+    migrate_account(pubkey);
+    apply_journal(pubkey);
+    auto* impl = shard_for(pubkey);
+    std::lock_guard lock{impl->write_mutex};
+    auto owner = impl->owner_id(pubkey);
+    if (!owner)
+        return {};
     auto st = impl->prepared_st(
-            "DELETE FROM messages"
-            " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-            " RETURNING namespace, hash");
-    return get_all<namespace_id, std::string>(st, pubkey);
+            "DELETE FROM messages WHERE owner = ? RETURNING namespace, hash_text(hash)");
+    return invalidated(impl, pubkey, get_all<namespace_id, std::string>(st, *owner));
 }
 
 std::vector<std::string> Database::delete_all(const user_pubkey_t& pubkey, namespace_id ns) {
+    db_timer timer;
+    migrate_account(pubkey);
+    apply_journal(pubkey);
+    auto* impl = shard_for(pubkey);
+    std::lock_guard lock{impl->write_mutex};
+    auto owner = impl->owner_id(pubkey);
+    if (!owner)
+        return {};
     auto st = impl->prepared_st(
-            "DELETE FROM messages"
-            " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-            " AND namespace = ?"
-            " RETURNING hash");
-    return get_all<std::string>(st, pubkey, ns);
+            "DELETE FROM messages WHERE owner = ? AND namespace = ? RETURNING hash_text(hash)");
+    return invalidated(impl, pubkey, get_all<std::string>(st, *owner, ns));
 }
 
-namespace {
-    std::string multi_in_query(std::string_view prefix, size_t count, std::string_view suffix) {
-        std::string query;
-        query.reserve(prefix.size() + (count == 0 ? 0 : 2 * count - 1) + suffix.size());
-        query += prefix;
-        for (size_t i = 0; i < count; i++) {
-            if (i > 0)
-                query += ',';
-            query += '?';
-        }
-        query += suffix;
-        return query;
-    }
-}  // namespace
-
 std::vector<std::string> Database::delete_by_hash(
         const user_pubkey_t& pubkey, const std::vector<std::string>& msg_hashes) {
-    if (msg_hashes.size() == 1) {
+    db_timer timer;
+    migrate_account(pubkey);
+    apply_journal(pubkey);
+    auto* impl = shard_for(pubkey);
+    std::vector<std::string> kept;
+    auto& hashes = impl->maybe_stored(msg_hashes, kept);
+    if (hashes.empty())
+        return {};
+    std::lock_guard lock{impl->write_mutex};
+    auto owner = impl->owner_id(pubkey);
+    if (!owner)
+        return {};
+    std::vector<std::string> deleted;
+    if (hashes.size() == 1) {
         // Use an optimized prepared statement for very common single-hash deletions
         auto st = impl->prepared_st(
-                "DELETE FROM messages"
-                " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-                " AND hash = ?"
-                " RETURNING hash");
-        return get_all<std::string>(st, pubkey, msg_hashes[0]);
+                "DELETE FROM messages WHERE owner = ? AND hash = ? RETURNING hash_text(hash)");
+        deleted = get_all<std::string>(st, *owner, hash_binder{hashes[0]});
+    } else {
+        auto st = impl->prepared_in_st(
+                "DELETE FROM messages WHERE owner = ? AND hash IN ("sv,  // ?,?,?,...,?
+                ") RETURNING hash_text(hash)"sv,
+                2,
+                hashes);
+        st->bind(1, *owner);
+        deleted = get_all<std::string>(st);
     }
-
-    SQLite::Statement st{
-            impl->db,
-            multi_in_query(
-                    "DELETE FROM messages"
-                    " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-                    " AND hash IN ("sv,  // ?,?,?,...,?
-                    msg_hashes.size(),
-                    ") RETURNING hash"sv)};
-
-    bind_pubkey(st, 1, 2, pubkey);
-    for (size_t i = 0; i < msg_hashes.size(); i++)
-        st.bindNoCopy(3 + i, msg_hashes[i]);
-    return get_all<std::string>(st);
+    impl->hash_filter_misses(hashes.size(), deleted.size());
+    return invalidated(impl, pubkey, std::move(deleted));
 }
 
 std::vector<std::pair<namespace_id, std::string>> Database::delete_by_timestamp(
         const user_pubkey_t& pubkey, std::chrono::system_clock::time_point timestamp) {
+    db_timer timer;
+    migrate_account(pubkey);
+    apply_journal(pubkey);
+    auto* impl = shard_for(pubkey);
+    std::lock_guard lock{impl->write_mutex};
+    auto owner = impl->owner_id(pubkey);
+    if (!owner)
+        return {};
     auto st = impl->prepared_st(
-            "DELETE FROM messages"
-            " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-            " AND timestamp <= ?"
-            " RETURNING hash");
-    return get_all<namespace_id, std::string>(st, pubkey, to_epoch_ms(timestamp));
+            "DELETE FROM messages WHERE owner = ? AND timestamp <= ?"
+            " RETURNING namespace, hash_text(hash)");
+    return invalidated(
+            impl, pubkey, get_all<namespace_id, std::string>(st, *owner, to_epoch_ms(timestamp)));
 }
 
 std::vector<std::string> Database::delete_by_timestamp(
         const user_pubkey_t& pubkey,
         namespace_id ns,
         std::chrono::system_clock::time_point timestamp) {
+    db_timer timer;
+    migrate_account(pubkey);
+    apply_journal(pubkey);
+    auto* impl = shard_for(pubkey);
+    std::lock_guard lock{impl->write_mutex};
+    auto owner = impl->owner_id(pubkey);
+    if (!owner)
+        return {};
     auto st = impl->prepared_st(
-            "DELETE FROM messages"
-            " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-            " AND timestamp <= ? AND namespace = ?"
-            " RETURNING hash");
-    return get_all<std::string>(st, pubkey, to_epoch_ms(timestamp), ns);
+            "DELETE FROM messages WHERE owner = ? AND timestamp <= ? AND namespace = ?"
+            " RETURNING hash_text(hash)");
+    return invalidated(
+            impl, pubkey, get_all<std::string>(st, *owner, to_epoch_ms(timestamp), ns));
 }
 
 void Database::revoke_subkey(
         const user_pubkey_t& pubkey, const std::array<unsigned char, 32>& revoke_subkey) {
+    db_timer timer;
+    migrate_account(pubkey);
+    apply_journal(pubkey);
+    auto* impl = shard_for(pubkey);
+    std::lock_guard lock{impl->write_mutex};
     auto insert_subkey = impl->prepared_st(
             "INSERT INTO revoked_subkeys (owner, subkey) "
             "VALUES ((SELECT id FROM owners WHERE pubkey = ? AND type = ?), ?) "
             "ON CONFLICT DO NOTHING");
     exec_query(insert_subkey, pubkey, blob_binder{util::view_guts(revoke_subkey)});
+
+    // Until it is committed subkey_revoked() can't see the revocation in the database, and would
+    // take it back out of the set
+    if (auto* b = impl->batch_here(); b && b->write_lock) {
+        b->revoked.emplace_back(util::view_guts(revoke_subkey));
+        return;
+    }
+    std::unique_lock rlock{revoked_subkeys_mutex};
+    revoked_subkeys.emplace(util::view_guts(revoke_subkey));
 }
 
 bool Database::subkey_revoked(const std::array<unsigned char, 32>& revoke_subkey) {
-    auto get_subkey_count =
-            impl->prepared_st("SELECT count(*) FROM revoked_subkeys WHERE subkey = ?");
-    auto subkey_count =
-            exec_and_get<int64_t>(get_subkey_count, blob_binder{util::view_guts(revoke_subkey)});
-    return subkey_count > 0;
+    db_timer timer;
+    auto subkey = util::view_guts(revoke_subkey);
+    {
+        std::shared_lock lock{revoked_subkeys_mutex};
+        if (!revoked_subkeys.count(std::string{subkey}))
+            return false;
+    }
+
+    auto in_db = [&] {
+        for (auto& impl : shards) {
+            auto get_subkey_count = impl->prepared_read_st(
+                    "SELECT count(*) FROM revoked_subkeys WHERE subkey = ?");
+            if (exec_and_get<int64_t>(get_subkey_count, blob_binder{subkey}) > 0)
+                return true;
+        }
+        return false;
+    };
+    if (in_db())
+        return true;
+
+    // The revocation has since been dropped from the database, so forget about it.  Check again
+    // once we have the lock, though: the read above can miss a revocation that was being
+    // committed, and revoke_subkey only adds it to the set (a no-op, as it is still there) after
+    // committing, so forgetting it now would let the subkey through until restart.
+    std::unique_lock lock{revoked_subkeys_mutex};
+    if (in_db())
+        return true;
+    revoked_subkeys.erase(std::string{subkey});
+    return false;
 }
 
+namespace {
+    // Returns the expiries of whichever of `hashes` the given owner has stored.
+    std::map<std::string, int64_t> stored_expiries(
+            DatabaseImpl* impl, int64_t owner, const std::vector<std::string>& hashes) {
+        if (hashes.size() == 1) {
+            // Pre-prepared version for the common single hash case
+            auto st = impl->prepared_read_st(
+                    "SELECT hash_text(hash), expiry FROM messages WHERE hash = ? AND owner = ?");
+            return get_map<std::string, int64_t>(st, hash_binder{hashes[0]}, owner);
+        }
+        auto st = impl->prepared_in_st(
+                "SELECT hash_text(hash), expiry FROM messages"
+                " WHERE owner = ? AND hash IN ("sv,  // ?,...,?
+                ")"sv,
+                2,
+                hashes,
+                true);
+        st->bind(1, owner);
+        return get_map<std::string, int64_t>(st);
+    }
+
+    // How far (in ms) before `new_exp` a message's expiry may be for update_expiry to leave it be.
+    int64_t expiry_tolerance(std::chrono::system_clock::time_point new_exp) {
+        using namespace std::chrono;
+        auto remaining = duration_cast<milliseconds>(new_exp - system_clock::now());
+        if (remaining <= 0ms)
+            return 0;
+        return std::min<int64_t>(
+                static_cast<int64_t>(remaining.count() * Database::EXPIRY_TOLERANCE),
+                duration_cast<milliseconds>(Database::EXPIRY_TOLERANCE_MAX).count());
+    }
+}  // namespace
+
 std::vector<std::string> Database::update_expiry(
         const user_pubkey_t& pubkey,
         const std::vector<std::string>& msg_hashes,
         std::chrono::system_clock::time_point new_exp,
         bool extend_only,
-        bool shorten_only) {
+        bool shorten_only,
+        std::map<std::string, int64_t>* unchanged) {
+    db_timer timer;
+    migrate_account(pubkey);
+    apply_journal(pubkey);
+    auto* impl = shard_for(pubkey);
+    std::vector<std::string> kept;
+    auto& hashes = impl->maybe_stored(msg_hashes, kept);
+    if (hashes.empty())
+        return {};
+    auto owner = impl->owner_id(pubkey, true);
+    if (!owner)
+        return {};
     auto new_exp_ms = to_epoch_ms(new_exp);
 
+    // Look at the current expiries first (without the write lock): messages that extend_only or
+    // shorten_only rule out are left alone, as are (unless shortening) ones that already expire
+    // only a little earlier than asked, so that clients pushing the expiry of the same messages
+    // forward over and over again don't write anything each time.  Those are reported with their
+    // actual expiry, never as updated.
+    auto current = stored_expiries(impl, *owner, hashes);
+    impl->hash_filter_misses(hashes.size(), current.size());
+    auto tolerance = expiry_tolerance(new_exp);
+    std::vector<std::string> updated, rewrite;
+    for (auto& [hash, expiry] : current) {
+        if (shorten_only ? expiry <= new_exp_ms
+                         : expiry >= new_exp_ms - tolerance &&
+                                   (extend_only || expiry < new_exp_ms)) {
+            if (unchanged)
+                unchanged->emplace(hash, expiry);
+        } else if (expiry == new_exp_ms)
+            updated.push_back(hash);
+        else
+            rewrite.push_back(hash);
+    }
+    if (rewrite.empty())
+        return updated;
+
+    std::lock_guard lock{impl->write_mutex};
+    // The constraint gets applied again here in case a concurrent update got in first
     auto expiry_constraint = extend_only  ? " AND expiry < ?1"s
                            : shorten_only ? " AND expiry > ?1"s
                                           : ""s;
-    if (msg_hashes.size() == 1) {
+    std::vector<std::string> rewritten;
+    if (rewrite.size() == 1) {
         // Pre-prepared version for the common single hash case
         auto st = impl->prepared_st(
                 "UPDATE messages SET expiry = ? WHERE hash = ?"s + expiry_constraint +
-                " AND owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-                " RETURNING hash");
-        return get_all<std::string>(st, new_exp_ms, msg_hashes[0], pubkey);
+                " AND owner = ? RETURNING hash_text(hash)");
+        rewritten = invalidated(
+                impl,
+                pubkey,
+                get_all<std::string>(st, new_exp_ms, hash_binder{rewrite[0]}, *owner));
+    } else {
+        auto st = impl->prepared_in_st(
+                "UPDATE messages SET expiry = ? WHERE owner = ?"s + expiry_constraint +
+                        " AND hash IN (",  // ?,?,?,...,?
+                ") RETURNING hash_text(hash)"sv,
+                3,
+                rewrite);
+        st->bind(1, new_exp_ms);
+        st->bind(2, *owner);
+        rewritten = invalidated(impl, pubkey, get_all<std::string>(st));
     }
-
-    SQLite::Statement st{
-            impl->db,
-            multi_in_query(
-                    "UPDATE messages SET expiry = ?"
-                    " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"s +
-                            expiry_constraint + " AND hash IN (",  // ?,?,?,...,?
-                    msg_hashes.size(),
-                    ") RETURNING hash"sv)};
-    st.bind(1, new_exp_ms);
-    bind_pubkey(st, 2, 3, pubkey);
-    for (size_t i = 0; i < msg_hashes.size(); i++)
-        st.bindNoCopy(4 + i, msg_hashes[i]);
-
-    return get_all<std::string>(st);
+    if (updated.empty())
+        return rewritten;
+    updated.insert(updated.end(), rewritten.begin(), rewritten.end());
+    return updated;
 }
 
 std::map<std::string, int64_t> Database::get_expiries(
         const user_pubkey_t& pubkey, const std::vector<std::string>& msg_hashes) {
-    if (msg_hashes.size() == 1) {
-        // Pre-prepared version for the common single hash case
-        auto st = impl->prepared_st(
-                "SELECT hash, expiry FROM messages WHERE hash = ?"
-                " AND owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)");
-        return get_map<std::string, int64_t>(st);
-    }
-
-    SQLite::Statement st{
-            impl->db,
-            multi_in_query(
-                    "SELECT hash, expiry FROM messages"
-                    " WHERE owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-                    " AND hash IN ("sv,  // ?,?,?,...,?
-                    msg_hashes.size(),
-                    ")"sv)};
-    bind_pubkey(st, 1, 2, pubkey);
-    for (size_t i = 0; i < msg_hashes.size(); i++)
-        st.bindNoCopy(3 + i, msg_hashes[i]);
-
-    return get_map<std::string, int64_t>(st);
+    db_timer timer;
+    migrate_account(pubkey);
+    apply_journal(pubkey);
+    auto* impl = shard_for(pubkey);
+    std::vector<std::string> kept;
+    auto& hashes = impl->maybe_stored(msg_hashes, kept);
+    if (hashes.empty())
+        return {};
+    auto owner = impl->owner_id(pubkey, true);
+    if (!owner)
+        return {};
+    auto expiries = stored_expiries(impl, *owner, hashes);
+    impl->hash_filter_misses(hashes.size(), expiries.size());
+    return expiries;
 }
 
 std::vector<std::pair<namespace_id, std::string>> Database::update_all_expiries(
         const user_pubkey_t& pubkey, std::chrono::system_clock::time_point new_exp) {
+    db_timer timer;
+    migrate_account(pubkey);
+    apply_journal(pubkey);
+    auto* impl = shard_for(pubkey);
     auto new_exp_ms = to_epoch_ms(new_exp);
+    // Repeats of an expire_all that already went through have nothing left to shorten
+    auto owner = impl->owner_id(pubkey, true);
+    if (!owner)
+        return {};
+    auto any = impl->prepared_read_st(
+            "SELECT EXISTS(SELECT 1 FROM messages WHERE owner = ? AND expiry > ?)");
+    if (!exec_and_get<int64_t>(any, *owner, new_exp_ms))
+        return {};
+    std::lock_guard lock{impl->write_mutex};
     auto st = impl->prepared_st(
-            "UPDATE messages SET expiry = ?"
-            " WHERE expiry > ? AND owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-            " RETURNING namespace, hash");
-    return get_all<namespace_id, std::string>(st, new_exp_ms, new_exp_ms, pubkey);
+            "UPDATE messages SET expiry = ?1 WHERE expiry > ?1 AND owner = ?"
+            " RETURNING namespace, hash_text(hash)");
+    return invalidated(
+            impl, pubkey, get_all<namespace_id, std::string>(st, new_exp_ms, *owner));
 }
 
 std::vector<std::string> Database::update_all_expiries(
         const user_pubkey_t& pubkey,
         namespace_id ns,
         std::chrono::system_clock::time_point new_exp) {
+    db_timer timer;
+    migrate_account(pubkey);
+    apply_journal(pubkey);
+    auto* impl = shard_for(pubkey);
     auto new_exp_ms = to_epoch_ms(new_exp);
+    // Repeats of an expire_all that already went through have nothing left to shorten
+    auto owner = impl->owner_id(pubkey, true);
+    if (!owner)
+        return {};
+    auto any = impl->prepared_read_st(
+            "SELECT EXISTS(SELECT 1 FROM messages WHERE owner = ? AND namespace = ?"
+            " AND expiry > ?)");
+    if (!exec_and_get<int64_t>(any, *owner, ns, new_exp_ms))
+        return {};
+    std::lock_guard lock{impl->write_mutex};
     auto st = impl->prepared_st(
-            "UPDATE messages SET expiry = ?"
-            " WHERE expiry > ? AND owner = (SELECT id FROM owners WHERE pubkey = ? AND type = ?)"
-            " AND namespace = ?"
-            " RETURNING hash");
-    return get_all<std::string>(st, new_exp_ms, new_exp_ms, pubkey, ns);
+            "UPDATE messages SET expiry = ?1 WHERE expiry > ?1 AND owner = ? AND namespace = ?"
+            " RETURNING hash_text(hash)");
+    return invalidated(impl, pubkey, get_all<std::string>(st, new_exp_ms, *owner, ns));
 }
 
 }  // namespace oxen
@@ -1,14 +1,26 @@
 #pragma once
 
 #include <oxenss/common/message.h>
+#include <oxenss/utils/affinity.hpp>
+#include "retrieve_cache.hpp"
+#include "segments.hpp"
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <deque>
 #include <filesystem>
+#include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
 namespace oxen {
@@ -17,36 +29,334 @@ using namespace std::literals;
 
 class DatabaseImpl;
 
+// sqlite3 settings for the storage database connections.  The defaults leave sqlite3's own
+// defaults in place.
+struct db_tuning {
+    // Bytes of each database file to read through a memory map rather than read() calls (PRAGMA
+    // mmap_size); 0 disables memory-mapped I/O.  sqlite3 caps this at its compiled-in maximum
+    // (2GB by default).
+    int64_t mmap_size = 0;
+    // Page cache size, in bytes, of each database file's connection (PRAGMA cache_size); 0 keeps
+    // sqlite3's default of 2MB.
+    int64_t cache_size = 0;
+    // Checkpoint the WAL into the database once it holds this many pages (PRAGMA
+    // wal_autocheckpoint).
+    int wal_autocheckpoint = 1000;
+    // Keep temporary tables and indices (e.g. for sorting) in memory rather than in temp files.
+    bool temp_store_memory = false;
+    // Run checkpoints from a background thread, on a separate connection, rather than inside the
+    // commit of whichever write pushes the WAL over `wal_autocheckpoint` pages.
+    bool background_checkpoint = false;
+    // Acknowledge stores as soon as they are synced to an append-only journal next to each
+    // database file (see IngestJournal), and write them into the database from a background
+    // thread, so that store latency doesn't depend on sqlite3 commits.  Messages still in the
+    // journal are written into the database before any request involving their account, and are
+    // replayed at startup after a crash.
+    bool ingest_journal = false;
+    // CPUs to run the database's own threads (the background checkpointer and journal applier)
+    // on, if not empty.  Client writes are committed by the worker threads making them.
+    util::cpu_set thread_cpus;
+};
+
+// Eviction of unexpired messages once the database gets close to full, so that new messages keep
+// getting stored rather than being rejected until enough old ones expire.  Eviction happens in the
+// periodic clean_expired() calls, in chunks, rather than in the stores themselves.
+struct db_eviction {
+    bool enabled = false;
+    // Eviction starts once a shard's used pages exceed this fraction of its size limit, and
+    // removes the soonest-to-expire messages until they are down to `low_water`.  The gap leaves
+    // room for the stores that arrive between clean_expired() calls.
+    double high_water = 0.95;
+    double low_water = 0.90;
+    // Soft limit on the stored message bytes of each account; 0 for none.  When a shard needs to
+    // evict, accounts over the limit first lose their soonest-to-expire messages down to the limit,
+    // before anyone else's get evicted.
+    int64_t account_quota = 0;
+};
+
 // Storage database class.
+//
+// The database can optionally be split into multiple shards, each of which is a separate sqlite3
+// database file (with its own connection) holding the messages of the accounts in one contiguous
+// range of the swarm space (see user_pubkey_t::swarm_space()).  This allows writes for different
+// accounts to proceed in parallel rather than all being serialized through a single sqlite3 writer.
+// Sharding is transparent to callers: calls involving a pubkey are routed to the appropriate
+// shard, and calls that aren't pubkey-specific are applied to all shards.
+//
+// Client reads (retrieve, retrieve_by_hash, get_expiries and subkey_revoked) don't go through a
+// shard's shared connection but through a read-only connection that each calling thread opens for
+// itself, so that concurrent reads proceed in parallel (under WAL, alongside the writer) rather
+// than taking turns on the shared connection.
 class Database {
-    std::unique_ptr<DatabaseImpl> impl;
+    std::vector<std::unique_ptr<DatabaseImpl>> shards;
+    // The size of the swarm space range assigned to each shard; 0 if unsharded.
+    uint64_t shard_span = 0;
+    // Payloads at least this large get stored in segment files; 0 if disabled.
+    size_t cold_threshold = 0;
+    // Eviction of unexpired messages when full (see db_eviction)
+    db_eviction eviction;
     friend class DatabaseImpl;
 
+    // Returns the index of (or pointer to) the shard responsible for the given pubkey
+    size_t shard_index(const user_pubkey_t& pubkey) const;
+    DatabaseImpl* shard_for(const user_pubkey_t& pubkey);
+
+    // Every subkey that has been revoked, so that subkey_revoked() only has to query the database
+    // for subkeys in here.  This can contain subkeys that are no longer in the database (e.g.
+    // because of the per-account revocation limit); those get removed when a query finds them
+    // missing.
+    std::unordered_set<std::string> revoked_subkeys;
+    std::shared_mutex revoked_subkeys_mutex;
+
+    // Moves all data from a database file that isn't part of the current shard configuration (e.g.
+    // after the shard count was changed) into the current shards, then removes the old file.  With
+    // online migration this only copies the revoked subkeys and queues the messages for
+    // migrate_pending().
+    void migrate_from(const std::filesystem::path& old_db, bool online);
+
+    // Data waiting to be moved into the current shards by online migration: the legacy table of a
+    // shard, or the messages of a database file from another shard configuration.
+    struct migration_source;
+    std::deque<std::unique_ptr<migration_source>> migrations;
+    std::mutex migration_mutex;
+    std::atomic<bool> migrating_{false};
+    int64_t migrated_ = 0;
+    // Accounts already moved ahead of the rest by migrate_account()
+    std::unordered_set<user_pubkey_t> migrated_accounts;
+
+    // Moves the next chunk of pending data; returns false if there is nothing left to move.
+    bool migrate_chunk();
+
+    // Moves any of `pubkey`'s messages still waiting for online migration, so that requests
+    // involving the account see all of its messages.  Does nothing (beyond checking an atomic
+    // flag) if migration is finished.
+    void migrate_account(const user_pubkey_t& pubkey);
+
+    // bulk_store() without migrating the accounts first, for storing messages that migration (or
+    // the journal replay) itself is moving.
+    void store_all(const std::vector<message>& items);
+
+    // Background WAL checkpointing (see db_tuning::background_checkpoint): the thread waits on
+    // `checkpoint_cv` for shards whose WAL has grown past the checkpoint threshold.
+    std::thread checkpointer;
+    std::mutex checkpoint_mutex;
+    std::condition_variable checkpoint_cv;
+    bool checkpoint_stop = false;
+    void run_checkpoints();
+
+    // Ingest journal (see db_tuning::ingest_journal): the thread waits on `journal_cv` for
+    // journaled messages to write into the database.
+    std::thread journal_applier;
+    std::mutex journal_mutex;
+    std::condition_variable journal_cv;
+    bool journal_stop = false;
+    void run_journal();
+
+    // Stops and joins the checkpointer and journal applier threads, if running (emptying the
+    // journals once the applier has stopped).
+    void stop_threads();
+
+    // Writes any of `pubkey`'s messages still waiting in the ingest journal into the database, so
+    // that requests involving the account see them.  Does nothing (beyond checking an atomic) when
+    // nothing is waiting.
+    void apply_journal(const user_pubkey_t& pubkey);
+
+    // Stores the messages of any ingest journal files left in `db_path` (e.g. by a crash, or by a
+    // different shard configuration) into the database, then removes the files.
+    void replay_journals(const std::filesystem::path& db_path);
+
   public:
     // Recommended period for calling clean_expired()
     static constexpr auto CLEANUP_PERIOD = 10s;
 
+    // clean_expired() deletes expired messages in chunks of this many rows, each in its own
+    // transaction, so that other writes can get in between chunks.
+    static constexpr int EXPIRY_CHUNK_SIZE = 1000;
+
+    // Recommended time budget for the periodic clean_expired() calls; anything left over once
+    // this runs out gets picked up by the next call.
+    static constexpr auto EXPIRY_TIME_BUDGET = 250ms;
+
+    // Maximum total size of the database (across all shards, if sharded).
     static constexpr int64_t SIZE_LIMIT = int64_t(3584) * 1024 * 1024;  // 3.5 GB
 
+    // With eviction enabled (see db_eviction), clean_expired() evicts messages in chunks of this
+    // many rows, each in its own transaction, and checks the per-account quota of this many
+    // accounts per call (resuming with the next ones on the following call).
+    static constexpr int EVICTION_CHUNK_SIZE = 500;
+    static constexpr int EVICTION_QUOTA_ACCOUNTS = 1000;
+
+    // Recommended period and time budget for migrate_pending() calls while migrating() is true.
+    static constexpr auto MIGRATION_PERIOD = 1s;
+    static constexpr auto MIGRATION_TIME_BUDGET = 200ms;
+
+    // Online migration moves messages in chunks of this many rows, each in its own transaction.
+    static constexpr size_t MIGRATION_CHUNK_SIZE = 500;
+
+    // Maximum number of database shards we allow.
+    static constexpr size_t MAX_SHARDS = 64;
+
+    // clean_expired() compacts a payload segment (see `cold_threshold`, below) once less than this
+    // fraction of it is still in use.
+    static constexpr double COLD_COMPACT_RATIO = 0.5;
+
+    // With the ingest journal (see db_tuning::ingest_journal), a shard's journal gets emptied once
+    // it grows past this size: stores briefly wait while everything in it is written into the
+    // database and synced.
+    static constexpr int64_t JOURNAL_TRUNCATE_SIZE = 16 * 1024 * 1024;
+
     // Constructor.  Note that you *must* also set up a timer that runs periodically (every
     // CLEANUP_PERIOD is recommended) and calls clean_expired().
-    explicit Database(const std::filesystem::path& db_path);
+    //
+    // `shards` specifies how many database files to split the messages across.  The default, 1,
+    // uses a single `storage.db` database; a value greater than one uses `storage-I-of-N.db` files
+    // instead.  If database files exist from a different shard configuration they are migrated
+    // into the new configuration (and then deleted) during construction.
+    //
+    // If `cold_threshold` is non-zero then message payloads of at least that many bytes are not
+    // stored in the database itself but appended to memory-mapped segment files kept in a
+    // `-segments` directory next to each database file, which keeps the database (and its page
+    // cache) small when most of the stored bytes are large payloads that are rarely read.  Segments
+    // are limited to the database's size limit, and get compacted by clean_expired() as their
+    // messages expire.  Payloads stored in segments remain readable if the threshold is later
+    // turned off.
+    //
+    // If `online_migration` is true then messages in old database files or old schemas are not
+    // migrated during construction: the database is usable immediately, and the messages get moved
+    // over by periodic migrate_pending() calls (which you must then set up as well).  Until that
+    // finishes, requests for a specific account first move that account's messages over; only
+    // other queries (such as message counts) can miss some messages.
+    //
+    // `tuning` sets sqlite3's memory map, page cache and checkpointing settings; see db_tuning.
+    //
+    // `eviction` controls whether unexpired messages get evicted (by clean_expired()) as the
+    // database fills up, rather than stores failing once it is full; see db_eviction.
+    explicit Database(
+            const std::filesystem::path& db_path,
+            size_t shards = 1,
+            size_t cold_threshold = 0,
+            bool online_migration = false,
+            const db_tuning& tuning = {},
+            const db_eviction& eviction = {});
+
+    // Returns the number of database shards in use.
+    size_t shard_count() const { return shards.size(); }
 
     ~Database();
 
     // if the database is full then print an error only once ever N errors
     static constexpr int DB_FULL_FREQUENCY = 100;
 
+    // Maximum number of concurrent store() calls that get committed together in one transaction.
+    static constexpr size_t STORE_BATCH_MAX = 100;
+
+    // A batch (see begin_batch) only gets write transactions if each shard it stores to has room
+    // for twice the batch's message data plus this much more, since sqlite3 rolls back the entire
+    // transaction when the database fills up.
+    static constexpr int64_t BATCH_HEADROOM = 1024 * 1024;
+
+    // Unless shortening, update_expiry leaves alone (and reports as unchanged, with its actual
+    // expiry) a message that already expires no more than this fraction of the new expiry's
+    // remaining lifetime (and no more than EXPIRY_TOLERANCE_MAX) before the requested expiry, so
+    // that clients repeatedly refreshing the same messages cost each swarm member a read rather
+    // than a write.  Expiries close to now are thus always set exactly.
+    static constexpr double EXPIRY_TOLERANCE = 0.01;
+    static constexpr auto EXPIRY_TOLERANCE_MAX = 1h;
+
+    // Messages inserted per multi-row INSERT statement by bulk_store.  Fewer left over at the end
+    // go in statements of power of 2 sizes, so that only a handful of statements get prepared.
+    static constexpr size_t BULK_STORE_ROWS = 64;
+
+    // Maximum number of prepared statements that each thread keeps cached for each database shard
+    // (for each of the shared and its read-only connection); when full, the least recently used
+    // statement gets dropped.
+    static constexpr size_t STATEMENT_CACHE_SIZE = 128;
+
+    // Maximum number of account owner ids that each shard keeps cached in memory; when full, the
+    // cache starts over.
+    static constexpr size_t OWNER_CACHE_SIZE = 100'000;
+
+    // Queries taking a list of message hashes (such as delete_by_hash) round the number of hash
+    // placeholders up to the next power of 2 so that similarly sized requests can share a cached
+    // statement; lists longer than this are prepared once and not cached.
+    static constexpr size_t MAX_CACHED_IN_ARITY = 256;
+
+    struct statement_cache_stats {
+        int64_t hits = 0;       // Queries that used an already prepared statement
+        int64_t misses = 0;     // Queries that had to prepare a new statement
+        int64_t evictions = 0;  // Statements dropped from a full cache
+        int64_t cached = 0;     // Statements currently cached (across all threads)
+        std::chrono::microseconds prepare_time{0};  // Total time spent preparing statements
+    };
+
+    // Returns prepared statement cache statistics, summed across all shards.
+    statement_cache_stats get_statement_cache_stats();
+
+    struct io_stats {
+        int64_t cache_used = 0;     // Bytes of page cache currently in use
+        int64_t cache_hits = 0;     // Pages found in the page cache
+        int64_t cache_misses = 0;   // Pages that had to be read from the file (or memory map)
+        int64_t cache_writes = 0;   // Dirty pages written out to the WAL
+        int64_t cache_spills = 0;   // Dirty pages written out early because the cache was full
+        int64_t checkpoints = 0;    // Background checkpoints run
+        int64_t checkpointed = 0;   // Pages copied from the WAL into the database by those
+        int64_t checkpoint_busy = 0;  // Checkpoints that couldn't copy everything due to readers
+        std::chrono::microseconds checkpoint_time{0};  // Total time spent in those
+        int64_t readers = 0;  // Read-only connections (one per thread that has done reads)
+        int64_t journaled = 0;        // Stores acknowledged from the ingest journal
+        int64_t journal_syncs = 0;    // fdatasync calls made for those
+        int64_t journal_waiting = 0;  // Journaled messages not yet written into the database
+    };
+
+    // Returns database I/O statistics (from sqlite3_db_status), summed across all shards.
+    io_stats get_io_stats();
+
+    // Memory held by the database, in bytes.  The sqlite3 figures are exact (from sqlite3_status
+    // and sqlite3_db_status); the in-memory caches are estimates (see util::memory_of).
+    struct memory_stats {
+        int64_t sqlite_used = 0;       // Currently allocated by sqlite3, for everything
+        int64_t sqlite_highwater = 0;  // The most sqlite3 has had allocated at once
+        int64_t sqlite_allocations = 0;  // Outstanding sqlite3 allocations
+        int64_t page_cache = 0;  // Page caches of all connections
+        int64_t statements = 0;  // Prepared statements (including the statement caches)
+        int64_t schema = 0;      // Parsed schemas of all connections
+        int64_t retrieve_cache = 0;
+        int64_t hash_filters = 0;
+        int64_t owner_caches = 0;
+        int64_t journal = 0;  // Messages waiting in the ingest journals
+    };
+
+    memory_stats get_memory_stats();
+
     // Attempts to store a message in the database.  Returns true if inserted, false on failure
     // due to the message already existing, and nullopt if the insertion failed because the
     // database is full.  For other query failures, throws.
     //
     // This means `if (db.store(...))` will be true if inserted *or* already present; to check
     // only for insertion use `ins && *ins`.
+    //
+    // Stores made concurrently from multiple threads are group-committed: one of the callers
+    // inserts all the pending messages in a single transaction, and each caller then returns its
+    // own message's result.
     std::optional<bool> store(const message& msg);
 
+    // Same as above, but for a shared message, which the retrieve cache can then share rather
+    // than copy.
+    std::optional<bool> store(const shared_message& msg);
+
     void bulk_store(const std::vector<message>& items);
 
+    // Produces messages by invoking the given sink once for each one.
+    using message_source = std::function<void(const message_sink& sink)>;
+
+    // Stores the messages produced by `source` without them having to be collected into a vector
+    // first (e.g. straight out of a serialized batch); the views passed to the sink only need to
+    // stay valid for the duration of each sink call.  Each shard's messages are stored in a single
+    // transaction.  If the database is sharded or migrating then `source` gets invoked more than
+    // once, and must produce the same messages each time.  If `source` throws then nothing is stored and the
+    // exception is propagated.
+    void bulk_store(const message_source& source);
+
     // Default value for message overhead calculations in `retrieve`.  In practice, overhead for the
     // message itself (i.e. the json keys, etc.) seems to be in the 75-80 character range (depending
     // on whether json or bt-encoded), not including the hash + the data.
@@ -59,6 +369,10 @@ class Database {
     // Note that the `pubkey` value of the returned message's will be left default constructed,
     // i.e. *not* filled with the given pubkey.
     //
+    // Retrieves that follow one of an account's newest few messages (such as the typical poll that
+    // finds nothing new) are answered from an in-memory cache (see RetrieveCache), which skips
+    // expired messages that the database might still be returning.
+    //
     // Returns a vector of messages, and a bool indicating whether there are more results to
     // retrieve.
     std::pair<std::vector<message>, bool> retrieve(
@@ -73,9 +387,179 @@ class Database {
                     DEFAULT_MSG_OVERHEAD  // how much overhead per message to allow for
     );
 
-    // Retrieves all messages.
+    // Same as above, but rather than returning copies of the messages this invokes `f` with a view
+    // of each one, referencing the database result directly.  The viewed hash and data are only
+    // valid until `f` returns.  Returns true if there are more messages to retrieve.
+    bool retrieve(
+            const user_pubkey_t& pubkey,
+            namespace_id ns,
+            const std::string& last_hash,
+            const std::function<void(const message_view& msg)>& f,
+            std::optional<size_t> num_results = std::nullopt,
+            std::optional<size_t> max_size = std::nullopt,
+            bool size_b64 = true,
+            size_t per_message_overhead = DEFAULT_MSG_OVERHEAD);
+
+    // One of the retrieves of a `retrieve_multi` call: the account, namespace, last hash and
+    // message limit of a single `retrieve`.
+    struct retrieve_query {
+        user_pubkey_t pubkey;
+        namespace_id ns = namespace_id::Default;
+        std::string last_hash;
+        std::optional<size_t> max_results;
+    };
+    struct retrieve_result {
+        std::vector<message> messages;
+        bool more = false;  // True if there are more messages to retrieve
+    };
+
+    // Performs several retrieves (of any mix of accounts and namespaces) at once, returning the
+    // result of each query in the same order as `queries`.  Each account's owner is looked up only
+    // once, and all the queries against a shard read from a single snapshot of it.
+    //
+    // `max_size` (with `size_b64` and `per_message_overhead` as for `retrieve`) is a budget shared
+    // by all of the queries, used up in query order: once it runs out the remaining queries return
+    // no messages (and set `more` if they have any).  The first message overall is always returned,
+    // even if it alone exceeds the budget.
+    std::vector<retrieve_result> retrieve_multi(
+            const std::vector<retrieve_query>& queries,
+            std::optional<size_t> max_size = std::nullopt,
+            bool size_b64 = true,
+            size_t per_message_overhead = DEFAULT_MSG_OVERHEAD);
+
+    // Returns a value that changes whenever messages of `pubkey` get stored, deleted, or updated
+    // (see RetrieveCache::account_token), so that results retrieved for the account under the same
+    // token can be treated as interchangeable.
+    uint64_t account_token(const user_pubkey_t& pubkey);
+
+    // What one request of a batch (see begin_batch) does with the database.
+    struct batch_access {
+        user_pubkey_t pubkey;
+        bool write = false;     // True if the request changes the account's messages
+        size_t store_size = 0;  // Size of the message the request stores, if any
+    };
+
+    // An open batch; see begin_batch().  Destroying it ends the batch, committing its writes.
+    class batch_scope {
+      public:
+        batch_scope();
+        batch_scope(batch_scope&&) noexcept;
+        batch_scope& operator=(batch_scope&&) noexcept;
+        ~batch_scope();
+
+        // True if any of the batch's database work is being grouped
+        explicit operator bool() const { return (bool)state_; }
+
+        // Ends the batch, committing its writes.  Returns false if they could not be committed (or
+        // had already been rolled back by sqlite3), in which case none of the batch's writes were
+        // kept.  Destroying a scope without calling this commits it all the same, but leaves any
+        // failure unreported.
+        bool commit();
+
+      private:
+        friend class Database;
+        struct state;
+        std::unique_ptr<state> state_;
+    };
+
+    // Groups the database work of a batch of requests, which make the `accesses` between this call
+    // and the destruction of the returned scope, on the calling thread.  Each shard that the batch
+    // reads (but doesn't write) more than once gets read through a single snapshot, and if the
+    // batch writes more than once then each shard it writes gets one transaction (holding off the
+    // shard's other writers until the scope ends) rather than a commit per change.  The batch's
+    // requests see their own writes, other threads only see them once the scope has ended.
+    //
+    // Writes are left to commit individually when the ingest journal is in use, during online
+    // migration, if a shard is too full (see BATCH_HEADROOM), or if the calling thread already has
+    // a batch open.  Reads of accounts not given in `accesses` are fine, but every write must be
+    // given: with another shard's writers held off, writing to a shard outside of the batch could
+    // deadlock against a batch holding that one.
+    [[nodiscard]] batch_scope begin_batch(const std::vector<batch_access>& accesses);
+
+    // Returns retrieve cache statistics, summed across all shards.
+    RetrieveCache::stats get_retrieve_cache_stats();
+
+    // Deletes, expiry updates and expiry lookups first check the message hashes they are given
+    // against an in-memory filter of the hashes we have, skipping the ones we definitely don't.
+    struct hash_filter_stats {
+        int64_t lookups = 0;          // Hashes checked against the filter
+        int64_t skipped = 0;          // ... that the filter said we don't have
+        int64_t false_positives = 0;  // ... that got through but turned out not to be stored
+        int64_t entries = 0;          // Hashes in the filters
+        int64_t capacity = 0;         // Hashes the filters are sized for
+        int64_t bytes = 0;            // Memory used by the filters
+        int64_t rebuilds = 0;         // Filters rebuilt because they got too full or too empty
+    };
+
+    // Returns hash filter statistics, summed across all shards.  (`false_positives` only counts
+    // deletes and expiry lookups, since expiry updates can also miss due to their constraints).
+    hash_filter_stats get_hash_filter_stats();
+
+    // Retrieves all messages.  Note that this loads every stored message into memory at once;
+    // prefer the callback version below for anything other than small databases.
     std::vector<message> retrieve_all();
 
+    // Default number of rows that the streaming `retrieve_all` loads from the database at a time.
+    constexpr static size_t RETRIEVE_ALL_CHUNK_SIZE = 500;
+
+    // Streams all messages, in insertion order, invoking `f` with each one.  Rather than loading
+    // the entire database into memory, rows are fetched `chunk_size` at a time (and the query is
+    // reset between chunks so that we don't hold a read transaction open for the entire iteration).
+    // If `f` returns false then iteration stops without loading any further messages.
+    void retrieve_all(
+            const std::function<bool(message&& msg)>& f,
+            size_t chunk_size = RETRIEVE_ALL_CHUNK_SIZE);
+
+    // Streams the messages of every account whose swarm space value (see
+    // user_pubkey_t::swarm_space) lies in the inclusive range [lo, hi], invoking `f` with each one.
+    // Accounts are selected using an index on their stored swarm space values, so the cost depends
+    // only on the number of accounts in the range rather than the size of the database.  Accounts
+    // are visited in ascending swarm space order, with all of an account's messages together.
+    // Messages are loaded (up to) `chunk_size` at a time, as with retrieve_all, and iteration stops
+    // if `f` returns false.  Returns false if iteration was stopped by `f`.
+    bool retrieve_by_swarm_space(
+            uint64_t lo,
+            uint64_t hi,
+            const std::function<bool(message&& msg)>& f,
+            size_t chunk_size = RETRIEVE_ALL_CHUNK_SIZE);
+
+    // Snapshots move a whole range of accounts between storage servers (e.g. to bootstrap a new
+    // swarm member) as a serialized sqlite3 database image of their messages, which the receiver
+    // attaches and merges with INSERT ... SELECT rather than storing the messages one by one.
+    //
+    // export_snapshot sets `image` to a snapshot of the unexpired messages of the accounts whose
+    // swarm space value lies in the inclusive range [lo, hi] (empty if there are none).  Accounts
+    // are added in ascending swarm space order, stopping before the first account that would take
+    // the image's message bytes over `max_size` (though the first account is always included), in
+    // which case the swarm space value to continue from is returned; nullopt means the range is
+    // done.
+    std::optional<uint64_t> export_snapshot(
+            uint64_t lo, uint64_t hi, size_t max_size, std::string& image);
+
+    // Returns true if `blob` looks like a snapshot image (i.e. a sqlite3 database) rather than, say,
+    // a batch of serialized messages.
+    static bool is_snapshot(std::string_view blob);
+
+    // Merges the messages of a snapshot image produced by export_snapshot into the database,
+    // skipping messages we already have, expired messages, and rows that aren't valid messages.
+    // Returns the number of messages stored.  Throws if the image isn't a snapshot we understand.
+    int64_t import_snapshot(std::string_view image);
+
+    // Returns true if online migration (see the constructor) still has messages left to move.
+    bool migrating() const { return migrating_.load(std::memory_order_relaxed); }
+
+    // Moves messages waiting for online migration over, in chunks, until there are none left or,
+    // if given, the time budget runs out.
+    void migrate_pending(std::optional<std::chrono::milliseconds> budget = std::nullopt);
+
+    struct migration_progress {
+        int64_t migrated = 0;   // Messages moved so far
+        int64_t remaining = 0;  // Estimate of the messages still to move
+    };
+
+    // Returns online migration progress, or nullopt if there is nothing (left) to migrate.
+    std::optional<migration_progress> get_migration_progress();
+
     // Return the total number of messages stored
     int64_t get_message_count();
 
@@ -85,6 +569,9 @@ class Database {
     // Returns the number of used bytes (i.e. used pages * page size) of the database
     int64_t get_used_bytes();
 
+    // Returns payload segment statistics, summed across all shards.
+    SegmentStore::stats get_segment_stats();
+
     // Get random message. Returns nullopt if there are no messages.
     std::optional<message> retrieve_random();
 
@@ -92,9 +579,37 @@ class Database {
     // pubkey or namespace!
     std::optional<message> retrieve_by_hash(const std::string& msg_hash);
 
+    // Same as retrieve_by_hash, but only loads and returns the message's data, for answering
+    // storage tests.
+    std::optional<std::string> retrieve_payload(const std::string& msg_hash);
+
     // Removes expired messages from the database; the `Database` instance owner should call
-    // this periodically.
-    void clean_expired();
+    // this periodically.  Deletion happens in chunks of EXPIRY_CHUNK_SIZE, oldest expiries first.
+    // If `budget` is given then each shard stops deleting once it has spent that long, leaving
+    // the rest for the next call.  Shards that finish also compact their payload segments and,
+    // with eviction enabled, evict messages if they are getting full (see db_eviction) within
+    // what is left of the budget.
+    void clean_expired(std::optional<std::chrono::milliseconds> budget = std::nullopt);
+
+    struct expiry_stats {
+        int64_t passes = 0;      // clean_expired() calls
+        int64_t deleted = 0;     // Expired messages deleted
+        int64_t evicted = 0;     // Unexpired messages evicted to make room (see db_eviction)
+        int64_t over_quota = 0;  // ... of which were from accounts over the quota
+        int64_t incomplete = 0;  // Calls that ran out of time budget before finishing
+        int64_t last_deleted = 0;
+        std::chrono::microseconds last_duration{0};
+        std::chrono::microseconds max_duration{0};
+        std::chrono::microseconds total_duration{0};
+    };
+
+    // Returns statistics about expired message cleanup.
+    expiry_stats get_expiry_stats();
+
+    // Returns the total time the calling thread has spent in the Database calls that handle client
+    // requests (store, retrieve, the delete and expiry updates, etc.), so that the difference
+    // across some piece of work gives the database time of that work.
+    static std::chrono::steady_clock::duration thread_time();
 
     // Deletes all messages owned by the given pubkey.  Returns the [namespace, hash] pairs of any
     // deleted messages.
@@ -125,25 +640,30 @@ class Database {
     void revoke_subkey(
             const user_pubkey_t& pubkey, const std::array<unsigned char, 32>& revoke_subkey);
 
-    // Checks if a subkey exists in the revoked subkey database. True if exists and has been revoked
+    // Checks if a subkey exists in the revoked subkey database. True if exists and has been revoked.
+    // Subkeys that have never been revoked are answered from memory without a database query.
     bool subkey_revoked(const std::array<unsigned char, 32>& revoke_subkey);
 
     // Updates the expiry time of the given messages owned by the given pubkey.  Returns a vector of
     // hashes of updated messages (i.e. hashes that don't exist, or were not updated, are not
-    // returned).
+    // returned).  Messages already expiring at new_exp count as updated without being rewritten.
     //
     // extend_only and shorten_only allow message expiries to only be adjusted in one way or the
-    // other.  They are mutually exclusive.
+    // other.  They are mutually exclusive.  If `unchanged` is given it gets the current expiries
+    // of the messages that exist but were not updated, either because of them or because they
+    // already expire within EXPIRY_TOLERANCE before new_exp.
     std::vector<std::string> update_expiry(
             const user_pubkey_t& pubkey,
             const std::vector<std::string>& msg_hashes,
             std::chrono::system_clock::time_point new_exp,
             bool extend_only = false,
-            bool shorten_only = false);
+            bool shorten_only = false,
+            std::map<std::string, int64_t>* unchanged = nullptr);
 
     // Shortens the expiry time of all messages owned by the given pubkey.  Expiries can only be
     // shortened (i.e. brought closer to now), not extended into the future.  Returns a vector of
-    // [namespace, hash] pairs of messages that had their expiries shortened.
+    // [namespace, hash] pairs of messages that had their expiries shortened.  Accounts with nothing
+    // to shorten are answered without a write.
     std::vector<std::pair<namespace_id, std::string>> update_all_expiries(
             const user_pubkey_t& pubkey, std::chrono::system_clock::time_point new_exp);
 
@@ -159,6 +679,10 @@ class Database {
     // found are not included).
     std::map<std::string, int64_t> get_expiries(
             const user_pubkey_t& pubkey, const std::vector<std::string>& msg_hashes);
+
+  private:
+    std::mutex expiry_stats_mutex;
+    expiry_stats expiry_stats_;
 };
 
 }  // namespace oxen
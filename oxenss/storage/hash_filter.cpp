@@ -0,0 +1,70 @@
+#include "hash_filter.hpp"
+
+#include <algorithm>
+#include <functional>
+
+namespace oxen {
+
+HashFilter::HashFilter(size_t capacity) : capacity_{std::max(capacity, MIN_CAPACITY)} {
+    size_t counters = 16;
+    while (counters < capacity_ * COUNTERS_PER_ENTRY)
+        counters <<= 1;
+    mask_ = counters - 1;
+    words_ = std::make_unique<std::atomic<uint64_t>[]>(counters / 16);
+    for (size_t i = 0; i < counters / 16; i++)
+        words_[i].store(0, std::memory_order_relaxed);
+}
+
+template <typename F>
+void HashFilter::probes(std::string_view hash, F&& f) const {
+    // Double hashing: probe i looks at counter h1 + i*h2.  Message hashes are already random, but
+    // we get given arbitrary strings too, so we still hash them properly.
+    uint64_t h1 = std::hash<std::string_view>{}(hash);
+    // splitmix64 finalizer, for a second, independent-enough value
+    uint64_t h2 = h1 + 0x9e3779b97f4a7c15;
+    h2 = (h2 ^ (h2 >> 30)) * 0xbf58476d1ce4e5b9;
+    h2 = (h2 ^ (h2 >> 27)) * 0x94d049bb133111eb;
+    h2 = (h2 ^ (h2 >> 31)) | 1;
+    for (int i = 0; i < PROBES; i++) {
+        auto counter = (h1 + i * h2) & mask_;
+        f(words_[counter / 16], (counter % 16) * 4);
+    }
+}
+
+void HashFilter::add(std::string_view hash) {
+    probes(hash, [](std::atomic<uint64_t>& word, unsigned shift) {
+        auto w = word.load(std::memory_order_relaxed);
+        while ((w >> shift & COUNTER_MAX) != COUNTER_MAX &&
+               !word.compare_exchange_weak(
+                       w, w + (uint64_t{1} << shift), std::memory_order_release))
+            ;
+    });
+    entries_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void HashFilter::remove(std::string_view hash) {
+    probes(hash, [](std::atomic<uint64_t>& word, unsigned shift) {
+        auto w = word.load(std::memory_order_relaxed);
+        while (true) {
+            auto c = w >> shift & COUNTER_MAX;
+            // A saturated counter has to stay that way; 0 would mean a remove without an add.
+            if (c == COUNTER_MAX || c == 0)
+                break;
+            if (word.compare_exchange_weak(
+                        w, w - (uint64_t{1} << shift), std::memory_order_release))
+                break;
+        }
+    });
+    entries_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+bool HashFilter::maybe_contains(std::string_view hash) const {
+    bool found = true;
+    probes(hash, [&found](const std::atomic<uint64_t>& word, unsigned shift) {
+        if (found && (word.load(std::memory_order_acquire) >> shift & COUNTER_MAX) == 0)
+            found = false;
+    });
+    return found;
+}
+
+}  // namespace oxen
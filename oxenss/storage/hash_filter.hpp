@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+namespace oxen {
+
+// Counting Bloom filter of the message hashes stored in a database, used to answer the requests
+// that name messages by hash (deletes, expiry updates and lookups) without a query when none of
+// the given hashes are stored, as is often the case for hashes of messages that have long since
+// expired or been deleted.  `maybe_contains` never gives false negatives for hashes that have
+// been added (and not since removed); false positives just mean an unnecessary query.
+//
+// Each hash sets PROBES of the filter's 4-bit counters, of which there are COUNTERS_PER_ENTRY for
+// each hash the filter was sized for: at that capacity about 2.4% of absent hashes get through.
+// A counter that reaches its maximum stays there (removals can no longer tell whether it should
+// go down), so saturation only costs accuracy, never correctness.
+//
+// All methods are thread-safe and lock-free.
+class HashFilter {
+  public:
+    static constexpr size_t COUNTERS_PER_ENTRY = 8;
+    static constexpr int PROBES = 4;
+
+    // Smallest capacity we make a filter with.
+    static constexpr size_t MIN_CAPACITY = 1 << 16;
+
+    // Creates an empty filter sized for (at least) `capacity` hashes.
+    explicit HashFilter(size_t capacity);
+
+    void add(std::string_view hash);
+
+    // Removes a hash; must only be given hashes that were added.
+    void remove(std::string_view hash);
+
+    // Returns false if `hash` definitely hasn't been added; true if it (probably) has.
+    bool maybe_contains(std::string_view hash) const;
+
+    // Number of hashes currently added (i.e. added minus removed).
+    int64_t entries() const { return entries_.load(std::memory_order_relaxed); }
+
+    // Number of hashes the filter is sized for.
+    size_t capacity() const { return capacity_; }
+
+    // Memory used by the counters, in bytes.
+    size_t bytes() const { return (mask_ + 1) / 2; }
+
+  private:
+    static constexpr uint64_t COUNTER_MAX = 15;
+
+    // Calls `f(word, shift)` for the counter of each of the hash's probes.
+    template <typename F>
+    void probes(std::string_view hash, F&& f) const;
+
+    size_t capacity_;
+    size_t mask_;  // Number of counters, minus one
+    std::unique_ptr<std::atomic<uint64_t>[]> words_;  // 16 counters per word
+    std::atomic<int64_t> entries_{0};
+};
+
+}  // namespace oxen
@@ -0,0 +1,247 @@
+#include "journal.hpp"
+#include "oxenss/logging/oxen_logger.h"
+#include "oxenss/utils/time.hpp"
+
+#include <oxenc/endian.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace oxen {
+
+static auto logcat = log::Cat("db");
+
+namespace {
+    [[noreturn]] void throw_errno(std::string_view what, const std::filesystem::path& p) {
+        throw std::runtime_error{
+                fmt::format("Failed to {} {}: {}", what, p.u8string(), std::strerror(errno))};
+    }
+
+    // Record format (all integers little-endian):
+    //
+    //     u32 body size | u64 checksum | body
+    //
+    // where the body is `u8 type | u8 N | N bytes pubkey | u16 N | N bytes hash | i16 namespace |
+    // i64 timestamp | i64 expiry | u32 N | N bytes data`.
+    constexpr size_t HEADER_SIZE = 4 + 8;
+
+    // FNV-1a.  This only has to catch records that didn't make it to disk in full, not tampering.
+    uint64_t checksum(std::string_view data) {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (unsigned char c : data) {
+            h ^= c;
+            h *= 0x100000001b3ULL;
+        }
+        return h;
+    }
+
+    template <typename T>
+    void append_int(std::string& out, T val) {
+        oxenc::host_to_little_inplace(val);
+        out.append(reinterpret_cast<const char*>(&val), sizeof(val));
+    }
+
+    template <typename T>
+    void overwrite_int(std::string& out, size_t pos, T val) {
+        oxenc::host_to_little_inplace(val);
+        std::memcpy(out.data() + pos, &val, sizeof(val));
+    }
+
+    template <typename Size>
+    void append_string(std::string& out, std::string_view s) {
+        if (s.size() > std::numeric_limits<Size>::max())
+            throw std::invalid_argument{"Value too large for an ingest journal record"};
+        append_int(out, static_cast<Size>(s.size()));
+        out += s;
+    }
+
+    // Consumes values from the front of a record body; every read returns false (rather than
+    // throwing) if the body runs out, since a short body just means a corrupt record.
+    struct record_reader {
+        std::string_view data;
+
+        bool take(size_t n, std::string_view& out) {
+            if (data.size() < n)
+                return false;
+            out = data.substr(0, n);
+            data.remove_prefix(n);
+            return true;
+        }
+
+        template <typename T>
+        bool integer(T& val) {
+            std::string_view bytes;
+            if (!take(sizeof(T), bytes))
+                return false;
+            std::memcpy(&val, bytes.data(), sizeof(T));
+            oxenc::little_to_host_inplace(val);
+            return true;
+        }
+
+        template <typename Size>
+        bool string(std::string_view& out) {
+            Size n;
+            return integer(n) && take(n, out);
+        }
+    };
+}  // namespace
+
+IngestJournal::IngestJournal(std::filesystem::path path) : path_{std::move(path)} {
+    fd_ = ::open(path_.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd_ < 0)
+        throw_errno("open ingest journal", path_);
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+        close(fd_);
+        throw_errno("stat ingest journal", path_);
+    }
+    size_ = st.st_size;
+}
+
+IngestJournal::~IngestJournal() {
+    if (fd_ >= 0)
+        close(fd_);
+}
+
+size_t IngestJournal::replay(const std::function<void(const record& r)>& f) {
+    std::lock_guard lock{mutex_};
+    std::string contents(static_cast<size_t>(size_), '\0');
+    size_t have = 0;
+    while (have < contents.size()) {
+        auto n = pread(fd_, contents.data() + have, contents.size() - have, have);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            throw_errno("read ingest journal", path_);
+        }
+        if (n == 0)
+            break;
+        have += n;
+    }
+    contents.resize(have);
+
+    size_t pos = 0, count = 0;
+    while (true) {
+        record_reader header{std::string_view{contents}.substr(pos)};
+        uint32_t body_size;
+        uint64_t sum;
+        std::string_view body;
+        if (!header.integer(body_size) || !header.integer(sum) || !header.take(body_size, body) ||
+            checksum(body) != sum)
+            break;
+
+        record_reader r{body};
+        record rec;
+        int16_t ns;
+        if (!r.integer(rec.type) || !r.string<uint8_t>(rec.pubkey) ||
+            !r.string<uint16_t>(rec.hash) || !r.integer(ns) || !r.integer(rec.timestamp) ||
+            !r.integer(rec.expiry) || !r.string<uint32_t>(rec.data) || !r.data.empty())
+            break;
+        rec.ns = static_cast<namespace_id>(ns);
+        f(rec);
+        count++;
+        pos += HEADER_SIZE + body_size;
+    }
+
+    if (pos < contents.size()) {
+        log::warning(
+                logcat,
+                "Discarding {} bytes of incomplete records at the end of {}",
+                contents.size() - pos,
+                path_.u8string());
+        if (ftruncate(fd_, static_cast<off_t>(pos)) != 0)
+            throw_errno("truncate ingest journal", path_);
+    }
+    size_ = static_cast<int64_t>(pos);
+    return count;
+}
+
+uint64_t IngestJournal::append(const message& msg) {
+    std::string rec(HEADER_SIZE, '\0');
+    append_int(rec, static_cast<uint8_t>(msg.pubkey.type()));
+    append_string<uint8_t>(rec, msg.pubkey.raw());
+    append_string<uint16_t>(rec, msg.hash);
+    append_int(rec, to_int(msg.msg_namespace));
+    append_int(rec, to_epoch_ms(msg.timestamp));
+    append_int(rec, to_epoch_ms(msg.expiry));
+    append_string<uint32_t>(rec, msg.data);
+    std::string_view body{rec};
+    body.remove_prefix(HEADER_SIZE);
+    overwrite_int(rec, 0, static_cast<uint32_t>(body.size()));
+    overwrite_int(rec, 4, checksum(body));
+
+    std::lock_guard lock{mutex_};
+    size_t done = 0;
+    while (done < rec.size()) {
+        auto n = ::write(fd_, rec.data() + done, rec.size() - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            // Cut off whatever part of the record did get written, so that it doesn't end up in
+            // front of later records.
+            int err = errno;
+            if (done > 0 && ftruncate(fd_, static_cast<off_t>(size_)) != 0)
+                log::error(logcat, "Failed to remove partial journal record");
+            errno = err;
+            throw_errno("write ingest journal", path_);
+        }
+        done += n;
+    }
+    size_ += static_cast<int64_t>(rec.size());
+    stats_.appended++;
+    return ++written_;
+}
+
+void IngestJournal::sync(uint64_t seq) {
+    std::unique_lock lock{mutex_};
+    while (synced_ < seq) {
+        if (syncing_) {
+            sync_cv_.wait(lock);
+            continue;
+        }
+        syncing_ = true;
+        auto target = written_;
+        lock.unlock();
+        int rc = fdatasync(fd_);
+        int err = errno;
+        lock.lock();
+        syncing_ = false;
+        sync_cv_.notify_all();
+        if (rc != 0) {
+            errno = err;
+            throw_errno("sync ingest journal", path_);
+        }
+        synced_ = std::max(synced_, target);
+        stats_.syncs++;
+    }
+}
+
+void IngestJournal::truncate() {
+    std::unique_lock lock{mutex_};
+    sync_cv_.wait(lock, [this] { return !syncing_; });
+    if (ftruncate(fd_, 0) != 0)
+        throw_errno("truncate ingest journal", path_);
+    size_ = 0;
+    synced_ = written_;
+    stats_.truncations++;
+}
+
+int64_t IngestJournal::size() const {
+    std::lock_guard lock{mutex_};
+    return size_;
+}
+
+IngestJournal::stats IngestJournal::get_stats() const {
+    std::lock_guard lock{mutex_};
+    return stats_;
+}
+
+}  // namespace oxen
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <oxenss/common/message.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <string_view>
+
+namespace oxen {
+
+// Append-only log of accepted message stores, kept next to a database file, so that a store can be
+// acknowledged as soon as its record is on disk rather than once sqlite3 has committed it into the
+// database (which can stall behind checkpoints and B-tree maintenance).  The owner moves the
+// journaled messages into the database in the background and empties the journal once everything
+// in it is safely there; after a crash, whatever is still in the journal gets replayed (see
+// db_tuning::ingest_journal).
+//
+// Each record is a u32 length and a u64 checksum of the record body, followed by the body (the
+// message's fields), all little-endian.  Replay stops at the first record that is incomplete or
+// doesn't match its checksum, i.e. at the unsynced tail left by a crash.
+//
+// Concurrent appends share their fdatasync calls: each waits for a sync that started after its own
+// write, and whoever finds no sync running starts one covering everything written so far.  All
+// methods are thread-safe.
+class IngestJournal {
+  public:
+    // Opens the journal file, creating it if it doesn't exist.  Throws on I/O errors.
+    explicit IngestJournal(std::filesystem::path path);
+    ~IngestJournal();
+
+    IngestJournal(const IngestJournal&) = delete;
+    IngestJournal& operator=(const IngestJournal&) = delete;
+
+    // A message as read back by replay().  The views are only valid during the callback.
+    struct record {
+        uint8_t type;
+        std::string_view pubkey;
+        std::string_view hash;
+        namespace_id ns;
+        int64_t timestamp;  // Milliseconds since the epoch
+        int64_t expiry;     // Milliseconds since the epoch
+        std::string_view data;
+    };
+
+    // Invokes `f` with each intact record in the journal, in the order they were appended, then
+    // cuts off anything after them so that new records don't end up behind a torn one.  Returns the
+    // number of records replayed.  Throws on I/O errors.
+    size_t replay(const std::function<void(const record& r)>& f);
+
+    // Writes a record of `msg` to the end of the journal, returning its sequence number for
+    // sync().  Throws on I/O errors.
+    uint64_t append(const message& msg);
+
+    // Waits until the record with the given sequence number, and everything before it, has been
+    // fdatasync'd.  Throws on I/O errors.
+    void sync(uint64_t seq);
+
+    // Empties the journal.  The caller must make sure that everything in it is safely in the
+    // database first (i.e. committed *and* synced to disk).
+    void truncate();
+
+    // Returns the current size of the journal file, in bytes.
+    int64_t size() const;
+
+    struct stats {
+        int64_t appended = 0;     // Records appended since startup
+        int64_t syncs = 0;        // fdatasync calls made for them
+        int64_t truncations = 0;  // Times the journal was emptied
+    };
+
+    stats get_stats() const;
+
+  private:
+    const std::filesystem::path path_;
+    int fd_ = -1;
+
+    mutable std::mutex mutex_;
+    std::condition_variable sync_cv_;
+    int64_t size_ = 0;
+    uint64_t written_ = 0;  // Sequence number of the last record written
+    uint64_t synced_ = 0;   // Sequence number of the last record known to be on disk
+    bool syncing_ = false;
+    stats stats_;
+};
+
+}  // namespace oxen
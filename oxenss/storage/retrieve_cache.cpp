@@ -0,0 +1,184 @@
+#include "retrieve_cache.hpp"
+
+#include <algorithm>
+
+namespace oxen {
+
+RetrieveCache::RetrieveCache(size_t max_accounts, size_t max_bytes) :
+        max_accounts_{max_accounts}, max_bytes_{max_bytes} {}
+
+RetrieveCache::entry* RetrieveCache::find_entry(account& a, namespace_id ns) {
+    for (auto& e : a.namespaces)
+        if (e.ns == ns)
+            return &e;
+    return nullptr;
+}
+
+std::optional<std::vector<shared_message>> RetrieveCache::find(
+        const user_pubkey_t& pubkey,
+        namespace_id ns,
+        std::string_view last_hash,
+        std::chrono::system_clock::time_point now) {
+    std::lock_guard lock{mutex_};
+    auto it = accounts_.find(pubkey);
+    entry* e = it != accounts_.end() ? find_entry(it->second, ns) : nullptr;
+    if (!e) {
+        stats_.misses++;
+        return std::nullopt;
+    }
+
+    // Index of the first recent message to return, if we can answer
+    std::optional<size_t> start;
+    bool expired = false;
+    if (!last_hash.empty()) {
+        for (size_t i = e->recent.size(); i-- > 0;) {
+            if (e->recent[i]->hash == last_hash) {
+                expired = e->recent[i]->expiry <= now;
+                start = i + 1;
+                break;
+            }
+        }
+        if (!start && e->before && e->before->hash == last_hash) {
+            expired = e->before->expiry <= now;
+            start = 0;
+        }
+    }
+    // Otherwise the database would return everything from the beginning, which we only have if
+    // there's nothing before the recent messages.
+    if (!start && !expired && !e->before)
+        start = 0;
+
+    // An expired starting point may already be gone from the database, in which case the
+    // database would give back everything rather than what follows it.
+    if (!start || expired) {
+        stats_.misses++;
+        return std::nullopt;
+    }
+
+    stats_.hits++;
+    lru_.splice(lru_.begin(), lru_, it->second.lru_it);
+    std::vector<shared_message> result;
+    for (size_t i = *start; i < e->recent.size(); i++)
+        if (e->recent[i]->expiry > now)
+            result.push_back(e->recent[i]);
+    return result;
+}
+
+uint64_t RetrieveCache::fill_token() const {
+    std::lock_guard lock{mutex_};
+    return generation_;
+}
+
+uint64_t RetrieveCache::account_token(const user_pubkey_t& pubkey) const {
+    return account_generation(pubkey).load(std::memory_order_acquire);
+}
+
+void RetrieveCache::fill(
+        uint64_t token,
+        const user_pubkey_t& pubkey,
+        namespace_id ns,
+        std::optional<anchor> before,
+        std::vector<message> recent) {
+    std::lock_guard lock{mutex_};
+    if (token != generation_ || recent.size() > RECENT_MESSAGES)
+        return;
+
+    auto [it, inserted] = accounts_.try_emplace(pubkey);
+    auto& a = it->second;
+    if (inserted) {
+        lru_.push_front(pubkey);
+        a.lru_it = lru_.begin();
+    } else {
+        lru_.splice(lru_.begin(), lru_, a.lru_it);
+    }
+
+    entry* e = find_entry(a, ns);
+    if (e) {
+        for (auto& m : e->recent) {
+            a.bytes -= size_of(*m);
+            bytes_ -= size_of(*m);
+        }
+        e->recent.clear();
+    } else {
+        e = &a.namespaces.emplace_back();
+        e->ns = ns;
+    }
+    e->before = std::move(before);
+    for (auto& m : recent) {
+        m.pubkey = {};
+        a.bytes += size_of(m);
+        bytes_ += size_of(m);
+        e->recent.push_back(std::make_shared<const message>(std::move(m)));
+    }
+    stats_.fills++;
+    evict();
+}
+
+void RetrieveCache::inserted(const message& msg, const shared_message& shared) {
+    std::lock_guard lock{mutex_};
+    generation_++;
+    account_generation(msg.pubkey).fetch_add(1, std::memory_order_release);
+    auto it = accounts_.find(msg.pubkey);
+    if (it == accounts_.end())
+        return;
+    auto& a = it->second;
+    entry* e = find_entry(a, msg.msg_namespace);
+    // A fill from a concurrent retrieve can already include the message
+    if (!e || (e->before && e->before->hash == msg.hash) ||
+        std::any_of(e->recent.begin(), e->recent.end(), [&](const shared_message& m) {
+            return m->hash == msg.hash;
+        }))
+        return;
+
+    auto& m = e->recent.emplace_back(
+            shared ? shared
+                   : std::make_shared<const message>(
+                             msg.hash, msg.msg_namespace, msg.timestamp, msg.expiry, msg.data));
+    a.bytes += size_of(*m);
+    bytes_ += size_of(*m);
+    if (e->recent.size() > RECENT_MESSAGES) {
+        auto& oldest = *e->recent.front();
+        a.bytes -= size_of(oldest);
+        bytes_ -= size_of(oldest);
+        e->before = anchor{oldest.hash, oldest.expiry};
+        e->recent.pop_front();
+    }
+    evict();
+}
+
+void RetrieveCache::invalidate(const user_pubkey_t& pubkey) {
+    std::lock_guard lock{mutex_};
+    generation_++;
+    account_generation(pubkey).fetch_add(1, std::memory_order_release);
+    auto it = accounts_.find(pubkey);
+    if (it == accounts_.end())
+        return;
+    bytes_ -= it->second.bytes;
+    lru_.erase(it->second.lru_it);
+    accounts_.erase(it);
+    stats_.invalidations++;
+}
+
+void RetrieveCache::touch(const user_pubkey_t& pubkey) {
+    account_generation(pubkey).fetch_add(1, std::memory_order_release);
+}
+
+void RetrieveCache::evict() {
+    while (!lru_.empty() && (accounts_.size() > max_accounts_ || bytes_ > max_bytes_)) {
+        auto it = accounts_.find(lru_.back());
+        bytes_ -= it->second.bytes;
+        accounts_.erase(it);
+        lru_.pop_back();
+        stats_.evictions++;
+    }
+}
+
+RetrieveCache::stats RetrieveCache::get_stats() const {
+    std::lock_guard lock{mutex_};
+    auto s = stats_;
+    s.accounts = accounts_.size();
+    s.bytes = bytes_;
+    return s;
+}
+
+}  // namespace oxen
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <oxenss/common/message.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace oxen {
+
+// In-memory cache of the newest messages of recently polled accounts, used to answer retrieves
+// (most of which are clients polling for messages newer than the last one they already have, and
+// getting nothing back) without going to the database.
+//
+// For each cached (account, namespace) we keep up to RECENT_MESSAGES of the namespace's newest
+// messages, plus the hash and expiry of the message just before them (the "anchor").  Without an
+// anchor the recent messages are *all* of the namespace's messages.  A retrieve can be answered
+// from the cache if its last hash is one of these (or, without an anchor, is anything at all);
+// otherwise the caller falls back to the database and hands us what it found via fill().
+//
+// The owner must keep the cache in sync with the database: inserted() for every newly stored
+// message (in insertion order), and invalidate() after anything else that could remove or change
+// an account's messages.  Expired messages need no notification: they are simply skipped (and
+// never used as a retrieve's starting point), since expiry cleanup may have removed them.
+//
+// All methods are thread-safe.
+class RetrieveCache {
+  public:
+    // How many of each namespace's newest messages we keep.
+    static constexpr size_t RECENT_MESSAGES = 4;
+
+    // Default limits on how many accounts, and how many bytes of message hashes and data, we keep
+    // before dropping the least recently used accounts.
+    static constexpr size_t DEFAULT_MAX_ACCOUNTS = 10'000;
+    static constexpr size_t DEFAULT_MAX_BYTES = 32 * 1024 * 1024;
+
+    explicit RetrieveCache(
+            size_t max_accounts = DEFAULT_MAX_ACCOUNTS, size_t max_bytes = DEFAULT_MAX_BYTES);
+
+    // Hash and expiry of the message preceding the cached recent messages
+    struct anchor {
+        std::string hash;
+        std::chrono::system_clock::time_point expiry;
+    };
+
+    // Returns the unexpired messages of `ns` that follow `last_hash` (or all of them, if
+    // `last_hash` is empty or not a message of the namespace), oldest first, or nullopt if the
+    // cache can't answer.  The returned messages are shared with the cache, so this doesn't copy
+    // their payloads; their pubkeys may be left default constructed.
+    std::optional<std::vector<shared_message>> find(
+            const user_pubkey_t& pubkey,
+            namespace_id ns,
+            std::string_view last_hash,
+            std::chrono::system_clock::time_point now = std::chrono::system_clock::now());
+
+    // Returns a token to obtain before querying the database for something to pass to fill().
+    uint64_t fill_token() const;
+
+    // Caches the result of a database lookup of `ns`'s newest messages: `recent` (oldest first,
+    // at most RECENT_MESSAGES) are the newest messages and `before` the one preceding them, or
+    // nullopt if there is none.  Ignored if the cache was changed in any way since `token` was
+    // obtained, as the lookup may then have missed the change.
+    void fill(
+            uint64_t token,
+            const user_pubkey_t& pubkey,
+            namespace_id ns,
+            std::optional<anchor> before,
+            std::vector<message> recent);
+
+    // Returns a value that changes whenever inserted() or invalidate() is called for `pubkey`
+    // (and, rarely, for some other account).  Unlike fill_token() this is unaffected by changes to
+    // most other accounts, so it can tell whether a particular account might have changed.
+    uint64_t account_token(const user_pubkey_t& pubkey) const;
+
+    // Records a newly stored message.  If `shared` (which must hold `msg`) is given then the cache
+    // keeps a reference to it rather than a copy of the message.
+    void inserted(const message& msg, const shared_message& shared = nullptr);
+
+    // Drops everything cached for the given account.
+    void invalidate(const user_pubkey_t& pubkey);
+
+    // Changes the account's token (see account_token()) without touching anything cached, for a
+    // change that will reach the cache later through inserted() or invalidate(), such as a store
+    // that has only been journaled so far.
+    void touch(const user_pubkey_t& pubkey);
+
+    struct stats {
+        int64_t hits = 0;           // Retrieves answered from the cache
+        int64_t misses = 0;         // Retrieves that had to go to the database
+        int64_t fills = 0;          // Database results added to the cache
+        int64_t invalidations = 0;  // Accounts dropped because of a change
+        int64_t evictions = 0;      // Accounts dropped to make room
+        int64_t accounts = 0;       // Accounts currently cached
+        int64_t bytes = 0;          // Size of the currently cached message hashes and data
+    };
+
+    stats get_stats() const;
+
+  private:
+    struct entry {
+        namespace_id ns;
+        std::optional<anchor> before;
+        std::deque<shared_message> recent;  // Oldest first
+    };
+
+    struct account {
+        std::vector<entry> namespaces;
+        size_t bytes = 0;
+        std::list<user_pubkey_t>::iterator lru_it;
+    };
+
+    const size_t max_accounts_, max_bytes_;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<user_pubkey_t, account> accounts_;
+    std::list<user_pubkey_t> lru_;  // Most recently used at the front
+    size_t bytes_ = 0;
+    // Incremented by every change; see fill_token().
+    uint64_t generation_ = 0;
+    // Per-account change counters (see account_token()), shared by accounts with the same hash
+    // modulo their count.
+    mutable std::array<std::atomic<uint64_t>, 256> account_generations_{};
+    stats stats_;
+
+    static size_t size_of(const message& m) { return m.hash.size() + m.data.size(); }
+
+    entry* find_entry(account& a, namespace_id ns);
+
+    std::atomic<uint64_t>& account_generation(const user_pubkey_t& pubkey) const {
+        return account_generations_
+                [std::hash<user_pubkey_t>{}(pubkey) % account_generations_.size()];
+    }
+
+    // Drops least recently used accounts until we are within our limits.  Called with the lock
+    // held.
+    void evict();
+};
+
+}  // namespace oxen
@@ -0,0 +1,202 @@
+#include "segments.hpp"
+#include "oxenss/logging/oxen_logger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace oxen {
+
+static auto logcat = log::Cat("db");
+
+struct SegmentStore::mapping {
+    const char* addr = nullptr;
+    size_t len = 0;
+
+    mapping(const char* addr, size_t len) : addr{addr}, len{len} {}
+    mapping(const mapping&) = delete;
+    mapping& operator=(const mapping&) = delete;
+    ~mapping() { munmap(const_cast<char*>(addr), len); }
+};
+
+namespace {
+    [[noreturn]] void throw_errno(std::string_view what, const std::filesystem::path& p) {
+        throw std::runtime_error{
+                fmt::format("Failed to {} {}: {}", what, p.u8string(), std::strerror(errno))};
+    }
+}  // namespace
+
+SegmentStore::SegmentStore(std::filesystem::path dir, int64_t size_limit) :
+        dir_{std::move(dir)}, size_limit_{size_limit} {
+    std::error_code ec;
+    if (!std::filesystem::is_directory(dir_, ec))
+        return;
+
+    std::lock_guard lock{mutex_};
+    for (const auto& entry : std::filesystem::directory_iterator{dir_}) {
+        auto name = entry.path().filename().u8string();
+        int64_t id;
+        auto [end, err] = std::from_chars(name.data(), name.data() + name.size(), id);
+        if (err != std::errc{} || std::string_view{end} != ".seg" || !entry.is_regular_file())
+            continue;
+        auto seg = open(id, false);
+        close(seg.fd);
+        seg.fd = -1;
+        total_ += seg.size;
+        segments_.emplace(id, std::move(seg));
+    }
+    // Everything we found is sealed: we always start a new segment rather than appending to one
+    // from a previous run.
+    if (!segments_.empty())
+        current_ = segments_.rbegin()->first + 1;
+    log::info(
+            logcat,
+            "Loaded {} payload segments ({} bytes) from {}",
+            segments_.size(),
+            total_,
+            dir_.u8string());
+}
+
+SegmentStore::~SegmentStore() {
+    for (auto& [id, seg] : segments_)
+        if (seg.fd >= 0)
+            close(seg.fd);
+}
+
+std::filesystem::path SegmentStore::path(int64_t segment) const {
+    return dir_ / (std::to_string(segment) + ".seg");
+}
+
+SegmentStore::segment SegmentStore::open(int64_t id, bool create) {
+    auto p = path(id);
+    int fd = ::open(p.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0600);
+    if (fd < 0)
+        throw_errno("open payload segment", p);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw_errno("stat payload segment", p);
+    }
+    segment seg;
+    seg.fd = fd;
+    seg.size = st.st_size;
+    // We map the full segment size even though the file is (usually) smaller, so that the same
+    // mapping covers whatever gets appended later.  Only the part within the file ever gets read.
+    auto len = static_cast<size_t>(std::max<int64_t>(SEGMENT_SIZE, seg.size));
+    void* addr = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        close(fd);
+        throw_errno("map payload segment", p);
+    }
+    seg.map = std::make_shared<const mapping>(static_cast<const char*>(addr), len);
+    return seg;
+}
+
+std::optional<segment_ref> SegmentStore::append(std::string_view data) {
+    if (static_cast<int64_t>(data.size()) >= SEGMENT_SIZE)
+        throw std::invalid_argument{"Payload too large for a segment"};
+
+    std::lock_guard lock{mutex_};
+    if (total_ + static_cast<int64_t>(data.size()) > size_limit_)
+        return std::nullopt;
+
+    auto it = segments_.find(current_);
+    if (it != segments_.end() &&
+        it->second.size + static_cast<int64_t>(data.size()) > SEGMENT_SIZE) {
+        // Seal the current segment
+        fdatasync(it->second.fd);
+        close(it->second.fd);
+        it->second.fd = -1;
+        it = segments_.end();
+        current_++;
+    }
+    if (it == segments_.end()) {
+        std::filesystem::create_directories(dir_);
+        it = segments_.emplace(current_, open(current_, true)).first;
+    }
+
+    auto& seg = it->second;
+    segment_ref ref{current_, seg.size, static_cast<int64_t>(data.size())};
+    size_t written = 0;
+    while (written < data.size()) {
+        auto n = pwrite(
+                seg.fd, data.data() + written, data.size() - written, seg.size + written);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            throw_errno("write payload segment", path(current_));
+        }
+        written += n;
+    }
+    seg.size += ref.size;
+    total_ += ref.size;
+    stats_.appended++;
+    return ref;
+}
+
+void SegmentStore::sync() {
+    std::lock_guard lock{mutex_};
+    auto it = segments_.find(current_);
+    if (it == segments_.end() || it->second.fd < 0)
+        return;
+    if (fdatasync(it->second.fd) != 0)
+        throw_errno("sync payload segment", path(current_));
+}
+
+std::optional<SegmentStore::payload> SegmentStore::read(const segment_ref& ref) const {
+    std::lock_guard lock{mutex_};
+    auto it = segments_.find(ref.segment);
+    if (it == segments_.end() || ref.offset < 0 || ref.size < 0 ||
+        ref.offset + ref.size > it->second.size)
+        return std::nullopt;
+    auto& map = it->second.map;
+    return payload{map, std::string_view{map->addr + ref.offset, static_cast<size_t>(ref.size)}};
+}
+
+int64_t SegmentStore::size(int64_t segment) const {
+    std::lock_guard lock{mutex_};
+    auto it = segments_.find(segment);
+    return it != segments_.end() ? it->second.size : 0;
+}
+
+std::vector<std::pair<int64_t, int64_t>> SegmentStore::sealed() const {
+    std::vector<std::pair<int64_t, int64_t>> result;
+    std::lock_guard lock{mutex_};
+    for (const auto& [id, seg] : segments_)
+        if (id != current_)
+            result.emplace_back(id, seg.size);
+    return result;
+}
+
+void SegmentStore::remove(int64_t segment) {
+    std::lock_guard lock{mutex_};
+    auto it = segments_.find(segment);
+    if (it == segments_.end() || segment == current_)
+        return;
+    // The mapping stays valid (for anyone still holding it) after the file is gone
+    std::error_code ec;
+    std::filesystem::remove(path(segment), ec);
+    if (ec)
+        log::warning(logcat, "Failed to remove payload segment {}: {}", segment, ec.message());
+    total_ -= it->second.size;
+    segments_.erase(it);
+    stats_.removed++;
+}
+
+SegmentStore::stats SegmentStore::get_stats() const {
+    std::lock_guard lock{mutex_};
+    auto s = stats_;
+    s.segments = segments_.size();
+    s.bytes = total_;
+    return s;
+}
+
+}  // namespace oxen
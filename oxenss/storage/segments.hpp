@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace oxen {
+
+// Where a payload lives in a SegmentStore
+struct segment_ref {
+    int64_t segment;
+    int64_t offset;
+    int64_t size;
+};
+
+// Append-only store of message payloads, kept outside of the database in a directory of segment
+// files.  Payloads are appended to the current segment until it reaches SEGMENT_SIZE, at which
+// point it is sealed and a new one started.  Sealed segments are never written again: once enough
+// of a segment's payloads are gone the owner copies the remaining ones elsewhere and removes the
+// segment (see Database::clean_expired).
+//
+// Segments are memory-mapped, so reads hand out views of the mapped file rather than copies; a
+// read keeps its segment mapped (even if the segment gets removed in the meantime) for as long as
+// the returned payload is held.
+//
+// The directory only gets created once something is appended.  All methods are thread-safe.
+class SegmentStore {
+  public:
+    // Size at which we seal a segment and start a new one.  Payloads must be smaller than this.
+    static constexpr int64_t SEGMENT_SIZE = 64 * 1024 * 1024;
+
+    // `size_limit` bounds the total size of all segments; appends fail once it would be exceeded.
+    SegmentStore(std::filesystem::path dir, int64_t size_limit);
+    ~SegmentStore();
+
+    // Appends a payload, returning where it went, or nullopt if we have reached the size limit.
+    // Throws on I/O errors.
+    std::optional<segment_ref> append(std::string_view data);
+
+    // fdatasyncs the current segment, so that everything appended so far is on disk (sealed
+    // segments get synced when they are sealed).  Throws on I/O errors.
+    void sync();
+
+    struct mapping;
+
+    // A stored payload; `data` is valid for as long as this is held.
+    struct payload {
+        std::shared_ptr<const mapping> map;
+        std::string_view data;
+    };
+
+    // Returns the payload at the given location, or nullopt if there is no such segment or the
+    // location is beyond its end (e.g. because the tail of a segment got lost in a crash).
+    std::optional<payload> read(const segment_ref& ref) const;
+
+    // Returns the size of the given segment (0 if it doesn't exist).
+    int64_t size(int64_t segment) const;
+
+    // Returns the ids and sizes of all sealed segments.
+    std::vector<std::pair<int64_t, int64_t>> sealed() const;
+
+    // Removes a (sealed) segment.
+    void remove(int64_t segment);
+
+    struct stats {
+        int64_t segments = 0;
+        int64_t bytes = 0;     // Total size of all segments
+        int64_t appended = 0;  // Payloads appended since startup
+        int64_t removed = 0;   // Segments removed since startup
+    };
+
+    stats get_stats() const;
+
+  private:
+    struct segment {
+        std::shared_ptr<const mapping> map;
+        int fd = -1;  // Only kept open for the current, unsealed segment
+        int64_t size = 0;
+    };
+
+    const std::filesystem::path dir_;
+    const int64_t size_limit_;
+
+    mutable std::mutex mutex_;
+    std::map<int64_t, segment> segments_;
+    int64_t current_ = 0;  // Id of the segment we are appending to, if it exists
+    int64_t total_ = 0;
+    stats stats_;
+
+    std::filesystem::path path(int64_t segment) const;
+
+    // Opens (creating, if `create`) and maps a segment file.  Called with the lock held.
+    segment open(int64_t id, bool create);
+};
+
+}  // namespace oxen
@@ -0,0 +1,186 @@
+#include "affinity.hpp"
+#include "string_utils.hpp"
+
+#include <oxen/log.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <stdexcept>
+
+extern "C" {
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+}
+
+namespace oxen::util {
+
+static auto logcat = log::Cat("utils");
+
+namespace {
+    // Reads the first line of a (/proc or /sys) file, which report a size of 0 and so can't be
+    // read with slurp_file().  Returns nullopt if the file can't be opened.
+    std::optional<std::string> read_line(const std::filesystem::path& file) {
+        std::ifstream in{file};
+        std::string line;
+        if (!in || !std::getline(in, line))
+            return std::nullopt;
+        return line;
+    }
+
+    // The set a thread was last placed on by cpu_set::apply() (only ever compared against, as it
+    // may since have been destroyed), and whether that moved it off the default CPUs
+    thread_local const cpu_set* applied = nullptr;
+    thread_local bool restricted = false;
+
+#ifdef __linux__
+    // The CPUs threads get to run on by default, i.e. the ones the process started out with.
+    // Taken before the first thread gets placed anywhere else.
+    const ::cpu_set_t& default_mask() {
+        static const ::cpu_set_t mask = [] {
+            ::cpu_set_t m;
+            if (sched_getaffinity(0, sizeof(m), &m) != 0) {
+                CPU_ZERO(&m);
+                for (long cpu = 0, n = sysconf(_SC_NPROCESSORS_CONF); cpu < n && cpu < CPU_SETSIZE;
+                     cpu++)
+                    CPU_SET(cpu, &m);
+            }
+            return m;
+        }();
+        return mask;
+    }
+#endif
+}  // namespace
+
+cpu_set cpu_set::parse(std::string_view spec) {
+    auto invalid = [&spec](std::string_view why) {
+        return std::invalid_argument{fmt::format("Invalid CPU set '{}': {}", spec, why)};
+    };
+
+    std::string node_cpus;
+    if (starts_with(spec, "node")) {
+        unsigned node;
+        if (!parse_int(spec.substr(4), node))
+            throw invalid("expected a NUMA node number after 'node'");
+        auto list = read_line(fmt::format("/sys/devices/system/node/node{}/cpulist", node));
+        if (!list)
+            throw invalid("no such NUMA node");
+        node_cpus = std::move(*list);
+        spec = node_cpus;
+        trim(spec);
+    }
+
+    cpu_set set;
+    for (auto range : split(spec, ",")) {
+        trim(range);
+        if (range.empty())
+            throw invalid("empty CPU range");
+        auto dash = range.find('-');
+        int first, last;
+        if (!parse_int(range.substr(0, dash), first) ||
+            !parse_int(dash == std::string_view::npos ? range : range.substr(dash + 1), last))
+            throw invalid(fmt::format("bad CPU range '{}'", range));
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            throw invalid(fmt::format("bad CPU range '{}'", range));
+        for (int cpu = first; cpu <= last; cpu++)
+            set.cpus_.push_back(cpu);
+    }
+    std::sort(set.cpus_.begin(), set.cpus_.end());
+    set.cpus_.erase(std::unique(set.cpus_.begin(), set.cpus_.end()), set.cpus_.end());
+    if (set.cpus_.empty())
+        throw invalid("no CPUs");
+    return set;
+}
+
+std::string cpu_set::to_string() const {
+    std::vector<std::string> ranges;
+    for (size_t i = 0; i < cpus_.size();) {
+        size_t j = i;
+        while (j + 1 < cpus_.size() && cpus_[j + 1] == cpus_[j] + 1)
+            j++;
+        ranges.push_back(
+                j == i ? std::to_string(cpus_[i]) : fmt::format("{}-{}", cpus_[i], cpus_[j]));
+        i = j + 1;
+    }
+    return join(",", ranges);
+}
+
+void cpu_set::apply() const {
+    if (applied == this)
+        return;
+    applied = this;
+    // An empty set means the default placement, which is where a thread starts out
+    if (cpus_.empty() && !restricted)
+        return;
+    restricted = !cpus_.empty();
+#ifdef __linux__
+    const auto& defaults = default_mask();
+    ::cpu_set_t mask;
+    if (cpus_.empty())
+        mask = defaults;
+    else {
+        CPU_ZERO(&mask);
+        for (int cpu : cpus_)
+            CPU_SET(cpu, &mask);
+    }
+    if (int rc = pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask); rc != 0)
+        log::error(
+                logcat,
+                "Failed to restrict thread to CPUs {}: {}",
+                cpus_.empty() ? "(default)" : to_string(),
+                strerror(rc));
+#else
+    if (!cpus_.empty())
+        log::warning(logcat, "Restricting threads to CPUs isn't supported on this platform");
+#endif
+}
+
+void set_thread_name(const std::string& name) {
+#ifdef __linux__
+    pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+#else
+    (void)name;
+#endif
+}
+
+std::vector<thread_cpu_time> thread_cpu_times() {
+    std::vector<thread_cpu_time> threads;
+#ifdef __linux__
+    const long ticks = sysconf(_SC_CLK_TCK);
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator{"/proc/self/task", ec}) {
+        thread_cpu_time t;
+        if (!parse_int(entry.path().filename().native(), t.tid))
+            continue;
+        // The thread may have exited since we listed it
+        auto stat = read_line(entry.path() / "stat");
+        if (!stat)
+            continue;
+        // "TID (NAME) STATE PPID ...", where NAME can contain anything (including parentheses)
+        auto name_start = stat->find('('), name_end = stat->rfind(')');
+        if (name_start == std::string::npos || name_end == std::string::npos ||
+            name_end < name_start)
+            continue;
+        t.name = stat->substr(name_start + 1, name_end - name_start - 1);
+        // Fields after the name, counting from STATE (field 3): utime is 14, stime 15, and
+        // processor 39.
+        auto fields = split_any(std::string_view{*stat}.substr(name_end + 1), " ", true);
+        int64_t utime, stime;
+        if (fields.size() < 37 || !parse_int(fields[11], utime) ||
+            !parse_int(fields[12], stime) || !parse_int(fields[36], t.last_cpu))
+            continue;
+        t.user = std::chrono::milliseconds{utime * 1000 / ticks};
+        t.system = std::chrono::milliseconds{stime * 1000 / ticks};
+        threads.push_back(std::move(t));
+    }
+    std::sort(threads.begin(), threads.end(), [](const auto& a, const auto& b) {
+        return a.tid < b.tid;
+    });
+#endif
+    return threads;
+}
+
+}  // namespace oxen::util
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace oxen::util {
+
+// A set of CPUs for a group of threads to run on, to keep them from migrating across cores (and,
+// on multi-socket hosts, across NUMA nodes, which makes them lose their caches and work on memory
+// attached to the other socket).  An empty set places no restriction.
+class cpu_set {
+  public:
+    cpu_set() = default;
+
+    // Parses a CPU list as used by the kernel (e.g. "0-3,8,10-11") or a NUMA node ("node1", which
+    // stands for the CPUs of that node).  Throws std::invalid_argument if the spec is invalid or
+    // names a node that doesn't exist.
+    static cpu_set parse(std::string_view spec);
+
+    bool empty() const { return cpus_.empty(); }
+    const std::vector<int>& cpus() const { return cpus_; }
+
+    // Returns the set as a CPU list (e.g. "0-3,8").
+    std::string to_string() const;
+
+    // Restricts the calling thread to these CPUs; an empty set puts the thread back on the CPUs
+    // the process started out with.  Threads remember the set they were last placed on, so calling
+    // this for every job a thread picks up only costs a system call when the thread actually moves
+    // to a different set.  Failure (e.g. none of the CPUs being online) is logged, and otherwise
+    // leaves the thread where it was.
+    void apply() const;
+
+  private:
+    std::vector<int> cpus_;  // Sorted, without duplicates
+};
+
+// Sets the name of the calling thread (as shown by top, and reported by thread_cpu_times()).
+// Names are truncated to the 15 characters allowed by the kernel.
+void set_thread_name(const std::string& name);
+
+struct thread_cpu_time {
+    int tid;
+    std::string name;
+    std::chrono::milliseconds user;    // CPU time spent in user space
+    std::chrono::milliseconds system;  // CPU time spent in the kernel
+    int last_cpu;                      // CPU the thread last ran on
+};
+
+// Returns the CPU time used so far by each thread of this process (from /proc/self/task), so that
+// thread placement can be checked and tuned.  Returns an empty list where that isn't available.
+std::vector<thread_cpu_time> thread_cpu_times();
+
+}  // namespace oxen::util
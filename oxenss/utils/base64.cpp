@@ -0,0 +1,262 @@
+#include "base64.hpp"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define OXENSS_BASE64_AVX2
+#include <immintrin.h>
+#endif
+
+namespace oxen::util {
+
+namespace {
+
+    constexpr std::string_view b64_chars =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    // Encoding table mapping each 12-bit value to its two output characters, so that we can
+    // encode 3 input bytes with two lookups.
+    struct b64_encode_table {
+        std::array<char, 2 * 4096> pairs{};
+        constexpr b64_encode_table() {
+            for (size_t i = 0; i < 4096; i++) {
+                pairs[2 * i] = b64_chars[i >> 6];
+                pairs[2 * i + 1] = b64_chars[i & 0x3f];
+            }
+        }
+    };
+    constexpr b64_encode_table b64_enc{};
+
+    // Decoding table mapping each character to its 6-bit value, or 0xff if the character is not a
+    // valid base64 character.  Like oxenc, we accept both the standard and URL-safe alphabets.
+    struct b64_decode_table {
+        std::array<uint8_t, 256> values{};
+        constexpr b64_decode_table() {
+            for (auto& v : values)
+                v = 0xff;
+            for (size_t i = 0; i < b64_chars.size(); i++)
+                values[static_cast<unsigned char>(b64_chars[i])] = i;
+            values['-'] = 62;
+            values['_'] = 63;
+        }
+    };
+    constexpr b64_decode_table b64_dec{};
+
+    void encode_scalar(const unsigned char* in, size_t size, char* out) {
+        for (; size >= 3; in += 3, size -= 3, out += 4) {
+            uint32_t n = uint32_t{in[0]} << 16 | uint32_t{in[1]} << 8 | uint32_t{in[2]};
+            std::memcpy(out, &b64_enc.pairs[2 * (n >> 12)], 2);
+            std::memcpy(out + 2, &b64_enc.pairs[2 * (n & 0xfff)], 2);
+        }
+        if (size == 1) {
+            out[0] = b64_chars[in[0] >> 2];
+            out[1] = b64_chars[(in[0] & 0x03) << 4];
+            out[2] = '=';
+            out[3] = '=';
+        } else if (size == 2) {
+            out[0] = b64_chars[in[0] >> 2];
+            out[1] = b64_chars[(in[0] & 0x03) << 4 | in[1] >> 4];
+            out[2] = b64_chars[(in[1] & 0x0f) << 2];
+            out[3] = '=';
+        }
+    }
+
+    // Decodes `size` characters (which must not be 1 mod 4, and must not include padding) into
+    // `out`, which must have room for size*3/4 bytes.  Returns false if any invalid characters
+    // are encountered.
+    bool decode_scalar(const unsigned char* in, size_t size, unsigned char* out) {
+        auto& v = b64_dec.values;
+        for (; size >= 4; in += 4, size -= 4, out += 3) {
+            uint8_t a = v[in[0]], b = v[in[1]], c = v[in[2]], d = v[in[3]];
+            if ((a | b | c | d) & 0xc0)
+                return false;
+            uint32_t n = uint32_t{a} << 18 | uint32_t{b} << 12 | uint32_t{c} << 6 | d;
+            out[0] = n >> 16;
+            out[1] = n >> 8;
+            out[2] = n;
+        }
+        if (size >= 2) {
+            uint8_t a = v[in[0]], b = v[in[1]], c = size == 3 ? v[in[2]] : 0;
+            if ((a | b | c) & 0xc0)
+                return false;
+            out[0] = a << 2 | b >> 4;
+            if (size == 3)
+                out[1] = b << 4 | c >> 2;
+        }
+        return true;
+    }
+
+#ifdef OXENSS_BASE64_AVX2
+
+    bool detect_avx2() {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+    }
+
+    // The AVX2 implementations below are based on the algorithms described by Wojciech Muła and
+    // Daniel Lemire in "Faster Base64 Encoding and Decoding using AVX2 Instructions" (2018).
+
+    // Encodes 24 bytes at a time into 32 characters.  Returns the number of input bytes
+    // consumed, which is always a multiple of 24; the caller encodes whatever remains.
+    __attribute__((target("avx2"))) size_t encode_avx2(
+            const unsigned char* in, size_t size, char* out) {
+        const auto shuffle = _mm256_setr_epi8(
+                1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,  //
+                1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+        const auto lut = _mm256_setr_epi8(
+                65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,  //
+                65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+
+        size_t done = 0;
+        // Each iteration reads 28 bytes (two overlapping 16-byte loads) but only consumes 24.
+        for (; size - done >= 28; done += 24, out += 32) {
+            auto lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + done));
+            auto hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + done + 12));
+            auto v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+
+            // Spread each 3 bytes across 4 bytes, then shift each 6-bit value into place
+            v = _mm256_shuffle_epi8(v, shuffle);
+            auto t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+            auto t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+            auto t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+            auto t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+            auto indices = _mm256_or_si256(t1, t3);
+
+            // Translate the 6-bit values into characters by adding a per-range offset
+            auto offsets = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+            auto ge26 = _mm256_cmpgt_epi8(indices, _mm256_set1_epi8(25));
+            offsets = _mm256_sub_epi8(offsets, ge26);
+            auto chars = _mm256_add_epi8(indices, _mm256_shuffle_epi8(lut, offsets));
+
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), chars);
+        }
+        return done;
+    }
+
+    // Decodes 32 characters at a time into 24 bytes.  Returns the number of input characters
+    // consumed (a multiple of 32); the caller decodes whatever remains.  Stops early (without
+    // consuming the block) at any block containing characters outside the standard alphabet so
+    // that the scalar decoder can deal with it (either to decode URL-safe characters, or to
+    // reject it).  Each 24-byte output block is written with a 32-byte store, so `size` must
+    // leave enough input for the scalar decoder to overwrite the excess.
+    __attribute__((target("avx2"))) size_t decode_avx2(
+            const unsigned char* in, size_t size, unsigned char* out) {
+        const auto lut_lo = _mm256_setr_epi8(
+                0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,  //
+                0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+        const auto lut_hi = _mm256_setr_epi8(
+                0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,  //
+                0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+        const auto lut_roll = _mm256_setr_epi8(
+                0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,  //
+                0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+        const auto mask_2f = _mm256_set1_epi8(0x2f);
+        const auto pack_shuffle = _mm256_setr_epi8(
+                2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,  //
+                2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+        const auto pack_permute = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1);
+
+        size_t done = 0;
+        // We need at least 44 characters (i.e. 33 output bytes) for the 32-byte store to stay
+        // within the decoded output.
+        for (; size - done >= 44; done += 32, out += 24) {
+            auto str = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + done));
+
+            // Classify each character by its nibbles; any invalid character gives a non-zero
+            // result in `lo & hi`.
+            auto hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+            auto lo_nibbles = _mm256_and_si256(str, mask_2f);
+            auto hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+            auto lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+            if (!_mm256_testz_si256(lo, hi))
+                break;
+
+            // Translate the characters into 6-bit values
+            auto eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+            auto roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+            str = _mm256_add_epi8(str, roll);
+
+            // Pack 4 6-bit values into 3 bytes
+            auto merged = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+            auto packed = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+            packed = _mm256_shuffle_epi8(packed, pack_shuffle);
+            packed = _mm256_permutevar8x32_epi32(packed, pack_permute);
+
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), packed);
+        }
+        return done;
+    }
+
+#endif
+
+    const bool use_avx2 =
+#ifdef OXENSS_BASE64_AVX2
+            detect_avx2();
+#else
+            false;
+#endif
+
+}  // namespace
+
+bool base64_accelerated() {
+    return use_avx2;
+}
+
+void base64_encode(std::string_view in, char* out) {
+    auto* data = reinterpret_cast<const unsigned char*>(in.data());
+    size_t size = in.size();
+#ifdef OXENSS_BASE64_AVX2
+    if (use_avx2) {
+        size_t done = encode_avx2(data, size, out);
+        data += done;
+        size -= done;
+        out += done / 3 * 4;
+    }
+#endif
+    encode_scalar(data, size, out);
+}
+
+std::string base64_encode(std::string_view in) {
+    std::string out;
+    out.resize(base64_encoded_size(in.size()));
+    base64_encode(in, out.data());
+    return out;
+}
+
+std::optional<std::string> base64_decode(std::string_view in) {
+    size_t size = in.size();
+    if (size % 4 == 1)
+        return std::nullopt;
+    // Allow 1 or 2 padding characters, but only if they pad the value to a multiple of 4
+    if (size > 0 && size % 4 == 0 && in[size - 1] == '=') {
+        size--;
+        if (in[size - 1] == '=')
+            size--;
+    }
+
+    std::optional<std::string> result;
+    auto& out = result.emplace();
+    out.resize(size / 4 * 3 + (size % 4 == 0 ? 0 : size % 4 - 1));
+
+    auto* data = reinterpret_cast<const unsigned char*>(in.data());
+    auto* dest = reinterpret_cast<unsigned char*>(out.data());
+#ifdef OXENSS_BASE64_AVX2
+    if (use_avx2) {
+        size_t done = decode_avx2(data, size, dest);
+        data += done;
+        size -= done;
+        dest += done / 4 * 3;
+    }
+#endif
+    if (!decode_scalar(data, size, dest))
+        result.reset();
+    return result;
+}
+
+}  // namespace oxen::util
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// Fast base64 encoding/decoding for message payloads.  On x86-64 CPUs supporting AVX2 this uses a
+// vectorized implementation (selected at runtime); otherwise it falls back to a table-driven
+// scalar implementation.  Results are identical to oxenc's base64 functions, which are still
+// preferable for small values (hashes, keys, signatures) where the setup cost dominates.
+
+namespace oxen::util {
+
+/// Returns the size of the padded base64 encoding of `size` bytes.
+constexpr size_t base64_encoded_size(size_t size) {
+    return (size + 2) / 3 * 4;
+}
+
+/// Encodes `in` as padded base64, writing exactly `base64_encoded_size(in.size())` characters to
+/// `out`.
+void base64_encode(std::string_view in, char* out);
+
+/// Returns the padded base64 encoding of `in`.
+std::string base64_encode(std::string_view in);
+
+/// Decodes a base64-encoded value.  Accepts the same inputs as `oxenc::is_base64` (i.e. the
+/// standard or URL-safe alphabet, with optional '=' padding) and returns the decoded value, or
+/// nullopt if the input is not valid base64.
+std::optional<std::string> base64_decode(std::string_view in);
+
+/// Returns true if the AVX2-accelerated implementation is in use.
+bool base64_accelerated();
+
+}  // namespace oxen::util
@@ -0,0 +1,163 @@
+#include "compression.hpp"
+#include "string_utils.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <stdexcept>
+
+#include <fmt/core.h>
+#include <zlib.h>
+
+namespace oxen::util {
+
+namespace {
+    std::atomic<uint64_t> compressed_count{0}, compressed_in{0}, compressed_out{0};
+
+    // zlib's window bits; adding 16 makes it use the gzip format rather than zlib's.
+    int window_bits(content_encoding encoding) {
+        switch (encoding) {
+            case content_encoding::gzip: return MAX_WBITS + 16;
+            case content_encoding::deflate: return MAX_WBITS;
+            default: throw std::invalid_argument{"Cannot compress with the identity encoding"};
+        }
+    }
+
+    // Parses the q-value of one Accept-Encoding entry's parameters (e.g. "q=0.5"), as a
+    // thousandth so that we don't have to deal with floating point.
+    int parse_qvalue(std::string_view params) {
+        for (auto param : split(params, ";", true)) {
+            trim(param);
+            if (param.size() < 2 || (param[0] != 'q' && param[0] != 'Q') || param[1] != '=')
+                continue;
+            param.remove_prefix(2);
+            // q-values are "0", "1", or with up to three decimal places
+            int q = 0, scale = 1000;
+            bool point = false;
+            for (char c : param) {
+                if (c == '.' && !point)
+                    point = true;
+                else if (c >= '0' && c <= '9' && (!point || scale > 1)) {
+                    if (point)
+                        q += (c - '0') * (scale /= 10);
+                    else
+                        q = q * 10 + (c - '0') * 1000;
+                } else
+                    return 0;
+            }
+            return std::min(q, 1000);
+        }
+        return 1000;
+    }
+}  // namespace
+
+std::string_view to_string(content_encoding encoding) {
+    switch (encoding) {
+        case content_encoding::gzip: return "gzip";
+        case content_encoding::deflate: return "deflate";
+        default: return "identity";
+    }
+}
+
+content_encoding accept_encoding(std::string_view header) {
+    auto best = content_encoding::identity;
+    int best_q = 0;
+    for (auto entry : split(header, ",", true)) {
+        auto semi = entry.find(';');
+        auto name = entry.substr(0, semi);
+        trim(name);
+        content_encoding enc;
+        if (string_iequal(name, "gzip") || string_iequal(name, "x-gzip") || name == "*")
+            enc = content_encoding::gzip;
+        else if (string_iequal(name, "deflate"))
+            enc = content_encoding::deflate;
+        else
+            continue;
+        int q = semi == std::string_view::npos ? 1000 : parse_qvalue(entry.substr(semi + 1));
+        if (q > best_q || (q == best_q && q > 0 && enc == content_encoding::gzip)) {
+            best = enc;
+            best_q = q;
+        }
+    }
+    return best;
+}
+
+std::string compress(std::string_view data, content_encoding encoding, int level) {
+    z_stream z{};
+    if (int rc = deflateInit2(
+                &z,
+                std::clamp(level, 1, 9),
+                Z_DEFLATED,
+                window_bits(encoding),
+                8,
+                Z_DEFAULT_STRATEGY);
+        rc != Z_OK)
+        throw std::runtime_error{fmt::format("Failed to initialize compression: {}", rc)};
+
+    std::string out;
+    out.resize(deflateBound(&z, data.size()));
+    z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    z.avail_in = static_cast<uInt>(data.size());
+    z.next_out = reinterpret_cast<Bytef*>(out.data());
+    z.avail_out = static_cast<uInt>(out.size());
+    int rc = deflate(&z, Z_FINISH);
+    auto written = z.total_out;
+    deflateEnd(&z);
+    // With the output sized by deflateBound a single call always finishes
+    if (rc != Z_STREAM_END)
+        throw std::runtime_error{fmt::format("Compression failed: {}", rc)};
+    out.resize(written);
+    return out;
+}
+
+std::string decompress(std::string_view data, content_encoding encoding, size_t max_size) {
+    z_stream z{};
+    if (int rc = inflateInit2(&z, window_bits(encoding)); rc != Z_OK)
+        throw std::runtime_error{fmt::format("Failed to initialize decompression: {}", rc)};
+
+    std::string out;
+    z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    z.avail_in = static_cast<uInt>(data.size());
+    int rc = Z_OK;
+    while (rc == Z_OK) {
+        if (out.size() >= max_size) {
+            inflateEnd(&z);
+            throw std::runtime_error{"Decompressed data is too large"};
+        }
+        auto have = out.size();
+        out.resize(std::min(max_size, std::max<size_t>(have * 2, 4096)));
+        z.next_out = reinterpret_cast<Bytef*>(out.data() + have);
+        z.avail_out = static_cast<uInt>(out.size() - have);
+        rc = inflate(&z, Z_NO_FLUSH);
+        out.resize(out.size() - z.avail_out);
+    }
+    inflateEnd(&z);
+    if (rc != Z_STREAM_END)
+        throw std::runtime_error{fmt::format("Invalid compressed data: {}", rc)};
+    return out;
+}
+
+bool maybe_compress(
+        std::string& body, content_encoding encoding, const compression_config& config) {
+    if (encoding == content_encoding::identity || config.min_size == 0 ||
+        body.size() < config.min_size || body.size() > std::numeric_limits<uInt>::max())
+        return false;
+    auto compressed = compress(body, encoding, config.level);
+    if (compressed.size() >= body.size())
+        return false;
+    compressed_count++;
+    compressed_in += body.size();
+    compressed_out += compressed.size();
+    body = std::move(compressed);
+    return true;
+}
+
+compression_stats get_compression_stats() {
+    compression_stats stats;
+    stats.compressed = compressed_count;
+    stats.bytes_in = compressed_in;
+    stats.bytes_out = compressed_out;
+    return stats;
+}
+
+}  // namespace oxen::util
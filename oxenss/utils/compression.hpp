@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Compression of large response bodies (such as retrieve responses, which are mostly base64 and
+// JSON framing) for clients that ask for it: via Accept-Encoding over HTTPS, or an extra request
+// part over OMQ.
+
+namespace oxen::util {
+
+enum class content_encoding { identity, gzip, deflate };
+
+/// Returns the encoding's name as used in Accept-Encoding/Content-Encoding ("gzip", etc.).
+std::string_view to_string(content_encoding encoding);
+
+/// Picks the encoding to use from an Accept-Encoding style list (e.g. "br, gzip;q=0.8, deflate").
+/// Encodings we don't support, and those with a q-value of 0, are ignored; among the rest the
+/// highest q-value wins, preferring gzip on ties.  Returns identity if nothing usable is listed.
+content_encoding accept_encoding(std::string_view header);
+
+struct compression_config {
+    // Response bodies of at least this many bytes are compressed for clients that accept it; 0
+    // disables compression.
+    size_t min_size = 16 * 1024;
+
+    // zlib compression level, from 1 (fastest) to 9 (smallest).
+    int level = 3;
+};
+
+/// Compresses `body` in place if compression is enabled, `encoding` isn't identity, and the body
+/// is at least `config.min_size` bytes.  Returns true if the body was compressed; false if it was
+/// left as is (including when compressing it wouldn't make it any smaller).
+bool maybe_compress(
+        std::string& body, content_encoding encoding, const compression_config& config);
+
+/// Compresses `data` with the given encoding, which must not be identity.  Throws
+/// std::runtime_error on failure.
+std::string compress(std::string_view data, content_encoding encoding, int level);
+
+/// Decompresses `data`.  Throws std::runtime_error if the data isn't valid for the encoding or
+/// would decompress to more than `max_size` bytes.
+std::string decompress(std::string_view data, content_encoding encoding, size_t max_size);
+
+struct compression_stats {
+    uint64_t compressed = 0;  // Number of bodies compressed
+    uint64_t bytes_in = 0;    // Total size of those bodies before compression
+    uint64_t bytes_out = 0;   // ... and after
+};
+
+/// Returns the totals of the compression done by maybe_compress() since startup.
+compression_stats get_compression_stats();
+
+}  // namespace oxen::util
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace oxen::util {
+
+// Thread-safe, lock-free histogram of durations using fixed (cumulative, Prometheus-style) bucket
+// boundaries.
+class latency_histogram {
+  public:
+    // Upper bounds of the histogram buckets; a final, implicit bucket holds everything slower.
+    static constexpr std::array<std::chrono::microseconds, 15> BUCKETS{
+            std::chrono::microseconds{100},
+            std::chrono::microseconds{250},
+            std::chrono::microseconds{500},
+            std::chrono::microseconds{1'000},
+            std::chrono::microseconds{2'500},
+            std::chrono::microseconds{5'000},
+            std::chrono::microseconds{10'000},
+            std::chrono::microseconds{25'000},
+            std::chrono::microseconds{50'000},
+            std::chrono::microseconds{100'000},
+            std::chrono::microseconds{250'000},
+            std::chrono::microseconds{500'000},
+            std::chrono::microseconds{1'000'000},
+            std::chrono::microseconds{2'500'000},
+            std::chrono::microseconds{5'000'000}};
+
+    void record(std::chrono::steady_clock::duration d) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(d);
+        size_t i = 0;
+        while (i < BUCKETS.size() && us > BUCKETS[i])
+            i++;
+        counts_[i].fetch_add(1, std::memory_order_relaxed);
+        sum_us_.fetch_add(us.count(), std::memory_order_relaxed);
+    }
+
+    struct snapshot {
+        // Non-cumulative count of each bucket; the last element counts values above the last
+        // BUCKETS value.
+        std::array<uint64_t, BUCKETS.size() + 1> counts{};
+        uint64_t count = 0;
+        int64_t sum_us = 0;
+
+        // Estimates the `q` quantile (e.g. 0.99 for the 99th percentile) by interpolating within
+        // the bucket that contains it.  Values beyond the last bucket are reported as the last
+        // bucket boundary; returns 0 if there are no values at all.
+        std::chrono::microseconds quantile(double q) const {
+            if (count == 0)
+                return std::chrono::microseconds{0};
+            double rank = q * count;
+            uint64_t seen = 0;
+            for (size_t i = 0; i < BUCKETS.size(); i++) {
+                if (counts[i] > 0 && seen + counts[i] >= rank) {
+                    auto lo = i == 0 ? 0 : BUCKETS[i - 1].count();
+                    auto hi = BUCKETS[i].count();
+                    return std::chrono::microseconds{static_cast<int64_t>(
+                            lo + (hi - lo) * std::max(0.0, rank - seen) / counts[i])};
+                }
+                seen += counts[i];
+            }
+            return BUCKETS.back();
+        }
+    };
+
+    snapshot get() const {
+        snapshot s;
+        for (size_t i = 0; i < counts_.size(); i++) {
+            s.counts[i] = counts_[i].load(std::memory_order_relaxed);
+            s.count += s.counts[i];
+        }
+        s.sum_us = sum_us_.load(std::memory_order_relaxed);
+        return s;
+    }
+
+  private:
+    std::array<std::atomic<uint64_t>, BUCKETS.size() + 1> counts_{};
+    std::atomic<int64_t> sum_us_{0};
+};
+
+}  // namespace oxen::util
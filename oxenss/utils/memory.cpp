@@ -0,0 +1,76 @@
+#include "memory.hpp"
+
+#include <fmt/format.h>
+
+// jemalloc's control interface.  Declared weak (rather than including jemalloc's header) so that
+// this builds and runs without jemalloc, which we only link to if it is available: the symbol is
+// then simply null.
+extern "C" int mallctl(const char* name, void* oldp, size_t* oldlenp, void* newp, size_t newlen)
+        __attribute__((weak));
+
+namespace oxen::util {
+
+namespace {
+    // Reads a jemalloc statistic; returns false (leaving `val` alone) if it isn't available.
+    template <typename T>
+    bool read_mallctl(const char* name, T& val) {
+        T v;
+        size_t len = sizeof(v);
+        if (mallctl(name, &v, &len, nullptr, 0) != 0)
+            return false;
+        val = v;
+        return true;
+    }
+}  // namespace
+
+allocator_stats get_allocator_stats() {
+    allocator_stats stats;
+    if (!mallctl)
+        return stats;
+
+    // Statistics are a snapshot taken at the last epoch change, so advance it first
+    uint64_t epoch = 1;
+    size_t len = sizeof(epoch);
+    if (mallctl("epoch", &epoch, &len, &epoch, len) != 0)
+        return stats;
+    stats.available = true;
+
+    for (auto [name, field] :
+         {std::pair{"stats.allocated", &stats.allocated},
+          std::pair{"stats.active", &stats.active},
+          std::pair{"stats.metadata", &stats.metadata},
+          std::pair{"stats.resident", &stats.resident},
+          std::pair{"stats.mapped", &stats.mapped},
+          std::pair{"stats.retained", &stats.retained}}) {
+        size_t v;
+        if (read_mallctl(name, v))
+            *field = static_cast<int64_t>(v);
+    }
+
+    unsigned narenas = 0;
+    size_t page = 4096;
+    read_mallctl("arenas.narenas", narenas);
+    read_mallctl("arenas.page", page);
+    for (unsigned i = 0; i < narenas; i++) {
+        bool initialized = false;
+        if (!read_mallctl(fmt::format("arena.{}.initialized", i).c_str(), initialized) ||
+            !initialized)
+            continue;
+        auto& a = stats.arenas.emplace_back();
+        a.index = i;
+        a.threads = 0;
+        size_t small = 0, large = 0, pactive = 0, pdirty = 0;
+        read_mallctl(fmt::format("stats.arenas.{}.nthreads", i).c_str(), a.threads);
+        read_mallctl(fmt::format("stats.arenas.{}.small.allocated", i).c_str(), small);
+        read_mallctl(fmt::format("stats.arenas.{}.large.allocated", i).c_str(), large);
+        read_mallctl(fmt::format("stats.arenas.{}.pactive", i).c_str(), pactive);
+        read_mallctl(fmt::format("stats.arenas.{}.pdirty", i).c_str(), pdirty);
+        a.small_allocated = static_cast<int64_t>(small);
+        a.large_allocated = static_cast<int64_t>(large);
+        a.active = static_cast<int64_t>(pactive * page);
+        a.dirty = static_cast<int64_t>(pdirty * page);
+    }
+    return stats;
+}
+
+}  // namespace oxen::util
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace oxen::util {
+
+// Estimates of the heap memory held by standard containers, for the memory accounting in the stats
+// endpoint.  These count what the container itself allocates (element storage, hash nodes and
+// bucket arrays, plus the allocator's per-allocation overhead) but not whatever the elements point
+// to, which callers add themselves where it matters.  They are estimates (the real layout depends
+// on the standard library), meant for spotting growth and comparing subsystems, not exact totals.
+
+// Approximate bookkeeping overhead of each heap allocation
+inline constexpr size_t ALLOC_OVERHEAD = 16;
+
+inline size_t memory_of(const std::string& s) {
+    // Short strings live inside the std::string itself
+    return s.capacity() > 15 ? s.capacity() + 1 + ALLOC_OVERHEAD : 0;
+}
+
+template <typename T, typename A>
+size_t memory_of(const std::vector<T, A>& v) {
+    return v.capacity() ? v.capacity() * sizeof(T) + ALLOC_OVERHEAD : 0;
+}
+
+template <typename T, typename A>
+size_t memory_of(const std::deque<T, A>& d) {
+    // Elements are allocated in blocks of (at least) 512 bytes, plus a map of block pointers
+    size_t per_block = std::max<size_t>(512 / sizeof(T), 1);
+    size_t blocks = (d.size() + per_block - 1) / per_block + 1;
+    return blocks * (per_block * sizeof(T) + ALLOC_OVERHEAD + sizeof(void*));
+}
+
+namespace detail {
+    // Each element of a node-based hash container is a separate allocation holding the value, the
+    // next pointer and the cached hash; the buckets are one array of pointers.
+    template <typename C>
+    size_t hash_container_memory(const C& c) {
+        return c.size() * (sizeof(typename C::value_type) + 2 * sizeof(void*) + ALLOC_OVERHEAD) +
+               c.bucket_count() * sizeof(void*);
+    }
+}  // namespace detail
+
+template <typename... T>
+size_t memory_of(const std::unordered_map<T...>& m) {
+    return detail::hash_container_memory(m);
+}
+
+template <typename... T>
+size_t memory_of(const std::unordered_set<T...>& s) {
+    return detail::hash_container_memory(s);
+}
+
+// Statistics of the memory allocator, when running with jemalloc (see get_allocator_stats()).
+struct allocator_stats {
+    bool available = false;  // False if we aren't running with jemalloc
+    int64_t allocated = 0;   // Bytes allocated by the application
+    int64_t active = 0;      // Bytes in active pages (allocated plus fragmentation)
+    int64_t metadata = 0;    // Bytes of allocator metadata
+    int64_t resident = 0;    // Bytes in physically resident pages mapped by the allocator
+    int64_t mapped = 0;      // Bytes in active extents mapped by the allocator
+    int64_t retained = 0;    // Bytes of virtual memory retained rather than returned to the OS
+
+    struct arena {
+        unsigned index;
+        unsigned threads;         // Threads currently assigned to the arena
+        int64_t small_allocated;  // Bytes allocated in small size classes
+        int64_t large_allocated;  // Bytes allocated in large size classes
+        int64_t active;           // Bytes in the arena's active pages
+        int64_t dirty;            // Bytes in unused dirty pages not yet returned to the OS
+    };
+    std::vector<arena> arenas;  // Arenas that have been used
+};
+
+// Returns jemalloc's current statistics (refreshing them first), or `available = false` if the
+// process isn't using jemalloc.
+allocator_stats get_allocator_stats();
+
+}  // namespace oxen::util
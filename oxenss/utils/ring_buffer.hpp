@@ -0,0 +1,93 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+namespace oxen::util {
+
+// Fixed-capacity FIFO queue stored inline: once full, pushing a new element drops the oldest one.
+// Not thread-safe.
+template <typename T, size_t N>
+class ring_buffer {
+    static_assert(N > 0);
+
+  public:
+    static constexpr size_t capacity() { return N; }
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    bool full() const { return size_ == N; }
+
+    // Element `i`, counting from the oldest
+    T& operator[](size_t i) { return items_[(start_ + i) % N]; }
+    const T& operator[](size_t i) const { return items_[(start_ + i) % N]; }
+
+    T& front() { return (*this)[0]; }
+    const T& front() const { return (*this)[0]; }
+    T& back() { return (*this)[size_ - 1]; }
+    const T& back() const { return (*this)[size_ - 1]; }
+
+    // Appends an element, replacing the oldest one if we are full.
+    void push_back(T val) {
+        if (full()) {
+            items_[start_] = std::move(val);
+            start_ = (start_ + 1) % N;
+        } else {
+            items_[(start_ + size_++) % N] = std::move(val);
+        }
+    }
+
+    void pop_front() {
+        start_ = (start_ + 1) % N;
+        size_--;
+    }
+
+    void clear() { start_ = size_ = 0; }
+
+    // Iteration from oldest to newest
+    template <typename Ring, typename Ref>
+    class iterator_base {
+        Ring* ring_ = nullptr;
+        size_t i_ = 0;
+
+      public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = std::remove_reference_t<Ref>*;
+        using reference = Ref;
+
+        iterator_base() = default;
+        iterator_base(Ring* ring, size_t i) : ring_{ring}, i_{i} {}
+        Ref operator*() const { return (*ring_)[i_]; }
+        pointer operator->() const { return &(*ring_)[i_]; }
+        iterator_base& operator++() {
+            i_++;
+            return *this;
+        }
+        iterator_base operator++(int) {
+            auto copy = *this;
+            i_++;
+            return copy;
+        }
+        bool operator==(const iterator_base& o) const { return i_ == o.i_; }
+        bool operator!=(const iterator_base& o) const { return i_ != o.i_; }
+    };
+    using iterator = iterator_base<ring_buffer, T&>;
+    using const_iterator = iterator_base<const ring_buffer, const T&>;
+
+    iterator begin() { return {this, 0}; }
+    iterator end() { return {this, size_}; }
+    const_iterator begin() const { return {this, 0}; }
+    const_iterator end() const { return {this, size_}; }
+
+  private:
+    std::array<T, N> items_{};
+    size_t start_ = 0;
+    size_t size_ = 0;
+};
+
+}  // namespace oxen::util
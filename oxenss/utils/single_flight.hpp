@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace oxen::util {
+
+// Coalesces identical concurrent computations: while a computation for some key is running, other
+// callers with the same key don't run their own but get handed the result of the running one once
+// it finishes.  Nothing is cached: once a computation finishes the next call for its key starts
+// a new one.
+//
+// All methods are thread-safe.
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class SingleFlight {
+  public:
+    using callback = std::function<void(const Value&)>;
+
+    // If no computation for `key` is in flight, calls `compute()` (which must not throw) and then
+    // `cb` with its result, followed by the callbacks of any calls that joined it in the meantime,
+    // all from the calling thread.  Otherwise queues `cb` to be called with the result of the
+    // computation in flight and returns right away.  Returns true if this call did the work.
+    template <typename Compute>
+    bool run(const Key& key, Compute&& compute, callback cb) {
+        {
+            std::lock_guard lock{mutex_};
+            auto [it, inserted] = flights_.try_emplace(key);
+            if (!inserted) {
+                it->second.push_back(std::move(cb));
+                coalesced_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+        executed_.fetch_add(1, std::memory_order_relaxed);
+
+        const Value result = compute();
+
+        std::vector<callback> joined;
+        {
+            std::lock_guard lock{mutex_};
+            auto it = flights_.find(key);
+            joined = std::move(it->second);
+            flights_.erase(it);
+        }
+        cb(result);
+        for (auto& c : joined)
+            c(result);
+        return true;
+    }
+
+    // Number of computations currently in flight.
+    size_t in_flight() const {
+        std::lock_guard lock{mutex_};
+        return flights_.size();
+    }
+
+    // Number of computations run, and of calls that were handed the result of another's.
+    uint64_t executed() const { return executed_.load(std::memory_order_relaxed); }
+    uint64_t coalesced() const { return coalesced_.load(std::memory_order_relaxed); }
+
+  private:
+    mutable std::mutex mutex_;
+    std::unordered_map<Key, std::vector<callback>, Hash> flights_;
+    std::atomic<uint64_t> executed_{0};
+    std::atomic<uint64_t> coalesced_{0};
+};
+
+}  // namespace oxen::util
@@ -0,0 +1,172 @@
+#include "trace.hpp"
+#include "random.hpp"
+
+#include <algorithm>
+
+namespace oxen::util {
+
+namespace {
+    thread_local std::shared_ptr<request_trace> thread_trace;
+    thread_local int thread_span = 0;
+}  // namespace
+
+request_trace::request_trace(
+        std::string name, std::chrono::steady_clock::time_point start, bool sampled) :
+        started{std::chrono::system_clock::now() -
+                std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                        std::chrono::steady_clock::now() - start)},
+        sampled{sampled} {
+    auto& root = spans_.emplace_back();
+    root.name = std::move(name);
+    root.start = start;
+}
+
+int request_trace::begin(
+        std::string name, int parent, std::chrono::steady_clock::time_point start) {
+    std::lock_guard lock{mutex_};
+    auto& s = spans_.emplace_back();
+    s.name = std::move(name);
+    s.parent = parent;
+    s.start = start;
+    return static_cast<int>(spans_.size() - 1);
+}
+
+void request_trace::end(int span, std::chrono::steady_clock::time_point end) {
+    std::lock_guard lock{mutex_};
+    auto& s = spans_[span];
+    s.duration = end - s.start;
+}
+
+void request_trace::add(
+        std::string name,
+        int parent,
+        std::chrono::steady_clock::time_point start,
+        std::chrono::steady_clock::duration duration) {
+    std::lock_guard lock{mutex_};
+    auto& s = spans_.emplace_back();
+    s.name = std::move(name);
+    s.parent = parent;
+    s.start = start;
+    s.duration = duration;
+}
+
+void request_trace::set_detail(int span, std::string detail) {
+    std::lock_guard lock{mutex_};
+    spans_[span].detail = std::move(detail);
+}
+
+void request_trace::set_value(int span, const char* name, int64_t value) {
+    std::lock_guard lock{mutex_};
+    spans_[span].values.emplace_back(name, value);
+}
+
+std::vector<trace_span> request_trace::spans() const {
+    std::lock_guard lock{mutex_};
+    return spans_;
+}
+
+std::chrono::steady_clock::duration request_trace::duration() const {
+    std::lock_guard lock{mutex_};
+    return spans_.front().duration;
+}
+
+trace_scope::trace_scope(std::shared_ptr<request_trace> trace, int span) :
+        active_{(bool)trace} {
+    if (!active_)
+        return;
+    prev_ = std::exchange(thread_trace, std::move(trace));
+    prev_span_ = std::exchange(thread_span, span);
+}
+
+trace_scope::~trace_scope() {
+    if (!active_)
+        return;
+    thread_trace = std::move(prev_);
+    thread_span = prev_span_;
+}
+
+const std::shared_ptr<request_trace>& current_trace() {
+    return thread_trace;
+}
+
+int current_span() {
+    return thread_span;
+}
+
+traced::traced(const char* name) {
+    if (!thread_trace)
+        return;
+    trace_ = thread_trace;
+    span_ = trace_->begin(name, thread_span);
+    prev_span_ = std::exchange(thread_span, span_);
+}
+
+traced::~traced() {
+    if (!trace_)
+        return;
+    trace_->end(span_);
+    // Only restore if we're still on the trace we started on (i.e. scopes were properly nested)
+    if (thread_trace == trace_)
+        thread_span = prev_span_;
+}
+
+async_traced::async_traced(std::string name) {
+    if (!thread_trace)
+        return;
+    trace_ = thread_trace;
+    span_ = trace_->begin(std::move(name), thread_span);
+}
+
+Tracer::Tracer(trace_config conf) : conf_{std::move(conf)} {}
+
+std::shared_ptr<request_trace> Tracer::start(
+        std::string name, std::chrono::steady_clock::time_point start) {
+    if (!enabled())
+        return nullptr;
+    bool sampled = conf_.sample_rate > 0 &&
+                   std::uniform_real_distribution<double>{}(rng()) < conf_.sample_rate;
+    if (!sampled && conf_.slow_threshold.count() == 0)
+        return nullptr;
+    return std::make_shared<request_trace>(std::move(name), start, sampled);
+}
+
+void Tracer::finish(std::shared_ptr<request_trace> trace) {
+    if (!trace)
+        return;
+    trace->end(0);
+    auto took = trace->duration();
+    if (!trace->sampled && (conf_.slow_threshold.count() == 0 || took < conf_.slow_threshold))
+        return;
+
+    std::lock_guard lock{mutex_};
+    auto cutoff = std::chrono::system_clock::now() - conf_.window;
+    kept_.erase(
+            std::remove_if(
+                    kept_.begin(),
+                    kept_.end(),
+                    [&](const auto& t) { return t->started < cutoff; }),
+            kept_.end());
+    if (kept_.size() < conf_.keep) {
+        kept_.push_back(std::move(trace));
+        return;
+    }
+    auto fastest = std::min_element(kept_.begin(), kept_.end(), [](const auto& a, const auto& b) {
+        return a->duration() < b->duration();
+    });
+    if (fastest != kept_.end() && (*fastest)->duration() < took)
+        *fastest = std::move(trace);
+}
+
+std::vector<std::shared_ptr<const request_trace>> Tracer::slowest() const {
+    std::vector<std::shared_ptr<const request_trace>> result;
+    {
+        std::lock_guard lock{mutex_};
+        result = kept_;
+    }
+    std::sort(result.begin(), result.end(), [](const auto& a, const auto& b) {
+        return a->duration() > b->duration();
+    });
+    return result;
+}
+
+}  // namespace oxen::util
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace oxen::util {
+
+// A timed step in handling a request.  Spans form a tree through their parent indices.
+struct trace_span {
+    std::string name;
+    std::string detail;  // Optional extra information, e.g. the SQL of a database statement
+    int parent = -1;     // Index of the parent span; -1 for the root span
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::duration duration{0};
+    std::vector<std::pair<const char*, int64_t>> values;  // Named counters, e.g. rows scanned
+};
+
+// The spans recorded while handling one request.  Span 0 is the root span covering the whole
+// request.  Spans can be added from any thread.
+class request_trace {
+  public:
+    request_trace(std::string name, std::chrono::steady_clock::time_point start, bool sampled);
+
+    // Starts a new span, returning its index.
+    int begin(
+            std::string name,
+            int parent,
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now());
+
+    // Ends a span started with begin().
+    void end(int span,
+             std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now());
+
+    // Adds a complete span.
+    void add(
+            std::string name,
+            int parent,
+            std::chrono::steady_clock::time_point start,
+            std::chrono::steady_clock::duration duration);
+
+    void set_detail(int span, std::string detail);
+    void set_value(int span, const char* name, int64_t value);
+
+    // Returns a copy of the recorded spans.
+    std::vector<trace_span> spans() const;
+
+    // Total duration of the request; only valid once the root span has ended.
+    std::chrono::steady_clock::duration duration() const;
+
+    // When the request started
+    const std::chrono::system_clock::time_point started;
+
+    // Whether this trace was randomly sampled (rather than just kept because it was slow)
+    const bool sampled;
+
+  private:
+    mutable std::mutex mutex_;
+    std::vector<trace_span> spans_;
+};
+
+// Sets the calling thread's current trace (and the span that newly started spans nest under)
+// until destruction, restoring the previous one.  Used to attach spans recorded anywhere on the
+// thread (e.g. by the database) to the request being handled.  Does nothing if given a null trace.
+class trace_scope {
+    std::shared_ptr<request_trace> prev_;
+    int prev_span_;
+    bool active_;
+
+  public:
+    trace_scope(std::shared_ptr<request_trace> trace, int span = 0);
+    ~trace_scope();
+    trace_scope(const trace_scope&) = delete;
+    trace_scope& operator=(const trace_scope&) = delete;
+};
+
+// Returns the calling thread's current trace, if any, and the span new spans should nest under.
+const std::shared_ptr<request_trace>& current_trace();
+int current_span();
+
+// Records a span, nested under the current span, from construction until destruction if the
+// calling thread has a current trace; does nothing (beyond checking for one) otherwise.  Spans
+// started while this one is alive nest under it.
+class traced {
+    std::shared_ptr<request_trace> trace_;
+    int span_ = -1;
+    int prev_span_ = -1;
+
+  public:
+    explicit traced(const char* name);
+    ~traced();
+    traced(const traced&) = delete;
+    traced& operator=(const traced&) = delete;
+
+    explicit operator bool() const { return (bool)trace_; }
+    void detail(std::string detail) {
+        if (trace_)
+            trace_->set_detail(span_, std::move(detail));
+    }
+    void value(const char* name, int64_t value) {
+        if (trace_)
+            trace_->set_value(span_, name, value);
+    }
+};
+
+// Like `traced`, but for a step that completes asynchronously (e.g. waiting on a remote reply):
+// the span starts at construction and ends when finish() is called, from whatever thread.
+// Copyable, so that it can be captured into callbacks.
+class async_traced {
+    std::shared_ptr<request_trace> trace_;
+    int span_ = -1;
+
+  public:
+    async_traced() = default;
+    explicit async_traced(std::string name);
+
+    void finish() const {
+        if (trace_)
+            trace_->end(span_);
+    }
+    void value(const char* name, int64_t value) const {
+        if (trace_)
+            trace_->set_value(span_, name, value);
+    }
+};
+
+// Tracer settings; see Tracer.
+struct trace_config {
+    double sample_rate = 0;
+    std::chrono::milliseconds slow_threshold{0};
+    size_t keep = 20;
+    std::chrono::seconds window{std::chrono::minutes{30}};
+};
+
+// Decides which requests get traced and keeps the slowest recently completed traces.
+//
+// A request is traced if it is randomly sampled (with probability `sample_rate`), or, if
+// `slow_threshold` is set, always (since we can't know in advance which requests will be slow);
+// when it finishes the trace is kept if it was sampled or took at least `slow_threshold`.  Of the
+// kept traces completed within the last `window` we retain the `keep` slowest.
+//
+// All methods are thread-safe.
+class Tracer {
+  public:
+    explicit Tracer(trace_config conf = {});
+
+    // Whether any requests get traced at all.
+    bool enabled() const { return conf_.sample_rate > 0 || conf_.slow_threshold.count() > 0; }
+
+    // Starts tracing a request with the given name (started at `start`), or returns nullptr if
+    // the request shouldn't be traced.
+    std::shared_ptr<request_trace> start(
+            std::string name,
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now());
+
+    // Ends the root span of a trace returned by start() and keeps it if it qualifies.
+    void finish(std::shared_ptr<request_trace> trace);
+
+    // Returns the kept traces, slowest first.
+    std::vector<std::shared_ptr<const request_trace>> slowest() const;
+
+  private:
+    const trace_config conf_;
+    mutable std::mutex mutex_;
+    std::vector<std::shared_ptr<const request_trace>> kept_;
+};
+
+}  // namespace oxen::util
@@ -0,0 +1,106 @@
+#include "work_queue.hpp"
+
+#include <oxen/log.hpp>
+
+#include <algorithm>
+
+extern "C" {
+#include <pthread.h>
+}
+
+namespace oxen::util {
+
+static auto logcat = log::Cat("utils");
+
+WorkQueue::WorkQueue(std::string name, size_t threads, size_t max_queue) :
+        name_{std::move(name)}, max_queue_{max_queue} {
+    threads_.reserve(threads);
+    for (size_t i = 0; i < threads; i++) {
+        auto& t = threads_.emplace_back([this] { worker(); });
+#ifdef __linux__
+        // Thread names are limited to 15 characters
+        pthread_setname_np(t.native_handle(), name_.substr(0, 15).c_str());
+#else
+        (void)t;
+#endif
+    }
+}
+
+WorkQueue::~WorkQueue() {
+    stop();
+}
+
+bool WorkQueue::submit(std::function<void()> job) {
+    {
+        std::lock_guard lock{mutex_};
+        if (stopping_ || queue_.size() >= max_queue_) {
+            rejected_++;
+            return false;
+        }
+        queue_.push_back({std::move(job), std::chrono::steady_clock::now()});
+        max_queued_ = std::max(max_queued_, queue_.size());
+    }
+    cv_.notify_one();
+    return true;
+}
+
+void WorkQueue::stop() {
+    std::deque<queued_job> dropped;
+    {
+        std::lock_guard lock{mutex_};
+        if (stopping_)
+            return;
+        stopping_ = true;
+        dropped.swap(queue_);
+    }
+    cv_.notify_all();
+    for (auto& t : threads_)
+        t.join();
+    if (!dropped.empty())
+        log::info(logcat, "{}: dropped {} queued jobs at shutdown", name_, dropped.size());
+    // `dropped` (and whatever the jobs have captured) gets destroyed here, outside the lock
+}
+
+WorkQueue::stats WorkQueue::get_stats() const {
+    stats s;
+    s.threads = threads_.size();
+    {
+        std::lock_guard lock{mutex_};
+        s.queued = queue_.size();
+        s.max_queued = max_queued_;
+        s.processed = processed_;
+        s.rejected = rejected_;
+    }
+    s.wait = wait_.get();
+    s.run = run_.get();
+    return s;
+}
+
+void WorkQueue::worker() {
+    std::unique_lock lock{mutex_};
+    while (true) {
+        cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+        if (stopping_)
+            return;
+
+        auto [job, queued] = std::move(queue_.front());
+        queue_.pop_front();
+        lock.unlock();
+
+        auto started = std::chrono::steady_clock::now();
+        wait_.record(started - queued);
+        try {
+            job();
+        } catch (const std::exception& e) {
+            log::error(logcat, "{}: uncaught exception in job: {}", name_, e.what());
+        }
+        // Destroy the job (and anything it captured) before retaking the lock
+        job = nullptr;
+        run_.record(std::chrono::steady_clock::now() - started);
+
+        lock.lock();
+        processed_++;
+    }
+}
+
+}  // namespace oxen::util
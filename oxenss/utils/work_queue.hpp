@@ -0,0 +1,75 @@
+#pragma once
+
+#include "histogram.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace oxen::util {
+
+// A bounded job queue served by its own pool of worker threads.  Used to give a class of work
+// (e.g. onion request decryption) its own resources so that floods of it can't starve out other
+// work, and vice versa.  When the queue is full new jobs are rejected rather than queued, so that
+// callers can shed load.
+class WorkQueue {
+  public:
+    // Starts `threads` worker threads (named `name`) serving a queue of at most `max_queue` jobs.
+    WorkQueue(std::string name, size_t threads, size_t max_queue);
+
+    // Stops the queue; see stop().
+    ~WorkQueue();
+
+    WorkQueue(const WorkQueue&) = delete;
+    WorkQueue& operator=(const WorkQueue&) = delete;
+
+    // Queues a job.  Returns false (and destroys `job` without calling it) if the queue is full
+    // or has been stopped.
+    bool submit(std::function<void()> job);
+
+    // Stops accepting new jobs, drops any queued (but not yet started) jobs, and waits for running
+    // jobs to finish.  Idempotent.
+    void stop();
+
+    struct stats {
+        size_t threads = 0;
+        size_t queued = 0;      // Jobs currently waiting
+        size_t max_queued = 0;  // Most jobs ever waiting at once
+        uint64_t processed = 0;
+        uint64_t rejected = 0;
+        latency_histogram::snapshot wait;  // Time jobs spent queued before starting
+        latency_histogram::snapshot run;   // Time jobs took to run
+    };
+
+    stats get_stats() const;
+
+  private:
+    struct queued_job {
+        std::function<void()> job;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    const std::string name_;
+    const size_t max_queue_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<queued_job> queue_;
+    bool stopping_ = false;
+    size_t max_queued_ = 0;
+    uint64_t processed_ = 0, rejected_ = 0;
+
+    latency_histogram wait_, run_;
+
+    std::vector<std::thread> threads_;
+
+    void worker();
+};
+
+}  // namespace oxen::util
@@ -0,0 +1,53 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/utils/affinity.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+
+extern "C" {
+#include <sched.h>
+}
+
+using namespace oxen;
+
+TEST_CASE("affinity - parsing CPU sets", "[affinity]") {
+    auto set = util::cpu_set::parse("8-9, 3,0-2,2");
+    CHECK(set.cpus() == std::vector{0, 1, 2, 3, 8, 9});
+    CHECK(set.to_string() == "0-3,8-9");
+    CHECK(util::cpu_set::parse("5").to_string() == "5");
+    CHECK(util::cpu_set{}.empty());
+
+    for (auto bad : {"", "x", "1-", "-1", "3-1", "0,,1", "99999", "node", "nodex", "node99999"})
+        CHECK_THROWS_AS(util::cpu_set::parse(bad), std::invalid_argument);
+}
+
+TEST_CASE("affinity - thread CPU times", "[affinity]") {
+    // CPU 0 is always there, so this shouldn't fail; and an empty set puts the thread back where
+    // it started
+    bool restored = true;
+    std::thread t{[&restored] {
+        util::set_thread_name("affinity-test");
+#ifdef __linux__
+        cpu_set_t before, after;
+        sched_getaffinity(0, sizeof(before), &before);
+#endif
+        util::cpu_set::parse("0").apply();
+        util::cpu_set{}.apply();
+#ifdef __linux__
+        sched_getaffinity(0, sizeof(after), &after);
+        restored = CPU_EQUAL(&before, &after);
+#endif
+    }};
+    t.join();
+    CHECK(restored);
+
+    util::set_thread_name("affinity-main");
+    auto threads = util::thread_cpu_times();
+#ifdef __linux__
+    CHECK(std::any_of(threads.begin(), threads.end(), [](const auto& t) {
+        return t.name == "affinity-main" && t.last_cpu >= 0;
+    }));
+#endif
+}
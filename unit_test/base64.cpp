@@ -0,0 +1,71 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/utils/base64.hpp>
+
+#include <oxenc/base64.h>
+
+#include <random>
+#include <string>
+
+using namespace std::literals;
+using namespace oxen;
+
+TEST_CASE("base64 - encoding", "[base64]") {
+    CHECK(util::base64_encode(""sv) == "");
+    CHECK(util::base64_encode("a"sv) == "YQ==");
+    CHECK(util::base64_encode("ab"sv) == "YWI=");
+    CHECK(util::base64_encode("abc"sv) == "YWJj");
+    CHECK(util::base64_encode("\xff\xfe\xfd\x00\x01"sv) == "//79AAE=");
+
+    // Compare against oxenc for all the sizes around the vectorized block sizes, and some large
+    // message-sized values:
+    std::mt19937_64 rng{1};
+    for (size_t size : {1, 2, 3, 23, 24, 25, 27, 28, 29, 47, 48, 49, 52, 100, 1000, 76800}) {
+        std::string data(size, '\0');
+        for (auto& c : data)
+            c = static_cast<char>(rng());
+        auto encoded = util::base64_encode(data);
+        CHECK(encoded.size() == util::base64_encoded_size(size));
+        CHECK(encoded == oxenc::to_base64(data));
+    }
+}
+
+TEST_CASE("base64 - decoding", "[base64]") {
+    CHECK(util::base64_decode(""sv) == ""s);
+    CHECK(util::base64_decode("YQ=="sv) == "a"s);
+    CHECK(util::base64_decode("YQ"sv) == "a"s);
+    CHECK(util::base64_decode("YWI="sv) == "ab"s);
+    CHECK(util::base64_decode("YWI"sv) == "ab"s);
+    CHECK(util::base64_decode("YWJj"sv) == "abc"s);
+    CHECK(util::base64_decode("//79AAE="sv) == "\xff\xfe\xfd\x00\x01"s);
+    // URL-safe alphabet:
+    CHECK(util::base64_decode("__79AAE"sv) == "\xff\xfe\xfd\x00\x01"s);
+
+    CHECK_FALSE(util::base64_decode("Y"sv));
+    CHECK_FALSE(util::base64_decode("YWJjZ"sv));
+    CHECK_FALSE(util::base64_decode("YQ="sv));
+    CHECK_FALSE(util::base64_decode("Y==="sv));
+    CHECK_FALSE(util::base64_decode("===="sv));
+    CHECK_FALSE(util::base64_decode("YW=j"sv));
+    CHECK_FALSE(util::base64_decode("YWJ*"sv));
+    CHECK_FALSE(util::base64_decode("YWJ\x80"sv));
+
+    std::mt19937_64 rng{2};
+    for (size_t size : {1, 2, 3, 23, 24, 25, 32, 33, 34, 35, 100, 1000, 76800}) {
+        std::string data(size, '\0');
+        for (auto& c : data)
+            c = static_cast<char>(rng());
+        auto encoded = oxenc::to_base64(data);
+        CHECK(util::base64_decode(encoded) == data);
+
+        // Invalid characters anywhere (including inside a vectorized block) must be rejected,
+        // and must agree with oxenc's validation:
+        for (size_t pos : {size_t{0}, encoded.size() / 2, encoded.size() - 1}) {
+            for (char bad : {'*', '\0', '\x80', ' '}) {
+                auto broken = encoded;
+                broken[pos] = bad;
+                CHECK(util::base64_decode(broken).has_value() == oxenc::is_base64(broken));
+            }
+        }
+    }
+}
@@ -0,0 +1,31 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/rpc/client_rpc_endpoints.h>
+
+#include <string>
+#include <type_traits>
+
+using namespace oxen;
+
+TEST_CASE("client rpc - method lookup", "[rpc]") {
+    for (const auto& method : rpc::client_rpc_methods) {
+        auto endpoint = rpc::find_client_rpc(method.name);
+        REQUIRE(endpoint);
+        CHECK(*endpoint == method.index);
+        // The index dispatches to the type that has the name
+        CHECK(rpc::visit_client_rpc(*endpoint, [&](auto t) {
+            for (auto name : decltype(t)::type::names())
+                if (name == method.name)
+                    return true;
+            return false;
+        }));
+    }
+
+    CHECK(rpc::find_client_rpc("get_snodes_for_pubkey") == rpc::find_client_rpc("get_swarm"));
+    CHECK(rpc::visit_client_rpc(*rpc::find_client_rpc("batch"), [](auto t) {
+        return std::is_same_v<typename decltype(t)::type, rpc::batch>;
+    }));
+    for (auto bad : {"", "stor", "storee", "Store", "retrieve ", "no_such_method"})
+        CHECK_FALSE(rpc::find_client_rpc(bad));
+    static_assert(rpc::find_client_rpc("store").has_value());
+}
@@ -0,0 +1,59 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/utils/compression.hpp>
+
+#include <stdexcept>
+#include <string>
+
+using namespace oxen;
+using util::content_encoding;
+
+TEST_CASE("compression - Accept-Encoding negotiation", "[compression]") {
+    CHECK(util::accept_encoding("") == content_encoding::identity);
+    CHECK(util::accept_encoding("br, zstd") == content_encoding::identity);
+    CHECK(util::accept_encoding("gzip") == content_encoding::gzip);
+    CHECK(util::accept_encoding("deflate, gzip") == content_encoding::gzip);
+    CHECK(util::accept_encoding("GZip;q=0.5, deflate") == content_encoding::deflate);
+    CHECK(util::accept_encoding("gzip;q=0, deflate;q=0.001") == content_encoding::deflate);
+    CHECK(util::accept_encoding("gzip; q=0.0, deflate;q=0") == content_encoding::identity);
+    CHECK(util::accept_encoding("br;q=1.0, *;q=0.3") == content_encoding::gzip);
+    CHECK(util::to_string(content_encoding::deflate) == "deflate");
+}
+
+TEST_CASE("compression - round trip", "[compression]") {
+    std::string body;
+    for (int i = 0; i < 2000; i++)
+        body += R"({"hash":"abcdefghijklmnopqrstuvwxyz","timestamp":1690000000000,"data":"QUJD"},)";
+
+    for (auto enc : {content_encoding::gzip, content_encoding::deflate}) {
+        auto c = util::compress(body, enc, 3);
+        CHECK(c.size() < body.size() / 10);
+        CHECK(util::decompress(c, enc, body.size()) == body);
+        CHECK_THROWS_AS(util::decompress(c, enc, body.size() - 1), std::runtime_error);
+        CHECK_THROWS_AS(
+                util::decompress(c.substr(0, c.size() / 2), enc, 1 << 20), std::runtime_error);
+    }
+    // gzip and zlib framing differ
+    CHECK_THROWS_AS(
+            util::decompress(
+                    util::compress(body, content_encoding::gzip, 1),
+                    content_encoding::deflate,
+                    1 << 20),
+            std::runtime_error);
+}
+
+TEST_CASE("compression - size threshold", "[compression]") {
+    util::compression_config config;
+    config.min_size = 1000;
+
+    std::string small(999, 'a'), large(1000, 'a'), orig = large;
+    CHECK_FALSE(util::maybe_compress(small, content_encoding::gzip, config));
+    CHECK_FALSE(util::maybe_compress(large, content_encoding::identity, config));
+    CHECK(util::maybe_compress(large, content_encoding::gzip, config));
+    CHECK(util::decompress(large, content_encoding::gzip, 1000) == orig);
+
+    config.min_size = 0;
+    std::string body = orig;
+    CHECK_FALSE(util::maybe_compress(body, content_encoding::gzip, config));
+    CHECK(body == orig);
+}
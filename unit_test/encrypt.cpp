@@ -91,3 +91,24 @@ TEST_CASE("XChaCha20-Poly1309 encryption", "[encrypt][xchacha20]") {
 
     CHECK_THROWS_AS(alice_server.decrypt_xchacha20(ctext_alice, bob_pubkey), std::runtime_error);
 }
+
+TEST_CASE("Symmetric key caching", "[encrypt][cache]") {
+    ChannelEncryption alice_box{alice_seckey, alice_pubkey};
+    ChannelEncryption bob_box{bob_seckey, bob_pubkey};
+
+    for (auto type : {EncryptType::aes_cbc, EncryptType::aes_gcm, EncryptType::xchacha20}) {
+        // Decrypting replies uses the same key as encrypting, so after the first message with a
+        // given type everything should be a cache hit.
+        auto before = alice_box.get_key_cache_stats();
+        for (int i = 0; i < 3; i++) {
+            auto ctext = alice_box.encrypt(type, plaintext_data, bob_pubkey);
+            CHECK(bob_box.decrypt(type, ctext, alice_pubkey) == plaintext_data);
+            auto reply = bob_box.encrypt(type, plaintext_data, alice_pubkey);
+            CHECK(alice_box.decrypt(type, reply, bob_pubkey) == plaintext_data);
+        }
+        auto after = alice_box.get_key_cache_stats();
+        CHECK(after.misses == before.misses + 1);
+        CHECK(after.hits == before.hits + 5);
+        CHECK(after.size == before.size + 1);
+    }
+}
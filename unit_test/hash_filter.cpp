@@ -0,0 +1,62 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/storage/hash_filter.hpp>
+
+#include <string>
+
+using namespace oxen;
+
+TEST_CASE("hash filter - membership", "[hash_filter]") {
+    HashFilter f{1000};
+    CHECK(f.capacity() == HashFilter::MIN_CAPACITY);
+    CHECK(f.bytes() >= HashFilter::MIN_CAPACITY * HashFilter::COUNTERS_PER_ENTRY / 2);
+
+    const int n = HashFilter::MIN_CAPACITY;
+    for (int i = 0; i < n; i++)
+        f.add("hash" + std::to_string(i));
+    CHECK(f.entries() == n);
+
+    // No false negatives
+    int missing = 0;
+    for (int i = 0; i < n; i++)
+        if (!f.maybe_contains("hash" + std::to_string(i)))
+            missing++;
+    CHECK(missing == 0);
+
+    // At capacity we expect ~2.4% false positives
+    int fp = 0;
+    for (int i = 0; i < n; i++)
+        if (f.maybe_contains("other" + std::to_string(i)))
+            fp++;
+    CHECK(fp > 0);
+    CHECK(fp < n / 25);
+
+    // Removing the odd ones keeps the even ones, and makes most of the odd ones disappear
+    for (int i = 1; i < n; i += 2)
+        f.remove("hash" + std::to_string(i));
+    CHECK(f.entries() == n / 2);
+    int kept = 0;
+    for (int i = 0; i < n; i++)
+        if (f.maybe_contains("hash" + std::to_string(i)))
+            kept++;
+    CHECK(kept >= n / 2);
+    CHECK(kept < n / 2 + n / 50);
+    for (int i = 0; i < n; i += 2)
+        CHECK(f.maybe_contains("hash" + std::to_string(i)));
+}
+
+TEST_CASE("hash filter - saturation", "[hash_filter]") {
+    HashFilter f{0};
+    // Adding the same hash more times than a counter can count saturates its counters, which then
+    // stay set no matter how many times it gets removed.
+    for (int i = 0; i < 20; i++)
+        f.add("hash");
+    for (int i = 0; i < 20; i++)
+        f.remove("hash");
+    CHECK(f.entries() == 0);
+    CHECK(f.maybe_contains("hash"));
+
+    f.add("other");
+    f.remove("other");
+    CHECK_FALSE(f.maybe_contains("other"));
+}
@@ -0,0 +1,28 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/utils/histogram.hpp>
+
+#include <chrono>
+
+using namespace oxen;
+using namespace std::literals;
+
+TEST_CASE("latency histogram - quantiles", "[histogram]") {
+    util::latency_histogram h;
+    CHECK(h.get().quantile(0.5) == 0us);
+
+    for (int i = 0; i < 90; i++)
+        h.record(50us);
+    for (int i = 0; i < 10; i++)
+        h.record(2ms);
+
+    auto s = h.get();
+    CHECK(s.count == 100);
+    CHECK(s.sum_us == 90 * 50 + 10 * 2000);
+    CHECK(s.counts[0] == 90);
+    CHECK(s.quantile(0.5) == 55us);     // 50/90ths of the way through the 0-100us bucket
+    CHECK(s.quantile(0.99) == 2350us);  // 90% of the way through the 1-2.5ms bucket
+
+    h.record(1min);
+    CHECK(h.get().quantile(1.0) == util::latency_histogram::BUCKETS.back());
+}
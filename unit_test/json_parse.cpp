@@ -0,0 +1,76 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/rpc/json_parse.h>
+
+#include <string>
+#include <string_view>
+
+using namespace oxen;
+using namespace std::literals;
+using nlohmann::json;
+
+TEST_CASE("json parsing - simple bodies take the fast path", "[json]") {
+    for (auto body :
+         {R"({"method":"store","params":{"pubkey":"05abcd","ttl":86400000,"data":"aGVsbG8="}})"sv,
+          R"( { "a" : [ 1, -2, 0, true, false, null, [], {} ] , "b" : "" } )"sv,
+          R"({"x":18446744073709551615,"y":-9223372036854775807})"sv,
+          R"({"dup":1,"dup":2})"sv,
+          R"([[[[["deep"]]]]])"sv,
+          R"("just a string")"sv,
+          "12345"sv}) {
+        INFO(body);
+        auto fast = rpc::detail::parse_simple_json(body);
+        REQUIRE(fast);
+        CHECK(*fast == json::parse(body));
+        CHECK(rpc::parse_json(body) == json::parse(body));
+    }
+
+    auto j = rpc::parse_json(R"({"u":5,"i":-5,"dup":1,"dup":2})");
+    CHECK(j["u"].is_number_unsigned());
+    CHECK(j["i"].is_number_integer());
+    CHECK_FALSE(j["i"].is_number_unsigned());
+    CHECK(j["dup"] == 2);
+}
+
+TEST_CASE("json parsing - unusual bodies fall back to nlohmann", "[json]") {
+    for (auto body :
+         {R"({"a":"escaped \"quote\""})"sv,
+          R"({"a":"\u00e9"})"sv,
+          "{\"a\":\"\xc3\xa9\"}"sv,
+          R"({"a":1.5})"sv,
+          R"({"a":1e3})"sv,
+          R"({"a":-0})"sv,
+          R"({"a":18446744073709551616})"sv,
+          R"({"a":123456789012345678901})"sv,
+          R"({"a":-9223372036854775808})"sv}) {
+        INFO(body);
+        CHECK_FALSE(rpc::detail::parse_simple_json(body));
+        auto parsed = rpc::parse_json(body);
+        REQUIRE_FALSE(parsed.is_discarded());
+        CHECK(parsed == json::parse(body));
+    }
+
+    std::string deep = std::string(100, '[') + std::string(100, ']');
+    CHECK_FALSE(rpc::detail::parse_simple_json(deep));
+    CHECK(rpc::parse_json(deep) == json::parse(deep));
+}
+
+TEST_CASE("json parsing - invalid bodies", "[json]") {
+    for (auto body :
+         {""sv,
+          "   "sv,
+          "{"sv,
+          R"({"a":1,})"sv,
+          R"({"a" 1})"sv,
+          R"([1,2)"sv,
+          R"({"a":01})"sv,
+          R"({"a":tru})"sv,
+          R"({"a":"unterminated})"sv,
+          "{\"a\":\"tab\there\"}"sv,
+          R"({"a":1} trailing)"sv,
+          R"({a:1})"sv}) {
+        INFO(body);
+        CHECK_FALSE(rpc::detail::parse_simple_json(body));
+        CHECK(rpc::parse_json(body).is_discarded());
+    }
+}
@@ -0,0 +1,58 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/server/load_shedder.h>
+
+using namespace oxen;
+using namespace std::literals;
+
+using server::LoadShedder;
+
+TEST_CASE("load shedder - sheds only while waits are long", "[load_shedder]") {
+    LoadShedder shedder{100ms};
+    CHECK_FALSE(shedder.shedding());
+    CHECK_FALSE(shedder.shed_low_priority());
+
+    // Short waits never trigger shedding
+    for (int i = 0; i < 100; i++)
+        shedder.record_wait(10ms);
+    CHECK_FALSE(shedder.shedding());
+    CHECK(shedder.average_wait() <= 10ms);
+    CHECK(shedder.average_wait() > 9ms);
+
+    // A single slow job doesn't either
+    shedder.record_wait(500ms);
+    CHECK_FALSE(shedder.shedding());
+
+    // but a sustained backlog does
+    for (int i = 0; i < 20 && !shedder.shedding(); i++)
+        shedder.record_wait(500ms);
+    REQUIRE(shedder.shedding());
+    CHECK(shedder.shed_low_priority());
+    CHECK(shedder.shed_low_priority());
+
+    // Dropping just below the target isn't enough to stop
+    for (int i = 0; i < 100; i++)
+        shedder.record_wait(90ms);
+    CHECK(shedder.shedding());
+
+    // Going below half the target is
+    for (int i = 0; i < 100 && shedder.shedding(); i++)
+        shedder.record_wait(10ms);
+    CHECK_FALSE(shedder.shedding());
+    CHECK_FALSE(shedder.shed_low_priority());
+
+    auto stats = shedder.get_stats();
+    CHECK(stats.shed == 2);
+    CHECK(stats.episodes == 1);
+    CHECK_FALSE(stats.shedding);
+}
+
+TEST_CASE("load shedder - disabled", "[load_shedder]") {
+    LoadShedder shedder{0ms};
+    for (int i = 0; i < 100; i++)
+        shedder.record_wait(10s);
+    CHECK(shedder.average_wait() > 9s);
+    CHECK_FALSE(shedder.shedding());
+    CHECK_FALSE(shedder.shed_low_priority());
+    CHECK(shedder.get_stats().episodes == 0);
+}
@@ -0,0 +1,116 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/logging/oxen_logger.h>
+
+#include <spdlog/logger.h>
+#include <spdlog/sinks/base_sink.h>
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace oxen;
+using namespace std::literals;
+
+namespace {
+
+// Collects messages; optionally blocks writes until released, to make the async sink back up.
+struct collecting_sink : spdlog::sinks::base_sink<std::mutex> {
+    std::vector<std::string> messages;
+    std::mutex gate;
+    size_t flushes = 0;
+
+  protected:
+    void sink_it_(const spdlog::details::log_msg& msg) override {
+        std::lock_guard lock{gate};
+        messages.emplace_back(msg.payload.data(), msg.payload.size());
+    }
+    void flush_() override { flushes++; }
+};
+
+}  // namespace
+
+TEST_CASE("logging - async sink writes everything in order", "[logging]") {
+    auto collect = std::make_shared<collecting_sink>();
+    auto sink = std::make_shared<logging::async_sink>(std::vector<spdlog::sink_ptr>{collect}, 64);
+    spdlog::logger logger{"test", sink};
+    logger.set_level(spdlog::level::trace);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+        threads.emplace_back([&logger, t] {
+            for (int i = 0; i < 10; i++) {
+                logger.info("{}:{}", t, i);
+                std::this_thread::sleep_for(1ms);
+            }
+        });
+    for (auto& t : threads)
+        t.join();
+    logger.flush();
+
+    REQUIRE(collect->messages.size() == 40);
+    CHECK(collect->flushes >= 1);
+    CHECK(sink->get_stats().written == 40);
+    CHECK(sink->get_stats().dropped == 0);
+    // Each thread's messages come out in the order they were logged
+    for (int t = 0; t < 4; t++) {
+        int next = 0;
+        for (auto& m : collect->messages)
+            if (m.substr(0, m.find(':')) == std::to_string(t))
+                CHECK(m == std::to_string(t) + ":" + std::to_string(next++));
+        CHECK(next == 10);
+    }
+
+    sink->stop();
+    logger.info("after stop");
+    CHECK(collect->messages.back() == "after stop");
+}
+
+TEST_CASE("logging - async sink drops when full, except errors", "[logging]") {
+    auto collect = std::make_shared<collecting_sink>();
+    auto sink = std::make_shared<logging::async_sink>(std::vector<spdlog::sink_ptr>{collect}, 16);
+    spdlog::logger logger{"test", sink};
+
+    {
+        // Stall the writer so that the buffer fills up
+        std::unique_lock gate{collect->gate};
+        logger.info("first");
+        std::this_thread::sleep_for(100ms);  // Let the writer pick up "first" and block on it
+        for (int i = 0; i < 100; i++)
+            logger.info("msg {}", i);
+        CHECK(sink->get_stats().dropped > 0);
+        std::thread err{[&] { logger.error("important"); }};
+        gate.unlock();
+        err.join();
+    }
+    sink->stop();
+
+    auto stats = sink->get_stats();
+    CHECK(stats.dropped == 100 - 15);  // "first" holds its slot until written
+    CHECK(stats.queued == 0);
+    CHECK(std::count(collect->messages.begin(), collect->messages.end(), "important") == 1);
+    CHECK(std::any_of(collect->messages.begin(), collect->messages.end(), [](auto& m) {
+        return m.find("dropped 85 log messages") != std::string::npos;
+    }));
+}
+
+TEST_CASE("logging - lazy arguments", "[logging]") {
+    auto collect = std::make_shared<collecting_sink>();
+    spdlog::logger logger{"test", collect};
+    logger.set_level(spdlog::level::info);
+
+    int calls = 0;
+    auto expensive = [&] {
+        calls++;
+        return "expensive"s;
+    };
+    logger.debug("{}", logging::lazy(expensive));
+    CHECK(calls == 0);
+    logger.info("got {}", logging::lazy(expensive));
+    CHECK(calls == 1);
+    REQUIRE(collect->messages.size() == 1);
+    CHECK(collect->messages[0] == "got expensive");
+}
@@ -0,0 +1,194 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/server/monitor_index.h>
+
+#include <oxenmq/oxenmq.h>
+
+#include <algorithm>
+
+using namespace oxen;
+using namespace std::literals;
+
+using server::MonitorIndex;
+
+namespace {
+
+MonitorIndex::account_key account(unsigned char b) {
+    MonitorIndex::account_key k;
+    k.fill(b);
+    k[0] = 0x05;
+    return k;
+}
+
+std::vector<namespace_id> ns(std::initializer_list<int16_t> ids) {
+    std::vector<namespace_id> v;
+    for (auto i : ids)
+        v.push_back(static_cast<namespace_id>(i));
+    return v;
+}
+
+// Distinct service-node style connection ids
+oxenmq::ConnectionID conn(char c) {
+    return oxenmq::ConnectionID{std::string(32, c)};
+}
+
+// Looks up subscribers, splitting them by whether they want data
+void find(
+        const MonitorIndex& idx,
+        const MonitorIndex::account_key& acc,
+        namespace_id n,
+        std::vector<oxenmq::ConnectionID>& plain,
+        std::vector<oxenmq::ConnectionID>& with_data,
+        std::chrono::steady_clock::time_point now) {
+    std::vector<MonitorIndex::subscriber> subs;
+    idx.find(acc, n, subs, now);
+    for (auto& s : subs)
+        (s.want_data ? with_data : plain).push_back(s.conn);
+}
+
+}  // namespace
+
+TEST_CASE("monitor index - subscriptions and lookups", "[monitor]") {
+    MonitorIndex idx;
+    auto now = std::chrono::steady_clock::now();
+    auto c1 = conn('a'), c2 = conn('b');
+
+    CHECK_FALSE(idx.subscribe(account(1), ns({0, 5, -10}), c1, false, false, now));
+    CHECK_FALSE(idx.subscribe(account(1), ns({-30000, 0, 1000}), c2, true, false, now));
+    CHECK(idx.size() == 2);
+
+    std::vector<oxenmq::ConnectionID> plain, with_data;
+    find(idx, account(1), namespace_id::Default, plain, with_data, now);
+    CHECK(plain == std::vector{c1});
+    CHECK(with_data == std::vector{c2});
+
+    plain.clear();
+    with_data.clear();
+    find(idx, account(1), static_cast<namespace_id>(-30000), plain, with_data, now);
+    CHECK(plain.empty());
+    CHECK(with_data == std::vector{c2});
+
+    plain.clear();
+    with_data.clear();
+    find(idx, account(1), static_cast<namespace_id>(3), plain, with_data, now);
+    find(idx, account(2), namespace_id::Default, plain, with_data, now);
+    CHECK(plain.empty());
+    CHECK(with_data.empty());
+
+    // Renewing adds namespaces (and data) rather than replacing them:
+    CHECK(idx.subscribe(account(1), ns({3, 2000}), c1, true, false, now));
+    CHECK(idx.size() == 2);
+    for (auto n : {0, 3, 5, -10, 2000}) {
+        plain.clear();
+        with_data.clear();
+        find(idx, account(1), static_cast<namespace_id>(n), plain, with_data, now);
+        CHECK(plain.empty());
+        CHECK(std::count(with_data.begin(), with_data.end(), c1) == 1);
+    }
+
+    // Batching is likewise turned on (but never off) by a renewal:
+    std::vector<MonitorIndex::subscriber> subs;
+    idx.find(account(1), namespace_id::Default, subs, now);
+    REQUIRE(subs.size() == 2);
+    CHECK_FALSE(subs[0].batch);
+    CHECK_FALSE(subs[1].batch);
+    idx.subscribe(account(1), ns({0}), c2, false, true, now);
+    idx.subscribe(account(1), ns({0}), c2, false, false, now);
+    subs.clear();
+    idx.find(account(1), namespace_id::Default, subs, now);
+    REQUIRE(subs.size() == 2);
+    CHECK_FALSE(subs[0].batch);
+    CHECK(subs[1].conn == c2);
+    CHECK(subs[1].batch);
+    CHECK(subs[1].want_data);
+}
+
+TEST_CASE("monitor index - expiry", "[monitor]") {
+    MonitorIndex idx;
+    auto now = std::chrono::steady_clock::now();
+    auto c1 = conn('a'), c2 = conn('b');
+
+    idx.subscribe(account(1), ns({0}), c1, false, false, now, 10min);
+    idx.subscribe(account(2), ns({0}), c2, false, false, now, 30min);
+    idx.subscribe(account(3), ns({0}), c1, false, false, now);  // DEFAULT_TTL (65min)
+
+    std::vector<oxenmq::ConnectionID> plain, with_data;
+    find(idx, account(1), namespace_id::Default, plain, with_data, now + 11min);
+    CHECK(plain.empty());  // Expired, even though not yet removed
+
+    CHECK(idx.expire(now + 5min) == 0);
+    CHECK(idx.expire(now + 12min) == 1);
+    CHECK(idx.size() == 2);
+
+    // Renewing account 2 before it expires moves it to a later slot:
+    idx.subscribe(account(2), ns({1}), c2, false, false, now + 25min, 30min);
+    CHECK(idx.expire(now + 40min) == 0);
+    CHECK(idx.size() == 2);
+
+    find(idx, account(2), static_cast<namespace_id>(1), plain, with_data, now + 50min);
+    CHECK(plain == std::vector{c2});
+
+    CHECK(idx.expire(now + 57min) == 1);
+    CHECK(idx.expire(now + 67min) == 1);
+    CHECK(idx.size() == 0);
+}
+
+TEST_CASE("monitor index - expiry after a long gap", "[monitor]") {
+    MonitorIndex idx;
+    auto now = std::chrono::steady_clock::now();
+    auto c1 = conn('a');
+
+    idx.subscribe(account(1), ns({0}), c1, false, false, now, 10min);
+    // Nothing expires for a long time, then a new subscription lands in a slot that the catch-up
+    // pass visits before it is due; it must survive (and still expire later).
+    idx.subscribe(account(2), ns({0}), c1, false, false, now + 200min, 60min);
+    CHECK(idx.expire(now + 201min) == 1);
+    CHECK(idx.size() == 1);
+    CHECK(idx.expire(now + 250min) == 0);
+    CHECK(idx.expire(now + 262min) == 1);
+    CHECK(idx.size() == 0);
+}
+
+TEST_CASE("monitor index - memory usage", "[monitor]") {
+    MonitorIndex idx;
+    auto now = std::chrono::steady_clock::now();
+    auto empty = idx.memory_usage();
+
+    for (unsigned char i = 0; i < 50; i++)
+        idx.subscribe(account(i), ns({0, 1}), conn('a'), false, false, now, 10min);
+    auto full = idx.memory_usage();
+    CHECK(full > empty + 50 * sizeof(void*));
+
+    idx.expire(now + 11min);
+    CHECK(idx.size() == 0);
+    CHECK(idx.memory_usage() < full);
+}
+
+TEST_CASE("monitor index - renewal by auth digest", "[monitor]") {
+    MonitorIndex idx;
+    auto now = std::chrono::steady_clock::now();
+    auto c1 = conn('a'), c2 = conn('b');
+    MonitorIndex::auth_digest auth, other;
+    auth.fill(1);
+    other.fill(2);
+
+    // Nothing to renew yet, and a zero digest never renews
+    CHECK_FALSE(idx.renew(account(1), c1, auth, now));
+    idx.subscribe(account(1), ns({0}), c1, false, false, now, 10min);
+    CHECK_FALSE(idx.renew(account(1), c1, MonitorIndex::auth_digest{}, now));
+
+    idx.subscribe(account(1), ns({0}), c1, false, false, now, 10min, auth);
+    CHECK_FALSE(idx.renew(account(1), c1, other, now));
+    CHECK_FALSE(idx.renew(account(1), c2, auth, now));
+    CHECK_FALSE(idx.renew(account(2), c1, auth, now));
+
+    CHECK(idx.renew(account(1), c1, auth, now + 9min, 10min));
+    CHECK(idx.expire(now + 12min) == 0);
+    std::vector<oxenmq::ConnectionID> plain, with_data;
+    find(idx, account(1), static_cast<namespace_id>(0), plain, with_data, now + 12min);
+    CHECK(plain == std::vector{c1});
+
+    // Once lapsed it needs a full subscription again
+    CHECK_FALSE(idx.renew(account(1), c1, auth, now + 20min));
+    CHECK(idx.expire(now + 21min) == 1);
+}
@@ -4,6 +4,8 @@
 
 #include <oxenss/rpc/onion_processing.h>
 
+#include <nlohmann/json.hpp>
+
 using namespace oxen::rpc;
 using namespace oxen::crypto;
 using namespace std::literals;
@@ -89,6 +91,20 @@ TEST_CASE("onion request - relay to snode", "[onion][snode]") {
     CHECK(*std::get_if<RelayToNodeInfo>(&res) == expected);
 }
 
+TEST_CASE("onion request - combined payload parsing", "[onion]") {
+    auto data = prefix + R"#({"headers": ""})#";
+
+    auto [ctext, json] = parse_combined_payload(data);
+
+    CHECK(ctext == ciphertext);
+    // The ciphertext should refer to the payload rather than being copied out of it
+    CHECK(ctext.data() == data.data() + 4);
+    CHECK(json.count("headers"));
+
+    CHECK_THROWS(parse_combined_payload("\x0b\0\0\0ciphertext{}"sv));
+    CHECK_THROWS(parse_combined_payload("\x0a\0\0"sv));
+}
+
 TEST_CASE("onion request - url target filtering", "[onion][relay]") {
     CHECK(is_onion_url_target_allowed("/loki/v3/lsrpc"));
     CHECK(is_onion_url_target_allowed("/loki/oxen/v4/lsrpc"));
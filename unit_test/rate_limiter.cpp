@@ -5,6 +5,8 @@
 #include <oxenmq/oxenmq.h>
 
 #include <chrono>
+#include <sstream>
+#include <string>
 
 using oxen::rpc::RateLimiter;
 using namespace oxen::crypto;
@@ -118,3 +120,80 @@ TEST_CASE("rate limiter - client - max client limit", "[ratelim][client]") {
     const auto delta = 1'000'000us / RateLimiter::TOKEN_RATE;
     CHECK_FALSE(rate_limiter.should_rate_limit_client(overflow_ip, now + delta));
 }
+
+TEST_CASE("rate limiter - client - custom config", "[ratelim][client]") {
+    oxenmq::OxenMQ omq;
+    oxen::rpc::rate_limit_config conf;
+    conf.bucket_size = 10;
+    conf.token_rate = 100;
+    conf.max_clients = 50;
+    RateLimiter rate_limiter{omq, conf};
+    const auto now = std::chrono::steady_clock::now();
+
+    uint32_t ip = (10 << 24) + 1;
+    for (int i = 0; i < 10; ++i)
+        CHECK_FALSE(rate_limiter.should_rate_limit_client(ip, now));
+    CHECK(rate_limiter.should_rate_limit_client(ip, now));
+    CHECK_FALSE(rate_limiter.should_rate_limit_client(ip, now + 10ms));
+
+    // The client limit applies across all shards
+    for (uint32_t i = 1; i < 50; ++i)
+        CHECK_FALSE(rate_limiter.should_rate_limit_client(ip + i, now));
+    CHECK(rate_limiter.should_rate_limit_client(ip + 50, now));
+}
+
+TEST_CASE("rate limiter - client - ipv6 prefixes", "[ratelim][client]") {
+    oxenmq::OxenMQ omq;
+    RateLimiter rate_limiter{omq};
+    const auto now = std::chrono::steady_clock::now();
+
+    // Different addresses within the same /64 share a bucket
+    for (int i = 0; i < RateLimiter::BUCKET_SIZE; ++i)
+        CHECK_FALSE(rate_limiter.should_rate_limit_client(
+                "2001:db8:1:2::" + std::to_string(i % 100 + 1), now));
+    CHECK(rate_limiter.should_rate_limit_client("2001:db8:1:2:ffff:ffff:ffff:ffff", now));
+    CHECK(rate_limiter.should_rate_limit_client("[2001:db8:1:2::1]", now));
+
+    // ... but the neighbouring /64 does not
+    CHECK_FALSE(rate_limiter.should_rate_limit_client("2001:db8:1:3::1", now));
+
+    // IPv4-mapped addresses share the bucket of the IPv4 address
+    for (int i = 0; i < RateLimiter::BUCKET_SIZE; ++i)
+        CHECK_FALSE(rate_limiter.should_rate_limit_client("10.1.1.13", now));
+    CHECK(rate_limiter.should_rate_limit_client("::ffff:10.1.1.13", now));
+    std::string packed{"\x0a\x01\x01\x0d", 4};
+    CHECK(rate_limiter.should_rate_limit_client_addr(packed, now));
+    CHECK(rate_limiter.should_rate_limit_client_addr("bad", now));
+}
+
+// Returns an address in the `i`th /48 of 2001:db8::/32
+static std::string fmt_prefix(int i) {
+    std::ostringstream addr;
+    addr << "2001:db8:" << std::hex << i << "::1";
+    return addr.str();
+}
+
+TEST_CASE("rate limiter - client - ipv6 table is bounded", "[ratelim][client]") {
+    oxenmq::OxenMQ omq;
+    oxen::rpc::rate_limit_config conf;
+    conf.ipv6_prefix = 48;
+    conf.ipv6_buckets = 128;  // i.e. 8 per shard
+    RateLimiter rate_limiter{omq, conf};
+    const auto now = std::chrono::steady_clock::now();
+
+    // With a /48 prefix, everything in 2001:db8:1::/48 shares a bucket
+    for (int i = 0; i < RateLimiter::BUCKET_SIZE; ++i)
+        CHECK_FALSE(rate_limiter.should_rate_limit_client("2001:db8:1:1::1", now));
+    CHECK(rate_limiter.should_rate_limit_client("2001:db8:1:ffff::1", now));
+
+    // Rotating through lots of prefixes can only ever occupy the fixed table; once it is full of
+    // active buckets, new prefixes get limited.
+    int limited = 0;
+    for (int i = 0; i < 1000; ++i)
+        limited += rate_limiter.should_rate_limit_client(fmt_prefix(i), now);
+    CHECK(limited >= 1000 - 128);
+
+    // Once buckets refill their slots get reused
+    const auto later = now + std::chrono::seconds{10};
+    CHECK_FALSE(rate_limiter.should_rate_limit_client(fmt_prefix(5000), later));
+}
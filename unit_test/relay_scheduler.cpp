@@ -0,0 +1,184 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/snode/relay_scheduler.h>
+
+#include <string>
+#include <vector>
+
+using namespace oxen;
+using namespace std::literals;
+
+using snode::relay_chunk;
+using snode::relay_position;
+using snode::RelayScheduler;
+
+namespace {
+
+snode::sn_record peer(unsigned char b) {
+    snode::sn_record sn;
+    sn.pubkey_legacy.fill(b);
+    return sn;
+}
+
+// Fake network and database: sends are recorded for the test to answer, and each loaded chunk
+// covers 10 swarm space values with one batch named after where it starts.
+struct fake_relay {
+    struct sent {
+        crypto::legacy_pubkey pk;
+        std::string batch;
+        std::function<void(bool)> done;
+    };
+    std::vector<sent> sends;
+    std::vector<relay_position> loads;
+
+    RelayScheduler make(snode::relay_config config = {}) {
+        return RelayScheduler{
+                [this](const snode::sn_record& sn, const std::string& batch, auto done) {
+                    sends.push_back({sn.pubkey_legacy, batch, std::move(done)});
+                },
+                [this](const snode::sn_record&,
+                       const RelayScheduler::ranges_t& ranges,
+                       relay_position from) {
+                    loads.push_back(from);
+                    relay_chunk chunk;
+                    chunk.batches.push_back(
+                            std::to_string(from.range) + ":" + std::to_string(from.next));
+                    auto hi = ranges[from.range].second;
+                    if (from.next + 10 <= hi)
+                        chunk.next = relay_position{from.range, from.next + 10};
+                    else if (from.range + 1 < ranges.size())
+                        chunk.next = relay_position{from.range + 1, ranges[from.range + 1].first};
+                    return chunk;
+                },
+                config};
+    }
+
+    // Answers the oldest outstanding send
+    void reply(bool success) {
+        REQUIRE_FALSE(sends.empty());
+        auto s = std::move(sends.front());
+        sends.erase(sends.begin());
+        s.done(success);
+    }
+};
+
+}  // namespace
+
+TEST_CASE("relay scheduler - in-flight window", "[relay]") {
+    fake_relay f;
+    auto sched = f.make();
+    auto a = peer(1);
+
+    sched.relay(a, {{0, 29}, {100, 109}});
+    // Only a window's worth gets loaded and sent:
+    REQUIRE(f.sends.size() == snode::RELAY_WINDOW);
+    CHECK(f.sends[0].batch == "0:0");
+    CHECK(f.sends[1].batch == "0:10");
+
+    // The same relay again is a no-op:
+    sched.relay(a, {{0, 29}, {100, 109}});
+    CHECK(f.sends.size() == snode::RELAY_WINDOW);
+
+    auto stats = sched.get_stats().at(a.pubkey_legacy);
+    CHECK(stats.relays == 1);
+    CHECK(stats.in_flight == 2);
+    CHECK(stats.progress == 0);
+
+    f.reply(true);
+    REQUIRE(f.sends.size() == 2);
+    CHECK(f.sends[1].batch == "0:20");
+    CHECK(sched.get_stats().at(a.pubkey_legacy).progress == Approx(0.25));
+
+    f.reply(true);
+    f.reply(true);
+    REQUIRE(f.sends.size() == 1);
+    CHECK(f.sends[0].batch == "1:100");
+    f.reply(true);
+    CHECK(f.sends.empty());
+
+    stats = sched.get_stats().at(a.pubkey_legacy);
+    CHECK(stats.sent == 4);
+    CHECK(stats.sent_bytes == 3 + 4 + 4 + 5);
+    CHECK(stats.in_flight == 0);
+    CHECK(stats.progress == 1);
+
+    // Finished relays get retired, after which the same relay can be queued again
+    sched.relay(a, {{0, 29}, {100, 109}});
+    CHECK(f.sends.size() == 2);
+    CHECK(sched.get_stats().at(a.pubkey_legacy).relays == 1);
+}
+
+TEST_CASE("relay scheduler - retry with backoff", "[relay]") {
+    fake_relay f;
+    auto sched = f.make();
+    auto a = peer(1), b = peer(2);
+
+    sched.relay(a, {{0, 9}});
+    sched.relay(b, {{0, 9}});
+    REQUIRE(f.sends.size() == 2);
+
+    f.reply(false);
+    // The failed batch waits out its backoff...
+    REQUIRE(f.sends.size() == 1);
+    CHECK(f.sends[0].pk == b.pubkey_legacy);
+    sched.tick();
+    CHECK(f.sends.size() == 1);
+    auto stats = sched.get_stats().at(a.pubkey_legacy);
+    CHECK(stats.failures == 1);
+    CHECK(stats.queued == 1);
+
+    // ...without holding up other peers:
+    f.reply(true);
+    CHECK(sched.get_stats().at(b.pubkey_legacy).progress == 1);
+
+    sched.tick(std::chrono::steady_clock::now() + snode::RELAY_BACKOFF_BASE * 2);
+    REQUIRE(f.sends.size() == 1);
+    CHECK(f.sends[0].pk == a.pubkey_legacy);
+    CHECK(f.sends[0].batch == "0:0");
+    f.reply(true);
+    stats = sched.get_stats().at(a.pubkey_legacy);
+    CHECK(stats.sent == 1);
+    CHECK(stats.progress == 1);
+    CHECK(f.loads.size() == 2);  // The retry didn't reload anything
+}
+
+TEST_CASE("relay scheduler - abandon and resume from checkpoint", "[relay]") {
+    fake_relay f;
+    snode::relay_config config;
+    config.max_attempts = 2;
+    config.window = 1;
+    auto sched = f.make(config);
+    auto a = peer(1);
+
+    sched.relay(a, {{0, 99}});
+    f.reply(true);
+    f.reply(true);
+    REQUIRE(f.sends.size() == 1);
+    CHECK(f.sends[0].batch == "0:20");
+
+    f.reply(false);
+    sched.tick(std::chrono::steady_clock::now() + 1h);
+    f.reply(false);
+    CHECK(f.sends.empty());
+    auto stats = sched.get_stats().at(a.pubkey_legacy);
+    CHECK(stats.abandoned == 1);
+    CHECK(stats.relays == 0);
+
+    // Relaying the same ranges again picks up from the last acknowledged position:
+    f.loads.clear();
+    sched.relay(a, {{0, 99}});
+    REQUIRE(f.sends.size() == 1);
+    CHECK(f.sends[0].batch == "0:20");
+    REQUIRE(f.loads.size() == 1);
+    CHECK(f.loads[0] == relay_position{0, 20});
+    stats = sched.get_stats().at(a.pubkey_legacy);
+    CHECK(stats.resumed == 1);
+    CHECK(stats.progress == Approx(0.2));
+
+    // Nothing more goes out once stopped:
+    sched.stop();
+    f.reply(true);
+    sched.relay(a, {{0, 49}});
+    CHECK(f.sends.empty());
+    CHECK(sched.get_stats().empty());
+}
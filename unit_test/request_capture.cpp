@@ -0,0 +1,115 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/rpc/request_capture.h>
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace oxen;
+using namespace std::literals;
+using nlohmann::json;
+
+namespace {
+std::vector<json> read_capture(const std::filesystem::path& file) {
+    std::vector<json> lines;
+    std::ifstream in{file};
+    for (std::string line; std::getline(in, line);)
+        lines.push_back(json::parse(line));
+    return lines;
+}
+}  // namespace
+
+TEST_CASE("request capture - anonymized request shapes", "[capture]") {
+    auto file = std::filesystem::temp_directory_path() / "oxenss-test-request-capture";
+    std::filesystem::remove(file);
+    {
+        rpc::RequestCapture capture{{file, 1.0}};
+        REQUIRE(capture.enabled());
+
+        std::string pk1 = "05" + std::string(64, 'a'), pk2 = "05" + std::string(64, 'b');
+        auto req = capture.sample("client", "https", "batch");
+        REQUIRE(req);
+        capture.describe(
+                *req,
+                json{{"requests",
+                      {{{"method", "store"},
+                        {"params",
+                         {{"pubkey", pk1},
+                          {"namespace", 3},
+                          {"data", std::string(100, 'x')},
+                          {"ttl", 60000},
+                          {"signature", "sig"}}}},
+                       {{"method", "retrieve"},
+                        {"params", {{"pubkey", pk1}, {"last_hash", "abc"}, {"max_count", 5}}}},
+                       {{"method", "delete"},
+                        {"params", {{"pubkey", pk2}, {"messages", {"a", "b", "c"}}}}}}}});
+        capture.finish(*req, 200, json{{"results", json::array()}});
+
+        auto retrieve = capture.sample("client", "omq", "retrieve");
+        capture.describe(*retrieve, json{{"pubkey", pk2}, {"namespace", "all"}});
+        capture.finish(*retrieve, 200, R"({"messages":[],"more":false})"sv);
+    }
+
+    auto lines = read_capture(file);
+    std::filesystem::remove(file);
+    REQUIRE(lines.size() == 3);
+    CHECK(lines[0]["capture"] == 1);
+    CHECK(lines[0]["sample_rate"] == 1.0);
+
+    auto& batch = lines[1];
+    CHECK(batch["kind"] == "client");
+    CHECK(batch["transport"] == "https");
+    CHECK(batch["method"] == "batch");
+    CHECK(batch["status"] == 200);
+    CHECK(batch.contains("latency_us"));
+    REQUIRE(batch["sub"].size() == 3);
+    auto &store = batch["sub"][0], &ret = batch["sub"][1], &del = batch["sub"][2];
+    CHECK(store["method"] == "store");
+    CHECK(store["ns"] == 3);
+    CHECK(store["data"] == 100);
+    CHECK(store["ttl"] == 60000);
+    CHECK(ret["last_hash"] == true);
+    CHECK(ret["max_count"] == 5);
+    CHECK(del["count"] == 3);
+    // The same account gets the same number, and nothing identifying is kept
+    CHECK(store["account"] == ret["account"]);
+    CHECK(store["account"] != del["account"]);
+    auto dumped = batch.dump();
+    CHECK(dumped.find("aaaa") == std::string::npos);
+    CHECK(dumped.find("sig") == std::string::npos);
+    CHECK(dumped.find("abc") == std::string::npos);
+
+    auto& retrieve = lines[2];
+    CHECK(retrieve["transport"] == "omq");
+    CHECK(retrieve["ns"] == "all");
+    CHECK(retrieve["account"] == del["account"]);
+    CHECK(retrieve["hit"] == false);
+}
+
+TEST_CASE("request capture - sampling and size limit", "[capture]") {
+    CHECK_FALSE(rpc::RequestCapture{}.enabled());
+    CHECK_FALSE(rpc::RequestCapture{{"", 1.0}}.enabled());
+
+    auto file = std::filesystem::temp_directory_path() / "oxenss-test-request-capture-limit";
+    {
+        rpc::RequestCapture capture{{file, 1.0, 300}};
+        REQUIRE(capture.enabled());
+        for (int i = 0; i < 10; i++)
+            if (auto req = capture.sample("onion", ""))
+                capture.finish(*req, 200, "response"sv);
+        // Stopped once the next entry would have gone over the limit
+        CHECK_FALSE(capture.enabled());
+        CHECK_FALSE(capture.sample("onion", ""));
+    }
+    CHECK(std::filesystem::file_size(file) <= 300);
+    auto lines = read_capture(file);
+    std::filesystem::remove(file);
+    CHECK(lines.size() > 1);
+    CHECK(lines.size() < 11);
+
+    rpc::RequestCapture never{{file, 0.0}};
+    CHECK_FALSE(never.enabled());
+    std::filesystem::remove(file);
+}
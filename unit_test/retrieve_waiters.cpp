@@ -0,0 +1,163 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/server/retrieve_waiters.h>
+
+#include <string>
+
+using namespace oxen;
+using namespace std::literals;
+
+using server::RetrieveWaiters;
+
+namespace {
+
+RetrieveWaiters::account_key account(unsigned char b) {
+    RetrieveWaiters::account_key k;
+    k.fill(b);
+    k[0] = 0x05;
+    return k;
+}
+
+constexpr auto ns0 = namespace_id::Default;
+constexpr auto ns5 = namespace_id::SessionSync;
+
+// Runs the callbacks, returning how many there were
+size_t run(std::vector<RetrieveWaiters::callback>& cbs) {
+    for (auto& cb : cbs)
+        cb();
+    auto n = cbs.size();
+    cbs.clear();
+    return n;
+}
+
+}  // namespace
+
+TEST_CASE("retrieve waiters - wake on new message", "[retrieve_waiters]") {
+    RetrieveWaiters w;
+    auto now = std::chrono::steady_clock::now();
+    std::string resumed;
+    auto resume = [&resumed](char c) { return [&resumed, c] { resumed += c; }; };
+
+    REQUIRE(w.add(account(1), ns0, 10s, resume('a'), now));
+    REQUIRE(w.add(account(1), ns5, 10s, resume('b'), now));
+    REQUIRE(w.add(account(1), ns0, 10s, resume('c'), now));
+    REQUIRE(w.add(account(2), ns0, 10s, resume('d'), now));
+    CHECK(w.size() == 4);
+
+    std::vector<RetrieveWaiters::callback> cbs;
+    w.wake(account(3), ns0, cbs);
+    w.wake(account(1), namespace_id::ClosedV2, cbs);
+    CHECK(cbs.empty());
+
+    w.wake(account(1), ns0, cbs);
+    CHECK(run(cbs) == 2);
+    CHECK(resumed == "ac");
+    CHECK(w.size() == 2);
+
+    // Each waiter is only handed back once
+    w.wake(account(1), ns0, cbs);
+    CHECK(cbs.empty());
+
+    w.wake(account(1), ns5, cbs);
+    w.wake(account(2), ns0, cbs);
+    CHECK(run(cbs) == 2);
+    CHECK(resumed == "acbd");
+    CHECK(w.size() == 0);
+
+    // Woken waiters don't also time out
+    w.expire(cbs, now + 1min);
+    CHECK(cbs.empty());
+}
+
+TEST_CASE("retrieve waiters - timeouts", "[retrieve_waiters]") {
+    RetrieveWaiters w;
+    auto now = std::chrono::steady_clock::now();
+    int resumed = 0;
+    auto resume = [&resumed] { resumed++; };
+
+    REQUIRE(w.add(account(1), ns0, 1s, resume, now));
+    REQUIRE(w.add(account(1), ns0, 5s, resume, now));
+    REQUIRE(w.add(account(2), ns0, 2s, resume, now));
+    // Longer than the wheel covers, so clamped to MAX_WAIT:
+    REQUIRE(w.add(account(3), ns0, 1h, resume, now));
+    CHECK(w.size() == 4);
+
+    std::vector<RetrieveWaiters::callback> cbs;
+    w.expire(cbs, now + 500ms);
+    CHECK(cbs.empty());
+    // Timeouts get noticed by the end of the tick after the deadline
+    w.expire(cbs, now + 1s + 2 * RetrieveWaiters::WHEEL_TICK);
+    CHECK(run(cbs) == 1);
+    w.expire(cbs, now + 3s);
+    CHECK(run(cbs) == 1);
+    CHECK(w.size() == 2);
+
+    // Falling behind by a lot still expires things (and only once)
+    w.expire(cbs, now + RetrieveWaiters::MAX_WAIT - 1s);
+    CHECK(run(cbs) == 1);
+    w.expire(cbs, now + RetrieveWaiters::MAX_WAIT + 2 * RetrieveWaiters::WHEEL_TICK);
+    CHECK(run(cbs) == 1);
+    CHECK(w.size() == 0);
+    CHECK(resumed == 4);
+
+    w.expire(cbs, now + 2h);
+    CHECK(cbs.empty());
+
+    // A waiter added with a time that expire() has already gone past still times out on the next
+    // tick, rather than a full turn of the wheel later
+    REQUIRE(w.add(account(1), ns0, 1s, resume, now + 2h - 5s));
+    w.expire(cbs, now + 2h + 2 * RetrieveWaiters::WHEEL_TICK);
+    CHECK(run(cbs) == 1);
+    CHECK(w.size() == 0);
+}
+
+TEST_CASE("retrieve waiters - limits", "[retrieve_waiters]") {
+    RetrieveWaiters w{5, 3};
+    auto now = std::chrono::steady_clock::now();
+    auto noop = [] {};
+
+    CHECK(w.add(account(1), ns0, 1s, noop, now));
+    CHECK(w.add(account(1), ns5, 1s, noop, now));
+    CHECK(w.add(account(1), ns0, 1s, noop, now));
+    CHECK_FALSE(w.add(account(1), ns0, 1s, noop, now));
+    CHECK(w.add(account(2), ns0, 1s, noop, now));
+    CHECK(w.add(account(3), ns0, 1s, noop, now));
+    CHECK_FALSE(w.add(account(4), ns0, 1s, noop, now));
+    CHECK(w.size() == 5);
+
+    // Waking some frees up room for more
+    std::vector<RetrieveWaiters::callback> cbs;
+    w.wake(account(1), ns0, cbs);
+    CHECK(cbs.size() == 2);
+    CHECK(w.add(account(1), ns0, 1s, noop, now));
+    CHECK(w.add(account(4), ns0, 1s, noop, now));
+    CHECK(w.size() == 5);
+}
+
+TEST_CASE("retrieve waiters - cancel", "[retrieve_waiters]") {
+    RetrieveWaiters w{5, 2};
+    auto now = std::chrono::steady_clock::now();
+    int resumed = 0;
+    auto resume = [&resumed] { resumed++; };
+
+    auto a = w.add(account(1), ns0, 1s, resume, now);
+    auto b = w.add(account(1), ns0, 1s, resume, now);
+    REQUIRE(a);
+    REQUIRE(b);
+    CHECK_FALSE(w.add(account(1), ns0, 1s, resume, now));
+
+    // Cancelling frees up the account's place without resuming anything
+    CHECK(w.cancel(account(1), *a));
+    CHECK_FALSE(w.cancel(account(1), *a));
+    CHECK_FALSE(w.cancel(account(2), *b));
+    CHECK(w.size() == 1);
+    CHECK(w.add(account(1), ns0, 1s, resume, now));
+
+    std::vector<RetrieveWaiters::callback> cbs;
+    w.wake(account(1), ns0, cbs);
+    CHECK(run(cbs) == 2);
+    CHECK_FALSE(w.cancel(account(1), *b));
+    w.expire(cbs, now + 1min);
+    CHECK(cbs.empty());
+    CHECK(resumed == 2);
+}
@@ -1,6 +1,9 @@
 #include <oxenss/snode/serialization.h>
 #include <oxenss/snode/service_node.h>
+#include <oxenss/server/omq.h>
+#include <oxenc/bt_serialize.h>
 #include <oxenc/hex.h>
+#include <nlohmann/json.hpp>
 
 #include <catch2/catch.hpp>
 
@@ -67,3 +70,120 @@ TEST_CASE("v1 serialization - batch serialization", "[serialization]") {
     serialized = serialize_messages(msgs.begin(), msgs.end(), 1);
     CHECK(serialized.size() == 2);
 }
+
+TEST_CASE("v2 serialization - grouped values", "[serialization]") {
+    oxen::user_pubkey_t pk1, pk2;
+    REQUIRE(pk1.load("054368520005786b249bcd461d28f75e560ea794014eeb17fcf6003f37d876783e"s));
+    REQUIRE(pk2.load("03aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"s));
+    const std::chrono::system_clock::time_point timestamp{12'345'678ms};
+    std::vector<oxen::message> msgs;
+    msgs.emplace_back(
+            pk1, "h1", oxen::namespace_id::Default, timestamp + 5ms, timestamp + 1h, "d\x00"s);
+    msgs.emplace_back(
+            pk1, "h2", static_cast<oxen::namespace_id>(-5), timestamp, timestamp + 2h, "data");
+    msgs.emplace_back(
+            pk2, "h3", static_cast<oxen::namespace_id>(42), timestamp + 1s, timestamp + 1h, "x");
+
+    auto serialized = serialize_messages(msgs.begin(), msgs.end(), SERIALIZATION_VERSION_GROUPED);
+    REQUIRE(serialized.size() == 1);
+    CHECK(serialized.front() ==
+          "\x02l"
+          "i12345678e"
+          "i15945678e"
+          "l"
+          "l33:\x05\x43\x68\x52\x00\x05\x78\x6b\x24\x9b\xcd\x46\x1d\x28\xf7\x5e\x56"
+          "\x0e\xa7\x94\x01\x4e\xeb\x17\xfc\xf6\x00\x3f\x37\xd8\x76\x78\x3e"
+          "l"
+          "l2:h1i0ei5ei0e2:d\x00" "e"
+          "l2:h2i-5ei0ei3600000e4:datae"
+          "e"
+          "e"
+          "l33:\x03\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa"
+          "\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa\xaa"
+          "l"
+          "l2:h3i42ei1000ei0e1:xe"
+          "e"
+          "e"
+          "e"
+          "e"s);
+
+    auto v1 = serialize_messages(msgs.begin(), msgs.end(), SERIALIZATION_VERSION_BT);
+    REQUIRE(v1.size() == 1);
+    CHECK(serialized.front().size() < v1.front().size());
+
+    const auto messages = deserialize_messages(serialized.front());
+    REQUIRE(messages.size() == msgs.size());
+    for (size_t i = 0; i < messages.size(); ++i) {
+        CHECK(messages[i].pubkey == msgs[i].pubkey);
+        CHECK(messages[i].hash == msgs[i].hash);
+        CHECK(messages[i].msg_namespace == msgs[i].msg_namespace);
+        CHECK(messages[i].timestamp == msgs[i].timestamp);
+        CHECK(messages[i].expiry == msgs[i].expiry);
+        CHECK(messages[i].data == msgs[i].data);
+    }
+
+    // Unknown versions are rejected:
+    CHECK(deserialize_messages("\x03" + serialized.front().substr(1)).empty());
+    CHECK_THROWS(serialize_messages(msgs.begin(), msgs.end(), 3));
+}
+
+TEST_CASE("v2 serialization - batch serialization", "[serialization]") {
+    oxen::user_pubkey_t pub_key;
+    REQUIRE(pub_key.load("054368520005786b249bcd461d28f75e560ea794014eeb17fcf6003f37d876783e"s));
+    const std::chrono::system_clock::time_point timestamp{1'622'576'077s};
+    std::vector<oxen::message> msgs;
+    msgs.emplace_back(
+            pub_key,
+            "hash",
+            oxen::namespace_id::Default,
+            timestamp,
+            timestamp + 24h,
+            std::string(100000, 'x'));
+    const size_t per_batch = SERIALIZATION_BATCH_SIZE / serialized_size(msgs.front());
+    msgs = {per_batch + 1, msgs.front()};
+    auto serialized = serialize_messages(msgs.begin(), msgs.end(), SERIALIZATION_VERSION_GROUPED);
+    REQUIRE(serialized.size() == 2);
+    size_t count = 0;
+    for (const auto& s : serialized) {
+        CHECK(s.size() <= SERIALIZATION_BATCH_SIZE);
+        count += deserialize_messages(s).size();
+    }
+    CHECK(count == msgs.size());
+}
+
+TEST_CASE("bt serialization of json responses", "[serialization][bt]") {
+    auto j = nlohmann::json{
+            {"swarm",
+             {{"abcd", {{"hash", "h\x00sh"s}, {"t", 12345}, {"failed", false}}},
+              {"0123", {{"deleted", {"a", "b"}}, {"neg", -7}}}}},
+            {"hf", {19, 3}},
+            {"t", uint64_t{1'700'000'000'000}},
+            {"empty", nlohmann::json::object()},
+            {"list", nlohmann::json::array()}};
+
+    auto expected = oxenc::bt_serialize(oxen::server::json_to_bt(j));
+    CHECK(oxen::server::bt_serialize_json(j) == expected);
+    CHECK(oxen::server::bt_to_json(oxenc::bt_dict_consumer{expected}) ==
+          oxen::server::bt_to_json(oxenc::bt_dict_consumer{oxen::server::bt_serialize_json(j)}));
+
+    CHECK_THROWS(oxen::server::bt_serialize_json(nlohmann::json{{"x", 1.5}}));
+    CHECK_THROWS(oxen::server::bt_serialize_json(nlohmann::json{{"x", nullptr}}));
+}
+
+TEST_CASE("storage_cc_batch reply serialization", "[serialization][bt]") {
+    using oxen::server::OMQ;
+    std::vector<std::vector<std::string>> replies{
+            {"d7:deletedle9:signature3:sige"}, {"404", "not found"}, {""}, {}};
+    auto encoded = OMQ::encode_batch_replies(replies);
+    CHECK(encoded == "ll29:d7:deletedle9:signature3:sigeel3:4049:not foundel0:eelee");
+    CHECK(encoded == oxenc::bt_serialize(oxenc::bt_list{
+                             oxenc::bt_list{"d7:deletedle9:signature3:sige"},
+                             oxenc::bt_list{"404", "not found"},
+                             oxenc::bt_list{""},
+                             oxenc::bt_list{}}));
+    CHECK(OMQ::decode_batch_replies(encoded) == replies);
+    CHECK(OMQ::encode_batch_replies({}) == "le");
+    CHECK(OMQ::decode_batch_replies("le").empty());
+    CHECK_THROWS(OMQ::decode_batch_replies("l3:abce"));
+    CHECK_THROWS(OMQ::decode_batch_replies("ll3:abc"));
+}
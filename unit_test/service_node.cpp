@@ -81,4 +81,11 @@ TEST_CASE("service nodes - message hashing", "[service-nodes][messages]") {
     auto expected = "4sMyAuaZlMwww3oFvfhazfw7ASx/7TDtO+TVc8aAjHs";
     CHECK(oxen::rpc::computeMessageHash(pk, oxen::namespace_id::Default, data) == expected);
     CHECK(oxen::rpc::compute_hash_blake2b_b64({pk.prefixed_raw() + data}) == expected);
+    // However the data is split into parts:
+    auto prefixed = pk.prefixed_raw();
+    CHECK(oxen::rpc::blake2b_b64(prefixed, data).view() == expected);
+    CHECK(oxen::rpc::blake2b_b64(prefixed + data).str() == expected);
+    CHECK(oxen::rpc::compute_hash_blake2b_b64(
+                  {std::string_view{prefixed}.substr(0, 1), std::string_view{prefixed}.substr(1),
+                   ""sv, data}) == expected);
 }
@@ -0,0 +1,61 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/utils/single_flight.hpp>
+
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace oxen;
+using namespace std::literals;
+
+TEST_CASE("single flight - joins identical computations in flight", "[single_flight]") {
+    util::SingleFlight<std::string, std::string> sf;
+
+    // Block the first computation so that other calls can join it
+    std::promise<void> started, release;
+    auto blocker = release.get_future();
+    std::vector<std::string> results;
+    std::mutex results_mutex;
+    auto record = [&](const std::string& r) {
+        std::lock_guard lock{results_mutex};
+        results.push_back(r);
+    };
+
+    int computed = 0;
+    std::thread first{[&] {
+        CHECK(sf.run(
+                "a",
+                [&] {
+                    started.set_value();
+                    blocker.wait();
+                    computed++;
+                    return "result a"s;
+                },
+                record));
+    }};
+    started.get_future().wait();
+    CHECK(sf.in_flight() == 1);
+
+    // Same key: joins, without computing anything
+    CHECK_FALSE(sf.run("a", [] { return "wrong"s; }, record));
+    CHECK_FALSE(sf.run("a", [] { return "wrong"s; }, record));
+    // A different key runs on its own
+    CHECK(sf.run("b", [] { return "result b"s; }, record));
+    CHECK(results == std::vector{"result b"s});
+
+    release.set_value();
+    first.join();
+    CHECK(computed == 1);
+    CHECK(results == std::vector{"result b"s, "result a"s, "result a"s, "result a"s});
+    CHECK(sf.in_flight() == 0);
+    CHECK(sf.executed() == 2);
+    CHECK(sf.coalesced() == 2);
+
+    // Nothing is cached: the next call for a finished key computes again
+    CHECK(sf.run("a", [] { return "again"s; }, record));
+    CHECK(results.back() == "again");
+    CHECK(sf.executed() == 3);
+}
@@ -0,0 +1,62 @@
+#include <oxenss/snode/stats.h>
+#include <oxenss/utils/ring_buffer.hpp>
+
+#include <catch2/catch.hpp>
+#include <oxenmq/oxenmq.h>
+
+#include <thread>
+#include <vector>
+
+using namespace oxen;
+
+TEST_CASE("ring buffer - drops the oldest when full", "[stats][ring]") {
+    util::ring_buffer<int, 3> r;
+    REQUIRE(r.empty());
+    r.push_back(1);
+    r.push_back(2);
+    REQUIRE(r.size() == 2);
+    REQUIRE(r.front() == 1);
+    REQUIRE(r.back() == 2);
+
+    r.push_back(3);
+    r.push_back(4);
+    REQUIRE(r.full());
+    REQUIRE(std::vector<int>(r.begin(), r.end()) == std::vector<int>{2, 3, 4});
+
+    r.pop_front();
+    r.push_back(5);
+    r.push_back(6);
+    REQUIRE(std::vector<int>(r.begin(), r.end()) == std::vector<int>{4, 5, 6});
+    REQUIRE(r[1] == 5);
+
+    r.clear();
+    REQUIRE(r.empty());
+}
+
+TEST_CASE("stats - peer reports merge per-thread shards", "[stats]") {
+    oxenmq::OxenMQ omq;
+    snode::all_stats_t stats{omq, {}};
+    auto pk = crypto::legacy_pubkey::from_hex(
+            "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abc000");
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; i++)
+        threads.emplace_back([&] {
+            for (int j = 0; j < 100; j++) {
+                stats.record_request_failed(pk);
+                stats.record_storage_test_result(pk, snode::ResultType::OK);
+            }
+            stats.record_push_failed(pk);
+        });
+    for (auto& t : threads)
+        t.join();
+
+    auto report = stats.peer_report();
+    REQUIRE(report.size() == 1);
+    auto& peer = report[pk];
+    CHECK(peer.requests_failed == 400);
+    CHECK(peer.pushes_failed == 4);
+    REQUIRE(peer.storage_tests.size() == snode::STORAGE_TESTS_KEPT);
+    for (size_t i = 1; i < peer.storage_tests.size(); i++)
+        CHECK(peer.storage_tests[i - 1].timestamp <= peer.storage_tests[i].timestamp);
+}
@@ -1,10 +1,18 @@
 #include <oxenss/storage/database.hpp>
+#include <oxenss/storage/hash_filter.hpp>
+#include <oxenss/storage/journal.hpp>
 
 #include <oxenss/logging/oxen_logger.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <stdexcept>
 #include <string>
 #include <thread>
 
@@ -15,8 +23,21 @@ using namespace oxen;
 using namespace std::literals;
 
 struct StorageDeleter {
-    StorageDeleter() { std::filesystem::remove("storage.db"); }
-    ~StorageDeleter() { std::filesystem::remove("storage.db"); }
+    StorageDeleter() { remove(); }
+    ~StorageDeleter() { remove(); }
+
+    // Removes storage.db as well as any sharded storage-I-of-N.db files (and their payload
+    // segment directories)
+    static void remove() {
+        std::vector<std::filesystem::path> dbs;
+        for (const auto& entry : std::filesystem::directory_iterator{"."}) {
+            auto name = entry.path().filename().u8string();
+            if (name.rfind("storage.db", 0) == 0 || name.rfind("storage-", 0) == 0)
+                dbs.push_back(entry.path());
+        }
+        for (const auto& db : dbs)
+            std::filesystem::remove_all(db);
+    }
 };
 
 TEST_CASE("storage - database file creation", "[storage]") {
@@ -231,6 +252,45 @@ TEST_CASE("storage - remove expired entries", "[storage]") {
     CHECK(storage.get_message_count() == 2);
 }
 
+TEST_CASE("storage - incremental expiry", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    Database storage{"."};
+
+    auto now = std::chrono::system_clock::now();
+    const int expired = Database::EXPIRY_CHUNK_SIZE * 2 + 500;
+    std::vector<message> items;
+    for (int i = 0; i < expired; i++)
+        items.emplace_back(
+                pubkey, "old" + std::to_string(i), namespace_id::Default, now, now, "x");
+    items.emplace_back(pubkey, "live", namespace_id::Default, now, now + 1h, "x");
+    storage.bulk_store(items);
+    REQUIRE(storage.get_message_count() == expired + 1);
+    std::this_thread::sleep_for(5ms);
+
+    // With no time to spare we still get through one chunk per pass:
+    storage.clean_expired(0ms);
+    CHECK(storage.get_message_count() == expired + 1 - Database::EXPIRY_CHUNK_SIZE);
+    auto stats = storage.get_expiry_stats();
+    CHECK(stats.passes == 2);  // Including the one at startup
+    CHECK(stats.deleted == Database::EXPIRY_CHUNK_SIZE);
+    CHECK(stats.incomplete == 1);
+    CHECK(stats.last_deleted == Database::EXPIRY_CHUNK_SIZE);
+
+    // Without a budget it runs until everything expired is gone:
+    storage.clean_expired();
+    CHECK(storage.get_message_count() == 1);
+    CHECK(storage.get_owner_count() == 1);
+    stats = storage.get_expiry_stats();
+    CHECK(stats.passes == 3);
+    CHECK(stats.deleted == expired);
+    CHECK(stats.incomplete == 1);
+    CHECK(stats.max_duration >= stats.last_duration);
+}
+
 TEST_CASE("storage - bulk data storage", "[storage]") {
     StorageDeleter fixture;
 
@@ -316,6 +376,49 @@ TEST_CASE("storage - bulk storage with overlap", "[storage]") {
     }
 }
 
+TEST_CASE("storage - bulk storage of many accounts", "[storage]") {
+    StorageDeleter fixture;
+
+    std::vector<user_pubkey_t> pubkeys(10);
+    for (size_t i = 0; i < pubkeys.size(); i++)
+        REQUIRE(pubkeys[i].load("05" + std::string(62, '0') + std::to_string(10 + i)));
+    const auto now = std::chrono::system_clock::now();
+    auto msg = [&](size_t account, std::string hash) {
+        return message{
+                pubkeys[account], std::move(hash), namespace_id::Default, now, now + 1h, "x"};
+    };
+
+    // Some accounts already exist, but (after reopening) aren't in the owner cache
+    {
+        Database storage{"."};
+        CHECK(storage.store(msg(0, "old0")));
+        CHECK(storage.store(msg(3, "old3")));
+    }
+    Database storage{"."};
+
+    // Enough for several full multi-row inserts plus a remainder, interleaving the accounts, with
+    // some duplicates both of each other and of what's already stored
+    const size_t num_items = 3 * Database::BULK_STORE_ROWS + 7;
+    std::vector<message> items;
+    for (size_t i = 0; i < num_items; i++)
+        items.push_back(msg(i % pubkeys.size(), "hash" + std::to_string(i)));
+    items.push_back(msg(0, "hash0"));
+    items.push_back(msg(3, "old3"));
+    items.push_back(msg(5, "hash5"));
+    CHECK_NOTHROW(storage.bulk_store(items));
+
+    CHECK(storage.get_owner_count() == pubkeys.size());
+    CHECK(storage.get_message_count() == static_cast<int64_t>(num_items + 2));
+    size_t total = 0;
+    for (size_t a = 0; a < pubkeys.size(); a++) {
+        auto [msgs, more] = storage.retrieve(pubkeys[a], namespace_id::Default, "");
+        for (auto& m : msgs)
+            CHECK(m.hash.substr(m.hash.size() - 1) == std::to_string(a));
+        total += msgs.size();
+    }
+    CHECK(total == num_items + 2);
+}
+
 TEST_CASE("storage - retrieve limit", "[storage]") {
     StorageDeleter fixture;
 
@@ -350,3 +453,1359 @@ TEST_CASE("storage - retrieve limit", "[storage]") {
     CHECK(storage.retrieve(pubkey, namespace_id::Default, "", 101).first.size() == 100);
     CHECK(storage.retrieve(pubkey2, namespace_id::Default, "", 10).first.size() == 5);
 }
+
+TEST_CASE("storage - retrieve multi", "[storage][shards]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pk1, pk2, pk3;
+    REQUIRE(pk1.load("050000000000000000000000000000000000000000000000000000000000000001"));
+    REQUIRE(pk2.load("058000000000000000000000000000000000000000000000000000000000000000"));
+    REQUIRE(pk3.load("05ffffffffffffffff000000000000000000000000000000000000000000000000"));
+
+    auto now = std::chrono::system_clock::now();
+    for (size_t shards : {1, 4}) {
+        StorageDeleter::remove();
+        Database storage{".", shards};
+
+        for (int i = 0; i < 5; i++) {
+            auto n = std::to_string(i);
+            storage.store({pk1, "a" + n, namespace_id::Default, now, now + 1h, "data" + n});
+            storage.store({pk1, "b" + n, namespace_id::SessionSync, now, now + 1h, "data" + n});
+            storage.store({pk2, "c" + n, namespace_id::Default, now, now + 1h, "data" + n});
+        }
+
+        using Q = Database::retrieve_query;
+        auto hashes = [](const Database::retrieve_result& r) {
+            std::vector<std::string> h;
+            for (auto& m : r.messages)
+                h.push_back(m.hash);
+            return h;
+        };
+        using v = std::vector<std::string>;
+
+        auto res = storage.retrieve_multi(
+                {Q{pk1, namespace_id::Default, "a1"},
+                 Q{pk1, namespace_id::SessionSync, "", 2},
+                 Q{pk2, namespace_id::Default, "nope"},
+                 Q{pk3, namespace_id::Default, ""},
+                 Q{pk2, namespace_id::Default, "c3"}});
+        REQUIRE(res.size() == 5);
+        CHECK(hashes(res[0]) == v{"a2", "a3", "a4"});
+        CHECK_FALSE(res[0].more);
+        CHECK(hashes(res[1]) == v{"b0", "b1"});
+        CHECK(res[1].more);
+        CHECK(hashes(res[2]) == v{"c0", "c1", "c2", "c3", "c4"});
+        CHECK(hashes(res[3]).empty());
+        CHECK_FALSE(res[3].more);
+        CHECK(hashes(res[4]) == v{"c4"});
+        CHECK(res[0].messages[0].data == "data2");
+        CHECK(res[0].messages[0].msg_namespace == namespace_id::Default);
+
+        // Each result matches what a plain retrieve gives
+        auto [single, more] = storage.retrieve(pk1, namespace_id::SessionSync, "", 2);
+        CHECK(single.size() == 2);
+        CHECK(more);
+
+        // The size budget is shared, in query order.  Each message here counts as
+        // 100 + 2 + 5*4/3 = 108, so a budget of 250 holds two of them.
+        res = storage.retrieve_multi(
+                {Q{pk1, namespace_id::Default, "a3"},
+                 Q{pk2, namespace_id::Default, ""},
+                 Q{pk1, namespace_id::SessionSync, ""}},
+                250);
+        CHECK(hashes(res[0]) == v{"a4"});
+        CHECK_FALSE(res[0].more);
+        CHECK(hashes(res[1]) == v{"c0"});
+        CHECK(res[1].more);
+        CHECK(hashes(res[2]).empty());
+        CHECK(res[2].more);
+
+        // The first message is returned even if it alone is over the budget
+        res = storage.retrieve_multi(
+                {Q{pk3, namespace_id::Default, ""}, Q{pk2, namespace_id::Default, ""}}, 1);
+        CHECK(hashes(res[0]).empty());
+        CHECK(hashes(res[1]) == v{"c0"});
+        CHECK(res[1].more);
+
+        CHECK(storage.retrieve_multi({}).empty());
+    }
+}
+
+TEST_CASE("storage - streaming retrieve all", "[storage]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey_t pubkey, pubkey2;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(pubkey2.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdee"));
+
+    auto now = std::chrono::system_clock::now();
+    const size_t num_entries = 25;
+    for (size_t i = 0; i < num_entries; i++) {
+        const auto hash = "hash" + std::to_string(i);
+        storage.store(
+                {i % 2 ? pubkey : pubkey2,
+                 hash,
+                 namespace_id::Default,
+                 now,
+                 now + 100s,
+                 "bytesasstring"});
+    }
+
+    // Chunk sizes that divide evenly, don't divide evenly, and are larger than the whole set:
+    for (size_t chunk : {1, 5, 7, 25, 100}) {
+        std::vector<std::string> hashes;
+        storage.retrieve_all(
+                [&](message&& m) {
+                    CHECK(m.pubkey == (hashes.size() % 2 ? pubkey : pubkey2));
+                    hashes.push_back(std::move(m.hash));
+                    return true;
+                },
+                chunk);
+        REQUIRE(hashes.size() == num_entries);
+        for (size_t i = 0; i < num_entries; i++)
+            CHECK(hashes[i] == "hash" + std::to_string(i));
+    }
+
+    // Stopping early
+    size_t count = 0;
+    storage.retrieve_all([&](message&&) { return ++count < 12; }, 5);
+    CHECK(count == 12);
+
+    CHECK(storage.retrieve_all().size() == num_entries);
+}
+
+TEST_CASE("storage - eviction when full", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t heavy, light;
+    REQUIRE(heavy.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(light.load("05fedcba9876543210fedcba9876543210fedcba9876543210fedcba9876543210"));
+
+    auto now = std::chrono::system_clock::now();
+    auto store_all = [&](Database& storage) {
+        for (int i = 0; i < 10; i++)
+            REQUIRE(storage.store(
+                    {heavy,
+                     "heavy" + std::to_string(i),
+                     namespace_id::Default,
+                     now,
+                     now + 1h + i * 1min,
+                     std::string(1000, 'x')}));
+        REQUIRE(storage.store(
+                {light, "light", namespace_id::Default, now, now + 1h, std::string(1000, 'x')}));
+    };
+
+    {
+        // Without eviction nothing unexpired gets removed
+        Database storage{"."};
+        store_all(storage);
+        storage.clean_expired();
+        CHECK(storage.get_message_count() == 11);
+        CHECK(storage.get_expiry_stats().evicted == 0);
+    }
+    StorageDeleter::remove();
+
+    // Pretend that the database is always (too) full, so that everything beyond the quota gets
+    // evicted and then the rest get evicted soonest-expiring first, a chunk at a time.
+    db_eviction eviction;
+    eviction.enabled = true;
+    eviction.high_water = 0;
+    eviction.low_water = 0;
+    eviction.account_quota = 4500;
+    Database storage{".", 1, 0, false, {}, eviction};
+    store_all(storage);
+    // Load the retrieve cache, which eviction must then invalidate:
+    REQUIRE(storage.retrieve(heavy, namespace_id::Default, "").first.size() == 10);
+
+    storage.clean_expired();
+    CHECK(storage.get_message_count() == 0);
+    CHECK(storage.get_owner_count() == 0);
+    auto stats = storage.get_expiry_stats();
+    CHECK(stats.evicted == 11);
+    CHECK(stats.over_quota == 6);  // Only the 4 latest-expiring heavy messages fit the quota
+    CHECK(storage.retrieve(heavy, namespace_id::Default, "").first.empty());
+    CHECK(storage.retrieve(light, namespace_id::Default, "").first.empty());
+}
+
+TEST_CASE("storage - tuning and background checkpoints", "[storage]") {
+    StorageDeleter fixture;
+
+    db_tuning tuning;
+    tuning.mmap_size = 64 * 1024 * 1024;
+    tuning.cache_size = 8 * 1024 * 1024;
+    tuning.wal_autocheckpoint = 10;
+    tuning.temp_store_memory = true;
+    tuning.background_checkpoint = true;
+
+    user_pubkey_t pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    auto now = std::chrono::system_clock::now();
+    const size_t num_entries = 200;
+    {
+        Database storage{".", 2, 0, false, tuning};
+        for (size_t i = 0; i < num_entries; i++)
+            REQUIRE(storage.store(
+                    {pubkey,
+                     "hash" + std::to_string(i),
+                     namespace_id::Default,
+                     now,
+                     now + 100s,
+                     std::string(2000, 'x')}));
+
+        auto stats = storage.get_io_stats();
+        for (int i = 0; i < 100 && stats.checkpoints == 0; i++) {
+            std::this_thread::sleep_for(10ms);
+            stats = storage.get_io_stats();
+        }
+        CHECK(stats.checkpoints > 0);
+        CHECK(stats.checkpointed > 0);
+        CHECK(stats.cache_writes > 0);
+        CHECK(stats.cache_used > 0);
+
+        for (int i = 0; i < 3; i++)
+            CHECK(storage.retrieve(pubkey, namespace_id::Default, "").first.size() ==
+                  num_entries);
+        auto after = storage.get_io_stats();
+        CHECK(after.cache_hits > stats.cache_hits);
+        // Counters accumulate across calls rather than getting reset by them
+        CHECK(after.cache_writes >= stats.cache_writes);
+    }
+
+    Database storage{".", 2, 0, false, tuning};
+    CHECK(storage.get_message_count() == num_entries);
+}
+
+TEST_CASE("storage - sharded database", "[storage][shards]") {
+    StorageDeleter fixture;
+
+    // These map to the first and last quarter of the swarm space, respectively
+    user_pubkey_t pk_low, pk_high;
+    REQUIRE(pk_low.load("050000000000000000000000000000000000000000000000000000000000000001"));
+    REQUIRE(pk_high.load("05ffffffffffffffff000000000000000000000000000000000000000000000000"));
+    REQUIRE(pk_low.swarm_space() == 1);
+    REQUIRE(pk_high.swarm_space() == (uint64_t)-1);
+
+    auto now = std::chrono::system_clock::now();
+    {
+        Database storage{".", 4};
+        CHECK(storage.shard_count() == 4);
+        CHECK(std::filesystem::exists("storage-1-of-4.db"));
+        CHECK(std::filesystem::exists("storage-4-of-4.db"));
+        CHECK_FALSE(std::filesystem::exists("storage.db"));
+
+        for (int i = 0; i < 10; i++) {
+            auto n = std::to_string(i);
+            CHECK(storage.store({pk_low, "low" + n, namespace_id::Default, now, now + 1h, "x"}));
+            CHECK(storage.store({pk_high, "high" + n, namespace_id::Default, now, now + 1h, "y"}));
+        }
+        CHECK(storage.get_message_count() == 20);
+        CHECK(storage.get_owner_count() == 2);
+        CHECK(storage.retrieve(pk_low, namespace_id::Default, "").first.size() == 10);
+        CHECK(storage.retrieve(pk_high, namespace_id::Default, "").first.size() == 10);
+        CHECK(storage.retrieve_by_hash("high3"));
+        CHECK(storage.retrieve_all().size() == 20);
+        CHECK(storage.delete_by_hash(pk_high, {"high1", "high2"}).size() == 2);
+        CHECK(storage.get_message_count() == 18);
+    }
+
+    // Changing the shard count should migrate everything into the new layout
+    {
+        Database storage{".", 1};
+        CHECK(storage.shard_count() == 1);
+        CHECK_FALSE(std::filesystem::exists("storage-1-of-4.db"));
+        CHECK(storage.get_message_count() == 18);
+        CHECK(storage.retrieve(pk_low, namespace_id::Default, "").first.size() == 10);
+        CHECK(storage.retrieve(pk_high, namespace_id::Default, "").first.size() == 8);
+    }
+    {
+        Database storage{".", 3};
+        CHECK_FALSE(std::filesystem::exists("storage.db"));
+        CHECK(storage.get_message_count() == 18);
+        CHECK(storage.retrieve(pk_high, namespace_id::Default, "").first.size() == 8);
+    }
+
+    CHECK_THROWS(Database{".", 0});
+}
+
+TEST_CASE("storage - online migration", "[storage][shards]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pk_low, pk_high;
+    REQUIRE(pk_low.load("050000000000000000000000000000000000000000000000000000000000000001"));
+    REQUIRE(pk_high.load("05ffffffffffffffff000000000000000000000000000000000000000000000000"));
+    std::array<unsigned char, 32> subkey;
+    subkey.fill(0x42);
+
+    auto now = std::chrono::system_clock::now();
+    {
+        Database storage{".", 1};
+        for (int i = 0; i < 10; i++) {
+            auto n = std::to_string(i);
+            CHECK(storage.store({pk_low, "low" + n, namespace_id::Default, now, now + 1h, "x"}));
+            CHECK(storage.store({pk_high, "high" + n, namespace_id::Default, now, now + 1h, "y"}));
+        }
+        // Enough other accounts, spread across the swarm space, to need several chunks
+        std::vector<message> msgs;
+        constexpr auto hex = "0123456789abcdef";
+        for (int i = 0; i < 600; i++) {
+            std::string pk = "05" + std::string(64, '0');
+            pk[2] = hex[i % 16];
+            pk[3] = hex[(i / 16) % 16];
+            pk[65] = '2';
+            user_pubkey_t other;
+            REQUIRE(other.load(pk));
+            auto hash = "other" + std::to_string(i);
+            msgs.push_back({other, std::move(hash), namespace_id::Default, now, now + 1h, "z"});
+        }
+        storage.bulk_store(msgs);
+        storage.revoke_subkey(pk_low, subkey);
+        CHECK(storage.get_message_count() == 620);
+    }
+
+    {
+        Database storage{".", 2, 0, true};
+        CHECK(storage.migrating());
+        CHECK(std::filesystem::exists("storage.db"));
+        auto progress = storage.get_migration_progress();
+        REQUIRE(progress);
+        CHECK(progress->migrated == 0);
+        CHECK(progress->remaining == 620);
+        CHECK(storage.get_message_count() == 0);
+
+        // Revocations come over right away
+        CHECK(storage.subkey_revoked(subkey));
+        // Messages not yet moved can still be found by hash (as storage tests do)
+        CHECK(storage.retrieve_by_hash("high3"));
+        CHECK(storage.retrieve_payload("high3"));
+        // Account requests move the account over first
+        CHECK(storage.retrieve(pk_low, namespace_id::Default, "").first.size() == 10);
+        CHECK(storage.get_message_count() == 10);
+        // So do stores: a new message has to come after the old ones for a retrieve that
+        // resumes from an old message
+        CHECK(storage.store({pk_high, "high10", namespace_id::Default, now, now + 1h, "y"}));
+        CHECK(storage.get_message_count() == 21);
+        auto after = storage.retrieve(pk_high, namespace_id::Default, "high5").first;
+        REQUIRE(after.size() == 5);
+        CHECK(after.back().hash == "high10");
+        CHECK(storage.delete_by_hash(pk_high, {"high1"}).size() == 1);
+        CHECK(storage.get_message_count() == 20);
+
+        storage.migrate_pending();
+        CHECK_FALSE(storage.migrating());
+        CHECK_FALSE(storage.get_migration_progress());
+        CHECK_FALSE(std::filesystem::exists("storage.db"));
+        CHECK(storage.get_message_count() == 620);
+        // A deleted message must not come back
+        CHECK(storage.retrieve(pk_high, namespace_id::Default, "").first.size() == 10);
+        CHECK_FALSE(storage.retrieve_by_hash("high1"));
+        CHECK(storage.subkey_revoked(subkey));
+    }
+
+    // An interrupted migration carries on from where it stopped
+    {
+        Database storage{".", 1, 0, true};
+        REQUIRE(storage.migrating());
+        storage.migrate_pending(0ms);  // Moves a single chunk
+        CHECK(storage.migrating());
+        CHECK(storage.get_message_count() > 0);
+        CHECK(storage.get_message_count() < 620);
+    }
+    {
+        Database storage{".", 1, 0, true};
+        storage.migrate_pending();
+        CHECK_FALSE(storage.migrating());
+        CHECK(storage.get_message_count() == 620);
+        CHECK_FALSE(std::filesystem::exists("storage-1-of-2.db"));
+        CHECK_FALSE(std::filesystem::exists("storage-2-of-2.db"));
+    }
+}
+
+TEST_CASE("storage - retrieve by swarm space", "[storage][shards]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pk_low, pk_mid, pk_high;
+    REQUIRE(pk_low.load("050000000000000000000000000000000000000000000000000000000000000001"));
+    REQUIRE(pk_mid.load("058000000000000000000000000000000000000000000000000000000000000000"));
+    REQUIRE(pk_high.load("05ffffffffffffffff000000000000000000000000000000000000000000000000"));
+    REQUIRE(pk_low.swarm_space() == 1);
+    REQUIRE(pk_mid.swarm_space() == uint64_t{1} << 63);
+    REQUIRE(pk_high.swarm_space() == (uint64_t)-1);
+
+    auto now = std::chrono::system_clock::now();
+    for (size_t shards : {1, 4}) {
+        StorageDeleter::remove();
+        Database storage{".", shards};
+
+        // Owners get added through both the single and bulk store paths:
+        for (int i = 0; i < 5; i++) {
+            auto n = std::to_string(i);
+            CHECK(storage.store({pk_low, "low" + n, namespace_id::Default, now, now + 1h, "x"}));
+            CHECK(storage.store({pk_mid, "mid" + n, namespace_id::Default, now, now + 1h, "y"}));
+        }
+        std::vector<message> bulk;
+        for (int i = 0; i < 5; i++)
+            bulk.emplace_back(
+                    pk_high, "high" + std::to_string(i), namespace_id::Default, now, now + 1h, "z");
+        storage.bulk_store(bulk);
+
+        auto hashes_in = [&](uint64_t lo, uint64_t hi, size_t chunk = 2) {
+            std::vector<std::string> hashes;
+            storage.retrieve_by_swarm_space(
+                    lo,
+                    hi,
+                    [&](message&& m) {
+                        CHECK(m.pubkey);
+                        hashes.push_back(std::move(m.hash));
+                        return true;
+                    },
+                    chunk);
+            std::sort(hashes.begin(), hashes.end());
+            return hashes;
+        };
+
+        using v = std::vector<std::string>;
+        v low{"low0", "low1", "low2", "low3", "low4"}, mid{"mid0", "mid1", "mid2", "mid3", "mid4"},
+                high{"high0", "high1", "high2", "high3", "high4"};
+
+        CHECK(hashes_in(0, 1) == low);
+        CHECK(hashes_in(1, 1, 1) == low);
+        CHECK(hashes_in(2, (uint64_t{1} << 63) - 1).empty());
+        CHECK(hashes_in(uint64_t{1} << 63, uint64_t{1} << 63, 100) == mid);
+        CHECK(hashes_in((uint64_t)-1, (uint64_t)-1) == high);
+        CHECK(hashes_in(5, 1).empty());
+        auto all = hashes_in(0, (uint64_t)-1, 3);
+        CHECK(all.size() == 15);
+
+        // Stopping early
+        size_t count = 0;
+        CHECK_FALSE(storage.retrieve_by_swarm_space(
+                0, (uint64_t)-1, [&](message&&) { return ++count < 7; }, 2));
+        CHECK(count == 7);
+    }
+}
+
+TEST_CASE("storage - streaming bulk store", "[storage][shards]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pk_low, pk_high;
+    REQUIRE(pk_low.load("050000000000000000000000000000000000000000000000000000000000000001"));
+    REQUIRE(pk_high.load("05ffffffffffffffff000000000000000000000000000000000000000000000000"));
+
+    auto now = std::chrono::system_clock::now();
+    std::vector<message> msgs;
+    for (int i = 0; i < 10; i++)
+        msgs.emplace_back(
+                i % 4 == 0 ? pk_high : pk_low,
+                "hash" + std::to_string(i),
+                static_cast<namespace_id>(i % 3),
+                now,
+                now + 1h,
+                "data" + std::to_string(i));
+
+    // Produces the messages from scratch (rather than passing views into `msgs`) so that the views
+    // are only valid during each call, as with a serialized batch.
+    auto source = [&](const message_sink& store) {
+        for (const auto& m : msgs) {
+            user_pubkey_t pk = m.pubkey;
+            std::string hash = m.hash, data = m.data;
+            store(pk, message_view{hash, m.msg_namespace, m.timestamp, m.expiry, data});
+        }
+    };
+
+    for (size_t shards : {1, 4}) {
+        StorageDeleter::remove();
+        Database storage{".", shards};
+
+        // A source that fails part way through stores nothing:
+        CHECK_THROWS(storage.bulk_store([&](const message_sink& store) {
+            source(store);
+            throw std::runtime_error{"bad batch"};
+        }));
+        CHECK(storage.get_message_count() == 0);
+
+        storage.bulk_store(source);
+        CHECK(storage.get_message_count() == msgs.size());
+        CHECK(storage.get_owner_count() == 2);
+        for (const auto& m : msgs) {
+            auto [found, more] = storage.retrieve(m.pubkey, m.msg_namespace, "");
+            auto it = std::find_if(found.begin(), found.end(), [&](const message& f) {
+                return f.hash == m.hash;
+            });
+            REQUIRE(it != found.end());
+            CHECK(it->data == m.data);
+        }
+
+        // Storing it again is a no-op
+        storage.bulk_store(source);
+        CHECK(storage.get_message_count() == msgs.size());
+    }
+}
+
+TEST_CASE("storage - snapshots", "[storage][shards]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pk_low, pk_mid, pk_high;
+    REQUIRE(pk_low.load("050000000000000000000000000000000000000000000000000000000000000001"));
+    REQUIRE(pk_mid.load("058000000000000000000000000000000000000000000000000000000000000000"));
+    REQUIRE(pk_high.load("05ffffffffffffffff000000000000000000000000000000000000000000000000"));
+
+    // (Whole milliseconds, as stored, so that the merged expiries compare equal)
+    auto now = std::chrono::time_point_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now());
+    std::vector<message> msgs;
+    for (int i = 0; i < 5; i++) {
+        auto n = std::to_string(i);
+        auto ns = static_cast<namespace_id>(i % 3);
+        msgs.emplace_back(pk_low, "low" + n, ns, now, now + 1h, "x" + n);
+        msgs.emplace_back(pk_mid, "mid" + n, ns, now, now + 1h, std::string(1500, 'a' + i));
+        msgs.emplace_back(pk_high, "high" + n, ns, now, now + 1h, "z" + n);
+    }
+    std::filesystem::create_directories("storage-src");
+    Database src{"storage-src"};
+    src.bulk_store(msgs);
+    CHECK(src.store({pk_mid, "expired", namespace_id::Default, now - 1h, now - 1s, "old"}));
+
+    std::string image;
+    CHECK_FALSE(src.export_snapshot(2, (uint64_t{1} << 63) - 1, 1'000'000, image));
+    CHECK(image.empty());
+
+    // A small size limit still takes a whole account, then stops before the next one
+    auto next = src.export_snapshot(0, (uint64_t)-1, 10, image);
+    REQUIRE(next);
+    CHECK(*next == uint64_t{1} << 63);
+    CHECK(Database::is_snapshot(image));
+
+    CHECK_FALSE(src.export_snapshot(0, (uint64_t)-1, 1'000'000, image));
+    CHECK(Database::is_snapshot(image));
+    CHECK_FALSE(Database::is_snapshot("\x02" + image));
+
+    // The merging database is sharded, and (in one case) puts the larger payloads in segments
+    for (auto [shards, cold] :
+         {std::pair<size_t, size_t>{1, 0}, std::pair<size_t, size_t>{4, 1000}}) {
+        auto dir = "storage-dst" + std::to_string(shards);
+        std::filesystem::create_directories(dir);
+        Database dst{dir, shards, cold};
+        CHECK(dst.store(msgs[0]));
+        CHECK(dst.retrieve(pk_low, msgs[0].msg_namespace, "").first.size() == 1);
+
+        CHECK(dst.import_snapshot(image) == msgs.size() - 1);
+        CHECK(dst.get_message_count() == msgs.size());
+        CHECK(dst.get_owner_count() == 3);
+        CHECK_FALSE(dst.retrieve_by_hash("expired"));
+        if (cold)
+            CHECK(dst.get_segment_stats().appended == 5);
+        for (auto& pk : {pk_low, pk_mid, pk_high})
+            for (int ns = 0; ns < 3; ns++) {
+                std::vector<message> expected;
+                for (auto& m : msgs)
+                    if (m.pubkey == pk && m.msg_namespace == static_cast<namespace_id>(ns))
+                        expected.push_back(m);
+                // (The retrieve cache has been invalidated, so the earlier retrieve of pk_low
+                // doesn't hide the merged messages)
+                auto [found, more] = dst.retrieve(pk, static_cast<namespace_id>(ns), "");
+                REQUIRE(found.size() == expected.size());
+                for (size_t i = 0; i < found.size(); i++) {
+                    CHECK(found[i].hash == expected[i].hash);
+                    CHECK(found[i].data == expected[i].data);
+                    CHECK(found[i].expiry == expected[i].expiry);
+                }
+            }
+
+        // Merging it again is a no-op
+        CHECK(dst.import_snapshot(image) == 0);
+        CHECK(dst.get_message_count() == msgs.size());
+    }
+
+    std::filesystem::create_directories("storage-bad");
+    Database bad{"storage-bad"};
+    CHECK_THROWS(bad.import_snapshot("SQLite format 3\0garbage"s));
+    // Images whose schema isn't exactly ours get rejected before anything is read from them
+    auto tampered = image;
+    auto pos = tampered.find("data BLOB NOT NULL");
+    REQUIRE(pos != std::string::npos);
+    tampered.replace(pos, 18, "data ANY  NOT NULL");
+    CHECK_THROWS(bad.import_snapshot(tampered));
+    CHECK(bad.get_message_count() == 0);
+}
+
+TEST_CASE("storage - concurrent stores", "[storage]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey_t pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    auto now = std::chrono::system_clock::now();
+
+    // Concurrent stores get group-committed, but each caller must still see its own result: every
+    // hash gets stored twice, so exactly one of the two stores of each should report insertion.
+    const int num_threads = 8, per_thread = 50;
+    std::vector<std::thread> threads;
+    std::vector<std::vector<std::optional<bool>>> results(num_threads);
+    for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < per_thread; i++) {
+                auto hash = "hash" + std::to_string(t / 2 * per_thread + i);
+                results[t].push_back(
+                        storage.store({pubkey, hash, namespace_id::Default, now, now + 1h, "x"}));
+            }
+        });
+    }
+    for (auto& th : threads)
+        th.join();
+
+    for (int t = 0; t < num_threads; t += 2) {
+        for (int i = 0; i < per_thread; i++) {
+            REQUIRE(results[t][i].has_value());
+            REQUIRE(results[t + 1][i].has_value());
+            CHECK(*results[t][i] != *results[t + 1][i]);
+        }
+    }
+    CHECK(storage.get_message_count() == num_threads / 2 * per_thread);
+}
+
+TEST_CASE("storage - concurrent reads and writes", "[storage]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey_t pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    auto now = std::chrono::system_clock::now();
+    auto msg = [&](int i) {
+        return message{
+                pubkey,
+                "hash" + std::to_string(i),
+                namespace_id::Default,
+                now,
+                now + 100s,
+                "data" + std::to_string(i)};
+    };
+
+    // Reads (on their own connections) see everything committed before they started
+    const int num_entries = 200;
+    std::atomic<int> stored = 0;
+    std::atomic<bool> failed = false;
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; t++)
+        readers.emplace_back([&] {
+            while (stored < num_entries) {
+                int before = stored;
+                auto [msgs, more] = storage.retrieve(pubkey, namespace_id::Default, "");
+                if (msgs.size() < static_cast<size_t>(before))
+                    failed = true;
+                if (before > 0 && !storage.retrieve_by_hash("hash" + std::to_string(before - 1)))
+                    failed = true;
+            }
+        });
+    for (int i = 0; i < num_entries; i++) {
+        REQUIRE(storage.store(msg(i)));
+        stored++;
+    }
+    for (auto& t : readers)
+        t.join();
+    CHECK_FALSE(failed);
+    CHECK(storage.get_io_stats().readers >= 1);
+
+    // Reads see deletions, too (including through the retrieve cache)
+    CHECK(storage.retrieve(pubkey, namespace_id::Default, "").first.size() == num_entries);
+    CHECK(storage.delete_by_hash(pubkey, {"hash5", "hash6"}).size() == 2);
+    CHECK(storage.retrieve(pubkey, namespace_id::Default, "").first.size() == num_entries - 2);
+    CHECK_FALSE(storage.retrieve_by_hash("hash5"));
+    CHECK(storage.get_expiries(pubkey, {"hash5", "hash7"}).size() == 1);
+    CHECK(storage.delete_all(pubkey).size() == num_entries - 2);
+    CHECK(storage.retrieve(pubkey, namespace_id::Default, "").first.empty());
+    CHECK(storage.get_expiries(pubkey, {"hash7"}).empty());
+}
+
+TEST_CASE("storage - batches", "[storage]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey_t pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    auto now = std::chrono::system_clock::now();
+    auto store = [&](std::string hash) {
+        return storage.store({pubkey, std::move(hash), namespace_id::Default, now, now + 1h, "x"});
+    };
+    auto hashes = [&] {
+        std::vector<std::string> result;
+        for (auto& m : storage.retrieve(pubkey, namespace_id::Default, "").first)
+            result.push_back(m.hash);
+        return result;
+    };
+    auto hashes_elsewhere = [&] {
+        std::vector<std::string> result;
+        std::thread{[&] { result = hashes(); }}.join();
+        return result;
+    };
+    auto expiry_ms = [](auto t) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(t.time_since_epoch()).count();
+    };
+    using A = Database::batch_access;
+    using V = std::vector<std::string>;
+    std::array<unsigned char, 32> subkey;
+    subkey.fill(0x42);
+
+    REQUIRE(store("a0"));
+
+    // Nothing to group for a single request
+    auto single = storage.begin_batch({A{pubkey, true}});
+    CHECK_FALSE(single);
+
+    {
+        auto batch = storage.begin_batch({A{pubkey, true, 1}, A{pubkey, true}, A{pubkey}});
+        REQUIRE(batch);
+        // Batches don't nest
+        auto nested = storage.begin_batch({A{pubkey, true}, A{pubkey, true}});
+        CHECK_FALSE(nested);
+
+        CHECK(store("a1") == true);
+        CHECK(storage.delete_by_hash(pubkey, {"a0"}) == V{"a0"});
+        // The batch sees its own changes, but nothing else does until it ends
+        CHECK(hashes() == V{"a1"});
+        CHECK(hashes_elsewhere() == V{"a0"});
+
+        // A revocation only counts once it is committed (and checking it from elsewhere before
+        // then must not make us forget it)
+        storage.revoke_subkey(pubkey, subkey);
+        bool revoked_elsewhere = true;
+        std::thread{[&] { revoked_elsewhere = storage.subkey_revoked(subkey); }}.join();
+        CHECK_FALSE(revoked_elsewhere);
+
+        CHECK(batch.commit());
+        CHECK_FALSE(batch);
+    }
+    // (including through the retrieve cache, which the other thread just filled)
+    CHECK(hashes_elsewhere() == V{"a1"});
+    CHECK(hashes() == V{"a1"});
+    CHECK(storage.subkey_revoked(subkey));
+
+    {
+        // A read-only batch reads from one snapshot, without holding up writes
+        auto batch = storage.begin_batch({A{pubkey}, A{pubkey}});
+        REQUIRE(batch);
+        CHECK(storage.get_expiries(pubkey, {"a1"})["a1"] == expiry_ms(now + 1h));
+        std::thread{[&] { storage.update_expiry(pubkey, {"a1"}, now + 2h); }}.join();
+        CHECK(storage.get_expiries(pubkey, {"a1"})["a1"] == expiry_ms(now + 1h));
+    }
+    CHECK(storage.get_expiries(pubkey, {"a1"})["a1"] == expiry_ms(now + 2h));
+}
+
+TEST_CASE("storage - hash list queries", "[storage]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey_t pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    auto now = std::chrono::system_clock::now();
+    auto expiry = now + 1h;
+    auto expiry_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                             expiry.time_since_epoch())
+                             .count();
+
+    std::vector<std::string> hashes;
+    for (int i = 0; i < 300; i++) {
+        hashes.push_back("hash" + std::to_string(i));
+        REQUIRE(storage.store({pubkey, hashes.back(), namespace_id::Default, now, expiry, "x"}));
+    }
+
+    auto first_n = [&](size_t n) {
+        return std::vector<std::string>(hashes.begin(), hashes.begin() + n);
+    };
+
+    // Single hash, and list sizes both on and between the rounded placeholder counts, and more
+    // than MAX_CACHED_IN_ARITY:
+    for (size_t n : {1, 2, 3, 4, 5, 8, 100, 300}) {
+        auto exp = storage.get_expiries(pubkey, first_n(n));
+        CHECK(exp.size() == n);
+        for (auto& [h, e] : exp)
+            CHECK(e == expiry_ms);
+    }
+
+    auto before = storage.get_statement_cache_stats();
+    auto exp = storage.get_expiries(pubkey, first_n(7));
+    CHECK(exp.size() == 7);
+    auto after = storage.get_statement_cache_stats();
+    // 7 hashes should use the (already prepared) 8-placeholder statement:
+    CHECK(after.hits == before.hits + 1);
+    CHECK(after.misses == before.misses);
+    CHECK(after.cached > 0);
+
+    // Padding the placeholder list with repeats shouldn't cause anything to be returned twice
+    CHECK(storage.update_expiry(pubkey, first_n(5), now + 30min).size() == 5);
+    CHECK(storage.update_expiry(pubkey, first_n(3), now + 10min, false, true).size() == 3);
+    CHECK(storage.delete_by_hash(pubkey, first_n(6)).size() == 6);
+    CHECK(storage.get_expiries(pubkey, first_n(10)).size() == 4);
+    CHECK(storage.get_message_count() == 294);
+}
+
+TEST_CASE("storage - expiry refreshes", "[storage]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey_t pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    auto now = std::chrono::system_clock::now();
+    auto expiry_ms = [](auto t) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(t.time_since_epoch()).count();
+    };
+    using V = std::vector<std::string>;
+    V hashes{"hash1", "hash2", "hash3"};
+    for (auto& h : hashes)
+        REQUIRE(storage.store({pubkey, h, namespace_id::Default, now, now + 10 * 24h, "x"}));
+    auto expiries = [&] {
+        std::vector<int64_t> result;
+        for (auto& [h, e] : storage.get_expiries(pubkey, hashes))
+            result.push_back(e);
+        return result;
+    };
+    auto all = [](int64_t e) { return std::vector<int64_t>(3, e); };
+
+    auto sorted = [](V v) {
+        std::sort(v.begin(), v.end());
+        return v;
+    };
+    auto exp = now + 14 * 24h;
+    CHECK(sorted(storage.update_expiry(pubkey, hashes, exp)) == hashes);
+    CHECK(expiries() == all(expiry_ms(exp)));
+
+    // Refreshing to the same expiry again reports the messages as updated without rewriting them,
+    // and (unless shortening) ones already expiring only a little earlier than asked are left be
+    // and reported unchanged, with their actual expiry
+    std::map<std::string, int64_t> unchanged;
+    CHECK(storage.update_expiry(pubkey, hashes, exp, false, false, &unchanged) == hashes);
+    CHECK(unchanged.empty());
+    CHECK(storage.update_expiry(pubkey, hashes, exp + 1min, false, false, &unchanged).empty());
+    CHECK(unchanged.size() == 3);
+    CHECK(unchanged["hash2"] == expiry_ms(exp));
+    unchanged.clear();
+    CHECK(storage.update_expiry(pubkey, hashes, exp + 1min, true, false, &unchanged).empty());
+    CHECK(unchanged.size() == 3);
+    CHECK(expiries() == all(expiry_ms(exp)));
+
+    // ... but messages expiring later than asked are set exactly, as are shortenings
+    CHECK(sorted(storage.update_expiry(pubkey, hashes, exp - 1min)) == hashes);
+    CHECK(expiries() == all(expiry_ms(exp - 1min)));
+    CHECK(sorted(storage.update_expiry(pubkey, hashes, exp - 2min, false, true)) == hashes);
+    CHECK(expiries() == all(expiry_ms(exp - 2min)));
+    exp -= 2min;
+
+    // Constraints still apply as before
+    unchanged.clear();
+    CHECK(storage.update_expiry(pubkey, hashes, exp - 1min, true, false, &unchanged).empty());
+    CHECK(unchanged.size() == 3);
+    unchanged.clear();
+    CHECK(storage.update_expiry(pubkey, {"hash1"}, exp + 1min, false, true, &unchanged).empty());
+    CHECK(unchanged == std::map<std::string, int64_t>{{"hash1", expiry_ms(exp)}});
+
+    // An extension beyond the tolerance is written, mixed in with ones that aren't
+    CHECK(storage.update_expiry(pubkey, {"hash1"}, exp + 12h) == V{"hash1"});
+    CHECK(sorted(storage.update_expiry(pubkey, hashes, exp + 12h)) == hashes);
+    CHECK(expiries() == all(expiry_ms(exp + 12h)));
+
+    // Expiries close to now are set exactly
+    CHECK(storage.update_expiry(pubkey, hashes, now + 1min, false, true).size() == 3);
+    CHECK(storage.update_expiry(pubkey, hashes, now + 59s, false, true).size() == 3);
+    CHECK(expiries() == all(expiry_ms(now + 59s)));
+
+    // Repeating an expire_all only shortens the first time
+    CHECK(storage.update_all_expiries(pubkey, now + 30s).size() == 3);
+    CHECK(storage.update_all_expiries(pubkey, now + 30s).empty());
+    CHECK(storage.update_all_expiries(pubkey, namespace_id::Default, now + 30s).empty());
+    CHECK(expiries() == all(expiry_ms(now + 30s)));
+}
+
+TEST_CASE("storage - binary hash keys", "[storage]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey_t pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    auto now = std::chrono::system_clock::now();
+
+    // The sort of hash we compute (unpadded base64 of 32 bytes) gets stored as its bytes; anything
+    // else (including the URL-safe and non-canonical spellings of the same bytes) as text.  All of
+    // them have to come back out exactly as stored, and stay distinct.
+    const std::vector<std::string> hashes{
+            "3q2+7wABAgMEBQYHCAkKCwwNDg8QERITFBUWFxgZGhs",
+            "3q2-7wABAgMEBQYHCAkKCwwNDg8QERITFBUWFxgZGhs",
+            "3q2+7wABAgMEBQYHCAkKCwwNDg8QERITFBUWFxgZGhv",
+            "3q2+7wABAgMEBQYHCAkKCwwNDg8QERITFBUWFxgZGhs=",
+            "plainhash"};
+    for (auto& h : hashes)
+        REQUIRE(storage.store({pubkey, h, namespace_id::Default, now, now + 1h, "data"}));
+    CHECK_FALSE(*storage.store({pubkey, hashes[0], namespace_id::Default, now, now + 1h, "x"}));
+
+    std::vector<std::string> found;
+    for (auto& m : storage.retrieve(pubkey, namespace_id::Default, "").first)
+        found.push_back(m.hash);
+    CHECK(found == hashes);
+    CHECK(storage.retrieve(pubkey, namespace_id::Default, hashes[0]).first.size() == 4);
+
+    auto msg = storage.retrieve_by_hash(hashes[0]);
+    REQUIRE(msg);
+    CHECK(msg->hash == hashes[0]);
+    CHECK(storage.get_expiries(pubkey, {hashes[0]}).count(hashes[0]) == 1);
+    CHECK(storage.get_expiries(pubkey, hashes).size() == hashes.size());
+    auto deleted = storage.delete_by_hash(pubkey, {hashes[4], hashes[0]});
+    std::sort(deleted.begin(), deleted.end());
+    CHECK(deleted == std::vector<std::string>{hashes[0], hashes[4]});
+    CHECK_FALSE(storage.retrieve_by_hash(hashes[0]));
+    CHECK(storage.retrieve_by_hash(hashes[1]));
+    CHECK(storage.get_message_count() == 3);
+}
+
+TEST_CASE("storage - retrieve views", "[storage]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey_t pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    auto now = std::chrono::system_clock::now();
+    for (int i = 0; i < 10; i++)
+        REQUIRE(storage.store(
+                {pubkey,
+                 "hash" + std::to_string(i),
+                 namespace_id::Default,
+                 now,
+                 now + 100s,
+                 std::string(100 + i, 'a' + i)}));
+
+    // The view-based retrieve should give the same messages (and `more` value) as the copying
+    // version, under both count and size limits:
+    for (auto [count, size] : std::vector<std::pair<std::optional<size_t>, std::optional<size_t>>>{
+                 {std::nullopt, std::nullopt}, {3, std::nullopt}, {std::nullopt, 500}, {10, 1}}) {
+        auto [expected, expected_more] =
+                storage.retrieve(pubkey, namespace_id::Default, "hash1", count, size);
+        std::vector<message> viewed;
+        bool more = storage.retrieve(
+                pubkey,
+                namespace_id::Default,
+                "hash1",
+                [&](const message_view& m) {
+                    viewed.emplace_back(
+                            std::string{m.hash},
+                            m.msg_namespace,
+                            m.timestamp,
+                            m.expiry,
+                            std::string{m.data});
+                },
+                count,
+                size);
+        CHECK(more == expected_more);
+        REQUIRE(viewed.size() == expected.size());
+        for (size_t i = 0; i < viewed.size(); i++) {
+            CHECK(viewed[i].hash == expected[i].hash);
+            CHECK(viewed[i].data == expected[i].data);
+            CHECK(viewed[i].expiry == expected[i].expiry);
+        }
+    }
+
+    auto [msgs, more] = storage.retrieve(pubkey, namespace_id::Default, "hash1", 3);
+    REQUIRE(msgs.size() == 3);
+    CHECK(more);
+    CHECK(msgs[0].hash == "hash2");
+    CHECK(msgs[0].data == std::string(102, 'c'));
+}
+
+TEST_CASE("storage - revoked subkeys", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    std::array<unsigned char, 32> revoked, other;
+    revoked.fill(0x11);
+    other.fill(0x22);
+
+    {
+        Database storage{"."};
+        auto now = std::chrono::system_clock::now();
+        REQUIRE(storage.store({pubkey, "hash", namespace_id::Default, now, now + 1h, "x"}));
+
+        CHECK_FALSE(storage.subkey_revoked(revoked));
+        storage.revoke_subkey(pubkey, revoked);
+        CHECK(storage.subkey_revoked(revoked));
+
+        // Subkeys that were never revoked shouldn't need to touch the database at all
+        auto before = storage.get_statement_cache_stats();
+        CHECK_FALSE(storage.subkey_revoked(other));
+        auto after = storage.get_statement_cache_stats();
+        CHECK(after.hits == before.hits);
+        CHECK(after.misses == before.misses);
+    }
+
+    // Revocations have to be reloaded when reopening the database
+    Database storage{"."};
+    CHECK(storage.subkey_revoked(revoked));
+    CHECK_FALSE(storage.subkey_revoked(other));
+}
+
+TEST_CASE("storage - retrieve cache", "[storage]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey_t pubkey, other;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    REQUIRE(other.load("05fedcba9876543210fedcba9876543210fedcba9876543210fedcba9876543210"));
+
+    auto now = std::chrono::system_clock::now();
+    auto store = [&](const user_pubkey_t& pk, int i, auto expiry) {
+        REQUIRE(storage.store(
+                {pk, "hash" + std::to_string(i), namespace_id::Default, now, expiry, "data"}));
+    };
+    auto hashes = [&](std::string last_hash, std::optional<size_t> max = std::nullopt) {
+        std::vector<std::string> result;
+        for (auto& m : storage.retrieve(pubkey, namespace_id::Default, last_hash, max).first)
+            result.push_back(m.hash);
+        return result;
+    };
+    using V = std::vector<std::string>;
+
+    for (int i = 0; i < 3; i++)
+        store(pubkey, i, now + 1h);
+
+    // The first poll has to go to the database, and fills the cache:
+    CHECK(hashes("") == V{"hash0", "hash1", "hash2"});
+    auto stats = storage.get_retrieve_cache_stats();
+    CHECK(stats.hits == 0);
+    CHECK(stats.misses == 1);
+    CHECK(stats.fills == 1);
+    CHECK(stats.accounts == 1);
+
+    // Polls from any of the cached messages are answered from memory:
+    CHECK(hashes("hash2").empty());
+    CHECK(hashes("hash0") == V{"hash1", "hash2"});
+    CHECK(hashes("nosuchhash") == V{"hash0", "hash1", "hash2"});
+    CHECK(storage.get_retrieve_cache_stats().hits == 3);
+
+    // New messages are written through to the cache, pushing the oldest ones out:
+    store(pubkey, 3, now + 1h);
+    store(pubkey, 4, now + 1h);
+    CHECK(hashes("hash2") == V{"hash3", "hash4"});
+    CHECK(hashes("hash0") == V{"hash1", "hash2", "hash3", "hash4"});
+    CHECK(storage.get_retrieve_cache_stats().hits == 5);
+    // ... at which point we no longer know everything the namespace has
+    CHECK(hashes("nosuchhash").size() == 5);
+    CHECK(storage.get_retrieve_cache_stats().misses == 2);
+
+    // Limits apply to cached answers too:
+    auto [limited, more] = storage.retrieve(pubkey, namespace_id::Default, "hash0", 2);
+    CHECK(limited.size() == 2);
+    CHECK(more);
+
+    // Deletions drop the account from the cache:
+    CHECK(storage.delete_by_hash(pubkey, {"hash4"}) == V{"hash4"});
+    stats = storage.get_retrieve_cache_stats();
+    CHECK(stats.invalidations == 1);
+    CHECK(stats.accounts == 0);
+    CHECK(hashes("hash3").empty());
+    CHECK(storage.get_retrieve_cache_stats().misses == 3);
+    CHECK(hashes("hash3").empty());
+    CHECK(storage.get_retrieve_cache_stats().hits == 7);
+
+    // ... as do expiry updates, but only when they change something:
+    CHECK(storage.update_expiry(pubkey, {"nosuchhash"}, now + 2h).empty());
+    CHECK(storage.get_retrieve_cache_stats().invalidations == 1);
+    CHECK(storage.update_expiry(pubkey, {"hash3"}, now + 2h) == V{"hash3"});
+    CHECK(storage.get_retrieve_cache_stats().invalidations == 2);
+
+    // Expired messages don't get served from the cache, nor used as a starting point:
+    CHECK(hashes("hash3").empty());
+    store(pubkey, 5, now - 1s);
+    CHECK(hashes("hash3").empty());
+    auto misses = storage.get_retrieve_cache_stats().misses;
+    CHECK(hashes("hash5").empty());
+    CHECK(storage.get_retrieve_cache_stats().misses == misses + 1);
+
+    // Polls of accounts without any messages get cached as well, and then see new messages:
+    CHECK(storage.retrieve(other, namespace_id::Default, "").first.empty());
+    auto token = storage.account_token(other);
+    CHECK(storage.account_token(other) == token);
+    store(other, 100, now + 1h);
+    // ... which also changes the account's token
+    CHECK(storage.account_token(other) != token);
+    stats = storage.get_retrieve_cache_stats();
+    auto msgs = storage.retrieve(other, namespace_id::Default, "").first;
+    REQUIRE(msgs.size() == 1);
+    CHECK(msgs[0].hash == "hash100");
+    CHECK(storage.get_retrieve_cache_stats().hits == stats.hits + 1);
+}
+
+TEST_CASE("storage - owner id cache", "[storage]") {
+    StorageDeleter fixture;
+
+    Database storage{"."};
+
+    user_pubkey_t pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    auto now = std::chrono::system_clock::now();
+    auto store = [&](std::string hash, auto expiry) {
+        return storage.store({pubkey, std::move(hash), namespace_id::Default, now, expiry, "x"});
+    };
+
+    REQUIRE(store("hash1", now + 1h) == true);
+    REQUIRE(store("hash2", now + 1h) == true);
+    CHECK(store("hash2", now + 1h) == false);
+    CHECK(storage.get_expiries(pubkey, {"hash1", "hash2"}).size() == 2);
+
+    // Deleting the last message removes the owner row (via the autoclean trigger); the cached
+    // owner id has to go with it, or the next store would reference a missing owner.
+    CHECK(storage.delete_all(pubkey).size() == 2);
+    CHECK(storage.get_owner_count() == 0);
+    CHECK(store("hash3", now + 1h) == true);
+    CHECK(storage.get_owner_count() == 1);
+    CHECK(storage.retrieve(pubkey, namespace_id::Default, "").first.size() == 1);
+
+    // Likewise when the owner's messages expire:
+    CHECK(storage.update_all_expiries(pubkey, now - 1s).size() == 1);
+    storage.clean_expired();
+    CHECK(storage.get_owner_count() == 0);
+    CHECK(storage.update_expiry(pubkey, {"hash3"}, now + 1h).empty());
+    CHECK(store("hash4", now + 1h) == true);
+    CHECK(storage.update_expiry(pubkey, {"hash4"}, now + 2h) == std::vector{"hash4"s});
+    CHECK(storage.delete_by_hash(pubkey, {"hash4", "nosuchhash"}) == std::vector{"hash4"s});
+    CHECK(storage.get_message_count() == 0);
+
+    // A rolled back bulk store doesn't leave behind any owner ids that might get reused
+    CHECK_THROWS(storage.bulk_store([&](const message_sink& sink) {
+        sink(pubkey, message_view{"hash5", namespace_id::Default, now, now + 1h, "x"});
+        throw std::runtime_error{"oops"};
+    }));
+    CHECK(storage.get_owner_count() == 0);
+    CHECK(store("hash6", now + 1h) == true);
+    CHECK(storage.retrieve(pubkey, namespace_id::Default, "").first.size() == 1);
+}
+
+TEST_CASE("storage - hash filter", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    auto now = std::chrono::system_clock::now();
+    auto msg = [&](std::string hash, auto expiry) {
+        return message{pubkey, std::move(hash), namespace_id::Default, now, expiry, "x"};
+    };
+    using V = std::vector<std::string>;
+
+    {
+        Database storage{"."};
+        REQUIRE(storage.store(msg("hash1", now + 1h)));
+        REQUIRE(storage.store(msg("hash2", now + 1h)));
+        storage.bulk_store(std::vector{msg("hash3", now + 1h), msg("hash4", now - 1s)});
+
+        auto before = storage.get_hash_filter_stats();
+        CHECK(before.entries == 4);
+
+        // Hashes we never had get skipped without reaching the database
+        CHECK(storage.delete_by_hash(pubkey, {"nope1", "nope2"}).empty());
+        CHECK(storage.update_expiry(pubkey, {"nope3"}, now + 2h).empty());
+        CHECK(storage.get_expiries(pubkey, {"nope4"}).empty());
+        auto stats = storage.get_hash_filter_stats();
+        CHECK(stats.lookups - before.lookups == 4);
+        // (These could, with a ~1-in-40 chance each, be false positives)
+        CHECK(stats.skipped + stats.false_positives - before.skipped - before.false_positives ==
+              4);
+
+        // Mixed in with ones we do have they still get found
+        CHECK(storage.get_expiries(pubkey, {"nope1", "hash1", "hash2"}).size() == 2);
+        CHECK(storage.update_expiry(pubkey, {"hash2", "nope2"}, now + 2h) == V{"hash2"});
+        CHECK(storage.delete_by_hash(pubkey, {"hash1", "nope3"}) == V{"hash1"});
+        CHECK(storage.get_hash_filter_stats().entries == 3);
+
+        // Deleted and expired hashes leave the filter; re-stored ones get back in
+        storage.clean_expired();
+        CHECK(storage.get_message_count() == 2);
+        CHECK(storage.get_hash_filter_stats().entries == 2);
+        REQUIRE(storage.store(msg("hash1", now + 1h)));
+        CHECK(storage.get_expiries(pubkey, {"hash1", "hash4"}).size() == 1);
+
+        // A rolled back bulk store leaves its hashes in the filter (until it next gets rebuilt),
+        // but they are then just false positives.  (Enough of them that some actually get inserted
+        // before the rollback, rather than just buffered).
+        const auto rolled_back = static_cast<int64_t>(Database::BULK_STORE_ROWS);
+        CHECK_THROWS(storage.bulk_store([&](const message_sink& sink) {
+            sink(pubkey, message_view{"hash5", namespace_id::Default, now, now + 1h, "x"});
+            for (int i = 1; i < rolled_back; i++) {
+                auto hash = "rolledback" + std::to_string(i);
+                sink(pubkey, message_view{hash, namespace_id::Default, now, now + 1h, "x"});
+            }
+            throw std::runtime_error{"oops"};
+        }));
+        CHECK(storage.get_expiries(pubkey, {"hash5"}).empty());
+        REQUIRE(storage.store(msg("hash5", now + 1h)));
+        CHECK(storage.get_expiries(pubkey, {"hash5"}).size() == 1);
+
+        CHECK(storage.delete_all(pubkey).size() == 4);
+        CHECK(storage.get_hash_filter_stats().entries == rolled_back);
+        CHECK(storage.delete_by_hash(pubkey, {"hash1"}).empty());
+        REQUIRE(storage.store(msg("hash6", now + 1h)));
+    }
+
+    // The filter gets built from what's in the database on startup
+    Database storage{"."};
+    auto stats = storage.get_hash_filter_stats();
+    CHECK(stats.entries == 1);
+    CHECK(stats.capacity >= static_cast<int64_t>(HashFilter::MIN_CAPACITY));
+    CHECK(storage.delete_by_hash(pubkey, {"hash6"}) == V{"hash6"});
+}
+
+TEST_CASE("storage - cold payload segments", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+
+    auto now = std::chrono::system_clock::now();
+    const std::string big(3000, 'a'), medium(1000, 'b'), small = "c";
+    auto msg = [&](std::string hash, std::string data) {
+        return message{pubkey, std::move(hash), namespace_id::Default, now, now + 1h, data};
+    };
+    auto data_of = [](const std::vector<message>& msgs) {
+        std::vector<std::string> data;
+        for (auto& m : msgs)
+            data.push_back(m.data);
+        return data;
+    };
+
+    {
+        Database storage{".", 1, 1000};
+        CHECK(storage.store(msg("hash1", big)) == true);
+        CHECK(storage.store(msg("hash2", small)) == true);
+        CHECK(storage.store(msg("hash1", big)) == false);
+        storage.bulk_store(std::vector{msg("hash3", medium), msg("hash2", small)});
+
+        auto stats = storage.get_segment_stats();
+        CHECK(stats.segments == 1);
+        CHECK(stats.appended == 2);
+        CHECK(stats.bytes == 4000);
+        CHECK(std::filesystem::exists("storage.db-segments"));
+
+        CHECK(data_of(storage.retrieve(pubkey, namespace_id::Default, "").first) ==
+              std::vector{big, small, medium});
+        CHECK(data_of(storage.retrieve(pubkey, namespace_id::Default, "hash1").first) ==
+              std::vector{small, medium});
+        auto m = storage.retrieve_by_hash("hash3");
+        REQUIRE(m);
+        CHECK(m->data == medium);
+        CHECK(storage.retrieve_payload("hash1") == big);
+        CHECK(storage.retrieve_payload("hash2") == small);
+        CHECK_FALSE(storage.retrieve_payload("hash4"));
+        CHECK(data_of(storage.retrieve_all()) == std::vector{big, small, medium});
+    }
+
+    // Payloads already in segments remain readable without a threshold.  The segment from before
+    // is now sealed, so once most of it has expired its remaining payload gets moved and the
+    // segment removed.
+    {
+        Database storage{"."};
+        CHECK(storage.get_segment_stats().segments == 1);
+        CHECK(data_of(storage.retrieve(pubkey, namespace_id::Default, "").first) ==
+              std::vector{big, small, medium});
+
+        CHECK(storage.update_expiry(pubkey, {"hash1"}, now - 1s, false, true) ==
+              std::vector{"hash1"s});
+        storage.clean_expired();
+        auto stats = storage.get_segment_stats();
+        CHECK(stats.removed == 1);
+        CHECK(stats.segments == 1);
+        CHECK(stats.bytes == 1000);
+        CHECK(data_of(storage.retrieve(pubkey, namespace_id::Default, "").first) ==
+              std::vector{small, medium});
+    }
+
+    // Once nothing refers to a sealed segment it just gets removed
+    {
+        Database storage{"."};
+        CHECK(storage.delete_by_hash(pubkey, {"hash3"}) == std::vector{"hash3"s});
+        storage.clean_expired();
+        auto stats = storage.get_segment_stats();
+        CHECK(stats.removed == 1);
+        CHECK(stats.segments == 0);
+        CHECK(data_of(storage.retrieve(pubkey, namespace_id::Default, "").first) ==
+              std::vector{small});
+    }
+}
+
+TEST_CASE("storage - ingest journal", "[storage]") {
+    StorageDeleter fixture;
+
+    user_pubkey_t pubkey;
+    REQUIRE(pubkey.load("050123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"));
+    auto now = std::chrono::time_point_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now());
+    auto msg = [&](int i) {
+        auto n = std::to_string(i);
+        return message{pubkey, "hash" + n, namespace_id::Default, now, now + 1h, "data" + n};
+    };
+
+    db_tuning tuning;
+    tuning.ingest_journal = true;
+    {
+        Database storage{".", 1, 0, false, tuning};
+        for (int i = 0; i < 3; i++)
+            CHECK(storage.store(msg(i)));
+        CHECK_FALSE(storage.store(msg(1)));
+        CHECK(storage.get_io_stats().journaled == 3);
+
+        // Journaled messages are visible whether or not they have made it into the database yet
+        auto found = storage.retrieve_by_hash("hash2");
+        REQUIRE(found);
+        CHECK(found->data == "data2");
+        CHECK(storage.retrieve_payload("hash0") == "data0");
+        CHECK(storage.retrieve(pubkey, namespace_id::Default, "").first.size() == 3);
+        CHECK(storage.delete_by_hash(pubkey, {"hash1"}) == std::vector{"hash1"s});
+        CHECK(storage.get_io_stats().journal_waiting == 0);
+        // The account's token changes as soon as the store is acknowledged
+        auto token = storage.account_token(pubkey);
+        CHECK(storage.store(msg(3)));
+        CHECK(storage.account_token(pubkey) != token);
+
+        // ... including to each of the accounts of a retrieve_multi
+        user_pubkey_t other;
+        REQUIRE(other.load("05ffffffffffffffff000000000000000000000000000000000000000000000000"));
+        CHECK(storage.store({other, "other0", namespace_id::Default, now, now + 1h, "x"}));
+        using Q = Database::retrieve_query;
+        auto multi = storage.retrieve_multi({Q{pubkey}, Q{other}});
+        REQUIRE(multi.size() == 2);
+        CHECK(multi[0].messages.size() == 3);
+        REQUIRE(multi[1].messages.size() == 1);
+        CHECK(multi[1].messages[0].hash == "other0");
+    }
+    // Shutting down writes everything into the database and empties the journal
+    CHECK(std::filesystem::file_size("storage.db-ingest") == 0);
+    {
+        Database storage{"."};
+        CHECK(storage.get_message_count() == 4);
+        CHECK_FALSE(std::filesystem::exists("storage.db-ingest"));
+    }
+
+    // A journal left behind by a crash (here with a torn record at the end, and from a different
+    // shard configuration) gets replayed at startup
+    {
+        IngestJournal journal{"storage-1-of-2.db-ingest"};
+        journal.sync(journal.append(msg(4)));
+        journal.sync(journal.append(msg(5)));
+    }
+    {
+        std::ofstream out{"storage-1-of-2.db-ingest", std::ios::binary | std::ios::app};
+        out << "\x20\0\0\0torn"sv;
+    }
+    {
+        Database storage{"."};
+        CHECK(storage.get_message_count() == 6);
+        CHECK(storage.retrieve_payload("hash5") == "data5");
+        CHECK_FALSE(storage.retrieve_by_hash("hash1"));
+        CHECK_FALSE(std::filesystem::exists("storage-1-of-2.db-ingest"));
+    }
+}
@@ -1,5 +1,8 @@
 #include <catch2/catch.hpp>
+#include <algorithm>
 #include <iostream>
+#include <limits>
+#include <random>
 
 #include <oxenss/crypto/keys.h>
 #include <oxenss/rpc/request_handler.h>
@@ -7,6 +10,7 @@
 #include <oxenss/utils/time.hpp>
 
 #include <oxenc/base64.h>
+#include <oxenc/endian.h>
 
 using namespace std::literals;
 
@@ -150,3 +154,251 @@ TEST_CASE("service nodes - pubkey to swarm id") {
     REQUIRE(pk.load("05000000000000000000000000000000000000000000000000fffffffffffffffe"));
     CHECK(get_swarm_by_pk(swarms, pk)->swarm_id == 0);
 }
+
+TEST_CASE("swarm - lookup table matches get_swarm_by_pk", "[swarm]") {
+    using oxen::snode::SwarmInfo;
+    using oxen::snode::SwarmLookup;
+
+    auto check_all = [](const std::vector<SwarmInfo>& swarms, const std::vector<uint64_t>& vals) {
+        SwarmLookup lookup{swarms};
+        std::string raw(33, '\x05');
+        oxen::user_pubkey_t pk;
+        for (auto v : vals) {
+            // Put the value into the last 8 bytes so that the swarm space value is exactly `v`
+            oxenc::write_host_as_big(v, raw.data() + 25);
+            REQUIRE(pk.load(raw));
+            REQUIRE(oxen::snode::pubkey_to_swarm_space(pk) == v);
+            auto i = lookup.find(v);
+            REQUIRE(i >= 0);
+            INFO("swarm space value " << v);
+            CHECK(swarms[i].swarm_id == get_swarm_by_pk(swarms, pk)->swarm_id);
+            auto ranges = lookup.ranges(i);
+            CHECK(std::any_of(ranges.begin(), ranges.end(), [v](auto& r) {
+                return r.first <= v && v <= r.second;
+            }));
+        }
+
+        // The per-swarm ranges must exactly partition the swarm space, agreeing with find():
+        std::vector<std::pair<uint64_t, uint64_t>> all;
+        for (size_t i = 0; i < swarms.size(); i++) {
+            auto ranges = lookup.ranges(i);
+            CHECK(ranges.size() <= 2);
+            for (auto [lo, hi] : ranges) {
+                CHECK(lookup.find(lo) == static_cast<int64_t>(i));
+                CHECK(lookup.find(hi) == static_cast<int64_t>(i));
+                all.emplace_back(lo, hi);
+            }
+        }
+        std::sort(all.begin(), all.end());
+        REQUIRE_FALSE(all.empty());
+        CHECK(all.front().first == 0);
+        CHECK(all.back().second == std::numeric_limits<uint64_t>::max());
+        for (size_t j = 1; j < all.size(); j++)
+            CHECK(all[j].first == all[j - 1].second + 1);
+    };
+
+    CHECK(SwarmLookup{}.find(123) == -1);
+    CHECK(SwarmLookup{std::vector<SwarmInfo>{}}.find(123) == -1);
+
+    std::mt19937_64 rng{42};
+    std::vector<uint64_t> vals{0, 1, 2, 0x28, 0x29, (uint64_t)-2, (uint64_t)-1, 1ULL << 63};
+    for (int i = 0; i < 1000; i++)
+        vals.push_back(rng());
+
+    std::vector<SwarmInfo> swarms{{1000, {}}};
+    check_all(swarms, vals);
+
+    // Small swarm ids with the wraparound midpoint overflowing to the top end, and the ties
+    // tested above:
+    swarms = {{100, {}}, {200, {}}, {300, {}}, {399, {}}, {498, {}}, {596, {}}, {694, {}}};
+    for (auto& s : swarms)
+        for (int d : {-2, -1, 0, 1, 2})
+            vals.push_back(s.swarm_id + d);
+    check_all(swarms, vals);
+    // Wraparound midpoint landing at the bottom end:
+    swarms.push_back({(uint64_t)-20, {}});
+    check_all(swarms, vals);
+    swarms.insert(swarms.begin(), {0, {}});
+    check_all(swarms, vals);
+
+    // Random swarms, including values on and around each swarm id and each midpoint
+    for (int trial = 0; trial < 10; trial++) {
+        swarms.clear();
+        std::vector<uint64_t> trial_vals = vals;
+        size_t n = 2 + rng() % 500;
+        for (size_t i = 0; i < n; i++)
+            swarms.push_back({rng(), {}});
+        std::sort(swarms.begin(), swarms.end());
+        for (size_t i = 0; i < n; i++) {
+            uint64_t a = swarms[i].swarm_id, b = swarms[(i + 1) % n].swarm_id;
+            uint64_t mid = a + (b - a) / 2;
+            for (int d : {-1, 0, 1}) {
+                trial_vals.push_back(a + d);
+                trial_vals.push_back(mid + d);
+            }
+        }
+        check_all(swarms, trial_vals);
+    }
+}
+
+TEST_CASE("swarm - unchanged node lists are detected", "[swarm]") {
+    using namespace oxen::snode;
+
+    auto node = [](unsigned char i, std::string ip = "10.0.0.1") {
+        sn_record sn{std::move(ip), 22021, 22020};
+        sn.pubkey_legacy[0] = i;
+        sn.pubkey_ed25519[0] = i;
+        sn.pubkey_x25519[0] = i;
+        return sn;
+    };
+    const std::vector<SwarmInfo> swarms{{100, {node(1), node(2)}}, {200, {node(3), node(4)}}};
+    const std::vector<sn_record> decommissioned{node(5)};
+
+    Swarm swarm{node(1)};
+    auto apply = [&](std::vector<SwarmInfo> s, const std::vector<sn_record>& d, bool active) {
+        auto events = swarm.derive_swarm_events(s);
+        swarm.set_swarm_id(events.our_swarm_id);
+        swarm.update_state(std::move(s), d, events, active);
+    };
+
+    CHECK_FALSE(swarm.is_current(swarms, decommissioned));
+    apply(swarms, decommissioned, false);
+    // Not applied as an active update, so applying it again would still change things
+    CHECK_FALSE(swarm.is_current(swarms, decommissioned));
+    apply(swarms, decommissioned, true);
+    CHECK(swarm.is_current(swarms, decommissioned));
+    REQUIRE(swarm.other_nodes().size() == 1);
+    CHECK(swarm.other_nodes()[0].pubkey_legacy == node(2).pubkey_legacy);
+    CHECK(swarm.find_node(node(5).pubkey_x25519));
+
+    // A node without ip info gets its old one preserved, so that's not a change either
+    auto changed = swarms;
+    changed[1].snodes[0] = node(3, "0.0.0.0");
+    changed[1].snodes[0].port = changed[1].snodes[0].omq_port = 0;
+    CHECK(swarm.is_current(changed, decommissioned));
+
+    changed = swarms;
+    changed[1].snodes[0] = node(3, "10.0.0.2");
+    CHECK_FALSE(swarm.is_current(changed, decommissioned));
+    CHECK_FALSE(swarm.is_current(swarms, {}));
+    CHECK_FALSE(swarm.is_current(swarms, {node(6)}));
+    auto moved = swarms;
+    moved[0].snodes.push_back(node(5));
+    CHECK_FALSE(swarm.is_current(moved, {}));
+    CHECK_FALSE(swarm.is_current({swarms[0]}, decommissioned));
+
+    // Applying changes gets picked up by the node indices and lookup
+    apply(changed, {node(6)}, true);
+    CHECK(swarm.is_current(changed, {node(6)}));
+    CHECK(swarm.find_node(node(3).pubkey_ed25519)->ip == "10.0.0.2");
+    CHECK_FALSE(swarm.find_node(node(5).pubkey_legacy));
+    CHECK(swarm.find_node(node(6).pubkey_legacy));
+    oxen::user_pubkey_t pk;
+    REQUIRE(pk.load("05" + std::string(64, '0')));
+    CHECK(swarm.find_swarm(pk)->swarm_id == 100);
+    apply({swarms[1]}, {}, true);
+    CHECK(swarm.find_swarm(pk)->swarm_id == 200);
+}
+
+TEST_CASE("swarm - snapshots", "[swarm]") {
+    using namespace oxen::snode;
+
+    auto node = [](unsigned char i, std::string ip = "10.0.0.1") {
+        sn_record sn{std::move(ip), 22021, uint16_t(22020 + i)};
+        sn.pubkey_legacy[0] = i;
+        sn.pubkey_ed25519[1] = i;
+        sn.pubkey_x25519[2] = i;
+        return sn;
+    };
+    block_update bu;
+    bu.swarms = {{100, {node(1), node(2)}}, {200, {node(3), node(4, "10.0.0.44")}}};
+    bu.decommissioned_nodes = {node(5)};
+    bu.height = 1234567;
+    bu.block_hash = std::string(64, 'a');
+    bu.hardfork = 19;
+    bu.snode_revision = 3;
+    auto taken = std::chrono::system_clock::now();
+
+    auto data = serialize_swarm_snapshot(bu, taken);
+    auto [loaded, loaded_taken] = parse_swarm_snapshot(data);
+    CHECK(std::chrono::duration_cast<std::chrono::seconds>(taken - loaded_taken).count() == 0);
+    CHECK(loaded.height == bu.height);
+    CHECK(loaded.block_hash == bu.block_hash);
+    CHECK(loaded.hardfork == 19);
+    CHECK(loaded.snode_revision == 3);
+    REQUIRE(loaded.swarms.size() == 2);
+    CHECK(loaded.swarms[1].swarm_id == 200);
+    REQUIRE(loaded.swarms[1].snodes.size() == 2);
+    auto& sn = loaded.swarms[1].snodes[1];
+    CHECK(sn.pubkey_legacy == node(4).pubkey_legacy);
+    CHECK(sn.pubkey_ed25519 == node(4).pubkey_ed25519);
+    CHECK(sn.pubkey_x25519 == node(4).pubkey_x25519);
+    CHECK(sn.ip == "10.0.0.44");
+    CHECK(sn.port == 22021);
+    CHECK(sn.omq_port == 22024);
+    REQUIRE(loaded.decommissioned_nodes.size() == 1);
+    CHECK(loaded.decommissioned_nodes[0].pubkey_legacy == node(5).pubkey_legacy);
+    // Rebuilt from the swarms (i.e. not including decommissioned nodes):
+    CHECK(loaded.active_x25519_pubkeys.size() == 4);
+    CHECK(loaded.active_x25519_pubkeys.count(std::string{node(3).pubkey_x25519.view()}));
+
+    CHECK_THROWS(parse_swarm_snapshot(data.substr(0, data.size() - 1)));
+    CHECK_THROWS(parse_swarm_snapshot(data + "x"));
+    CHECK_THROWS(parse_swarm_snapshot("SWS2" + data.substr(4)));
+}
+
+TEST_CASE("swarm - funded node lookups", "[swarm]") {
+    using namespace oxen::snode;
+
+    std::mt19937_64 rng{123};
+    auto random_key = [&](auto& key) {
+        for (auto& c : key)
+            c = rng();
+    };
+    std::vector<sn_record> nodes(1000);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        auto& sn = nodes[i];
+        sn.ip = "10.0." + std::to_string(i / 256) + "." + std::to_string(i % 256);
+        sn.port = 1000 + i;
+        random_key(sn.pubkey_legacy);
+        random_key(sn.pubkey_ed25519);
+        random_key(sn.pubkey_x25519);
+        // Force some hash collisions: the hash is the first 8 bytes
+        if (i % 10 == 1) {
+            std::copy(nodes[i - 1].pubkey_legacy.begin(),
+                      nodes[i - 1].pubkey_legacy.begin() + 8,
+                      sn.pubkey_legacy.begin());
+            std::copy(nodes[i - 1].pubkey_x25519.begin(),
+                      nodes[i - 1].pubkey_x25519.begin() + 8,
+                      sn.pubkey_x25519.begin());
+        }
+    }
+    std::vector<SwarmInfo> swarms{{100, {nodes.begin(), nodes.begin() + 600}}};
+    std::vector<sn_record> decommissioned{nodes.begin() + 600, nodes.end()};
+    // A duplicate record is ignored in favour of the first one
+    auto dupe = nodes[5];
+    dupe.ip = "1.2.3.4";
+    decommissioned.push_back(dupe);
+
+    Swarm swarm{nodes[0]};
+    auto events = swarm.derive_swarm_events(swarms);
+    swarm.set_swarm_id(events.our_swarm_id);
+    swarm.update_state(std::move(swarms), decommissioned, events, true);
+
+    CHECK(swarm.all_funded_nodes().size() == nodes.size());
+    for (auto& sn : nodes) {
+        auto a = swarm.find_node(sn.pubkey_legacy);
+        auto b = swarm.find_node(sn.pubkey_ed25519);
+        auto c = swarm.find_node(sn.pubkey_x25519);
+        REQUIRE(a);
+        REQUIRE(b);
+        REQUIRE(c);
+        CHECK(a->ip == sn.ip);
+        CHECK(b->port == sn.port);
+        CHECK(c->pubkey_legacy == sn.pubkey_legacy);
+    }
+    oxen::crypto::legacy_pubkey unknown;
+    random_key(unknown);
+    CHECK_FALSE(swarm.find_node(unknown));
+    CHECK_FALSE(Swarm{nodes[0]}.find_node(nodes[0].pubkey_legacy));
+}
@@ -0,0 +1,145 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/server/tls_sessions.h>
+
+extern "C" {
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+}
+
+#include <memory>
+
+using namespace oxen;
+
+namespace {
+
+// Generates a throwaway self-signed cert into the given server context
+void add_self_signed_cert(SSL_CTX* ctx) {
+    EVP_PKEY* pkey = EVP_PKEY_new();
+    EVP_PKEY_CTX* kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_ED25519, nullptr);
+    REQUIRE(EVP_PKEY_keygen_init(kctx) == 1);
+    REQUIRE(EVP_PKEY_keygen(kctx, &pkey) == 1);
+    EVP_PKEY_CTX_free(kctx);
+
+    X509* x509 = X509_new();
+    ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+    X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+    X509_gmtime_adj(X509_getm_notAfter(x509), 3600);
+    X509_set_pubkey(x509, pkey);
+    X509_set_issuer_name(x509, X509_get_subject_name(x509));
+    REQUIRE(X509_sign(x509, pkey, nullptr) > 0);
+
+    REQUIRE(SSL_CTX_use_certificate(ctx, x509) == 1);
+    REQUIRE(SSL_CTX_use_PrivateKey(ctx, pkey) == 1);
+    X509_free(x509);
+    EVP_PKEY_free(pkey);
+}
+
+// Runs a complete handshake (plus a bit of application data, so that TLS 1.3 tickets get
+// delivered) between a fresh client and server over an in-memory BIO pair.  Returns the client's
+// session (for resumption) and whether the handshake resumed `resume`.
+std::pair<SSL_SESSION*, bool> handshake(SSL_CTX* server, SSL_CTX* client, SSL_SESSION* resume) {
+    SSL* s = SSL_new(server);
+    SSL* c = SSL_new(client);
+    BIO *sbio, *cbio;
+    REQUIRE(BIO_new_bio_pair(&sbio, 0, &cbio, 0) == 1);
+    SSL_set_bio(s, sbio, sbio);
+    SSL_set_bio(c, cbio, cbio);
+    SSL_set_accept_state(s);
+    SSL_set_connect_state(c);
+    if (resume)
+        SSL_set_session(c, resume);
+
+    char buf[16];
+    bool sent = false, got = false;
+    for (int i = 0; i < 100 && !got; i++) {
+        if (!sent && SSL_write(c, "ping", 4) == 4)
+            sent = true;
+        if (SSL_read(s, buf, sizeof(buf)) == 4)
+            SSL_write(s, "pong", 4);
+        got = SSL_read(c, buf, sizeof(buf)) == 4;
+    }
+    REQUIRE(got);
+
+    bool reused = SSL_session_reused(c);
+    SSL_SESSION* sess = SSL_get1_session(c);
+    // A connection freed without a clean shutdown marks its session as not resumable
+    SSL_shutdown(c);
+    SSL_shutdown(s);
+    SSL_free(s);
+    SSL_free(c);
+    return {sess, reused};
+}
+
+struct ctx_deleter {
+    void operator()(SSL_CTX* c) const { SSL_CTX_free(c); }
+};
+using ctx_ptr = std::unique_ptr<SSL_CTX, ctx_deleter>;
+
+}  // namespace
+
+TEST_CASE("TLS session resumption", "[tls]") {
+    ctx_ptr client{SSL_CTX_new(TLS_client_method())};
+    SSL_CTX_set_session_cache_mode(client.get(), SSL_SESS_CACHE_CLIENT);
+
+    // Two servers standing in for two HTTPS event loops
+    ctx_ptr server1{SSL_CTX_new(TLS_server_method())}, server2{SSL_CTX_new(TLS_server_method())};
+    add_self_signed_cert(server1.get());
+    add_self_signed_cert(server2.get());
+    server::tls_session_config conf;
+    server::configure_tls_sessions(server1.get(), conf);
+    server::configure_tls_sessions(server2.get(), conf);
+
+    for (int tls_ver : {TLS1_2_VERSION, TLS1_3_VERSION}) {
+        INFO("TLS version " << std::hex << tls_ver);
+        SSL_CTX_set_min_proto_version(client.get(), tls_ver);
+        SSL_CTX_set_max_proto_version(client.get(), tls_ver);
+
+        auto before = server::get_tls_handshake_stats();
+        auto [sess, reused] = handshake(server1.get(), client.get(), nullptr);
+        CHECK_FALSE(reused);
+        auto [sess2, reused2] = handshake(server1.get(), client.get(), sess);
+        CHECK(reused2);
+        // The ticket keys are shared, so a ticket from one context works on another
+        auto [sess3, reused3] = handshake(server2.get(), client.get(), sess2);
+        CHECK(reused3);
+
+        auto after = server::get_tls_handshake_stats();
+        CHECK(after.full - before.full == 1);
+        CHECK(after.resumed - before.resumed == 2);
+        SSL_SESSION_free(sess);
+        SSL_SESSION_free(sess2);
+        SSL_SESSION_free(sess3);
+    }
+}
+
+TEST_CASE("TLS session resumption from the server-side cache", "[tls]") {
+    ctx_ptr client{SSL_CTX_new(TLS_client_method())};
+    SSL_CTX_set_session_cache_mode(client.get(), SSL_SESS_CACHE_CLIENT);
+    SSL_CTX_set_max_proto_version(client.get(), TLS1_2_VERSION);
+
+    ctx_ptr server{SSL_CTX_new(TLS_server_method())};
+    add_self_signed_cert(server.get());
+    server::tls_session_config conf;
+    conf.tickets = false;
+    server::configure_tls_sessions(server.get(), conf);
+
+    auto [sess, reused] = handshake(server.get(), client.get(), nullptr);
+    CHECK_FALSE(reused);
+    auto [sess2, reused2] = handshake(server.get(), client.get(), sess);
+    CHECK(reused2);
+    SSL_SESSION_free(sess);
+    SSL_SESSION_free(sess2);
+
+    // With the cache disabled as well there is nothing to resume from
+    ctx_ptr server2{SSL_CTX_new(TLS_server_method())};
+    add_self_signed_cert(server2.get());
+    conf.cache_size = 0;
+    server::configure_tls_sessions(server2.get(), conf);
+    auto [sess3, reused3] = handshake(server2.get(), client.get(), nullptr);
+    auto [sess4, reused4] = handshake(server2.get(), client.get(), sess3);
+    CHECK_FALSE(reused4);
+    SSL_SESSION_free(sess3);
+    SSL_SESSION_free(sess4);
+}
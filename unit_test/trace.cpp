@@ -0,0 +1,72 @@
+#include <oxenss/utils/trace.hpp>
+
+#include <catch2/catch.hpp>
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+using namespace oxen;
+using namespace std::literals;
+
+TEST_CASE("trace - spans nest under the current span", "[trace]") {
+    util::Tracer tracer{{1.0}};
+    auto trace = tracer.start("retrieve");
+    REQUIRE(trace);
+    {
+        util::trace_scope scope{trace};
+        util::traced outer{"outer"};
+        REQUIRE(outer);
+        {
+            util::traced inner{"inner"};
+            inner.detail("SELECT 1");
+            inner.value("rows", 3);
+        }
+        util::async_traced wait{"peer"};
+        std::thread{[wait] { wait.finish(); }}.join();
+    }
+    // Without a current trace nothing gets recorded
+    util::traced untraced{"nothing"};
+    CHECK_FALSE(untraced);
+    tracer.finish(trace);
+
+    auto spans = trace->spans();
+    REQUIRE(spans.size() == 4);
+    CHECK(spans[0].name == "retrieve");
+    CHECK(spans[1].name == "outer");
+    CHECK(spans[1].parent == 0);
+    CHECK(spans[2].name == "inner");
+    CHECK(spans[2].parent == 1);
+    CHECK(spans[2].detail == "SELECT 1");
+    REQUIRE(spans[2].values.size() == 1);
+    CHECK(spans[2].values[0].second == 3);
+    CHECK(spans[3].name == "peer");
+    CHECK(spans[3].parent == 1);
+    CHECK(spans[0].duration >= spans[1].duration);
+
+    REQUIRE(tracer.slowest().size() == 1);
+}
+
+TEST_CASE("trace - only slow requests are kept", "[trace]") {
+    util::trace_config conf;
+    conf.slow_threshold = 5ms;
+    conf.keep = 2;
+    util::Tracer tracer{conf};
+
+    // Not sampled, so only traced because of the threshold
+    auto fast = tracer.start("fast");
+    REQUIRE(fast);
+    tracer.finish(fast);
+    CHECK(tracer.slowest().empty());
+
+    for (auto d : {6ms, 20ms, 10ms}) {
+        auto t = tracer.start(std::to_string(d.count()), std::chrono::steady_clock::now() - d);
+        tracer.finish(t);
+    }
+    auto kept = tracer.slowest();
+    REQUIRE(kept.size() == 2);
+    CHECK(kept[0]->spans()[0].name == "20");
+    CHECK(kept[1]->spans()[0].name == "10");
+
+    CHECK_FALSE(util::Tracer{}.start("off"));
+}
@@ -0,0 +1,50 @@
+#include <catch2/catch.hpp>
+
+#include <oxenss/utils/work_queue.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+
+using namespace oxen;
+using namespace std::literals;
+
+TEST_CASE("work queue - runs jobs and rejects when full", "[work_queue]") {
+    util::WorkQueue q{"test", 1, 2};
+
+    // Block the single worker so that we can fill up the queue behind it
+    std::promise<void> release;
+    std::promise<void> started;
+    auto blocker = release.get_future().share();
+    REQUIRE(q.submit([&started, blocker] {
+        started.set_value();
+        blocker.wait();
+    }));
+    started.get_future().wait();
+
+    std::atomic<int> ran = 0;
+    CHECK(q.submit([&] { ran++; }));
+    CHECK(q.submit([&] { ran++; }));
+    CHECK_FALSE(q.submit([&] { ran++; }));
+
+    auto s = q.get_stats();
+    CHECK(s.threads == 1);
+    CHECK(s.queued == 2);
+    CHECK(s.rejected == 1);
+
+    release.set_value();
+    for (int i = 0; i < 100 && q.get_stats().processed < 3; i++)
+        std::this_thread::sleep_for(10ms);
+
+    s = q.get_stats();
+    CHECK(ran == 2);
+    CHECK(s.processed == 3);
+    CHECK(s.queued == 0);
+    CHECK(s.max_queued == 2);
+    CHECK(s.wait.count == 3);
+    CHECK(s.run.count == 3);
+
+    q.stop();
+    CHECK_FALSE(q.submit([&] { ran++; }));
+}